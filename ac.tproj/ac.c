@@ -43,6 +43,7 @@ __unused static char rcsid[] = "$Id: ac.c,v 1.2 2006/02/07 05:51:22 lindak Exp $
 
 #include <sys/types.h>
 #include <sys/file.h>
+#include <sys/queue.h>
 #include <sys/time.h>
 #include <err.h>
 #include <errno.h>
@@ -50,28 +51,36 @@ __unused static char rcsid[] = "$Id: ac.c,v 1.2 2006/02/07 05:51:22 lindak Exp $
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <utmpx.h>
 #include <unistd.h>
 
 #define UT_NAMESIZE 8 /* from utmp.h; only for formatting */
 
 /*
- * this is for our list of currently logged in sessions
+ * this is for our list of currently logged in sessions, newest first.
+ * each session is also on the hash chain for its tty, in the same order,
+ * so a logout only looks at the sessions on that tty.
  */
 struct utmp_list {
-	struct utmp_list *next;
+	LIST_ENTRY(utmp_list) link;
+	LIST_ENTRY(utmp_list) hlink;
 	struct utmpx usr;
 };
 
 /*
- * this is for our list of users that are accumulating time.
+ * this is for our list of users that are accumulating time, newest
+ * first; hnext chains the users in the same hash bucket.
  */
 struct user_list {
 	struct user_list *next;
+	struct user_list *hnext;
 	char	name[_UTX_USERSIZE+1];
 	time_t	secs;
 };
 
+#define	AC_HASHSIZE	1024			/* buckets, power of 2 */
+
 /*
  * this is for chosing whether to ignore a login
  */
@@ -91,7 +100,15 @@ static char	*Console = CONSOLE_TTY;
 static time_t	Total = 0;
 static time_t	FirstTime = 0;
 static int	Flags = 0;
+static time_t	Start = 0;			/* -S, 0 if unbounded */
+static time_t	End = 0;			/* -E, 0 if unbounded */
+static int	Started = 0;			/* reached Start yet */
+static struct utmpx *Window = NULL;		/* -S records, newest first */
+static size_t	WindowCount = 0;
 static struct user_list *Users = NULL;
+static struct user_list *UserHash[AC_HASHSIZE];
+static LIST_HEAD(, utmp_list) Logins = LIST_HEAD_INITIALIZER(Logins);
+static LIST_HEAD(, utmp_list) LineHash[AC_HASHSIZE];
 static struct tty_list *Ttys = NULL;
 
 #define NEW(type) (type *)malloc(sizeof (type))
@@ -109,17 +126,82 @@ static int Debug = 0;
 int			main __P((int, char **));
 int			ac __P((void));
 struct tty_list		*add_tty __P((char *));
+int			day_of __P((time_t, time_t *));
 int			do_tty __P((char *));
-struct utmp_list	*log_in __P((struct utmp_list *, struct utmpx *));
-struct utmp_list	*log_out __P((struct utmp_list *, struct utmpx *));
-int			on_console __P((struct utmp_list *));
+unsigned int		hash_name __P((const char *, size_t));
+void			load_window __P((void));
+struct utmpx		*next_record __P((void));
+time_t			parse_time __P((const char *));
+void			start_window __P((void));
+void			log_in __P((struct utmpx *));
+void			log_out __P((struct utmpx *));
+int			on_console __P((void));
 void			show __P((char *, time_t));
-void			show_today __P((struct user_list *, struct utmp_list *,
-			    time_t));
+void			show_today __P((time_t));
 void			show_users __P((struct user_list *));
-struct user_list	*update_user __P((struct user_list *, char *, time_t));
+void			update_user __P((char *, time_t));
 void			usage __P((void));
 
+/*
+ * hash at most len bytes of name, stopping at a NUL like strncmp
+ */
+unsigned int
+hash_name(const char *name, size_t len)
+{
+	unsigned int h = 2166136261U;
+
+	while (len-- > 0 && *name != '\0')
+		h = (h ^ (unsigned char)*name++) * 16777619U;
+	return h & (AC_HASHSIZE - 1);
+}
+
+/*
+ * day of the year of t, as localtime() would give it.  the bounds of
+ * the last day looked up are cached so that localtime() is only called
+ * about once per day of records; on a miss *midnight is set to the start
+ * of the day the way the daily totals have always computed it.
+ */
+int
+day_of(time_t t, time_t *midnight)
+{
+	static time_t lo = 1, hi = 0;
+	static int yday;
+	struct tm *ltm, tm;
+
+	if (t >= lo && t < hi)
+		return yday;
+
+	ltm = localtime(&t);
+	tm = *ltm;
+	yday = tm.tm_yday;
+	if (midnight != NULL)
+		*midnight = t - tm.tm_sec - 60 * tm.tm_min - 3600 * tm.tm_hour;
+
+	/*
+	 * only trust bounds that really fall on this day; anything odd
+	 * around a DST change just narrows the cached range
+	 */
+	tm.tm_sec = tm.tm_min = tm.tm_hour = 0;
+	tm.tm_isdst = -1;
+	lo = mktime(&tm);
+	if (lo == -1 || lo > t || localtime(&lo)->tm_yday != yday)
+		lo = t;
+	tm = *localtime(&t);
+	tm.tm_sec = tm.tm_min = tm.tm_hour = 0;
+	tm.tm_mday++;
+	tm.tm_isdst = -1;
+	hi = mktime(&tm);
+	if (hi == -1 || hi <= t) {
+		hi = t + 1;
+	} else {
+		time_t last = hi - 1;
+
+		if (localtime(&last)->tm_yday != yday)
+			hi = t + 1;
+	}
+	return yday;
+}
+
 struct tty_list *
 add_tty(char *name)
 {
@@ -175,11 +257,12 @@ do_tty(char *name)
  * is someone logged in on Console?
  */
 int
-on_console(struct utmp_list *head)
+on_console(void)
 {
 	struct utmp_list *up;
 
-	for (up = head; up; up = up->next) {
+	LIST_FOREACH(up, &LineHash[hash_name(Console,
+	    sizeof (up->usr.ut_line))], hlink) {
 		if (strncmp(up->usr.ut_line, Console,
 		    sizeof (up->usr.ut_line)) == 0)
 			return 1;
@@ -191,32 +274,36 @@ on_console(struct utmp_list *head)
 /*
  * update user's login time
  */
-struct user_list *
-update_user(struct user_list *head, char *name, time_t secs)
+void
+update_user(char *name, time_t secs)
 {
 	struct user_list *up;
+	unsigned int h;
 
-	for (up = head; up != NULL; up = up->next) {
+	h = hash_name(name, sizeof (up->name) - 1);
+	for (up = UserHash[h]; up != NULL; up = up->hnext) {
 		if (strncmp(up->name, name, sizeof (up->name)) == 0) {
 			up->secs += secs;
 			Total += secs;
-			return head;
+			return;
 		}
 	}
 	/*
 	 * not found so add new user unless specified users only
 	 */
 	if (Flags & AC_U)
-		return head;
+		return;
 
 	if ((up = NEW(struct user_list)) == NULL)
 		err(1, "malloc");
-	up->next = head;
+	up->next = Users;
+	Users = up;
+	up->hnext = UserHash[h];
+	UserHash[h] = up;
 	(void)strncpy(up->name, name, sizeof (up->name) - 1);
 	up->name[sizeof (up->name) - 1] = '\0';	/* paranoid! */
 	up->secs = secs;
 	Total += secs;
-	return up;
 }
 
 int
@@ -226,8 +313,14 @@ main(int argc, char **argv)
 	int c;
 
 	fp = NULL;
-	while ((c = getopt(argc, argv, "Dc:dpt:w:")) != EOF) {
+	while ((c = getopt(argc, argv, "DE:S:c:dpt:w:")) != EOF) {
 		switch (c) {
+		case 'E':
+			End = parse_time(optarg);
+			break;
+		case 'S':
+			Start = parse_time(optarg);
+			break;
 #ifdef DEBUG
 		case 'D':
 			Debug++;
@@ -263,12 +356,14 @@ main(int argc, char **argv)
 		 * initialize user list
 		 */
 		for (; optind < argc; optind++) {
-			Users = update_user(Users, argv[optind], 0L);
+			update_user(argv[optind], 0L);
 		}
 		Flags |= AC_U;			/* freeze user list */
 	}
 	if (Flags & AC_D)
 		Flags &= ~AC_P;
+	if (Start && End && End < Start)
+		errx(1, "end time is before start time");
 	ac();
 
 	return 0;
@@ -297,9 +392,9 @@ show_users(struct user_list *list)
  * print total login time for 24hr period in decimal hours
  */
 void
-show_today(struct user_list *users, struct utmp_list *logins, time_t secs)
+show_today(time_t secs)
 {
-	struct user_list *up;
+	struct user_list *up, *users = Users;
 	struct utmp_list *lp;
 	char date[64];
 	time_t yesterday = secs - 1;
@@ -310,9 +405,9 @@ show_today(struct user_list *users, struct utmp_list *logins, time_t secs)
 	/* restore the missing second */
 	yesterday++;
 
-	for (lp = logins; lp != NULL; lp = lp->next) {
+	LIST_FOREACH(lp, &Logins, link) {
 		secs = yesterday - lp->usr.ut_tv.tv_sec;
-		Users = update_user(Users, lp->usr.ut_user, secs);
+		update_user(lp->usr.ut_user, secs);
 		lp->usr.ut_tv.tv_sec = yesterday;	/* as if they just logged in */
 	}
 	secs = 0;
@@ -320,7 +415,8 @@ show_today(struct user_list *users, struct utmp_list *logins, time_t secs)
 		secs += up->secs;
 		up->secs = 0;			/* for next day */
 	}
-	if (secs)
+	/* days before -S are only replayed to find who was logged in */
+	if (secs && (!Start || Started))
 		(void)printf("%s %11.2f\n", date, ((double)secs / 3600));
 }
 
@@ -329,17 +425,25 @@ show_today(struct user_list *users, struct utmp_list *logins, time_t secs)
  * if ut_line is "~", we log all users out as the system has
  * been shut down.
  */
-struct utmp_list *
-log_out(struct utmp_list *head, struct utmpx *up)
+void
+log_out(struct utmpx *up)
 {
-	struct utmp_list *lp, *lp2, *tlp;
+	struct utmp_list *lp, *tlp;
 	time_t secs;
+	int all;
 
-	for (lp = head, lp2 = NULL; lp != NULL; )
-		if (up->ut_type == BOOT_TIME || up->ut_type == SHUTDOWN_TIME || strncmp(lp->usr.ut_line, up->ut_line,
+	/*
+	 * the tty's hash chain holds its sessions in the same order as
+	 * Logins, so users are charged in the same order either way
+	 */
+	all = up->ut_type == BOOT_TIME || up->ut_type == SHUTDOWN_TIME;
+	lp = all ? LIST_FIRST(&Logins) :
+	    LIST_FIRST(&LineHash[hash_name(up->ut_line, sizeof (up->ut_line))]);
+	while (lp != NULL)
+		if (all || strncmp(lp->usr.ut_line, up->ut_line,
 		    sizeof (up->ut_line)) == 0) {
 			secs = up->ut_tv.tv_sec - lp->usr.ut_tv.tv_sec;
-			Users = update_user(Users, lp->usr.ut_user, secs);
+			update_user(lp->usr.ut_user, secs);
 #ifdef DEBUG
 			if (Debug)
 				printf("%-.*s %-.*s: %-.*s logged out (%2d:%02d:%02d)\n",
@@ -352,25 +456,20 @@ log_out(struct utmp_list *head, struct utmpx *up)
 			 * now lose it
 			 */
 			tlp = lp;
-			lp = lp->next;
-			if (tlp == head)
-				head = lp;
-			else if (lp2 != NULL)
-				lp2->next = lp;
+			lp = all ? LIST_NEXT(lp, link) : LIST_NEXT(lp, hlink);
+			LIST_REMOVE(tlp, link);
+			LIST_REMOVE(tlp, hlink);
 			free(tlp);
-		} else {
-			lp2 = lp;
-			lp = lp->next;
-		}
-	return head;
+		} else
+			lp = LIST_NEXT(lp, hlink);
 }
 
 
 /*
  * if do_tty says ok, login a user
  */
-struct utmp_list *
-log_in(struct utmp_list *head, struct utmpx *up)
+void
+log_in(struct utmpx *up)
 {
 	struct utmp_list *lp;
 
@@ -391,8 +490,8 @@ log_in(struct utmp_list *head, struct utmpx *up)
 		 * SunOS 4.0.2 does not treat ":0.0" as special but we
 		 * do.
 		 */
-		if (on_console(head))
-			return head;
+		if (on_console())
+			return;
 		/*
 		 * ok, no recorded login, so they were here when wtmp
 		 * started!  Adjust ut_tv.tv_sec!
@@ -411,16 +510,17 @@ log_in(struct utmp_list *head, struct utmpx *up)
 	 */
 	if (Flags & AC_T)
 		if (!do_tty(up->ut_line))
-			return head;
+			return;
 
 	/*
 	 * go ahead and log them in
 	 */
 	if ((lp = NEW(struct utmp_list)) == NULL)
 		err(1, "malloc");
-	lp->next = head;
-	head = lp;
 	memmove((char *)&lp->usr, (char *)up, sizeof (struct utmpx));
+	LIST_INSERT_HEAD(&Logins, lp, link);
+	LIST_INSERT_HEAD(&LineHash[hash_name(lp->usr.ut_line,
+	    sizeof (lp->usr.ut_line))], lp, hlink);
 #ifdef DEBUG
 	if (Debug) {
 		printf("%-.*s %-.*s: %-.*s logged in", 19,
@@ -431,37 +531,142 @@ log_in(struct utmp_list *head, struct utmpx *up)
 		putchar('\n');
 	}
 #endif
-	return head;
+}
+
+/*
+ * parse a -S or -E time: seconds since the epoch, or a local
+ * YYYY-MM-DD with an optional HH:MM[:SS]
+ */
+time_t
+parse_time(const char *arg)
+{
+	static const char *formats[] = {
+		"%Y-%m-%d %H:%M:%S", "%Y-%m-%dT%H:%M:%S",
+		"%Y-%m-%d %H:%M", "%Y-%m-%dT%H:%M", "%Y-%m-%d", NULL
+	};
+	const char **fmt, *ep;
+	struct tm tm;
+	char *end;
+	long long secs;
+	time_t t;
+
+	secs = strtoll(arg, &end, 10);
+	if (*arg != '\0' && *end == '\0' && secs > 0)
+		return (time_t)secs;
+	for (fmt = formats; *fmt != NULL; fmt++) {
+		bzero(&tm, sizeof(tm));
+		ep = strptime(arg, *fmt, &tm);
+		if (ep != NULL && *ep == '\0') {
+			tm.tm_isdst = -1;
+			if ((t = mktime(&tm)) != -1 && t > 0)
+				return t;
+		}
+	}
+	errx(1, "invalid time: %s", arg);
+}
+
+/*
+ * with -S, read the records backwards from the end, which only touches
+ * the records we need; we have to go back to the last boot or shutdown
+ * before Start, as any login since then may still be open at Start.
+ */
+void
+load_window(void)
+{
+	struct utmpx *u;
+	size_t size = 0;
+
+	setutxent_wtmp(0); /* read in reverse direction */
+	while ((u = getutxent_wtmp()) != NULL) {
+		if (WindowCount == size) {
+			size = size ? size * 2 : 1024;
+			Window = reallocf(Window, size * sizeof(*Window));
+			if (Window == NULL)
+				err(1, "malloc");
+		}
+		Window[WindowCount++] = *u;
+		if (u->ut_tv.tv_sec < Start &&
+		    (u->ut_type == BOOT_TIME || u->ut_type == SHUTDOWN_TIME))
+			break;
+	}
+	endutxent_wtmp();
+}
+
+/*
+ * the next record in time order
+ */
+struct utmpx *
+next_record(void)
+{
+	if (Start)
+		return WindowCount > 0 ? &Window[--WindowCount] : NULL;
+	return getutxent_wtmp();
+}
+
+/*
+ * Start has been reached: forget the time accumulated before it, and
+ * charge anyone still logged in from Start on.
+ */
+void
+start_window(void)
+{
+	struct user_list *up, *next;
+	struct utmp_list *lp;
+	int i;
+
+	Started = 1;
+	LIST_FOREACH(lp, &Logins, link)
+		if (lp->usr.ut_tv.tv_sec < Start)
+			lp->usr.ut_tv.tv_sec = Start;
+	Total = 0;
+	if (Flags & AC_U) {
+		for (up = Users; up != NULL; up = up->next)
+			up->secs = 0;
+		return;
+	}
+	for (up = Users; up != NULL; up = next) {
+		next = up->next;
+		free(up);
+	}
+	Users = NULL;
+	for (i = 0; i < AC_HASHSIZE; i++)
+		UserHash[i] = NULL;
 }
 
 int
 ac(void)
 {
-	struct utmp_list *lp, *head = NULL;
+	struct utmp_list *lp;
 	struct utmpx *u, end;
-	struct tm *ltm;
-	time_t secs = 0;
-	int day = -1;
-
-	setutxent_wtmp(1); /* read in forward direction */
-	while ((u = getutxent_wtmp()) != NULL) {
+	time_t midnight = 0, secs = 0, now;
+	int day = -1, yday;
+
+	if (Start)
+		load_window();
+	else
+		setutxent_wtmp(1); /* read in forward direction */
+	while ((u = next_record()) != NULL) {
+		if (End && u->ut_tv.tv_sec > End)
+			break;
 		if (!FirstTime)
 			FirstTime = u->ut_tv.tv_sec;
 		if (Flags & AC_D) {
-			ltm = localtime(&u->ut_tv.tv_sec);
-			if (day >= 0 && day != ltm->tm_yday) {
-				day = ltm->tm_yday;
+			yday = day_of(u->ut_tv.tv_sec, &midnight);
+			if (day >= 0 && day != yday) {
+				day = yday;
 				/*
-				 * print yesterday's total
+				 * print yesterday's total; a new day is
+				 * always a cache miss, so midnight is set
 				 */
-				secs = u->ut_tv.tv_sec;
-				secs -= ltm->tm_sec;
-				secs -= 60 * ltm->tm_min;
-				secs -= 3600 * ltm->tm_hour;
-				show_today(Users, head, secs);
+				secs = midnight;
+				if (Start && !Started && secs > Start)
+					start_window();
+				show_today(secs);
 			} else
-				day = ltm->tm_yday;
+				day = yday;
 		}
+		if (Start && !Started && u->ut_tv.tv_sec >= Start)
+			start_window();
 		switch(u->ut_type) {
 		case OLD_TIME:
 			secs = u->ut_tv.tv_sec;
@@ -471,12 +676,12 @@ ac(void)
 			/*
 			 * adjust time for those logged in
 			 */
-			for (lp = head; lp != NULL; lp = lp->next)
+			LIST_FOREACH(lp, &Logins, link)
 				lp->usr.ut_tv.tv_sec -= secs;
 			break;
 		case BOOT_TIME:			/* reboot or shutdown */
 		case SHUTDOWN_TIME:
-			head = log_out(head, u);
+			log_out(u);
 			FirstTime = u->ut_tv.tv_sec; /* shouldn't be needed */
 			break;
 		case USER_PROCESS:
@@ -487,38 +692,42 @@ ac(void)
 			if (strncmp(u->ut_line, "tty", 3) != 0 ||
 			    strchr("pqrstuvwxy", u->ut_line[3]) == 0 ||
 			    *u->ut_host != '\0')
-				head = log_in(head, u);
+				log_in(u);
 			break;
 		case DEAD_PROCESS:
-			head = log_out(head, u);
+			log_out(u);
 			break;
 		}
 	}
-	endutxent_wtmp();
+	if (Start) {
+		free(Window);
+		if (!Started)
+			start_window();
+	} else
+		endutxent_wtmp();
+	now = time((time_t *)0);
+	if (End && End < now)
+		now = End;
 	bzero(&end, sizeof(end));
-	end.ut_tv.tv_sec = time((time_t *)0);
+	end.ut_tv.tv_sec = now;
 	end.ut_type = SHUTDOWN_TIME;
 
 	if (Flags & AC_D) {
-		ltm = localtime(&end.ut_tv.tv_sec);
-		if (day >= 0 && day != ltm->tm_yday) {
+		yday = day_of(end.ut_tv.tv_sec, &midnight);
+		if (day >= 0 && day != yday) {
 			/*
 			 * print yesterday's total
 			 */
-			secs = end.ut_tv.tv_sec;
-			secs -= ltm->tm_sec;
-			secs -= 60 * ltm->tm_min;
-			secs -= 3600 * ltm->tm_hour;
-			show_today(Users, head, secs);
+			show_today(midnight);
 		}
 	}
 	/*
-	 * anyone still logged in gets time up to now
+	 * anyone still logged in gets time up to now, or to End
 	 */
-	head = log_out(head, &end);
+	log_out(&end);
 
 	if (Flags & AC_D)
-		show_today(Users, head, time((time_t *)0));
+		show_today(now);
 	else {
 		if (Flags & AC_P)
 			show_users(Users);
@@ -532,9 +741,9 @@ usage(void)
 {
 	(void)fprintf(stderr,
 #ifdef CONSOLE_TTY
-	    "ac [-dp] [-c console] [-t tty] [-w wtmp] [users ...]\n");
+	    "ac [-dp] [-c console] [-E end] [-S start] [-t tty] [-w wtmp] [users ...]\n");
 #else
-	    "ac [-dp] [-t tty] [-w wtmp] [users ...]\n");
+	    "ac [-dp] [-E end] [-S start] [-t tty] [-w wtmp] [users ...]\n");
 #endif
 	exit(1);
 }
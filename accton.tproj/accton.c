@@ -42,21 +42,48 @@ static char sccsid[] = "@(#)accton.c	8.1 (Berkeley) 6/6/93";
 __FBSDID("$FreeBSD: src/usr.sbin/accton/accton.c,v 1.8 2004/08/07 04:19:37 imp Exp $");
 
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <compression.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+/*
+ * Compressed accounting archive, read back by sa(8) (keep in sync with
+ * sa.tproj/main.c): ACZ_MAGIC, then blocks of two host-order uint32_t,
+ * the raw and stored sizes, followed by the stored bytes. A block is
+ * LZFSE unless both sizes are equal, in which case it is stored as is.
+ */
+#define	ACZ_MAGIC	"ACZ1"
+#define	ACZ_SUFFIX	".acz"
+#define	ACZ_BLOCK_SIZE	(1024 * 1024)
+
+static int compress_archive(const char *, const char *);
+static void rotate(const char *, int);
 static void usage(void);
 
 int
 main(int argc, char *argv[])
 {
-	int ch;
+	int ch, keep = 7, rflag = 0;
+	char *ep;
 
-	while ((ch = getopt(argc, argv, "")) != -1)
+	while ((ch = getopt(argc, argv, "k:r")) != -1)
 		switch(ch) {
+		case 'k':
+			keep = (int)strtol(optarg, &ep, 10);
+			if (*ep != '\0' || keep < 1 || keep > 999)
+				errx(1, "invalid archive count: %s", optarg);
+			break;
+		case 'r':
+			rflag = 1;
+			break;
 		case '?':
 		default:
 			usage();
@@ -64,6 +91,13 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
+	if (rflag) {
+		if (argc != 1)
+			usage();
+		rotate(*argv, keep);
+		exit(0);
+	}
+
 	switch(argc) {
 	case 0:
 		if (acct(NULL))
@@ -79,9 +113,142 @@ main(int argc, char *argv[])
 	exit(0);
 }
 
+/*
+ * Start a new, empty acctfile and turn the old one into the compressed
+ * archive acctfile.0.acz, shifting older archives up and keeping at most
+ * keep of them.
+ */
+static void
+rotate(const char *file, int keep)
+{
+	char from[PATH_MAX], to[PATH_MAX], tmp[PATH_MAX];
+	struct stat sb;
+	int fd, i;
+
+	if (stat(file, &sb) == -1)
+		err(1, "%s", file);
+
+	for (i = keep - 1; i > 0; i--) {
+		(void)snprintf(from, sizeof(from), "%s.%d%s", file, i - 1, ACZ_SUFFIX);
+		(void)snprintf(to, sizeof(to), "%s.%d%s", file, i, ACZ_SUFFIX);
+		if (rename(from, to) == -1 && errno != ENOENT)
+			err(1, "rename %s to %s", from, to);
+	}
+
+	/*
+	 * the kernel keeps writing to the renamed file until acct(2)
+	 * switches it to the new one, so no records are lost
+	 */
+	(void)snprintf(tmp, sizeof(tmp), "%s.0", file);
+	if (rename(file, tmp) == -1)
+		err(1, "rename %s to %s", file, tmp);
+	if ((fd = open(file, O_WRONLY | O_CREAT | O_EXCL, sb.st_mode & ALLPERMS)) == -1)
+		err(1, "%s", file);
+	if (fchown(fd, sb.st_uid, sb.st_gid) == -1 ||
+	    fchmod(fd, sb.st_mode & ALLPERMS) == -1)
+		warn("%s", file);
+	(void)close(fd);
+	if (acct(file))
+		err(1, "%s", file);
+
+	(void)snprintf(to, sizeof(to), "%s.0%s", file, ACZ_SUFFIX);
+	if (compress_archive(tmp, to) == -1)
+		exit(1);
+	if (unlink(tmp) == -1)
+		err(1, "%s", tmp);
+}
+
+/* Write the compressed archive to, then atomically rename it into place. */
+static int
+compress_archive(const char *from, const char *to)
+{
+	char part[PATH_MAX];
+	uint8_t *raw, *packed;
+	uint32_t sizes[2];
+	struct stat sb;
+	size_t have, packed_size;
+	ssize_t n;
+	int in, out, error = 0;
+
+	(void)snprintf(part, sizeof(part), "%s.tmp", to);
+	if ((in = open(from, O_RDONLY)) == -1 || fstat(in, &sb) == -1) {
+		warn("%s", from);
+		return (-1);
+	}
+	if ((out = open(part, O_WRONLY | O_CREAT | O_TRUNC, sb.st_mode & ALLPERMS)) == -1) {
+		warn("%s", part);
+		(void)close(in);
+		return (-1);
+	}
+	raw = malloc(ACZ_BLOCK_SIZE);
+	packed = malloc(ACZ_BLOCK_SIZE);
+	if (raw == NULL || packed == NULL) {
+		warn(NULL);
+		error = -1;
+		goto out;
+	}
+
+	if (write(out, ACZ_MAGIC, strlen(ACZ_MAGIC)) != (ssize_t)strlen(ACZ_MAGIC)) {
+		warn("%s", part);
+		error = -1;
+		goto out;
+	}
+	do {
+		/* fill a whole block so block boundaries don't depend on read sizes */
+		for (have = 0; have < ACZ_BLOCK_SIZE; have += n) {
+			n = read(in, raw + have, ACZ_BLOCK_SIZE - have);
+			if (n == -1) {
+				warn("%s", from);
+				error = -1;
+				goto out;
+			}
+			if (n == 0)
+				break;
+		}
+		if (have == 0)
+			break;
+
+		packed_size = compression_encode_buffer(packed, ACZ_BLOCK_SIZE,
+		    raw, have, NULL, COMPRESSION_LZFSE);
+		sizes[0] = (uint32_t)have;
+		if (packed_size == 0 || packed_size >= have) {
+			sizes[1] = (uint32_t)have;
+			memcpy(packed, raw, have);
+		} else
+			sizes[1] = (uint32_t)packed_size;
+		if (write(out, sizes, sizeof(sizes)) != sizeof(sizes) ||
+		    write(out, packed, sizes[1]) != (ssize_t)sizes[1]) {
+			warn("%s", part);
+			error = -1;
+			goto out;
+		}
+	} while (have == ACZ_BLOCK_SIZE);
+
+	if (fsync(out) == -1) {
+		warn("%s", part);
+		error = -1;
+	}
+out:
+	free(raw);
+	free(packed);
+	(void)close(in);
+	if (close(out) == -1 && error == 0) {
+		warn("%s", part);
+		error = -1;
+	}
+	if (error == 0 && rename(part, to) == -1) {
+		warn("rename %s to %s", part, to);
+		error = -1;
+	}
+	if (error)
+		(void)unlink(part);
+	return (error);
+}
+
 static void
 usage(void)
 {
-	(void)fprintf(stderr, "usage: accton [file]\n");
+	(void)fprintf(stderr, "usage: accton [file]\n"
+	    "       accton -r [-k count] file\n");
 	exit(1);
 }
@@ -32,13 +32,16 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/param.h>
+#include <sys/time.h>
 #include <paths.h>
 #include <err.h>
 #include <mach/mach.h>
+#include <mach/mach_time.h>
 #include <mach-o/arch.h>
 #include <limits.h>
 #include <sys/fcntl.h>
 #include <glob.h>
+#include <libproc.h>
 #include <CoreFoundation/CoreFoundation.h>
 #include <NSSystemDirectories.h>
 #include <sysdir.h>
@@ -168,6 +171,35 @@ isSupportedCPU(cpu_type_t cpu)
 bool unrecognizednative32seen = false;
 bool unrecognizednative64seen = false;
 
+/* -t: report how long it took to get to the spawn */
+static bool timing = false;
+static uint64_t mainstart;
+
+/*
+ * reportTiming - print the time from the creation of this process to main(),
+ * and from main() to the spawn of the command, in microseconds.
+ */
+static void
+reportTiming(void)
+{
+    mach_timebase_info_data_t tb;
+    struct proc_bsdinfo pbi;
+    struct timeval now;
+    uint64_t setup, total;
+
+    mach_timebase_info(&tb);
+    setup = (mach_absolute_time() - mainstart) * tb.numer / tb.denom / 1000;
+    gettimeofday(&now, NULL);
+    if(proc_pidinfo(getpid(), PROC_PIDTBSDINFO, 0, &pbi, sizeof(pbi)) != sizeof(pbi)) {
+        fprintf(stderr, "%s: setup %llu us\n", ARCH_PROG, setup);
+        return;
+    }
+    total = (uint64_t)(now.tv_sec - pbi.pbi_start_tvsec) * 1000000 +
+        now.tv_usec - pbi.pbi_start_tvusec;
+    fprintf(stderr, "%s: launch %llu us, setup %llu us\n", ARCH_PROG,
+        total > setup ? total - setup : 0, setup);
+}
+
 /*
  * arch - perform the original behavior of the arch and machine commands.
  * The archcmd flag is non-zero for the arch command, zero for the machine
@@ -239,6 +271,8 @@ spawnIt(CPU *cpu, int pflag, const char *str, char **argv)
 
     if(copied != count)
         errx(1, "posix_spawnattr_setbinpref_np only copied %lu of %lu", copied, count);
+    if(timing)
+        reportTiming();
     if(pflag)
         ret = posix_spawnp(&pid, str, NULL, &attr, argv, envCopy ? envCopy : environ);
     else
@@ -577,30 +611,33 @@ usage(int ret)
     fprintf(stderr,
             "Usage: %s\n"
             "       Display the machine's architecture type\n"
-            "Usage: %s {-arch_name | -arch arch_name} ... [-c] [-d envname] ... [-e envname=value] ... [-h] prog [arg ...]\n"
+            "Usage: %s {-arch_name | -arch arch_name} ... [-c] [-d envname] ... [-e envname=value] ... [-h] [-t] prog [arg ...]\n"
             "       Run prog with any arguments, using the given architecture\n"
             "       order.  If no architectures are specified, use the\n"
             "       ARCHPREFERENCE environment variable, or a property list file.\n"
             "       -c will clear out all environment variables before running prog.\n"
             "       -d will delete the given environment variable before running prog.\n"
             "       -e will add the given environment variable/value before running prog.\n"
-            "       -h will print usage message and exit.\n",
+            "       -h will print usage message and exit.\n"
+            "       -t will print the time taken to start prog.\n",
             ARCH_PROG, ARCH_PROG);
     exit(ret);
 }
 
 /*
- * wrapped - check the path to see if it is a link to /usr/bin/arch.
+ * wrapped - check the path to see if it is a link to /usr/bin/arch.  The
+ * path that was found is returned in execpath, so the caller can spawn it
+ * without searching PATH a second time.
  */
 static int
-wrapped(const char *name)
+wrapped(const char *name, char *execpath, size_t size)
 {
     size_t lp, ln;
     char *p;
     char *bp = NULL;
     char *cur, *path;
-    char buf[MAXPATHLEN], rpbuf[MAXPATHLEN];
-    struct stat sb;
+    char buf[MAXPATHLEN];
+    struct stat sb, archsb;
 
     ln = strlen(name);
 
@@ -654,9 +691,15 @@ wrapped(const char *name)
         if(p == NULL)
             errx(1, "Can't find %s in PATH", name);
     } while(0); /* end block */
-    if(realpath(bp, rpbuf) == NULL)
-        errx(1, "realpath failed on %s", bp);
-    return (strcmp(rpbuf, "/usr/bin/" ARCH_PROG) == 0);
+    if(strlcpy(execpath, bp, size) >= size)
+        errx(1, "%s: path too long", bp);
+    /*
+     * stat() followed any links, so compare the file itself rather than
+     * resolving the whole path with realpath().
+     */
+    if(stat("/usr/bin/" ARCH_PROG, &archsb) != 0)
+        return 0;
+    return (sb.st_dev == archsb.st_dev && sb.st_ino == archsb.st_ino);
 }
 
 /*
@@ -744,6 +787,9 @@ spawnFromArgs(CPU *cpu, char **argv)
             continue;
         } else if(MATCHARG(argv, "-h")) {
             usage(0);
+        } else if(MATCHARG(argv, "-t")) {
+            timing = true;
+            continue;
         } else {
             ap = *argv + 1;
             if(*ap == '-') ap++;
@@ -757,7 +803,8 @@ spawnFromArgs(CPU *cpu, char **argv)
         usage(1);
     }
     /* if the program is already a link to arch, then force execpath */
-    int needexecpath = wrapped(*argv);
+    char execpath[MAXPATHLEN];
+    int needexecpath = wrapped(*argv, execpath, sizeof(execpath));
 
     /*
      * If we don't have any architecutures, try ARCHPREFERENCE and plist
@@ -767,9 +814,11 @@ spawnFromArgs(CPU *cpu, char **argv)
         spawnFromPreferences(cpu, needexecpath, argv); /* doesn't return */
 
     /*
-     * Call posix_spawnp on the program name.
+     * The architectures came from the command line, so there is no need to
+     * read any preferences.  Call posix_spawnp on the path wrapped() already
+     * found (it still runs scripts without an interpreter line through sh).
      */
-    spawnIt(cpu, 1, *argv, argv);
+    spawnIt(cpu, 1, execpath, argv);
 }
 
 
@@ -781,6 +830,8 @@ main(int argc, char **argv)
     int my_name_is_arch;
     CPU cpu;
 
+    mainstart = mach_absolute_time();
+
     if(strcmp(prog, MACHINE_PROG) == 0) {
         if(argc > 1)
             errx(-1, "no arguments accepted");
@@ -45,7 +45,6 @@ __FBSDID("$FreeBSD: /usr/local/www/cvsroot/FreeBSD/src/usr.bin/at/at.c,v 1.34 20
 #ifndef __FreeBSD__
 #include <getopt.h>
 #endif
-#include <glob.h>
 #ifdef __FreeBSD__
 #include <locale.h>
 #endif
@@ -96,6 +95,25 @@ __FBSDID("$FreeBSD: /usr/local/www/cvsroot/FreeBSD/src/usr.bin/at/at.c,v 1.34 20
 
 enum { ATQ, ATRM, AT, BATCH, CAT };	/* what program we want to run */
 
+/* A job number asked for on the command line, and where it was asked for
+ */
+struct job_req {
+    long jobno;
+    int order;
+};
+
+/* A job found in the spool, kept until they can be listed in order
+ */
+struct atjob {
+    char *name;
+    uid_t uid;
+    mode_t mode;
+    char queue;
+    long jobno;
+    time_t runtimer;
+    int order;
+};
+
 /* File scope variables */
 
 static const char *no_export[] = {
@@ -124,7 +142,7 @@ static void writefile(time_t runtimer, char queue);
 static void list_jobs(long *, int);
 static long nextjob(void);
 static time_t ttime(const char *arg);
-static int in_job_list(long, long *, int);
+static int in_job_list(long, struct job_req *, int);
 static long *get_job_list(int, char *[], int *);
 
 /* Signal catching functions */
@@ -478,27 +496,72 @@ writefile(time_t runtimer, char queue)
 }
 
 static int
-in_job_list(long job, long *joblist, int len)
+job_req_cmp(const void *a, const void *b)
 {
-    int i;
+    const struct job_req *x = a, *y = b;
+
+    if (x->jobno != y->jobno)
+	return (x->jobno < y->jobno) ? -1 : 1;
+    return x->order - y->order;
+}
 
-    for (i = 0; i < len; i++)
-	if (job == joblist[i])
-	    return 1;
+static int
+in_job_list(long job, struct job_req *reqs, int len)
+{
+    /* reqs is sorted by job number and holds each job once; return the
+     * position the job was given in on the command line, or -1.
+     */
+    int lo = 0, hi = len, mid;
+
+    while (lo < hi) {
+	mid = lo + (hi - lo) / 2;
+	if (reqs[mid].jobno < job)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return (lo < len && reqs[lo].jobno == job) ? reqs[lo].order : -1;
+}
 
-    return 0;
+static int
+job_cmp(const void *a, const void *b)
+{
+    /* Requested jobs come out in the order they were given, as POSIX
+     * wants; otherwise by the time they will run.
+     */
+    const struct atjob *x = a, *y = b;
+
+    if (x->order != y->order)
+	return x->order - y->order;
+    if (x->runtimer != y->runtimer)
+	return (x->runtimer < y->runtimer) ? -1 : 1;
+    if (x->jobno != y->jobno)
+	return (x->jobno < y->jobno) ? -1 : 1;
+    return strcmp(x->name, y->name);
 }
 
 static void
-list_one_job(char *name, long *joblist, int len, int *first)
+list_one_job(char *name, struct job_req *reqs, int len,
+    struct atjob **jobs, int *njobs, int *size)
 {
     struct stat buf;
-    struct tm runtime;
     unsigned long ctm;
     char queue;
     long jobno;
-    time_t runtimer;
-    char timestr[TIMESIZE];
+    int order = 0;
+    struct atjob *job;
+
+    /* Weed out what the name alone rules out before going to the file
+     */
+    if(sscanf(name, "%c%5lx%8lx", &queue, &jobno, &ctm)!=3)
+	return;
+
+    /* If jobs are given, only list those jobs */
+    if (reqs && (order = in_job_list(jobno, reqs, len)) < 0)
+	return;
+
+    if (atqueue && (queue != atqueue))
+        return;
 
     if (stat(name, &buf) != 0)
 	perr("cannot stat in " ATJOB_DIR);
@@ -511,36 +574,20 @@ list_one_job(char *name, long *joblist, int len, int *first)
 	|| !(S_IXUSR & buf.st_mode || atverify))
 	return;
 
-    if(sscanf(name, "%c%5lx%8lx", &queue, &jobno, &ctm)!=3)
-	return;
-
-    /* If jobs are given, only list those jobs */
-    if (joblist && !in_job_list(jobno, joblist, len))
-	return;
-
-    if (atqueue && (queue != atqueue))
-        return;
-
-    runtimer = 60*(time_t) ctm;
-    runtime = *localtime(&runtimer);
-    strftime(timestr, TIMESIZE, "%a %b %e %T %Y", &runtime);
-    if (*first) {
-	if (!posixly_correct)
-	    printf("Date\t\t\t\tOwner\t\tQueue\tJob#\n");
-	*first=0;
-    }
-    if (posixly_correct)
-	printf("%ld\t%s\n", jobno, timestr);
-    else {
-	struct passwd *pw = getpwuid(buf.st_uid);
-
-	printf("%s\t%s\t%c%s\t%s\n",
-	       timestr,
-	       pw ? pw->pw_name : "???",
-	       queue,
-	       (S_IXUSR & buf.st_mode) ? "":"(done)",
-	       name);
+    if (*njobs == *size) {
+	*size = *size ? 2 * *size : 64;
+	if ((*jobs = realloc(*jobs, *size * sizeof(**jobs))) == NULL)
+	    panic("out of memory");
     }
+    job = &(*jobs)[(*njobs)++];
+    if ((job->name = strdup(name)) == NULL)
+	panic("out of memory");
+    job->uid = buf.st_uid;
+    job->mode = buf.st_mode;
+    job->queue = queue;
+    job->jobno = jobno;
+    job->runtimer = 60*(time_t) ctm;
+    job->order = order;
 }
 
 static void
@@ -551,45 +598,72 @@ list_jobs(long *joblist, int len)
      */
     DIR *spool;
     struct dirent *dirent;
-    int first=1;
+    struct job_req *reqs = NULL;
+    struct atjob *jobs = NULL;
+    struct passwd *pw = NULL;
+    struct tm runtime;
+    char timestr[TIMESIZE];
+    int nreqs = 0, njobs = 0, size = 0, i;
 
 #ifdef __FreeBSD__
     (void) setlocale(LC_TIME, "");
 #endif
 
+    if (joblist) {
+	if ((reqs = malloc(len * sizeof(*reqs))) == NULL)
+	    panic("out of memory");
+	for (i = 0; i < len; i++) {
+	    reqs[i].jobno = joblist[i];
+	    reqs[i].order = i;
+	}
+	qsort(reqs, len, sizeof(*reqs), job_req_cmp);
+	for (i = 0; i < len; i++)
+	    if (nreqs == 0 || reqs[i].jobno != reqs[nreqs - 1].jobno)
+		reqs[nreqs++] = reqs[i];
+    }
+
     PRIV_START
 
     if (chdir(ATJOB_DIR) != 0)
 	perr("cannot change to " ATJOB_DIR);
 
-    if (joblist) {		/* Force order to match POSIX */
-	char jobglob[32];
-	glob_t g;
-	int i;
-
-	sprintf(jobglob, "?%05lx*", joblist[0]);
-	g.gl_offs = 0;
-	glob(jobglob, GLOB_DOOFFS, NULL, &g);
-	for (i = 1; i < len; i++) {
-	    sprintf(jobglob, "?%05lx*", joblist[i]);
-	    glob(jobglob, GLOB_DOOFFS | GLOB_APPEND, NULL, &g);
-	}
-	for (i = 0; i < g.gl_pathc; i++) {
-	    list_one_job(g.gl_pathv[i], joblist, len, &first);
-	}
-	globfree(&g);
-    } else {
-	if ((spool = opendir(".")) == NULL)
-	    perr("cannot open " ATJOB_DIR);
+    if ((spool = opendir(".")) == NULL)
+	perr("cannot open " ATJOB_DIR);
 
-	/*	Loop over every file in the directory
-	 */
-	while((dirent = readdir(spool)) != NULL) {
-	   list_one_job(dirent->d_name, joblist, len, &first);
-	}
-	closedir(spool);
+    /*	Loop over every file in the directory once, then sort what's left
+     */
+    while((dirent = readdir(spool)) != NULL) {
+	list_one_job(dirent->d_name, reqs, nreqs, &jobs, &njobs, &size);
     }
+    closedir(spool);
+
     PRIV_END
+
+    qsort(jobs, njobs, sizeof(*jobs), job_cmp);
+
+    if (njobs > 0 && !posixly_correct)
+	printf("Date\t\t\t\tOwner\t\tQueue\tJob#\n");
+    for (i = 0; i < njobs; i++) {
+	runtime = *localtime(&jobs[i].runtimer);
+	strftime(timestr, TIMESIZE, "%a %b %e %T %Y", &runtime);
+	if (posixly_correct)
+	    printf("%ld\t%s\n", jobs[i].jobno, timestr);
+	else {
+	    /* Owners tend to come in runs; look each run up once */
+	    if (i == 0 || jobs[i].uid != jobs[i - 1].uid)
+		pw = getpwuid(jobs[i].uid);
+
+	    printf("%s\t%s\t%c%s\t%s\n",
+		   timestr,
+		   pw ? pw->pw_name : "???",
+		   jobs[i].queue,
+		   (S_IXUSR & jobs[i].mode) ? "":"(done)",
+		   jobs[i].name);
+	}
+	free(jobs[i].name);
+    }
+    free(jobs);
+    free(reqs);
 }
 
 static void
@@ -618,17 +692,21 @@ process_jobs(int argc, char **argv, int what)
     /*	Loop over every file in the directory
      */
     while((dirent = readdir(spool)) != NULL) {
-
-	PRIV_START
-	if (stat(dirent->d_name, &buf) != 0)
-	    perr("cannot stat in " ATJOB_DIR);
-	PRIV_END
+	int statted = 0;
 
 	if(sscanf(dirent->d_name, "%c%5lx%8lx", &queue, &jobno, &ctm)!=3)
 	    continue;
 
 	for (i=optind; i < argc; i++) {
 	    if (atoi(argv[i]) == jobno || strcmp(argv[i], dirent->d_name)==0) {
+		/* Only go to the file once its name has matched */
+		if (!statted) {
+		    PRIV_START
+		    if (stat(dirent->d_name, &buf) != 0)
+			perr("cannot stat in " ATJOB_DIR);
+		    PRIV_END
+		    statted = 1;
+		}
 		if ((buf.st_uid != real_uid) && !(real_uid == 0))
 		    errx(EXIT_FAILURE, "%s: not owner", argv[i]);
 		switch (what) {
@@ -87,9 +87,18 @@ __FBSDID("$FreeBSD: src/libexec/atrun/atrun.c,v 1.27 2009/12/25 10:30:54 ed Exp
 static const char * const atrun = "atrun"; /* service name for syslog etc. */
 static int debug = 0;
 
+/* A batch job that is due, waiting for the load to allow it to start.
+ */
+struct batch_job {
+    char name[sizeof("Z2345678901234")];
+    uid_t uid;
+    gid_t gid;
+};
+
 void perr(const char *fmt, ...);
 void perrx(const char *fmt, ...);
 static void usage(void);
+static int batch_cmp(const void *a, const void *b);
 
 /* Local functions */
 static ssize_t
@@ -456,11 +465,11 @@ main(int argc, char *argv[])
     unsigned long jobno;
     char queue;
     time_t now, run_time;
-    char batch_name[] = "Z2345678901234";
-    uid_t batch_uid;
-    gid_t batch_gid;
+    struct batch_job *batch = NULL;
+    size_t nbatch = 0, batch_size = 0, i;
+    long max_batch = 1;
+    double cpu_load = 0.;
     int c;
-    int run_batch;
     double load_avg = LOADAVG_MX, la;
 
 /* We don't need root privileges all the time; running under uid and gid daemon
@@ -472,10 +481,20 @@ main(int argc, char *argv[])
     openlog(atrun, LOG_PID, LOG_CRON);
 
     opterr = 0;
-    while((c=getopt(argc, argv, "dl:"))!= -1)
+    while((c=getopt(argc, argv, "dj:l:L:"))!= -1)
     {
 	switch (c)
 	{
+	case 'j':
+	    if (sscanf(optarg, "%ld", &max_batch) != 1 || max_batch < 1)
+		perr("garbled option -j");
+	    break;
+
+	case 'L':
+	    if (sscanf(optarg, "%lf", &cpu_load) != 1)
+		perr("garbled option -L");
+	    break;
+
 	case 'l':
 	    if (sscanf(optarg, "%lf", &load_avg) != 1)
 		perr("garbled option -l");
@@ -503,24 +522,18 @@ main(int argc, char *argv[])
      * script. Unlink older files if they should no longer be run.  For
      * deletion, their r bit has to be turned on.
      *
-     * Also, pick the oldest batch job to run, at most one per invocation of
-     * atrun.
+     * Also, pick the oldest batch jobs to run, at most max_batch per
+     * invocation of atrun.
      */
     if ((spool = opendir(".")) == NULL)
 	perr("cannot read %s", ATJOB_DIR);
 
     now = time(NULL);
-    run_batch = 0;
-    batch_uid = (uid_t) -1;
-    batch_gid = (gid_t) -1;
 
     while ((dirent = readdir(spool)) != NULL) {
-	if (stat(dirent->d_name,&buf) != 0)
-	    perr("cannot stat in %s", ATJOB_DIR);
-
 	/* We don't want directories
 	 */
-	if (!S_ISREG(buf.st_mode))
+	if (dirent->d_type != DT_UNKNOWN && dirent->d_type != DT_REG)
 	    continue;
 
 	if (sscanf(dirent->d_name,"%c%5lx%8lx",&queue,&jobno,&ctm) != 3)
@@ -528,12 +541,29 @@ main(int argc, char *argv[])
 
 	run_time = (time_t) ctm*60;
 
+	/* Jobs that aren't due yet are neither run nor deleted, so only
+	 * stat the ones whose name says they are.
+	 */
+	if (run_time > now)
+	    continue;
+
+	if (stat(dirent->d_name,&buf) != 0)
+	    perr("cannot stat in %s", ATJOB_DIR);
+
+	if (!S_ISREG(buf.st_mode))
+	    continue;
+
 	if ((S_IXUSR & buf.st_mode) && (run_time <=now)) {
-	    if ((isupper(queue) || queue == 'b') && (strcmp(batch_name,dirent->d_name) > 0)) {
-		run_batch = 1;
-		strlcpy(batch_name, dirent->d_name, sizeof(batch_name));
-		batch_uid = buf.st_uid;
-		batch_gid = buf.st_gid;
+	    if (isupper(queue)) {
+		if (nbatch == batch_size) {
+		    batch_size = batch_size ? 2 * batch_size : 16;
+		    if ((batch = reallocf(batch, batch_size * sizeof(*batch))) == NULL)
+			perr("cannot allocate memory");
+		}
+		strlcpy(batch[nbatch].name, dirent->d_name, sizeof(batch[nbatch].name));
+		batch[nbatch].uid = buf.st_uid;
+		batch[nbatch].gid = buf.st_gid;
+		nbatch++;
 	    }
 
 	/* The file is executable and old enough
@@ -546,10 +576,21 @@ main(int argc, char *argv[])
 	if ((run_time < now) && !(S_IXUSR & buf.st_mode) && (S_IRUSR & buf.st_mode))
 	    unlink(dirent->d_name);
     }
-    /* run the single batch file, if any
-    */
-    if (run_batch && (getloadavg(&la, 1) == 1) && la < load_avg)
-	run_file(batch_name, batch_uid, batch_gid);
+    /* run the oldest batch files, if any, while the load allows.  The load
+     * average won't show the jobs just started for a while yet, so count
+     * each of those as another unit of load.  With -L, the limit is per CPU.
+     */
+    if (nbatch > 0 && getloadavg(&la, 1) == 1) {
+	if (cpu_load > 0.) {
+	    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+	    load_avg = cpu_load * (ncpu > 0 ? ncpu : 1);
+	}
+	qsort(batch, nbatch, sizeof(*batch), batch_cmp);
+	for (i = 0; i < nbatch && (long)i < max_batch && la + i < load_avg; i++)
+	    run_file(batch[i].name, batch[i].uid, batch[i].gid);
+    }
+    free(batch);
 
     closelog();
 #if __APPLE__
@@ -559,13 +600,20 @@ main(int argc, char *argv[])
     exit(EXIT_SUCCESS);
 }
 
+static int
+batch_cmp(const void *a, const void *b)
+{
+    return strcmp(((const struct batch_job *)a)->name,
+	((const struct batch_job *)b)->name);
+}
+
 static void
 usage(void)
 {
     if (debug)
-	fprintf(stderr, "usage: atrun [-l load_avg] [-d]\n");
+	fprintf(stderr, "usage: atrun [-j max_batch] [-l load_avg | -L cpu_load] [-d]\n");
     else
-	syslog(LOG_ERR, "usage: atrun [-l load_avg] [-d]");
+	syslog(LOG_ERR, "usage: atrun [-j max_batch] [-l load_avg | -L cpu_load] [-d]");
 
     exit(EXIT_FAILURE);
 }
@@ -21,6 +21,10 @@
  *
  * @APPLE_LICENSE_HEADER_END@
  */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <db.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -57,49 +61,30 @@ _getline(FILE *fp)
 	return s;
 }
 
+/*
+ * The fields point into line, which is split in place.
+ */
 static struct passwd *
 parse_user(char *line)
 {
 	static struct passwd pw = {0};
-	char **tokens;
-	int i, len;
-
-	if (pw.pw_name != NULL) free(pw.pw_name);
-	pw.pw_name = NULL;
-	if (pw.pw_passwd != NULL) free(pw.pw_passwd);
-	pw.pw_passwd = NULL;
-	if (pw.pw_gecos != NULL) free(pw.pw_gecos);
-	pw.pw_gecos = NULL;
-	if (pw.pw_dir != NULL) free(pw.pw_dir);
-	pw.pw_dir = NULL;
-	if (pw.pw_shell != NULL) free(pw.pw_shell);
-	pw.pw_shell = NULL;
-
-	if (pw.pw_class != NULL) free(pw.pw_class);
-	pw.pw_class = NULL;
+	char *tokens[_PASSWD_FIELDS];
+	int i;
 
-	if (line == NULL) return (struct passwd *)NULL;
-	tokens = explode(line, ':');
-	len = listLength(tokens);
+	memset(&pw, 0, sizeof(pw));
 
-	if (len != _PASSWD_FIELDS)
-	{
-		freeList(tokens);
+	if (line == NULL) return (struct passwd *)NULL;
+	if (splitString(line, ':', tokens, _PASSWD_FIELDS) != _PASSWD_FIELDS)
 		return (struct passwd *)NULL;
-	}
 
 	i = 0;
 	pw.pw_name = tokens[i++];
 	pw.pw_passwd = tokens[i++];
-	pw.pw_uid = atoi(tokens[i]);
-	free(tokens[i++]);
-	pw.pw_gid = atoi(tokens[i]);
-	free(tokens[i++]);
+	pw.pw_uid = atoi(tokens[i++]);
+	pw.pw_gid = atoi(tokens[i++]);
 	pw.pw_class = tokens[i++];
-	pw.pw_change = atoi(tokens[i]);
-	free(tokens[i++]);
-	pw.pw_expire = atoi(tokens[i]);
-	free(tokens[i++]);
+	pw.pw_change = atoi(tokens[i++]);
+	pw.pw_expire = atoi(tokens[i++]);
 	pw.pw_gecos = tokens[i++];
 	pw.pw_dir = tokens[i++];
 	pw.pw_shell = tokens[i++];
@@ -107,6 +92,58 @@ parse_user(char *line)
 	return &pw;
 }
 
+/*
+ * Look the user's password up in the secure database built by
+ * pwd_mkdb(8), instead of reading the whole master file.  The database
+ * is only trusted if it isn't older than the file; returns NULL if it
+ * can't be used.
+ */
+static char *
+db_find_passwd(char *uname, char *fname)
+{
+	static char passwd[BUFSIZE];
+	char key_buf[BUFSIZE], *p, *end, *found;
+	struct stat fst, dst;
+	size_t len;
+	DBT key, data;
+	DB *db;
+
+	if (strcmp(fname, _PASSWD_FILE)) return NULL;
+	if (stat(fname, &fst) || stat(_PATH_SMP_DB, &dst)) return NULL;
+	if (dst.st_mtime < fst.st_mtime) return NULL;
+
+	len = strlen(uname);
+	if (len + 1 > sizeof(key_buf)) return NULL;
+	key_buf[0] = _PW_KEYBYNAME;
+	memcpy(key_buf + 1, uname, len);
+	key.data = key_buf;
+	key.size = len + 1;
+
+	db = dbopen(_PATH_SMP_DB, O_RDONLY, 0, DB_HASH, NULL);
+	if (db == NULL) return NULL;
+
+	/* the record starts with the name and password strings */
+	found = NULL;
+	if ((db->get)(db, &key, &data, 0) == 0)
+	{
+		p = data.data;
+		end = p + data.size;
+		if ((p = memchr(p, '\0', end - p)) != NULL &&
+		    !strcmp(data.data, uname))
+		{
+			p++;
+			if (memchr(p, '\0', end - p) != NULL &&
+			    strlen(p) < sizeof(passwd))
+			{
+				strcpy(passwd, p);
+				found = passwd;
+			}
+		}
+	}
+	(db->close)(db);
+	return found;
+}
+
 static struct passwd *
 find_user(char *uname, FILE *fp)
 {
@@ -250,6 +287,7 @@ file_check_passwd(char *uname, char *locn)
 	FILE *fp;
 	char *fname;
 	struct passwd *pw;
+	char *passwd;
 
 	fname = _PASSWD_FILE;
 	if (locn != NULL) fname = locn;
@@ -261,6 +299,13 @@ file_check_passwd(char *uname, char *locn)
 		exit(1);
 	}
 
+	passwd = db_find_passwd(uname, fname);
+	if (passwd != NULL)
+	{
+		fclose(fp);
+		checkpasswd(uname, passwd);
+		return 0;
+	}
 
 	pw = find_user(uname, fp);
 	if (pw == (struct passwd *)NULL)
@@ -233,6 +233,29 @@ lowerCase(char *s)
 	return t;
 }
 
+/*
+ * Split s in place at each c, like explode() but without allocating:
+ * the separators are overwritten with NULs and up to max field pointers
+ * are stored in l.  Returns the number of fields, which may exceed max.
+ */
+unsigned int
+splitString(char *s, char c, char **l, unsigned int max)
+{
+	unsigned int n;
+	char *p;
+
+	if ((s == NULL) || (s[0] == '\0')) return 0;
+
+	for (n = 0; ; n++)
+	{
+		p = strchr(s, c);
+		if (n < max) l[n] = s;
+		if (p == NULL) return n + 1;
+		*p = '\0';
+		s = p + 1;
+	}
+}
+
 char **
 explode(char *s, char c)
 {
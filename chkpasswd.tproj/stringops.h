@@ -37,3 +37,4 @@ char *presuffix(char *, char);
 char *suffix(char *, char);
 char *lowerCase(char *);
 char **explode(char *, char);
+unsigned int splitString(char *, char, char **, unsigned int);
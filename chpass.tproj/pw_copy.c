@@ -61,67 +61,114 @@
 #include <err.h>
 #include <pwd.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "pw_util.h"
 #include "pw_copy.h"
 
 extern char *tempname;
 
+#define	PW_COPY_BUFSIZE	(64 * 1024)	/* bytes per read(2) and write(2) */
+#define	PW_LINE_MAX	8192		/* longest line, with its newline */
+
+static void
+pw_write(int tfd, const char *p, size_t len)
+{
+	ssize_t n;
+
+	for (; len > 0; p += n, len -= n)
+		if ((n = write(tfd, p, len)) == -1)
+			pw_error(tempname, 1, 1);
+}
+
+static void
+pw_write_entry(int tfd, struct passwd *pw)
+{
+	if (dprintf(tfd, "%s:%s:%d:%d:%s:%ld:%ld:%s:%s:%s\n",
+	    pw->pw_name, pw->pw_passwd, pw->pw_uid, pw->pw_gid,
+	    pw->pw_class, pw->pw_change, pw->pw_expire, pw->pw_gecos,
+	    pw->pw_dir, pw->pw_shell) < 0)
+		pw_error(tempname, 1, 1);
+}
+
+/*
+ * Copy the master file to tfd with pw's entry replaced, or appended if
+ * it isn't there.  The file is moved in large blocks: lines are only
+ * looked at up to the entry being replaced, and everything after it is
+ * copied as is.
+ */
 void
 pw_copy(int ffd, int tfd, struct passwd *pw)
 {
-	FILE *from, *to;
-	int done;
-	char *p, buf[8192];
+	char *buf, *line, *end, *nl, *p;
+	size_t have = 0, namelen;
+	ssize_t n;
+	int done = 0;
 
-	if (!(from = fdopen(ffd, "r")))
-		pw_error(_PATH_MASTERPASSWD, 1, 1);
-	if (!(to = fdopen(tfd, "w")))
-		pw_error(tempname, 1, 1);
+	if ((buf = malloc(PW_COPY_BUFSIZE)) == NULL)
+		pw_error(NULL, 1, 1);
+	namelen = strlen(pw->pw_name);
 
-	for (done = 0; fgets(buf, sizeof(buf), from);) {
-		if (!strchr(buf, '\n')) {
-			warnx("%s: line too long", _PATH_MASTERPASSWD);
-			pw_error(NULL, 0, 1);
+	for (;;) {
+		if ((n = read(ffd, buf + have, PW_COPY_BUFSIZE - have)) == -1)
+			pw_error(_PATH_MASTERPASSWD, 1, 1);
+		if (n == 0)
+			break;
+		have += n;
+		if (done) {
+			pw_write(tfd, buf, have);
+			have = 0;
+			continue;
 		}
+
+		for (line = buf, end = buf + have;
+		    (nl = memchr(line, '\n', end - line)) != NULL;
+		    line = nl + 1) {
+			if (nl - line + 1 >= PW_LINE_MAX)
+				break;
 #if defined(__APPLE__)
-		if (done || (buf[0] == '#')) {
-#else
-		if (done) {
+			if (line[0] == '#')
+				continue;
 #endif
-			(void)fprintf(to, "%s", buf);
-			if (ferror(to))
-				goto err;
+			if (!(p = memchr(line, ':', nl - line))) {
+				warnx("%s: corrupted entry", _PATH_MASTERPASSWD);
+				pw_error(NULL, 0, 1);
+			}
+			if ((size_t)(p - line) == namelen &&
+			    memcmp(line, pw->pw_name, namelen) == 0) {
+				pw_write(tfd, buf, line - buf);
+				pw_write_entry(tfd, pw);
+				done = 1;
+				line = nl + 1;
+				break;
+			}
+		}
+		if (done) {
+			pw_write(tfd, line, end - line);
+			have = 0;
 			continue;
 		}
-		if (!(p = strchr(buf, ':'))) {
-			warnx("%s: corrupted entry", _PATH_MASTERPASSWD);
+		if (end - line >= PW_LINE_MAX - 1 || (nl != NULL &&
+		    nl - line + 1 >= PW_LINE_MAX)) {
+			warnx("%s: line too long", _PATH_MASTERPASSWD);
 			pw_error(NULL, 0, 1);
 		}
-		*p = '\0';
-		if (strcmp(buf, pw->pw_name)) {
-			*p = ':';
-			(void)fprintf(to, "%s", buf);
-			if (ferror(to))
-				goto err;
-			continue;
-		}
-		(void)fprintf(to, "%s:%s:%d:%d:%s:%ld:%ld:%s:%s:%s\n",
-		    pw->pw_name, pw->pw_passwd, pw->pw_uid, pw->pw_gid,
-		    pw->pw_class, pw->pw_change, pw->pw_expire, pw->pw_gecos,
-		    pw->pw_dir, pw->pw_shell);
-		done = 1;
-		if (ferror(to))
-			goto err;
+
+		/* keep the partial line for the next read */
+		pw_write(tfd, buf, line - buf);
+		have = end - line;
+		memmove(buf, line, have);
+	}
+	if (have > 0) {
+		warnx("%s: line too long", _PATH_MASTERPASSWD);
+		pw_error(NULL, 0, 1);
 	}
 	if (!done)
-		(void)fprintf(to, "%s:%s:%d:%d:%s:%ld:%ld:%s:%s:%s\n",
-		    pw->pw_name, pw->pw_passwd, pw->pw_uid, pw->pw_gid,
-		    pw->pw_class, pw->pw_change, pw->pw_expire, pw->pw_gecos,
-		    pw->pw_dir, pw->pw_shell);
+		pw_write_entry(tfd, pw);
 
-	if (ferror(to))
-err:		pw_error(NULL, 1, 1);
-	(void)fclose(to);
+	free(buf);
+	if (close(tfd) == -1)
+		pw_error(tempname, 1, 1);
 }
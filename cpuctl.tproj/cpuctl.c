@@ -5,6 +5,7 @@
 //  Copyright (c) 2019 Apple Inc. All rights reserved.
 //
 
+#include <ctype.h>
 #include <err.h>
 #include <getopt.h>
 #include <limits.h>
@@ -12,14 +13,39 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sysexits.h>
 #include <unistd.h>
 #include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <sys/sysctl.h>
+
+#define MAX_PERFLEVELS  8
+#define STATE_WAIT_NS   (2 * NSEC_PER_SEC)
+
+/*
+ * Where each CPU sits in the topology.  The kernel reports the CPUs of
+ * each performance level (hw.perflevelN) and how many share an L2, i.e.
+ * make up a cluster; on AMP systems CPUs are numbered cluster by cluster,
+ * starting with the least performant level.
+ */
+struct cpu_topo {
+    int perflevel;
+    int cluster;
+};
+
+static int nperflevels;
+static char perflevel_names[MAX_PERFLEVELS][32];
+static int show_timing;
 
 static void usage()
 {
     printf("usage: cpuctl [ list ]\n");
-    printf("       cpuctl { offline | online } <cpu> [ <cpu>... ]\n");
+    printf("       cpuctl [ -t ] { offline | online } <cpus> [ <cpus>... ]\n");
+    printf("\n");
+    printf("<cpus> is a CPU number, a range <first>-<last>, cluster:<n>,\n");
+    printf("or type:<perflevel>, where <perflevel> is a number or a name\n");
+    printf("such as P or E as shown by list.\n");
     exit(EX_USAGE);
 }
 
@@ -38,7 +64,82 @@ static void fetch_cpu_info(host_t *priv_port,
     }
 }
 
-static int do_cmd_list(mach_msg_type_number_t proc_count, processor_basic_info_data_t *cpus)
+static int sysctl_int(const char *name, int def)
+{
+    int value;
+    size_t len = sizeof(value);
+
+    if (sysctlbyname(name, &value, &len, NULL, 0) != 0)
+        return def;
+    return value;
+}
+
+static void fetch_cpu_topology(mach_msg_type_number_t proc_count,
+                               processor_basic_info_data_t *cpus,
+                               struct cpu_topo *topo)
+{
+    int logicalcpus[MAX_PERFLEVELS], cpusperl2[MAX_PERFLEVELS];
+    int total = 0;
+    char name[64];
+
+    nperflevels = sysctl_int("hw.nperflevels", 1);
+    if (nperflevels < 1 || nperflevels > MAX_PERFLEVELS)
+        nperflevels = 1;
+
+    for (int level = 0; level < nperflevels; level++) {
+        size_t len = sizeof(perflevel_names[level]);
+
+        snprintf(name, sizeof(name), "hw.perflevel%d.logicalcpu_max", level);
+        logicalcpus[level] = sysctl_int(name, nperflevels == 1 ? (int)proc_count : 0);
+        snprintf(name, sizeof(name), "hw.perflevel%d.cpusperl2", level);
+        cpusperl2[level] = sysctl_int(name, logicalcpus[level]);
+        if (cpusperl2[level] < 1)
+            cpusperl2[level] = 1;
+
+        snprintf(name, sizeof(name), "hw.perflevel%d.name", level);
+        if (sysctlbyname(name, perflevel_names[level], &len, NULL, 0) != 0)
+            snprintf(perflevel_names[level], sizeof(perflevel_names[level]), "%d", level);
+
+        total += logicalcpus[level];
+    }
+
+    /* Without a consistent description, treat the CPUs as one cluster. */
+    if (total != (int)proc_count) {
+        nperflevels = 1;
+        logicalcpus[0] = cpusperl2[0] = (int)proc_count;
+        snprintf(perflevel_names[0], sizeof(perflevel_names[0]), "0");
+    }
+
+    /* Hand out the CPUs in slot order, least performant level first. */
+    int level = nperflevels - 1, seen = 0, cluster = 0, prev_slot = -1;
+    for (int i = 0; i < (int)proc_count; i++) {
+        int lowest_slot = INT_MAX, lowest_idx = -1;
+        for (int j = 0; j < (int)proc_count; j++) {
+            if (cpus[j].slot_num > prev_slot && cpus[j].slot_num < lowest_slot) {
+                lowest_slot = cpus[j].slot_num;
+                lowest_idx = j;
+            }
+        }
+        if (lowest_idx == -1)
+            errx(EX_OSERR, "slot numbers are out of range");
+
+        while (seen == logicalcpus[level] && level > 0) {
+            level--;
+            seen = 0;
+            cluster++;
+        }
+        if (seen > 0 && seen % cpusperl2[level] == 0)
+            cluster++;
+
+        topo[lowest_idx].perflevel = level;
+        topo[lowest_idx].cluster = cluster;
+        seen++;
+        prev_slot = lowest_slot;
+    }
+}
+
+static int do_cmd_list(mach_msg_type_number_t proc_count, processor_basic_info_data_t *cpus,
+                       struct cpu_topo *topo)
 {
     int prev_lowest = -1;
     for (int i = 0; i < proc_count; i++) {
@@ -55,12 +156,15 @@ static int do_cmd_list(mach_msg_type_number_t proc_count, processor_basic_info_d
             errx(EX_OSERR, "slot numbers are out of range");
 
         processor_basic_info_data_t *cpu = &cpus[lowest_idx];
-        printf("CPU%d: %-7s type=%x,%x master=%d\n",
+        printf("CPU%d: %-7s type=%x,%x master=%d cluster=%d perflevel=%d (%s)\n",
                cpu->slot_num,
                cpu->running ? "online" : "offline",
                cpu->cpu_type,
                cpu->cpu_subtype,
-               cpu->is_master);
+               cpu->is_master,
+               topo[lowest_idx].cluster,
+               topo[lowest_idx].perflevel,
+               perflevel_names[topo[lowest_idx].perflevel]);
 
         prev_lowest = lowest_slot;
     }
@@ -78,13 +182,132 @@ static int find_cpu_by_slot(mach_msg_type_number_t proc_count,
     return -1;
 }
 
+static int find_perflevel(const char *str)
+{
+    char *endp = NULL;
+    int level = (int)strtoul(str, &endp, 0);
+
+    if (*str != 0 && *endp == 0)
+        return level < nperflevels ? level : -1;
+
+    /* a name, or its first letter: "P" for "Performance" */
+    for (level = 0; level < nperflevels; level++) {
+        if (!strcasecmp(str, perflevel_names[level]) ||
+            (str[1] == 0 && tolower(str[0]) == tolower(perflevel_names[level][0])))
+            return level;
+    }
+    return -1;
+}
+
+/*
+ * Mark the CPUs named by one argument in selected[], indexed like cpus[].
+ * Every argument is checked before any CPU is started or stopped.
+ */
+static void select_cpus(const char *arg,
+                        mach_msg_type_number_t proc_count,
+                        processor_basic_info_data_t *cpus,
+                        struct cpu_topo *topo,
+                        bool *selected)
+{
+    char *endp = NULL;
+    int matched = 0;
+
+    if (!strncmp(arg, "cluster:", 8)) {
+        int cluster = (int)strtoul(arg + 8, &endp, 0);
+        if (arg[8] == 0 || *endp != 0)
+            usage();
+        for (int i = 0; i < proc_count; i++) {
+            if (topo[i].cluster == cluster) {
+                selected[i] = true;
+                matched++;
+            }
+        }
+    } else if (!strncmp(arg, "type:", 5)) {
+        int level = find_perflevel(arg + 5);
+        if (level == -1)
+            errx(EX_USAGE, "Invalid CPU type %s", arg + 5);
+        for (int i = 0; i < proc_count; i++) {
+            if (topo[i].perflevel == level) {
+                selected[i] = true;
+                matched++;
+            }
+        }
+    } else {
+        int first = (int)strtoul(arg, &endp, 0), last = first;
+        if (endp == arg)
+            usage();
+        if (*endp == '-') {
+            const char *lastp = endp + 1;
+            last = (int)strtoul(lastp, &endp, 0);
+            if (endp == lastp || last < first)
+                usage();
+        }
+        if (*endp != 0)
+            usage();
+
+        for (int slot = first; slot <= last; slot++) {
+            int cpu = find_cpu_by_slot(proc_count, cpus, slot);
+            if (cpu == -1)
+                errx(EX_USAGE, "Invalid CPU ID %d", slot);
+            selected[cpu] = true;
+            matched++;
+        }
+    }
+
+    if (matched == 0)
+        errx(EX_USAGE, "No CPUs match %s", arg);
+}
+
+static mach_timebase_info_data_t timebase;
+
+static double abs_to_ms(uint64_t abstime)
+{
+    if (timebase.denom == 0)
+        mach_timebase_info(&timebase);
+    return (double)abstime * timebase.numer / timebase.denom / NSEC_PER_MSEC;
+}
+
+static uint64_t ns_to_abs(uint64_t ns)
+{
+    if (timebase.denom == 0)
+        mach_timebase_info(&timebase);
+    return ns * timebase.denom / timebase.numer;
+}
+
+/*
+ * Wait for the CPU to report the new state, so that the time taken
+ * covers the whole transition and not just the request.
+ */
+static bool wait_cpu_state(host_t *priv_port, processor_t port, bool up)
+{
+    uint64_t deadline = mach_absolute_time() + ns_to_abs(STATE_WAIT_NS);
+
+    for (;;) {
+        processor_basic_info_data_t info;
+        mach_msg_type_number_t info_count = PROCESSOR_BASIC_INFO_COUNT;
+
+        if (processor_info(port, PROCESSOR_BASIC_INFO, priv_port,
+                           (processor_info_t)&info, &info_count) != KERN_SUCCESS)
+            return false;
+        if ((bool)info.running == up)
+            return true;
+        if (mach_absolute_time() > deadline)
+            return false;
+        usleep(100);
+    }
+}
+
 int main(int argc, char **argv)
 {
     int opt;
 
-    while ((opt = getopt(argc, argv, "h")) != -1) {
+    while ((opt = getopt(argc, argv, "ht")) != -1) {
         switch (opt) {
+            case 't':
+                show_timing = 1;
+                break;
             case 'h':
+            default:
                 usage();
         }
     }
@@ -103,14 +326,19 @@ int main(int argc, char **argv)
         errx(EX_OSERR, "calloc() failed");
     fetch_cpu_info(&priv_port, proc_ports, proc_count, cpus);
 
+    struct cpu_topo *topo = calloc(proc_count, sizeof(*topo));
+    if (!topo)
+        errx(EX_OSERR, "calloc() failed");
+    fetch_cpu_topology(proc_count, cpus, topo);
+
     if (optind == argc)
-        return do_cmd_list(proc_count, cpus);
+        return do_cmd_list(proc_count, cpus, topo);
 
     const char *cmd = argv[optind];
     optind++;
 
     if (!strcmp(cmd, "list"))
-        return do_cmd_list(proc_count, cpus);
+        return do_cmd_list(proc_count, cpus, topo);
 
     bool up = true;
     if (!strncmp(cmd, "off", 3))
@@ -121,17 +349,42 @@ int main(int argc, char **argv)
     if (optind == argc)
         usage();
 
-    int ret = 0;
-    for (; optind < argc; optind++) {
-        char *endp = NULL;
-        int slot = (int)strtoul(argv[optind], &endp, 0);
-        if (*endp != 0)
-            usage();
+    bool *selected = calloc(proc_count, sizeof(*selected));
+    if (!selected)
+        errx(EX_OSERR, "calloc() failed");
+    for (; optind < argc; optind++)
+        select_cpus(argv[optind], proc_count, cpus, topo, selected);
 
-        int cpu = find_cpu_by_slot(proc_count, cpus, slot);
-        if (cpu == -1)
-            errx(EX_USAGE, "Invalid CPU ID %d", slot);
+    /* Only change the CPUs that are not already in the wanted state. */
+    int todo = 0, online = 0;
+    for (int i = 0; i < proc_count; i++) {
+        if (selected[i] && (bool)cpus[i].running == up)
+            selected[i] = false;
+        if (selected[i])
+            todo++;
+        if (cpus[i].running && !(selected[i] && !up))
+            online++;
+    }
+    if (!up && online == 0)
+        errx(EX_USAGE, "At least one CPU must remain online");
+
+    /*
+     * Apply the whole batch in slot order.  With -t, report how long each
+     * CPU took to change state, so that transitions can be compared as
+     * the number of online CPUs grows or shrinks.
+     */
+    int ret = 0, prev_slot = -1;
+    uint64_t batch_start = mach_absolute_time();
+    for (int n = 0; n < todo; n++) {
+        int cpu = -1;
+        for (int i = 0; i < proc_count; i++) {
+            if (selected[i] && cpus[i].slot_num > prev_slot &&
+                (cpu == -1 || cpus[i].slot_num < cpus[cpu].slot_num))
+                cpu = i;
+        }
+        prev_slot = cpus[cpu].slot_num;
 
+        uint64_t start = mach_absolute_time();
         if (up) {
             if (processor_start(proc_ports[cpu]) != KERN_SUCCESS)
                 errx(EX_OSERR, "processor_start(%u) failed", cpu);
@@ -139,6 +392,30 @@ int main(int argc, char **argv)
             if (processor_exit(proc_ports[cpu]) != KERN_SUCCESS)
                 errx(EX_OSERR, "processor_exit(%u) failed", cpu);
         }
+        uint64_t requested = mach_absolute_time();
+
+        if (show_timing) {
+            bool settled = wait_cpu_state(&priv_port, proc_ports[cpu], up);
+            uint64_t done = mach_absolute_time();
+
+            printf("CPU%d: %s call %.3f ms, %s %.3f ms\n", cpus[cpu].slot_num,
+                   up ? "online " : "offline",
+                   abs_to_ms(requested - start),
+                   settled ? "settled" : "not settled after",
+                   abs_to_ms(done - start));
+            if (!settled)
+                ret = EX_OSERR;
+        }
+    }
+
+    if (show_timing) {
+        online = 0;
+        fetch_cpu_info(&priv_port, proc_ports, proc_count, cpus);
+        for (int i = 0; i < proc_count; i++)
+            online += cpus[i].running ? 1 : 0;
+        printf("%d CPU%s %s in %.3f ms, %d of %u online\n",
+               todo, todo == 1 ? "" : "s", up ? "started" : "stopped",
+               abs_to_ms(mach_absolute_time() - batch_start), online, proc_count);
     }
 
     return ret;
@@ -56,26 +56,85 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <vis.h>
 #include <sys/sysctl.h>
 #include <libproc.h>
 
+/* How much of the previous read is looked for to find where it left off */
+#define ANCHOR_SIZE	1024
+
 static void
 usage(void)
 {
-	(void)fprintf(stderr, "usage: sudo dmesg\n");
+	(void)fprintf(stderr, "usage: sudo dmesg [-w]\n");
 	exit(1);
 }
 
+/*
+ * Print len bytes of the message buffer, visually encoded, through the
+ * caller's visbuf of at least len * 4 + 1 bytes.
+ */
+static void
+print_messages(char *visbuf, const char *msgs, size_t len)
+{
+	if (len == 0)
+		return;
+	strvisx(visbuf, msgs, len, 0);
+	printf("%s", visbuf);
+	fflush(stdout);
+}
+
+/*
+ * The kernel buffer only ever loses bytes at the front and gains them at the
+ * back, so the tail of the previous read is in the new one, shifted towards
+ * the start by however much was lost.  Look for it with the smallest shift
+ * first and return the offset where the new messages begin, or 0 if the
+ * buffer turned over completely since the last read.
+ */
+static size_t
+new_messages(const char *prev, size_t prevlen, const char *cur, size_t curlen)
+{
+	size_t alen, p;
+
+	if (prevlen == 0)
+		return 0;
+	alen = prevlen < ANCHOR_SIZE ? prevlen : ANCHOR_SIZE;
+	if (alen > curlen)
+		return 0;
+	p = prevlen - alen;
+	if (p > curlen - alen)
+		p = curlen - alen;
+	for (;;) {
+		if (memcmp(cur + p, prev + prevlen - alen, alen) == 0)
+			return p + alen;
+		if (p == 0)
+			return 0;
+		p--;
+	}
+}
+
 int
 main(int argc, char **argv)
 {
-	char *msgbuf, *visbuf;
+	char *msgbuf, *prevbuf, *visbuf, *tmp;
 	int msgbufsize;
 	size_t sysctlsize = sizeof(msgbufsize);
+	size_t len, prevlen, start;
 	long data_size;
+	int ch, follow = 0;
 
-	if (argc > 1)
+	while ((ch = getopt(argc, argv, "w")) != -1) {
+		switch (ch) {
+		case 'w':
+			follow = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc)
 		usage();
 
 	if (sysctlbyname("kern.msgbuf", &msgbufsize, &sysctlsize, NULL, 0)) {
@@ -92,10 +151,40 @@ main(int argc, char **argv)
 		usage();
 	}
 
-	visbuf = malloc(data_size*4);
-	strvis(visbuf, msgbuf, 0);
-	printf("%s", visbuf);
-	free(visbuf);
-	free(msgbuf);
-	exit(0);
+	if (!follow) {
+		visbuf = malloc(data_size*4);
+		strvis(visbuf, msgbuf, 0);
+		printf("%s", visbuf);
+		free(visbuf);
+		free(msgbuf);
+		exit(0);
+	}
+
+	/*
+	 * Follow mode: reuse the same two buffers for every read, and only
+	 * encode and print what was added since the previous one.
+	 */
+	prevbuf = malloc(msgbufsize);
+	visbuf = malloc((size_t)msgbufsize * 4 + 1);
+	if (prevbuf == NULL || visbuf == NULL) {
+		perror("Unable to allocate a message buffer");
+		exit(1);
+	}
+	len = strnlen(msgbuf, data_size);
+	print_messages(visbuf, msgbuf, len);
+	for (;;) {
+		tmp = prevbuf;
+		prevbuf = msgbuf;
+		msgbuf = tmp;
+		prevlen = len;
+
+		sleep(1);
+		if ((data_size = proc_kmsgbuf(msgbuf, msgbufsize)) == 0) {
+			perror("Unable to obtain kernel buffer");
+			exit(1);
+		}
+		len = strnlen(msgbuf, data_size);
+		start = new_messages(prevbuf, prevlen, msgbuf, len);
+		print_messages(visbuf, msgbuf + start, len - start);
+	}
 }
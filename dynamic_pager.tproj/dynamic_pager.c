@@ -8,6 +8,9 @@
 #include <string.h>
 #include <unistd.h> 
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 
 /*
  * We don't exit with a non-zero status anywhere here for 2 reasons:
@@ -17,27 +20,157 @@
  *	-- it could set the prefix for the swapfile name.
  */
 
-static void
+/*
+ * Old swap files are moved into this directory, inside the swap directory
+ * so that renaming them is cheap, and unlinked from there in the
+ * background.  Its name must not start with "swap".
+ */
+#define STALE_DIR	".stale"
+
+static char stale_path[1024];
+
+/*
+ * Move the old swap files out of the kernel's way.  A rename costs the
+ * same however large the file is, unlike the unlink that frees its blocks.
+ * Returns the number of files moved; any that cannot be moved are
+ * unlinked here instead.
+ */
+static int
 clean_swap_directory(const char *path)
 {
 	DIR *dir;
 	struct dirent *entry;
-	char buf[1024];
+	char buf[1024], stale[1024];
+	int moved = 0;
 
 	dir = opendir(path);
 	if (dir == NULL) {
 		fprintf(stderr,"dynamic_pager: cannot open swap directory %s\n", path);
-		exit(0);
+		return 0;
 	}
 
+	snprintf(stale_path, sizeof stale_path, "%s/%s", path, STALE_DIR);
+	if (mkdir(stale_path, 0700) == -1 && errno != EEXIST)
+		stale_path[0] = '\0';
+
 	while ((entry = readdir(dir)) != NULL) {
 		if (entry->d_namlen>= 4 && strncmp(entry->d_name, "swap", 4) == 0) {
 			snprintf(buf, sizeof buf, "%s/%s", path, entry->d_name);
+			snprintf(stale, sizeof stale, "%s/%s", stale_path, entry->d_name);
+			if (stale_path[0] != '\0' && rename(buf, stale) == 0)
+				moved++;
+			else
+				unlink(buf);
+		}
+	}
+
+	closedir(dir);
+
+	/* left over from a boot that did not finish cleaning */
+	if (moved == 0 && stale_path[0] != '\0' && rmdir(stale_path) == -1 && errno == ENOTEMPTY)
+		moved++;
+
+	return moved;
+}
+
+static void *
+remove_stale_files(void *arg)
+{
+	DIR *dir;
+	struct dirent *entry;
+	char buf[1024];
+
+	dir = opendir(stale_path);
+	if (dir == NULL)
+		return NULL;
+
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_type != DT_DIR) {
+			snprintf(buf, sizeof buf, "%s/%s", stale_path, entry->d_name);
 			unlink(buf);
 		}
 	}
 
 	closedir(dir);
+	rmdir(stale_path);
+
+	return NULL;
+}
+
+/*
+ * Create the first swap file ahead of time, contiguous if the filesystem
+ * can manage it, so that it is not scattered across a filesystem that
+ * has fragmented by the time the system first comes under memory pressure.
+ */
+static void
+preallocate_swap_file(const char *fileroot, off_t size)
+{
+	char path[1024];
+	fstore_t fst;
+	int fd;
+
+	snprintf(path, sizeof path, "%s0", fileroot);
+
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if (fd == -1) {
+		fprintf(stderr, "dynamic_pager: cannot create swap file %s: %s\n", path, strerror(errno));
+		return;
+	}
+
+	fst.fst_flags = F_ALLOCATECONTIG | F_ALLOCATEALL;
+	fst.fst_posmode = F_PEOFPOSMODE;
+	fst.fst_offset = 0;
+	fst.fst_length = size;
+	fst.fst_bytesalloc = 0;
+
+	if (fcntl(fd, F_PREALLOCATE, &fst) == -1) {
+		fst.fst_flags = F_ALLOCATEALL;
+		if (fcntl(fd, F_PREALLOCATE, &fst) == -1) {
+			fprintf(stderr, "dynamic_pager: cannot preallocate swap file %s: %s\n", path, strerror(errno));
+			close(fd);
+			unlink(path);
+			return;
+		}
+	}
+
+	if (ftruncate(fd, size) == -1) {
+		fprintf(stderr, "dynamic_pager: cannot size swap file %s: %s\n", path, strerror(errno));
+		close(fd);
+		unlink(path);
+		return;
+	}
+
+	close(fd);
+}
+
+static off_t
+parse_size(const char *str)
+{
+	char *end;
+	unsigned long long size;
+
+	errno = 0;
+	size = strtoull(str, &end, 0);
+	if (errno != 0 || end == str)
+		return -1;
+
+	switch (*end) {
+	case 'g': case 'G':
+		size <<= 10;
+		/* FALLTHROUGH */
+	case 'm': case 'M':
+		size <<= 10;
+		/* FALLTHROUGH */
+	case 'k': case 'K':
+		size <<= 10;
+		end++;
+		break;
+	}
+
+	if (*end != '\0' || size == 0 || size > INT64_MAX)
+		return -1;
+
+	return (off_t)size;
 }
 
 int
@@ -48,20 +181,31 @@ main(int argc, char **argv)
 	struct statfs sfs;
 	char *q;
 	char fileroot[512];
+	off_t prealloc_size = 0;
+	pthread_t cleaner;
+	int moved;
 
 	seteuid(getuid());
 	fileroot[0] = '\0';
 
-	while ((ch = getopt(argc, argv, "F:")) != EOF) {
+	while ((ch = getopt(argc, argv, "F:P:")) != EOF) {
 		switch((char)ch) {
 
 		case 'F':
 			strncpy(fileroot, optarg, 500);
 			break;
 
+		case 'P':
+			prealloc_size = parse_size(optarg);
+			if (prealloc_size == -1) {
+				(void)fprintf(stderr, "dynamic_pager: bad size %s\n", optarg);
+				prealloc_size = 0;
+			}
+			break;
+
 		default:
 			(void)fprintf(stderr,
-			    "usage: dynamic_pager [-F filename]\n");
+			    "usage: dynamic_pager [-F filename] [-P size]\n");
 			exit(0);
 		}
 	}
@@ -93,11 +237,6 @@ main(int argc, char **argv)
 	if ((q = strrchr(tmp, '/')))
 	        *q = 0;
 
-	/*
-	 * Remove all files in the swap directory.
-	 */
-	clean_swap_directory(tmp);
-
 	if (statfs(tmp, &sfs) == -1) {
 		/*
 		 * Setup the swap directory.
@@ -110,5 +249,21 @@ main(int argc, char **argv)
 
 	chown(tmp, 0, 0);
 
+	/*
+	 * Clear the old swap files out of the swap directory, then free their
+	 * space on a background thread while the first swap file is set up.
+	 */
+	moved = clean_swap_directory(tmp);
+	if (moved > 0 && pthread_create(&cleaner, NULL, remove_stale_files, NULL) != 0) {
+		remove_stale_files(NULL);
+		moved = 0;
+	}
+
+	if (prealloc_size > 0)
+		preallocate_swap_file(fileroot, prealloc_size);
+
+	if (moved > 0)
+		pthread_join(cleaner, NULL);
+
 	return (0);
 }
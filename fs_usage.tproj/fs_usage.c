@@ -29,6 +29,9 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <strings.h>
 #include <fcntl.h>
 #include <aio.h>
@@ -39,7 +42,12 @@
 #include <errno.h>
 #include <err.h>
 #include <libutil.h>
+#include <paths.h>
+#include <spawn.h>
+#include <crt_externs.h>
 #include <TargetConditionals.h>
+#include <dlfcn.h>
+#include <malloc/malloc.h>
 
 #include <ktrace/session.h>
 #include <System/sys/kdebug.h>
@@ -51,13 +59,22 @@
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/param.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/syslimits.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 
 #import <mach/clock_types.h>
 #import <mach/mach_time.h>
+#import <mach/mach.h>
+
+#include <mach-o/dyld.h>
+#include <mach-o/dyld_priv.h>
+#include <mach-o/loader.h>
+
+#include "rawz.h"
 
 /*
  * MAXCOLS controls when extra data kicks in.
@@ -123,18 +140,35 @@ struct diskio {
 #define HASH_MASK       (HASH_SIZE - 1)
 
 void setup_ktrace_callbacks(void);
+static void events_subclass(bool wanted, const char *name, uint32_t class, uint32_t subclass, void (^callback)(ktrace_event_t event));
+static inline void events_dispatch(void (^callback)(ktrace_event_t event), ktrace_event_t event);
 void extend_syscall(uint64_t thread, int type, ktrace_event_t event);
 
 /* printing routines */
 bool check_filter_mode(pid_t pid, th_info_t ti, uint64_t type, int error, int retval, char *sc_name);
 void format_print(th_info_t ti, char *sc_name, ktrace_event_t event, uint64_t type, int format, uint64_t now, uint64_t stime, int waited, const char *pathname, struct diskio *dio);
+static void format_emit(th_info_t ti, const char *sc_name, ktrace_event_t event, uint64_t type, int format, uint64_t elapsed_ns, int waited, const char *pathname, struct diskio *dio, const char *command_name, pid_t pid, uint64_t threadid, struct timeval now_walltime);
 int print_open(ktrace_event_t event, uint64_t flags);
+void init_syscall_filter(void);
+
+/* formatting pipeline routines */
+void pipeline_start(void);
+void pipeline_enqueue(th_info_t ti, const char *sc_name, ktrace_event_t event, uint64_t type, int format, uint64_t elapsed_ns, int waited, const char *pathname, struct diskio *dio, const char *command_name, pid_t pid, uint64_t threadid, struct timeval now_walltime);
+void pipeline_finish(void);
+
+/* structured output routines */
+void output_record(th_info_t ti, const char *sc_name, ktrace_event_t event, int format, const char *command_name, pid_t pid, uint64_t threadid, struct timeval walltime, uint64_t elapsed_ns, const char *pathname, struct diskio *dio);
+void output_flush(void);
 
 /* metadata info hash routines */
 void meta_add_name(uint64_t blockno, const char *pathname);
 const char *meta_find_name(uint64_t blockno);
 void meta_delete_all(void);
 
+/* path cache file routines */
+void path_cache_load(const char *path);
+void path_cache_save(const char *path);
+
 /* event ("thread info") routines */
 void event_enter(int type, ktrace_event_t event);
 void event_exit(char *sc_name, int type, ktrace_event_t event, int format);
@@ -142,6 +176,7 @@ th_info_t event_find(uint64_t thread, int type);
 void event_delete(th_info_t ti_to_delete);
 void event_delete_all(void);
 void event_mark_thread_waited(uint64_t);
+void event_print_stats(void);
 
 /* network fd set routines */
 void fd_set_is_network(pid_t pid, uint64_t fd, bool set);
@@ -160,6 +195,24 @@ struct diskio *diskio_complete(uint64_t bp, uint64_t io_errno, uint64_t resid, u
 void diskio_print(struct diskio *dio);
 void diskio_free(struct diskio *dio);
 
+/* top mode routines */
+void top_add_syscall(pid_t pid, uint64_t thread, int type, uint64_t now, uint64_t stime, uint64_t bytes);
+void top_add_diskio(struct diskio *dio);
+void top_clear_pid(pid_t pid);
+void top_print(void);
+
+/* disk I/O histogram routines */
+void diskio_hist_add(struct diskio *dio);
+void diskio_hist_print(void);
+
+/* benchmark routines */
+void bench_count_allocations(void);
+void bench_print(void);
+
+/* summary mode routines */
+void summary_add(pid_t pid, uint64_t thread, const char *sc_name, uint64_t now, uint64_t stime, uint64_t bytes);
+void summary_print(void);
+
 /* disk name routines */
 #define NFS_DEV -1
 #define CS_DEV	-2
@@ -484,6 +537,84 @@ uint64_t mach_time_of_first_event;
 uint64_t start_time_ns = 0;
 uint64_t end_time_ns = UINT64_MAX;
 unsigned int columns = 0;
+unsigned int rows = 0;
+uint64_t diskio_inflight = 0;
+uint64_t diskio_max_inflight = 0;
+
+/*
+ * -s: accumulate per-process, per-call counters instead of printing each
+ * event, and dump a sorted table every summary_interval_ns.
+ */
+bool summary_flag = false;
+uint64_t summary_interval_ns = 0;
+dispatch_source_t summary_timer;
+
+/*
+ * -o: emit one structured record per event through a large buffer instead
+ * of the column-formatted text.
+ */
+#define OUTPUT_TEXT	0
+#define OUTPUT_JSON	1
+#define OUTPUT_BIN	2
+
+int output_format = OUTPUT_TEXT;
+dispatch_source_t output_flush_timer;
+
+/*
+ * -H: bucket disk I/O service times per device and I/O type, print the
+ * distributions every histogram_interval_ns, and print no per-event lines.
+ */
+bool histogram_flag = false;
+uint64_t histogram_interval_ns = 0;
+dispatch_source_t histogram_timer;
+
+/*
+ * -T: keep a top-style screen of the processes doing the most I/O, redrawn
+ * every top_interval_ns, and print no per-event lines.
+ */
+bool top_flag = false;
+uint64_t top_interval_ns = 0;
+dispatch_source_t top_timer;
+
+/*
+ * -c: metadata block names and disk names are read from this file at start
+ * and written back to it at exit, so a replay of a raw file can name
+ * metadata I/O before the lookups that named it recur.
+ */
+const char *path_cache_file = NULL;
+
+/*
+ * -P: the ktrace callbacks only queue up what format_emit() needs and a
+ * separate thread does the formatting and writing.
+ */
+bool pipeline_flag = false;
+
+/* -D stats: report th_info table occupancy, probe lengths and filtering at exit */
+bool th_stats_flag = false;
+
+/*
+ * Events that reached the callbacks, and those of them that were then
+ * dropped by the -f modes in userspace.  Subclasses that no -f mode can show
+ * are never registered, so they're left out of the kernel's typefilter.
+ */
+uint64_t events_received = 0;
+uint64_t events_filtered = 0;
+
+/*
+ * -B: replay the -R file with the output sent to /dev/null, timing the
+ * callbacks and the formatting, and report the throughput at exit.
+ */
+bool bench_flag = false;
+struct {
+	uint64_t start_ns;
+	uint64_t callback_ns;
+	uint64_t format_ns;
+	uint64_t formatted;
+	uint64_t overruns;
+} bench;
+#define MAX_EXCLUDED_SUBCLASSES 16
+const char *excluded_subclasses[MAX_EXCLUDED_SUBCLASSES];
+int excluded_subclass_count = 0;
 
 /*
  * Network only or filesystem only output filter
@@ -667,16 +798,21 @@ const struct bsd_syscall bsd_syscalls[MAX_BSD_SYSCALL] = {
 	SYSCALL(getattrlistat, FMT_AT),
 };
 
+/* filled in by init_syscall_filter() from the -f modes */
+bool bsd_syscall_wanted[MAX_BSD_SYSCALL];
+
 static void
 get_screenwidth(void)
 {
 	struct winsize size;
 
 	columns = MAXCOLS;
+	rows = 0;
 
 	if (isatty(STDOUT_FILENO)) {
 		if (ioctl(1, TIOCGWINSZ, &size) != -1) {
 			columns = size.ws_col;
+			rows = size.ws_row;
 
 			if (columns > MAXWIDTH)
 				columns = MAXWIDTH;
@@ -693,6 +829,143 @@ mach_to_nano(uint64_t mach)
 	return nanoseconds;
 }
 
+/*
+ * Honor -S and -E when replaying a raw file.  Nothing after the end of the
+ * window can be shown, so stop reading the file as soon as it's passed.
+ */
+static bool
+raw_time_in_window(uint64_t now)
+{
+	static bool ended = false;
+	uint64_t relative_time_ns;
+
+	if (!RAW_flag)
+		return true;
+
+	relative_time_ns = mach_to_nano(now - mach_time_of_first_event);
+
+	if (relative_time_ns > end_time_ns) {
+		if (!ended) {
+			ended = true;
+			ktrace_end(s, 0);
+		}
+
+		return false;
+	}
+
+	return relative_time_ns >= start_time_ns;
+}
+
+/*
+ * With more than one -S/-E window, each window is replayed by a copy of
+ * fs_usage started with FS_USAGE_RAW_WINDOW_ENV set to "index,columns".
+ * The copies run in parallel with their output going to temporary files,
+ * which are then copied out in window order.
+ */
+#define MAX_RAW_WINDOWS		64
+#define FS_USAGE_RAW_WINDOW_ENV	"FS_USAGE_RAW_WINDOW"
+
+struct raw_window {
+	uint64_t start_ns;
+	uint64_t end_ns;
+} raw_windows[MAX_RAW_WINDOWS];
+int num_raw_windows = 0;
+
+/*
+ * If path is a compressed raw file, expand it with rawz_expand() and return
+ * the /dev/fd path of the expanded file for ktrace_set_file() to open.
+ * Otherwise path is returned as is.
+ */
+static const char *
+raw_file_path(const char *path)
+{
+	static char fd_path[32];
+	int fd, raw_fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return path;
+
+	if ((raw_fd = rawz_expand(fd, "fs_usage", NULL)) < 0)
+		err(1, "%s", path);
+
+	if (raw_fd == fd) {
+		close(fd);
+		return path;
+	}
+
+	snprintf(fd_path, sizeof (fd_path), "/dev/fd/%d", raw_fd);
+
+	return fd_path;
+}
+
+static int
+run_raw_windows(char *argv[])
+{
+	char path[MAXPATHLEN];
+	uint32_t pathlen = sizeof (path);
+	const char *tmpdir;
+	pid_t pids[MAX_RAW_WINDOWS];
+	int fds[MAX_RAW_WINDOWS];
+	int i, rv, status, exit_status = 0;
+
+	if (_NSGetExecutablePath(path, &pathlen) != 0)
+		errx(1, "could not find the fs_usage executable");
+
+	if ((tmpdir = getenv("TMPDIR")) == NULL)
+		tmpdir = _PATH_TMP;
+
+	for (i = 0; i < num_raw_windows; i++) {
+		posix_spawn_file_actions_t actions;
+		char tmp_path[MAXPATHLEN];
+		char window[32];
+
+		snprintf(tmp_path, sizeof (tmp_path), "%s/fs_usage.XXXXXX", tmpdir);
+
+		if ((fds[i] = mkstemp(tmp_path)) < 0)
+			err(1, "%s", tmp_path);
+
+		unlink(tmp_path);
+
+		snprintf(window, sizeof (window), "%d,%u", i, columns);
+		setenv(FS_USAGE_RAW_WINDOW_ENV, window, 1);
+
+		posix_spawn_file_actions_init(&actions);
+		posix_spawn_file_actions_adddup2(&actions, fds[i], STDOUT_FILENO);
+
+		if ((rv = posix_spawn(&pids[i], path, &actions, NULL, argv, *_NSGetEnviron())) != 0)
+			errc(1, rv, "posix_spawn");
+
+		posix_spawn_file_actions_destroy(&actions);
+	}
+
+	for (i = 0; i < num_raw_windows; i++) {
+		while (waitpid(pids[i], &status, 0) < 0) {
+			if (errno != EINTR)
+				err(1, "waitpid");
+		}
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			exit_status = 1;
+	}
+
+	for (i = 0; i < num_raw_windows; i++) {
+		char buf[64 * 1024];
+		ssize_t n;
+
+		if (lseek(fds[i], 0, SEEK_SET) < 0)
+			err(1, "lseek");
+
+		while ((n = read(fds[i], buf, sizeof (buf))) > 0) {
+			if (write(STDOUT_FILENO, buf, n) != n)
+				err(1, "write");
+		}
+
+		close(fds[i]);
+	}
+
+	return exit_status;
+}
+
 static void
 exit_usage(void)
 {
@@ -700,7 +973,7 @@ exit_usage(void)
 
 	myname = getprogname();
 
-	fprintf(stderr, "Usage: %s [-e] [-w] [-f mode] [-b] [-t seconds] [-R rawfile [-S start_time] [-E end_time]] [pid | cmd [pid | cmd] ...]\n", myname);
+	fprintf(stderr, "Usage: %s [-e] [-w] [-f mode] [-b] [-B] [-c cachefile] [-H interval] [-o format] [-P] [-s interval] [-T interval] [-t seconds] [-D stats] [-R rawfile [-S start_time] [-E end_time] ...] [pid | cmd [pid | cmd] ...]\n", myname);
 	fprintf(stderr, "  -e    exclude the specified list of pids from the sample\n");
 	fprintf(stderr, "        and exclude fs_usage by default\n");
 	fprintf(stderr, "  -w    force wider, detailed, output\n");
@@ -712,10 +985,24 @@ exit_usage(void)
 	fprintf(stderr, "          mode = \"diskio\"   Show only disk I/O events\n");
 	fprintf(stderr, "          mode = \"cachehit\" In addition, show cache hits\n");
 	fprintf(stderr, "  -b    annotate disk I/O events with BootCache info (if available)\n");
+	fprintf(stderr, "  -B    benchmark: replay the -R file with output discarded and report throughput\n");
+	fprintf(stderr, "  -c    load metadata block and disk names from file, and save them at exit\n");
+	fprintf(stderr, "  -H    print disk I/O latency histograms every interval seconds\n");
+	fprintf(stderr, "        instead of printing each event\n");
+	fprintf(stderr, "  -o    output format\n");
+	fprintf(stderr, "          format = \"text\"     Column-formatted lines (default)\n");
+	fprintf(stderr, "          format = \"json\"     One JSON object per line\n");
+	fprintf(stderr, "          format = \"bin\"      Binary records\n");
+	fprintf(stderr, "  -P    format and write output on a separate thread\n");
+	fprintf(stderr, "  -s    summarize calls per process every interval seconds\n");
+	fprintf(stderr, "        instead of printing each event\n");
+	fprintf(stderr, "  -T    show the processes doing the most I/O, refreshed every interval seconds\n");
 	fprintf(stderr, "  -t    specifies timeout in seconds (for use in automated tools)\n");
+	fprintf(stderr, "  -D    debug option; \"stats\" reports event table and filtering statistics at exit\n");
 	fprintf(stderr, "  -R    specifies a raw trace file to process\n");
 	fprintf(stderr, "  -S    if -R is specified, selects a start point in microseconds\n");
 	fprintf(stderr, "  -E    if -R is specified, selects an end point in microseconds\n");
+	fprintf(stderr, "        several -S/-E windows are processed in parallel\n");
 	fprintf(stderr, "  pid   selects process(s) to sample\n");
 	fprintf(stderr, "  cmd   selects process(s) matching command string to sample\n");
 	fprintf(stderr, "By default (no options) the following processes are excluded from the output:\n");
@@ -740,6 +1027,7 @@ main(int argc, char *argv[])
 	int rv;
 	bool exclude_pids = false;
 	uint64_t time_limit_ns = 0;
+	char **orig_argv = argv;
 
 	os_set_crash_callback(&fs_usage_cleanup);
 
@@ -754,8 +1042,12 @@ main(int argc, char *argv[])
 	(void)ktrace_ignore_process_filter_for_event(s, P_PgOut);
 	(void)ktrace_ignore_process_filter_for_event(s, P_PgIn);
 
-	while ((ch = getopt(argc, argv, "bewf:R:S:E:t:W")) != -1) {
+	while ((ch = getopt(argc, argv, "bBc:ewD:f:H:o:PR:S:E:s:t:T:W")) != -1) {
 		switch (ch) {
+			case 'c':
+				path_cache_file = optarg;
+				break;
+
 			case 'e':
 				exclude_pids = true;
 				break;
@@ -789,6 +1081,62 @@ main(int argc, char *argv[])
 				BC_flag = true;
 				break;
 
+			case 'B':
+				bench_flag = true;
+				break;
+
+			case 'H':
+				histogram_flag = true;
+				histogram_interval_ns = (uint64_t)(NSEC_PER_SEC * atof(optarg));
+				if (histogram_interval_ns == 0) {
+					fprintf(stderr, "ERROR: could not set histogram interval to %s\n",
+							optarg);
+					exit(1);
+				}
+				break;
+
+			case 'o':
+				if (!strcmp(optarg, "json"))
+					output_format = OUTPUT_JSON;
+				else if (!strcmp(optarg, "bin"))
+					output_format = OUTPUT_BIN;
+				else if (!strcmp(optarg, "text"))
+					output_format = OUTPUT_TEXT;
+				else
+					exit_usage();
+				break;
+
+			case 'D':
+				if (!strcmp(optarg, "stats"))
+					th_stats_flag = true;
+				else
+					exit_usage();
+				break;
+
+			case 'P':
+				pipeline_flag = true;
+				break;
+
+			case 's':
+				summary_flag = true;
+				summary_interval_ns = (uint64_t)(NSEC_PER_SEC * atof(optarg));
+				if (summary_interval_ns == 0) {
+					fprintf(stderr, "ERROR: could not set summary interval to %s\n",
+							optarg);
+					exit(1);
+				}
+				break;
+
+			case 'T':
+				top_flag = true;
+				top_interval_ns = (uint64_t)(NSEC_PER_SEC * atof(optarg));
+				if (top_interval_ns == 0) {
+					fprintf(stderr, "ERROR: could not set refresh interval to %s\n",
+							optarg);
+					exit(1);
+				}
+				break;
+
 			case 't':
 				time_limit_ns = (uint64_t)(NSEC_PER_SEC * atof(optarg));
 				if (time_limit_ns == 0) {
@@ -800,7 +1148,7 @@ main(int argc, char *argv[])
 
 			case 'R':
 				RAW_flag = true;
-				rv = ktrace_set_file(s, optarg);
+				rv = ktrace_set_file(s, raw_file_path(optarg));
 				if (rv) {
 					fprintf(stderr, "ERROR: reading trace from '%s' failed (%s)\n", optarg, strerror(errno));
 					exit(1);
@@ -808,11 +1156,25 @@ main(int argc, char *argv[])
 				break;
 
 			case 'S':
-				start_time_ns = NSEC_PER_SEC * atof(optarg);
+				if (num_raw_windows == MAX_RAW_WINDOWS) {
+					fprintf(stderr, "ERROR: at most %d time windows can be given\n", MAX_RAW_WINDOWS);
+					exit(1);
+				}
+				raw_windows[num_raw_windows].start_ns = NSEC_PER_SEC * atof(optarg);
+				raw_windows[num_raw_windows].end_ns = UINT64_MAX;
+				num_raw_windows++;
 				break;
 
 			case 'E':
-				end_time_ns = NSEC_PER_SEC * atof(optarg);
+				/* closes the window opened by the last -S, if it's still open */
+				if (num_raw_windows == 0 || raw_windows[num_raw_windows - 1].end_ns != UINT64_MAX) {
+					if (num_raw_windows == MAX_RAW_WINDOWS) {
+						fprintf(stderr, "ERROR: at most %d time windows can be given\n", MAX_RAW_WINDOWS);
+						exit(1);
+					}
+					raw_windows[num_raw_windows++].start_ns = 0;
+				}
+				raw_windows[num_raw_windows - 1].end_ns = NSEC_PER_SEC * atof(optarg);
 				break;
 
 			default:
@@ -828,6 +1190,45 @@ main(int argc, char *argv[])
 		time_limit_ns = 0;
 	}
 
+	if (bench_flag) {
+		int fd;
+
+		if (!RAW_flag) {
+			fprintf(stderr, "ERROR: -B needs a raw file to replay, given with -R\n");
+			exit(1);
+		}
+
+		if ((fd = open(_PATH_DEVNULL, O_WRONLY)) < 0 || dup2(fd, STDOUT_FILENO) < 0)
+			err(1, "%s", _PATH_DEVNULL);
+		close(fd);
+	}
+
+	if (num_raw_windows > 0) {
+		const char *window_env;
+		int window = 0;
+
+		if (!RAW_flag) {
+			fprintf(stderr, "NOTE: -S and -E are ignored unless a raw file is specified\n");
+		} else if ((window_env = getenv(FS_USAGE_RAW_WINDOW_ENV)) != NULL) {
+			char *endptr;
+
+			window = (int)strtol(window_env, &endptr, 10);
+
+			if (window < 0 || window >= num_raw_windows) {
+				fprintf(stderr, "ERROR: bad %s\n", FS_USAGE_RAW_WINDOW_ENV);
+				exit(1);
+			}
+
+			if (*endptr == ',' && !wideflag)
+				columns = (unsigned int)strtoul(endptr + 1, NULL, 10);
+		} else if (num_raw_windows > 1) {
+			exit(run_raw_windows(orig_argv));
+		}
+
+		start_time_ns = raw_windows[window].start_ns;
+		end_time_ns = raw_windows[window].end_ns;
+	}
+
 	if (!RAW_flag) {
 		if (geteuid() != 0) {
 			fprintf(stderr, "'fs_usage' must be run as root...\n");
@@ -919,6 +1320,21 @@ main(int argc, char *argv[])
 	ktrace_set_signal_handler(s);
 
 	ktrace_set_completion_handler(s, ^{
+		if (pipeline_flag)
+			pipeline_finish();
+		if (summary_flag)
+			summary_print();
+		if (histogram_flag)
+			diskio_hist_print();
+		if (top_flag)
+			top_print();
+		if (th_stats_flag)
+			event_print_stats();
+		if (path_cache_file)
+			path_cache_save(path_cache_file);
+		output_flush();
+		if (bench_flag)
+			bench_print();
 		exit(0);
 	});
 
@@ -930,14 +1346,19 @@ main(int argc, char *argv[])
 	});
 	dispatch_activate(sigwinch_source);
 
-	init_shared_cache_mapping();
-
 	cache_disk_names();
 
+	if (path_cache_file)
+		path_cache_load(path_cache_file);
+
 	setup_ktrace_callbacks();
 
+	if (pipeline_flag)
+		pipeline_start();
+
 	ktrace_set_dropped_events_handler(s, ^{
 		fprintf(stderr, "fs_usage: buffer overrun, events generated too quickly\n");
+		bench.overruns++;
 
 		/* clear any state that is now potentially invalid */
 
@@ -952,6 +1373,10 @@ main(int argc, char *argv[])
 	/* no need to symbolicate addresses */
 	ktrace_set_uuid_map_enabled(s, KTRACE_FEATURE_DISABLED);
 
+	if (bench_flag)
+		bench_count_allocations();
+	bench.start_ns = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+
 	rv = ktrace_start(s, dispatch_get_main_queue());
 
 	if (rv) {
@@ -959,6 +1384,50 @@ main(int argc, char *argv[])
 		exit(1);
 	}
 
+	/*
+	 * When replaying a raw file the events arrive far faster than real time,
+	 * so only the final table at completion is meaningful.
+	 */
+	if (summary_flag && !RAW_flag) {
+		summary_timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, dispatch_get_main_queue());
+		dispatch_source_set_timer(summary_timer, dispatch_time(DISPATCH_TIME_NOW, summary_interval_ns), summary_interval_ns, NSEC_PER_SEC / 10);
+		dispatch_source_set_event_handler(summary_timer, ^{
+			summary_print();
+		});
+		dispatch_activate(summary_timer);
+	}
+
+	if (top_flag && !RAW_flag) {
+		top_timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, dispatch_get_main_queue());
+		dispatch_source_set_timer(top_timer, dispatch_time(DISPATCH_TIME_NOW, top_interval_ns), top_interval_ns, NSEC_PER_SEC / 10);
+		dispatch_source_set_event_handler(top_timer, ^{
+			top_print();
+		});
+		dispatch_activate(top_timer);
+	}
+
+	if (histogram_flag && !RAW_flag) {
+		histogram_timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, dispatch_get_main_queue());
+		dispatch_source_set_timer(histogram_timer, dispatch_time(DISPATCH_TIME_NOW, histogram_interval_ns), histogram_interval_ns, NSEC_PER_SEC / 10);
+		dispatch_source_set_event_handler(histogram_timer, ^{
+			diskio_hist_print();
+		});
+		dispatch_activate(histogram_timer);
+	}
+
+	/*
+	 * Structured output is only written when the buffer fills; when tracing
+	 * live, also push it out once a second so a reader isn't left waiting.
+	 */
+	if (output_format != OUTPUT_TEXT && !RAW_flag && !pipeline_flag) {
+		output_flush_timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, dispatch_get_main_queue());
+		dispatch_source_set_timer(output_flush_timer, dispatch_time(DISPATCH_TIME_NOW, NSEC_PER_SEC), NSEC_PER_SEC, NSEC_PER_SEC / 10);
+		dispatch_source_set_event_handler(output_flush_timer, ^{
+			output_flush();
+		});
+		dispatch_activate(output_flush_timer);
+	}
+
 	if (time_limit_ns > 0) {
 		dispatch_after(dispatch_time(DISPATCH_TIME_NOW, time_limit_ns),
 				dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0),
@@ -975,7 +1444,37 @@ main(int argc, char *argv[])
 void
 setup_ktrace_callbacks(void)
 {
-	ktrace_events_subclass(s, DBG_MACH, DBG_MACH_EXCP_SC, ^(ktrace_event_t event) {
+	bool want_filesys, want_diskio, want_pageins, want_syscalls, want_lookups;
+	int index;
+
+	init_syscall_filter();
+
+	/*
+	 * Only ask for the subclasses the -f modes can show: ktrace builds the
+	 * kernel's typefilter from the registered callbacks, so the rest are
+	 * never recorded or copied out.  The pid and command lists are already
+	 * handed to ktrace in main().
+	 */
+	want_filesys = (filter_mode == DEFAULT_DO_NOT_FILTER) || (filter_mode & (FILESYS_FILTER | PATHNAME_FILTER));
+	want_diskio = (filter_mode == DEFAULT_DO_NOT_FILTER) || (filter_mode & (FILESYS_FILTER | DISKIO_FILTER)) || histogram_flag;
+	want_pageins = want_filesys || show_cachehits;
+
+	/*
+	 * diskio names metadata blocks by the paths the calls that modified
+	 * them looked up, so those calls are traced even though they're not
+	 * printed; see init_syscall_filter().
+	 */
+	want_lookups = want_filesys || (filter_mode & DISKIO_FILTER);
+
+	want_syscalls = want_lookups;
+	for (index = 0; index < MAX_BSD_SYSCALL; index++) {
+		if (bsd_syscall_wanted[index]) {
+			want_syscalls = true;
+			break;
+		}
+	}
+
+	events_subclass(want_lookups, "DBG_MACH_EXCP_SC", DBG_MACH, DBG_MACH_EXCP_SC, ^(ktrace_event_t event) {
 		int type;
 
 		type = event->debugid & KDBG_EVENTID_MASK;
@@ -989,7 +1488,7 @@ setup_ktrace_callbacks(void)
 		}
 	});
 
-	ktrace_events_subclass(s, DBG_MACH, DBG_MACH_VM, ^(ktrace_event_t event) {
+	events_subclass(want_pageins, "DBG_MACH_VM", DBG_MACH, DBG_MACH_VM, ^(ktrace_event_t event) {
 		th_info_t ti;
 		unsigned int type;
 
@@ -1031,7 +1530,7 @@ setup_ktrace_callbacks(void)
 	});
 
 	if (include_waited_flag || RAW_flag) {
-		ktrace_events_subclass(s, DBG_MACH, DBG_MACH_SCHED, ^(ktrace_event_t event) {
+		events_subclass(true, "DBG_MACH_SCHED", DBG_MACH, DBG_MACH_SCHED, ^(ktrace_event_t event) {
 			int type;
 
 			type = event->debugid & KDBG_EVENTID_MASK;
@@ -1045,7 +1544,7 @@ setup_ktrace_callbacks(void)
 		});
 	}
 
-	ktrace_events_subclass(s, DBG_FSYSTEM, DBG_FSRW, ^(ktrace_event_t event) {
+	events_subclass(true, "DBG_FSRW", DBG_FSYSTEM, DBG_FSRW, ^(ktrace_event_t event) {
 		th_info_t ti;
 		int type;
 
@@ -1122,7 +1621,7 @@ setup_ktrace_callbacks(void)
 		}
 	});
 
-	ktrace_events_subclass(s, DBG_FSYSTEM, DBG_DKRW, ^(ktrace_event_t event) {
+	events_subclass(want_diskio, "DBG_DKRW", DBG_FSYSTEM, DBG_DKRW, ^(ktrace_event_t event) {
 		struct diskio *dio;
 		unsigned int type;
 
@@ -1139,7 +1638,7 @@ setup_ktrace_callbacks(void)
 		}
 	});
 
-	ktrace_events_subclass(s, DBG_FSYSTEM, DBG_IOCTL, ^(ktrace_event_t event) {
+	events_subclass(want_filesys, "DBG_IOCTL", DBG_FSYSTEM, DBG_IOCTL, ^(ktrace_event_t event) {
 		th_info_t ti;
 		int type;
 		pid_t pid;
@@ -1152,6 +1651,8 @@ setup_ktrace_callbacks(void)
 
 				if (check_filter_mode(pid, NULL, SPEC_unmap_info, 0, 0, "SPEC_unmap_info"))
 					format_print(NULL, "  TrimExtent", event, type, FMT_UNMAP_INFO, event->timestamp, event->timestamp, 0, "", NULL);
+				else
+					events_filtered++;
 
 				break;
 
@@ -1174,7 +1675,7 @@ setup_ktrace_callbacks(void)
 	});
 
 	if (BC_flag || RAW_flag) {
-		ktrace_events_subclass(s, DBG_FSYSTEM, DBG_BOOTCACHE, ^(ktrace_event_t event) {
+		events_subclass(want_diskio, "DBG_BOOTCACHE", DBG_FSYSTEM, DBG_BOOTCACHE, ^(ktrace_event_t event) {
 			struct diskio *dio;
 			unsigned int type;
 
@@ -1224,6 +1725,11 @@ setup_ktrace_callbacks(void)
 		if (!bsd_syscalls[index].sc_name)
 			return;
 
+		if (!bsd_syscall_wanted[index]) {
+			events_filtered++;
+			return;
+		}
+
 		if (event->debugid & DBG_FUNC_START) {
 			event_enter(type, event);
 		} else {
@@ -1231,14 +1737,21 @@ setup_ktrace_callbacks(void)
 		}
 	};
 
-	ktrace_events_subclass(s, DBG_BSD, DBG_BSD_EXCP_SC, bsd_sc_proc_cb);
-	ktrace_events_subclass(s, DBG_BSD, DBG_BSD_PROC, bsd_sc_proc_cb);
+	events_subclass(want_syscalls, "DBG_BSD_EXCP_SC", DBG_BSD, DBG_BSD_EXCP_SC, bsd_sc_proc_cb);
+	/* always wanted, to see processes exit */
+	events_subclass(true, "DBG_BSD_PROC", DBG_BSD, DBG_BSD_PROC, bsd_sc_proc_cb);
 
-	ktrace_events_range(s, KDBG_EVENTID(DBG_BSD, DBG_BSD_SC_EXTENDED_INFO, 0), KDBG_EVENTID(DBG_BSD, DBG_BSD_SC_EXTENDED_INFO2 + 1, 0), ^(ktrace_event_t event) {
-		extend_syscall(event->threadid, event->debugid & KDBG_EVENTID_MASK, event);
-	});
+	if (want_syscalls) {
+		ktrace_events_range(s, KDBG_EVENTID(DBG_BSD, DBG_BSD_SC_EXTENDED_INFO, 0), KDBG_EVENTID(DBG_BSD, DBG_BSD_SC_EXTENDED_INFO2 + 1, 0), ^(ktrace_event_t event) {
+			events_dispatch(^(ktrace_event_t ev) {
+				extend_syscall(ev->threadid, ev->debugid & KDBG_EVENTID_MASK, ev);
+			}, event);
+		});
+	} else {
+		excluded_subclasses[excluded_subclass_count++] = "DBG_BSD_SC_EXTENDED_INFO";
+	}
 
-	ktrace_events_subclass(s, DBG_CORESTORAGE, DBG_CS_IO, ^(ktrace_event_t event) {
+	events_subclass(want_diskio, "DBG_CS_IO", DBG_CORESTORAGE, DBG_CS_IO, ^(ktrace_event_t event) {
 		// the usual DBG_FUNC_START/END does not work for i/o since it will
 		// return on a different thread, this code uses the P_CS_IO_Done (0x4) bit
 		// instead. the trace command doesn't know how handle either method
@@ -1280,7 +1793,7 @@ setup_ktrace_callbacks(void)
 		}
 	});
 
-	ktrace_events_subclass(s, DBG_CORESTORAGE, 1 /* DBG_CS_SYNC */, ^(ktrace_event_t event) {
+	events_subclass(want_filesys, "DBG_CS_SYNC", DBG_CORESTORAGE, 1 /* DBG_CS_SYNC */, ^(ktrace_event_t event) {
 		int cs_type = event->debugid & P_CS_Type_Mask; // strip out the done bit
 		bool start = (event->debugid & P_CS_IO_Done) != P_CS_IO_Done;
 
@@ -1294,6 +1807,42 @@ setup_ktrace_callbacks(void)
 	});
 }
 
+/*
+ * Register callback for a subclass if wanted, counting the events it sees,
+ * or remember that the kernel was told to leave it out.
+ */
+static void
+events_subclass(bool wanted, const char *name, uint32_t class, uint32_t subclass, void (^callback)(ktrace_event_t event))
+{
+	if (!wanted) {
+		os_assert(excluded_subclass_count < MAX_EXCLUDED_SUBCLASSES);
+		excluded_subclasses[excluded_subclass_count++] = name;
+		return;
+	}
+
+	ktrace_events_subclass(s, class, subclass, ^(ktrace_event_t event) {
+		events_dispatch(callback, event);
+	});
+}
+
+/* count, and with -B time, the events handed to the callbacks */
+static inline void
+events_dispatch(void (^callback)(ktrace_event_t event), ktrace_event_t event)
+{
+	uint64_t start_ns;
+
+	events_received++;
+
+	if (!bench_flag) {
+		callback(event);
+		return;
+	}
+
+	start_ns = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+	callback(event);
+	bench.callback_ns += clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - start_ns;
+}
+
 static void
 extend_syscall_rw(th_info_t ti, ktrace_event_t event)
 {
@@ -1602,32 +2151,134 @@ check_filter_mode(pid_t pid, th_info_t ti, uint64_t type, int error, int retval,
 	return ret;
 }
 
-int
-print_open(ktrace_event_t event, uint64_t flags)
+/*
+ * So that the -f filters can throw away system calls before any state is
+ * kept for them, each BSD system call is put in one of these classes, which
+ * mirror the cases in check_filter_mode().  Calls which read or change the
+ * network fd state are kept whenever a network or filesys filter needs
+ * that state to be right.
+ */
+#define SC_CLASS_FILESYS	0
+#define SC_CLASS_NETWORK	1	/* network only; marks fds as sockets */
+#define SC_CLASS_FD		2	/* network or filesys depending on the fd */
+#define SC_CLASS_FD_STATE	3	/* only tracked for fd state */
+#define SC_CLASS_EXEC		4
+
+static int
+syscall_filter_class(int type)
 {
-	char mode[] = {
-		'_',
-		'_',
-		(flags & O_CREAT) ? 'C' : '_',
-		(flags & O_APPEND) ? 'A' : '_',
-		(flags & O_TRUNC) ? 'T' : '_',
-		(flags & O_EXCL) ? 'E' : '_',
-		(flags & O_NONBLOCK) ? 'N' : '_',
-		(flags & O_SHLOCK) ? 'l' : (flags & O_EXLOCK) ? 'L' : '_',
-		(flags & O_NOFOLLOW) ? 'F' : '_',
-		(flags & O_SYMLINK) ? 'S' : '_',
-		(flags & O_EVTONLY) ? 'V' : '_',
-		(flags & O_CLOEXEC) ? 'X' : '_',
-		'\0',
-	};
+	switch (type) {
+		case BSC_close:
+		case BSC_close_nocancel:
+		case BSC_guarded_close_np:
+		case BSC_read:
+		case BSC_write:
+		case BSC_read_nocancel:
+		case BSC_write_nocancel:
+			return SC_CLASS_FD;
 
-	if (flags & O_RDWR) {
-		mode[0] = 'R';
-		mode[1] = 'W';
-	} else if (flags & O_WRONLY) {
-		mode[1] = 'W';
-	} else {
-		mode[0] = 'R';
+		case BSC_accept:
+		case BSC_accept_nocancel:
+		case BSC_socket:
+		case BSC_recvfrom:
+		case BSC_sendto:
+		case BSC_recvmsg:
+		case BSC_sendmsg:
+		case BSC_connect:
+		case BSC_bind:
+		case BSC_listen:
+		case BSC_sendto_nocancel:
+		case BSC_recvfrom_nocancel:
+		case BSC_recvmsg_nocancel:
+		case BSC_sendmsg_nocancel:
+		case BSC_connect_nocancel:
+		case BSC_select:
+		case BSC_select_nocancel:
+		case BSC_socketpair:
+			return SC_CLASS_NETWORK;
+
+		case BSC_dup:
+		case BSC_dup2:
+			return SC_CLASS_FD_STATE;
+
+		case BSC_execve:
+		case BSC_posix_spawn:
+			return SC_CLASS_EXEC;
+	}
+
+	return SC_CLASS_FILESYS;
+}
+
+void
+init_syscall_filter(void)
+{
+	bool fd_state_needed, meta_names_needed;
+	int index;
+
+	fd_state_needed = (filter_mode & (NETWORK_FILTER | FILESYS_FILTER)) != 0;
+
+	/*
+	 * diskio names a metadata block after the last path looked up by the
+	 * call that modified it, so the calls that look up paths still have to
+	 * be followed; check_filter_mode() keeps them from being printed.
+	 */
+	meta_names_needed = (filter_mode & DISKIO_FILTER) != 0;
+
+	for (index = 0; index < MAX_BSD_SYSCALL; index++) {
+		bool wanted;
+
+		/* pathname filtering can't be decided until the call returns */
+		if (filter_mode == DEFAULT_DO_NOT_FILTER || (filter_mode & PATHNAME_FILTER)) {
+			bsd_syscall_wanted[index] = true;
+			continue;
+		}
+
+		switch (syscall_filter_class(BSC_BASE | (index << 2))) {
+			case SC_CLASS_NETWORK:
+			case SC_CLASS_FD:
+			case SC_CLASS_FD_STATE:
+				wanted = fd_state_needed;
+				break;
+
+			case SC_CLASS_EXEC:
+				wanted = (filter_mode & (EXEC_FILTER | FILESYS_FILTER)) != 0 || meta_names_needed;
+				break;
+
+			default:
+				wanted = (filter_mode & FILESYS_FILTER) != 0 || meta_names_needed;
+				break;
+		}
+
+		bsd_syscall_wanted[index] = wanted;
+	}
+}
+
+int
+print_open(ktrace_event_t event, uint64_t flags)
+{
+	char mode[] = {
+		'_',
+		'_',
+		(flags & O_CREAT) ? 'C' : '_',
+		(flags & O_APPEND) ? 'A' : '_',
+		(flags & O_TRUNC) ? 'T' : '_',
+		(flags & O_EXCL) ? 'E' : '_',
+		(flags & O_NONBLOCK) ? 'N' : '_',
+		(flags & O_SHLOCK) ? 'l' : (flags & O_EXLOCK) ? 'L' : '_',
+		(flags & O_NOFOLLOW) ? 'F' : '_',
+		(flags & O_SYMLINK) ? 'S' : '_',
+		(flags & O_EVTONLY) ? 'V' : '_',
+		(flags & O_CLOEXEC) ? 'X' : '_',
+		'\0',
+	};
+
+	if (flags & O_RDWR) {
+		mode[0] = 'R';
+		mode[1] = 'W';
+	} else if (flags & O_WRONLY) {
+		mode[1] = 'W';
+	} else {
+		mode[0] = 'R';
 	}
 
 	if (event->arg1) {
@@ -1649,28 +2300,16 @@ format_print(th_info_t ti, char *sc_name, ktrace_event_t event,
 	     uint64_t type, int format, uint64_t now, uint64_t stime,
 	     int waited, const char *pathname, struct diskio *dio)
 {
-	uint64_t secs, usecs;
-	int nopadding = 0;
-	static time_t last_walltime_secs = -1;
 	const char *command_name;
 	pid_t pid;
-	int len = 0;
-	int clen = 0;
-	size_t tlen = 0;
-	uint64_t class;
-	uint64_t user_addr;
-	uint64_t user_size;
-	char *framework_name;
-	char *framework_type;
-	char *p1;
-	char *p2;
-	char buf[2 * PATH_MAX + 64];
-	char cs_diskname[32];
 	uint64_t threadid;
+	uint64_t elapsed_ns;
+	uint64_t bench_start_ns = 0;
 	struct timeval now_walltime;
 
-	static char timestamp[32];
-	static size_t timestamp_len = 0;
+	/* the histograms and top screen replace the per-event output */
+	if (histogram_flag || top_flag)
+		return;
 
 	if (!mach_time_of_first_event)
 		mach_time_of_first_event = now;
@@ -1689,16 +2328,8 @@ format_print(th_info_t ti, char *sc_name, ktrace_event_t event,
 		return;
 
 	/* honor -S and -E */
-	if (RAW_flag) {
-		uint64_t relative_time_ns;
-
-		relative_time_ns = mach_to_nano(now - mach_time_of_first_event);
-
-		if (relative_time_ns < start_time_ns || relative_time_ns > end_time_ns)
-			return;
-	}
-
-	class = KDBG_EXTRACT_CLASS(type);
+	if (!raw_time_in_window(now))
+		return;
 
 	if (dio) {
 		command_name = dio->issuing_command;
@@ -1727,6 +2358,80 @@ format_print(th_info_t ti, char *sc_name, ktrace_event_t event,
 
 	os_assert(now_walltime.tv_sec || now_walltime.tv_usec);
 
+	/*
+	 * Look up the paths that need the ktrace session or the metadata hash
+	 * here, so that format_emit() itself can run on the formatting thread.
+	 */
+	if (output_format != OUTPUT_TEXT || columns > MAXCOLS || wideflag) {
+		if (format == FMT_HFS_update) {
+			pathname = ktrace_get_path_for_vp(s, event->arg1);
+		} else if (format == FMT_DISKIO && !dio->io_errno) {
+			if (dio->is_meta) {
+				if (!(type & P_DISKIO_READ))
+					pathname = meta_find_name(dio->blkno);
+			} else {
+				pathname = ktrace_get_path_for_vp(s, dio->vnodeid);
+			}
+		}
+
+		if (!pathname)
+			pathname = "";
+	}
+
+	elapsed_ns = mach_to_nano(now - stime);
+
+	if (bench_flag) {
+		bench.formatted++;
+		bench_start_ns = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+	}
+
+	if (pipeline_flag) {
+		pipeline_enqueue(ti, sc_name, event, type, format, elapsed_ns, waited,
+				pathname, dio, command_name, pid, threadid, now_walltime);
+	} else {
+		format_emit(ti, sc_name, event, type, format, elapsed_ns, waited,
+				pathname, dio, command_name, pid, threadid, now_walltime);
+	}
+
+	if (bench_flag)
+		bench.format_ns += clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - bench_start_ns;
+}
+
+/*
+ * called from:
+ *
+ * format_print(), or the formatting thread with -P
+ */
+static void
+format_emit(th_info_t ti, const char *sc_name, ktrace_event_t event,
+	    uint64_t type, int format, uint64_t elapsed_ns, int waited,
+	    const char *pathname, struct diskio *dio, const char *command_name,
+	    pid_t pid, uint64_t threadid, struct timeval now_walltime)
+{
+	uint64_t secs, usecs;
+	int nopadding = 0;
+	static time_t last_walltime_secs = -1;
+	int len = 0;
+	int clen = 0;
+	size_t tlen = 0;
+	uint64_t user_addr;
+	uint64_t user_size;
+	char *framework_name;
+	char *framework_type;
+	char *p1;
+	char *p2;
+	char buf[2 * PATH_MAX + 64];
+	char cs_diskname[32];
+
+	static char timestamp[32];
+	static size_t timestamp_len = 0;
+
+	if (output_format != OUTPUT_TEXT) {
+		output_record(ti, sc_name, event, format, command_name, pid, threadid,
+				now_walltime, elapsed_ns, pathname, dio);
+		return;
+	}
+
 	/* try and reuse the timestamp string */
 	if (last_walltime_secs != now_walltime.tv_sec) {
 		timestamp_len = strftime(timestamp, sizeof (timestamp), "%H:%M:%S", localtime(&now_walltime.tv_sec));
@@ -1868,11 +2573,6 @@ format_print(th_info_t ti, char *sc_name, ktrace_event_t event,
 
 				free(sbuf);
 
-				pathname = ktrace_get_path_for_vp(s, event->arg1);
-
-				if (!pathname)
-					pathname = "";
-
 				nopadding = 1;
 
 				break;
@@ -1890,17 +2590,6 @@ format_print(th_info_t ti, char *sc_name, ktrace_event_t event,
 					else
 						clen += printf(" D=0x%8.8" PRIx64 "  B=0x%-6" PRIx64 " /dev/%s ", dio->blkno, dio->iosize, find_disk_name(dio->dev));
 
-					if (dio->is_meta) {
-						if (!(type & P_DISKIO_READ)) {
-							pathname = meta_find_name(dio->blkno);
-						}
-					} else {
-						pathname = ktrace_get_path_for_vp(s, dio->vnodeid);
-
-						if (!pathname)
-							pathname = "";
-					}
-
 					nopadding = 1;
 				}
 
@@ -2892,7 +3581,7 @@ format_print(th_info_t ti, char *sc_name, ktrace_event_t event,
 	 * insures that we see a minimum of 1 us for
 	 * an elapsed time
 	 */
-	usecs = (mach_to_nano(now - stime) + (NSEC_PER_USEC - 1)) / NSEC_PER_USEC;
+	usecs = (elapsed_ns + (NSEC_PER_USEC - 1)) / NSEC_PER_USEC;
 	secs = usecs / USEC_PER_SEC;
 	usecs -= secs * USEC_PER_SEC;
 
@@ -2911,914 +3600,2455 @@ format_print(th_info_t ti, char *sc_name, ktrace_event_t event,
 	else
 		printf("%s%s %3llu.%06llu%s %-12.12s\n", p1, pathname, secs, usecs, p2, command_name);
 
-	if (!RAW_flag)
+	/* the formatting thread flushes whenever it catches up */
+	if (!RAW_flag && !pipeline_flag)
 		fflush(stdout);
 }
 
-#pragma mark metadata info hash routines
-
-#define VN_HASH_SIZE	16384
-#define VN_HASH_MASK	(VN_HASH_SIZE - 1)
+#pragma mark formatting pipeline routines
 
-typedef struct meta_info {
-	struct meta_info *m_next;
-	uint64_t m_blkno;
-	char m_name[MAXPATHLEN];
-} *meta_info_t;
+/*
+ * Single-producer, single-consumer byte ring.  The head and tail are
+ * free-running byte counts: the ktrace queue only advances the head and the
+ * formatting thread only advances the tail.  Records are variable length
+ * (a fixed header and the strings that follow it) and never wrap; a zero
+ * length marks the unused space at the end of the ring.  When the ring is
+ * full the record is dropped rather than stalling the ktrace queue.
+ */
+#define PIPELINE_RING_SIZE	(16 * 1024 * 1024)
+#define PIPELINE_RING_MASK	(PIPELINE_RING_SIZE - 1)
 
-meta_info_t m_info_hash[VN_HASH_SIZE];
+#define PIPELINE_HAS_TI		0x1
+#define PIPELINE_HAS_EVENT	0x2
+#define PIPELINE_HAS_DIO	0x4
 
-void
-meta_add_name(uint64_t blockno, const char *pathname)
-{
-	meta_info_t	mi;
-	int hashid;
+struct pipeline_record {
+	uint32_t length;
+	uint32_t flags;
+	uint64_t type;
+	int format;
+	int waited;
+	uint64_t elapsed_ns;
+	uint64_t threadid;
+	pid_t pid;
+	uint16_t sc_name_len;
+	uint16_t command_len;
+	uint16_t path_len;
+	uint16_t path2_len;
+	struct timeval walltime;
+	uint64_t ti_args[8];
+	struct ktrace_event event;
+	struct diskio dio;
+	char strings[];
+};
 
-	hashid = blockno & VN_HASH_MASK;
+char *pipeline_ring;
+_Atomic uint64_t pipeline_head;
+_Atomic uint64_t pipeline_tail;
+_Atomic bool pipeline_consumer_waiting;
+_Atomic bool pipeline_done;
+dispatch_semaphore_t pipeline_sema;
+pthread_t pipeline_thread;
 
-	for (mi = m_info_hash[hashid]; mi; mi = mi->m_next) {
-		if (mi->m_blkno == blockno)
-			break;
-	}
+/* only touched by the ktrace queue */
+uint64_t pipeline_enqueued = 0;
+uint64_t pipeline_dropped = 0;
+uint64_t pipeline_peak_backlog = 0;
 
-	if (mi == NULL) {
-		mi = malloc(sizeof (struct meta_info));
+/* only touched by the formatting thread */
+_Atomic uint64_t pipeline_formatted;
 
-		mi->m_next = m_info_hash[hashid];
-		m_info_hash[hashid] = mi;
-		mi->m_blkno = blockno;
+static void
+pipeline_consume(struct pipeline_record *rec)
+{
+	static struct th_info ti;
+	const char *sc_name, *command_name, *pathname;
+
+	sc_name = rec->strings;
+	command_name = sc_name + rec->sc_name_len + 1;
+	pathname = command_name + rec->command_len + 1;
+
+	if (rec->flags & PIPELINE_HAS_TI) {
+		ti.arg1 = rec->ti_args[0];
+		ti.arg2 = rec->ti_args[1];
+		ti.arg3 = rec->ti_args[2];
+		ti.arg4 = rec->ti_args[3];
+		ti.arg5 = rec->ti_args[4];
+		ti.arg6 = rec->ti_args[5];
+		ti.arg7 = rec->ti_args[6];
+		ti.arg8 = rec->ti_args[7];
+		strlcpy(ti.pathname2, pathname + rec->path_len + 1, sizeof (ti.pathname2));
 	}
 
-	strncpy(mi->m_name, pathname, sizeof (mi->m_name));
+	format_emit((rec->flags & PIPELINE_HAS_TI) ? &ti : NULL, sc_name,
+			(rec->flags & PIPELINE_HAS_EVENT) ? &rec->event : NULL,
+			rec->type, rec->format, rec->elapsed_ns, rec->waited, pathname,
+			(rec->flags & PIPELINE_HAS_DIO) ? &rec->dio : NULL,
+			command_name, rec->pid, rec->threadid, rec->walltime);
 }
 
-const char *
-meta_find_name(uint64_t blockno)
+static void *
+pipeline_main(void *arg __unused)
 {
-	meta_info_t	mi;
-	int		hashid;
+	uint64_t tail = atomic_load_explicit(&pipeline_tail, memory_order_relaxed);
 
-	hashid = blockno & VN_HASH_MASK;
+	for (;;) {
+		struct pipeline_record *rec;
+		uint64_t head;
+		size_t pos;
 
-	for (mi = m_info_hash[hashid]; mi; mi = mi->m_next) {
-		if (mi->m_blkno == blockno)
-			return mi->m_name;
+		head = atomic_load_explicit(&pipeline_head, memory_order_acquire);
+
+		if (tail == head) {
+			/* caught up, so this is a good time to write out what we have */
+			fflush(stdout);
+			output_flush();
+
+			if (atomic_load(&pipeline_done) &&
+					atomic_load_explicit(&pipeline_head, memory_order_acquire) == tail)
+				break;
+
+			atomic_store(&pipeline_consumer_waiting, true);
+
+			if (atomic_load_explicit(&pipeline_head, memory_order_acquire) == tail)
+				dispatch_semaphore_wait(pipeline_sema, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_MSEC));
+
+			atomic_store(&pipeline_consumer_waiting, false);
+			continue;
+		}
+
+		pos = tail & PIPELINE_RING_MASK;
+		rec = (struct pipeline_record *)&pipeline_ring[pos];
+
+		if (rec->length == 0) {
+			tail += PIPELINE_RING_SIZE - pos;
+		} else {
+			pipeline_consume(rec);
+			tail += rec->length;
+			atomic_fetch_add_explicit(&pipeline_formatted, 1, memory_order_relaxed);
+		}
+
+		atomic_store_explicit(&pipeline_tail, tail, memory_order_release);
 	}
 
-	return "";
+	return NULL;
 }
 
 void
-meta_delete_all(void)
+pipeline_start(void)
 {
-	meta_info_t mi, next;
-	int i;
+	int rv;
 
-	for (i = 0; i < HASH_MASK; i++) {
-		for (mi = m_info_hash[i]; mi; mi = next) {
-			next = mi->m_next;
+	pipeline_ring = malloc(PIPELINE_RING_SIZE);
+	os_assert(pipeline_ring != NULL);
 
-			free(mi);
-		}
+	pipeline_sema = dispatch_semaphore_create(0);
 
-		m_info_hash[i] = NULL;
+	if ((rv = pthread_create(&pipeline_thread, NULL, pipeline_main, NULL)) != 0) {
+		errc(1, rv, "pthread_create");
 	}
 }
 
-#pragma mark event ("thread info") routines
-
-th_info_t th_info_hash[HASH_SIZE];
-th_info_t th_info_freelist;
-
-static th_info_t
-add_event(ktrace_event_t event, int type)
+void
+pipeline_enqueue(th_info_t ti, const char *sc_name, ktrace_event_t event,
+		uint64_t type, int format, uint64_t elapsed_ns, int waited,
+		const char *pathname, struct diskio *dio, const char *command_name,
+		pid_t pid, uint64_t threadid, struct timeval now_walltime)
 {
-	th_info_t ti;
-	int hashid;
-	uint64_t eventid;
-
-	if ((ti = th_info_freelist))
-		th_info_freelist = ti->next;
-	else
-		ti = malloc(sizeof (struct th_info));
+	struct pipeline_record *rec;
+	size_t sc_name_len, command_len, path_len, path2_len;
+	size_t need, pos, pad;
+	uint64_t head, tail, backlog;
+	char *p;
 
-	bzero(ti, sizeof (struct th_info));
+	sc_name_len = strnlen(sc_name, UINT16_MAX);
+	command_len = strnlen(command_name, MAXCOMLEN);
+	path_len = strnlen(pathname, MAXPATHLEN);
+	path2_len = (format == FMT_MOUNT && ti) ? strnlen(ti->pathname2, MAXPATHLEN) : 0;
 
-	hashid = event->threadid & HASH_MASK;
+	need = sizeof (struct pipeline_record) + sc_name_len + command_len + path_len + path2_len + 4;
+	need = roundup(need, 8);
 
-	ti->next = th_info_hash[hashid];
-	th_info_hash[hashid] = ti;
+	head = atomic_load_explicit(&pipeline_head, memory_order_relaxed);
+	tail = atomic_load_explicit(&pipeline_tail, memory_order_acquire);
 
-	eventid = event->debugid & KDBG_EVENTID_MASK;
+	pos = head & PIPELINE_RING_MASK;
+	pad = (PIPELINE_RING_SIZE - pos < need) ? PIPELINE_RING_SIZE - pos : 0;
 
-	if (eventid == BSC_execve || eventid == BSC_posix_spawn) {
-		const char *command;
+	if (head + pad + need - tail > PIPELINE_RING_SIZE) {
+		pipeline_dropped++;
+		return;
+	}
 
-		command = ktrace_get_execname_for_thread(s, event->threadid);
+	if (pad) {
+		((struct pipeline_record *)&pipeline_ring[pos])->length = 0;
+		head += pad;
+		pos = 0;
+	}
 
-		if (!command)
-			command = "";
+	rec = (struct pipeline_record *)&pipeline_ring[pos];
+
+	rec->length = (uint32_t)need;
+	rec->flags = 0;
+	rec->type = type;
+	rec->format = format;
+	rec->waited = waited;
+	rec->elapsed_ns = elapsed_ns;
+	rec->threadid = threadid;
+	rec->pid = pid;
+	rec->walltime = now_walltime;
+	rec->sc_name_len = (uint16_t)sc_name_len;
+	rec->command_len = (uint16_t)command_len;
+	rec->path_len = (uint16_t)path_len;
+	rec->path2_len = (uint16_t)path2_len;
+
+	if (ti) {
+		rec->flags |= PIPELINE_HAS_TI;
+		rec->ti_args[0] = ti->arg1;
+		rec->ti_args[1] = ti->arg2;
+		rec->ti_args[2] = ti->arg3;
+		rec->ti_args[3] = ti->arg4;
+		rec->ti_args[4] = ti->arg5;
+		rec->ti_args[5] = ti->arg6;
+		rec->ti_args[6] = ti->arg7;
+		rec->ti_args[7] = ti->arg8;
+	}
 
-		strncpy(ti->command, command, sizeof (ti->command));
-		ti->command[MAXCOMLEN] = '\0';
+	if (event) {
+		rec->flags |= PIPELINE_HAS_EVENT;
+		rec->event = *event;
 	}
 
-	ti->thread = event->threadid;
-	ti->type = type;
+	if (dio) {
+		rec->flags |= PIPELINE_HAS_DIO;
+		rec->dio = *dio;
+	}
 
-	return ti;
+	p = rec->strings;
+	memcpy(p, sc_name, sc_name_len);
+	p[sc_name_len] = '\0';
+	p += sc_name_len + 1;
+	memcpy(p, command_name, command_len);
+	p[command_len] = '\0';
+	p += command_len + 1;
+	memcpy(p, pathname, path_len);
+	p[path_len] = '\0';
+	p += path_len + 1;
+	if (path2_len)
+		memcpy(p, ti->pathname2, path2_len);
+	p[path2_len] = '\0';
+
+	atomic_store_explicit(&pipeline_head, head + need, memory_order_release);
+
+	pipeline_enqueued++;
+	backlog = pipeline_enqueued - atomic_load_explicit(&pipeline_formatted, memory_order_relaxed);
+	if (backlog > pipeline_peak_backlog)
+		pipeline_peak_backlog = backlog;
+
+	if (atomic_exchange(&pipeline_consumer_waiting, false))
+		dispatch_semaphore_signal(pipeline_sema);
 }
 
-th_info_t
-event_find(uint64_t thread, int type)
+/*
+ * Drain whatever is still queued, then report how the formatting thread
+ * kept up.
+ */
+void
+pipeline_finish(void)
 {
-	th_info_t ti;
-	int hashid;
+	atomic_store(&pipeline_done, true);
+	dispatch_semaphore_signal(pipeline_sema);
+	pthread_join(pipeline_thread, NULL);
+
+	fprintf(stderr, "fs_usage: %" PRIu64 " records formatted, %" PRIu64 " dropped with the queue full, peak backlog %" PRIu64 " records\n",
+			atomic_load(&pipeline_formatted), pipeline_dropped, pipeline_peak_backlog);
+}
+
+#pragma mark structured output routines
+
+#define OUTPUT_BUF_SIZE	(1024 * 1024)
+
+/*
+ * -o bin layout: the file starts with OUTPUT_BIN_MAGIC, then a version and
+ * the size of struct output_bin_record.  Each record is that header followed
+ * by the call, command, path and device strings, without terminators, whose
+ * lengths are given in the header.  fd is -1 when the call has none.
+ */
+#define OUTPUT_BIN_MAGIC	"fs_usage"
+#define OUTPUT_BIN_VERSION	1
+
+struct output_bin_record {
+	uint32_t length;
+	int32_t pid;
+	uint64_t walltime_usec;
+	uint64_t elapsed_ns;
+	uint64_t thread;
+	int64_t fd;
+	uint64_t bytes;
+	uint64_t blkno;
+	int32_t error;
+	uint16_t call_len;
+	uint16_t command_len;
+	uint16_t path_len;
+	uint16_t dev_len;
+	uint32_t reserved;
+};
+
+char *output_buf = NULL;
+size_t output_len = 0;
+bool output_header_written = false;
 
-	hashid = thread & HASH_MASK;
+void
+output_flush(void)
+{
+	size_t off = 0;
 
-	for (ti = th_info_hash[hashid]; ti; ti = ti->next) {
-		if (ti->thread == thread) {
-			if (type == ti->type)
-				return ti;
+	while (off < output_len) {
+		ssize_t n = write(STDOUT_FILENO, output_buf + off, output_len - off);
 
-			if (type == 0)
-				return ti;
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			err(1, "write");
 		}
+
+		off += n;
 	}
 
-	return NULL;
+	output_len = 0;
 }
 
-void
-event_delete(th_info_t ti_to_delete)
+static void
+output_write(const void *data, size_t len)
 {
-	th_info_t	ti;
-	th_info_t	ti_prev;
-	int		hashid;
+	if (!output_buf) {
+		output_buf = malloc(OUTPUT_BUF_SIZE);
+		os_assert(output_buf != NULL);
+	}
 
-	hashid = ti_to_delete->thread & HASH_MASK;
+	if (output_len + len > OUTPUT_BUF_SIZE)
+		output_flush();
 
-	if ((ti = th_info_hash[hashid])) {
-		if (ti == ti_to_delete)
-			th_info_hash[hashid] = ti->next;
-		else {
-			ti_prev = ti;
+	if (len > OUTPUT_BUF_SIZE) {
+		ssize_t n;
 
-			for (ti = ti->next; ti; ti = ti->next) {
-				if (ti == ti_to_delete) {
-					ti_prev->next = ti->next;
-					break;
-				}
-				ti_prev = ti;
+		while (len > 0) {
+			if ((n = write(STDOUT_FILENO, data, len)) < 0) {
+				if (errno == EINTR)
+					continue;
+				err(1, "write");
 			}
+			data = (const char *)data + n;
+			len -= n;
 		}
-		if (ti) {
-			ti->next = th_info_freelist;
-			th_info_freelist = ti;
+
+		return;
+	}
+
+	memcpy(output_buf + output_len, data, len);
+	output_len += len;
+}
+
+static void
+output_printf(const char *fmt, ...) __printflike(1, 2);
+
+static void
+output_printf(const char *fmt, ...)
+{
+	char buf[256];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof (buf), fmt, ap);
+	va_end(ap);
+
+	if (len > 0)
+		output_write(buf, MIN((size_t)len, sizeof (buf) - 1));
+}
+
+static void
+output_json_string(const char *key, const char *value)
+{
+	char buf[2 * PATH_MAX];
+	size_t len = 0;
+	const unsigned char *p;
+
+	output_printf(",\"%s\":\"", key);
+
+	for (p = (const unsigned char *)value; *p; p++) {
+		if (len + 7 > sizeof (buf)) {
+			output_write(buf, len);
+			len = 0;
+		}
+
+		if (*p == '"' || *p == '\\') {
+			buf[len++] = '\\';
+			buf[len++] = *p;
+		} else if (*p < 0x20) {
+			len += snprintf(&buf[len], sizeof (buf) - len, "\\u%04x", *p);
+		} else {
+			buf[len++] = *p;
 		}
 	}
+
+	buf[len++] = '"';
+	output_write(buf, len);
+}
+
+static int64_t
+output_fd(th_info_t ti, ktrace_event_t event, int format)
+{
+	switch (format) {
+		case FMT_FD:
+		case FMT_FD_IO:
+		case FMT_FD_2:
+		case FMT_PREAD:
+		case FMT_LSEEK:
+		case FMT_FTRUNC:
+		case FMT_FCNTL:
+		case FMT_FCHMOD:
+		case FMT_FCHMOD_EXT:
+		case FMT_FCHFLAGS:
+		case FMT_FLOCK:
+		case FMT_IOCTL:
+		case FMT_IOCTL_SYNC:
+		case FMT_IOCTL_SYNCCACHE:
+		case FMT_IOCTL_UNMAP:
+			return (int64_t)(int)ti->arg1;
+
+		case FMT_OPEN:
+		case FMT_OPENAT:
+		case FMT_GUARDED_OPEN:
+		case FMT_SOCKET:
+			if (event->arg1 == 0)
+				return (int64_t)(int)event->arg2;
+			break;
+	}
+
+	return -1;
 }
 
+/*
+ * Called from format_emit() in place of the column formatting, after the
+ * -S/-E and kernel_task filtering.  The pathname is never clipped.
+ */
 void
-event_delete_all(void)
+output_record(th_info_t ti, const char *sc_name, ktrace_event_t event, int format,
+		const char *command_name, pid_t pid, uint64_t threadid, struct timeval walltime,
+		uint64_t elapsed_ns, const char *pathname, struct diskio *dio)
 {
-	th_info_t	ti = 0;
-	th_info_t	ti_next = 0;
-	int             i;
+	char cs_diskname[32];
+	const char *devname = NULL;
+	int64_t fd = -1;
+	uint64_t bytes = 0;
+	uint64_t blkno = 0;
+	int error = 0;
 
-	for (i = 0; i < HASH_SIZE; i++) {
+	while (*sc_name == ' ')
+		sc_name++;
 
-		for (ti = th_info_hash[i]; ti; ti = ti_next) {
-			ti_next = ti->next;
-			ti->next = th_info_freelist;
-			th_info_freelist = ti;
+	if (dio) {
+		error = (int)dio->io_errno;
+		blkno = dio->blkno;
+
+		if (!error)
+			bytes = dio->iosize;
+
+		if (format == FMT_DISKIO_CS)
+			devname = generate_cs_disk_name(dio->dev, cs_diskname);
+		else
+			devname = find_disk_name(dio->dev);
+	} else {
+		if (format != FMT_UNMAP_INFO)
+			error = (int)event->arg1;
+
+		if (ti)
+			fd = output_fd(ti, event, format);
+
+		if ((format == FMT_FD_IO || format == FMT_PREAD) && !error)
+			bytes = event->arg2;
+
+		if (format == FMT_SYNC_DISK_CS)
+			devname = generate_cs_disk_name(event->arg1, cs_diskname);
+	}
+
+	if (!pathname)
+		pathname = "";
+
+	if (output_format == OUTPUT_JSON) {
+		output_printf("{\"time\":%ld.%06d,\"pid\":%d,\"thread\":%" PRIu64,
+				(long)walltime.tv_sec, (int)walltime.tv_usec, pid, threadid);
+		output_json_string("command", command_name);
+		output_json_string("call", sc_name);
+
+		if (fd >= 0)
+			output_printf(",\"fd\":%" PRId64, fd);
+
+		output_printf(",\"bytes\":%" PRIu64 ",\"errno\":%d,\"elapsed_ns\":%" PRIu64,
+				bytes, error, elapsed_ns);
+
+		if (*pathname != '\0')
+			output_json_string("path", pathname);
+
+		if (devname) {
+			output_json_string("dev", devname);
+			output_printf(",\"blkno\":%" PRIu64, blkno);
+		}
+
+		output_write("}\n", 2);
+	} else {
+		struct output_bin_record rec;
+
+		if (!output_header_written) {
+			uint32_t hdr[2] = { OUTPUT_BIN_VERSION, sizeof (struct output_bin_record) };
+
+			output_write(OUTPUT_BIN_MAGIC, 8);
+			output_write(hdr, sizeof (hdr));
+			output_header_written = true;
 		}
-		th_info_hash[i] = 0;
+
+		bzero(&rec, sizeof (rec));
+		rec.pid = pid;
+		rec.walltime_usec = (uint64_t)walltime.tv_sec * USEC_PER_SEC + walltime.tv_usec;
+		rec.elapsed_ns = elapsed_ns;
+		rec.thread = threadid;
+		rec.fd = fd;
+		rec.bytes = bytes;
+		rec.blkno = blkno;
+		rec.error = error;
+		rec.call_len = (uint16_t)strlen(sc_name);
+		rec.command_len = (uint16_t)strlen(command_name);
+		rec.path_len = (uint16_t)strnlen(pathname, MAXPATHLEN);
+		rec.dev_len = devname ? (uint16_t)strlen(devname) : 0;
+		rec.length = (uint32_t)(sizeof (rec) + rec.call_len + rec.command_len + rec.path_len + rec.dev_len);
+
+		output_write(&rec, sizeof (rec));
+		output_write(sc_name, rec.call_len);
+		output_write(command_name, rec.command_len);
+		output_write(pathname, rec.path_len);
+
+		if (devname)
+			output_write(devname, rec.dev_len);
+	}
+}
+
+#pragma mark metadata info hash routines
+
+#define VN_HASH_SIZE	16384
+#define VN_HASH_MASK	(VN_HASH_SIZE - 1)
+
+typedef struct meta_info {
+	struct meta_info *m_next;
+	uint64_t m_blkno;
+	char m_name[MAXPATHLEN];
+} *meta_info_t;
+
+meta_info_t m_info_hash[VN_HASH_SIZE];
+
+void
+meta_add_name(uint64_t blockno, const char *pathname)
+{
+	meta_info_t	mi;
+	int hashid;
+
+	hashid = blockno & VN_HASH_MASK;
+
+	for (mi = m_info_hash[hashid]; mi; mi = mi->m_next) {
+		if (mi->m_blkno == blockno)
+			break;
+	}
+
+	if (mi == NULL) {
+		mi = malloc(sizeof (struct meta_info));
+
+		mi->m_next = m_info_hash[hashid];
+		m_info_hash[hashid] = mi;
+		mi->m_blkno = blockno;
 	}
+
+	strncpy(mi->m_name, pathname, sizeof (mi->m_name));
+}
+
+const char *
+meta_find_name(uint64_t blockno)
+{
+	meta_info_t	mi;
+	int		hashid;
+
+	hashid = blockno & VN_HASH_MASK;
+
+	for (mi = m_info_hash[hashid]; mi; mi = mi->m_next) {
+		if (mi->m_blkno == blockno)
+			return mi->m_name;
+	}
+
+	return "";
 }
 
 void
-event_enter(int type, ktrace_event_t event)
+meta_delete_all(void)
 {
+	meta_info_t mi, next;
+	int i;
+
+	for (i = 0; i < VN_HASH_SIZE; i++) {
+		for (mi = m_info_hash[i]; mi; mi = next) {
+			next = mi->m_next;
+
+			free(mi);
+		}
+
+		m_info_hash[i] = NULL;
+	}
+}
+
+#pragma mark event ("thread info") routines
+
+/*
+ * In-flight events live in an open-addressed table with linear probing.  The
+ * slot is hashed on the thread alone so that every event outstanding on a
+ * thread sits in the same probe run, which event_find(thread, 0) and
+ * event_mark_thread_waited() rely on.  The thread, type and insertion order
+ * are kept in the slot itself so probing never has to touch the (large)
+ * th_info.  Deletion shifts later entries back, so there are no tombstones,
+ * and the table doubles once it is more than 3/4 full.
+ */
+struct th_slot {
+	uint64_t thread;
+	uint64_t seq;
 	th_info_t ti;
+	int type;
+};
 
-#if DEBUG
-	int index;
-	bool found;
+#define TH_TABLE_INITIAL_SHIFT	10
+#define TH_INFO_SLAB_COUNT	64
 
-	found = false;
+struct th_slot *th_table = NULL;
+unsigned int th_table_shift = 0;
+size_t th_table_size = 0;
+size_t th_table_count = 0;
+uint64_t th_table_seq = 0;
+th_info_t th_info_freelist;
 
-	switch (type) {
-		case P_CS_SYNC_DISK:
-		case MACH_pageout:
-		case MACH_vmfault:
-		case MSC_map_fd:
-		case SPEC_ioctl:
-		case Throttled:
-		case HFS_update:
-			found = true;
+struct {
+	uint64_t lookups;
+	uint64_t probes;
+	uint64_t max_probes;
+	uint64_t grows;
+	size_t max_count;
+	size_t slabs;
+} th_stats;
+
+static inline size_t
+th_table_hash(uint64_t thread)
+{
+	return (size_t)((thread * 0x9e3779b97f4a7c15ULL) >> (64 - th_table_shift));
+}
+
+static inline void
+th_stats_record(uint64_t probes)
+{
+	th_stats.lookups++;
+	th_stats.probes += probes;
+
+	if (probes > th_stats.max_probes)
+		th_stats.max_probes = probes;
+}
+
+static uint64_t
+th_table_insert_slot(struct th_slot *slot)
+{
+	size_t mask = th_table_size - 1;
+	size_t i = th_table_hash(slot->thread);
+	uint64_t probes = 1;
+
+	while (th_table[i].ti) {
+		i = (i + 1) & mask;
+		probes++;
 	}
 
-	if ((type & CSC_MASK) == BSC_BASE) {
-		if ((index = BSC_INDEX(type)) < MAX_BSD_SYSCALL && bsd_syscalls[index].sc_name)
-			found = true;
+	th_table[i] = *slot;
+
+	return probes;
+}
+
+static void
+th_table_grow(void)
+{
+	struct th_slot *old_table = th_table;
+	size_t old_size = th_table_size;
+	size_t i;
+
+	th_table_shift = th_table_shift ? th_table_shift + 1 : TH_TABLE_INITIAL_SHIFT;
+	th_table_size = (size_t)1 << th_table_shift;
+	th_table = calloc(th_table_size, sizeof (struct th_slot));
+	os_assert(th_table != NULL);
+
+	for (i = 0; i < old_size; i++) {
+		if (old_table[i].ti)
+			th_table_insert_slot(&old_table[i]);
 	}
 
-	os_assert(found);
-#endif /* DEBUG */
+	free(old_table);
 
-	if ((ti = add_event(event, type)) == NULL)
-		return;
+	if (old_table)
+		th_stats.grows++;
+}
 
-	ti->stime  = event->timestamp;
-	ti->arg1   = event->arg1;
-	ti->arg2   = event->arg2;
-	ti->arg3   = event->arg3;
-	ti->arg4   = event->arg4;
+static th_info_t
+th_info_alloc(void)
+{
+	th_info_t ti;
+
+	if (!th_info_freelist) {
+		th_info_t slab;
+		int i;
+
+		slab = malloc(TH_INFO_SLAB_COUNT * sizeof (struct th_info));
+		os_assert(slab != NULL);
+
+		for (i = 0; i < TH_INFO_SLAB_COUNT; i++) {
+			slab[i].next = th_info_freelist;
+			th_info_freelist = &slab[i];
+		}
+
+		th_stats.slabs++;
+	}
+
+	ti = th_info_freelist;
+	th_info_freelist = ti->next;
+
+	return ti;
 }
 
-void
-event_exit(char *sc_name, int type, ktrace_event_t event, int format)
+static th_info_t
+add_event(ktrace_event_t event, int type)
 {
 	th_info_t ti;
-	pid_t pid;
+	struct th_slot slot;
+	uint64_t eventid;
 
-	if ((ti = event_find(event->threadid, type)) == NULL)
-		return;
+	if ((th_table_count + 1) * 4 > th_table_size * 3)
+		th_table_grow();
 
-	pid = ktrace_get_pid_for_thread(s, event->threadid);
+	ti = th_info_alloc();
 
-	if (check_filter_mode(pid, ti, type, (int)event->arg1, (int)event->arg2, sc_name)) {
-		const char *pathname;
+	bzero(ti, sizeof (struct th_info));
 
-		pathname = NULL;
+	eventid = event->debugid & KDBG_EVENTID_MASK;
 
-		/* most things are just interested in the first lookup */
-		if (ti->pathname[0] != '\0')
-			pathname = ti->pathname;
+	if (eventid == BSC_execve || eventid == BSC_posix_spawn) {
+		const char *command;
 
-		if (!pathname)
-			pathname = "";
+		command = ktrace_get_execname_for_thread(s, event->threadid);
+
+		if (!command)
+			command = "";
+
+		strncpy(ti->command, command, sizeof (ti->command));
+		ti->command[MAXCOMLEN] = '\0';
+	}
+
+	ti->thread = event->threadid;
+	ti->type = type;
+
+	slot.thread = event->threadid;
+	slot.type = type;
+	slot.seq = ++th_table_seq;
+	slot.ti = ti;
+
+	th_stats_record(th_table_insert_slot(&slot));
+
+	if (++th_table_count > th_stats.max_count)
+		th_stats.max_count = th_table_count;
+
+	return ti;
+}
+
+/*
+ * type 0 matches any event on the thread; as with the old chained hash
+ * (which pushed new events on the front), the most recent one wins.
+ */
+th_info_t
+event_find(uint64_t thread, int type)
+{
+	struct th_slot *slot, *found = NULL;
+	size_t mask, i;
+	uint64_t probes = 0;
+
+	if (th_table_count == 0)
+		return NULL;
+
+	mask = th_table_size - 1;
+
+	for (i = th_table_hash(thread); (slot = &th_table[i])->ti; i = (i + 1) & mask) {
+		probes++;
+
+		if (slot->thread != thread)
+			continue;
+
+		if (type == slot->type) {
+			found = slot;
+			break;
+		}
+
+		if (type == 0 && (!found || slot->seq > found->seq))
+			found = slot;
+	}
+
+	th_stats_record(probes + 1);
+
+	return found ? found->ti : NULL;
+}
+
+void
+event_delete(th_info_t ti_to_delete)
+{
+	size_t mask, i, j, home;
+
+	if (th_table_count == 0)
+		return;
+
+	mask = th_table_size - 1;
+
+	for (i = th_table_hash(ti_to_delete->thread); th_table[i].ti; i = (i + 1) & mask) {
+		if (th_table[i].ti == ti_to_delete)
+			break;
+	}
+
+	if (th_table[i].ti == NULL)
+		return;
+
+	/*
+	 * Shift back any entry further along the run whose home slot does not
+	 * lie cyclically within (i, j], so lookups never hit a premature hole.
+	 */
+	for (j = (i + 1) & mask; th_table[j].ti; j = (j + 1) & mask) {
+		home = th_table_hash(th_table[j].thread);
+
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			th_table[i] = th_table[j];
+			i = j;
+		}
+	}
+
+	th_table[i].ti = NULL;
+	th_table_count--;
+
+	ti_to_delete->next = th_info_freelist;
+	th_info_freelist = ti_to_delete;
+}
+
+void
+event_delete_all(void)
+{
+	size_t i;
+
+	for (i = 0; i < th_table_size; i++) {
+		th_info_t ti = th_table[i].ti;
+
+		if (ti) {
+			ti->next = th_info_freelist;
+			th_info_freelist = ti;
+			th_table[i].ti = NULL;
+		}
+	}
+
+	th_table_count = 0;
+}
+
+void
+event_print_stats(void)
+{
+	int i;
+
+	fprintf(stderr, "th_info table: %zu slots, %zu in use, %zu peak, %" PRIu64 " grows, %zu slabs\n",
+			th_table_size, th_table_count, th_stats.max_count, th_stats.grows, th_stats.slabs);
+	fprintf(stderr, "th_info probes: %" PRIu64 " operations, %.2f average, %" PRIu64 " max\n",
+			th_stats.lookups,
+			th_stats.lookups ? (double)th_stats.probes / th_stats.lookups : 0.0,
+			th_stats.max_probes);
+	fprintf(stderr, "disk I/Os: %" PRIu64 " in flight, %" PRIu64 " peak\n",
+			diskio_inflight, diskio_max_inflight);
+	fprintf(stderr, "events: %" PRIu64 " received, %" PRIu64 " filtered in userspace\n",
+			events_received, events_filtered);
+	fprintf(stderr, "filtered in the kernel:");
+	if (excluded_subclass_count == 0)
+		fprintf(stderr, " none");
+	for (i = 0; i < excluded_subclass_count; i++)
+		fprintf(stderr, " %s", excluded_subclasses[i]);
+	fprintf(stderr, "\n");
+}
+
+void
+event_enter(int type, ktrace_event_t event)
+{
+	th_info_t ti;
+
+#if DEBUG
+	int index;
+	bool found;
+
+	found = false;
+
+	switch (type) {
+		case P_CS_SYNC_DISK:
+		case MACH_pageout:
+		case MACH_vmfault:
+		case MSC_map_fd:
+		case SPEC_ioctl:
+		case Throttled:
+		case HFS_update:
+			found = true;
+	}
+
+	if ((type & CSC_MASK) == BSC_BASE) {
+		if ((index = BSC_INDEX(type)) < MAX_BSD_SYSCALL && bsd_syscalls[index].sc_name)
+			found = true;
+	}
+
+	os_assert(found);
+#endif /* DEBUG */
+
+	if ((ti = add_event(event, type)) == NULL)
+		return;
+
+	ti->stime  = event->timestamp;
+	ti->arg1   = event->arg1;
+	ti->arg2   = event->arg2;
+	ti->arg3   = event->arg3;
+	ti->arg4   = event->arg4;
+}
+
+void
+event_exit(char *sc_name, int type, ktrace_event_t event, int format)
+{
+	th_info_t ti;
+	pid_t pid;
+
+	if ((ti = event_find(event->threadid, type)) == NULL)
+		return;
+
+	pid = ktrace_get_pid_for_thread(s, event->threadid);
+
+	if (check_filter_mode(pid, ti, type, (int)event->arg1, (int)event->arg2, sc_name)) {
+		const char *pathname;
+
+		pathname = NULL;
+
+		/* most things are just interested in the first lookup */
+		if (ti->pathname[0] != '\0')
+			pathname = ti->pathname;
+
+		if (!pathname)
+			pathname = "";
+
+		if (summary_flag || top_flag) {
+			uint64_t bytes = 0;
+
+			if ((format == FMT_FD_IO || format == FMT_PREAD) && event->arg1 == 0)
+				bytes = event->arg2;
+
+			if (top_flag)
+				top_add_syscall(pid, event->threadid, type, event->timestamp, ti->stime, bytes);
+			if (summary_flag)
+				summary_add(pid, event->threadid, sc_name, event->timestamp, ti->stime, bytes);
+		} else {
+			format_print(ti, sc_name, event, type, format, event->timestamp, ti->stime, ti->waited, pathname, NULL);
+		}
+	} else {
+		events_filtered++;
+	}
+
+	event_delete(ti);
+}
+
+void
+event_mark_thread_waited(uint64_t thread)
+{
+	struct th_slot *slot;
+	size_t mask, i;
+
+	if (th_table_count == 0)
+		return;
+
+	mask = th_table_size - 1;
+
+	for (i = th_table_hash(thread); (slot = &th_table[i])->ti; i = (i + 1) & mask) {
+		if (slot->thread == thread)
+			slot->ti->waited = 1;
+	}
+}
+
+#pragma mark summary mode routines
+
+#define SUMMARY_HASH_SIZE	8192
+#define SUMMARY_HASH_MASK	(SUMMARY_HASH_SIZE - 1)
+#define SUMMARY_NAME_LEN	24
+
+struct summary_entry {
+	pid_t pid;
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint64_t bytes;
+	char name[SUMMARY_NAME_LEN];
+	char command[MAXCOMLEN + 1];
+};
+
+/*
+ * Open-addressed with linear probing; the table is a fixed size so the cost
+ * of an event stays constant no matter how long fs_usage runs.  Once it is
+ * full, new (pid, call) pairs are counted in summary_overflow.
+ */
+struct summary_entry summary_table[SUMMARY_HASH_SIZE];
+int summary_used = 0;
+uint64_t summary_overflow = 0;
+
+static uint32_t
+summary_hash(pid_t pid, const char *name)
+{
+	uint32_t hash = 2166136261u ^ (uint32_t)pid;
+
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+void
+summary_add(pid_t pid, uint64_t thread, const char *sc_name, uint64_t now, uint64_t stime, uint64_t bytes)
+{
+	struct summary_entry *se;
+	uint64_t elapsed_ns;
+	uint32_t hashid;
+	int probes;
+
+	if (!mach_time_of_first_event)
+		mach_time_of_first_event = now;
+
+	if (!want_kernel_task && pid == 0)
+		return;
+
+	/* honor -S and -E */
+	if (!raw_time_in_window(now))
+		return;
+
+	hashid = summary_hash(pid, sc_name) & SUMMARY_HASH_MASK;
+
+	for (probes = 0; probes < SUMMARY_HASH_SIZE; probes++) {
+		se = &summary_table[hashid];
+
+		if (se->count == 0)
+			break;
+
+		if (se->pid == pid && !strncmp(se->name, sc_name, SUMMARY_NAME_LEN - 1))
+			break;
+
+		hashid = (hashid + 1) & SUMMARY_HASH_MASK;
+	}
+
+	if (probes == SUMMARY_HASH_SIZE) {
+		summary_overflow++;
+		return;
+	}
+
+	if (se->count == 0) {
+		const char *command;
+
+		command = ktrace_get_execname_for_thread(s, thread);
+
+		if (!command)
+			command = "";
+
+		se->pid = pid;
+		strlcpy(se->name, sc_name, sizeof (se->name));
+		strlcpy(se->command, command, sizeof (se->command));
+		summary_used++;
+	}
+
+	elapsed_ns = mach_to_nano(now - stime);
+
+	se->count++;
+	se->total_ns += elapsed_ns;
+	se->bytes += bytes;
+
+	if (elapsed_ns > se->max_ns)
+		se->max_ns = elapsed_ns;
+}
+
+void
+summary_print(void)
+{
+	struct summary_entry **sorted;
+	struct timeval now_walltime;
+	char timestamp[32];
+	int i, n;
+
+	gettimeofday(&now_walltime, NULL);
+	strftime(timestamp, sizeof (timestamp), "%H:%M:%S", localtime(&now_walltime.tv_sec));
+
+	sorted = malloc(sizeof (struct summary_entry *) * (summary_used + 1));
+	os_assert(sorted != NULL);
+
+	for (i = 0, n = 0; i < SUMMARY_HASH_SIZE; i++) {
+		if (summary_table[i].count)
+			sorted[n++] = &summary_table[i];
+	}
+
+	qsort_b(sorted, n, sizeof (struct summary_entry *), ^int(const void *aa, const void *bb) {
+		const struct summary_entry *a = *(struct summary_entry * const *)aa;
+		const struct summary_entry *b = *(struct summary_entry * const *)bb;
+
+		if (a->total_ns > b->total_ns) return -1;
+		if (a->total_ns == b->total_ns) return 0;
+		return 1;
+	});
+
+	printf("\n%s  %d entries", timestamp, n);
+	if (summary_overflow)
+		printf(", %" PRIu64 " events not tracked (table full)", summary_overflow);
+	printf(", %" PRIu64 " disk I/Os in flight (peak %" PRIu64 ")\n", diskio_inflight, diskio_max_inflight);
+	printf("%-17s %-16s %7s %10s %14s %12s %14s\n",
+			"CALL", "PROCESS", "PID", "COUNT", "TOTAL(s)", "MAX(s)", "BYTES");
+
+	for (i = 0; i < n; i++) {
+		struct summary_entry *se = sorted[i];
+
+		printf("%-17.17s %-16.16s %7d %10" PRIu64 " %7" PRIu64 ".%06" PRIu64 " %5" PRIu64 ".%06" PRIu64 " %14" PRIu64 "\n",
+				se->name, se->command, se->pid, se->count,
+				se->total_ns / NSEC_PER_SEC, (se->total_ns % NSEC_PER_SEC) / NSEC_PER_USEC,
+				se->max_ns / NSEC_PER_SEC, (se->max_ns % NSEC_PER_SEC) / NSEC_PER_USEC,
+				se->bytes);
+	}
+
+	fflush(stdout);
+	free(sorted);
+
+	/* each table covers one interval */
+	bzero(summary_table, sizeof (summary_table));
+	summary_used = 0;
+	summary_overflow = 0;
+}
+
+#pragma mark network fd set routines
+
+/*
+ * Each pid that has used a socket gets a bitmap, one bit per fd, sized to
+ * its highest network fd and grown by doubling.  Lookups never create an
+ * entry, so the table only holds pids that actually have sockets.
+ */
+#define FD_SET_MAX	(1 << 24)
+
+struct pid_fd_set {
+	struct pid_fd_set *next;
+	pid_t pid;
+	uint64_t *set;
+	size_t setwords; /* number of 64-bit *words* in set */
+};
+
+struct pid_fd_set *pfs_hash[HASH_SIZE];
+
+static inline int
+pfs_hash_pid(pid_t pid)
+{
+	return (int)(((uint32_t)pid * 2654435761u) >> 22) & HASH_MASK;
+}
+
+static struct pid_fd_set *
+pfs_find(pid_t pid)
+{
+	struct pid_fd_set *pfs;
+
+	for (pfs = pfs_hash[pfs_hash_pid(pid)]; pfs; pfs = pfs->next) {
+		if (pfs->pid == pid) {
+			return pfs;
+		}
+	}
+
+	return NULL;
+}
+
+static struct pid_fd_set *
+pfs_get(pid_t pid)
+{
+	struct pid_fd_set *pfs;
+	int hashid;
+
+	os_assert(pid >= 0);
+
+	if ((pfs = pfs_find(pid)))
+		return pfs;
+
+	hashid = pfs_hash_pid(pid);
+
+	pfs = calloc(1, sizeof (struct pid_fd_set));
+	os_assert(pfs != NULL);
+
+	pfs->pid = pid;
+	pfs->set = NULL;
+	pfs->setwords = 0;
+	pfs->next = pfs_hash[hashid];
+	pfs_hash[hashid] = pfs;
+
+	return pfs;
+}
+
+void
+fd_clear_pid(pid_t pid)
+{
+	struct pid_fd_set *pfs, *prev;
+	int hashid;
+
+	if (pid < 0)
+		return;
+
+	if (top_flag)
+		top_clear_pid(pid);
+
+	hashid = pfs_hash_pid(pid);
+
+	pfs = pfs_hash[hashid];
+	prev = NULL;
+
+	while (pfs) {
+		if (pfs->pid == pid) {
+			if (prev) {
+				prev->next = pfs->next;
+			} else {
+				pfs_hash[hashid] = pfs->next;
+			}
+
+			free(pfs->set);
+			free(pfs);
+
+			break;
+		} else {
+			prev = pfs;
+			pfs = pfs->next;
+		}
+	}
+}
+
+void
+fd_clear_all(void)
+{
+	struct pid_fd_set *pfs, *next;
+	int i;
+
+	for (i = 0; i < HASH_SIZE; i++) {
+		for (pfs = pfs_hash[i]; pfs; pfs = next) {
+			next = pfs->next;
+
+			free(pfs->set);
+			free(pfs);
+		}
+
+		pfs_hash[i] = NULL;
+	}
+}
+
+void
+fd_set_is_network(pid_t pid, uint64_t fd, bool set)
+{
+	struct pid_fd_set *pfs;
+	size_t word;
+
+	if (pid < 0)
+		return;
+	if (fd >= FD_SET_MAX)
+		return;
+
+	word = (size_t)fd / 64;
+
+	if (set) {
+		pfs = pfs_get(pid);
+	} else if ((pfs = pfs_find(pid)) == NULL || word >= pfs->setwords) {
+		return;
+	}
+
+	if (word >= pfs->setwords) {
+		size_t newwords;
+
+		newwords = MAX(word + 1, 2 * pfs->setwords);
+		pfs->set = reallocf(pfs->set, newwords * sizeof (uint64_t));
+		os_assert(pfs->set != NULL);
+
+		bzero(pfs->set + pfs->setwords, (newwords - pfs->setwords) * sizeof (uint64_t));
+		pfs->setwords = newwords;
+	}
+
+	if (set)
+		pfs->set[word] |= 1ULL << (fd % 64);
+	else
+		pfs->set[word] &= ~(1ULL << (fd % 64));
+}
+
+bool
+fd_is_network(pid_t pid, uint64_t fd)
+{
+	struct pid_fd_set *pfs;
+
+	if (pid < 0)
+		return false;
+
+	if ((pfs = pfs_find(pid)) == NULL)
+		return false;
+
+	if (fd / 64 >= pfs->setwords) {
+		return false;
+	}
+
+	return (pfs->set[fd / 64] >> (fd % 64)) & 1;
+}
+
+#pragma mark shared region address lookup routines
+
+/*
+ * Page faults are attributed to a shared cache library by looking the fault
+ * address up in an array of the segments of every image in the dyld shared
+ * cache, sorted by address.  The array is built from the copy of the shared
+ * cache mapped into fs_usage itself, which is at the same (slid) address in
+ * every process, and only when the first page fault needs a name.
+ *
+ * To avoid a full binary search for each fault, an index records, for each
+ * LIBRARY_INDEX_SHIFT-sized stretch of the shared region, the first segment
+ * which ends beyond the start of that stretch.
+ */
+#define LIBRARY_INDEX_SHIFT	21
+
+struct library_info {
+	uint64_t b_address;
+	uint64_t e_address;
+	uint32_t name_index;
+	uint32_t r_type;
+};
+
+struct library_info *library_infos = NULL;
+int num_libraries = 0;
+int max_libraries = 0;
+
+char **library_names = NULL;
+uint32_t num_library_names = 0;
+uint32_t max_library_names = 0;
+
+uint64_t shared_cache_b_address = 0;
+uint64_t shared_cache_e_address = 0;
+
+uint32_t *library_index = NULL;
+size_t library_index_size = 0;
+
+bool shared_cache_mapping_initialized = false;
+
+#define	TEXT_R		0
+#define DATA_R		1
+#define OBJC_R		2
+#define IMPORT_R	3
+#define UNICODE_R	4
+#define IMAGE_R		5
+#define LINKEDIT_R	6
+
+/*
+ * Name a library the way the old shared cache map parsing did: the path
+ * component holding the last "." (e.g., "Foundation.framework"), or else
+ * the last path component.
+ */
+static uint32_t
+add_library_name(const char *path)
+{
+	const char *dot, *start, *end;
+	char *name;
+
+	if ((dot = strrchr(path, '.')) != NULL) {
+		for (start = dot; start > path && start[-1] != '/'; start--)
+			;
+
+		if ((end = strchr(dot, '/')) == NULL)
+			end = dot + strlen(dot);
+	} else {
+		if ((start = strrchr(path, '/')) != NULL)
+			start++;
+		else
+			start = path;
+
+		end = start + strlen(start);
+	}
+
+	name = strndup(start, end - start);
+	os_assert(name != NULL);
+
+	if (num_library_names == max_library_names) {
+		max_library_names = max_library_names ? 2 * max_library_names : 1024;
+		library_names = reallocf(library_names, max_library_names * sizeof (char *));
+		os_assert(library_names != NULL);
+	}
+
+	library_names[num_library_names] = name;
+
+	return num_library_names++;
+}
+
+static void
+add_library_segment(uint64_t b_address, uint64_t e_address, int type, uint32_t name_index)
+{
+	struct library_info *li;
+
+	if (num_libraries == max_libraries) {
+		max_libraries = max_libraries ? 2 * max_libraries : 4096;
+		library_infos = reallocf(library_infos, max_libraries * sizeof (struct library_info));
+		os_assert(library_infos != NULL);
+	}
+
+	li = &library_infos[num_libraries++];
+	li->b_address = b_address;
+	li->e_address = e_address;
+	li->r_type = type;
+	li->name_index = name_index;
+
+	if (shared_cache_b_address == 0 || b_address < shared_cache_b_address)
+		shared_cache_b_address = b_address;
+
+	if (e_address > shared_cache_e_address)
+		shared_cache_e_address = e_address;
+}
+
+static int
+segment_type(const char *segname)
+{
+	if (strncmp(segname, "__TEXT", 6) == 0)
+		return TEXT_R;
+	if (strncmp(segname, "__DATA", 6) == 0)
+		return DATA_R;
+	if (strncmp(segname, "__AUTH", 6) == 0)
+		return DATA_R;
+	if (strncmp(segname, "__OBJC", 6) == 0)
+		return OBJC_R;
+	if (strncmp(segname, "__IMPORT", 8) == 0)
+		return IMPORT_R;
+	if (strncmp(segname, "__UNICODE", 9) == 0)
+		return UNICODE_R;
+	if (strncmp(segname, "__IMAGE", 7) == 0)
+		return IMAGE_R;
+	if (strncmp(segname, "__LINKEDIT", 10) == 0)
+		return LINKEDIT_R;
+
+	return -1;
+}
+
+/*
+ * The shared cache slide is the difference between where our own copy of
+ * libsystem_c's __TEXT is and where it says it should be.
+ */
+static bool
+shared_cache_slide(uintptr_t *slide)
+{
+	const struct mach_header_64 *mh;
+	const struct load_command *lc;
+	Dl_info info;
+	uint32_t i;
+
+	if (dladdr((const void *)printf, &info) == 0 || info.dli_fbase == NULL)
+		return false;
+
+	mh = info.dli_fbase;
+
+	if (mh->magic != MH_MAGIC_64)
+		return false;
+
+	lc = (const struct load_command *)(mh + 1);
+
+	for (i = 0; i < mh->ncmds; i++) {
+		if (lc->cmd == LC_SEGMENT_64) {
+			const struct segment_command_64 *sc = (const struct segment_command_64 *)lc;
+
+			if (!strncmp(sc->segname, "__TEXT", sizeof (sc->segname))) {
+				*slide = (uintptr_t)mh - sc->vmaddr;
+				return true;
+			}
+		}
+
+		lc = (const struct load_command *)((uintptr_t)lc + lc->cmdsize);
+	}
+
+	return false;
+}
+
+static void
+build_library_index(void)
+{
+	size_t i;
+	int j;
+
+	library_index_size = (size_t)(((shared_cache_e_address - shared_cache_b_address) >> LIBRARY_INDEX_SHIFT) + 1);
+	library_index = malloc(library_index_size * sizeof (uint32_t));
+	os_assert(library_index != NULL);
+
+	for (i = 0, j = 0; i < library_index_size; i++) {
+		uint64_t bucket_start = shared_cache_b_address + ((uint64_t)i << LIBRARY_INDEX_SHIFT);
+
+		while (j < num_libraries && library_infos[j].e_address <= bucket_start)
+			j++;
+
+		library_index[i] = (uint32_t)j;
+	}
+}
+
+void
+init_shared_cache_mapping(void)
+{
+	shared_cache_mapping_initialized = true;
+
+#if TARGET_OS_OSX
+	__block uint32_t linkedit_name = UINT32_MAX;
+	uuid_t cache_uuid;
+	uintptr_t slide;
+	size_t cache_size;
+	const char *cache_path;
+
+	if (_dyld_get_shared_cache_range(&cache_size) == NULL || !_dyld_get_shared_cache_uuid(cache_uuid))
+		return;
+
+	if (!shared_cache_slide(&slide))
+		return;
+
+	if ((cache_path = dyld_shared_cache_file_path()) == NULL)
+		cache_path = "dyld_shared_cache";
+
+	dyld_shared_cache_iterate_text(cache_uuid, ^(const dyld_shared_cache_dylib_text_info *info) {
+		const struct mach_header_64 *mh;
+		const struct load_command *lc;
+		uint32_t name_index = UINT32_MAX;
+		uint32_t i;
+
+		mh = (const struct mach_header_64 *)(uintptr_t)(info->loadAddressUnslid + slide);
+
+		if (mh->magic != MH_MAGIC_64)
+			return;
+
+		lc = (const struct load_command *)(mh + 1);
+
+		for (i = 0; i < mh->ncmds; i++, lc = (const struct load_command *)((uintptr_t)lc + lc->cmdsize)) {
+			const struct segment_command_64 *sc;
+			int type;
+
+			if (lc->cmd != LC_SEGMENT_64)
+				continue;
+
+			sc = (const struct segment_command_64 *)lc;
+
+			if ((type = segment_type(sc->segname)) == -1 || sc->vmsize == 0)
+				continue;
+
+			/* every image shares one __LINKEDIT; name it after the cache */
+			if (type == LINKEDIT_R) {
+				if (linkedit_name != UINT32_MAX)
+					continue;
+
+				linkedit_name = add_library_name(cache_path);
+				add_library_segment(sc->vmaddr + slide, sc->vmaddr + slide + sc->vmsize, type, linkedit_name);
+				continue;
+			}
+
+			if (name_index == UINT32_MAX)
+				name_index = add_library_name(info->path);
+
+			add_library_segment(sc->vmaddr + slide, sc->vmaddr + slide + sc->vmsize, type, name_index);
+		}
+	});
+
+	if (num_libraries == 0)
+		return;
+
+	qsort_b(library_infos, num_libraries, sizeof (struct library_info), ^int(const void *aa, const void *bb) {
+		struct library_info *a = (struct library_info *)aa;
+		struct library_info *b = (struct library_info *)bb;
+
+		if (a->b_address < b->b_address) return -1;
+		if (a->b_address == b->b_address) return 0;
+		return 1;
+	});
+
+	build_library_index();
+#endif //TARGET_OS_OSX
+}
+
+void
+lookup_name(uint64_t user_addr, char **type, char **name)
+{
+	uint32_t i;
+
+	static char *frameworkType[] = {
+		"<TEXT>    ",
+		"<DATA>    ",
+		"<OBJC>    ",
+		"<IMPORT>  ",
+		"<UNICODE> ",
+		"<IMAGE>   ",
+		"<LINKEDIT>",
+	};
+
+	*name = NULL;
+	*type = NULL;
+
+	if (!shared_cache_mapping_initialized)
+		init_shared_cache_mapping();
+
+	if (!num_libraries || user_addr < shared_cache_b_address || user_addr >= shared_cache_e_address)
+		return;
+
+	for (i = library_index[(user_addr - shared_cache_b_address) >> LIBRARY_INDEX_SHIFT];
+			i < (uint32_t)num_libraries && library_infos[i].b_address <= user_addr; i++) {
+		if (user_addr < library_infos[i].e_address) {
+			*type = frameworkType[library_infos[i].r_type];
+			*name = library_names[library_infos[i].name_index];
+			return;
+		}
+	}
+}
+
+#pragma mark disk I/O tracking routines
+
+/*
+ * In-flight I/Os are hashed on their buf pointer, with each bucket a doubly
+ * linked list so that completion can unlink in constant time.  struct
+ * diskios come from slabs and are recycled through free_diskios.
+ */
+#define DISKIO_HASH_SIZE	4096
+#define DISKIO_HASH_MASK	(DISKIO_HASH_SIZE - 1)
+#define DISKIO_SLAB_COUNT	256
+
+struct diskio *free_diskios = NULL;
+struct diskio *busy_diskios[DISKIO_HASH_SIZE];
+
+static inline int
+diskio_hash(uint64_t bp)
+{
+	return (int)(((bp >> 4) * 0x9e3779b97f4a7c15ULL) >> 52) & DISKIO_HASH_MASK;
+}
+
+static struct diskio *
+diskio_alloc(void)
+{
+	struct diskio *dio;
+
+	if (!free_diskios) {
+		struct diskio *slab;
+		int i;
+
+		slab = malloc(DISKIO_SLAB_COUNT * sizeof (struct diskio));
+		os_assert(slab != NULL);
+
+		for (i = 0; i < DISKIO_SLAB_COUNT; i++) {
+			slab[i].next = free_diskios;
+			free_diskios = &slab[i];
+		}
+	}
+
+	dio = free_diskios;
+	free_diskios = dio->next;
+
+	return dio;
+}
+
+struct diskio *
+diskio_start(uint64_t type, uint64_t bp, uint64_t dev,
+	     uint64_t blkno, uint64_t iosize, ktrace_event_t event)
+{
+	const char *command;
+	struct diskio *dio;
+	int hashid;
+
+	dio = diskio_alloc();
+
+	dio->prev = NULL;
+
+	dio->type = type;
+	dio->bp = bp;
+	dio->dev = dev;
+	dio->blkno = blkno;
+	dio->iosize = iosize;
+	dio->issued_time = event->timestamp;
+	dio->issuing_thread = event->threadid;
+	dio->issuing_pid = ktrace_get_pid_for_thread(s, event->threadid);
+
+	dio->bc_info = 0x0;
+
+	command = ktrace_get_execname_for_thread(s, event->threadid);
+
+	if (!command)
+		command = "";
+
+	strncpy(dio->issuing_command, command, MAXCOMLEN);
+	dio->issuing_command[MAXCOMLEN] = '\0';
+
+	hashid = diskio_hash(bp);
+
+	dio->next = busy_diskios[hashid];
+
+	if (dio->next)
+		dio->next->prev = dio;
+
+	busy_diskios[hashid] = dio;
+
+	if (++diskio_inflight > diskio_max_inflight)
+		diskio_max_inflight = diskio_inflight;
+
+	return dio;
+}
+
+struct diskio *
+diskio_find(uint64_t bp)
+{
+	struct diskio *dio;
+
+	for (dio = busy_diskios[diskio_hash(bp)]; dio; dio = dio->next) {
+		if (dio->bp == bp)
+			return dio;
+	}
+
+	return NULL;
+}
+
+struct diskio *
+diskio_complete(uint64_t bp, uint64_t io_errno, uint64_t resid,
+		uint64_t thread, uint64_t curtime, struct timeval curtime_wall)
+{
+	struct diskio *dio;
+
+	if ((dio = diskio_find(bp)) == NULL) return NULL;
+
+	if (dio->prev == NULL) {
+		if ((busy_diskios[diskio_hash(bp)] = dio->next))
+			dio->next->prev = NULL;
+	} else {
+		if (dio->next)
+			dio->next->prev = dio->prev;
+		dio->prev->next = dio->next;
+	}
+
+	diskio_inflight--;
+
+	dio->iosize -= resid;
+	dio->io_errno = io_errno;
+	dio->completed_time = curtime;
+	dio->completed_walltime = curtime_wall;
+	dio->completion_thread = thread;
+
+	return dio;
+}
+
+void
+diskio_free(struct diskio *dio)
+{
+	dio->next = free_diskios;
+	free_diskios = dio;
+}
+
+void
+diskio_print(struct diskio *dio)
+{
+	char  *p = NULL;
+	int   len = 0;
+	uint64_t type;
+	int   format = FMT_DISKIO;
+	char  buf[64];
+
+	type = dio->type;
+	dio->is_meta = 0;
+
+	if ((type & P_CS_Class) == P_CS_Class) {
+		switch (type) {
+			case P_CS_ReadChunk:
+				p = "    RdChunkCS";
+				len = 13;
+				format = FMT_DISKIO_CS;
+				break;
+			case P_CS_WriteChunk:
+				p = "    WrChunkCS";
+				len = 13;
+				format = FMT_DISKIO_CS;
+				break;
+			case P_CS_MetaRead:
+				p = "  RdMetaCS";
+				len = 10;
+				format = FMT_DISKIO_CS;
+				break;
+			case P_CS_MetaWrite:
+				p = "  WrMetaCS";
+				len = 10;
+				format = FMT_DISKIO_CS;
+				break;
+			case P_CS_TransformRead:
+				p = "  RdBgTfCS";
+				len = 10;
+				break;
+			case P_CS_TransformWrite:
+				p = "  WrBgTfCS";
+				len = 10;
+				break;
+			case P_CS_MigrationRead:
+				p = "  RdBgMigrCS";
+				len = 12;
+				break;
+			case P_CS_MigrationWrite:
+				p = "  WrBgMigrCS";
+				len = 12;
+				break;
+			default:
+				p = "  CS";
+				len = 4;
+				break;
+		}
+
+		strncpy(buf, p, len);
+	} else {
+		switch (type & P_DISKIO_TYPE) {
+			case P_RdMeta:
+				dio->is_meta = 1;
+				p = "  RdMeta";
+				len = 8;
+				break;
+			case P_WrMeta:
+				dio->is_meta = 1;
+				p = "  WrMeta";
+				len = 8;
+				break;
+			case P_RdData:
+				p = "  RdData";
+				len = 8;
+				break;
+			case P_WrData:
+				p = "  WrData";
+				len = 8;
+				break;
+			case P_PgIn:
+				p = "  PgIn";
+				len = 6;
+				break;
+			case P_PgOut:
+				p = "  PgOut";
+				len = 7;
+				break;
+			default:
+				p = "  ";
+				len = 2;
+				break;
+		}
+
+		strncpy(buf, p, len);
+
+		buf[len++] = '[';
+
+		if (type & P_DISKIO_ASYNC)
+			buf[len++] = 'A';
+		else
+			buf[len++] = 'S';
+
+		if (type & P_DISKIO_NOCACHE)
+			buf[len++] = 'N';
+
+		int tier = (type & P_DISKIO_TIER_MASK) >> P_DISKIO_TIER_SHIFT;
+
+		if (tier > 0) {
+			buf[len++] = 'T';
+			if (tier > 0 && tier < 10)
+				buf[len++] = '0' + tier;
+
+			if (type & P_DISKIO_TIER_UPGRADE) {
+				buf[len++] = 'U';
+			}
+		}
+
+		if (type & P_DISKIO_PASSIVE)
+			buf[len++] = 'P';
 
-		format_print(ti, sc_name, event, type, format, event->timestamp, ti->stime, ti->waited, pathname, NULL);
+		buf[len++] = ']';
 	}
 
-	event_delete(ti);
-}
+	buf[len] = 0;
 
-void
-event_mark_thread_waited(uint64_t thread)
-{
-	th_info_t	ti;
-	int		hashid;
+	if (histogram_flag)
+		diskio_hist_add(dio);
+
+	if (check_filter_mode(-1, NULL, type, 0, 0, buf)) {
+		if (top_flag)
+			top_add_diskio(dio);
+
+		if (summary_flag) {
+			char *name = buf;
 
-	hashid = thread & HASH_MASK;
+			/* the typed names are indented for the event listing */
+			while (*name == ' ')
+				name++;
 
-	for (ti = th_info_hash[hashid]; ti; ti = ti->next) {
-		if (ti->thread == thread)
-			ti->waited = 1;
+			summary_add(dio->issuing_pid, dio->issuing_thread, name, dio->completed_time,
+					dio->issued_time, dio->io_errno ? 0 : dio->iosize);
+			return;
+		}
+
+		const char *pathname = ktrace_get_path_for_vp(s, dio->vnodeid);
+		format_print(NULL, buf, NULL, type, format, dio->completed_time,
+				dio->issued_time, 1, pathname ? pathname : "", dio);
+	} else {
+		events_filtered++;
 	}
 }
 
-#pragma mark network fd set routines
+#pragma mark top mode routines
 
-struct pid_fd_set {
-	struct pid_fd_set *next;
+/*
+ * Per-process activity is kept for the last TOP_WINDOW refresh intervals
+ * in a fixed-size open-addressed table, so memory stays constant however
+ * long fs_usage runs.  At each refresh the oldest interval is dropped and
+ * the table is rebuilt without processes that have exited or have had no
+ * activity in the whole window.
+ */
+#define TOP_WINDOW		5
+#define TOP_MAX_PIDS		4096
+#define TOP_HASH_MASK		(TOP_MAX_PIDS - 1)
+
+struct top_interval {
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+	uint64_t syscalls;
+	uint64_t syscall_ns;
+	uint64_t diskios;
+	uint64_t diskio_bytes;
+};
+
+struct top_entry {
 	pid_t pid;
-	char *set;
-	size_t setsize; /* number of *bytes*, not bits */
+	bool in_use;
+	bool exited;
+	char command[MAXCOMLEN + 1];
+	struct top_interval intervals[TOP_WINDOW];
+	struct top_interval total;	/* filled in when printing */
 };
 
-struct pid_fd_set *pfs_hash[HASH_SIZE];
+struct top_entry top_table[TOP_MAX_PIDS];
+struct top_entry top_rebuild_table[TOP_MAX_PIDS];
+int top_current = 0;
+uint64_t top_overflow = 0;
 
-static struct pid_fd_set *
-pfs_get(pid_t pid)
+static bool
+io_is_read(int type)
 {
-	struct pid_fd_set *pfs;
-	int hashid;
-
-	os_assert(pid >= 0);
-
-	hashid = pid & HASH_MASK;
-
-	for (pfs = pfs_hash[hashid]; pfs; pfs = pfs->next) {
-		if (pfs->pid == pid) {
-			return pfs;
-		}
+	switch (type) {
+		case BSC_read:
+		case BSC_read_nocancel:
+		case BSC_readv:
+		case BSC_readv_nocancel:
+		case BSC_pread:
+		case BSC_pread_nocancel:
+		case BSC_recvfrom:
+		case BSC_recvfrom_nocancel:
+		case BSC_recvmsg:
+		case BSC_recvmsg_nocancel:
+		case BSC_getdirentries:
+		case BSC_getdirentries64:
+			return true;
 	}
 
-	pfs = calloc(1, sizeof (struct pid_fd_set));
-
-	pfs->pid = pid;
-	pfs->set = NULL;
-	pfs->setsize = 0;
-	pfs->next = pfs_hash[hashid];
-	pfs_hash[hashid] = pfs;
-
-	return pfs;
+	return false;
 }
 
-void
-fd_clear_pid(pid_t pid)
+static struct top_entry *
+top_find(struct top_entry *table, pid_t pid, bool create)
 {
-	struct pid_fd_set *pfs, *prev;
-	int hashid;
-
-	if (pid < 0)
-		return;
+	struct top_entry *te;
+	int i, probes;
 
-	hashid = pid & HASH_MASK;
-
-	pfs = pfs_hash[hashid];
-	prev = NULL;
+	i = (int)(((uint32_t)pid * 2654435761u) >> 20) & TOP_HASH_MASK;
 
-	while (pfs) {
-		if (pfs->pid == pid) {
-			if (prev) {
-				prev->next = pfs->next;
-			} else {
-				pfs_hash[hashid] = pfs->next;
-			}
+	for (probes = 0; probes < TOP_MAX_PIDS; probes++, i = (i + 1) & TOP_HASH_MASK) {
+		te = &table[i];
 
-			free(pfs->set);
-			free(pfs);
+		if (!te->in_use) {
+			if (!create)
+				return NULL;
 
-			break;
-		} else {
-			prev = pfs;
-			pfs = pfs->next;
+			te->in_use = true;
+			te->pid = pid;
+			return te;
 		}
+
+		if (te->pid == pid)
+			return te;
 	}
+
+	return NULL;
 }
 
-void
-fd_clear_all(void)
+static struct top_entry *
+top_get(pid_t pid, uint64_t thread)
 {
-	struct pid_fd_set *pfs, *next;
-	int i;
+	struct top_entry *te;
 
-	for (i = 0; i < HASH_SIZE; i++) {
-		for (pfs = pfs_hash[i]; pfs; pfs = next) {
-			next = pfs->next;
+	if (!want_kernel_task && pid == 0)
+		return NULL;
 
-			free(pfs->set);
-			free(pfs);
-		}
+	if ((te = top_find(top_table, pid, true)) == NULL) {
+		top_overflow++;
+		return NULL;
+	}
 
-		pfs_hash[i] = NULL;
+	if (te->command[0] == '\0') {
+		const char *command = ktrace_get_execname_for_thread(s, thread);
+
+		strlcpy(te->command, command ? command : "", sizeof (te->command));
 	}
+
+	return te;
 }
 
 void
-fd_set_is_network(pid_t pid, uint64_t fd, bool set)
+top_add_syscall(pid_t pid, uint64_t thread, int type, uint64_t now, uint64_t stime, uint64_t bytes)
 {
-	struct pid_fd_set *pfs;
+	struct top_entry *te;
+	struct top_interval *ti;
 
-	if (pid < 0)
-		return;
-	if (fd > OPEN_MAX)
+	if ((te = top_get(pid, thread)) == NULL)
 		return;
 
-	pfs = pfs_get(pid);
-
-	if (fd >= pfs->setsize * CHAR_BIT) {
-		size_t newsize;
-
-		if (!set) return;
-
-		newsize = MAX(((size_t)fd + CHAR_BIT) / CHAR_BIT, 2 * pfs->setsize);
-		pfs->set = reallocf(pfs->set, newsize);
-		os_assert(pfs->set != NULL);
+	ti = &te->intervals[top_current];
 
-		bzero(pfs->set + pfs->setsize, newsize - pfs->setsize);
-		pfs->setsize = newsize;
-	}
+	ti->syscalls++;
+	ti->syscall_ns += mach_to_nano(now - stime);
 
-	if (set)
-		setbit(pfs->set, fd);
+	if (io_is_read(type))
+		ti->bytes_read += bytes;
 	else
-		clrbit(pfs->set, fd);
+		ti->bytes_written += bytes;
 }
 
-bool
-fd_is_network(pid_t pid, uint64_t fd)
+void
+top_add_diskio(struct diskio *dio)
 {
-	struct pid_fd_set *pfs;
+	struct top_entry *te;
+	struct top_interval *ti;
 
-	if (pid < 0)
-		return false;
+	if ((te = top_get(dio->issuing_pid, dio->issuing_thread)) == NULL)
+		return;
 
-	pfs = pfs_get(pid);
+	ti = &te->intervals[top_current];
 
-	if (fd >= pfs->setsize * CHAR_BIT) {
-		return false;
-	}
+	ti->diskios++;
 
-	return isset(pfs->set, fd);
+	if (!dio->io_errno)
+		ti->diskio_bytes += dio->iosize;
 }
 
-#pragma mark shared region address lookup routines
-
-#define MAXINDEX 2048
-
-struct library_range {
-	uint64_t b_address;
-	uint64_t e_address;
-};
-
-struct library_info {
-	uint64_t b_address;
-	uint64_t e_address;
-	int	 r_type;
-	char     *name;
-};
-
-struct library_range frameworkArm64e = {0, 0};
-struct library_range framework64 = {0, 0};
-struct library_range framework64h = {0, 0};
-
-struct library_info library_infos[MAXINDEX];
-int num_libraries = 0;
-
-#define	TEXT_R		0
-#define DATA_R		1
-#define OBJC_R		2
-#define IMPORT_R	3
-#define UNICODE_R	4
-#define IMAGE_R		5
-#define LINKEDIT_R	6
-
-static void
-sort_library_addresses(void)
+void
+top_clear_pid(pid_t pid)
 {
-	library_infos[num_libraries].b_address = library_infos[num_libraries - 1].b_address + 0x800000;
-	library_infos[num_libraries].e_address = library_infos[num_libraries].b_address;
-	library_infos[num_libraries].name = NULL;
-
-	qsort_b(library_infos, num_libraries, sizeof (struct library_info), ^int(const void *aa, const void *bb) {
-		struct library_info *a = (struct library_info *)aa;
-		struct library_info *b = (struct library_info *)bb;
+	struct top_entry *te;
 
-		if (a->b_address < b->b_address) return -1;
-		if (a->b_address == b->b_address) return 0;
-		return 1;
-	});
+	if ((te = top_find(top_table, pid, false)) != NULL)
+		te->exited = true;
 }
 
-static int
-scanline(char *inputstring, char **argv, int maxtokens)
+static void
+top_sum(struct top_entry *te)
 {
-	int n = 0;
-	char **ap = argv, *p, *val;
+	int i;
 
-	for (p = inputstring; n < maxtokens && p != NULL; ) {
-		while ((val = strsep(&p, " \t")) != NULL && *val == '\0') ;
+	bzero(&te->total, sizeof (te->total));
 
-		*ap++ = val;
-		n++;
+	for (i = 0; i < TOP_WINDOW; i++) {
+		te->total.bytes_read += te->intervals[i].bytes_read;
+		te->total.bytes_written += te->intervals[i].bytes_written;
+		te->total.syscalls += te->intervals[i].syscalls;
+		te->total.syscall_ns += te->intervals[i].syscall_ns;
+		te->total.diskios += te->intervals[i].diskios;
+		te->total.diskio_bytes += te->intervals[i].diskio_bytes;
 	}
-
-	*ap = 0;
-
-	return n;
 }
 
 static int
-read_shared_cache_map(const char *path, struct library_range *lr, char *linkedit_name)
-{
-	uint64_t	b_address, e_address;
-	char	buf[1024];
-	char	*fnp, *fn_tofree;
-	FILE	*fd;
-	char	frameworkName[256];
-	char	*tokens[64];
-	int	ntokens;
-	int	type;
-	int	linkedit_found = 0;
-	char	*substring, *ptr;
-
-	bzero(buf, sizeof(buf));
-	bzero(tokens, sizeof(tokens));
-
-	lr->b_address = 0;
-	lr->e_address = 0;
-
-	if ((fd = fopen(path, "r")) == 0)
-		return 0;
-
-	while (fgets(buf, 1023, fd)) {
-		if (strncmp(buf, "mapping", 7))
-			break;
-	}
-
-	buf[strlen(buf)-1] = 0;
-
-	frameworkName[0] = 0;
-
-	for (;;) {
-		/*
-		 * Extract lib name from path name
-		 */
-		if ((substring = strrchr(buf, '.'))) {
-			/*
-			 * There is a ".": name is whatever is between the "/" around the "."
-			 */
-			while ( *substring != '/')		    /* find "/" before "." */
-				substring--;
+top_compare(const struct top_entry *a, const struct top_entry *b)
+{
+	uint64_t abytes = a->total.bytes_read + a->total.bytes_written;
+	uint64_t bbytes = b->total.bytes_read + b->total.bytes_written;
 
-			substring++;
+	if (abytes != bbytes)
+		return abytes > bbytes ? -1 : 1;
+	if (a->total.syscall_ns != b->total.syscall_ns)
+		return a->total.syscall_ns > b->total.syscall_ns ? -1 : 1;
+	if (a->total.diskios != b->total.diskios)
+		return a->total.diskios > b->total.diskios ? -1 : 1;
 
-			strncpy(frameworkName, substring, 256);           /* copy path from "/" */
-			frameworkName[255] = 0;
-			substring = frameworkName;
+	return 0;
+}
 
-			while ( *substring != '/' && *substring)    /* find "/" after "." and stop string there */
-				substring++;
+void
+top_print(void)
+{
+	struct top_entry *sorted[TOP_MAX_PIDS];
+	struct timeval now_walltime;
+	char timestamp[32];
+	unsigned int max_rows;
+	int i, n;
 
-			*substring = 0;
-		} else {
-			/*
-			 * No ".": take segment after last "/"
-			 */
-			ptr = buf;
-			substring = ptr;
+	if (!wideflag)
+		get_screenwidth();
 
-			while (*ptr)  {
-				if (*ptr == '/')
-					substring = ptr + 1;
-				ptr++;
-			}
+	gettimeofday(&now_walltime, NULL);
+	strftime(timestamp, sizeof (timestamp), "%H:%M:%S", localtime(&now_walltime.tv_sec));
 
-			strncpy(frameworkName, substring, 256);
-			frameworkName[255] = 0;
+	for (i = 0, n = 0; i < TOP_MAX_PIDS; i++) {
+		if (top_table[i].in_use) {
+			top_sum(&top_table[i]);
+			sorted[n++] = &top_table[i];
 		}
+	}
 
-		fnp = malloc(strlen(frameworkName) + 1);
-		fn_tofree = fnp;
-		strcpy(fnp, frameworkName);
-
-		while (fgets(buf, 1023, fd) && num_libraries < (MAXINDEX - 2)) {
-			/*
-			 * Get rid of EOL
-			 */
-			buf[strlen(buf)-1] = 0;
-
-			ntokens = scanline(buf, tokens, 64);
-
-			if (ntokens < 4)
-				continue;
-
-			if (strncmp(tokens[0], "__TEXT", 6) == 0)
-				type = TEXT_R;
-			else if (strncmp(tokens[0], "__DATA", 6) == 0)
-				type = DATA_R;
-			else if (strncmp(tokens[0], "__OBJC", 6) == 0)
-				type = OBJC_R;
-			else if (strncmp(tokens[0], "__IMPORT", 8) == 0)
-				type = IMPORT_R;
-			else if (strncmp(tokens[0], "__UNICODE", 9) == 0)
-				type = UNICODE_R;
-			else if (strncmp(tokens[0], "__IMAGE", 7) == 0)
-				type = IMAGE_R;
-			else if (strncmp(tokens[0], "__LINKEDIT", 10) == 0)
-				type = LINKEDIT_R;
-			else
-				type = -1;
-
-			if (type == LINKEDIT_R && linkedit_found)
-				break;
-
-			if (type != -1) {
-				b_address = strtoull(tokens[1], 0, 16);
-				e_address = strtoull(tokens[3], 0, 16);
-
-				library_infos[num_libraries].b_address	= b_address;
-				library_infos[num_libraries].e_address	= e_address;
-				library_infos[num_libraries].r_type	= type;
-
-				if (type == LINKEDIT_R) {
-					library_infos[num_libraries].name = linkedit_name;
-					linkedit_found = 1;
-				} else {
-					library_infos[num_libraries].name = fnp;
-					fn_tofree = NULL;
-				}
-#if 0
-				printf("%s(%d): %qx-%qx\n", frameworkInfo[numFrameworks].name, type, b_address, e_address);
-#endif
-				if (lr->b_address == 0 || b_address < lr->b_address)
-					lr->b_address = b_address;
+	qsort_b(sorted, n, sizeof (struct top_entry *), ^int(const void *aa, const void *bb) {
+		return top_compare(*(struct top_entry * const *)aa, *(struct top_entry * const *)bb);
+	});
 
-				if (lr->e_address == 0 || e_address > lr->e_address)
-					lr->e_address = e_address;
+	if (isatty(STDOUT_FILENO))
+		printf("\033[H\033[2J");
 
-				num_libraries++;
-			}
+	printf("%s  %d processes over the last %.1fs, %" PRIu64 " disk I/Os in flight",
+			timestamp, n, (double)(top_interval_ns * TOP_WINDOW) / NSEC_PER_SEC, diskio_inflight);
+	if (top_overflow)
+		printf(", %" PRIu64 " events from untracked processes", top_overflow);
+	printf("\n\n");
 
-			if (type == LINKEDIT_R)
-				break;
-		}
+	printf("%-16s %7s %12s %12s %10s %12s %8s %12s\n",
+			"PROCESS", "PID", "READ", "WRITTEN", "CALLS", "CALL TIME(s)", "DISKIO", "DISK BYTES");
 
-		free(fn_tofree);
+	/* leave room for the headers on a terminal */
+	max_rows = (rows > 4) ? rows - 4 : (unsigned int)n;
 
-		if (fgets(buf, 1023, fd) == 0)
-			break;
+	for (i = 0; i < n && (unsigned int)i < max_rows; i++) {
+		struct top_entry *te = sorted[i];
 
-		buf[strlen(buf)-1] = 0;
+		printf("%-16.16s %7d %12" PRIu64 " %12" PRIu64 " %10" PRIu64 " %5" PRIu64 ".%06" PRIu64 " %8" PRIu64 " %12" PRIu64 "\n",
+				te->command, te->pid, te->total.bytes_read, te->total.bytes_written,
+				te->total.syscalls, te->total.syscall_ns / NSEC_PER_SEC,
+				(te->total.syscall_ns % NSEC_PER_SEC) / NSEC_PER_USEC,
+				te->total.diskios, te->total.diskio_bytes);
 	}
 
-	fclose(fd);
+	fflush(stdout);
 
-#if 0
-	printf("%s range, %qx-%qx\n", path, lr->b_address, lr->e_address);
-#endif
-	return 1;
-}
+	/*
+	 * Slide the window and keep only the processes still worth showing.
+	 */
+	top_current = (top_current + 1) % TOP_WINDOW;
 
-#define DYLD_SHARED_CACHE_LOCATION "/System/Library/dyld/"
+	bzero(top_rebuild_table, sizeof (top_rebuild_table));
 
-void
-init_shared_cache_mapping(void)
-{
-#if TARGET_OS_OSX
-#if TARGET_CPU_ARM64
-	read_shared_cache_map(DYLD_SHARED_CACHE_LOCATION"dyld_shared_cache_arm64e.map", &frameworkArm64e, DYLD_SHARED_CACHE_LOCATION"dyld_shared_cache_arm64e");
-#else //!TARGET_CPU_ARM64
-	if (0 == read_shared_cache_map(DYLD_SHARED_CACHE_LOCATION"dyld_shared_cache_x86_64h.map", &framework64h, DYLD_SHARED_CACHE_LOCATION"dyld_shared_cache_x86_64h")) {
-		read_shared_cache_map(DYLD_SHARED_CACHE_LOCATION"dyld_shared_cache_x86_64.map", &framework64, DYLD_SHARED_CACHE_LOCATION"dyld_shared_cache_x86_64");
-	}
-#endif //TARGET_CPU_ARM64
-	sort_library_addresses();
-#endif //TARGET_OS_OSX
-}
+	for (i = 0; i < TOP_MAX_PIDS; i++) {
+		struct top_entry *te = &top_table[i], *nte;
 
-void
-lookup_name(uint64_t user_addr, char **type, char **name)
-{
-	int i;
-	int start, last;
+		if (!te->in_use || te->exited)
+			continue;
 
-	static char *frameworkType[] = {
-		"<TEXT>    ",
-		"<DATA>    ",
-		"<OBJC>    ",
-		"<IMPORT>  ",
-		"<UNICODE> ",
-		"<IMAGE>   ",
-		"<LINKEDIT>",
-	};
+		bzero(&te->intervals[top_current], sizeof (struct top_interval));
+		top_sum(te);
 
-	*name = NULL;
-	*type = NULL;
+		if (te->total.syscalls == 0 && te->total.diskios == 0)
+			continue;
 
-	if (num_libraries) {
-		if ((user_addr >= frameworkArm64e.b_address && user_addr < frameworkArm64e.e_address) ||
-			(user_addr >= framework64.b_address && user_addr < framework64.e_address) ||
-			(user_addr >= framework64h.b_address && user_addr < framework64h.e_address)) {
+		nte = top_find(top_rebuild_table, te->pid, true);
+		*nte = *te;
+	}
 
-			start = 0;
-			last  = num_libraries;
+	memcpy(top_table, top_rebuild_table, sizeof (top_table));
+	top_overflow = 0;
+}
 
-			for (i = num_libraries / 2; start < last; i = start + ((last - start) / 2)) {
-				if (user_addr > library_infos[i].e_address)
-					start = i+1;
-				else
-					last = i;
-			}
+#pragma mark disk I/O histogram routines
 
-			if (start < num_libraries &&
-				user_addr >= library_infos[start].b_address && user_addr < library_infos[start].e_address) {
-				*type = frameworkType[library_infos[start].r_type];
-				*name = library_infos[start].name;
-			}
-		}
-	}
-}
+/*
+ * Service times go into log2 microsecond buckets: bucket 0 holds anything
+ * under 2us, and bucket n holds [2^n, 2^(n+1)) us.
+ */
+#define DISKIO_HIST_BUCKETS	32
+
+#define DIO_HIST_RDDATA	0
+#define DIO_HIST_WRDATA	1
+#define DIO_HIST_RDMETA	2
+#define DIO_HIST_WRMETA	3
+#define DIO_HIST_PGIN	4
+#define DIO_HIST_PGOUT	5
+#define DIO_HIST_CS	6
+#define DIO_HIST_TYPES	7
+
+static const char *diskio_hist_names[DIO_HIST_TYPES] = {
+	"RdData", "WrData", "RdMeta", "WrMeta", "PgIn", "PgOut", "CS",
+};
 
-#pragma mark disk I/O tracking routines
+struct diskio_hist {
+	struct diskio_hist *next;
+	uint64_t dev;
+	bool is_cs;
+	uint64_t count[DIO_HIST_TYPES];
+	uint64_t max_us[DIO_HIST_TYPES];
+	uint64_t buckets[DIO_HIST_TYPES][DISKIO_HIST_BUCKETS];
+};
 
-struct diskio *free_diskios = NULL;
-struct diskio *busy_diskios = NULL;
+struct diskio_hist *diskio_hists = NULL;
 
-struct diskio *
-diskio_start(uint64_t type, uint64_t bp, uint64_t dev,
-	     uint64_t blkno, uint64_t iosize, ktrace_event_t event)
+static int
+diskio_hist_type(uint64_t type)
 {
-	const char *command;
-	struct diskio *dio;
-
-	if ((dio = free_diskios)) {
-		free_diskios = dio->next;
-	} else {
-		dio = malloc(sizeof (struct diskio));
+	if ((type & P_CS_Class) == P_CS_Class)
+		return DIO_HIST_CS;
+
+	switch (type & P_DISKIO_TYPE) {
+		case P_RdMeta:
+			return DIO_HIST_RDMETA;
+		case P_WrMeta:
+			return DIO_HIST_WRMETA;
+		case P_RdData:
+			return DIO_HIST_RDDATA;
+		case P_WrData:
+			return DIO_HIST_WRDATA;
+		case P_PgIn:
+			return DIO_HIST_PGIN;
+		case P_PgOut:
+			return DIO_HIST_PGOUT;
 	}
 
-	dio->prev = NULL;
+	return -1;
+}
 
-	dio->type = type;
-	dio->bp = bp;
-	dio->dev = dev;
-	dio->blkno = blkno;
-	dio->iosize = iosize;
-	dio->issued_time = event->timestamp;
-	dio->issuing_thread = event->threadid;
-	dio->issuing_pid = ktrace_get_pid_for_thread(s, event->threadid);
+void
+diskio_hist_add(struct diskio *dio)
+{
+	struct diskio_hist *dh;
+	uint64_t usecs;
+	bool is_cs;
+	int type, bucket;
 
-	dio->bc_info = 0x0;
+	if ((type = diskio_hist_type(dio->type)) == -1)
+		return;
 
-	command = ktrace_get_execname_for_thread(s, event->threadid);
+	if (!mach_time_of_first_event)
+		mach_time_of_first_event = dio->completed_time;
 
-	if (!command)
-		command = "";
+	/* honor -S and -E */
+	if (!raw_time_in_window(dio->completed_time))
+		return;
 
-	strncpy(dio->issuing_command, command, MAXCOMLEN);
-	dio->issuing_command[MAXCOMLEN] = '\0';
+	is_cs = (type == DIO_HIST_CS);
 
-	dio->next = busy_diskios;
+	for (dh = diskio_hists; dh; dh = dh->next) {
+		if (dh->dev == dio->dev && dh->is_cs == is_cs)
+			break;
+	}
 
-	if (dio->next)
-		dio->next->prev = dio;
+	if (dh == NULL) {
+		dh = calloc(1, sizeof (struct diskio_hist));
+		os_assert(dh != NULL);
 
-	busy_diskios = dio;
+		dh->dev = dio->dev;
+		dh->is_cs = is_cs;
+		dh->next = diskio_hists;
+		diskio_hists = dh;
+	}
 
-	return dio;
-}
+	usecs = mach_to_nano(dio->completed_time - dio->issued_time) / NSEC_PER_USEC;
 
-struct diskio *
-diskio_find(uint64_t bp)
-{
-	struct diskio *dio;
+	bucket = (usecs < 2) ? 0 : (63 - __builtin_clzll(usecs));
+	if (bucket >= DISKIO_HIST_BUCKETS)
+		bucket = DISKIO_HIST_BUCKETS - 1;
 
-	for (dio = busy_diskios; dio; dio = dio->next) {
-		if (dio->bp == bp)
-			return dio;
-	}
+	dh->buckets[type][bucket]++;
+	dh->count[type]++;
 
-	return NULL;
+	if (usecs > dh->max_us[type])
+		dh->max_us[type] = usecs;
 }
 
-struct diskio *
-diskio_complete(uint64_t bp, uint64_t io_errno, uint64_t resid,
-		uint64_t thread, uint64_t curtime, struct timeval curtime_wall)
+/*
+ * Report the upper bound of the bucket holding the given fraction of I/Os,
+ * capped at the largest time actually seen.
+ */
+static uint64_t
+diskio_hist_percentile(struct diskio_hist *dh, int type, double fraction)
 {
-	struct diskio *dio;
+	uint64_t target, seen = 0;
+	int i;
 
-	if ((dio = diskio_find(bp)) == NULL) return NULL;
+	target = (uint64_t)(dh->count[type] * fraction);
+	if (target == 0)
+		target = 1;
 
-	if (dio == busy_diskios) {
-		if ((busy_diskios = dio->next))
-			dio->next->prev = NULL;
-	} else {
-		if (dio->next)
-			dio->next->prev = dio->prev;
-		dio->prev->next = dio->next;
-	}
+	for (i = 0; i < DISKIO_HIST_BUCKETS; i++) {
+		seen += dh->buckets[type][i];
 
-	dio->iosize -= resid;
-	dio->io_errno = io_errno;
-	dio->completed_time = curtime;
-	dio->completed_walltime = curtime_wall;
-	dio->completion_thread = thread;
+		if (seen >= target)
+			return MIN((2ULL << i) - 1, dh->max_us[type]);
+	}
 
-	return dio;
+	return dh->max_us[type];
 }
 
 void
-diskio_free(struct diskio *dio)
+diskio_hist_print(void)
 {
-	dio->next = free_diskios;
-	free_diskios = dio;
-}
+	struct diskio_hist *dh;
+	struct timeval now_walltime;
+	char timestamp[32];
+	char cs_diskname[32];
+	int type, i;
 
-void
-diskio_print(struct diskio *dio)
-{
-	char  *p = NULL;
-	int   len = 0;
-	uint64_t type;
-	int   format = FMT_DISKIO;
-	char  buf[64];
+	gettimeofday(&now_walltime, NULL);
+	strftime(timestamp, sizeof (timestamp), "%H:%M:%S", localtime(&now_walltime.tv_sec));
 
-	type = dio->type;
-	dio->is_meta = 0;
+	printf("\n%s  disk I/O service times (us), %" PRIu64 " in flight (peak %" PRIu64 ")\n",
+			timestamp, diskio_inflight, diskio_max_inflight);
+	printf("%-16s %-7s %10s %10s %10s %10s %10s\n",
+			"DEVICE", "TYPE", "COUNT", "P50", "P99", "P999", "MAX");
 
-	if ((type & P_CS_Class) == P_CS_Class) {
-		switch (type) {
-			case P_CS_ReadChunk:
-				p = "    RdChunkCS";
-				len = 13;
-				format = FMT_DISKIO_CS;
-				break;
-			case P_CS_WriteChunk:
-				p = "    WrChunkCS";
-				len = 13;
-				format = FMT_DISKIO_CS;
-				break;
-			case P_CS_MetaRead:
-				p = "  RdMetaCS";
-				len = 10;
-				format = FMT_DISKIO_CS;
-				break;
-			case P_CS_MetaWrite:
-				p = "  WrMetaCS";
-				len = 10;
-				format = FMT_DISKIO_CS;
-				break;
-			case P_CS_TransformRead:
-				p = "  RdBgTfCS";
-				len = 10;
-				break;
-			case P_CS_TransformWrite:
-				p = "  WrBgTfCS";
-				len = 10;
-				break;
-			case P_CS_MigrationRead:
-				p = "  RdBgMigrCS";
-				len = 12;
-				break;
-			case P_CS_MigrationWrite:
-				p = "  WrBgMigrCS";
-				len = 12;
-				break;
-			default:
-				p = "  CS";
-				len = 4;
-				break;
-		}
+	for (dh = diskio_hists; dh; dh = dh->next) {
+		const char *devname;
 
-		strncpy(buf, p, len);
-	} else {
-		switch (type & P_DISKIO_TYPE) {
-			case P_RdMeta:
-				dio->is_meta = 1;
-				p = "  RdMeta";
-				len = 8;
-				break;
-			case P_WrMeta:
-				dio->is_meta = 1;
-				p = "  WrMeta";
-				len = 8;
-				break;
-			case P_RdData:
-				p = "  RdData";
-				len = 8;
-				break;
-			case P_WrData:
-				p = "  WrData";
-				len = 8;
-				break;
-			case P_PgIn:
-				p = "  PgIn";
-				len = 6;
-				break;
-			case P_PgOut:
-				p = "  PgOut";
-				len = 7;
-				break;
-			default:
-				p = "  ";
-				len = 2;
-				break;
+		devname = dh->is_cs ? generate_cs_disk_name(dh->dev, cs_diskname) : find_disk_name(dh->dev);
+
+		for (type = 0; type < DIO_HIST_TYPES; type++) {
+			if (dh->count[type] == 0)
+				continue;
+
+			printf("%-16.16s %-7s %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n",
+					devname, diskio_hist_names[type], dh->count[type],
+					diskio_hist_percentile(dh, type, 0.50),
+					diskio_hist_percentile(dh, type, 0.99),
+					diskio_hist_percentile(dh, type, 0.999),
+					dh->max_us[type]);
+
+			printf("    ");
+			for (i = 0; i < DISKIO_HIST_BUCKETS; i++) {
+				if (dh->buckets[type][i])
+					printf(" <%" PRIu64 ":%" PRIu64, 2ULL << i, dh->buckets[type][i]);
+			}
+			printf("\n");
 		}
 
-		strncpy(buf, p, len);
+		/* each report covers one interval */
+		bzero(dh->count, sizeof (dh->count));
+		bzero(dh->max_us, sizeof (dh->max_us));
+		bzero(dh->buckets, sizeof (dh->buckets));
+	}
 
-		buf[len++] = '[';
+	fflush(stdout);
+}
 
-		if (type & P_DISKIO_ASYNC)
-			buf[len++] = 'A';
-		else
-			buf[len++] = 'S';
+#pragma mark benchmark routines
 
-		if (type & P_DISKIO_NOCACHE)
-			buf[len++] = 'N';
+/*
+ * -B counts the heap allocations made during the replay, from every
+ * thread and libktrace as well as fs_usage, by wrapping the allocators
+ * of the default malloc zone.
+ */
+_Atomic uint64_t bench_allocations;
+malloc_zone_t bench_zone;	/* the default zone as it was */
 
-		int tier = (type & P_DISKIO_TIER_MASK) >> P_DISKIO_TIER_SHIFT;
+static void *
+bench_malloc(malloc_zone_t *zone, size_t size)
+{
+	atomic_fetch_add_explicit(&bench_allocations, 1, memory_order_relaxed);
+	return bench_zone.malloc(zone, size);
+}
 
-		if (tier > 0) {
-			buf[len++] = 'T';
-			if (tier > 0 && tier < 10)
-				buf[len++] = '0' + tier;
+static void *
+bench_calloc(malloc_zone_t *zone, size_t count, size_t size)
+{
+	atomic_fetch_add_explicit(&bench_allocations, 1, memory_order_relaxed);
+	return bench_zone.calloc(zone, count, size);
+}
 
-			if (type & P_DISKIO_TIER_UPGRADE) {
-				buf[len++] = 'U';
-			}
-		}
+static void *
+bench_valloc(malloc_zone_t *zone, size_t size)
+{
+	atomic_fetch_add_explicit(&bench_allocations, 1, memory_order_relaxed);
+	return bench_zone.valloc(zone, size);
+}
 
-		if (type & P_DISKIO_PASSIVE)
-			buf[len++] = 'P';
+static void *
+bench_realloc(malloc_zone_t *zone, void *ptr, size_t size)
+{
+	atomic_fetch_add_explicit(&bench_allocations, 1, memory_order_relaxed);
+	return bench_zone.realloc(zone, ptr, size);
+}
 
-		buf[len++] = ']';
+static void *
+bench_memalign(malloc_zone_t *zone, size_t alignment, size_t size)
+{
+	atomic_fetch_add_explicit(&bench_allocations, 1, memory_order_relaxed);
+	return bench_zone.memalign(zone, alignment, size);
+}
+
+void
+bench_count_allocations(void)
+{
+	malloc_zone_t *zone = malloc_default_zone();
+
+	/* the zone is left read-only once malloc has set it up */
+	if (vm_protect(mach_task_self(), (vm_address_t)zone, sizeof (*zone), FALSE,
+				VM_PROT_READ | VM_PROT_WRITE) != KERN_SUCCESS) {
+		fprintf(stderr, "NOTE: -B can't count allocations\n");
+		return;
 	}
 
-	buf[len] = 0;
+	bench_zone = *zone;
+	zone->malloc = bench_malloc;
+	zone->calloc = bench_calloc;
+	zone->valloc = bench_valloc;
+	zone->realloc = bench_realloc;
+	if (zone->version >= 5)
+		zone->memalign = bench_memalign;
 
-	if (check_filter_mode(-1, NULL, type, 0, 0, buf)) {
-		const char *pathname = ktrace_get_path_for_vp(s, dio->vnodeid);
-		format_print(NULL, buf, NULL, type, format, dio->completed_time,
-				dio->issued_time, 1, pathname ? pathname : "", dio);
+	(void)vm_protect(mach_task_self(), (vm_address_t)zone, sizeof (*zone), FALSE, VM_PROT_READ);
+}
+
+/*
+ * Report what -B measured.  The time in the callbacks includes the time
+ * spent formatting, so the two are split apart here; whatever is left of
+ * the elapsed time went to libktrace reading and decoding the file.
+ */
+void
+bench_print(void)
+{
+	malloc_statistics_t mstats;
+	struct rusage ru;
+	uint64_t elapsed_ns, callback_ns, decode_ns;
+
+	elapsed_ns = clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - bench.start_ns;
+	callback_ns = bench.callback_ns > bench.format_ns ? bench.callback_ns - bench.format_ns : 0;
+	decode_ns = elapsed_ns > bench.callback_ns ? elapsed_ns - bench.callback_ns : 0;
+
+	fprintf(stderr, "events: %" PRIu64 " in %.3f s, %.0f events/sec\n",
+			events_received, (double)elapsed_ns / NSEC_PER_SEC,
+			elapsed_ns ? (double)events_received * NSEC_PER_SEC / elapsed_ns : 0.0);
+	fprintf(stderr, "  decode:   %8.1f ns/event\n",
+			events_received ? (double)decode_ns / events_received : 0.0);
+	fprintf(stderr, "  callback: %8.1f ns/event\n",
+			events_received ? (double)callback_ns / events_received : 0.0);
+	fprintf(stderr, "  format:   %8.1f ns/line, %" PRIu64 " lines\n",
+			bench.formatted ? (double)bench.format_ns / bench.formatted : 0.0, bench.formatted);
+
+	fprintf(stderr, "dropped: %" PRIu64 " buffer overruns", bench.overruns);
+	if (pipeline_flag) {
+		fprintf(stderr, ", %" PRIu64 " lines (%.2f%%)", pipeline_dropped,
+				bench.formatted ? 100.0 * pipeline_dropped / bench.formatted : 0.0);
 	}
+	fprintf(stderr, "\n");
+
+	os_assert(getrusage(RUSAGE_SELF, &ru) == 0);
+	malloc_zone_statistics(NULL, &mstats);
+
+	/* ru_maxrss is in bytes on Darwin */
+	fprintf(stderr, "memory: %ld KB peak RSS, %" PRIu64 " allocations (%u live), %zu KB peak heap\n",
+			ru.ru_maxrss / 1024, atomic_load(&bench_allocations), mstats.blocks_in_use,
+			mstats.max_size_in_use / 1024);
 }
 
 #pragma mark disk name routines
@@ -3831,6 +6061,9 @@ struct diskrec {
 
 struct diskrec *disk_list = NULL;
 
+/* names loaded with -c; these are from the traced system, so they win */
+struct diskrec *saved_disk_list = NULL;
+
 void
 cache_disk_names(void)
 {
@@ -3899,6 +6132,11 @@ find_disk_name(uint64_t dev)
 	if (dev == CS_DEV)
 		return ("CS");
 
+	for (dnp = saved_disk_list; dnp; dnp = dnp->next) {
+		if (dnp->dev == dev)
+			return (dnp->diskname);
+	}
+
 	for (i = 0; i < 2; i++) {
 		for (dnp = disk_list; dnp; dnp = dnp->next) {
 			if (dnp->dev == dev)
@@ -3920,3 +6158,138 @@ generate_cs_disk_name(uint64_t dev, char *s)
 
 	return (s);
 }
+
+#pragma mark path cache file routines
+
+/*
+ * The cache file is text, one entry per line:
+ *
+ *	disk <dev> <name>
+ *	meta <blkno> <pathname>
+ *
+ * Pathnames run to the end of the line; any containing a newline are not
+ * saved.  Disk names are only used when replaying a raw file, since a live
+ * trace can always look at /dev.  A file that doesn't start with the
+ * header, from another version or not a cache at all, is ignored and
+ * written afresh at exit.
+ */
+#define PATH_CACHE_HEADER	"# fs_usage path cache v1\n"
+
+void
+path_cache_load(const char *path)
+{
+	FILE *fp;
+	char *line = NULL;
+	size_t linecap = 0;
+	ssize_t linelen;
+	int nmeta = 0, ndisk = 0;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		if (errno != ENOENT)
+			warn("%s", path);
+		return;
+	}
+
+	if (getline(&line, &linecap, fp) < 0 || strcmp(line, PATH_CACHE_HEADER) != 0) {
+		fprintf(stderr, "fs_usage: %s is not a path cache from this version, rebuilding it\n", path);
+		free(line);
+		fclose(fp);
+		return;
+	}
+
+	while ((linelen = getline(&line, &linecap, fp)) > 0) {
+		unsigned long long value;
+		char *name;
+
+		if (line[linelen - 1] == '\n')
+			line[--linelen] = '\0';
+
+		if (line[0] == '#' || linelen < 6)
+			continue;
+
+		value = strtoull(&line[5], &name, 0);
+
+		if (*name != ' ')
+			continue;
+
+		name++;
+
+		if (!strncmp(line, "meta ", 5)) {
+			meta_add_name(value, name);
+			nmeta++;
+		} else if (!strncmp(line, "disk ", 5) && RAW_flag) {
+			struct diskrec *dnp;
+
+			if ((dnp = malloc(sizeof (struct diskrec))) == NULL)
+				continue;
+
+			if ((dnp->diskname = strdup(name)) == NULL) {
+				free(dnp);
+				continue;
+			}
+
+			dnp->dev = (int)value;
+			dnp->next = saved_disk_list;
+			saved_disk_list = dnp;
+			ndisk++;
+		}
+	}
+
+	free(line);
+	fclose(fp);
+
+	fprintf(stderr, "fs_usage: loaded %d metadata names and %d disk names from %s\n", nmeta, ndisk, path);
+}
+
+static void
+path_cache_save_disks(FILE *fp, struct diskrec *list)
+{
+	struct diskrec *dnp;
+
+	for (dnp = list; dnp; dnp = dnp->next)
+		fprintf(fp, "disk %d %s\n", dnp->dev, dnp->diskname);
+}
+
+void
+path_cache_save(const char *path)
+{
+	char tmp_path[MAXPATHLEN];
+	meta_info_t mi;
+	FILE *fp;
+	int fd;
+	int i;
+
+	if (snprintf(tmp_path, sizeof (tmp_path), "%s.XXXXXX", path) >= (int)sizeof (tmp_path)) {
+		warnx("%s: path too long", path);
+		return;
+	}
+
+	if ((fd = mkstemp(tmp_path)) < 0 || (fp = fdopen(fd, "w")) == NULL) {
+		warn("%s", tmp_path);
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmp_path);
+		}
+		return;
+	}
+
+	fputs(PATH_CACHE_HEADER, fp);
+
+	/* the names from the traced system come last so they win on reload */
+	path_cache_save_disks(fp, disk_list);
+	path_cache_save_disks(fp, saved_disk_list);
+
+	for (i = 0; i < VN_HASH_SIZE; i++) {
+		for (mi = m_info_hash[i]; mi; mi = mi->m_next) {
+			if (mi->m_name[0] == '\0' || strchr(mi->m_name, '\n'))
+				continue;
+
+			fprintf(fp, "meta 0x%" PRIx64 " %.*s\n", mi->m_blkno, (int)sizeof (mi->m_name), mi->m_name);
+		}
+	}
+
+	if (fclose(fp) != 0 || rename(tmp_path, path) != 0) {
+		warn("%s", path);
+		unlink(tmp_path);
+	}
+}
@@ -32,6 +32,7 @@
 #include <xpc/private.h>
 #include <sys/event.h>
 #include <sys/time.h>
+#include <dispatch/dispatch.h>
 
 #if defined(CONFIG_GCORE_MAP) || defined(CONFIG_GCORE_CONV) || defined(CONFIG_GCORE_FREF)
 
@@ -95,50 +96,6 @@ walkcore(
 
 #endif
 
-#ifdef CONFIG_GCORE_FREF
-
-int
-gcore_fref(int fd)
-{
-	off_t filesize;
-	const void *corebase = mmapfile(fd, 0, &filesize);
-
-	close(fd);
-	struct flist {
-		STAILQ_ENTRY(flist) f_linkage;
-		const char *f_nm;
-		unsigned long f_nmhash;
-	};
-	STAILQ_HEAD(flisthead, flist) __flh, *flh = &__flh;
-	STAILQ_INIT(flh);
-
-	walkcore(corebase, NULL, ^(const struct proto_fileref_command *fc) {
-		const char *nm = fc->filename.offset + (const char *)fc;
-		const unsigned long nmhash = simple_namehash(nm);
-		struct flist *f;
-		STAILQ_FOREACH(f, flh, f_linkage) {
-			if (nmhash == f->f_nmhash && 0 == strcmp(f->f_nm, nm))
-				return;	/* skip duplicates */
-		}
-		struct flist *nf = calloc(1, sizeof (*nf));
-		nf->f_nm = nm;
-		nf->f_nmhash = nmhash;
-		STAILQ_INSERT_TAIL(flh, nf, f_linkage);
-	}, NULL, NULL, NULL);
-
-	struct flist *f, *tf;
-	STAILQ_FOREACH_SAFE(f, flh, f_linkage, tf) {
-		printf("%s\n", f->f_nm);
-		free(f);
-		f = NULL;
-	}
-
-	munmap((void *)corebase, (size_t)filesize);
-	return 0;
-}
-
-#endif /* CONFIG_GCORE_FREF */
-
 #ifdef CONFIG_GCORE_MAP
 
 /*
@@ -264,10 +221,13 @@ fat_machocmp(const struct fat_header *fh, const native_mach_header_t *mh, const
 	return -1;
 }
 
+struct decode_pipeline;
+
 struct output_info {
 	int oi_fd;
 	off_t oi_foffset;
 	bool oi_nocache;
+	struct decode_pipeline *oi_pipeline;
 };
 
 static struct convstats {
@@ -277,41 +237,25 @@ static struct convstats {
 	int64_t uncompressed;
 } cstat, *cstats = &cstat;
 
+static int segment_uncompflags(unsigned, compression_algorithm *);
+
 /*
- * A fileref segment references a read-only file that contains pages from
- * the image.  The file may be a Mach binary or dylib identified with a uuid.
+ * Check that the mapped file is the one the fileref was taken from.
  */
 static int
-convert_fileref_with_file(const char *filename, const native_mach_header_t *inmh, const struct proto_fileref_command *infr, const struct vm_range *invr, struct load_command *lc, struct output_info *oi)
+match_fileref(const void *raddr, size_t rlen, const struct stat *st, const native_mach_header_t *inmh, const struct proto_fileref_command *infr, off_t *fatoff)
 {
-	assert(invr->addr == infr->vmaddr && invr->size == infr->vmsize);
-
-	struct stat st;
-	const int rfd = open(filename, O_RDONLY);
-	if (-1 == rfd || -1 == fstat(rfd, &st)) {
-		warnc(errno, "%s: open", filename);
-		return EX_IOERR;
-	}
-	const size_t rlen = (size_t)st.st_size;
-	void *raddr = mmap(NULL, rlen, PROT_READ, MAP_PRIVATE, rfd, 0);
-	if ((void *)-1 == raddr) {
-		warnc(errno, "%s: mmap", filename);
-		close(rfd);
-		return EX_IOERR;
-	}
-	close(rfd);
-
-	off_t fatoff = 0;	/* for FAT objects */
 	int ecode = EX_DATAERR;
 
+	*fatoff = 0;
 	switch (FREF_ID_TYPE(infr->flags)) {
 		case kFREF_ID_UUID: {
 			/* file should be a mach binary: check that uuid matches */
-			const uint32_t magic = *(uint32_t *)raddr;
+			const uint32_t magic = *(const uint32_t *)raddr;
 			switch (magic) {
 				case FAT_MAGIC:
 				case FAT_CIGAM:
-					if (0 == fat_machocmp(raddr, inmh, infr, &fatoff))
+					if (0 == fat_machocmp(raddr, inmh, infr, fatoff))
 						ecode = 0;
 					break;
 				case NATIVE_MH_MAGIC:
@@ -330,16 +274,78 @@ convert_fileref_with_file(const char *filename, const native_mach_header_t *inmh
 			}
 			break;
 		}
-		case kFREF_ID_MTIMESPEC_LE:
-			/* file should have the same mtime */
-			if (0 == memcmp(&st.st_mtimespec, infr->id, sizeof (infr->id)))
+		case kFREF_ID_MTIMESPEC_LE: {
+			/* file should have the same mtime (seconds are recorded) */
+			struct timespec mts;
+			memcpy(&mts, infr->id, sizeof (mts));
+			if (st->st_mtimespec.tv_sec == mts.tv_sec)
 				ecode = 0;
 			break;
+		}
 		case kFREF_ID_NONE:
 			/* file has no uniquifier, copy it anyway */
 			break;
 	}
+	return ecode;
+}
 
+static void *
+mmap_fileref(const char *filename, struct stat *st, bool quiet)
+{
+	const int rfd = open(filename, O_RDONLY);
+	if (-1 == rfd || -1 == fstat(rfd, st)) {
+		if (!quiet)
+			warnc(errno, "%s: open", filename);
+		if (-1 != rfd)
+			close(rfd);
+		return NULL;
+	}
+	void *raddr = mmap(NULL, (size_t)st->st_size, PROT_READ, MAP_PRIVATE, rfd, 0);
+	if ((void *)-1 == raddr) {
+		if (!quiet)
+			warnc(errno, "%s: mmap", filename);
+		raddr = NULL;
+	}
+	close(rfd);
+	return raddr;
+}
+
+/*
+ * fileref_matches returns true if filename is the file the fileref was
+ * taken from; cached paths are checked quietly since they may be stale.
+ */
+static bool
+fileref_matches(const char *filename, const native_mach_header_t *inmh, const struct proto_fileref_command *infr, bool quiet)
+{
+	struct stat st;
+	void *raddr = mmap_fileref(filename, &st, quiet);
+	if (NULL == raddr)
+		return false;
+	off_t fatoff;
+	const int ecode = match_fileref(raddr, (size_t)st.st_size, &st, inmh, infr, &fatoff);
+	munmap(raddr, (size_t)st.st_size);
+	if (0 != ecode && !quiet)
+		warnx("%s doesn't match corefile content", filename);
+	return 0 == ecode;
+}
+
+/*
+ * A fileref segment references a read-only file that contains pages from
+ * the image.  The file may be a Mach binary or dylib identified with a uuid.
+ */
+static int
+convert_fileref_with_file(const char *filename, const native_mach_header_t *inmh, const struct proto_fileref_command *infr, const struct vm_range *invr, struct load_command *lc, struct output_info *oi)
+{
+	assert(invr->addr == infr->vmaddr && invr->size == infr->vmsize);
+
+	struct stat st;
+	void *raddr = mmap_fileref(filename, &st, false);
+	if (NULL == raddr)
+		return EX_IOERR;
+	const size_t rlen = (size_t)st.st_size;
+
+	off_t fatoff;	/* for FAT objects */
+	const int ecode = match_fileref(raddr, rlen, &st, inmh, infr, &fatoff);
 	if (0 != ecode) {
 		munmap(raddr, rlen);
 		warnx("%s doesn't match corefile content", filename);
@@ -373,7 +379,32 @@ convert_fileref_with_file(const char *filename, const native_mach_header_t *inmh
 	if (-1 == madvise((void *)start, len, MADV_SEQUENTIAL))
 		warnc(errno, "%s: madvise", filename);
 
-	const int error = bounded_pwrite(oi->oi_fd, start, len, oi->oi_foffset, &oi->oi_nocache, NULL);
+	/*
+	 * References to a previous core (gcore -I) can be to compressed data.
+	 */
+	const unsigned flavor = COMP_ALG_TYPE(infr->flags);
+	const void *data = start;
+	size_t datalen = len;
+	void *buf = NULL;
+	if (flavor) {
+		compression_algorithm ca;
+		datalen = V_SIZEOF(invr);
+		if (0 != segment_uncompflags(flavor, &ca) ||
+			NULL == (buf = malloc(datalen)) ||
+			datalen != compression_decode_buffer(buf, datalen, start, len, NULL, ca)) {
+			warnx("%s: failed to uncompress segment", filename);
+			free(buf);
+			if (zlen)
+				munmap(zaddr, zlen);
+			munmap(raddr, rlen);
+			return EX_DATAERR;
+		}
+		data = buf;
+		cstats->compressed += len;
+	}
+
+	const int error = bounded_pwrite(oi->oi_fd, data, datalen, oi->oi_foffset, &oi->oi_nocache, NULL);
+	free(buf);
 
 	if (zlen) {
 		if (-1 == munmap(zaddr, zlen))
@@ -388,11 +419,11 @@ convert_fileref_with_file(const char *filename, const native_mach_header_t *inmh
 
 	const struct file_range fr = {
 		.off = oi->oi_foffset,
-		.size = infr->filesize,
+		.size = datalen,
 	};
 	make_native_segment_command(lc, invr, &fr, infr->maxprot, infr->prot);
 	oi->oi_foffset += fr.size;
-	cstats->added += infr->filesize;
+	cstats->added += datalen;
 	return 0;
 }
 
@@ -611,12 +642,17 @@ waitpid_error:
  * result plist. Upon success, this function sets response point to the buffer
  * and returns bytes being read; otherwise, it returns -1. The caller is
  * responsible for freeing the response buffer.
+ *
+ * Several of these may run at once, so the child is spawned with only
+ * stdin, stderr and its own pipe open: a child inheriting another query's
+ * pipe would hold off that query's end-of-file until it exited.
  */
 static ssize_t
 exec_dsymForUUID(uuid_string_t id, char **response)
 {
 	int pipe_fds[2] = {-1, -1};
 	bool file_actions_inited = false;
+	bool attr_inited = false;
 	ssize_t bytes_read = -1;
 	int rc;
 
@@ -647,9 +683,31 @@ exec_dsymForUUID(uuid_string_t id, char **response)
 		goto cleanup;
 	}
 
+	rc = posix_spawn_file_actions_addinherit_np(&file_actions, STDIN_FILENO);
+	if (rc) {
+		goto cleanup;
+	}
+
+	rc = posix_spawn_file_actions_addinherit_np(&file_actions, STDERR_FILENO);
+	if (rc) {
+		goto cleanup;
+	}
+
+	posix_spawnattr_t attr;
+	rc = posix_spawnattr_init(&attr);
+	if (rc) {
+		goto cleanup;
+	}
+	attr_inited = true;
+
+	rc = posix_spawnattr_setflags(&attr, POSIX_SPAWN_CLOEXEC_DEFAULT);
+	if (rc) {
+		goto cleanup;
+	}
+
 	char *command[] = {DSYMFORUUID_PATH, id, NULL};
 	pid_t child;
-	rc = posix_spawn(&child, command[0], &file_actions, NULL, command, NULL);
+	rc = posix_spawn(&child, command[0], &file_actions, &attr, command, NULL);
 	if (rc) {
 		goto cleanup;
 	}
@@ -671,6 +729,9 @@ cleanup:
 	if (file_actions_inited) {
 		posix_spawn_file_actions_destroy(&file_actions);
 	}
+	if (attr_inited) {
+		posix_spawnattr_destroy(&attr);
+	}
 
 	return bytes_read;
 }
@@ -684,7 +745,7 @@ cleanup:
 static char *
 get_symbol_rich_executable_path_via_dsymForUUID(const uuid_t uuid)
 {
-	char *response;
+	char *response = NULL;
 	ssize_t size;
 	uuid_string_t uuid_str;
 	xpc_object_t plist = NULL;
@@ -741,11 +802,377 @@ cleanup:
 }
 
 /*
- * bind the file reference into the output core file.
- * filename optionally prefixed with names from a ':'-separated PATH variable
+ * UUID-tagged filerefs are content-addressed, so the file that matched a
+ * uuid in one conversion is the first one tried for it in the next.  The
+ * cache is a text file of "uuid path" lines, most recently resolved first;
+ * a cached path is always checked against the fileref before it is used.
  */
+#define FRCACHE_MAXENTRIES	4096
+
+struct frcache_entry {
+	uuid_t fce_uuid;
+	char *fce_path;
+	bool fce_superseded;	/* resolved again in this run */
+};
+
+static struct frcache {
+	struct frcache_entry *fc_entries;	/* sorted by uuid */
+	size_t fc_nentries;
+	bool fc_dirty;
+} frcache;
+
+static char *
+frcache_filename(bool create)
+{
+	char cachedir[MAXPATHLEN];
+	const size_t len = confstr(_CS_DARWIN_USER_CACHE_DIR, cachedir, sizeof (cachedir));
+	if (0 == len || len > sizeof (cachedir))
+		return NULL;
+
+	char *dir;
+	if (-1 == asprintf(&dir, "%s/com.apple.gcore", cachedir))
+		return NULL;
+	if (create && -1 == mkdir(dir, 0700) && EEXIST != errno) {
+		free(dir);
+		return NULL;
+	}
+	char *nm = NULL;
+	if (-1 == asprintf(&nm, "%s/filerefs", dir))
+		nm = NULL;
+	free(dir);
+	return nm;
+}
+
 static int
-convert_fileref(const char *path, bool zf, const native_mach_header_t *inmh, const struct proto_fileref_command *infr, struct load_command *lc, struct output_info *oi)
+frcache_entrycmp(const void *a, const void *b)
+{
+	const struct frcache_entry *fa = a, *fb = b;
+	return uuid_compare(fa->fce_uuid, fb->fce_uuid);
+}
+
+static void
+frcache_load(void)
+{
+	char *nm = frcache_filename(false);
+	FILE *f = NULL == nm ? NULL : fopen(nm, "r");
+	free(nm);
+	if (NULL == f)
+		return;
+
+	size_t nalloc = 0;
+	char *line = NULL;
+	size_t linecap = 0;
+	ssize_t linelen;
+	while (frcache.fc_nentries < FRCACHE_MAXENTRIES &&
+		   (linelen = getline(&line, &linecap, f)) > 0) {
+		if ('\n' == line[linelen - 1])
+			line[--linelen] = '\0';
+		const size_t uulen = sizeof (uuid_string_t) - 1;
+		if ((size_t)linelen < uulen + 2 || ' ' != line[uulen] || '/' != line[uulen + 1])
+			continue;
+		line[uulen] = '\0';
+		uuid_t uu;
+		if (0 != uuid_parse(line, uu))
+			continue;
+		if (frcache.fc_nentries == nalloc) {
+			nalloc = nalloc ? 2 * nalloc : 64;
+			struct frcache_entry *fce = realloc(frcache.fc_entries, nalloc * sizeof (*fce));
+			if (NULL == fce)
+				break;
+			frcache.fc_entries = fce;
+		}
+		struct frcache_entry *fce = &frcache.fc_entries[frcache.fc_nentries];
+		if (NULL == (fce->fce_path = strdup(line + uulen + 1)))
+			break;
+		uuid_copy(fce->fce_uuid, uu);
+		fce->fce_superseded = false;
+		frcache.fc_nentries++;
+	}
+	free(line);
+	fclose(f);
+
+	qsort(frcache.fc_entries, frcache.fc_nentries, sizeof (*frcache.fc_entries), frcache_entrycmp);
+	if (OPTIONS_DEBUG(opt, 1))
+		printf("Loaded %zu cached fileref paths\n", frcache.fc_nentries);
+}
+
+static struct frcache_entry *
+frcache_lookup(const uuid_t uu)
+{
+	struct frcache_entry key;
+	uuid_copy(key.fce_uuid, uu);
+	return bsearch(&key, frcache.fc_entries, frcache.fc_nentries, sizeof (key), frcache_entrycmp);
+}
+
+static void
+frcache_free(void)
+{
+	for (size_t i = 0; i < frcache.fc_nentries; i++)
+		free(frcache.fc_entries[i].fce_path);
+	free(frcache.fc_entries);
+	memset(&frcache, 0, sizeof (frcache));
+}
+
+/*
+ * Each distinct file named by the filerefs of the core, and the file
+ * found to match it.  Segments from the same file share a resolution.
+ */
+struct fref_resolution {
+	const struct proto_fileref_command *fr_fc;	/* first reference */
+	const char *fr_nm;
+	unsigned long fr_nmhash;
+	char *fr_path;			/* the matching file, or NULL */
+	const char *fr_source;	/* where fr_path came from */
+};
+
+struct fref_table {
+	struct fref_resolution *ft_res;
+	size_t ft_nres;
+	struct fref_resolution **ft_bycmd;	/* by load command index */
+};
+
+#define FREF_RESOLVE_WIDTH	16	/* concurrent lookups, mostly waiting on dsymForUUID */
+
+/*
+ * Find the file for one reference, in the same order as a conversion
+ * always tried them: dsymForUUID (-s), then the search path (-L) or the
+ * recorded name.  The cache is consulted first for uuid-tagged files.
+ * Called concurrently, so only the resolution itself is written.
+ */
+static void
+resolve_fileref(const char *path, const native_mach_header_t *inmh, struct fref_resolution *res)
+{
+	const struct proto_fileref_command *infr = res->fr_fc;
+	const bool uuidtag = kFREF_ID_UUID == FREF_ID_TYPE(infr->flags);
+
+	if (uuidtag) {
+		const struct frcache_entry *fce = frcache_lookup(infr->id);
+		if (NULL != fce && fileref_matches(fce->fce_path, inmh, infr, true)) {
+			res->fr_path = strdup(fce->fce_path);
+			res->fr_source = "cache";
+			return;
+		}
+	}
+
+	if (opt->dsymforuuid && uuidtag) {
+		/* Try to use dsymForUUID to get the symbol-rich executable */
+		char *symrich_filepath = get_symbol_rich_executable_path_via_dsymForUUID(infr->id);
+		if (symrich_filepath) {
+			if (fileref_matches(symrich_filepath, inmh, infr, false)) {
+				res->fr_path = symrich_filepath;
+				res->fr_source = "dsymForUUID";
+				return;
+			}
+			free(symrich_filepath);
+			warnx("Failed to convert fileref with dsymForUUID. Fall back to local paths");
+		}
+	}
+
+	const char *nm = res->fr_nm;
+	if (NULL == path || '\0' == *path) {
+		if (fileref_matches(nm, inmh, infr, false)) {
+			res->fr_path = strdup(nm);
+			res->fr_source = "fileref";
+		}
+		return;
+	}
+
+	/* search the : separated path (-L) for possible matches */
+	char *pathcopy = strdup(path);
+	char *searchpath = pathcopy;
+	const char *token;
+
+	while ((token = strsep(&searchpath, ":")) != NULL) {
+		const size_t buflen = strlen(token) + 1 + strlen(nm) + 1;
+		char *buf = malloc(buflen);
+		snprintf(buf, buflen, "%s%s%s", token, '/' == nm[0] ? "" : "/", nm);
+		if (0 == access(buf, R_OK)) {
+			if (fileref_matches(buf, inmh, infr, false)) {
+				res->fr_path = buf;
+				res->fr_source = "search path";
+				break;
+			}
+		} else if (OPTIONS_DEBUG(opt, 1))
+			printf("\t'%s' for '%s': %s.\n", buf, nm,
+				0 == access(buf, F_OK) ? "Unreadable" : "Not present");
+		free(buf);
+	}
+	free(pathcopy);
+}
+
+static bool
+same_fileref(const struct fref_resolution *res, const struct proto_fileref_command *fc, const char *nm, unsigned long nmhash)
+{
+	return nmhash == res->fr_nmhash &&
+		FREF_ID_TYPE(fc->flags) == FREF_ID_TYPE(res->fr_fc->flags) &&
+		0 == memcmp(fc->id, res->fr_fc->id, sizeof (fc->id)) &&
+		0 == strcmp(nm, res->fr_nm);
+}
+
+/*
+ * Resolve every distinct fileref up front and concurrently, so that a core
+ * with hundreds of references doesn't wait on each lookup in turn.
+ */
+static struct fref_table *
+resolve_filerefs(const native_mach_header_t *inmh, const char *path)
+{
+	struct fref_table *ft = calloc(1, sizeof (*ft));
+	if (NULL == ft ||
+		NULL == (ft->ft_bycmd = calloc(inmh->ncmds, sizeof (*ft->ft_bycmd))) ||
+		NULL == (ft->ft_res = calloc(inmh->ncmds, sizeof (*ft->ft_res))))
+		errx(EX_OSERR, "out of memory for fileref table");
+
+	const struct load_command *lc = (const void *)(inmh + 1);
+	for (unsigned i = 0; i < inmh->ncmds; i++) {
+		if (proto_LC_FILEREF == lc->cmd) {
+			const struct proto_fileref_command *fc = (const void *)lc;
+			const char *nm = fc->filename.offset + (const char *)fc;
+			const unsigned long nmhash = simple_namehash(nm);
+			struct fref_resolution *res = NULL;
+			for (size_t n = 0; n < ft->ft_nres && NULL == res; n++)
+				if (same_fileref(&ft->ft_res[n], fc, nm, nmhash))
+					res = &ft->ft_res[n];
+			if (NULL == res) {
+				res = &ft->ft_res[ft->ft_nres++];
+				res->fr_fc = fc;
+				res->fr_nm = nm;
+				res->fr_nmhash = nmhash;
+			}
+			ft->ft_bycmd[i] = res;
+		}
+		if (NULL == (lc = next_lc(lc)))
+			break;
+	}
+	if (0 == ft->ft_nres)
+		return ft;
+
+	frcache_load();
+
+	const uint64_t start = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+	dispatch_queue_t dq = dispatch_get_global_queue(QOS_CLASS_UTILITY, 0);
+	dispatch_group_t dg = dispatch_group_create();
+	dispatch_semaphore_t ds = dispatch_semaphore_create(FREF_RESOLVE_WIDTH);
+
+	for (size_t n = 0; n < ft->ft_nres; n++) {
+		struct fref_resolution *res = &ft->ft_res[n];
+		dispatch_semaphore_wait(ds, DISPATCH_TIME_FOREVER);
+		dispatch_group_async(dg, dq, ^{
+			resolve_fileref(path, inmh, res);
+			dispatch_semaphore_signal(ds);
+		});
+	}
+	dispatch_group_wait(dg, DISPATCH_TIME_FOREVER);
+	dispatch_release(ds);
+	dispatch_release(dg);
+
+	/*
+	 * Fold the answers for uuid-tagged files back into the cache.
+	 */
+	size_t nfound = 0, ncached = 0;
+	for (size_t n = 0; n < ft->ft_nres; n++) {
+		const struct fref_resolution *res = &ft->ft_res[n];
+		if (NULL != res->fr_path)
+			nfound++;
+		if (kFREF_ID_UUID != FREF_ID_TYPE(res->fr_fc->flags))
+			continue;
+		struct frcache_entry *fce = frcache_lookup(res->fr_fc->id);
+		if (NULL != fce) {
+			/* either replaced, or no longer matches */
+			fce->fce_superseded = true;
+			if (NULL != res->fr_path && 0 == strcmp(fce->fce_path, res->fr_path)) {
+				ncached++;
+				continue;
+			}
+		} else if (NULL == res->fr_path)
+			continue;
+		frcache.fc_dirty = true;
+	}
+
+	if (opt->verbose) {
+		const uint64_t elapsed = clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - start;
+		printf("Resolved %zu of %zu referenced files (%zu from cache) in %llu ms\n",
+			   nfound, ft->ft_nres, ncached, elapsed / NSEC_PER_MSEC);
+	}
+	return ft;
+}
+
+/*
+ * Write this run's uuid-tagged resolutions first, then the older entries
+ * that weren't resolved again, up to the size of the cache.
+ */
+static void
+frcache_save(const struct fref_table *ft)
+{
+	if (!frcache.fc_dirty)
+		return;
+	frcache.fc_dirty = false;
+
+	char *nm = frcache_filename(true);
+	if (NULL == nm)
+		return;
+	char *tnm;
+	if (-1 == asprintf(&tnm, "%s.XXXXXX", nm)) {
+		free(nm);
+		return;
+	}
+	const int fd = mkstemp(tnm);
+	FILE *f = -1 == fd ? NULL : fdopen(fd, "w");
+	if (NULL == f) {
+		if (-1 != fd) {
+			close(fd);
+			unlink(tnm);
+		}
+		free(tnm);
+		free(nm);
+		return;
+	}
+
+	size_t nentries = 0;
+	bool ok = true;
+	uuid_string_t uustr;
+	for (size_t n = 0; ok && n < ft->ft_nres && nentries < FRCACHE_MAXENTRIES; n++) {
+		const struct fref_resolution *res = &ft->ft_res[n];
+		if (NULL == res->fr_path || '/' != res->fr_path[0] ||
+			kFREF_ID_UUID != FREF_ID_TYPE(res->fr_fc->flags))
+			continue;
+		uuid_unparse_lower(res->fr_fc->id, uustr);
+		ok = fprintf(f, "%s %s\n", uustr, res->fr_path) > 0;
+		nentries++;
+	}
+	for (size_t i = 0; ok && i < frcache.fc_nentries && nentries < FRCACHE_MAXENTRIES; i++) {
+		const struct frcache_entry *fce = &frcache.fc_entries[i];
+		if (fce->fce_superseded)
+			continue;
+		uuid_unparse_lower(fce->fce_uuid, uustr);
+		ok = fprintf(f, "%s %s\n", uustr, fce->fce_path) > 0;
+		nentries++;
+	}
+	if (0 != fclose(f))
+		ok = false;
+	if (!ok || -1 == rename(tnm, nm))
+		unlink(tnm);
+	free(tnm);
+	free(nm);
+}
+
+static void
+free_fref_table(struct fref_table *ft)
+{
+	frcache_save(ft);
+	frcache_free();
+	for (size_t n = 0; n < ft->ft_nres; n++)
+		free(ft->ft_res[n].fr_path);
+	free(ft->ft_res);
+	free(ft->ft_bycmd);
+	free(ft);
+}
+
+/*
+ * bind the file reference into the output core file, using the file
+ * found for it by resolve_filerefs()
+ */
+static int
+convert_fileref(const struct fref_resolution *res, bool zf, const native_mach_header_t *inmh, const struct proto_fileref_command *infr, struct load_command *lc, struct output_info *oi)
 {
 	const char *nm = infr->filename.offset + (const char *)infr;
 	uuid_string_t uustr;
@@ -778,53 +1205,11 @@ convert_fileref(const char *path, bool zf, const native_mach_header_t *inmh, con
 		printf("\n");
 	}
 
-	int ecode = 0;
-	if (opt->dsymforuuid && (FREF_ID_TYPE(infr->flags) == kFREF_ID_UUID)) {
-		/* Try to use dsymForUUID to get the symbol-rich executable */
-		char *symrich_filepath = get_symbol_rich_executable_path_via_dsymForUUID(infr->id);
-		if (symrich_filepath) {
-			if (opt->verbose) {
-				printf("\tTrying %s from dsymForUUID\n", symrich_filepath);
-			}
-			ecode = convert_fileref_with_file(symrich_filepath, inmh, infr, &invr, lc, oi);
-			free(symrich_filepath);
-			if (ecode == 0) {
-				return (ecode);
-			}
-			warnx("Failed to convert fileref with dsymForUUID. Fall back to local paths");
-		}
-	}
-
-	const size_t pathsize = path ? strlen(path) : 0;
-	ecode = EX_DATAERR;
-	if (0 == pathsize)
-		ecode = convert_fileref_with_file(nm, inmh, infr, &invr, lc, oi);
-	else {
-		/* search the : separated path (-L) for possible matches */
-		char *pathcopy = strdup(path);
-		char *searchpath = pathcopy;
-		const char *token;
-
-		while ((token = strsep(&searchpath, ":")) != NULL) {
-			const size_t buflen = strlen(token) + 1 + strlen(nm) + 1;
-			char *buf = malloc(buflen);
-			snprintf(buf, buflen, "%s%s%s", token, '/' == nm[0] ? "" : "/", nm);
-			if (opt->verbose)
-				printf("\tTrying '%s'", buf);
-			if (0 == access(buf, R_OK)) {
-				if (opt->verbose)
-					printf("\n");
-				ecode = convert_fileref_with_file(buf, inmh, infr, &invr, lc, oi);
-				if (0 == ecode) {
-					free(buf);
-					break;
-				}
-			} else if (opt->verbose)
-				printf(": %s.\n",
-					0 == access(buf, F_OK) ? "Unreadable" : "Not present");
-			free(buf);
-		}
-		free(pathcopy);
+	int ecode = EX_DATAERR;
+	if (NULL != res->fr_path) {
+		if (opt->verbose)
+			printf("\tUsing '%s' from %s\n", res->fr_path, res->fr_source);
+		ecode = convert_fileref_with_file(res->fr_path, inmh, infr, &invr, lc, oi);
 	}
 
 	if (0 != ecode && zf) {
@@ -880,6 +1265,178 @@ segment_uncompflags(unsigned algnum, compression_algorithm *ca)
 	return 0;
 }
 
+/*
+ * Compressed segments are uncompressed by a pool of worker queues.  Each
+ * segment is given its place in the output file and its load command
+ * when it's queued, so only the data is written late: by this thread,
+ * in the order queued, as each slot is reused or the pipeline drained.
+ * The decode buffers belong to the slots and are reused, growing as
+ * needed, so at most dp_nslots of them are ever allocated.
+ */
+struct dchunk {
+	const void *dc_input;
+	size_t dc_inlen;
+	compression_algorithm dc_ca;
+	void *dc_buf;
+	size_t dc_buflen;			// allocated size of dc_buf
+	size_t dc_outlen;			// expected uncompressed size
+	off_t dc_foffset;			// where it goes in the output file
+	bool dc_ok;
+	dispatch_semaphore_t dc_done;
+};
+
+struct decode_pipeline {
+	unsigned dp_nqueues;
+	dispatch_queue_t *dp_queues;
+	unsigned dp_nslots;
+	unsigned dp_head;			// oldest outstanding chunk
+	unsigned dp_count;			// number outstanding
+	unsigned long dp_queued;	// chunks queued in total
+	int dp_ecode;				// first error seen
+	struct dchunk dp_slots[];
+};
+
+static void
+start_decode_pipeline(struct output_info *oi)
+{
+	assert(NULL == oi->oi_pipeline);
+	if (opt->nthreads < 2)
+		return;
+
+	const unsigned nslots = 2 * opt->nthreads;
+	struct decode_pipeline *dp = calloc(1, sizeof (*dp) + nslots * sizeof (dp->dp_slots[0]));
+	if (NULL == dp)
+		return;
+	dp->dp_queues = calloc(opt->nthreads, sizeof (*dp->dp_queues));
+	if (NULL == dp->dp_queues) {
+		free(dp);
+		return;
+	}
+	dp->dp_nqueues = opt->nthreads;
+	for (unsigned i = 0; i < dp->dp_nqueues; i++)
+		dp->dp_queues[i] = dispatch_queue_create("com.apple.gcore.uncompress", DISPATCH_QUEUE_SERIAL);
+	dp->dp_nslots = nslots;
+	for (unsigned i = 0; i < dp->dp_nslots; i++)
+		dp->dp_slots[i].dc_done = dispatch_semaphore_create(0);
+
+	if (OPTIONS_DEBUG(opt, 1))
+		printf("uncompressing with %u threads, %u segments in flight\n", dp->dp_nqueues, dp->dp_nslots);
+	oi->oi_pipeline = dp;
+}
+
+/*
+ * Write out the oldest outstanding chunk, waiting for it to be uncompressed.
+ */
+static void
+retire_dchunk(struct output_info *oi)
+{
+	struct decode_pipeline *dp = oi->oi_pipeline;
+	assert(dp->dp_count);
+	struct dchunk *dc = &dp->dp_slots[dp->dp_head];
+
+	dp->dp_head = (dp->dp_head + 1) % dp->dp_nslots;
+	dp->dp_count--;
+
+	dispatch_semaphore_wait(dc->dc_done, DISPATCH_TIME_FOREVER);
+	if (0 != dp->dp_ecode)
+		return;
+	if (!dc->dc_ok) {
+		warnx("failed to uncompress segment");
+		dp->dp_ecode = EX_DATAERR;
+		return;
+	}
+	const int error = bounded_pwrite(oi->oi_fd, dc->dc_buf, dc->dc_outlen, dc->dc_foffset, &oi->oi_nocache, NULL);
+	if (error) {
+		warnc(error, "failed to write data to core file");
+		dp->dp_ecode = EX_IOERR;
+	}
+}
+
+static int
+queue_dchunk(struct output_info *oi, const void *input, size_t inlen, compression_algorithm ca, size_t outlen)
+{
+	struct decode_pipeline *dp = oi->oi_pipeline;
+
+	if (dp->dp_count == dp->dp_nslots)
+		retire_dchunk(oi);
+	if (0 != dp->dp_ecode)
+		return dp->dp_ecode;
+
+	struct dchunk *dc = &dp->dp_slots[(dp->dp_head + dp->dp_count) % dp->dp_nslots];
+	if (dc->dc_buflen < outlen) {
+		free(dc->dc_buf);
+		dc->dc_buflen = 0;
+		if (NULL == (dc->dc_buf = malloc(outlen))) {
+			warnx("out of memory for uncompressed segment");
+			return EX_OSERR;
+		}
+		dc->dc_buflen = outlen;
+	}
+	dc->dc_input = input;
+	dc->dc_inlen = inlen;
+	dc->dc_ca = ca;
+	dc->dc_outlen = outlen;
+	dc->dc_foffset = oi->oi_foffset;
+	dp->dp_count++;
+
+	dispatch_async(dp->dp_queues[dp->dp_queued % dp->dp_nqueues], ^{
+		dc->dc_ok = dc->dc_outlen == compression_decode_buffer(dc->dc_buf, dc->dc_outlen, dc->dc_input, dc->dc_inlen, NULL, dc->dc_ca);
+		dispatch_semaphore_signal(dc->dc_done);
+	});
+	dp->dp_queued++;
+	return 0;
+}
+
+/*
+ * Write out everything still outstanding; returns the first error seen.
+ */
+static int
+finish_decode_pipeline(struct output_info *oi)
+{
+	struct decode_pipeline *dp = oi->oi_pipeline;
+
+	if (NULL == dp)
+		return 0;
+	while (dp->dp_count)
+		retire_dchunk(oi);
+
+	const int ecode = dp->dp_ecode;
+
+	for (unsigned i = 0; i < dp->dp_nqueues; i++)
+		dispatch_release(dp->dp_queues[i]);
+	for (unsigned i = 0; i < dp->dp_nslots; i++) {
+		dispatch_release(dp->dp_slots[i].dc_done);
+		free(dp->dp_slots[i].dc_buf);
+	}
+	free(dp->dp_queues);
+	poison(dp, 0xdeadbeef, sizeof (*dp));
+	free(dp);
+	oi->oi_pipeline = NULL;
+	return ecode;
+}
+
+/*
+ * Reserve the space the converted core will need up front, contiguously
+ * if possible, rather than have the file system grow it piecemeal.
+ */
+static void
+preallocate(int fd, off_t size)
+{
+	fstore_t fst = {
+		.fst_flags = F_ALLOCATECONTIG | F_ALLOCATEALL,
+		.fst_posmode = F_PEOFPOSMODE,
+		.fst_offset = 0,
+		.fst_length = size,
+	};
+	if (-1 == fcntl(fd, F_PREALLOCATE, &fst)) {
+		fst.fst_flags = F_ALLOCATEALL;
+		if (-1 == fcntl(fd, F_PREALLOCATE, &fst) && OPTIONS_DEBUG(opt, 1)) {
+			hsize_str_t hstr;
+			printf("cannot preallocate %s: %s\n", str_hsize(hstr, size), strerror(errno));
+		}
+	}
+}
+
 static int
 convert_region(const void *inbase, const struct vm_range *invr, const struct file_range *infr, const vm_prot_t prot, const vm_prot_t maxprot, const int flavor, struct load_command *lc, struct output_info *oi)
 {
@@ -905,6 +1462,20 @@ convert_region(const void *inbase, const struct vm_range *invr, const struct fil
 				printvr(invr, "uncompressing %s to %s\n",
 					str_hsize(hstr1, F_SIZE(infr)), str_hsize(hstr2, V_SIZE(invr)));
 			}
+			if (oi->oi_pipeline) {
+				if (0 != (ecode = queue_dchunk(oi, input, (size_t)F_SIZE(infr), ca, V_SIZEOF(invr))))
+					return ecode;
+				cstats->compressed += F_SIZE(infr);
+
+				const struct file_range outfr = {
+					.off = oi->oi_foffset,
+					.size = V_SIZE(invr),
+				};
+				make_native_segment_command(lc, invr, &outfr, maxprot, prot);
+				oi->oi_foffset += outfr.size;
+				cstats->uncompressed += outfr.size;
+				return 0;
+			}
 			const size_t buflen = V_SIZEOF(invr);
 			buf = malloc(buflen);
 			const size_t dstsize = compression_decode_buffer(buf, buflen, input, (size_t)F_SIZE(infr), NULL, ca);
@@ -1012,6 +1583,7 @@ gcore_conv(int infd, const char *searchpath, bool zf, int fd)
 	 */
 	__block size_t headersize = sizeof (native_mach_header_t);
 	__block unsigned pageshift_target = pageshift_host;
+	__block off_t datasize = 0;
 
 	walkcore(inmh, ^(const struct proto_coreinfo_command *ci) {
 		assert(sizeof (*ci) == ci->cmdsize);
@@ -1028,11 +1600,16 @@ gcore_conv(int infd, const char *searchpath, bool zf, int fd)
 		assert(cmdsize == fc->cmdsize);
 
 		headersize += sizeof (native_segment_command_t);
-	}, ^(const struct proto_coredata_command *__unused cc) {
+		datasize += COMP_ALG_TYPE(fc->flags) ? (off_t)fc->vmsize : (off_t)fc->filesize;
+	}, ^(const struct proto_coredata_command *cc) {
 		assert(sizeof (*cc) == cc->cmdsize);
 		headersize += sizeof (native_segment_command_t);
+		if (cc->filesize)
+			datasize += (off_t)cc->vmsize;
 	}, ^(const native_segment_command_t *sc) {
 		headersize += sc->cmdsize;
+		if (sc->filesize)
+			datasize += (off_t)sc->vmsize;
 	}, ^(const struct thread_command *tc) {
 		headersize += tc->cmdsize;
 	});
@@ -1057,12 +1634,18 @@ gcore_conv(int infd, const char *searchpath, bool zf, int fd)
 		.oi_fd = fd,
 		.oi_foffset = ((vm_offset_t)headersize + pagemask_target) & ~pagemask_target,
 		.oi_nocache = false,
+		.oi_pipeline = NULL,
 	};
 
+	struct fref_table *ft = resolve_filerefs(inmh, searchpath);
+
+	preallocate(fd, oi.oi_foffset + datasize);
+	start_decode_pipeline(&oi);
+
 	for (unsigned i = 0; i < inmh->ncmds; i++) {
 		switch (inlc->cmd) {
 			case proto_LC_FILEREF:
-				ecode = convert_fileref(searchpath, zf, inmh, (const void *)inlc, lc, &oi);
+				ecode = convert_fileref(ft->ft_bycmd[i], zf, inmh, (const void *)inlc, lc, &oi);
 				break;
 			case proto_LC_COREDATA:
 				ecode = convert_coredata(corebase, inmh, (const void *)inlc, lc, &oi);
@@ -1089,6 +1672,11 @@ gcore_conv(int infd, const char *searchpath, bool zf, int fd)
 			break;
 	}
 
+	const int pecode = finish_decode_pipeline(&oi);
+	if (0 == ecode)
+		ecode = pecode;
+	free_fref_table(ft);
+
 	/*
 	 * Even if we've encountered an error, try and write out the header
 	 */
@@ -1115,3 +1703,68 @@ gcore_conv(int infd, const char *searchpath, bool zf, int fd)
 	return ecode;
 }
 #endif
+
+#ifdef CONFIG_GCORE_FREF
+
+int
+gcore_fref(int fd, const char *searchpath)
+{
+	off_t filesize;
+	const void *corebase = mmapfile(fd, 0, &filesize);
+
+	close(fd);
+
+#ifdef CONFIG_GCORE_CONV
+	/*
+	 * With a search path or dsymForUUID, show where each file was found.
+	 */
+	if (NULL != searchpath || opt->dsymforuuid) {
+		const native_mach_header_t *inmh = corebase;
+		validate_core_header(inmh, filesize);
+		struct fref_table *ft = resolve_filerefs(inmh, searchpath);
+		for (size_t n = 0; n < ft->ft_nres; n++) {
+			const struct fref_resolution *res = &ft->ft_res[n];
+			if (NULL != res->fr_path)
+				printf("%s\t%s\n", res->fr_nm, res->fr_path);
+			else
+				printf("%s\t(not found)\n", res->fr_nm);
+		}
+		free_fref_table(ft);
+		munmap((void *)corebase, (size_t)filesize);
+		return 0;
+	}
+#endif
+	struct flist {
+		STAILQ_ENTRY(flist) f_linkage;
+		const char *f_nm;
+		unsigned long f_nmhash;
+	};
+	STAILQ_HEAD(flisthead, flist) __flh, *flh = &__flh;
+	STAILQ_INIT(flh);
+
+	walkcore(corebase, NULL, ^(const struct proto_fileref_command *fc) {
+		const char *nm = fc->filename.offset + (const char *)fc;
+		const unsigned long nmhash = simple_namehash(nm);
+		struct flist *f;
+		STAILQ_FOREACH(f, flh, f_linkage) {
+			if (nmhash == f->f_nmhash && 0 == strcmp(f->f_nm, nm))
+				return;	/* skip duplicates */
+		}
+		struct flist *nf = calloc(1, sizeof (*nf));
+		nf->f_nm = nm;
+		nf->f_nmhash = nmhash;
+		STAILQ_INSERT_TAIL(flh, nf, f_linkage);
+	}, NULL, NULL, NULL);
+
+	struct flist *f, *tf;
+	STAILQ_FOREACH_SAFE(f, flh, f_linkage, tf) {
+		printf("%s\n", f->f_nm);
+		free(f);
+		f = NULL;
+	}
+
+	munmap((void *)corebase, (size_t)filesize);
+	return 0;
+}
+
+#endif /* CONFIG_GCORE_FREF */
@@ -10,7 +10,7 @@
 #define _CONVERT_H
 
 #ifdef CONFIG_GCORE_FREF
-extern int gcore_fref(int);
+extern int gcore_fref(int, const char *);
 #endif
 
 #ifdef CONFIG_GCORE_MAP
@@ -19,6 +19,11 @@
 #include <sys/param.h>
 #include <libgen.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <dispatch/dispatch.h>
+#include <Block.h>
+#include <CommonCrypto/CommonDigest.h>
 
 native_mach_header_t *
 make_corefile_mach_header(void *data)
@@ -101,7 +106,7 @@ make_coredata_command(void *data, const struct vm_range *vr, const struct file_r
 	return cc;
 }
 
-static size_t
+size_t
 sizeof_segment_command(void) {
 	return opt->extended ?
 		sizeof (struct proto_coredata_command) : sizeof (native_segment_command_t);
@@ -129,9 +134,579 @@ commit_load_command(struct write_segment_data *wsd, const struct load_command *l
     mach_header_inc_sizeofcmds(mh, lc->cmdsize);
 }
 
+#pragma mark -- Concurrent compression of segment data --
+
+/*
+ * When compressing, chunks of memory are mapped in address order by the
+ * thread walking the region list, then handed to a pool of worker queues
+ * to be compressed.  Chunks are retired strictly in the order they were
+ * queued, and only then given a file offset, a load command and written,
+ * so the core file is laid out exactly as if it were written serially.
+ * Load commands without data (zfod segments, file references) are queued
+ * behind any chunks still in flight for the same reason.
+ *
+ * At most wp_nslots chunks are outstanding at once, which bounds the
+ * memory in use to about twice that many chunks.
+ */
+struct wchunk {
+    const struct region *wc_region;
+    struct vm_range wc_vr;          // range in the target task
+    struct vm_range wc_d;           // our copy of that range
+    void *wc_dstbuf;                // compressed copy, if smaller
+    size_t wc_filesize;
+    unsigned wc_algorithm;
+    walk_return_t (^wc_command)(void);  // queued load command, no data
+    dispatch_semaphore_t wc_done;   // compression has finished
+    unsigned char wc_digest[CC_SHA256_DIGEST_LENGTH];   // of the data as written
+    const struct base_segment *wc_unchanged;    // same data in the base core
+};
+
+struct write_pipeline {
+    unsigned wp_nqueues;
+    dispatch_queue_t *wp_queues;
+    unsigned wp_nslots;
+    unsigned wp_head;               // oldest outstanding chunk
+    unsigned wp_count;              // number outstanding
+    unsigned long wp_queued;        // chunks queued in total
+    bool wp_failed;                 // a write failed: discard the rest
+    struct wchunk wp_slots[];
+};
+
+static walk_return_t pwrite_memory(struct write_segment_data *, const void *, size_t, const struct vm_range *);
+static int segment_compflags(compression_algorithm, unsigned *);
+
+#define SAMPLE_SIZE		(64 * 1024)
+#define LARGE_REGION	(256ull * 1024 * 1024)
+
+/*
+ * -Z algorithm=auto: compress the start of the chunk with LZ4 to see how
+ * it fares.  Data that barely compresses (e.g. media buffers) is stored
+ * as is; very compressible data is worth the slower, tighter LZFSE unless
+ * the region is so large that speed matters more.
+ */
+static bool
+choose_algorithm(const struct wchunk *wc, compression_algorithm *ca)
+{
+    const size_t samplesize = MIN(V_SIZEOF(&wc->wc_d), SAMPLE_SIZE);
+    void *sample = malloc(samplesize);
+
+    if (NULL == sample) {
+        *ca = COMPRESSION_LZ4;
+        return true;
+    }
+    const size_t csize = compression_encode_buffer(sample, samplesize, (const void *)V_ADDR(&wc->wc_d), samplesize, NULL, COMPRESSION_LZ4);
+    free(sample);
+
+    if (0 == csize || csize > samplesize - samplesize / 8)
+        return false;
+    if (csize < samplesize / 4 && R_SIZE(wc->wc_region) < LARGE_REGION)
+        *ca = COMPRESSION_LZFSE;
+    else
+        *ca = COMPRESSION_LZ4;
+    return true;
+}
+
+static void
+compress_chunk(struct wchunk *wc)
+{
+    const struct vm_range *dp = &wc->wc_d;
+    compression_algorithm ca = opt->calgorithm;
+
+    if (opt->autocompress && !choose_algorithm(wc, &ca))
+        return;
+
+    void *dstbuf = malloc(V_SIZEOF(dp));
+
+    if (NULL == dstbuf)
+        return;
+    const size_t filesize = compression_encode_buffer(dstbuf, V_SIZEOF(dp), (const void *)V_ADDR(dp), V_SIZEOF(dp), NULL, ca);
+    if (filesize > 0 && filesize < V_SIZEOF(dp) &&
+        segment_compflags(ca, &wc->wc_algorithm) == 0) {
+        wc->wc_dstbuf = dstbuf;	/* the data source is now heap, compressed */
+        wc->wc_filesize = filesize;
+        mach_vm_deallocate(mach_task_self(), V_ADDR(dp), V_SIZE(dp));
+        V_SETADDR(&wc->wc_d, 0);
+    } else
+        free(dstbuf);
+    assert(wc->wc_filesize <= V_SIZEOF(dp));
+}
+
+static void
+digest_chunk(struct wchunk *wc)
+{
+    const void *srcaddr = wc->wc_dstbuf ? wc->wc_dstbuf : (const void *)V_ADDR(&wc->wc_d);
+    CC_SHA256(srcaddr, (CC_LONG)wc->wc_filesize, wc->wc_digest);
+}
+
+/*
+ * Chunks already in the file, by digest, so that identical data
+ * (e.g. memory mapped more than once) is only written once.
+ */
+struct written_chunk {
+    struct written_chunk *wr_next;
+    unsigned char wr_digest[CC_SHA256_DIGEST_LENGTH];
+    size_t wr_filesize;
+    unsigned wr_algorithm;
+    off_t wr_foffset;
+};
+
+#define WRITTEN_HASH_SIZE   (1u << 14)
+
+struct written_chunks {
+    struct written_chunk *wt_hash[WRITTEN_HASH_SIZE];
+};
+
+static unsigned
+written_hash(const unsigned char *digest)
+{
+    uint32_t h;
+    memcpy(&h, digest, sizeof (h));
+    return h & (WRITTEN_HASH_SIZE - 1);
+}
+
+static const struct written_chunk *
+find_written_chunk(const struct write_segment_data *wsd, const struct wchunk *wc)
+{
+    if (NULL == wsd->wsd_written)
+        return NULL;
+    const struct written_chunk *wr = wsd->wsd_written->wt_hash[written_hash(wc->wc_digest)];
+    for (; wr; wr = wr->wr_next)
+        if (wr->wr_filesize == wc->wc_filesize &&
+            wr->wr_algorithm == wc->wc_algorithm &&
+            0 == memcmp(wr->wr_digest, wc->wc_digest, sizeof (wr->wr_digest)))
+            break;
+    return wr;
+}
+
+static void
+add_written_chunk(struct write_segment_data *wsd, const struct wchunk *wc, off_t foffset)
+{
+    if (NULL == wsd->wsd_written &&
+        NULL == (wsd->wsd_written = calloc(1, sizeof (*wsd->wsd_written))))
+        return;
+    struct written_chunk *wr = malloc(sizeof (*wr));
+    if (NULL == wr)
+        return;
+    memcpy(wr->wr_digest, wc->wc_digest, sizeof (wr->wr_digest));
+    wr->wr_filesize = wc->wc_filesize;
+    wr->wr_algorithm = wc->wc_algorithm;
+    wr->wr_foffset = foffset;
+    struct written_chunk **bucket = &wsd->wsd_written->wt_hash[written_hash(wc->wc_digest)];
+    wr->wr_next = *bucket;
+    *bucket = wr;
+}
+
+static void
+del_written_chunks(struct write_segment_data *wsd)
+{
+    if (NULL == wsd->wsd_written)
+        return;
+    for (unsigned i = 0; i < WRITTEN_HASH_SIZE; i++) {
+        struct written_chunk *wr = wsd->wsd_written->wt_hash[i];
+        while (wr) {
+            struct written_chunk *next = wr->wr_next;
+            free(wr);
+            wr = next;
+        }
+    }
+    free(wsd->wsd_written);
+    wsd->wsd_written = NULL;
+}
+
+static void
+release_chunk(struct wchunk *wc)
+{
+    if (wc->wc_dstbuf) {
+        free(wc->wc_dstbuf);
+        wc->wc_dstbuf = NULL;
+    }
+    if (V_ADDR(&wc->wc_d)) {
+        kern_return_t kr = mach_vm_deallocate(mach_task_self(), V_ADDR(&wc->wc_d), V_SIZE(&wc->wc_d));
+        if (KERN_SUCCESS != kr && OPTIONS_DEBUG(opt, 1))
+            err_mach(kr, wc->wc_region, "mach_vm_deallocate() post %llx-%llx", V_ADDR(&wc->wc_d), V_SIZE(&wc->wc_d));
+        V_SETADDR(&wc->wc_d, 0);
+    }
+}
+
+/*
+ * -I basecore: a chunk whose data is exactly as it was in a previous core
+ * of the same process is written as a file reference to that core rather
+ * than written again.  The comparison is made on the data as it would be
+ * written, i.e. after compression, which is deterministic.
+ */
+struct base_segment {
+    mach_vm_offset_t bs_vmaddr;
+    mach_vm_offset_t bs_vmsize;
+    off_t bs_fileoff;
+    size_t bs_filesize;
+    unsigned bs_algorithm;
+};
+
+struct base_core {
+    char *bc_path;
+    const void *bc_addr;
+    size_t bc_size;
+    unsigned bc_nsegs;
+    struct base_segment *bc_segs;   // sorted by address
+};
+
+static int
+base_segment_compar(const void *a, const void *b)
+{
+    const struct base_segment *bsa = a, *bsb = b;
+    if (bsa->bs_vmaddr != bsb->bs_vmaddr)
+        return bsa->bs_vmaddr < bsb->bs_vmaddr ? -1 : 1;
+    return 0;
+}
+
+struct base_core *
+load_base_core(const char *path)
+{
+    struct base_core *bc = calloc(1, sizeof (*bc));
+    if (NULL == bc)
+        errx(EX_OSERR, "out of memory for base core");
+    if (NULL == (bc->bc_path = realpath(path, NULL)))
+        errc(EX_NOINPUT, errno, "%s", path);
+
+    struct stat st;
+    const int fd = open(bc->bc_path, O_RDONLY);
+    if (-1 == fd || -1 == fstat(fd, &st))
+        errc(EX_NOINPUT, errno, "%s", bc->bc_path);
+    bc->bc_size = (size_t)st.st_size;
+    if (bc->bc_size < sizeof (native_mach_header_t))
+        errx(EX_DATAERR, "%s: not a core file", bc->bc_path);
+    bc->bc_addr = mmap(NULL, bc->bc_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if ((void *)-1 == bc->bc_addr)
+        errc(EX_NOINPUT, errno, "%s: mmap", bc->bc_path);
+    close(fd);
+
+    const native_mach_header_t *mh = bc->bc_addr;
+    if (NATIVE_MH_MAGIC != mh->magic || MH_CORE != mh->filetype ||
+        sizeof (*mh) + mh->sizeofcmds > bc->bc_size)
+        errx(EX_DATAERR, "%s: not a core file", bc->bc_path);
+
+    bc->bc_segs = calloc(mh->ncmds, sizeof (*bc->bc_segs));
+    if (NULL == bc->bc_segs && mh->ncmds)
+        errx(EX_OSERR, "out of memory for base core");
+
+    const struct load_command *lc = (const void *)(mh + 1);
+    for (unsigned i = 0; i < mh->ncmds && NULL != lc; i++, lc = next_lc(lc)) {
+        if ((caddr_t)lc + sizeof (*lc) > (caddr_t)(mh + 1) + mh->sizeofcmds)
+            errx(EX_DATAERR, "%s: bad load command", bc->bc_path);
+        if (proto_LC_COREDATA != lc->cmd)
+            continue;
+        const struct proto_coredata_command *cc = (const void *)lc;
+        if (0 == cc->filesize || cc->fileoff + cc->filesize > bc->bc_size)
+            continue;
+        struct base_segment *bs = &bc->bc_segs[bc->bc_nsegs++];
+        bs->bs_vmaddr = cc->vmaddr;
+        bs->bs_vmsize = cc->vmsize;
+        bs->bs_fileoff = (off_t)cc->fileoff;
+        bs->bs_filesize = (size_t)cc->filesize;
+        bs->bs_algorithm = COMP_ALG_TYPE(cc->flags);
+    }
+    qsort(bc->bc_segs, bc->bc_nsegs, sizeof (*bc->bc_segs), base_segment_compar);
+    if (OPTIONS_DEBUG(opt, 1))
+        printf("base core %s: %u data segments\n", bc->bc_path, bc->bc_nsegs);
+    return bc;
+}
+
+void
+del_base_core(struct base_core *bc)
+{
+    munmap((void *)bc->bc_addr, bc->bc_size);
+    free(bc->bc_segs);
+    free(bc->bc_path);
+    free(bc);
+}
+
+const char *
+base_core_path(const struct base_core *bc)
+{
+    return bc->bc_path;
+}
+
+static const struct base_segment *
+find_base_segment(const struct base_core *bc, const struct wchunk *wc)
+{
+    const struct base_segment key = {
+        .bs_vmaddr = V_ADDR(&wc->wc_vr),
+    };
+    const struct base_segment *bs = bsearch(&key, bc->bc_segs, bc->bc_nsegs, sizeof (key), base_segment_compar);
+    if (NULL == bs ||
+        bs->bs_vmsize != V_SIZE(&wc->wc_vr) ||
+        bs->bs_filesize != wc->wc_filesize ||
+        bs->bs_algorithm != wc->wc_algorithm)
+        return NULL;
+    const void *srcaddr = wc->wc_dstbuf ? wc->wc_dstbuf : (const void *)V_ADDR(&wc->wc_d);
+    if (0 != memcmp((const char *)bc->bc_addr + bs->bs_fileoff, srcaddr, wc->wc_filesize))
+        return NULL;
+    return bs;
+}
+
+static struct proto_fileref_command *make_fileref_command(void *, const char *, const uuid_t,
+    const struct vm_range *, const struct file_range *, const vm_region_submap_info_data_64_t *, unsigned);
+
+static void
+print_compression_summary(struct write_segment_data *wsd)
+{
+    struct compression_summary *cs = &wsd->wsd_cs;
+    static const char *const algnames[] = {
+        [kCOMP_NONE] = "stored",
+        [kCOMP_LZ4] = "lz4",
+        [kCOMP_ZLIB] = "zlib",
+        [kCOMP_LZMA] = "lzma",
+        [kCOMP_LZFSE] = "lzfse",
+    };
+
+    if (NULL == cs->cs_region)
+        return;
+    if (OPTIONS_DEBUG(opt, 2)) {
+        hsize_str_t hin, hout;
+        printr(cs->cs_region, "%lu chunk%s %s -> %s (", cs->cs_nchunks, 1 == cs->cs_nchunks ? "" : "s",
+               str_hsize(hin, cs->cs_insize), str_hsize(hout, cs->cs_outsize));
+        const char *sep = "";
+        for (unsigned i = 0; i < sizeof (algnames) / sizeof (algnames[0]); i++)
+            if (cs->cs_count[i]) {
+                printf("%s%s %lu", sep, algnames[i], cs->cs_count[i]);
+                sep = ", ";
+            }
+        printf(")\n");
+    }
+    bzero(cs, sizeof (*cs));
+}
+
+/*
+ * Summarize per region how each chunk was compressed.  Chunks are written
+ * in address order, so a region ends when a chunk from another turns up.
+ */
+static void
+summarize_chunk(struct write_segment_data *wsd, const struct wchunk *wc)
+{
+    struct compression_summary *cs = &wsd->wsd_cs;
+
+    if (cs->cs_region != wc->wc_region)
+        print_compression_summary(wsd);
+    cs->cs_region = wc->wc_region;
+    cs->cs_nchunks++;
+    cs->cs_insize += V_SIZE(&wc->wc_vr);
+    cs->cs_outsize += wc->wc_filesize;
+    if (wc->wc_algorithm < sizeof (cs->cs_count) / sizeof (cs->cs_count[0]))
+        cs->cs_count[wc->wc_algorithm]++;
+}
+
+static walk_return_t
+write_chunk(struct write_segment_data *wsd, struct wchunk *wc)
+{
+    const struct region *r = wc->wc_region;
+    const void *srcaddr = wc->wc_dstbuf ? wc->wc_dstbuf : (const void *)V_ADDR(&wc->wc_d);
+
+    assert(wc->wc_filesize);
+
+    /* with -Z dedup, point at any identical copy already in the file */
+    const struct written_chunk *wr = opt->dedup && !wsd->wsd_stream && !wc->wc_unchanged ?
+        find_written_chunk(wsd, wc) : NULL;
+    const struct file_range fr = {
+        .off = wr ? wr->wr_foffset : wsd->wsd_foffset,
+        .size = wc->wc_filesize,
+    };
+    make_segment_command(wsd->wsd_lc, &wc->wc_vr, &fr, &r->r_info, wc->wc_algorithm, r->r_purgable);
+
+    walk_return_t step;
+    if (wc->wc_unchanged) {
+        /* overwrite the segment command with a reference to the base core */
+        const struct base_segment *bs = wc->wc_unchanged;
+        const struct file_range bfr = {
+            .off = bs->bs_fileoff,
+            .size = bs->bs_filesize,
+        };
+        struct proto_fileref_command *fc = make_fileref_command(wsd->wsd_lc, wsd->wsd_base->bc_path, UUID_NULL, &wc->wc_vr, &bfr, &r->r_info, r->r_purgable);
+        fc->flags |= COMP_MAKE_FLAGS(bs->bs_algorithm);
+        wsd->wsd_nunchanged += V_SIZE(&wc->wc_vr);
+        if (OPTIONS_DEBUG(opt, 3))
+            printvr(&wc->wc_vr, "unchanged since base core (offset %lld)\n", bs->bs_fileoff);
+        step = WALK_CONTINUE;
+    } else if (wr) {
+        wsd->wsd_ndeduped += V_SIZE(&wc->wc_vr);
+        if (OPTIONS_DEBUG(opt, 3))
+            printvr(&wc->wc_vr, "duplicate of data at offset %lld\n", wr->wr_foffset);
+        step = WALK_CONTINUE;
+    } else if (wsd->wsd_stream) {
+        /*
+         * The offset of everything after this chunk has already been
+         * sent: write exactly filesize bytes, padding with zeroes where
+         * the data couldn't be read.
+         */
+        const size_t size = MIN(wc->wc_filesize, V_SIZEOF(&wc->wc_d));
+        step = pwrite_memory(wsd, srcaddr, size, &wc->wc_vr);
+        const off_t pad = fr.off + (off_t)fr.size - wsd->wsd_foffset;
+        if (WALK_ERROR != step && pad > 0) {
+            if (0 == bounded_write_zeroes(wsd->wsd_fd, (size_t)pad, wsd->wsd_foffset)) {
+                wsd->wsd_foffset += pad;
+                wsd->wsd_nwritten += pad;
+            } else
+                step = WALK_ERROR;
+        }
+    } else {
+        step = pwrite_memory(wsd, srcaddr, wc->wc_filesize, &wc->wc_vr);
+        if (opt->dedup && WALK_ERROR != step && wsd->wsd_foffset == fr.off + (off_t)fr.size)
+            add_written_chunk(wsd, wc, fr.off);
+    }
+    if (opt->extended && OPTIONS_DEBUG(opt, 2))
+        summarize_chunk(wsd, wc);
+    release_chunk(wc);
+    if (WALK_ERROR != step)
+        commit_load_command(wsd, wsd->wsd_lc);
+    return step;
+}
+
+/*
+ * Write out the oldest outstanding chunk, waiting for it to be compressed.
+ */
+static void
+retire_chunk(struct write_segment_data *wsd)
+{
+    struct write_pipeline *wp = wsd->wsd_pipeline;
+    assert(wp->wp_count);
+    struct wchunk *wc = &wp->wp_slots[wp->wp_head];
+
+    wp->wp_head = (wp->wp_head + 1) % wp->wp_nslots;
+    wp->wp_count--;
+
+    if (wc->wc_command) {
+        if (!wp->wp_failed && WALK_ERROR == wc->wc_command())
+            wp->wp_failed = true;
+        Block_release(wc->wc_command);
+        wc->wc_command = NULL;
+    } else {
+        dispatch_semaphore_wait(wc->wc_done, DISPATCH_TIME_FOREVER);
+        if (wp->wp_failed)
+            release_chunk(wc);
+        else if (WALK_ERROR == write_chunk(wsd, wc))
+            wp->wp_failed = true;
+    }
+}
+
+/*
+ * Find a free slot for the next chunk, retiring the oldest if all are busy.
+ */
+static struct wchunk *
+reserve_chunk(struct write_segment_data *wsd)
+{
+    struct write_pipeline *wp = wsd->wsd_pipeline;
+
+    if (wp->wp_count == wp->wp_nslots)
+        retire_chunk(wsd);
+    if (wp->wp_failed)
+        return NULL;
+    return &wp->wp_slots[(wp->wp_head + wp->wp_count) % wp->wp_nslots];
+}
+
+static void
+queue_chunk(struct write_segment_data *wsd, struct wchunk *wc)
+{
+    struct write_pipeline *wp = wsd->wsd_pipeline;
+
+    assert(wc == &wp->wp_slots[(wp->wp_head + wp->wp_count) % wp->wp_nslots]);
+    wp->wp_count++;
+    if (NULL == wc->wc_command) {
+        const struct base_core *bc = wsd->wsd_base;
+        dispatch_async(wp->wp_queues[wp->wp_queued % wp->wp_nqueues], ^{
+            const uint64_t pstart = prof_start();
+            compress_chunk(wc);
+            if (bc)
+                wc->wc_unchanged = find_base_segment(bc, wc);
+            if (opt->dedup && !wc->wc_unchanged)
+                digest_chunk(wc);
+            prof_stop(PROF_COMPRESS, pstart, V_SIZE(&wc->wc_vr));
+            dispatch_semaphore_signal(wc->wc_done);
+        });
+    }
+    wp->wp_queued++;
+}
+
+/*
+ * Emit a load command that has no data in the file, in order.
+ */
+static walk_return_t
+write_header_command(struct write_segment_data *wsd, walk_return_t (^command)(void))
+{
+    struct write_pipeline *wp = wsd->wsd_pipeline;
+
+    if (NULL == wp || 0 == wp->wp_count)
+        return command();
+
+    struct wchunk *wc = reserve_chunk(wsd);
+    if (NULL == wc)
+        return WALK_ERROR;
+    wc->wc_command = Block_copy(command);
+    queue_chunk(wsd, wc);
+    return WALK_CONTINUE;
+}
+
+void
+start_write_pipeline(struct write_segment_data *wsd)
+{
+    assert(NULL == wsd->wsd_pipeline);
+    if (!opt->extended || opt->nthreads < 2 || wsd->wsd_stream)
+        return;
+
+    const unsigned nslots = 2 * opt->nthreads;
+    struct write_pipeline *wp = calloc(1, sizeof (*wp) + nslots * sizeof (wp->wp_slots[0]));
+    if (NULL == wp)
+        return;
+    wp->wp_queues = calloc(opt->nthreads, sizeof (*wp->wp_queues));
+    if (NULL == wp->wp_queues) {
+        free(wp);
+        return;
+    }
+    wp->wp_nqueues = opt->nthreads;
+    for (unsigned i = 0; i < wp->wp_nqueues; i++)
+        wp->wp_queues[i] = dispatch_queue_create("com.apple.gcore.compress", DISPATCH_QUEUE_SERIAL);
+    wp->wp_nslots = nslots;
+    for (unsigned i = 0; i < wp->wp_nslots; i++)
+        wp->wp_slots[i].wc_done = dispatch_semaphore_create(0);
+
+    if (OPTIONS_DEBUG(opt, 1))
+        printf("compressing with %u threads, %u chunks in flight\n", wp->wp_nqueues, wp->wp_nslots);
+    wsd->wsd_pipeline = wp;
+}
+
+/*
+ * Write out everything still outstanding, and forget what was written;
+ * returns WALK_ERROR if any queued chunk couldn't be written.
+ */
+walk_return_t
+finish_write_pipeline(struct write_segment_data *wsd)
+{
+    struct write_pipeline *wp = wsd->wsd_pipeline;
+
+    if (NULL == wp) {
+        print_compression_summary(wsd);
+        del_written_chunks(wsd);
+        return WALK_CONTINUE;
+    }
+    while (wp->wp_count)
+        retire_chunk(wsd);
+    print_compression_summary(wsd);
+    del_written_chunks(wsd);
+
+    const walk_return_t step = wp->wp_failed ? WALK_ERROR : WALK_CONTINUE;
+
+    for (unsigned i = 0; i < wp->wp_nqueues; i++)
+        dispatch_release(wp->wp_queues[i]);
+    for (unsigned i = 0; i < wp->wp_nslots; i++)
+        dispatch_release(wp->wp_slots[i].wc_done);
+    free(wp->wp_queues);
+    poison(wp, 0xdeadbeef, sizeof (*wp));
+    free(wp);
+    wsd->wsd_pipeline = NULL;
+    return step;
+}
+
 #pragma mark -- Regions written as "file references" --
 
-static size_t
+size_t
 cmdsize_fileref_command(const char *nm)
 {
     size_t cmdsize = sizeof (struct proto_fileref_command);
@@ -192,7 +767,6 @@ make_fileref_command(void *data, const char *pathname, const uuid_t uuid,
 	 * A file reference allows different kinds of identifiers for
 	 * the reference to be reconstructed.
 	 */
-	assert(info->external_pager);
 
 	if (!uuid_is_null(uuid)) {
 		uuid_copy(fc->id, uuid);
@@ -243,20 +817,23 @@ write_fileref_subregion(const struct region *r, const struct subregion *s, struc
         printf("%s: unusual segment type %s from %s\n", __func__, S_MACHO_TYPE(s), S_FILENAME(s));
     assert((r->r_info.max_protection & VM_PROT_READ) == VM_PROT_READ);
     assert((r->r_info.protection & VM_PROT_WRITE) == 0);
+    assert(r->r_info.external_pager);
 
-    const struct libent *le = S_LIBENT(s);
-	const struct file_range fr = {
-		.off = S_MACHO_FILEOFF(s),
-		.size = S_SIZE(s),
-	};
-    const struct proto_fileref_command *fc = make_fileref_command(wsd->wsd_lc, le->le_pathname, le->le_uuid, S_RANGE(s), &fr, &r->r_info, r->r_purgable);
+    return write_header_command(wsd, ^walk_return_t (void) {
+        const struct libent *le = S_LIBENT(s);
+        const struct file_range fr = {
+            .off = S_MACHO_FILEOFF(s),
+            .size = S_SIZE(s),
+        };
+        const struct proto_fileref_command *fc = make_fileref_command(wsd->wsd_lc, le->le_pathname, le->le_uuid, S_RANGE(s), &fr, &r->r_info, r->r_purgable);
 
-    commit_load_command(wsd, (const void *)fc);
-    if (OPTIONS_DEBUG(opt, 3)) {
-        hsize_str_t hstr;
-        printr(r, "ref '%s' %s (vm %llx-%llx, file offset %lld for %s)\n", S_FILENAME(s), S_MACHO_TYPE(s), (uint64_t)fc->vmaddr, (uint64_t)fc->vmaddr + fc->vmsize, (int64_t)fc->fileoff, str_hsize(hstr, fc->filesize));
-    }
-    return WALK_CONTINUE;
+        commit_load_command(wsd, (const void *)fc);
+        if (OPTIONS_DEBUG(opt, 3)) {
+            hsize_str_t hstr;
+            printr(r, "ref '%s' %s (vm %llx-%llx, file offset %lld for %s)\n", S_FILENAME(s), S_MACHO_TYPE(s), (uint64_t)fc->vmaddr, (uint64_t)fc->vmaddr + fc->vmsize, (int64_t)fc->fileoff, str_hsize(hstr, fc->filesize));
+        }
+        return WALK_CONTINUE;
+    });
 }
 
 /*
@@ -271,21 +848,24 @@ write_fileref_region(const struct region *r, struct write_segment_data *wsd)
     assert(r->r_info.user_tag != VM_MEMORY_IOKIT);
     assert((r->r_info.max_protection & VM_PROT_READ) == VM_PROT_READ);
     assert(!r->r_inzfodregion);
+    assert(r->r_info.external_pager);
+
+    return write_header_command(wsd, ^walk_return_t (void) {
+        const struct libent *le = r->r_fileref->fr_libent;
+        const char *pathname = r->r_fileref->fr_pathname;
+        const struct file_range fr = {
+            .off = r->r_fileref->fr_offset,
+            .size = R_SIZE(r),
+        };
+        const struct proto_fileref_command *fc = make_fileref_command(wsd->wsd_lc, pathname, le ? le->le_uuid : UUID_NULL, R_RANGE(r), &fr, &r->r_info, r->r_purgable);
 
-	const struct libent *le = r->r_fileref->fr_libent;
-	const char *pathname = r->r_fileref->fr_pathname;
-	const struct file_range fr = {
-		.off = r->r_fileref->fr_offset,
-		.size = R_SIZE(r),
-	};
-	const struct proto_fileref_command *fc = make_fileref_command(wsd->wsd_lc, pathname, le ? le->le_uuid : UUID_NULL, R_RANGE(r), &fr, &r->r_info, r->r_purgable);
-
-    commit_load_command(wsd, (const void *)fc);
-    if (OPTIONS_DEBUG(opt, 3)) {
-        hsize_str_t hstr;
-		printr(r, "ref '%s' %s (vm %llx-%llx, file offset %lld for %s)\n", pathname, "(type?)", (uint64_t)fc->vmaddr, (uint64_t)fc->vmaddr + fc->vmsize, (int64_t)fc->fileoff, str_hsize(hstr, fc->filesize));
-    }
-    return WALK_CONTINUE;
+        commit_load_command(wsd, (const void *)fc);
+        if (OPTIONS_DEBUG(opt, 3)) {
+            hsize_str_t hstr;
+            printr(r, "ref '%s' %s (vm %llx-%llx, file offset %lld for %s)\n", pathname, "(type?)", (uint64_t)fc->vmaddr, (uint64_t)fc->vmaddr + fc->vmsize, (int64_t)fc->fileoff, str_hsize(hstr, fc->filesize));
+        }
+        return WALK_CONTINUE;
+    });
 }
 
 const struct regionop fileref_ops = {
@@ -313,13 +893,15 @@ write_zfod_region(const struct region *r, struct write_segment_data *wsd)
     assert(r->r_info.user_tag != VM_MEMORY_IOKIT);
     assert((r->r_info.max_protection & VM_PROT_READ) == VM_PROT_READ);
 
-	const struct file_range fr = {
-		.off = wsd->wsd_foffset,
-		.size = 0,
-	};
-    make_segment_command(wsd->wsd_lc, R_RANGE(r), &fr, &r->r_info, 0, VM_PURGABLE_EMPTY);
-    commit_load_command(wsd, wsd->wsd_lc);
-    return WALK_CONTINUE;
+    return write_header_command(wsd, ^walk_return_t (void) {
+        const struct file_range fr = {
+            .off = wsd->wsd_foffset,
+            .size = 0,
+        };
+        make_segment_command(wsd->wsd_lc, R_RANGE(r), &fr, &r->r_info, 0, VM_PURGABLE_EMPTY);
+        commit_load_command(wsd, wsd->wsd_lc);
+        return WALK_CONTINUE;
+    });
 }
 
 const struct regionop zfod_ops = {
@@ -335,8 +917,10 @@ pwrite_memory(struct write_segment_data *wsd, const void *addr, size_t size, con
 {
     assert(size);
 
-    ssize_t nwritten;
-	const int error = bounded_pwrite(wsd->wsd_fd, addr, size, wsd->wsd_foffset, &wsd->wsd_nocache, &nwritten);
+    ssize_t nwritten = 0;
+	const int error = wsd->wsd_stream ?
+		bounded_write(wsd->wsd_fd, addr, size, wsd->wsd_foffset, &nwritten) :
+		bounded_pwrite(wsd->wsd_fd, addr, size, wsd->wsd_foffset, &wsd->wsd_nocache, &nwritten);
 
     if (error || OPTIONS_DEBUG(opt, 3)) {
         hsize_str_t hsz;
@@ -365,6 +949,10 @@ pwrite_memory(struct write_segment_data *wsd, const void *addr, size_t size, con
             }
             break;
         case EFAULT:	// transient mapping failure?
+            if (wsd->wsd_stream) {
+                wsd->wsd_foffset += nwritten;   // the rest is padded
+                wsd->wsd_nwritten += nwritten;
+            }
             break;
         default:        // EROFS, ENOSPC, EFBIG etc. */
             step = WALK_ERROR;
@@ -584,6 +1172,165 @@ map_memory_range(struct write_segment_data *wsd, const struct region *r, const s
     return WALK_CONTINUE;
 }
 
+/*
+ * Write (or queue) a mapped range as a segment with data.
+ * The mapping is consumed.
+ */
+static walk_return_t
+write_data_range(struct write_segment_data *wsd, const struct region *r, const struct vm_range *vr, const struct vm_range *dp)
+{
+    struct wchunk wcs, *wc = &wcs;
+
+    if (wsd->wsd_pipeline && NULL == (wc = reserve_chunk(wsd))) {
+        mach_vm_deallocate(mach_task_self(), V_ADDR(dp), V_SIZE(dp));
+        return WALK_ERROR;
+    }
+    wc->wc_region = r;
+    wc->wc_vr = *vr;
+    wc->wc_d = *dp;
+    wc->wc_dstbuf = NULL;
+    wc->wc_algorithm = 0;
+    wc->wc_command = NULL;
+    wc->wc_unchanged = NULL;
+    wc->wc_filesize = wsd->wsd_stream ? V_SIZEOF(vr) : V_SIZEOF(dp);
+
+    if (wsd->wsd_pipeline) {
+        queue_chunk(wsd, wc);   // compressed and written later, in order
+        return WALK_CONTINUE;
+    }
+    if (!wsd->wsd_stream) {
+        const uint64_t pstart = prof_start();
+        if (opt->extended)
+            compress_chunk(wc);
+        if (wsd->wsd_base)
+            wc->wc_unchanged = find_base_segment(wsd->wsd_base, wc);
+        if (opt->dedup && !wc->wc_unchanged)
+            digest_chunk(wc);
+        prof_stop(PROF_COMPRESS, pstart, V_SIZE(vr));
+    }
+    return write_chunk(wsd, wc);
+}
+
+static walk_return_t
+write_zfod_range(struct write_segment_data *wsd, const struct region *r, const struct vm_range *vr)
+{
+    const struct vm_range zvr = *vr;
+
+    wsd->wsd_nzeroed += V_SIZE(vr);
+    return write_header_command(wsd, ^walk_return_t (void) {
+        const struct file_range fr = {
+            .off = wsd->wsd_foffset,
+            .size = 0,
+        };
+        make_segment_command(wsd->wsd_lc, &zvr, &fr, &r->r_info, 0, r->r_purgable);
+        commit_load_command(wsd, wsd->wsd_lc);
+        return WALK_CONTINUE;
+    });
+}
+
+/*
+ * Written a word at a time so that the compiler can vectorize it;
+ * size must be a multiple of 64 bytes.
+ */
+static bool
+is_zero_page(const void *addr, size_t size)
+{
+    const uint64_t *p = addr;
+    const uint64_t *const end = p + size / sizeof (*p);
+
+    for (; p < end; p += 8) {
+        uint64_t acc = 0;
+        for (unsigned i = 0; i < 8; i++)
+            acc |= p[i];
+        if (acc)
+            return false;
+    }
+    return true;
+}
+
+#define ZFOD_RUN_PAGES	16	/* shortest run worth splitting a chunk for */
+
+/*
+ * Runs of zero-filled pages are described by zfod segments rather than
+ * written out, as long as there's room left in the header for the
+ * extra load commands needed to split the chunk around them.
+ */
+static walk_return_t
+write_nonzero_ranges(struct write_segment_data *wsd, const struct region *r, const struct vm_range *vr, const struct vm_range *dp)
+{
+    const mach_vm_offset_t pagesize_host = 1ull << pageshift_host;
+    const mach_vm_offset_t pagemask = pagesize_host - 1;
+
+    if (V_SIZE(dp) != V_SIZE(vr) || 0 != (V_ADDR(dp) & pagemask) || 0 != (V_SIZE(dp) & pagemask))
+        return write_data_range(wsd, r, vr, dp);
+
+    const mach_vm_offset_t end = V_SIZE(dp);
+    mach_vm_offset_t off = 0;   // start of what has yet to be written
+    mach_vm_offset_t a = 0;
+    walk_return_t step = WALK_CONTINUE;
+
+    /* scanning is usually the first touch of the pages: count it as reading */
+    uint64_t pstart = prof_start();
+
+    while (a < end) {
+        if (!is_zero_page((const void *)(V_ADDR(dp) + a), (size_t)pagesize_host)) {
+            a += pagesize_host;
+            continue;
+        }
+        mach_vm_offset_t z = a + pagesize_host;
+        while (z < end && is_zero_page((const void *)(V_ADDR(dp) + z), (size_t)pagesize_host))
+            z += pagesize_host;
+
+        /* one more command for any data before the run, one for any after */
+        const unsigned long extra = (a > off) + (z < end);
+        if ((0 == extra || z - a >= ZFOD_RUN_PAGES * pagesize_host) && extra <= wsd->wsd_nspare) {
+            prof_stop(PROF_READ, pstart, 0);
+            wsd->wsd_nspare -= extra;
+            if (a > off) {
+                const struct vm_range svr = {
+                    .addr = V_ADDR(vr) + off,
+                    .size = a - off,
+                };
+                const struct vm_range sd = {
+                    .addr = V_ADDR(dp) + off,
+                    .size = a - off,
+                };
+                off = a;
+                if (WALK_ERROR == (step = write_data_range(wsd, r, &svr, &sd)))
+                    break;
+            }
+            mach_vm_deallocate(mach_task_self(), V_ADDR(dp) + a, z - a);
+            const struct vm_range zvr = {
+                .addr = V_ADDR(vr) + a,
+                .size = z - a,
+            };
+            off = z;
+            if (WALK_ERROR == (step = write_zfod_range(wsd, r, &zvr)))
+                break;
+            pstart = prof_start();
+        }
+        a = z;
+    }
+    if (WALK_ERROR != step)
+        prof_stop(PROF_READ, pstart, 0);
+
+    if (off < end) {
+        const struct vm_range svr = {
+            .addr = V_ADDR(vr) + off,
+            .size = end - off,
+        };
+        const struct vm_range sd = {
+            .addr = V_ADDR(dp) + off,
+            .size = end - off,
+        };
+        if (WALK_ERROR == step)
+            mach_vm_deallocate(mach_task_self(), V_ADDR(&sd), V_SIZE(&sd));
+        else
+            step = write_data_range(wsd, r, &svr, &sd);
+    }
+    return step;
+}
+
 static walk_return_t
 write_memory_range(struct write_segment_data *wsd, const struct region *r, mach_vm_offset_t vmaddr, mach_vm_offset_t vmsize)
 {
@@ -609,68 +1356,42 @@ write_memory_range(struct write_segment_data *wsd, const struct region *r, mach_
             .addr = vmaddr,
             .size = vmsize,
         };
+
+        if (wsd->wsd_dryrun) {
+            /* streaming: assign the file offset, the data comes later */
+            const struct file_range fr = {
+                .off = wsd->wsd_foffset,
+                .size = vmsize,
+            };
+            make_segment_command(wsd->wsd_lc, &vr, &fr, &r->r_info, 0, r->r_purgable);
+            commit_load_command(wsd, wsd->wsd_lc);
+            wsd->wsd_foffset += vmsize;
+            resid -= vmsize;
+            vmaddr += vmsize;
+            continue;
+        }
+
         struct vm_range d, *dp = &d;
 
+        const uint64_t pstart = prof_start();
         step = map_memory_range(wsd, r, &vr, dp);
+        prof_stop(PROF_READ, pstart, V_SIZE(&vr));
         if (WALK_CONTINUE != step)
             break;
         assert(0 != V_ADDR(dp) && 0 != V_SIZE(dp));
-        const void *srcaddr = (const void *)V_ADDR(dp);
 
         mach_vm_behavior_set(mach_task_self(), V_ADDR(dp), V_SIZE(dp), VM_BEHAVIOR_SEQUENTIAL);
 
-        void *dstbuf = NULL;
-        unsigned algorithm = 0;
-        size_t filesize;
-
-		if (opt->extended) {
-			dstbuf = malloc(V_SIZEOF(dp));
-			if (dstbuf) {
-				filesize = compression_encode_buffer(dstbuf, V_SIZEOF(dp), srcaddr, V_SIZEOF(dp), NULL, opt->calgorithm);
-				if (filesize > 0 && filesize < V_SIZEOF(dp)) {
-					srcaddr = dstbuf;	/* the data source is now heap, compressed */
-                    mach_vm_deallocate(mach_task_self(), V_ADDR(dp), V_SIZE(dp));
-                    V_SETADDR(dp, 0);
-					if (segment_compflags(opt->calgorithm, &algorithm) != 0) {
-						free(dstbuf);
-                        mach_vm_deallocate(mach_task_self(), V_ADDR(dp), V_SIZE(dp));
-                        V_SETADDR(dp, 0);
-						step = WALK_ERROR;
-                        break;
-					}
-				} else {
-					free(dstbuf);
-					dstbuf = NULL;
-					filesize = V_SIZEOF(dp);
-				}
-			} else
-				filesize = V_SIZEOF(dp);
-			assert(filesize <= V_SIZEOF(dp));
-		} else
-			filesize = V_SIZEOF(dp);
-
-        assert(filesize);
-
-		const struct file_range fr = {
-			.off = wsd->wsd_foffset,
-			.size = filesize,
-		};
-		make_segment_command(wsd->wsd_lc, &vr, &fr, &r->r_info, algorithm, r->r_purgable);
-		step = pwrite_memory(wsd, srcaddr, filesize, &vr);
-		if (dstbuf)
-			free(dstbuf);
-        if (V_ADDR(dp)) {
-            kern_return_t kr = mach_vm_deallocate(mach_task_self(), V_ADDR(dp), V_SIZE(dp));
-            if (KERN_SUCCESS != kr && OPTIONS_DEBUG(opt, 1))
-                err_mach(kr, r, "mach_vm_deallocate() post %llx-%llx", V_ADDR(dp), V_SIZE(dp));
-        }
-
-		if (WALK_ERROR == step)
-			break;
-		commit_load_command(wsd, wsd->wsd_lc);
-		resid -= vmsize;
-		vmaddr += vmsize;
-	} while (resid);
+        /* the dry run can't see zero pages, so they're always written when streaming */
+        if (wsd->wsd_stream)
+            step = write_data_range(wsd, r, &vr, dp);
+        else
+            step = write_nonzero_ranges(wsd, r, &vr, dp);
+        if (WALK_ERROR == step)
+            break;
+        resid -= vmsize;
+        vmaddr += vmsize;
+    } while (resid);
 
     return step;
 }
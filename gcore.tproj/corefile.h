@@ -58,6 +58,14 @@ struct size_segment_data {
     struct size_core ssd_zfod;     /* full segments with zfod pages */
 };
 
+struct compression_summary {
+    const struct region *cs_region;
+    unsigned long cs_nchunks;
+    unsigned long cs_count[kCOMP_LZFSE + 1];    /* by algorithm */
+    mach_vm_offset_t cs_insize;
+    mach_vm_offset_t cs_outsize;
+};
+
 struct write_segment_data {
     task_t wsd_task;
     native_mach_header_t *wsd_mh;
@@ -66,6 +74,27 @@ struct write_segment_data {
 	bool wsd_nocache;
     off_t wsd_foffset;
     off_t wsd_nwritten;
+    struct write_pipeline *wsd_pipeline;  /* concurrent compression, if any */
+    bool wsd_stream;        /* fd can't seek: write data in file order */
+    bool wsd_dryrun;        /* lay out the load commands, write nothing */
+    unsigned long wsd_nspare;   /* room left in the header for more segments */
+    mach_vm_offset_t wsd_nzeroed;   /* zero pages not written */
+    mach_vm_offset_t wsd_ndeduped;  /* duplicate data not written */
+    struct written_chunks *wsd_written;    /* data already written, by digest */
+    struct compression_summary wsd_cs;     /* of the region being written */
+    const struct base_core *wsd_base;      /* -I: previous core, if any */
+    mach_vm_offset_t wsd_nunchanged;       /* data referenced from it */
 };
 
+extern size_t sizeof_segment_command(void);
+extern size_t cmdsize_fileref_command(const char *);
+
+struct base_core;
+extern struct base_core *load_base_core(const char *);
+extern const char *base_core_path(const struct base_core *);
+extern void del_base_core(struct base_core *);
+
+extern void start_write_pipeline(struct write_segment_data *);
+extern walk_return_t finish_write_pipeline(struct write_segment_data *);
+
 #endif /* _COREFILE_H */
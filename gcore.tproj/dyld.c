@@ -7,6 +7,7 @@
 #include "utils.h"
 #include "corefile.h"
 #include "vm.h"
+#include "dyld_shared_cache.h"
 
 #include <mach-o/loader.h>
 #include <mach-o/fat.h>
@@ -19,10 +20,17 @@
 #include <sys/param.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <time.h>
 #include <libgen.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sysexits.h>
+#include <err.h>
 
 /*
  * WARNING WARNING WARNING
@@ -120,20 +128,37 @@ copy_dyld_image_mh(task_t task, mach_vm_address_t targetmh, const char *path)
 }
 
 /*
- * This table (list) describes libraries and the executable in the address space
+ * This table (list) describes libraries and the executable in the address space.
+ * Entries are also hashed by uuid and by pathname, and indexed by address
+ * (see libent_walk_range()).
  */
 struct liblist {
     STAILQ_ENTRY(liblist) ll_linkage;
+    struct liblist *ll_uuidnext;
+    struct liblist *ll_namenext;
     unsigned long ll_namehash;
     struct libent ll_entry;
 };
 static STAILQ_HEAD(, liblist) libhead = STAILQ_HEAD_INITIALIZER(libhead);
 
+#define LIBENT_NBUCKETS	(1u << 10)
+
+static struct liblist *libent_byuuid[LIBENT_NBUCKETS];
+static struct liblist *libent_byname[LIBENT_NBUCKETS];
+
+static unsigned
+uuid_bucket(const uuid_t uuid)
+{
+    uint32_t h;
+    memcpy(&h, uuid, sizeof (h));   /* uuids are random enough already */
+    return h & (LIBENT_NBUCKETS - 1);
+}
+
 static const struct libent *
 libent_lookup_bypathname_withhash(const char *nm, const unsigned long hash)
 {
     struct liblist *ll;
-    STAILQ_FOREACH(ll, &libhead, ll_linkage) {
+    for (ll = libent_byname[hash & (LIBENT_NBUCKETS - 1)]; NULL != ll; ll = ll->ll_namenext) {
         if (hash != ll->ll_namehash)
             continue;
         struct libent *le = &ll->ll_entry;
@@ -147,7 +172,7 @@ const struct libent *
 libent_lookup_byuuid(const uuid_t uuid)
 {
     struct liblist *ll;
-    STAILQ_FOREACH(ll, &libhead, ll_linkage) {
+    for (ll = libent_byuuid[uuid_bucket(uuid)]; NULL != ll; ll = ll->ll_uuidnext) {
         struct libent *le = &ll->ll_entry;
         if (uuid_compare(uuid, le->le_uuid) == 0)
             return le;
@@ -155,6 +180,94 @@ libent_lookup_byuuid(const uuid_t uuid)
     return NULL;
 }
 
+/*
+ * The address index: the images with a known extent sorted by start
+ * address, with the greatest end address of each prefix of that array,
+ * so that the images overlapping a range are found by binary search
+ * then a short walk back.  Rebuilt on demand after an insertion.
+ */
+static struct {
+    bool ai_valid;
+    unsigned ai_count;
+    const struct libent **ai_les;
+    mach_vm_address_t *ai_maxend;
+} addrindex;
+
+static void
+libent_build_addrindex(void)
+{
+    free(addrindex.ai_les);
+    free(addrindex.ai_maxend);
+    bzero(&addrindex, sizeof (addrindex));
+
+    unsigned count = 0;
+    struct liblist *ll;
+    STAILQ_FOREACH(ll, &libhead, ll_linkage) {
+        count++;
+    }
+    addrindex.ai_les = calloc(count, sizeof (*addrindex.ai_les));
+    addrindex.ai_maxend = calloc(count, sizeof (*addrindex.ai_maxend));
+    if (count && (NULL == addrindex.ai_les || NULL == addrindex.ai_maxend))
+        errx(EX_OSERR, "out of memory for library index");
+
+    STAILQ_FOREACH(ll, &libhead, ll_linkage) {
+        const struct libent *le = &ll->ll_entry;
+        if (NULL != le->le_mh && V_SIZE(&le->le_vr))
+            addrindex.ai_les[addrindex.ai_count++] = le;
+    }
+    qsort_b(addrindex.ai_les, addrindex.ai_count, sizeof (*addrindex.ai_les),
+            ^(const void *a, const void *b) {
+                const struct libent *lhs = *(const struct libent **)a;
+                const struct libent *rhs = *(const struct libent **)b;
+                if (V_ADDR(&lhs->le_vr) > V_ADDR(&rhs->le_vr))
+                    return 1;
+                if (V_ADDR(&lhs->le_vr) < V_ADDR(&rhs->le_vr))
+                    return -1;
+                return 0;
+            });
+    mach_vm_address_t maxend = 0;
+    for (unsigned i = 0; i < addrindex.ai_count; i++) {
+        maxend = MAX(maxend, V_ENDADDR(&addrindex.ai_les[i]->le_vr));
+        addrindex.ai_maxend[i] = maxend;
+    }
+    addrindex.ai_valid = true;
+}
+
+/*
+ * Call the block for every image whose mach header we have and whose
+ * extent touches [lo, hi], plus those of unknown extent, until it
+ * returns false.  Returns false if the walk was stopped.
+ */
+bool
+libent_walk_range(mach_vm_address_t lo, mach_vm_address_t hi, bool (^fn)(const struct libent *))
+{
+    struct liblist *ll;
+    STAILQ_FOREACH(ll, &libhead, ll_linkage) {
+        const struct libent *le = &ll->ll_entry;
+        if (NULL != le->le_mh && 0 == V_SIZE(&le->le_vr) && !fn(le))
+            return false;
+    }
+
+    if (!addrindex.ai_valid)
+        libent_build_addrindex();
+
+    /* find the number of images starting at or below hi */
+    unsigned n = 0, top = addrindex.ai_count;
+    while (n < top) {
+        const unsigned mid = n + (top - n) / 2;
+        if (V_ADDR(&addrindex.ai_les[mid]->le_vr) <= hi)
+            n = mid + 1;
+        else
+            top = mid;
+    }
+    while (n-- > 0 && addrindex.ai_maxend[n] >= lo) {
+        const struct libent *le = addrindex.ai_les[n];
+        if (V_ENDADDR(&le->le_vr) >= lo && !fn(le))
+            return false;
+    }
+    return true;
+}
+
 const struct libent *
 libent_lookup_first_bytype(uint32_t mhtype)
 {
@@ -212,15 +325,339 @@ libent_insert(const char *rawnm, const uuid_t uuid, uint64_t mhaddr, const nativ
 	ll->ll_entry.le_objoff = objoff;
     STAILQ_INSERT_HEAD(&libhead, ll, ll_linkage);
 
+    const unsigned ub = uuid_bucket(uuid);
+    ll->ll_uuidnext = libent_byuuid[ub];
+    libent_byuuid[ub] = ll;
+    const unsigned nb = nmhash & (LIBENT_NBUCKETS - 1);
+    ll->ll_namenext = libent_byname[nb];
+    libent_byname[nb] = ll;
+    addrindex.ai_valid = false;
+
     return &ll->ll_entry;
 }
 
+/*
+ * Naming the shared cache, and copying and checking the headers of the
+ * hundreds of images in it, is the same work for every process using
+ * that cache.  The results are kept in a small "hint" file per shared
+ * cache uuid in the user's cache directory, so that dumping a number of
+ * processes only does it once.  The file is only a hint: the shared
+ * cache it names is checked, and an image header is only used at the
+ * address and with the uuid that dyld reports for it in this process.
+ */
+
+#define SCHINT_MAGIC	0x67736368	/* 'gsch' */
+#define SCHINT_VERSION	1
+#define SCHINT_MAXMHLEN	(1024 * 1024)
+
+struct schint_file_header {
+    uint32_t sfh_magic;
+    uint32_t sfh_version;
+    uuid_t sfh_uuid;            // of the shared cache
+    uint32_t sfh_nimages;
+    uint32_t sfh_pathlen;       // shared cache pathname follows, NUL included
+};
+
+struct schint_file_image {
+    uuid_t sfi_uuid;
+    uint64_t sfi_mhaddr;
+    uint64_t sfi_objoff;
+    uint64_t sfi_vmaddr;
+    uint64_t sfi_vmsize;
+    uint32_t sfi_pathlen;       // pathname follows, NUL included ..
+    uint32_t sfi_mhlen;         // .. then the mach header and commands
+};
+
+struct schint_image {
+    STAILQ_ENTRY(schint_image) si_linkage;
+    uuid_t si_uuid;
+    uint64_t si_mhaddr;
+    mach_vm_offset_t si_objoff;
+    struct vm_range si_vr;
+    char *si_path;
+    native_mach_header_t *si_mh;
+};
+
+static struct {
+    bool sh_loaded;
+    bool sh_dirty;
+    uuid_t sh_uuid;
+    char *sh_file;
+    char *sh_cachepath;
+    unsigned sh_nimages;
+    STAILQ_HEAD(, schint_image) sh_images;
+} schint = {
+    .sh_images = STAILQ_HEAD_INITIALIZER(schint.sh_images),
+};
+
+static char *
+schint_filename(const uuid_t uu, bool create)
+{
+    char cachedir[MAXPATHLEN];
+    const size_t len = confstr(_CS_DARWIN_USER_CACHE_DIR, cachedir, sizeof (cachedir));
+    if (0 == len || len > sizeof (cachedir))
+        return NULL;
+
+    char *dir;
+    if (-1 == asprintf(&dir, "%s/com.apple.gcore", cachedir))
+        return NULL;
+    if (create && -1 == mkdir(dir, 0700) && EEXIST != errno) {
+        free(dir);
+        return NULL;
+    }
+    uuid_string_t uustr;
+    uuid_unparse_lower(uu, uustr);
+    char *nm = NULL;
+    if (-1 == asprintf(&nm, "%s/%s", dir, uustr))
+        nm = NULL;
+    free(dir);
+    return nm;
+}
+
+static char *
+schint_readstr(FILE *f, uint32_t len)
+{
+    if (0 == len || len > MAXPATHLEN)
+        return NULL;
+    char *str = malloc(len);
+    if (NULL != str && (1 != fread(str, len, 1, f) || '\0' != str[len - 1] || strlen(str) != len - 1)) {
+        free(str);
+        str = NULL;
+    }
+    return str;
+}
+
+/*
+ * Returns true if the hints (if any) are for this shared cache.
+ */
+static bool
+schint_load(const uuid_t uu)
+{
+    if (schint.sh_loaded)
+        return 0 == uuid_compare(uu, schint.sh_uuid);
+    schint.sh_loaded = true;
+    uuid_copy(schint.sh_uuid, uu);
+
+    if (NULL == (schint.sh_file = schint_filename(uu, false)))
+        return true;
+    const int fd = open(schint.sh_file, O_RDONLY | O_NOFOLLOW);
+    if (-1 == fd)
+        return true;
+    struct stat st;
+    if (-1 == fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_uid != geteuid()) {
+        close(fd);
+        return true;
+    }
+    FILE *f = fdopen(fd, "r");
+    if (NULL == f) {
+        close(fd);
+        return true;
+    }
+
+    struct schint_file_header sfh;
+    if (1 != fread(&sfh, sizeof (sfh), 1, f) ||
+        SCHINT_MAGIC != sfh.sfh_magic || SCHINT_VERSION != sfh.sfh_version ||
+        0 != uuid_compare(uu, sfh.sfh_uuid) ||
+        NULL == (schint.sh_cachepath = schint_readstr(f, sfh.sfh_pathlen))) {
+        fclose(f);
+        return true;
+    }
+
+    for (unsigned i = 0; i < sfh.sfh_nimages; i++) {
+        struct schint_file_image sfi;
+        if (1 != fread(&sfi, sizeof (sfi), 1, f) ||
+            sfi.sfi_mhlen < sizeof (native_mach_header_t) || sfi.sfi_mhlen > SCHINT_MAXMHLEN)
+            break;
+        struct schint_image *si = calloc(1, sizeof (*si));
+        if (NULL == si)
+            break;
+        if (NULL == (si->si_path = schint_readstr(f, sfi.sfi_pathlen)) ||
+            NULL == (si->si_mh = malloc(sfi.sfi_mhlen)) ||
+            1 != fread(si->si_mh, sfi.sfi_mhlen, 1, f) ||
+            sizeof (*si->si_mh) + si->si_mh->sizeofcmds != sfi.sfi_mhlen) {
+            free(si->si_mh);
+            free(si->si_path);
+            free(si);
+            break;
+        }
+        uuid_copy(si->si_uuid, sfi.sfi_uuid);
+        si->si_mhaddr = sfi.sfi_mhaddr;
+        si->si_objoff = sfi.sfi_objoff;
+        V_SETADDR(&si->si_vr, sfi.sfi_vmaddr);
+        V_SETSIZE(&si->si_vr, sfi.sfi_vmsize);
+        STAILQ_INSERT_TAIL(&schint.sh_images, si, si_linkage);
+        schint.sh_nimages++;
+    }
+    fclose(f);
+
+    if (OPTIONS_DEBUG(opt, 1))
+        printf("%u shared cache image hints loaded from %s\n", schint.sh_nimages, schint.sh_file);
+    return true;
+}
+
+static const struct schint_image *
+schint_lookup(uint64_t mhaddr, const uuid_t uuid)
+{
+    const struct schint_image *si;
+    STAILQ_FOREACH(si, &schint.sh_images, si_linkage) {
+        if (mhaddr == si->si_mhaddr && 0 == uuid_compare(uuid, si->si_uuid))
+            return si;
+    }
+    return NULL;
+}
+
+static void
+schint_add(uint64_t mhaddr, const uuid_t uuid, const char *path, native_mach_header_t *mh, const struct vm_range *vr, mach_vm_offset_t objoff)
+{
+    struct schint_image *si, *tsi;
+
+    /* the shared region slide may have changed: forget stale addresses */
+    STAILQ_FOREACH_SAFE(si, &schint.sh_images, si_linkage, tsi) {
+        if (0 == uuid_compare(uuid, si->si_uuid)) {
+            STAILQ_REMOVE(&schint.sh_images, si, schint_image, si_linkage);
+            schint.sh_nimages--;
+            /* si_mh may be referenced by a libent */
+            free(si->si_path);
+            free(si);
+        }
+    }
+    if (NULL == (si = calloc(1, sizeof (*si))))
+        return;
+    if (NULL == (si->si_path = strdup(path))) {
+        free(si);
+        return;
+    }
+    uuid_copy(si->si_uuid, uuid);
+    si->si_mhaddr = mhaddr;
+    si->si_objoff = objoff;
+    si->si_vr = *vr;
+    si->si_mh = mh;
+    STAILQ_INSERT_TAIL(&schint.sh_images, si, si_linkage);
+    schint.sh_nimages++;
+    schint.sh_dirty = true;
+}
+
+/*
+ * The name of the shared cache with this uuid, from the hint file if the
+ * file it names is still that shared cache.
+ */
+char *
+schint_shared_cache_filename(const uuid_t uu)
+{
+    if (!schint_load(uu))
+        return shared_cache_filename(uu);
+
+    if (NULL != schint.sh_cachepath) {
+        const int fd = open(schint.sh_cachepath, O_RDONLY);
+        if (-1 != fd) {
+            const size_t len = sizeof (struct copied_dyld_cache_header);
+            void *addr = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if ((void *)-1 != addr) {
+                uuid_t scuuid;
+                const bool same = get_uuid_from_shared_cache_mapping(addr, len, scuuid) &&
+                    0 == uuid_compare(uu, scuuid);
+                munmap(addr, len);
+                if (same)
+                    return strdup(schint.sh_cachepath);
+            }
+        }
+        free(schint.sh_cachepath);
+        schint.sh_cachepath = NULL;
+    }
+
+    char *nm = shared_cache_filename(uu);
+    if (NULL != nm && NULL != (schint.sh_cachepath = strdup(nm)))
+        schint.sh_dirty = true;
+    return nm;
+}
+
+/*
+ * Write the hint file back if anything new was learnt; failure to do so
+ * only costs time later.
+ */
+void
+schint_save(void)
+{
+    if (!schint.sh_dirty || NULL == schint.sh_cachepath)
+        return;
+    schint.sh_dirty = false;
+
+    free(schint.sh_file);
+    if (NULL == (schint.sh_file = schint_filename(schint.sh_uuid, true)))
+        return;
+    char *tnm;
+    if (-1 == asprintf(&tnm, "%s.XXXXXX", schint.sh_file))
+        return;
+    const int fd = mkstemp(tnm);
+    FILE *f = -1 == fd ? NULL : fdopen(fd, "w");
+    if (NULL == f) {
+        if (-1 != fd) {
+            close(fd);
+            unlink(tnm);
+        }
+        free(tnm);
+        return;
+    }
+
+    struct schint_file_header sfh = {
+        .sfh_magic = SCHINT_MAGIC,
+        .sfh_version = SCHINT_VERSION,
+        .sfh_nimages = schint.sh_nimages,
+        .sfh_pathlen = (uint32_t)strlen(schint.sh_cachepath) + 1,
+    };
+    uuid_copy(sfh.sfh_uuid, schint.sh_uuid);
+    bool ok = 1 == fwrite(&sfh, sizeof (sfh), 1, f) &&
+        1 == fwrite(schint.sh_cachepath, sfh.sfh_pathlen, 1, f);
+
+    const struct schint_image *si;
+    STAILQ_FOREACH(si, &schint.sh_images, si_linkage) {
+        if (!ok)
+            break;
+        struct schint_file_image sfi = {
+            .sfi_mhaddr = si->si_mhaddr,
+            .sfi_objoff = si->si_objoff,
+            .sfi_vmaddr = V_ADDR(&si->si_vr),
+            .sfi_vmsize = V_SIZE(&si->si_vr),
+            .sfi_pathlen = (uint32_t)strlen(si->si_path) + 1,
+            .sfi_mhlen = (uint32_t)(sizeof (*si->si_mh) + si->si_mh->sizeofcmds),
+        };
+        uuid_copy(sfi.sfi_uuid, si->si_uuid);
+        ok = 1 == fwrite(&sfi, sizeof (sfi), 1, f) &&
+            1 == fwrite(si->si_path, sfi.sfi_pathlen, 1, f) &&
+            1 == fwrite(si->si_mh, sfi.sfi_mhlen, 1, f);
+    }
+    if (0 != fclose(f))
+        ok = false;
+    if (!ok || -1 == rename(tnm, schint.sh_file)) {
+        if (OPTIONS_DEBUG(opt, 1))
+            printf("cannot save shared cache hints to %s\n", schint.sh_file);
+        unlink(tnm);
+    } else if (OPTIONS_DEBUG(opt, 1))
+        printf("%u shared cache image hints saved to %s\n", schint.sh_nimages, schint.sh_file);
+    free(tnm);
+}
+
 bool
 libent_build_nametable(task_t task, dyld_process_info dpi)
 {
     __block bool valid = true;
+    __block unsigned nhinted = 0;
+
+    uuid_t sc_uuid;
+    const bool hinting = get_sc_uuid(dpi, sc_uuid) && schint_load(sc_uuid);
 
 	_dyld_process_info_for_each_image(dpi, ^(uint64_t mhaddr, const uuid_t uuid, const char *path) {
+        const bool insharedregion = hinting &&
+            mhaddr >= SHARED_REGION_BASE && mhaddr < SHARED_REGION_BASE + SHARED_REGION_SIZE;
+        if (valid && insharedregion) {
+            const struct schint_image *si = schint_lookup(mhaddr, uuid);
+            if (NULL != si && 0 == strcmp(path, si->si_path)) {
+                (void) libent_insert(path, uuid, mhaddr, si->si_mh, &si->si_vr, si->si_objoff);
+                nhinted++;
+                return;
+            }
+        }
         if (valid) {
             native_mach_header_t *mh = copy_dyld_image_mh(task, mhaddr, path);
             if (mh) {
@@ -303,11 +740,16 @@ libent_build_nametable(task_t task, dyld_process_info dpi)
                     if (NULL == (lc = next_lc(lc)))
                         break;
                 }
-				if (valid)
+				if (valid) {
                     (void) libent_insert(path, uuid, mhaddr, mh, &vr, objoff);
+                    if (insharedregion)
+                        schint_add(mhaddr, uuid, path, mh, &vr, objoff);
+                }
             }
         }
     });
+    if (OPTIONS_DEBUG(opt, 1) && nhinted)
+        printf("%u image headers taken from shared cache hints\n", nhinted);
     if (OPTIONS_DEBUG(opt, 3))
         printf("nametable %sconstructed\n", valid ? "" : "NOT ");
     return valid;
@@ -25,9 +25,13 @@ struct libent {
 
 extern const struct libent *libent_lookup_byuuid(const uuid_t);
 extern const struct libent *libent_lookup_first_bytype(uint32_t);
+extern bool libent_walk_range(mach_vm_address_t, mach_vm_address_t, bool (^)(const struct libent *));
 extern const struct libent *libent_insert(const char *, const uuid_t, uint64_t, const native_mach_header_t *, const struct vm_range *, mach_vm_offset_t);
 extern bool libent_build_nametable(task_t, dyld_process_info);
 
+extern char *schint_shared_cache_filename(const uuid_t);
+extern void schint_save(void);
+
 extern dyld_process_info get_task_dyld_info(task_t);
 extern bool get_sc_uuid(dyld_process_info, uuid_t);
 extern void free_task_dyld_info(dyld_process_info);
@@ -13,9 +13,13 @@
 #include <sys/sysctl.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <libproc.h>
 
 #include <sys/kauth.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 
 #include <stdio.h>
 #include <string.h>
@@ -30,6 +34,8 @@
 #include <fcntl.h>
 #include <assert.h>
 #include <libutil.h>
+#include <spawn.h>
+#include <time.h>
 
 #include <mach/mach.h>
 
@@ -211,8 +217,21 @@ change_credentials(gid_t uid, uid_t gid)
 }
 
 static int
-openout(const char *corefname, char **coretname, struct stat *st)
+openout(const char *corefname, char **coretname, struct stat *st, int *stream)
 {
+	*stream = 0;
+	if (0 == strcmp(corefname, "-")) {
+		/*
+		 * Stream the dump to stdout; our own output goes to stderr.
+		 */
+		const int tfd = dup(STDOUT_FILENO);
+		if (-1 == tfd || -1 == dup2(STDERR_FILENO, STDOUT_FILENO) || -1 == fstat(tfd, st))
+			errc(EX_CANTCREAT, errno, "stdout");
+		*coretname = NULL;
+		*stream = 1;
+		return tfd;
+	}
+
 	const int tfd = open(corefname, O_WRONLY);
 	if (-1 == tfd) {
 		if (ENOENT == errno) {
@@ -231,6 +250,21 @@ openout(const char *corefname, char **coretname, struct stat *st)
 				errx(EX_CANTCREAT, "%s: invalid attributes", tnm);
 			*coretname = tnm;
 			return fd;
+		} else if (EOPNOTSUPP == errno && 0 == stat(corefname, st) && S_ISSOCK(st->st_mode)) {
+			/*
+			 * Stream the dump to a collector listening on a local socket.
+			 */
+			struct sockaddr_un sun = {
+				.sun_family = AF_UNIX,
+			};
+			if (strlcpy(sun.sun_path, corefname, sizeof (sun.sun_path)) >= sizeof (sun.sun_path))
+				errc(EX_CANTCREAT, ENAMETOOLONG, "%s", corefname);
+			const int sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+			if (-1 == sfd || -1 == connect(sfd, (const void *)&sun, sizeof (sun)) || -1 == fstat(sfd, st))
+				errc(EX_CANTCREAT, errno, "%s", corefname);
+			*coretname = NULL;
+			*stream = 1;
+			return sfd;
 		} else
 			errc(EX_CANTCREAT, errno, "%s", corefname);
 	} else if (-1 == fstat(tfd, st)) {
@@ -242,6 +276,13 @@ openout(const char *corefname, char **coretname, struct stat *st)
 				 */
 				*coretname = NULL;
 				return tfd;
+	} else if (S_ISFIFO(st->st_mode) || S_ISSOCK(st->st_mode)) {
+		/*
+		 * Can't seek: stream the dump, no rename!
+		 */
+		*coretname = NULL;
+		*stream = 1;
+		return tfd;
 	} else {
 		close(tfd);
 		errc(EX_CANTCREAT, EEXIST, "%s", corefname);
@@ -251,9 +292,10 @@ openout(const char *corefname, char **coretname, struct stat *st)
 static int
 closeout(int fd, int ecode, char *corefname, char *coretname, const struct stat *st)
 {
-	if (0 != ecode && !opt->preserve && S_ISREG(st->st_mode))
+	const bool isfile = S_ISREG(st->st_mode) && !opt->stream;
+	if (0 != ecode && !opt->preserve && isfile)
 		ftruncate(fd, 0); // limit large file clutter
-	if (0 == ecode && S_ISREG(st->st_mode))
+	if (0 == ecode && isfile)
 		fchmod(fd, 0400); // protect core files
 	if (-1 == close(fd)) {
 		warnc(errno, "%s: close", coretname ? coretname : corefname);
@@ -280,6 +322,7 @@ static const size_t oneM = oneK * oneK;
 #define LARGEST_CHUNKSIZE               INT32_MAX
 #define DEFAULT_COMPRESSION_CHUNKSIZE	(16 * oneM)
 #define DEFAULT_NC_THRESHOLD			(17 * oneK)
+#define DEFAULT_WRITE_BATCH				(oneM)
 
 static struct options options = {
 	.corpsify = 0,
@@ -293,19 +336,131 @@ static struct options options = {
 	.sizebound = 0,
 	.chunksize = 0,
 	.calgorithm = COMPRESSION_LZFSE,
+	.autocompress = 0,
+	.nthreads = 0,
+	.dedup = 0,
 	.ncthresh = DEFAULT_NC_THRESHOLD,
+	.bwlimit = 0,
+	.wbatch = DEFAULT_WRITE_BATCH,
+	.iopolicy = -1,
 	.dsymforuuid = 0,
+	.stream = 0,
+	.basecore = NULL,
 };
 
+static unsigned
+activecpus(void)
+{
+	int ncpu = 1;
+	size_t len = sizeof (ncpu);
+	if (0 != sysctlbyname("hw.activecpu", &ncpu, &len, NULL, 0) || ncpu < 1)
+		ncpu = 1;
+	return (unsigned)ncpu;
+}
+
+/*
+ * Names as understood by taskpolicy(8) -d
+ */
+static int
+parse_iopolicy(const char *str)
+{
+	char *endp;
+	const long policy = strtol(str, &endp, 0);
+	if ('\0' != *str && '\0' == *endp)
+		return (int)policy;
+
+	static const struct {
+		const char *name;
+		int policy;
+	} iopolicies[] = {
+		{ "default",	IOPOL_DEFAULT },
+		{ "important",	IOPOL_IMPORTANT },
+		{ "passive",	IOPOL_PASSIVE },
+		{ "throttle",	IOPOL_THROTTLE },
+		{ "utility",	IOPOL_UTILITY },
+		{ "standard",	IOPOL_STANDARD },
+	};
+	for (unsigned i = 0; i < sizeof (iopolicies) / sizeof (iopolicies[0]); i++)
+		if (0 == strcasecmp(str, iopolicies[i].name))
+			return iopolicies[i].policy;
+	return -1;
+}
+
+/*
+ * Resume a task stopped by -s, reporting for how long it was stopped.
+ */
+static void
+resume_task(task_t task, uint64_t suspended)
+{
+	task_resume(task);
+	if (opt->verbose) {
+		const uint64_t elapsed = clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - suspended;
+		printf("Task suspended for %llu ms\n", elapsed / NSEC_PER_MSEC);
+	}
+}
+
+/*
+ * Dump each of several processes in turn, each with a fresh copy of
+ * ourselves so that credentials and data model can be matched to every
+ * target.  Later dumps benefit from the shared cache hints left behind
+ * by earlier ones.
+ */
+static int
+gcore_pids(int npidarg, int argc, char *const *argv)
+{
+	extern char **environ;
+	char path[PROC_PIDPATHINFO_MAXSIZE];
+
+	if (proc_pidpath(getpid(), path, sizeof (path)) <= 0)
+		errc(EX_OSERR, errno, "cannot find %s", pgm);
+
+	char **cargv = calloc(npidarg + 2, sizeof (*cargv));
+	if (NULL == cargv)
+		errx(EX_OSERR, "out of memory");
+	memcpy(cargv, argv, npidarg * sizeof (*cargv));
+
+	int ecode = 0;
+	for (int i = npidarg; i < argc; i++) {
+		if (atoi(argv[i]) < 1)
+			errx(EX_DATAERR, "invalid pid: %s", argv[i]);
+	}
+	for (int i = npidarg; i < argc; i++) {
+		cargv[npidarg] = argv[i];
+
+		pid_t cpid;
+		const int error = posix_spawn(&cpid, path, NULL, NULL, cargv, environ);
+		if (error) {
+			warnc(error, "cannot dump pid %s", argv[i]);
+			ecode = EX_OSERR;
+			continue;
+		}
+		int status;
+		while (-1 == waitpid(cpid, &status, 0)) {
+			if (EINTR != errno)
+				errc(EX_OSERR, errno, "waitpid");
+		}
+		if (!WIFEXITED(status))
+			ecode = EX_SOFTWARE;
+		else if (0 != WEXITSTATUS(status))
+			ecode = WEXITSTATUS(status);
+	}
+	free(cargv);
+	return ecode;
+}
+
 static int
 gcore_main(int argc, char *const *argv)
 {
 #define	ZOPT_ALG	(0)
 #define	ZOPT_CHSIZE	(ZOPT_ALG + 1)
+#define	ZOPT_THREADS	(ZOPT_CHSIZE + 1)
+#define	ZOPT_DEDUP	(ZOPT_THREADS + 1)
 
     static char *const zoptkeys[] = {
         [ZOPT_ALG] = "algorithm",
         [ZOPT_CHSIZE] = "chunksize",
+        [ZOPT_THREADS] = "threads",
+        [ZOPT_DEDUP] = "dedup",
         NULL
     };
 
@@ -313,6 +468,7 @@ gcore_main(int argc, char *const *argv)
         if (EX_USAGE == eval) {
             fprintf(stderr,
                     "usage:\t%s [-s] [-v] [[-o file] | [-c pathfmt ]] [-b size] "
+                    "[-r rate] [-P iopolicy] [-n] [-T] "
 #if DEBUG
 #ifdef CONFIG_DEBUG
                     "[-d] "
@@ -321,8 +477,9 @@ gcore_main(int argc, char *const *argv)
                     "[-Z compression-options] "
 					"[-t size] "
                     "[-F] "
+                    "[-I basecore] "
 #endif
-                    "pid\n", pgm);
+                    "pid ...\n", pgm);
 #if DEBUG
             fprintf(stderr, "where compression-options:\n");
             const char zvalfmt[] = "\t%s=%s\t\t%s\n";
@@ -330,6 +487,10 @@ gcore_main(int argc, char *const *argv)
                     "set compression algorithm");
             fprintf(stderr, zvalfmt, zoptkeys[ZOPT_CHSIZE], "size",
                     "set compression chunksize, Mib");
+            fprintf(stderr, zvalfmt, zoptkeys[ZOPT_THREADS], "n",
+                    "compress with n threads");
+            fprintf(stderr, "\t%s\t\t\t%s\n", zoptkeys[ZOPT_DEDUP],
+                    "write identical chunks once");
 #endif
         }
     });
@@ -340,7 +501,7 @@ gcore_main(int argc, char *const *argv)
     int c;
     char *sopts, *value;
 
-    while ((c = getopt(argc, argv, "vdsxCFZ:o:c:b:t:")) != -1) {
+    while ((c = getopt(argc, argv, "vdsxnTCFZ:o:c:b:r:P:t:I:")) != -1) {
         switch (c) {
 
                 /*
@@ -367,9 +528,25 @@ gcore_main(int argc, char *const *argv)
                 } else
                     errx(EX_USAGE, "no bound specified");
                 break;
+            case 'r':   /* limit the write bandwidth, MiB/s */
+                if (atoi(optarg) > 0)
+                    options.bwlimit = atoi(optarg) * oneM;
+                else
+                    errx(EX_USAGE, "invalid rate");
+                break;
+            case 'P':   /* disk I/O policy, as taskpolicy -d */
+                if ((options.iopolicy = parse_iopolicy(optarg)) < 0)
+                    errx(EX_USAGE, "invalid I/O policy '%s'", optarg);
+                break;
             case 'v':   /* verbose output */
                 options.verbose++;
                 break;
+            case 'n':   /* estimate the dump, don't write it */
+                options.estimate++;
+                break;
+            case 'T':   /* report where the time went */
+                options.profile++;
+                break;
 
                 /*
                  * dev and debugging help
@@ -410,7 +587,9 @@ gcore_main(int argc, char *const *argv)
                                 errx(EX_USAGE, "missing algorithm for "
                                      "%s suboption",
                                      zoptkeys[ZOPT_ALG]);
-                            if (strcmp(value, "lz4") == 0)
+                            if (strcmp(value, "auto") == 0)
+                                options.autocompress = 1;
+                            else if (strcmp(value, "lz4") == 0)
                                 options.calgorithm = COMPRESSION_LZ4;
                             else if (strcmp(value, "zlib") == 0)
                                 options.calgorithm = COMPRESSION_ZLIB;
@@ -434,6 +613,18 @@ gcore_main(int argc, char *const *argv)
                                 errx(EX_USAGE, "chunksize %lu too large", chsize);
                             options.chunksize = chsize * oneM;
                             break;
+                        case ZOPT_THREADS:    /* set the number of compressors */
+                            if (NULL == value)
+                                errx(EX_USAGE, "no value specified for "
+                                     "%s suboption",
+                                     zoptkeys[ZOPT_THREADS]);
+                            if (atoi(value) < 1)
+                                errx(EX_USAGE, "invalid thread count");
+                            options.nthreads = atoi(value);
+                            break;
+                        case ZOPT_DEDUP:      /* write duplicates once */
+                            options.dedup++;
+                            break;
                         default:
                             if (suboptarg)
                                 errx(EX_USAGE, "illegal suboption '%s'",
@@ -456,6 +647,9 @@ gcore_main(int argc, char *const *argv)
             case 'F':   /* maximize filerefs */
                 options.allfilerefs++;
                 break;
+            case 'I':   /* incremental: reference unchanged data in a base core */
+                options.basecore = optarg;
+                break;
             default:
                 errx(EX_USAGE, "unknown flag");
         }
@@ -463,14 +657,26 @@ gcore_main(int argc, char *const *argv)
 
 	if (optind == argc)
 		errx(EX_USAGE, "no pid specified");
-	if (optind < argc-1)
-		errx(EX_USAGE, "too many arguments");
+	if (optind < argc-1) {
+		if (NULL != corefname)
+			errx(EX_USAGE, "cannot use -o with more than one pid");
+		return gcore_pids(optind, argc, argv);
+	}
+
+    if (options.extended && 0 == options.nthreads)
+        options.nthreads = activecpus();
 
 	opt = &options;
     if (NULL != corefname && NULL != corefmt)
         errx(EX_USAGE, "specify only one of -o and -c");
     if (!opt->extended && opt->allfilerefs)
         errx(EX_USAGE, "unknown flag");
+    if (!opt->extended && opt->basecore)
+        errx(EX_USAGE, "illegal flag combination");
+
+    if (-1 != opt->iopolicy &&
+        -1 == setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_PROCESS, opt->iopolicy))
+        err(EX_OSERR, "setiopolicy_np");
 
     setpageshift();
 
@@ -589,7 +795,10 @@ gcore_main(int argc, char *const *argv)
 
 	struct stat cst;
 	char *coretname = NULL;
-	const int fd = openout(corefname, &coretname, &cst);
+	const int fd = opt->estimate ? -1 :
+		openout(corefname, &coretname, &cst, &options.stream);
+	if (opt->stream && opt->basecore)
+		errx(EX_USAGE, "cannot stream an incremental core");
 
 	if (opt->verbose) {
         printf("Dumping core ");
@@ -601,7 +810,10 @@ gcore_main(int argc, char *const *argv)
             }
             printf(") ");
         }
-		printf("for pid %d to %s\n", pid, corefname);
+		if (opt->estimate)
+			printf("for pid %d (estimate only)\n", pid);
+		else
+			printf("for pid %d to %s\n", pid, corefname);
     }
 
     int ecode;
@@ -642,19 +854,34 @@ gcore_main(int argc, char *const *argv)
 			badcorpse_is_fatal = 0;
 		}
 
-		if (opt->suspend)
+		uint64_t suspended = 0;
+		if (opt->suspend) {
 			task_suspend(task);
+			suspended = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+		}
 
 		if (trycorpse) {
 			/*
 			 * Create a corpse from the image before dumping it
 			 */
+			const uint64_t cstart = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
 			ret = task_generate_corpse(task, &corpse);
 			switch (ret) {
 				case KERN_SUCCESS:
+					if (opt->verbose)
+						printf("Corpse generated in %llu ms\n",
+							   (clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - cstart) / NSEC_PER_MSEC);
 					if (OPTIONS_DEBUG(opt, 1))
 						printf("Corpse generated on port %x, task %x\n",
 							   corpse, task);
+					/*
+					 * The snapshot is taken: there's no need to keep
+					 * the process stopped while it's written out.
+					 */
+					if (suspended) {
+						resume_task(task, suspended);
+						suspended = 0;
+					}
 					ecode = coredump(corpse, fd, pbi);
 					mach_port_deallocate(mach_task_self(), corpse);
 					break;
@@ -678,8 +905,8 @@ gcore_main(int argc, char *const *argv)
 		}
 
 	out:
-		if (opt->suspend)
-			task_resume(task);
+		if (suspended)
+			resume_task(task, suspended);
 	} else {
 		/*
 		 * Handed a corpse by our parent.
@@ -688,6 +915,11 @@ gcore_main(int argc, char *const *argv)
 		mach_port_deallocate(mach_task_self(), corpse);
 	}
 
+	if (opt->estimate) {
+		if (ecode)
+			errx(ecode, "failed to estimate core for pid %d", pid);
+		return 0;
+	}
 	ecode = closeout(fd, ecode, corefname, coretname, &cst);
 	if (ecode)
 		errx(ecode, "failed to dump core for pid %d", pid);
@@ -728,15 +960,35 @@ gcore_fref_main(int argc, char *argv[])
 {
 	err_set_exit_b(^(int eval) {
 		if (EX_USAGE == eval) {
-			fprintf(stderr, "usage:\t%s %s corefile\n", pgm, argv[1]);
+			fprintf(stderr, "usage:\t%s %s [-v] [-L searchpath] [-s] corefile\n", pgm, argv[1]);
 		}
 	});
-	if (2 == argc)
+
+	char *searchpath = NULL;
+
+	int c;
+	optind = 2;
+	while ((c = getopt(argc, argv, "vL:s")) != -1) {
+		switch (c) {
+			case 'L':
+				searchpath = strdup(optarg);
+				break;
+			case 'v':
+				options.verbose++;
+				break;
+			case 's':
+				options.dsymforuuid++;
+				break;
+			default:
+				errx(EX_USAGE, "unknown flag");
+		}
+	}
+	if (optind == argc)
 		errx(EX_USAGE, "no input corefile");
-	if (argc > 3)
+	if (optind < argc - 1)
 		errx(EX_USAGE, "too many arguments");
 	opt = &options;
-	return gcore_fref(getcorefd(argv[2]));
+	return gcore_fref(getcorefd(argv[optind]), searchpath);
 }
 
 #endif /* CONFIG_GCORE_FREF */
@@ -818,6 +1070,7 @@ gcore_conv_main(int argc, char *argv[])
     const char *incore = argv[optind];
     char *corefname = strdup(argv[optind+1]);
 
+	options.nthreads = activecpus();
 	opt = &options;
 
 	setpageshift();
@@ -828,7 +1081,9 @@ gcore_conv_main(int argc, char *argv[])
 	const int infd = getcorefd(incore);
 	struct stat cst;
 	char *coretname = NULL;
-	const int fd = openout(corefname, &coretname, &cst);
+	const int fd = openout(corefname, &coretname, &cst, &options.stream);
+	if (opt->stream)
+		errx(EX_USAGE, "%s: cannot convert to a stream", corefname);
 	int ecode = gcore_conv(infd, searchpath, zf, fd);
 	ecode = closeout(fd, ecode, corefname, coretname, &cst);
 	if (ecode)
@@ -39,9 +39,19 @@ struct options {
     off_t sizebound;    // maximum size of the dump
     size_t chunksize;   // max size of a compressed subregion
     compression_algorithm calgorithm; // algorithm in use
+    int autocompress;   // choose the algorithm for each chunk
+    unsigned nthreads;  // number of threads compressing chunks
+    int dedup;          // write identical chunks only once
 	size_t ncthresh;	// F_NOCACHE enabled *above* this value
+    size_t bwlimit;     // bytes per second written, if non-zero
+    size_t wbatch;      // write in pieces aligned to this size, if non-zero
+    int iopolicy;       // disk I/O policy for the dump, unless -1
     int allfilerefs;    // if set, every mapped file on the root fs is a fileref
 	int dsymforuuid;   // Try dsysForUUID to retrieve symbol-rich executable
+    int stream;         // output can't seek: write the core sequentially
+    const char *basecore;   // reference data unchanged since this core
+    int estimate;       // only estimate the size of the dump, and its cost
+    int profile;        // report where the time went
 };
 
 extern const struct options *opt;
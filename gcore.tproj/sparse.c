@@ -82,7 +82,7 @@ del_sparse_region(struct region *r)
 {
     clean_subregions(r);
     poison(r, 0xcafecaff, sizeof (*r));
-    free(r);
+    free_region(r);
 }
 
 #define NULLsc  ((native_segment_command_t *)0)
@@ -223,27 +223,21 @@ eliminate_duplicate_subregions(struct region *r)
  * region of the target address space.
  */
 walk_return_t
-decorate_memory_region(struct region *r, void *arg)
+decorate_memory_region(struct region *r, __unused void *arg)
 {
 	if (r->r_inzfodregion || r->r_incommregion)
 		return WALK_CONTINUE;
 
-    const dyld_process_info dpi = arg;
-
     __block walk_return_t retval = WALK_CONTINUE;
     __block subregionlisthead_t srlhead = STAILQ_HEAD_INITIALIZER(srlhead);
 
-    _dyld_process_info_for_each_image(dpi, ^(uint64_t __unused mhaddr, const uuid_t uuid, __unused const char *path) {
-        if (WALK_CONTINUE == retval) {
-            const struct libent *le = libent_lookup_byuuid(uuid);
-            assert(le->le_mhaddr == mhaddr);
-			bool shouldskip = false;
-			if (V_SIZE(&le->le_vr))
-				shouldskip = (R_ENDADDR(r) < V_ADDR(&le->le_vr) ||
-							  R_ADDR(r) > V_ENDADDR(&le->le_vr));
-			if (!shouldskip)
-                retval = add_subregions_for_libent(&srlhead, r, le->le_mh, le->le_mhaddr, le);
-        }
+    /*
+     * Only the images (from the dyld-derived name table) touching this
+     * region, found via the address index, rather than all of them.
+     */
+    libent_walk_range(R_ADDR(r), R_ENDADDR(r), ^bool(const struct libent *le) {
+        retval = add_subregions_for_libent(&srlhead, r, le->le_mh, le->le_mhaddr, le);
+        return WALK_CONTINUE == retval;
     });
     if (WALK_CONTINUE != retval)
         goto done;
@@ -368,8 +362,9 @@ undecorate_memory_region(struct region *r, __unused void *arg)
  * and -after- we've tagged zfod and first-pass fileref's.
  */
 walk_return_t
-sparse_region_optimization(struct region *r, __unused void *arg)
+sparse_region_optimization(struct region *r, void *arg)
 {
+    struct coalesce_stats *cs = arg;
     assert(&sparse_ops != r->r_op);
 
     if (r->r_inzfodregion) {
@@ -443,6 +438,8 @@ sparse_region_optimization(struct region *r, __unused void *arg)
                            S_ADDR(s0), S_ENDADDR(s0), S_ADDR(s1), S_ENDADDR(s1));
                 S_SETSIZE(s0, S_ENDADDR(s1) - S_ADDR(s0));
                 elide_subregion(r, i);
+                if (cs)
+                    cs->cs_subregions++;
                 continue;
             }
 
@@ -462,6 +459,8 @@ sparse_region_optimization(struct region *r, __unused void *arg)
                            S_ADDR(s0), S_ENDADDR(s0), S_ADDR(s1), S_ENDADDR(s1));
                 S_SETSIZE(s0, S_ENDADDR(s1) - S_ADDR(s0));
                 elide_subregion(r, i);
+                if (cs)
+                    cs->cs_subregions++;
                 continue;
             }
 
@@ -472,6 +471,8 @@ sparse_region_optimization(struct region *r, __unused void *arg)
                            S_ADDR(s0), S_ENDADDR(s0), S_ADDR(s1), S_ENDADDR(s1));
                 S_SETSIZE(s0, S_ENDADDR(s1) - S_ADDR(s0));
                 elide_subregion(r, i);
+                if (cs)
+                    cs->cs_subregions++;
                 continue;
             }
 
@@ -479,6 +480,37 @@ sparse_region_optimization(struct region *r, __unused void *arg)
         }
     }
 
+    if (r->r_nsubregions > 1) {
+        /*
+         * Merge adjacent subregions that refer to contiguous ranges of
+         * the same file, e.g. __TEXT followed by __LINKEDIT in the shared
+         * cache: one file reference rather than several.
+         */
+        unsigned i = 1;
+        while (i < r->r_nsubregions) {
+            struct subregion *s0 = r->r_subregions[i-1];
+            struct subregion *s1 = r->r_subregions[i];
+
+            if (!s0->s_isuuidref || !s1->s_isuuidref ||
+                S_LIBENT(s0) != S_LIBENT(s1) ||
+                S_ENDADDR(s0) != S_ADDR(s1) ||
+                S_MACHO_FILEOFF(s0) + (off_t)S_SIZE(s0) != S_MACHO_FILEOFF(s1)) {
+                i++;
+                continue;
+            }
+            if (OPTIONS_DEBUG(opt, 2))
+                printr(r, "merging file references (%llx-%llx + %llx-%llx) -- contiguous in %s\n",
+                       S_ADDR(s0), S_ENDADDR(s0), S_ADDR(s1), S_ENDADDR(s1), S_FILENAME(s0));
+            S_SETSIZE(s0, S_ENDADDR(s1) - S_ADDR(s0));
+            s0->s_segcmd.vmsize = S_SIZE(s0);
+            s0->s_segcmd.filesize = (typeof (s0->s_segcmd.filesize))
+                (S_MACHO_FILEOFF(s1) + S_MACHO_FILESIZE(s1) - S_MACHO_FILEOFF(s0));
+            elide_subregion(r, i);
+            if (cs)
+                cs->cs_subregions++;
+        }
+    }
+
 	if (1 == r->r_nsubregions) {
 		struct subregion *s = r->r_subregions[0];
 		if (!s->s_isuuidref &&
@@ -65,6 +65,15 @@ static __inline const char *S_FILENAME(const struct subregion *s) {
 
 extern bool issubregiontype(const struct subregion *, const char *);
 
+/*
+ * Counts of the segment commands saved by merging; the argument
+ * to sparse_region_optimization.
+ */
+struct coalesce_stats {
+    unsigned long cs_subregions;    // subregions merged into their neighbor
+    unsigned long cs_regions;       // regions merged into their neighbor
+};
+
 extern walk_region_cbfn_t decorate_memory_region;
 extern walk_region_cbfn_t undecorate_memory_region;
 extern walk_region_cbfn_t sparse_region_optimization;
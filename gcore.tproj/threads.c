@@ -15,6 +15,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <stddef.h>
+#include <dispatch/dispatch.h>
 
 typedef struct {
     int flavor;
@@ -52,8 +53,13 @@ sizeof_LC_THREAD()
     return cmdsize;
 }
 
-void
-dump_thread_state(native_mach_header_t *mh, struct thread_command *tc, mach_port_t thread)
+/*
+ * Fill in one LC_THREAD command.  The flavor table is only read: the count
+ * handed to thread_get_state is a copy, so several threads can be captured
+ * at once without changing the layout of the commands.
+ */
+static void
+capture_thread_state(struct thread_command *tc, mach_port_t thread)
 {
     tc->cmd = LC_THREAD;
     tc->cmdsize = (uint32_t) sizeof_LC_THREAD();
@@ -65,7 +71,8 @@ dump_thread_state(native_mach_header_t *mh, struct thread_command *tc, mach_port
         memcpy(wbuf, &thread_flavor[f], sizeof (thread_flavor[f]));
         wbuf += sizeof (thread_flavor[f]) / sizeof (*wbuf);
 
-        const kern_return_t kr = thread_get_state(thread, thread_flavor[f].flavor, (thread_state_t)wbuf, &thread_flavor[f].count);
+        mach_msg_type_number_t count = thread_flavor[f].count;
+        const kern_return_t kr = thread_get_state(thread, thread_flavor[f].flavor, (thread_state_t)wbuf, &count);
         if (KERN_SUCCESS != kr) {
             err_mach(kr, NULL, "getting flavor %d of thread",
                      thread_flavor[f].flavor);
@@ -75,7 +82,26 @@ dump_thread_state(native_mach_header_t *mh, struct thread_command *tc, mach_port
         wbuf += thread_flavor[f].count;
     }
     assert((ptrdiff_t)tc->cmdsize == ((caddr_t)wbuf - (caddr_t)tc));
+}
+
+#define CONCURRENT_THREAD_CAPTURE   64  /* fewer threads are captured serially */
 
-    mach_header_inc_ncmds(mh, 1);
-    mach_header_inc_sizeofcmds(mh, tc->cmdsize);
+/*
+ * Capture the state of every thread into consecutive LC_THREAD commands
+ * starting at tc.  Every command is the same size, so with many threads
+ * they are captured concurrently, each into its own slot.
+ */
+void
+dump_thread_states(struct thread_command *tc, const mach_port_t *threads, unsigned count)
+{
+    const size_t cmdsize = sizeof_LC_THREAD();
+
+    if (count < CONCURRENT_THREAD_CAPTURE) {
+        for (unsigned t = 0; t < count; t++)
+            capture_thread_state((void *)((caddr_t)tc + t * cmdsize), threads[t]);
+    } else {
+        dispatch_apply(count, DISPATCH_APPLY_AUTO, ^(size_t t) {
+            capture_thread_state((void *)((caddr_t)tc + t * cmdsize), threads[t]);
+        });
+    }
 }
@@ -9,6 +9,6 @@
 #define _THREADS_H
 
 extern size_t sizeof_LC_THREAD(void);
-extern void dump_thread_state(native_mach_header_t *, struct thread_command *, mach_port_t);
+extern void dump_thread_states(struct thread_command *, const mach_port_t *, unsigned);
 
 #endif /* _THREADS_H */
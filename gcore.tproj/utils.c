@@ -14,6 +14,8 @@
 #include <unistd.h>
 #include <libutil.h>
 #include <errno.h>
+#include <time.h>
+#include <stdatomic.h>
 
 void
 err_mach(kern_return_t kr, const struct region *r, const char *fmt, ...)
@@ -391,11 +393,103 @@ strconcat(const char *s0, const char *s1, size_t maxlen)
 unsigned long
 simple_namehash(const char *nm)
 {
-	unsigned long result = 5381;
+	uint64_t result = 0xcbf29ce484222325ull;
 	int c;
-	while (0 != (c = *nm++))
-		result = (result * 33) ^ c;
-	return result;  /* modified djb2 */
+	while (0 != (c = (unsigned char)*nm++))
+		result = (result ^ (uint64_t)c) * 0x100000001b3ull;
+	return (unsigned long)result;  /* FNV-1a; the low bits index hash tables */
+}
+
+static _Atomic uint64_t prof_nsec[PROF_NCATEGORIES];
+static _Atomic uint64_t prof_bytes[PROF_NCATEGORIES];
+
+/*
+ * Returns a timestamp to hand to prof_stop(), or zero if not profiling.
+ */
+uint64_t
+prof_start(void)
+{
+	return opt->profile ? clock_gettime_nsec_np(CLOCK_UPTIME_RAW) : 0;
+}
+
+void
+prof_stop(unsigned category, uint64_t start, uint64_t nbytes)
+{
+	if (0 == start)
+		return;
+	assert(category < PROF_NCATEGORIES);
+	atomic_fetch_add_explicit(&prof_nsec[category], clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - start, memory_order_relaxed);
+	atomic_fetch_add_explicit(&prof_bytes[category], nbytes, memory_order_relaxed);
+}
+
+void
+print_profile(uint64_t elapsed)
+{
+	static const char *const names[PROF_NCATEGORIES] = {
+		[PROF_ENUMERATE] = "enumerate",
+		[PROF_READ] = "read",
+		[PROF_COMPRESS] = "compress",
+		[PROF_WRITE] = "write",
+		[PROF_THROTTLE] = "throttled",
+		[PROF_THREADS] = "threads",
+	};
+
+	printf("%-10s %10s %6s %7s %9s\n", "Phase", "msec", "%", "Bytes", "MiB/s");
+	for (unsigned i = 0; i < PROF_NCATEGORIES; i++) {
+		const uint64_t nsec = atomic_load(&prof_nsec[i]);
+		const uint64_t nbytes = atomic_load(&prof_bytes[i]);
+		hsize_str_t hstr;
+		printf("%-10s %10.3f %6.1f %7s ", names[i], (double)nsec / NSEC_PER_MSEC,
+			   elapsed ? 100.0 * nsec / elapsed : 0.0, nbytes ? str_hsize(hstr, nbytes) : "-");
+		if (nbytes && nsec)
+			printf("%9.1f\n", ((double)nbytes / (1024 * 1024)) / ((double)nsec / NSEC_PER_SEC));
+		else
+			printf("%9s\n", "-");
+	}
+	printf("%-10s %10.3f\n", "total", (double)elapsed / NSEC_PER_MSEC);
+	if (opt->nthreads > 1)
+		printf("(compression time is summed over %u threads)\n", opt->nthreads);
+}
+
+/*
+ * Pace writes to no more than opt->bwlimit bytes per second, measured
+ * from the first write: sleep until the bytes written so far are due.
+ */
+static void
+throttle_write(size_t nbytes)
+{
+	static uint64_t start, nwritten;
+
+	if (0 == opt->bwlimit)
+		return;
+	const uint64_t now = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+	if (0 == start)
+		start = now;
+	nwritten += nbytes;
+	const uint64_t due = start + (uint64_t)((double)nwritten * NSEC_PER_SEC / opt->bwlimit);
+	if (due > now) {
+		struct timespec ts = {
+			.tv_sec = (due - now) / NSEC_PER_SEC,
+			.tv_nsec = (due - now) % NSEC_PER_SEC,
+		};
+		const uint64_t pstart = prof_start();
+		while (-1 == nanosleep(&ts, &ts) && EINTR == errno)
+			continue;
+		prof_stop(PROF_THROTTLE, pstart, 0);
+	}
+}
+
+/*
+ * Writes are issued in pieces that end on opt->wbatch boundaries of
+ * the file, and are paced after each piece.
+ */
+static size_t
+batch_length(size_t resid, off_t off)
+{
+	if (0 == opt->wbatch)
+		return resid;
+	const size_t room = opt->wbatch - (size_t)(off % (off_t)opt->wbatch);
+	return resid < room ? resid : room;
 }
 
 int
@@ -412,10 +506,78 @@ bounded_pwrite(int fd, const void *addr, size_t size, off_t off, bool *nocache,
 	if (OPTIONS_DEBUG(opt, 3) && oldnocache ^ *nocache)
 		printf("F_NOCACHE now %sabled on fd %d\n", *nocache ? "en" : "dis", fd);
 
-	const ssize_t nwritten = pwrite(fd, addr, size, off);
-	if (-1 == nwritten)
-		return errno;
+	size_t resid = size;
+	while (resid) {
+		const size_t len = batch_length(resid, off);
+		const uint64_t pstart = prof_start();
+		const ssize_t nwritten = pwrite(fd, addr, len, off);
+		prof_stop(PROF_WRITE, pstart, -1 == nwritten ? 0 : (uint64_t)nwritten);
+		if (-1 == nwritten) {
+			if (EINTR == errno)
+				continue;
+			return errno;
+		}
+		throttle_write(nwritten);
+		addr = (const char *)addr + nwritten;
+		off += nwritten;
+		resid -= nwritten;
+		if ((size_t)nwritten != len)
+			break;	/* short write: let the caller see it */
+	}
 	if (nwrittenp)
-		*nwrittenp = nwritten;
+		*nwrittenp = size - resid;
 	return 0;
 }
+
+/*
+ * Sequential counterpart of bounded_pwrite() for pipes and sockets:
+ * 'off' is where the caller believes the stream to be, and is used
+ * only to enforce the size bound.  Short writes are retried; on error
+ * *nwrittenp is what was written before it.
+ */
+int
+bounded_write(int fd, const void *addr, size_t size, off_t off, ssize_t *nwrittenp)
+{
+	if (opt->sizebound && off + (off_t)size > opt->sizebound)
+		return EFBIG;
+
+	size_t resid = size;
+	int error = 0;
+	while (resid) {
+		const uint64_t pstart = prof_start();
+		const ssize_t nwritten = write(fd, addr, batch_length(resid, off));
+		prof_stop(PROF_WRITE, pstart, -1 == nwritten ? 0 : (uint64_t)nwritten);
+		if (-1 == nwritten) {
+			if (EINTR == errno)
+				continue;
+			error = errno;
+			break;
+		}
+		throttle_write(nwritten);
+		addr = (const char *)addr + nwritten;
+		off += nwritten;
+		resid -= nwritten;
+	}
+	if (nwrittenp)
+		*nwrittenp = size - resid;
+	return error;
+}
+
+/*
+ * Write 'size' bytes of zeroes to a stream.
+ */
+int
+bounded_write_zeroes(int fd, size_t size, off_t off)
+{
+	static const char zeroes[64 * 1024];
+	int error = 0;
+
+	while (size && 0 == error) {
+		const size_t len = size > sizeof (zeroes) ? sizeof (zeroes) : size;
+		ssize_t nwritten;
+		error = bounded_write(fd, zeroes, len, off, &nwritten);
+		off += nwritten;
+		size -= nwritten;
+	}
+	return error;
+}
@@ -38,5 +38,24 @@ extern const char *str_tagr(tag_str_t, const struct region *);
 extern char *strconcat(const char *, const char *, size_t);
 extern unsigned long simple_namehash(const char *);
 extern int bounded_pwrite(int, const void *, size_t, off_t, bool *, ssize_t *);
+extern int bounded_write(int, const void *, size_t, off_t, ssize_t *);
+extern int bounded_write_zeroes(int, size_t, off_t);
+
+/*
+ * -T: where the time goes
+ */
+enum {
+    PROF_ENUMERATE,     // building the region list
+    PROF_READ,          // mapping and first touch of target memory
+    PROF_COMPRESS,      // compressing and digesting (summed over threads)
+    PROF_WRITE,         // writing the core file
+    PROF_THROTTLE,      // waiting for the -r bandwidth limit
+    PROF_THREADS,       // capturing thread state
+    PROF_NCATEGORIES
+};
+
+extern uint64_t prof_start(void);
+extern void prof_stop(unsigned, uint64_t, uint64_t);
+extern void print_profile(uint64_t);
 
 #endif /* _UTILS_H */
@@ -30,12 +30,13 @@
 #include <fcntl.h>
 #include <assert.h>
 #include <sysexits.h>
+#include <time.h>
 
 #include <mach/mach.h>
 
 /*
- * (Another optimization to consider is merging adjacent regions with
- * the same properties.)
+ * (Adjacent regions with the same properties are merged once the
+ * other optimizations are done; see coalesce_region().)
  */
 
 static walk_return_t
@@ -296,6 +297,152 @@ validate_core_header(const native_mach_header_t *mh, off_t corefilesize)
  * pointed to by the various commands.
  */
 
+/*
+ * Streaming output can't seek, so the segment load commands have been laid
+ * out by a dry run of the region walk.  Write the header, then walk the
+ * regions again writing their contents in file order.  The second walk
+ * regenerates the segment commands into a scratch buffer, which must match
+ * the ones already sent.
+ */
+static int
+stream_segments(struct write_segment_data *wsd, struct regionhead *rhead, const void *header, size_t headersize, const void *segcmds, size_t segcmdsize, off_t dataoff)
+{
+    ssize_t nwritten;
+    if (0 != bounded_write(wsd->wsd_fd, header, headersize, 0, &nwritten) ||
+        0 != bounded_write_zeroes(wsd->wsd_fd, dataoff - headersize, headersize))
+        return EX_IOERR;
+    wsd->wsd_nwritten = dataoff;
+
+    void *scratch = calloc(1, headersize);
+    if (NULL == scratch)
+        errx(EX_OSERR, "out of memory for header");
+    native_mach_header_t *mh = wsd->wsd_mh;
+    wsd->wsd_mh = make_corefile_mach_header(scratch);
+    wsd->wsd_lc = (caddr_t)scratch + ((const char *)segcmds - (const char *)header);
+    wsd->wsd_foffset = dataoff;
+    wsd->wsd_dryrun = false;
+
+    int ecode = 0;
+    if (0 != walk_region_list(rhead, region_write_memory, wsd))
+        ecode = EX_IOERR;
+    else if (0 != memcmp((caddr_t)wsd->wsd_lc - segcmdsize, segcmds, segcmdsize)) {
+        warnx("segment layout changed while streaming");
+        ecode = EX_SOFTWARE;
+    }
+    wsd->wsd_mh = mh;
+    free(scratch);
+    return ecode;
+}
+
+/*
+ * -n: estimate the size of a dump, and how long it would take, from
+ * a sample of the memory that would be written.  One sample is read
+ * (and compressed, for extended cores) from every stride of each
+ * region with data.
+ */
+
+#define ESTIMATE_SAMPLE_SIZE    (64 * 1024)
+#define ESTIMATE_SAMPLE_STRIDE  (16 * 1024 * 1024)
+
+struct estimate_data {
+    task_t ed_task;
+    void *ed_sample;
+    void *ed_compressed;
+    unsigned long ed_nsamples;
+    uint64_t ed_sampled;        // bytes read
+    uint64_t ed_sampledout;     // .. and after compression
+    uint64_t ed_readns;
+    uint64_t ed_compressns;
+};
+
+static walk_return_t
+estimate_region(struct region *r, void *arg)
+{
+    struct estimate_data *ed = arg;
+
+    if (&vanilla_ops != r->r_op && &sparse_ops != r->r_op)
+        return WALK_CONTINUE;
+    if (0 == (r->r_info.protection & VM_PROT_READ))
+        return WALK_CONTINUE;
+
+    for (mach_vm_offset_t off = 0; off < R_SIZE(r); off += ESTIMATE_SAMPLE_STRIDE) {
+        mach_vm_size_t size = MIN(R_SIZE(r) - off, ESTIMATE_SAMPLE_SIZE);
+
+        uint64_t start = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+        const kern_return_t kr = mach_vm_read_overwrite(ed->ed_task, R_ADDR(r) + off, size, (mach_vm_address_t)ed->ed_sample, &size);
+        if (KERN_SUCCESS != kr || 0 == size)
+            continue;
+        uint64_t now = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+        ed->ed_readns += now - start;
+        ed->ed_sampled += size;
+        ed->ed_nsamples++;
+
+        size_t csize = 0;
+        if (opt->extended) {
+            start = now;
+            csize = compression_encode_buffer(ed->ed_compressed, (size_t)size, ed->ed_sample, (size_t)size, NULL, opt->calgorithm);
+            ed->ed_compressns += clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - start;
+        }
+        ed->ed_sampledout += 0 == csize ? size : csize;
+    }
+    return WALK_CONTINUE;
+}
+
+static void
+print_estimate_line(const char *type, const struct size_core *sc)
+{
+    hsize_str_t hstr;
+    printf("%-10s %8lu %7s\n", type, sc->count, str_hsize(hstr, sc->memsize));
+}
+
+static void
+estimate_core(task_t task, struct regionhead *rhead, const struct size_segment_data *ssd, size_t headersize, unsigned thread_count)
+{
+    struct estimate_data ed = {
+        .ed_task = task,
+        .ed_sample = malloc(ESTIMATE_SAMPLE_SIZE),
+        .ed_compressed = malloc(ESTIMATE_SAMPLE_SIZE),
+    };
+    if (NULL == ed.ed_sample || NULL == ed.ed_compressed)
+        errx(EX_OSERR, "out of memory for samples");
+    walk_region_list(rhead, estimate_region, &ed);
+
+    const uint64_t datasize = ssd->ssd_vanilla.memsize + ssd->ssd_sparse.memsize;
+    const double ratio = ed.ed_sampled ? (double)ed.ed_sampledout / ed.ed_sampled : 1.0;
+    const uint64_t filesize = headersize + (uint64_t)(datasize * ratio);
+    hsize_str_t hstr, hstr2;
+
+    printf("%-10s %8s %7s\n", "Segments", "Count", "Memory");
+    print_estimate_line("vanilla", &ssd->ssd_vanilla);
+    print_estimate_line("sparse", &ssd->ssd_sparse);
+    print_estimate_line("fileref", &ssd->ssd_fileref);
+    print_estimate_line("zfod", &ssd->ssd_zfod);
+    printf("%-10s %8u\n", "threads", thread_count);
+
+    printf("Header %s, data %s", str_hsize(hstr, headersize), str_hsize(hstr2, datasize));
+    if (opt->extended && ed.ed_sampled)
+        printf(" (compressing to about %.0f%%)", 100.0 * ratio);
+    printf("\nEstimated core file size %s, from %lu samples (%s)\n",
+           str_hsize(hstr, filesize), ed.ed_nsamples, str_hsize(hstr2, ed.ed_sampled));
+
+    if (ed.ed_sampled) {
+        const double readms = (double)ed.ed_readns / NSEC_PER_MSEC * datasize / ed.ed_sampled;
+        printf("Estimated time: read %.0f ms", readms);
+        if (opt->extended) {
+            const unsigned nthreads = opt->nthreads > 1 ? opt->nthreads : 1;
+            const double compressms = (double)ed.ed_compressns / NSEC_PER_MSEC * datasize / ed.ed_sampled / nthreads;
+            printf(", compress %.0f ms (%u thread%s)", compressms, nthreads, 1 == nthreads ? "" : "s");
+        }
+        if (opt->bwlimit)
+            printf(", write at least %.0f ms", 1000.0 * filesize / opt->bwlimit);
+        printf("\n");
+    }
+    free(ed.ed_sample);
+    free(ed.ed_compressed);
+}
+
+#define MAX_SPARE_SEGMENTS	16384ul
+
 int
 coredump_write(
     const task_t task,
@@ -305,27 +452,48 @@ coredump_write(
     mach_vm_offset_t aout_load_addr,
     mach_vm_offset_t dyld_aii_addr)
 {
-    struct size_segment_data ssda;
-    bzero(&ssda, sizeof (ssda));
-
-    if (walk_region_list(rhead, region_size_memory, &ssda) < 0) {
-        warnx(0, "cannot count segments");
-        return EX_OSERR;
-    }
-
     unsigned thread_count = 0;
     mach_port_t *threads = NULL;
     kern_return_t ret = task_threads(task, &threads, &thread_count);
     if (KERN_SUCCESS != ret || thread_count < 1) {
         err_mach(ret, NULL, "cannot retrieve threads");
+        if (KERN_SUCCESS != ret)
+            threads = NULL;
         thread_count = 0;
     }
 
+    /*
+     * Take all the thread states in one pass now, rather than after the
+     * memory has been written, and let go of the thread ports.
+     */
+    const size_t threadsize = thread_count * sizeof_LC_THREAD();
+    struct thread_command *tstates = NULL;
+    const uint64_t pstart = prof_start();
+    if (thread_count && !opt->estimate) {
+        if (NULL == (tstates = malloc(threadsize)))
+            errx(EX_OSERR, "out of memory for thread state");
+        dump_thread_states(tstates, threads, thread_count);
+    }
+    for (unsigned t = 0; t < thread_count; t++)
+        mach_port_deallocate(mach_task_self(), threads[t]);
+    if (NULL != threads)
+        mach_vm_deallocate(mach_task_self(), (mach_vm_address_t)threads, thread_count * sizeof (*threads));
+    prof_stop(PROF_THREADS, pstart, 0);
+
+    struct size_segment_data ssda;
+    bzero(&ssda, sizeof (ssda));
+
+    if (walk_region_list(rhead, region_size_memory, &ssda) < 0) {
+        warnx(0, "cannot count segments");
+        free(tstates);
+        return EX_OSERR;
+    }
+
 	if (OPTIONS_DEBUG(opt, 3)) {
 		print_memory_region_header();
 		walk_region_list(rhead, region_print_memory, NULL);
 		printf("\nmach header %lu\n", sizeof (native_mach_header_t));
-		printf("threadcount %u threadsize %lu\n", thread_count, thread_count * sizeof_LC_THREAD());
+		printf("threadcount %u threadsize %lu\n", thread_count, threadsize);
 		printf("fileref %lu %lu %llu\n", ssda.ssd_fileref.count, ssda.ssd_fileref.headersize, ssda.ssd_fileref.memsize);
 		printf("zfod %lu %lu %llu\n", ssda.ssd_zfod.count, ssda.ssd_zfod.headersize, ssda.ssd_zfod.memsize);
 		printf("vanilla %lu %lu %llu\n", ssda.ssd_vanilla.count, ssda.ssd_vanilla.headersize, ssda.ssd_vanilla.memsize);
@@ -333,7 +501,7 @@ coredump_write(
 	}
 
     size_t headersize = sizeof (native_mach_header_t) +
-        thread_count * sizeof_LC_THREAD() +
+        threadsize +
         ssda.ssd_fileref.headersize +
         ssda.ssd_zfod.headersize +
         ssda.ssd_vanilla.headersize +
@@ -341,6 +509,33 @@ coredump_write(
     if (opt->extended)
         headersize += sizeof (struct proto_coreinfo_command);
 
+    /*
+     * Leave room for chunks to be split around the runs of zero pages
+     * found while writing them.  (The streaming dry run can't see them.)
+     */
+    unsigned long nspare = 0;
+    if (!opt->stream) {
+        nspare = MIN(2 * (ssda.ssd_vanilla.count + ssda.ssd_sparse.count), MAX_SPARE_SEGMENTS);
+        headersize += nspare * sizeof_segment_command();
+    }
+
+    if (opt->estimate) {
+        estimate_core(task, rhead, &ssda, headersize, thread_count);
+        del_region_list(rhead);
+        return 0;
+    }
+
+    /*
+     * With a base core, any data segment may become a (larger) file
+     * reference to it.
+     */
+    struct base_core *bc = NULL;
+    if (opt->basecore) {
+        bc = load_base_core(opt->basecore);
+        const size_t growth = cmdsize_fileref_command(base_core_path(bc)) - sizeof_segment_command();
+        headersize += (ssda.ssd_vanilla.count + ssda.ssd_sparse.count + nspare) * growth;
+    }
+
     void *header = calloc(1, headersize);
     if (NULL == header)
         errx(EX_OSERR, "out of memory for header");
@@ -377,32 +572,51 @@ coredump_write(
 		.wsd_nocache = false,
         .wsd_foffset = ((mach_vm_offset_t)headersize + pagemask) & ~pagemask,
         .wsd_nwritten = 0,
+        .wsd_stream = opt->stream,
+        .wsd_dryrun = opt->stream,
+        .wsd_nspare = nspare,
+        .wsd_base = bc,
     };
+    const off_t dataoff = wsda.wsd_foffset;
 
 	int ecode = 0;
+    start_write_pipeline(&wsda);
     if (0 != walk_region_list(rhead, region_write_memory, &wsda))
         ecode = EX_IOERR;
+    if (WALK_ERROR == finish_write_pipeline(&wsda))
+        ecode = EX_IOERR;
 
-    del_region_list(rhead);
-
-    struct thread_command *tc = (void *)wsda.wsd_lc;
+    const void *segcmds = lc;
+    const size_t segcmdsize = (caddr_t)wsda.wsd_lc - (caddr_t)lc;
 
-    for (unsigned t = 0; t < thread_count; t++) {
-        dump_thread_state(mh, tc, threads[t]);
-        mach_port_deallocate(mach_task_self(), threads[t]);
-        tc = (void *)((caddr_t)tc + tc->cmdsize);
+    if (thread_count) {
+        memcpy(wsda.wsd_lc, tstates, threadsize);
+        mach_header_inc_ncmds(mh, thread_count);
+        mach_header_inc_sizeofcmds(mh, (uint32_t)threadsize);
+        free(tstates);
     }
 
-    /*
-     * Even if we've run out of space, try our best to
-     * write out the header.
-     */
-    if (0 != bounded_pwrite(fd, header, headersize, 0, &wsda.wsd_nocache, NULL))
-        ecode = EX_IOERR;
-    if (0 == ecode && headersize != sizeof (*mh) + mh->sizeofcmds)
-       ecode = EX_SOFTWARE;
-    if (0 == ecode)
-        wsda.wsd_nwritten += headersize;
+    if (opt->stream) {
+        if (0 == ecode && headersize != sizeof (*mh) + mh->sizeofcmds)
+            ecode = EX_SOFTWARE;
+        if (0 == ecode)
+            ecode = stream_segments(&wsda, rhead, header, headersize, segcmds, segcmdsize, dataoff);
+    } else {
+        /*
+         * Even if we've run out of space, try our best to
+         * write out the header.  Unused spare room isn't written.
+         */
+        const size_t usedsize = MIN(headersize, sizeof (*mh) + mh->sizeofcmds);
+        if (0 != bounded_pwrite(fd, header, usedsize, 0, &wsda.wsd_nocache, NULL))
+            ecode = EX_IOERR;
+        if (0 == ecode && (nspare || bc ? usedsize : headersize) != sizeof (*mh) + mh->sizeofcmds)
+           ecode = EX_SOFTWARE;
+        if (0 == ecode)
+            wsda.wsd_nwritten += usedsize;
+    }
+    del_region_list(rhead);
+    if (bc)
+        del_base_core(bc);
 
     validate_core_header(mh, wsda.wsd_foffset);
 
@@ -418,6 +632,12 @@ coredump_write(
             printf(", referenced %s", str_hsize(hsz, ssda.ssd_fileref.memsize));
         if (ssda.ssd_zfod.memsize)
             printf(", zfod %s", str_hsize(hsz, ssda.ssd_zfod.memsize));
+        if (wsda.wsd_nzeroed)
+            printf(", zero pages %s", str_hsize(hsz, wsda.wsd_nzeroed));
+        if (wsda.wsd_ndeduped)
+            printf(", duplicates %s", str_hsize(hsz, wsda.wsd_ndeduped));
+        if (wsda.wsd_nunchanged)
+            printf(", unchanged %s", str_hsize(hsz, wsda.wsd_nunchanged));
         printf(")\n");
     }
     free(header);
@@ -541,9 +761,67 @@ label_mapped_files(struct region *r, void *arg)
 	return WALK_CONTINUE;
 }
 
+struct coalesce_region_data {
+    struct region *crd_prev;
+    struct coalesce_stats *crd_stats;
+};
+
+static bool
+samefileref(const struct region *r0, const struct region *r1)
+{
+    if (r0->r_fileref->fr_libent || r1->r_fileref->fr_libent)
+        return r0->r_fileref->fr_libent == r1->r_fileref->fr_libent;
+    return 0 == strcmp(r0->r_fileref->fr_pathname, r1->r_fileref->fr_pathname);
+}
+
+/*
+ * VM entries are often split (e.g. by wiring or protection changes that
+ * were later undone) into adjacent regions describing the same thing.
+ * Merge adjacent file reference regions mapping contiguous ranges of the
+ * same file, and adjacent zfod regions, so that each needs just one
+ * segment command.  Runs last, so that sizing sees the merged regions.
+ */
+static walk_return_t
+coalesce_region(struct region *r, void *arg)
+{
+    struct coalesce_region_data *crd = arg;
+    struct region *r0 = crd->crd_prev;
+    crd->crd_prev = r;
+
+    if (NULL == r0 || r0->r_op != r->r_op || R_ENDADDR(r0) != R_ADDR(r))
+        return WALK_CONTINUE;
+    if (&fileref_ops != r->r_op && &zfod_ops != r->r_op)
+        return WALK_CONTINUE;
+    if (r0->r_info.protection != r->r_info.protection ||
+        r0->r_info.max_protection != r->r_info.max_protection ||
+        r0->r_info.share_mode != r->r_info.share_mode ||
+        r0->r_info.user_tag != r->r_info.user_tag ||
+        r0->r_info.external_pager != r->r_info.external_pager ||
+        r0->r_purgable != r->r_purgable ||
+        r0->r_insharedregion != r->r_insharedregion)
+        return WALK_CONTINUE;
+    if (&fileref_ops == r->r_op &&
+        (!samefileref(r0, r) ||
+         r0->r_fileref->fr_offset + (off_t)R_SIZE(r0) != r->r_fileref->fr_offset))
+        return WALK_CONTINUE;
+
+    if (OPTIONS_DEBUG(opt, 2))
+        printr(r0, "merging %s region %llx-%llx\n",
+               &zfod_ops == r->r_op ? "zfod" : "fileref", R_ADDR(r), R_ENDADDR(r));
+    R_SETSIZE(r0, R_ENDADDR(r) - R_ADDR(r0));
+    r0->r_info.pages_resident += r->r_info.pages_resident;
+    r0->r_info.pages_dirtied += r->r_info.pages_dirtied;
+    r0->r_info.pages_swapped_out += r->r_info.pages_swapped_out;
+    crd->crd_prev = r0;
+    crd->crd_stats->cs_regions++;
+    return WALK_DELETE_REGION;
+}
+
 int
 coredump(task_t task, int fd, const struct proc_bsdinfo *__unused pbi)
 {
+    const uint64_t pstart = prof_start();
+
     /* this is the shared cache id, if any */
     uuid_t sc_uuid;
     uuid_clear(sc_uuid);
@@ -576,6 +854,11 @@ coredump(task_t task, int fd, const struct proc_bsdinfo *__unused pbi)
         printf("Optimizing dump content\n");
     walk_region_list(rhead, simple_region_optimization, NULL);
 
+    struct coalesce_stats cstats = {
+        .cs_subregions = 0,
+        .cs_regions = 0,
+    };
+
 	if (dpi) {
 		/*
 		 * Snapshot dyld's info ..
@@ -604,13 +887,14 @@ coredump(task_t task, int fd, const struct proc_bsdinfo *__unused pbi)
 			if (0 == walk_region_list(rhead, decorate_memory_region, (void *)dpi)) {
 				if (OPTIONS_DEBUG(opt, 1))
 					printf("Sparse dump optimization(s)\n");
-				walk_region_list(rhead, sparse_region_optimization, NULL);
+				walk_region_list(rhead, sparse_region_optimization, &cstats);
 			} else {
 				walk_region_list(rhead, undecorate_memory_region, NULL);
 				warnx("error parsing dyld data => ignored");
 			}
 		}
 		free_task_dyld_info(dpi);
+		schint_save();
 	}
 
 	/*
@@ -631,12 +915,25 @@ coredump(task_t task, int fd, const struct proc_bsdinfo *__unused pbi)
 		walk_region_list(rhead, label_mapped_files, (void *)pbi);
 	}
 
+    struct coalesce_region_data crd = {
+        .crd_prev = NULL,
+        .crd_stats = &cstats,
+    };
+    walk_region_list(rhead, coalesce_region, &crd);
+    if (opt->verbose && (cstats.cs_subregions || cstats.cs_regions))
+        printf("Coalesced %lu subregion%s and %lu region%s, saving %lu segment commands\n",
+               cstats.cs_subregions, 1 == cstats.cs_subregions ? "" : "s",
+               cstats.cs_regions, 1 == cstats.cs_regions ? "" : "s",
+               cstats.cs_subregions + cstats.cs_regions);
+
     if (OPTIONS_DEBUG(opt, 1))
         printf("Optimization(s) done\n");
 
 done:
     if (0 == ecode)
         ecode = coredump_write(task, fd, rhead, aout_uuid, aout_load_addr, dyld_addr);
+    if (opt->profile)
+        print_profile(clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - pstart);
     return ecode;
 }
 
@@ -848,7 +1145,7 @@ coredump_prepare(task_t task, uuid_t sc_uuid)
     /*
      * Name the shared cache, if we can
      */
-    char *nm = shared_cache_filename(sc_uuid);
+    char *nm = schint_shared_cache_filename(sc_uuid);
     const struct libent *le;
 
     if (NULL != nm)
@@ -10,12 +10,14 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <ctype.h>
 #include <errno.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <assert.h>
 #include <sys/queue.h>
+#include <time.h>
 
 /*
  * There should be better APIs to describe the shared region
@@ -61,10 +63,61 @@ in_zfod_region(const vm_region_submap_info_data_64_t *info)
         0 == info->pages_dirtied + info->pages_resident + info->pages_swapped_out;
 }
 
+/*
+ * Regions are carved out of slabs rather than allocated one at a time;
+ * a large process can have hundreds of thousands of them.  Deleting a
+ * region merely poisons it: the slabs are released when the last
+ * region list is deleted.
+ */
+
+#define REGION_SLAB_COUNT   1024
+
+struct region_slab {
+    struct region_slab *rs_next;
+    unsigned rs_used;
+    struct region rs_regions[REGION_SLAB_COUNT];
+};
+
+static struct region_slab *region_slabs;
+static unsigned nregionlists;
+
 static struct region *
-new_region(mach_vm_offset_t vmaddr, mach_vm_size_t vmsize, const vm_region_submap_info_data_64_t *infop)
+alloc_region(void)
+{
+    struct region_slab *rs = region_slabs;
+
+    if (NULL == rs || REGION_SLAB_COUNT == rs->rs_used) {
+        rs = calloc(1, sizeof (*rs));
+        if (NULL == rs)
+            errx(EX_OSERR, "cannot allocate region slab");
+        rs->rs_next = region_slabs;
+        region_slabs = rs;
+    }
+    return &rs->rs_regions[rs->rs_used++];
+}
+
+void
+free_region(struct region *r)
+{
+    /* reclaimed with the slab in del_region_list() */
+}
+
+static void
+del_region_slabs(void)
+{
+    struct region_slab *rs, *next;
+
+    for (rs = region_slabs; NULL != rs; rs = next) {
+        next = rs->rs_next;
+        poison(rs, 0xdeadbee5, sizeof (*rs));
+        free(rs);
+    }
+    region_slabs = NULL;
+}
+
+static void
+init_region(struct region *r, mach_vm_offset_t vmaddr, mach_vm_size_t vmsize, const vm_region_submap_info_data_64_t *infop)
 {
-    struct region *r = calloc(1, sizeof (*r));
     assert(vmaddr != 0 && vmsize != 0);
     R_SETADDR(r, vmaddr);
     R_SETSIZE(r, vmsize);
@@ -78,6 +131,13 @@ new_region(mach_vm_offset_t vmaddr, mach_vm_size_t vmsize, const vm_region_subma
         r->r_op = &zfod_ops;
     else
         r->r_op = &vanilla_ops;
+}
+
+static struct region *
+new_region(mach_vm_offset_t vmaddr, mach_vm_size_t vmsize, const vm_region_submap_info_data_64_t *infop)
+{
+    struct region *r = alloc_region();
+    init_region(r, vmaddr, vmsize, infop);
     return r;
 }
 
@@ -89,7 +149,7 @@ del_fileref_region(struct region *r)
     poison(r->r_fileref, 0xdeadbee9, sizeof (*r->r_fileref));
     free(r->r_fileref);
     poison(r, 0xdeadbeeb, sizeof (*r));
-    free(r);
+    free_region(r);
 }
 
 void
@@ -99,7 +159,7 @@ del_zfod_region(struct region *r)
     assert(r->r_inzfodregion && 0 == r->r_nsubregions);
     assert(NULL == r->r_fileref);
     poison(r, 0xdeadbeed, sizeof (*r));
-    free(r);
+    free_region(r);
 }
 
 void
@@ -109,7 +169,7 @@ del_vanilla_region(struct region *r)
     assert(!r->r_inzfodregion && 0 == r->r_nsubregions);
     assert(NULL == r->r_fileref);
     poison(r, 0xdeadbeef, sizeof (*r));
-    free(r);
+    free_region(r);
 }
 
 /*
@@ -159,8 +219,13 @@ STAILQ_HEAD(regionhead, region);
  * we go.
  */
 
+struct walk_regions_stats {
+    unsigned wrs_nregions;
+    unsigned wrs_nqueries;
+};
+
 static int
-walk_regions(task_t task, struct regionhead *rhead)
+walk_regions(task_t task, struct regionhead *rhead, struct walk_regions_stats *wrs)
 {
     mach_vm_offset_t vm_addr = MACH_VM_MIN_ADDRESS;
     natural_t depth = 0;
@@ -175,6 +240,7 @@ walk_regions(task_t task, struct regionhead *rhead)
         mach_vm_size_t vm_size;
 
         kern_return_t ret = mach_vm_region_recurse(task, &vm_addr, &vm_size, &depth, (vm_region_recurse_info_t)&info, &count);
+        wrs->wrs_nqueries++;
 
         if (KERN_FAILURE == ret) {
             err_mach(ret, NULL, "error inspecting task at %llx", vm_addr);
@@ -187,9 +253,10 @@ walk_regions(task_t task, struct regionhead *rhead)
         }
 
         if (OPTIONS_DEBUG(opt, 3)) {
-            struct region *d = new_region(vm_addr, vm_size, &info);
-            ROP_PRINT(d);
-            ROP_DELETE(d);
+            struct region d;
+            bzero(&d, sizeof (d));
+            init_region(&d, vm_addr, vm_size, &info);
+            ROP_PRINT(&d);
         }
 
         if (info.is_submap) {
@@ -212,20 +279,33 @@ walk_regions(task_t task, struct regionhead *rhead)
 #ifdef CONFIG_SUBMAP
         r->r_depth = depth;
 #endif
-        /* grab the page info of the first page in the mapping */
-
-        mach_msg_type_number_t pageinfoCount = VM_PAGE_INFO_BASIC_COUNT;
-        ret = mach_vm_page_info(task, R_ADDR(r), VM_PAGE_INFO_BASIC, (vm_page_info_t)&r->r_pageinfo, &pageinfoCount);
-        if (KERN_SUCCESS != ret)
-            err_mach(ret, r, "getting pageinfo at %llx", R_ADDR(r));
-
-        /* record the purgability */
+        /*
+         * Grab the page info of the first page in the mapping.
+         * Only the object offset and id of file-backed and shared
+         * region mappings are ever consulted (to build file references
+         * and to find the shared cache), so don't ask about the rest.
+         */
+        if (info.external_pager || r->r_insharedregion) {
+            mach_msg_type_number_t pageinfoCount = VM_PAGE_INFO_BASIC_COUNT;
+            ret = mach_vm_page_info(task, R_ADDR(r), VM_PAGE_INFO_BASIC, (vm_page_info_t)&r->r_pageinfo, &pageinfoCount);
+            wrs->wrs_nqueries++;
+            if (KERN_SUCCESS != ret)
+                err_mach(ret, r, "getting pageinfo at %llx", R_ADDR(r));
+        }
 
-        ret = mach_vm_purgable_control(task, vm_addr, VM_PURGABLE_GET_STATE, &r->r_purgable);
-        if (KERN_SUCCESS != ret)
-            r->r_purgable = VM_PURGABLE_DENY;
+        /*
+         * Record the purgability; only anonymous memory backed by
+         * a VM object can be purgable.
+         */
+        if (!info.external_pager && !r->r_inzfodregion) {
+            ret = mach_vm_purgable_control(task, vm_addr, VM_PURGABLE_GET_STATE, &r->r_purgable);
+            wrs->wrs_nqueries++;
+            if (KERN_SUCCESS != ret)
+                r->r_purgable = VM_PURGABLE_DENY;
+        }
 
 		STAILQ_INSERT_TAIL(rhead, r, r_linkage);
+        wrs->wrs_nregions++;
 
         vm_addr += vm_size;
     }
@@ -245,6 +325,8 @@ del_region_list(struct regionhead *rhead)
         ROP_DELETE(r);
     }
     free(rhead);
+    if (0 == --nregionlists)
+        del_region_slabs();
 }
 
 struct regionhead *
@@ -252,10 +334,24 @@ build_region_list(task_t task)
 {
     struct regionhead *rhead = malloc(sizeof (*rhead));
     STAILQ_INIT(rhead);
-    if (0 != walk_regions(task, rhead)) {
+    nregionlists++;
+
+    struct walk_regions_stats wrs;
+    bzero(&wrs, sizeof (wrs));
+    const uint64_t start = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+    const uint64_t pstart = prof_start();
+
+    if (0 != walk_regions(task, rhead, &wrs)) {
         del_region_list(rhead);
         return NULL;
     }
+    prof_stop(PROF_ENUMERATE, pstart, 0);
+    if (opt->verbose) {
+        const uint64_t elapsed = clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - start;
+        printf("Enumerated %u regions (%u VM queries) in %llu.%03llu ms\n",
+               wrs.wrs_nregions, wrs.wrs_nqueries,
+               elapsed / NSEC_PER_MSEC, (elapsed % NSEC_PER_MSEC) / NSEC_PER_USEC);
+    }
     return rhead;
 }
 
@@ -444,7 +540,24 @@ is_actual_size(const task_t task, const struct region *r, mach_vm_size_t *hostvm
      */
     *hostvmsize = R_SIZE(r);
 
-    const long npagemax = 1ul << (pageshift_app - pageshift_host);
+    long npagemax = 1l << (pageshift_app - pageshift_host);
+    if ((mach_vm_size_t)npagemax * pagesize_host > R_SIZE(r))
+        npagemax = (long)(R_SIZE(r) >> pageshift_host);
+
+    /*
+     * Fetch the dispositions of all the trailing pages in one query
+     * rather than asking about each page in turn.
+     */
+    int dispositions[npagemax];
+    mach_vm_size_t dcount = (mach_vm_size_t)npagemax;
+    const mach_vm_address_t tstart = R_ENDADDR(r) - pagesize_host * (mach_vm_size_t)npagemax;
+
+    kern_return_t ret = mach_vm_page_range_query(task, tstart, pagesize_host * (mach_vm_size_t)npagemax, (mach_vm_address_t)dispositions, &dcount);
+    if (KERN_SUCCESS != ret) {
+        err_mach(ret, NULL, "getting page dispositions at %llx", tstart);
+        return true;	/* bail */
+    }
+
     for (long npage = 0; npage < npagemax; npage++) {
 
         const mach_vm_address_t taddress =
@@ -452,20 +565,13 @@ is_actual_size(const task_t task, const struct region *r, mach_vm_size_t *hostvm
         if (taddress < R_ADDR(r) || taddress >= R_ENDADDR(r))
             break;
 
-        mach_msg_type_number_t pCount = VM_PAGE_INFO_BASIC_COUNT;
-        vm_page_info_basic_data_t pInfo;
-
-        kern_return_t ret = mach_vm_page_info(task, taddress, VM_PAGE_INFO_BASIC, (vm_page_info_t)&pInfo, &pCount);
-        if (KERN_SUCCESS != ret) {
-            err_mach(ret, NULL, "getting pageinfo at %llx", taddress);
-            break;	/* bail */
-        }
-
         /*
          * If this page has been in memory before, assume it can
          * be brought back again
          */
-        if (pInfo.disposition & (VM_PAGE_QUERY_PAGE_PRESENT | VM_PAGE_QUERY_PAGE_REF | VM_PAGE_QUERY_PAGE_DIRTY | VM_PAGE_QUERY_PAGE_PAGED_OUT))
+        const long dindex = npagemax - 1 - npage;
+        if (dindex < (long)dcount &&
+            (dispositions[dindex] & (VM_PAGE_QUERY_PAGE_PRESENT | VM_PAGE_QUERY_PAGE_REF | VM_PAGE_QUERY_PAGE_DIRTY | VM_PAGE_QUERY_PAGE_PAGED_OUT)))
             continue;
 
         /*
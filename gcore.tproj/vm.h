@@ -25,6 +25,7 @@ extern void del_fileref_region(struct region *);
 extern void del_zfod_region(struct region *);
 extern void del_sparse_region(struct region *);
 extern void del_vanilla_region(struct region *);
+extern void free_region(struct region *);
 
 extern struct regionhead *build_region_list(task_t);
 extern int walk_region_list(struct regionhead *, walk_region_cbfn_t, void *);
@@ -44,13 +44,23 @@ __FBSDID("$FreeBSD: src/usr.bin/getconf/getconf.c,v 1.10 2006/12/06 12:00:26 max
 static void	do_confstr(const char *name, int key);
 static void	do_sysconf(const char *name, int key);
 static void	do_pathconf(const char *name, int key, const char *path);
+static void	all_confstr(const char *name, int key, int valid);
+static void	all_limit(const char *name, intmax_t value, int valid);
+static void	all_pathconf(const char *name, int key, int valid);
+static void	all_sysconf(const char *name, int key, int valid);
+static void	conf_error(const char *func, const char *name);
+
+static int	aflag;		/* printing every variable, as NAME: value */
+static const char *apath;	/* pathname for -a, if any */
+static int	status;
 
 static void
 usage(void)
 {
 	fprintf(stderr,
 "usage: getconf [-v prog_env] system_var\n"
-"       getconf [-v prog_env] path_var pathname\n");
+"       getconf [-v prog_env] path_var pathname\n"
+"       getconf [-v prog_env] -a [pathname]\n");
 	exit(EX_USAGE);
 }
 
@@ -62,8 +72,12 @@ main(int argc, char **argv)
 	intmax_t limitval;
 
 	vflag = NULL;
-	while ((c = getopt(argc, argv, "v:")) != -1) {
+	while ((c = getopt(argc, argv, "av:")) != -1) {
 		switch (c) {
+		case 'a':
+			aflag = 1;
+			break;
+
 		case 'v':
 			vflag = optarg;
 			break;
@@ -73,7 +87,11 @@ main(int argc, char **argv)
 		}
 	}
 
-	if ((name = argv[optind]) == NULL)
+	if (aflag) {
+		if (argc - optind > 1)
+			usage();
+		apath = argv[optind];
+	} else if ((name = argv[optind]) == NULL)
 		usage();
 
 	if (vflag != NULL) {
@@ -81,7 +99,10 @@ main(int argc, char **argv)
 			errx(EX_USAGE, "invalid programming environment %s",
 			     vflag);
 		if (valid > 0 && alt_path != NULL) {
-			if (argv[optind + 1] == NULL)
+			if (aflag)
+				execl(alt_path, "getconf", "-a", argv[optind],
+				      (char *)NULL);
+			else if (argv[optind + 1] == NULL)
 				execl(alt_path, "getconf", argv[optind],
 				      (char *)NULL);
 			else
@@ -95,6 +116,17 @@ main(int argc, char **argv)
 			     vflag);
 	}
 
+	if (aflag) {
+		if (apath != NULL)
+			foreach_pathconf(all_pathconf);
+		else {
+			foreach_limit(all_limit);
+			foreach_confstr(all_confstr);
+			foreach_sysconf(all_sysconf);
+		}
+		return status;
+	}
+
 	if (argv[optind + 1] == NULL) { /* confstr or sysconf */
 		if ((valid = find_limit(name, &limitval)) != 0) {
 			if (valid > 0)
@@ -146,13 +178,18 @@ do_confstr(const char *name, int key)
 	len = confstr(key, 0, 0);
 	if (len == 0) {
 		if (errno)
-			err(EX_OSERR, "confstr: %s", name);
-		else
+			conf_error("confstr", name);
+		else {
+			if (aflag)
+				printf("%s: ", name);
 			printf("undefined\n");
+		}
 	} else {
 		char buf[len + 1];
 
 		confstr(key, buf, len);
+		if (aflag)
+			printf("%s: ", name);
 		printf("%s\n", buf);
 	}
 	errno = savederr;
@@ -165,9 +202,13 @@ do_sysconf(const char *name, int key)
 
 	errno = 0;
 	value = sysconf(key);
-	if (value == -1 && errno != 0)
-		err(EX_OSERR, "sysconf: %s", name);
-	else if (value == -1)
+	if (value == -1 && errno != 0) {
+		conf_error("sysconf", name);
+		return;
+	}
+	if (aflag)
+		printf("%s: ", name);
+	if (value == -1)
 		printf("undefined\n");
 	else
 		printf("%ld\n", value);
@@ -180,10 +221,68 @@ do_pathconf(const char *name, int key, const char *path)
 
 	errno = 0;
 	value = pathconf(path, key);
-	if (value == -1 && errno != 0)
-		err(EX_OSERR, "pathconf: %s", name);
-	else if (value == -1)
+	if (value == -1 && errno != 0) {
+		conf_error("pathconf", name);
+		return;
+	}
+	if (aflag)
+		printf("%s: ", name);
+	if (value == -1)
 		printf("undefined\n");
 	else
 		printf("%ld\n", value);
 }
+
+/*
+ * A single lookup exits on failure; with -a, report it and go on with
+ * the rest of the variables.
+ */
+static void
+conf_error(const char *func, const char *name)
+{
+	if (!aflag)
+		err(EX_OSERR, "%s: %s", func, name);
+	warn("%s: %s", func, name);
+	status = EX_OSERR;
+}
+
+static void
+all_limit(const char *name, intmax_t value, int valid)
+{
+	if (valid)
+		printf("%s: %" PRIdMAX "\n", name, value);
+	else
+		printf("%s: undefined\n", name);
+}
+
+static void
+all_confstr(const char *name, int key, int valid)
+{
+	if (valid)
+		do_confstr(name, key);
+	else
+		printf("%s: undefined\n", name);
+}
+
+static void
+all_sysconf(const char *name, int key, int valid)
+{
+	intmax_t limitval;
+
+	/* As for a single lookup, a static limit of the same name wins. */
+	if (find_limit(name, &limitval) != 0)
+		return;
+	if (valid)
+		do_sysconf(name, key);
+	else
+		printf("%s: undefined\n", name);
+}
+
+static void
+all_pathconf(const char *name, int key, int valid)
+{
+	if (valid)
+		do_pathconf(name, key, apath);
+	else
+		printf("%s: undefined\n", name);
+}
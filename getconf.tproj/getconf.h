@@ -41,3 +41,7 @@ int	find_limit(const char *name, intmax_t *value);
 int	find_pathconf(const char *name, int *key);
 int	find_progenv(const char *name, const char **alt_path);
 int	find_sysconf(const char *name, int *key);
+void	foreach_confstr(void (*func)(const char *name, int key, int valid));
+void	foreach_limit(void (*func)(const char *name, intmax_t value, int valid));
+void	foreach_pathconf(void (*func)(const char *name, int key, int valid));
+void	foreach_sysconf(void (*func)(const char *name, int key, int valid));
@@ -80,6 +80,7 @@ __unused static const char rcsid[] =
 #include "gettytab.h"
 #include "extern.h"
 #include "pathnames.h"
+#include "startup_phase.h"
 
 /*
  * Set the amount of running time that getty should accumulate
@@ -203,6 +204,7 @@ main(int argc, char *argv[])
 	signal(SIGQUIT, SIG_IGN);
 
 	openlog("getty", LOG_ODELAY|LOG_CONS|LOG_PID, LOG_AUTH);
+	startup_phase(NULL);
 	gethostname(hostname, sizeof(hostname) - 1);
 	hostname[sizeof(hostname) - 1] = '\0';
 	if (hostname[0] == '\0')
@@ -218,6 +220,7 @@ main(int argc, char *argv[])
 
 	gettable("default");
 	gendefaults();
+	startup_phase("default gettytab entry");
 	tname = "default";
 	if (argc > 1)
 		tname = argv[1];
@@ -319,7 +322,9 @@ main(int argc, char *argv[])
 	    }
 	}
 
+	startup_phase("terminal setup");
 	defttymode();
+	startup_phase("terminal modes");
 	for (;;) {
 
 		/*
@@ -391,8 +396,10 @@ main(int argc, char *argv[])
 					digit = 1;
 				*q++ = *p++;
 			}
-		} else if (!(PL && PP))
+		} else if (!(PL && PP)) {
+			startup_phase("login prompt");
 			rval = getname();
+		}
 		if (rval == 2 || (PL && PP)) {
 			oflush();
 			alarm(0);
@@ -445,6 +452,7 @@ main(int argc, char *argv[])
 			limit.rlim_max = RLIM_INFINITY;
 			limit.rlim_cur = RLIM_INFINITY;
 			(void)setrlimit(RLIMIT_CPU, &limit);
+			startup_phase("reading login name");
 #ifdef __APPLE__
 			// <rdar://problem/3205179>
 			execle(LO, "login", AL ? "-fp1" : "-p1", name,
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2026 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Startup phase timings shared by getty and login, which it execs: how
+ * long each step between launch and the shell took, logged through
+ * syslog at LOG_DEBUG so that slow ones can be found.
+ *
+ * It is static inline, with the clock kept per file; include it as
+ * "startup_phase.h" from the one file that marks the phases.
+ */
+
+#ifndef _STARTUP_PHASE_H_
+#define _STARTUP_PHASE_H_
+
+#include <syslog.h>
+#include <time.h>
+
+/*
+ * Log how long the phase just finished took.  Called with NULL to start
+ * the clock.
+ */
+static inline void
+startup_phase(const char *what)
+{
+	static struct timespec last;
+	struct timespec now;
+	long long us;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &now);
+	if (what != NULL) {
+		us = (now.tv_sec - last.tv_sec) * 1000000LL +
+		    (now.tv_nsec - last.tv_nsec) / 1000;
+		syslog(LOG_DEBUG, "%s: %lld.%03lld ms", what, us / 1000,
+		    us % 1000);
+	}
+	last = now;
+}
+
+#endif /* _STARTUP_PHASE_H_ */
@@ -60,6 +60,19 @@ __unused static const char rcsid[] =
 #include "pathnames.h"
 #include "extern.h"
 
+/*
+ * Entries already fetched from gettytab.  getty looks the same ones up
+ * several times while starting (and again on each speed change), and each
+ * cgetent() rereads the file and resolves every tc= chain from scratch.
+ */
+struct gettyent {
+	struct gettyent *next;
+	char *name;
+	char *buf;
+};
+
+static struct gettyent *gettycache;
+
 /*
  * Get a table entry.
  */
@@ -67,6 +80,8 @@ void
 gettable(const char *name)
 {
 	char *buf = NULL;
+	struct gettyent *ep;
+	int cached = 0;
 	struct gettystrs *sp;
 	struct gettynums *np;
 	struct gettyflags *fp;
@@ -106,10 +121,26 @@ gettable(const char *name)
 		firsttime = 0;
 	}
 
-	switch (cgetent(&buf, (char **)dba, (char *)name)) {
+	for (ep = gettycache; ep != NULL; ep = ep->next)
+		if (strcmp(ep->name, name) == 0) {
+			buf = ep->buf;
+			cached = 1;
+			break;
+		}
+
+	if (!cached) switch (cgetent(&buf, (char **)dba, (char *)name)) {
 	case 1:
 		msg = "%s: couldn't resolve 'tc=' in gettytab '%s'";
+		break;
 	case 0:
+		if ((ep = malloc(sizeof(*ep))) != NULL &&
+		    (ep->name = strdup(name)) != NULL) {
+			ep->buf = buf;
+			ep->next = gettycache;
+			gettycache = ep;
+			cached = 1;
+		} else
+			free(ep);
 		break;
 	case -1:
 		msg = "%s: unknown gettytab entry '%s'";
@@ -177,7 +208,8 @@ gettable(const char *name)
 		       fp->value + '0', fp->set + '0');
 #endif /* DEBUG */
 
-	free(buf);
+	if (!cached)
+		free(buf);
 }
 
 void
@@ -43,11 +43,19 @@
 #include <sys/errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
 
 struct host_basic_info	hi;
 kernel_version_t	version;
 int			slots[1024];
 
+static void json_string(const char *str);
+static bool sysctl_u64(const char *name, uint64_t *value);
+static void json_sysctl(const char *key, const char *name, const char *indent,
+    bool *first);
+static void json_perflevels(void);
+
 int
 main(int argc, char *argv[])
 {
@@ -61,6 +69,20 @@ main(int argc, char *argv[])
 	host_name_port_t			host;
 	struct processor_set_basic_info	basic_info;
 	struct processor_set_load_info	load_info;
+	int			ch;
+	bool			jflag = false;
+	double			loadavg[3];
+
+	while ((ch = getopt(argc, argv, "j")) != -1) {
+		switch (ch) {
+		case 'j':
+			jflag = true;
+			break;
+		default:
+			fprintf(stderr, "usage: hostinfo [-j]\n");
+			exit(EXIT_FAILURE);
+		}
+	}
 
 	host = mach_host_self();
 	ret = host_kernel_version(host, version);
@@ -68,7 +90,8 @@ main(int argc, char *argv[])
 		mach_error(argv[0], ret);
                 exit(EXIT_FAILURE);
 	}
-	printf("Mach kernel version:\n\t %s\n", version);
+	if (!jflag)
+		printf("Mach kernel version:\n\t %s\n", version);
 	size = sizeof(hi)/sizeof(int);
 	ret = host_info(host, HOST_BASIC_INFO, (host_info_t)&hi, &size);
 	if (ret != KERN_SUCCESS) {
@@ -121,6 +144,57 @@ main(int argc, char *argv[])
 	    exit(EXIT_FAILURE);
 	}
 
+	slot_name(hi.cpu_type, hi.cpu_subtype, &cpu_name, &cpu_subname);
+
+	if (jflag) {
+		bool first = true;
+
+		if (getloadavg(loadavg, 3) != 3)
+			loadavg[0] = loadavg[1] = loadavg[2] = 0.0;
+
+		printf("{\n\t\"kernel_version\": ");
+		json_string(version);
+		printf(",\n\t\"max_cpus\": %d,\n", hi.max_cpus);
+		printf("\t\"physical_cpus\": %d,\n", hi.physical_cpu);
+		printf("\t\"logical_cpus\": %d,\n", hi.logical_cpu);
+		printf("\t\"cpu_type\": %d,\n\t\"cpu_subtype\": %d,\n",
+			hi.cpu_type, hi.cpu_subtype);
+		printf("\t\"cpu_name\": ");
+		json_string(cpu_name);
+		printf(",\n\t\"cpu_subname\": ");
+		json_string(cpu_subname);
+		printf(",\n\t\"active_cpus\": [");
+		for (int i = 0; i < cpu_count; i++) {
+			if (processor_basic_infop[i].running) {
+				printf("%s%d", first ? "" : ", ", i);
+				first = false;
+			}
+		}
+		printf("],\n\t\"memsize\": %llu,\n", (unsigned long long)memsize);
+		printf("\t\"tasks\": %d,\n\t\"threads\": %d,\n\t\"pset_processors\": %d,\n",
+			load_info.task_count, load_info.thread_count, basic_info.processor_count);
+		printf("\t\"load_average\": %d.%02d,\n\t\"mach_factor\": %d.%02d,\n",
+			load_info.load_average/LOAD_SCALE,
+			(load_info.load_average%LOAD_SCALE)/10,
+			load_info.mach_factor/LOAD_SCALE,
+			(load_info.mach_factor%LOAD_SCALE)/10);
+		printf("\t\"load_averages\": [%.2f, %.2f, %.2f],\n",
+			loadavg[0], loadavg[1], loadavg[2]);
+
+		printf("\t\"cache\": {");
+		first = true;
+		json_sysctl("line_size", "hw.cachelinesize", "\t\t", &first);
+		json_sysctl("l1i_size", "hw.l1icachesize", "\t\t", &first);
+		json_sysctl("l1d_size", "hw.l1dcachesize", "\t\t", &first);
+		json_sysctl("l2_size", "hw.l2cachesize", "\t\t", &first);
+		json_sysctl("l3_size", "hw.l3cachesize", "\t\t", &first);
+		printf("\n\t},\n");
+
+		json_perflevels();
+		printf("\n}\n");
+		exit(0);
+	}
+
 	if (hi.max_cpus > 1)
 		printf("Kernel configured for up to %d processors.\n",
 			hi.max_cpus);
@@ -133,7 +207,6 @@ main(int argc, char *argv[])
 		(hi.logical_cpu > 1) ? "s are" : " is");
 
 	printf("Processor type:");
-	slot_name(hi.cpu_type, hi.cpu_subtype, &cpu_name, &cpu_subname);
 	printf(" %s (%s)\n", cpu_name, cpu_subname);
 
 	printf("Processor%s active:", (hi.avail_cpus > 1) ? "s" : "");
@@ -161,3 +234,122 @@ main(int argc, char *argv[])
 
 	exit(0);
 }
+
+static void
+json_string(const char *str)
+{
+	const unsigned char *cp;
+
+	putchar('"');
+	for (cp = (const unsigned char *)str; *cp; cp++) {
+		if (*cp == '"' || *cp == '\\')
+			printf("\\%c", *cp);
+		else if (*cp == '\n')
+			printf("\\n");
+		else if (*cp == '\t')
+			printf("\\t");
+		else if (*cp < 0x20)
+			printf("\\u%04x", *cp);
+		else
+			putchar(*cp);
+	}
+	putchar('"');
+}
+
+/*
+ * Read an integer sysctl, whether the kernel exports it as 32 or 64 bits.
+ */
+static bool
+sysctl_u64(const char *name, uint64_t *value)
+{
+	union {
+		uint32_t	u32;
+		uint64_t	u64;
+	} u;
+	size_t len = sizeof(u);
+
+	if (sysctlbyname(name, &u, &len, NULL, 0) == -1)
+		return false;
+	if (len == sizeof(u.u32))
+		*value = u.u32;
+	else if (len == sizeof(u.u64))
+		*value = u.u64;
+	else
+		return false;
+	return true;
+}
+
+/*
+ * Print "key": value for an integer sysctl at the given indent, leaving
+ * out ones this machine does not have.
+ */
+static void
+json_sysctl(const char *key, const char *name, const char *indent, bool *first)
+{
+	uint64_t value;
+
+	if (!sysctl_u64(name, &value))
+		return;
+	printf("%s\n%s\"%s\": %llu", *first ? "" : ",", indent, key,
+		(unsigned long long)value);
+	*first = false;
+}
+
+/*
+ * The performance levels, most performant first, with their core counts,
+ * caches and clusters (the CPUs sharing an L2).  Machines without
+ * hw.perflevel report an empty list.
+ */
+static void
+json_perflevels(void)
+{
+	static const struct {
+		const char	*key;
+		const char	*leaf;
+	} fields[] = {
+		{ "physical_cpus",	"physicalcpu" },
+		{ "physical_cpus_max",	"physicalcpu_max" },
+		{ "logical_cpus",	"logicalcpu" },
+		{ "logical_cpus_max",	"logicalcpu_max" },
+		{ "l1i_size",		"l1icachesize" },
+		{ "l1d_size",		"l1dcachesize" },
+		{ "l2_size",		"l2cachesize" },
+		{ "cpus_per_l2",	"cpusperl2" },
+		{ "l3_size",		"l3cachesize" },
+		{ "cpus_per_l3",	"cpusperl3" },
+	};
+	uint64_t nperflevels = 0, logicalcpus, cpusperl2;
+	char name[64], levelname[64];
+	size_t len;
+	bool first;
+
+	(void)sysctl_u64("hw.nperflevels", &nperflevels);
+
+	printf("\t\"perflevels\": [");
+	for (uint64_t level = 0; level < nperflevels; level++) {
+		printf("%s\n\t\t{\n\t\t\t\"level\": %llu,\n\t\t\t\"name\": ",
+			level ? "," : "", (unsigned long long)level);
+		snprintf(name, sizeof(name), "hw.perflevel%llu.name", (unsigned long long)level);
+		len = sizeof(levelname);
+		if (sysctlbyname(name, levelname, &len, NULL, 0) == -1)
+			levelname[0] = '\0';
+		json_string(levelname);
+
+		first = false;
+		for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+			snprintf(name, sizeof(name), "hw.perflevel%llu.%s",
+				(unsigned long long)level, fields[i].leaf);
+			json_sysctl(fields[i].key, name, "\t\t\t", &first);
+		}
+
+		snprintf(name, sizeof(name), "hw.perflevel%llu.logicalcpu_max", (unsigned long long)level);
+		if (sysctl_u64(name, &logicalcpus)) {
+			snprintf(name, sizeof(name), "hw.perflevel%llu.cpusperl2", (unsigned long long)level);
+			if (sysctl_u64(name, &cpusperl2) && cpusperl2 > 0)
+				printf(",\n\t\t\t\"clusters\": %llu",
+					(unsigned long long)((logicalcpus + cpusperl2 - 1) / cpusperl2));
+		}
+		printf("\n\t\t}");
+	}
+	printf("%s]", nperflevels ? "\n\t" : "");
+}
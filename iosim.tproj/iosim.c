@@ -11,37 +11,122 @@
 #include <sys/types.h>
 #include <math.h>
 #include <signal.h>
-#include <libkern/OSAtomic.h>
 #include <limits.h>
 #include <errno.h>
 #include <CoreFoundation/CoreFoundation.h>
 #include "panic.h"
 #include <IOKit/IOKitLib.h>
 #include <spawn.h>
+#include <aio.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <sys/mman.h>
 
 #define IO_MODE_SEQ		0
 #define IO_MODE_RANDOM		1
+#define IO_MODE_ZIPF		2
+#define IO_MODE_HOTSPOT		3
+
+#define ZIPF_THETA		0.99	/* Skew of the zipfian pattern */
+#define HOTSPOT_IO_PERCENT	90	/* Share of I/Os sent to the hot region */
+#define HOTSPOT_SIZE_PERCENT	10	/* Share of the file that is hot */
 
 #define WORKLOAD_TYPE_RO	0
 #define WORKLOAD_TYPE_WO	1
 #define WORKLOAD_TYPE_RW	2
 
+#define REPORT_FORMAT_CSV	0
+#define REPORT_FORMAT_JSON	1
+
 #define MAX_THREADS		1000
+#define MAX_QUEUE_DEPTH		64
+#define MAX_JOBS		16
 #define MAX_FILENAME		64
 #define MAX_ITERATIONS		10000
 #define LATENCY_BIN_SIZE	1000
 #define LATENCY_BINS		31
 #define LOW_LATENCY_BIN_SIZE	50
 #define LOW_LATENCY_BINS	21
+#define PCT_SUB_BINS		16	/* Percentile bins per power of two */
+#define PCT_BINS		(61 * PCT_SUB_BINS)
+#define CACHE_LINE_SIZE		128
 #define THROUGHPUT_INTERVAL	5000
 #define DEFAULT_FILE_SIZE	(262144)
 #define BLOCKSIZE		1024
 #define MAX_CMD_SIZE		256
-#define PG_MASK			~(0xFFF)
+#define FILL_CHUNK_SIZE		(1024 * 1024)
+#define MAX_FILL_THREADS	8
+#define VERIFY_SECTOR_SIZE	4096
+#define VERIFY_MAGIC		0x696f73696d766679ULL	/* "iosimvfy" */
 #define kIONVMeANS2ControllerString         "AppleANS2Controller"
 #define kIONVMeANS2EmbeddedControllerString "AppleANS2NVMeController"
 #define kIONVMeControllerString             "AppleNVMeController"
 
+/* Per-thread generator of I/O offsets, in units of I/O sized blocks */
+typedef struct {
+	int64_t		blocks;		/* Blocks in the file */
+	int64_t		next;		/* Next sequential block */
+	uint64_t	rng;		/* xorshift64* state */
+	double		zipf_zetan;
+	double		zipf_eta;
+	double		zipf_alpha;
+} io_offset_gen_t;
+
+/*
+ * Statistics of one I/O thread. Only that thread writes them, so they need
+ * no atomics, and each sits on its own cache lines; print_stats() merges them.
+ */
+typedef struct {
+	int64_t		io_count;
+	int64_t		io_size;
+	int64_t		io_time;
+	int64_t		max_io_time;
+	int64_t		burst_count;
+	int64_t		latency_histogram[LATENCY_BINS];
+	int64_t		burst_latency_histogram[LATENCY_BINS];
+	int64_t		low_latency_histogram[LOW_LATENCY_BINS];
+	int64_t		pct_histogram[PCT_BINS];	/* Log-linear, for percentiles */
+	int64_t		verified_count;			/* Sectors read back and checked */
+} __attribute__((aligned(CACHE_LINE_SIZE))) io_thread_stats_t;
+
+/*
+ * A thread's I/O buffers, one per outstanding I/O. Writes come from buffers
+ * filled once at the requested compressibility, and reads go to separate
+ * ones, so reads never disturb the data that is written.
+ */
+typedef struct {
+	char		*read_buf;
+	char		*write_buf;
+	uint64_t	*sums;		/* Payload checksum of each write sector */
+} io_buffers_t;
+
+/* With -v, each sector written starts with this header */
+typedef struct {
+	uint64_t	magic;
+	uint64_t	offset;		/* Of the sector in the file */
+	uint64_t	sum;		/* mix of the payload checksum and offset */
+} verify_header_t;
+
+/*
+ * A group of threads sharing one workload. Without a job file (-g) there is
+ * a single job, built from the command line options.
+ */
+typedef struct {
+	char		name[MAX_FILENAME];
+	int		thread_count;
+	int		workload_type;
+	int		io_mode;
+	int		io_size;
+	int		io_tier;
+	int		cached_io_flag;
+	int		burst_count;
+	int		inter_burst_duration;
+	int		inter_io_delay_ms;
+	int		queue_depth;
+	int		target_iops;	/* Whole job; 0 for closed-loop bursts */
+	int		first_thread;
+} io_job_t;
+
 typedef enum {
 	kDefaultDevice    = 0,
 	kNVMeDevice       = 1,
@@ -55,14 +140,26 @@ int thread_count = 1;			/* Unit: Number ; Desc.: Thread Count */
 int workload_type = WORKLOAD_TYPE_RO;	/* Unit: 0/1/2  ; Desc.: Workload Type */
 int io_size = 4096;	                /* Unit: Bytes  ; Desc.: I/O Unit Size */
 int sync_frequency_ms = 0;		/* Unit: msecs  ; Desc.: Sync thread frequency (0: Indicates no sync) */
-int io_mode = 0;			/* Unit: 0/1	; Desc.: I/O Mode (Seq./Rand.) */
+int io_mode = 0;			/* Unit: 0/1/2/3; Desc.: I/O Mode (Seq./Rand./Zipf/Hotspot) */
 int test_duration = 0;                  /* Unit: secs   ; Desc.: Total Test Duration (0 indicates wait for Ctrl+C signal) */
 int io_tier = 0;			/* Unit: 0/1/2/3; Desc.: I/O Tier */
 int file_size = DEFAULT_FILE_SIZE;	/* Unit: pages  ; Desc.: File Size in 4096 byte blocks */
 int cached_io_flag = 0;			/* Unit: 0/1	; Desc.: I/O Caching behavior (no-cached/cached) */
 int io_qos_timeout_ms = 0;		/* Unit: msecs  ; Desc.: I/O QOS timeout */
+int queue_depth = 1;			/* Unit: Number ; Desc.: Outstanding I/Os per thread (1: Synchronous I/O) */
+int report_interval_ms = 0;		/* Unit: msecs  ; Desc.: Interval report period (0: No interval reports) */
+int target_iops = 0;			/* Unit: IOPS   ; Desc.: Open-loop I/O rate of all threads (0: Closed-loop bursts) */
+int report_format = REPORT_FORMAT_CSV;	/* Unit: 0/1	; Desc.: Interval report format (CSV/JSON) */
 char *user_fname;
 int user_specified_file = 0;
+char *job_fname;
+int reuse_files_flag = 0;		/* Unit: 0/1	; Desc.: Reuse test files of the same size from earlier runs */
+int fill_next_file;
+int compressibility = 100;		/* Unit: percent; Desc.: Compressibility of written data (100: Zeros) */
+int verify_flag = 0;			/* Unit: 0/1	; Desc.: Verify the checksum of each sector read */
+io_job_t jobs[MAX_JOBS];
+int job_count = 0;
+int thread_job[MAX_THREADS];
 qos_device_type_t qos_device = 0;
 
 int64_t total_io_count = 0;
@@ -70,11 +167,15 @@ int64_t total_io_size = 0;
 int64_t total_io_time = 0;
 int64_t max_io_time = 0;
 int64_t total_burst_count = 0;
+int64_t total_verified_count = 0;
 int64_t latency_histogram[LATENCY_BINS];
 int64_t burst_latency_histogram[LATENCY_BINS];
 int64_t low_latency_histogram[LOW_LATENCY_BINS];
+int64_t pct_histogram[PCT_BINS];
+io_thread_stats_t *thread_stats;
 int64_t throughput_histogram[MAX_ITERATIONS];
 int64_t throughput_index;
+int64_t test_start_us;
 CFRunLoopTimerRef	runLoopTimer	= NULL;
 
 void print_usage(void);
@@ -85,13 +186,36 @@ void signalHandler(int sig);
 void assertASP(CFRunLoopTimerRef timer, void *info );
 void start_qos_timer(void);
 void stop_qos_timer(void);
-void perform_io(int fd, char *buf, int size, int type);
+void perform_io(int fd, char *buf, int size, int type, off_t offset);
+int choose_io_type(io_job_t *job);
+void setup_io_buffers(io_job_t *job, io_buffers_t *bufs, uint64_t seed);
+char *io_buffer(io_job_t *job, io_buffers_t *bufs, int slot, int type, off_t offset);
+void verify_io_buffer(io_job_t *job, io_buffers_t *bufs, int slot, off_t offset, io_thread_stats_t *stats);
+uint64_t sector_checksum(char *sector);
+int64_t perform_async_burst(int fd, io_buffers_t *bufs, io_job_t *job, io_offset_gen_t *gen, io_thread_stats_t *stats);
+void init_offset_gen(io_job_t *job, io_offset_gen_t *gen, off_t size, uint64_t seed);
+uint64_t next_random(io_offset_gen_t *gen);
+off_t next_io_offset(io_job_t *job, io_offset_gen_t *gen);
+void submit_async_io(io_job_t *job, struct aiocb *cb, int fd, io_buffers_t *bufs, int slot, off_t offset);
+void perform_paced_io(int fd, io_buffers_t *bufs, io_job_t *job, io_offset_gen_t *gen, io_thread_stats_t *stats);
+void record_io(io_thread_stats_t *stats, int io_size, int64_t elapsed);
+void merge_stats(int first_thread, int count);
+void parse_job_file(char *fname);
+void test_file_name(char *fname, int thread_id);
+void create_test_file(char *fname, off_t size);
+void *fill_routine(void *arg);
+void drop_file_cache(char *fname);
+unsigned int find_pct_bin(int64_t latency);
+int64_t pct_bin_value(unsigned int bin);
+int64_t latency_percentile(int64_t *histogram, int64_t io_count, int64_t max_latency, double percentile);
+int64_t time_usecs(void);
+void print_interval_report(int64_t now);
 void *sync_routine(void *arg);
 void *calculate_throughput(void *arg);
 void *io_routine(void *arg);
 void validate_option(int value, int min, int max, char *option, char *units);
 void print_test_setup(int value, char *option, char *units, char *comment);
-void setup_process_io_policy(int io_tier);
+void setup_io_policy(int scope, int io_tier);
 void setup_qos_device(void);
 void print_latency_histogram(int64_t *data, int latency_bins, int latency_bin_size, double io_count);
 int system_cmd(char *command);
@@ -106,15 +230,23 @@ print_usage(void)
 	printf("-d: (msecs)   Inter I/O delay. Amount of time between issuing I/Os\n");
 	printf("-t: (number)  Thread count\n");
 	printf("-f: (0/1/2 :  Read-Only/Write-Only/Mixed RW) Workload Type\n");
-	printf("-m: (0/1   :  Sequential/Random) I/O pattern\n");
+	printf("-m: (0/1/2/3: Sequential/Random/Zipfian/Hotspot) I/O pattern\n");
 	printf("-j: (number)  Size of I/O in bytes\n");
 	printf("-s: (msecs)   Frequency of sync() calls\n");
 	printf("-x: (secs)    Test duration (0 indicates that the tool would wait for a Ctrl-C)\n");
 	printf("-l: (0/1/2/3) I/O Tier\n");
 	printf("-z: (number)  File Size in pages (1 page = 4096 bytes) \n");
 	printf("-n: (string)  File name used for tests (the tool would create files if this option is not specified)\n");
+	printf("-b: (percent) Compressibility of written data (100 indicates zeros, 0 incompressible)\n");
+	printf("-v: (0/1   :  No/Yes) Stamp a checksum in each 4096 byte sector written, and verify the sectors read\n");
+	printf("-u: (0/1   :  No/Yes) Name the files the tool creates by size, and reuse those left by earlier runs\n");
 	printf("-a: (0/1   :  Non-cached/Cached) I/O Caching behavior\n");
 	printf("-q: (msecs)   I/O QoS timeout. Time of I/O before drive assert and system panic\n");
+	printf("-o: (number)  Outstanding I/Os per thread, issued asynchronously (1 indicates synchronous I/O)\n");
+	printf("-r: (msecs)   Interval report period. IOPS, throughput and latency percentiles for each period (0 indicates no interval reports)\n");
+	printf("-e: (0/1   :  CSV/JSON) Interval report format\n");
+	printf("-p: (number)  Target IOPS of all threads. I/Os are issued on a fixed schedule and latency is measured from the scheduled time (0 indicates closed-loop bursts)\n");
+	printf("-g: (string)  Job file describing groups of threads, each with its own workload (see iosim(1))\n");
 }
 
 void print_data_percentage(double percent)
@@ -154,11 +286,30 @@ void print_stats()
 	double percentage;
         char label[MAX_FILENAME];
 
+	for (i = 0; job_count > 1 && i < job_count; i++) {
+		merge_stats(jobs[i].first_thread, jobs[i].thread_count);
+		printf("Job %s I/O Statistics:\n", jobs[i].name);
+		printf("Total I/Os      : %lld\n", total_io_count);
+		printf("Avg. Latency    : %.2lf usecs\n", ((double)total_io_time) / ((double)total_io_count));
+		printf("Max. Latency    : %.2lf usecs\n", ((double)max_io_time));
+		printf("p50 Latency     : %lld usecs\n", latency_percentile(pct_histogram, total_io_count, max_io_time, 50.0));
+		printf("p99 Latency     : %lld usecs\n", latency_percentile(pct_histogram, total_io_count, max_io_time, 99.0));
+		printf("p99.9 Latency   : %lld usecs\n", latency_percentile(pct_histogram, total_io_count, max_io_time, 99.9));
+		printf("Total Data      : %.2lf MB\n\n", (double)total_io_size / 1048576.0);
+	}
+
+	merge_stats(0, thread_count);
+
 	printf("I/O Statistics:\n");
 
 	printf("Total I/Os      : %lld\n", total_io_count);
 	printf("Avg. Latency    : %.2lf usecs\n", ((double)total_io_time) / ((double)total_io_count));
 	printf("Max. Latency    : %.2lf usecs\n", ((double)max_io_time));
+	printf("p50 Latency     : %lld usecs\n", latency_percentile(pct_histogram, total_io_count, max_io_time, 50.0));
+	printf("p99 Latency     : %lld usecs\n", latency_percentile(pct_histogram, total_io_count, max_io_time, 99.0));
+	printf("p99.9 Latency   : %lld usecs\n", latency_percentile(pct_histogram, total_io_count, max_io_time, 99.9));
+	if (verify_flag)
+		printf("Verified Sectors: %lld\n", total_verified_count);
 
 	printf("Low Latency Histogram: \n");
 	print_latency_histogram(low_latency_histogram, LOW_LATENCY_BINS, LOW_LATENCY_BIN_SIZE, (double)total_io_count);
@@ -193,6 +344,83 @@ unsigned int find_io_bin(int64_t latency, int latency_bin_size, int latency_bins
 	return bin;
 }
 
+/*
+ * Percentile bins are exact below PCT_SUB_BINS usecs; above that each power
+ * of two is split into PCT_SUB_BINS bins, so a bin is within 1/16th of the
+ * latencies it holds.
+ */
+unsigned int find_pct_bin(int64_t latency)
+{
+	int msb;
+
+	if (latency < PCT_SUB_BINS)
+		return (latency < 0) ? 0 : (unsigned int)latency;
+	msb = 63 - __builtin_clzll((uint64_t)latency);
+	return (msb - 3) * PCT_SUB_BINS + (unsigned int)((latency >> (msb - 4)) & (PCT_SUB_BINS - 1));
+}
+
+/* Returns the largest latency that falls in the bin */
+int64_t pct_bin_value(unsigned int bin)
+{
+	int shift;
+
+	if (bin < PCT_SUB_BINS)
+		return bin;
+	shift = bin / PCT_SUB_BINS - 1;
+	return (((int64_t)(PCT_SUB_BINS + bin % PCT_SUB_BINS) + 1) << shift) - 1;
+}
+
+int64_t latency_percentile(int64_t *histogram, int64_t io_count, int64_t max_latency, double percentile)
+{
+	int64_t target, seen = 0;
+	unsigned int i;
+
+	if (io_count == 0)
+		return 0;
+
+	target = (int64_t)ceil((percentile / 100.0) * io_count);
+	for (i = 0; i < PCT_BINS; i++) {
+		seen += histogram[i];
+		if (seen >= target)
+			break;
+	}
+	if (i == PCT_BINS || pct_bin_value(i) > max_latency)
+		return max_latency;
+	return pct_bin_value(i);
+}
+
+/* Sums the statistics of a range of threads into the global totals */
+void merge_stats(int first_thread, int count)
+{
+	io_thread_stats_t *stats;
+	int i, j;
+
+	total_io_count = total_io_size = total_io_time = max_io_time = total_burst_count = total_verified_count = 0;
+	memset(latency_histogram, 0, sizeof(latency_histogram));
+	memset(burst_latency_histogram, 0, sizeof(burst_latency_histogram));
+	memset(low_latency_histogram, 0, sizeof(low_latency_histogram));
+	memset(pct_histogram, 0, sizeof(pct_histogram));
+
+	for (i = first_thread; i < first_thread + count; i++) {
+		stats = &thread_stats[i];
+		total_io_count += stats->io_count;
+		total_io_size += stats->io_size;
+		total_io_time += stats->io_time;
+		total_burst_count += stats->burst_count;
+		total_verified_count += stats->verified_count;
+		if (stats->max_io_time > max_io_time)
+			max_io_time = stats->max_io_time;
+		for (j = 0; j < LATENCY_BINS; j++) {
+			latency_histogram[j] += stats->latency_histogram[j];
+			burst_latency_histogram[j] += stats->burst_latency_histogram[j];
+		}
+		for (j = 0; j < LOW_LATENCY_BINS; j++)
+			low_latency_histogram[j] += stats->low_latency_histogram[j];
+		for (j = 0; j < PCT_BINS; j++)
+			pct_histogram[j] += stats->pct_histogram[j];
+	}
+}
+
 void signalHandler(int sig)
 {
 	printf("\n");
@@ -301,31 +529,28 @@ void stop_qos_timer(void)
 	CFRelease(runLoopTimer);
 }
 
-void perform_io(int fd, char *buf, int size, int type)
+void perform_io(int fd, char *buf, int size, int type, off_t offset)
 {
 	long ret;
 
-	if (type == WORKLOAD_TYPE_RW)
-		type = (rand() % 2) ? WORKLOAD_TYPE_WO : WORKLOAD_TYPE_RO;
-
 	while(size > 0) {
 
 		if (type == WORKLOAD_TYPE_RO)
-			ret = read(fd, buf, size);
+			ret = pread(fd, buf, size, offset);
 		else
-			ret = write(fd, buf, size);
+			ret = pwrite(fd, buf, size, offset);
 
 		if (ret == 0) {
-			if (lseek(fd, 0, SEEK_SET) < 0) {
-				perror("lseek() to reset file offset to zero failed!\n");
-				goto error;
-			}
+			printf("Unexpected end of file at offset %lld!\n", offset);
+			goto error;
 		}
 
 		if (ret < 0) {
-			perror("read/write syscall failed!\n");
+			perror("pread/pwrite syscall failed!\n");
 			goto error;
 		}
+		buf += ret;
+		offset += ret;
 		size -= ret;
 	}
 
@@ -336,6 +561,356 @@ error:
 	exit(1);
 }
 
+/*
+ * Issue one burst with up to queue_depth asynchronous I/Os in flight,
+ * refilling the queue as I/Os complete. Returns the sum of the latencies.
+ */
+int64_t perform_async_burst(int fd, io_buffers_t *bufs, io_job_t *job, io_offset_gen_t *gen, io_thread_stats_t *stats)
+{
+	struct aiocb cb[MAX_QUEUE_DEPTH];
+	const struct aiocb *list[MAX_QUEUE_DEPTH];
+	struct timeval start_tv[MAX_QUEUE_DEPTH];
+	struct timeval end_tv;
+	int64_t elapsed, burst_elapsed = 0;
+	int issued = 0, inflight = 0, slot;
+
+	memset(cb, 0, sizeof(cb));
+	memset(list, 0, sizeof(list));
+
+	while (issued < job->burst_count || inflight > 0) {
+		for (slot = 0; issued < job->burst_count && slot < job->queue_depth; slot++) {
+			if (list[slot] != NULL)
+				continue;
+
+			gettimeofday(&start_tv[slot], NULL);
+			submit_async_io(job, &cb[slot], fd, bufs, slot, next_io_offset(job, gen));
+			list[slot] = &cb[slot];
+			issued++;
+			inflight++;
+
+			if (job->inter_io_delay_ms)
+				usleep(job->inter_io_delay_ms * 1000);
+		}
+
+		if (aio_suspend(list, job->queue_depth, NULL) < 0 && errno != EINTR) {
+			perror("aio_suspend syscall failed!\n");
+			goto error;
+		}
+		gettimeofday(&end_tv, NULL);
+
+		for (slot = 0; slot < job->queue_depth; slot++) {
+			if (list[slot] == NULL || aio_error(&cb[slot]) == EINPROGRESS)
+				continue;
+			if (aio_return(&cb[slot]) != job->io_size) {
+				perror("asynchronous read/write failed!\n");
+				goto error;
+			}
+			if (verify_flag && cb[slot].aio_lio_opcode == LIO_READ)
+				verify_io_buffer(job, bufs, slot, cb[slot].aio_offset, stats);
+			elapsed = ((end_tv.tv_sec - start_tv[slot].tv_sec) * 1000000)  + (end_tv.tv_usec - start_tv[slot].tv_usec);
+			record_io(stats, job->io_size, elapsed);
+			burst_elapsed += elapsed;
+			list[slot] = NULL;
+			inflight--;
+		}
+	}
+
+	return burst_elapsed;
+
+error:
+	print_stats();
+	exit(1);
+}
+
+void submit_async_io(io_job_t *job, struct aiocb *cb, int fd, io_buffers_t *bufs, int slot, off_t offset)
+{
+	int type, ret;
+
+	type = choose_io_type(job);
+
+	cb->aio_fildes = fd;
+	cb->aio_buf = io_buffer(job, bufs, slot, type, offset);
+	cb->aio_lio_opcode = (type == WORKLOAD_TYPE_RO) ? LIO_READ : LIO_WRITE;
+	cb->aio_nbytes = job->io_size;
+	cb->aio_offset = offset;
+
+	if (type == WORKLOAD_TYPE_RO)
+		ret = aio_read(cb);
+	else
+		ret = aio_write(cb);
+	if (ret < 0) {
+		if (errno == EAGAIN)
+			printf("Too many outstanding I/Os, see kern.aio_max_requests_per_process\n");
+		perror("aio_read/aio_write syscall failed!\n");
+		print_stats();
+		exit(1);
+	}
+}
+
+/*
+ * Open-loop load: the thread's I/Os are due at fixed intervals from the
+ * start, whether or not earlier ones have completed, with up to queue_depth
+ * in flight. Latency runs from when an I/O was due rather than when it was
+ * issued, so time spent waiting behind a slow device is not hidden.
+ */
+void perform_paced_io(int fd, io_buffers_t *bufs, io_job_t *job, io_offset_gen_t *gen, io_thread_stats_t *stats)
+{
+	struct aiocb cb[MAX_QUEUE_DEPTH];
+	const struct aiocb *list[MAX_QUEUE_DEPTH];
+	double due[MAX_QUEUE_DEPTH];
+	double next, interval;
+	struct timespec timeout;
+	int64_t now, elapsed;
+	int inflight = 0, slot;
+
+	memset(cb, 0, sizeof(cb));
+	memset(list, 0, sizeof(list));
+
+	interval = ((double)job->thread_count * 1000000.0) / job->target_iops;
+	next = (double)time_usecs();
+
+	while (1) {
+		now = time_usecs();
+		for (slot = 0; slot < job->queue_depth && next <= now; slot++) {
+			if (list[slot] != NULL)
+				continue;
+			due[slot] = next;
+			next += interval;
+			submit_async_io(job, &cb[slot], fd, bufs, slot, next_io_offset(job, gen));
+			list[slot] = &cb[slot];
+			inflight++;
+		}
+
+		/* Wake for a completion, or for the next I/O if a slot is free */
+		if (inflight < job->queue_depth) {
+			elapsed = (next > now) ? (int64_t)(next - now) : 0;
+			timeout.tv_sec = elapsed / 1000000;
+			timeout.tv_nsec = (elapsed % 1000000) * 1000;
+			if (inflight == 0) {
+				nanosleep(&timeout, NULL);
+				continue;
+			}
+		}
+		if (aio_suspend(list, job->queue_depth, (inflight < job->queue_depth) ? &timeout : NULL) < 0 &&
+		    errno != EINTR && errno != EAGAIN) {
+			perror("aio_suspend syscall failed!\n");
+			goto error;
+		}
+		now = time_usecs();
+
+		for (slot = 0; slot < job->queue_depth; slot++) {
+			if (list[slot] == NULL || aio_error(&cb[slot]) == EINPROGRESS)
+				continue;
+			if (aio_return(&cb[slot]) != job->io_size) {
+				perror("asynchronous read/write failed!\n");
+				goto error;
+			}
+			if (verify_flag && cb[slot].aio_lio_opcode == LIO_READ)
+				verify_io_buffer(job, bufs, slot, cb[slot].aio_offset, stats);
+			elapsed = now - (int64_t)due[slot];
+			record_io(stats, job->io_size, elapsed);
+			list[slot] = NULL;
+			inflight--;
+		}
+	}
+
+error:
+	print_stats();
+	exit(1);
+}
+
+int choose_io_type(io_job_t *job)
+{
+	if (job->workload_type == WORKLOAD_TYPE_RW)
+		return (rand() % 2) ? WORKLOAD_TYPE_WO : WORKLOAD_TYPE_RO;
+	return job->workload_type;
+}
+
+/* FNV-1a over the 64-bit words of a sector's payload */
+uint64_t sector_checksum(char *sector)
+{
+	uint64_t *word = (uint64_t *)(sector + sizeof(verify_header_t));
+	uint64_t *end = (uint64_t *)(sector + VERIFY_SECTOR_SIZE);
+	uint64_t sum = 0xcbf29ce484222325ULL;
+
+	while (word < end)
+		sum = (sum ^ *word++) * 0x100000001b3ULL;
+	return sum;
+}
+
+/*
+ * Allocates page-aligned buffers for each outstanding I/O. Each sector of
+ * a write buffer gets (100 - compressibility)% random bytes followed by
+ * zeros. The payload never changes, so its checksum is only computed once.
+ */
+void setup_io_buffers(io_job_t *job, io_buffers_t *bufs, uint64_t seed)
+{
+	size_t len = (size_t)job->io_size * job->queue_depth;
+	size_t sector, sector_size, random_bytes, i;
+	uint64_t rng = seed | 1, value = 0;
+
+	if (posix_memalign((void **)&bufs->read_buf, getpagesize(), len) ||
+	    posix_memalign((void **)&bufs->write_buf, getpagesize(), len) ||
+	    !(bufs->sums = calloc(len / VERIFY_SECTOR_SIZE + 1, sizeof(uint64_t)))) {
+		perror("Error allocating buffers for I/O!\n");
+		exit(1);
+	}
+	memset(bufs->read_buf, '\0', len);
+	memset(bufs->write_buf, '\0', len);
+
+	for (sector = 0; sector < len; sector += VERIFY_SECTOR_SIZE) {
+		sector_size = (len - sector < VERIFY_SECTOR_SIZE) ? len - sector : VERIFY_SECTOR_SIZE;
+		random_bytes = (sector_size * (100 - compressibility)) / 100;
+		for (i = 0; i < random_bytes; i++) {
+			if ((i % sizeof(uint64_t)) == 0) {
+				rng ^= rng >> 12;
+				rng ^= rng << 25;
+				rng ^= rng >> 27;
+				value = rng * 0x2545F4914F6CDD1DULL;
+			}
+			bufs->write_buf[sector + i] = (char)(value >> (8 * (i % sizeof(uint64_t))));
+		}
+		if (verify_flag)
+			bufs->sums[sector / VERIFY_SECTOR_SIZE] = sector_checksum(bufs->write_buf + sector);
+	}
+}
+
+/* Returns the buffer for an I/O of the given type; writes get stamped with -v */
+char *io_buffer(io_job_t *job, io_buffers_t *bufs, int slot, int type, off_t offset)
+{
+	size_t base = (size_t)slot * job->io_size;
+	verify_header_t *header;
+	size_t sector;
+
+	if (type == WORKLOAD_TYPE_RO)
+		return bufs->read_buf + base;
+
+	for (sector = 0; verify_flag && sector < (size_t)job->io_size; sector += VERIFY_SECTOR_SIZE) {
+		header = (verify_header_t *)(bufs->write_buf + base + sector);
+		header->magic = VERIFY_MAGIC;
+		header->offset = offset + sector;
+		header->sum = (bufs->sums[(base + sector) / VERIFY_SECTOR_SIZE] ^ header->offset) * 0x9E3779B97F4A7C15ULL;
+	}
+	return bufs->write_buf + base;
+}
+
+/*
+ * Checks every sector of a completed read that carries a header. Sectors
+ * without one have not been written by a -v run yet.
+ */
+void verify_io_buffer(io_job_t *job, io_buffers_t *bufs, int slot, off_t offset, io_thread_stats_t *stats)
+{
+	char *buf = bufs->read_buf + ((size_t)slot * job->io_size);
+	verify_header_t *header;
+	size_t sector;
+
+	for (sector = 0; sector < (size_t)job->io_size; sector += VERIFY_SECTOR_SIZE) {
+		header = (verify_header_t *)(buf + sector);
+		if (header->magic != VERIFY_MAGIC)
+			continue;
+		if (header->offset != (uint64_t)(offset + sector) ||
+		    header->sum != ((sector_checksum(buf + sector) ^ header->offset) * 0x9E3779B97F4A7C15ULL)) {
+			printf("Data verification failed for the sector at offset %lld (header offset %lld)!\n",
+			    (int64_t)(offset + sector), (int64_t)header->offset);
+			print_stats();
+			exit(1);
+		}
+		stats->verified_count++;
+	}
+}
+
+void init_offset_gen(io_job_t *job, io_offset_gen_t *gen, off_t size, uint64_t seed)
+{
+	double zeta2 = 0;
+	int64_t i;
+
+	memset(gen, 0, sizeof(*gen));
+	gen->blocks = size / job->io_size;
+	gen->rng = seed ? seed : 1;
+
+	if (job->io_mode != IO_MODE_ZIPF)
+		return;
+
+	/* Gray et al., "Quickly Generating Billion-Record Synthetic Databases" */
+	for (i = 1; i <= gen->blocks; i++) {
+		gen->zipf_zetan += 1.0 / pow((double)i, ZIPF_THETA);
+		if (i == 2)
+			zeta2 = gen->zipf_zetan;
+	}
+	gen->zipf_alpha = 1.0 / (1.0 - ZIPF_THETA);
+	if (gen->blocks > 2)
+		gen->zipf_eta = (1.0 - pow(2.0 / gen->blocks, 1.0 - ZIPF_THETA)) / (1.0 - zeta2 / gen->zipf_zetan);
+}
+
+uint64_t next_random(io_offset_gen_t *gen)
+{
+	gen->rng ^= gen->rng >> 12;
+	gen->rng ^= gen->rng << 25;
+	gen->rng ^= gen->rng >> 27;
+	return gen->rng * 0x2545F4914F6CDD1DULL;
+}
+
+/*
+ * Returns the offset of the next I/O, always a multiple of the I/O size
+ * and entirely within the file.
+ */
+off_t next_io_offset(io_job_t *job, io_offset_gen_t *gen)
+{
+	int64_t block, hot;
+	double u, uz;
+
+	switch (job->io_mode) {
+		case IO_MODE_RANDOM:
+			block = next_random(gen) % gen->blocks;
+			break;
+		case IO_MODE_ZIPF:
+			u = (next_random(gen) >> 11) * (1.0 / 9007199254740992.0);
+			uz = u * gen->zipf_zetan;
+			if (uz < 1.0)
+				block = 0;
+			else if (uz < 1.0 + pow(0.5, ZIPF_THETA))
+				block = 1;
+			else
+				block = (int64_t)(gen->blocks * pow(gen->zipf_eta * u - gen->zipf_eta + 1.0, gen->zipf_alpha));
+			if (block >= gen->blocks)
+				block = gen->blocks - 1;
+			/* Scatter the popular blocks rather than packing them at the start */
+			block = (int64_t)(((uint64_t)block * 0x9E3779B97F4A7C15ULL) % (uint64_t)gen->blocks);
+			break;
+		case IO_MODE_HOTSPOT:
+			hot = (gen->blocks * HOTSPOT_SIZE_PERCENT) / 100;
+			if (hot < 1)
+				hot = 1;
+			if (hot == gen->blocks || (int)(next_random(gen) % 100) < HOTSPOT_IO_PERCENT)
+				block = next_random(gen) % hot;
+			else
+				block = hot + next_random(gen) % (gen->blocks - hot);
+			break;
+		default:
+			block = gen->next;
+			if (++gen->next >= gen->blocks)
+				gen->next = 0;
+			break;
+	}
+
+	return (off_t)block * job->io_size;
+}
+
+void record_io(io_thread_stats_t *stats, int io_size, int64_t elapsed)
+{
+	stats->io_count++;
+	stats->io_size += io_size;
+
+	if (elapsed > stats->max_io_time) {
+		stats->max_io_time = elapsed;
+	}
+
+	stats->io_time += elapsed;
+	stats->latency_histogram[find_io_bin(elapsed, LATENCY_BIN_SIZE, LATENCY_BINS)]++;
+	stats->low_latency_histogram[find_io_bin(elapsed, LOW_LATENCY_BIN_SIZE, LOW_LATENCY_BINS)]++;
+	stats->pct_histogram[find_pct_bin(elapsed)]++;
+}
+
 void *sync_routine(void *arg)
 {
 	while(1) {
@@ -345,16 +920,114 @@ void *sync_routine(void *arg)
 	pthread_exit(NULL);
 }
 
+int64_t time_usecs(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return ((int64_t)tv.tv_sec * 1000000) + tv.tv_usec;
+}
+
+/*
+ * Prints one record for the period since the last call, from the difference
+ * of the per-thread totals. The max is the top of the highest bin used.
+ */
+void print_interval_report(int64_t now)
+{
+	static int64_t prev_pct_histogram[PCT_BINS];
+	static int64_t prev_io_count, prev_io_size, prev_io_time, prev_time;
+	static int header_printed;
+	int64_t histogram[PCT_BINS];
+	int64_t io_count = 0, io_size_sum = 0, io_time = 0, max_latency = 0, value;
+	double secs;
+	int i, j;
+
+	memset(histogram, 0, sizeof(histogram));
+	for (i = 0; i < thread_count; i++) {
+		io_count += thread_stats[i].io_count;
+		io_size_sum += thread_stats[i].io_size;
+		io_time += thread_stats[i].io_time;
+		for (j = 0; j < PCT_BINS; j++)
+			histogram[j] += thread_stats[i].pct_histogram[j];
+	}
+	for (j = 0; j < PCT_BINS; j++) {
+		value = histogram[j];
+		histogram[j] -= prev_pct_histogram[j];
+		prev_pct_histogram[j] = value;
+		if (histogram[j] > 0)
+			max_latency = pct_bin_value(j);
+	}
+
+	if (prev_time == 0)
+		prev_time = test_start_us;
+	secs = (double)(now - prev_time) / 1000000.0;
+	prev_time = now;
+
+	value = io_count;
+	io_count -= prev_io_count;
+	prev_io_count = value;
+	value = io_size_sum;
+	io_size_sum -= prev_io_size;
+	prev_io_size = value;
+	value = io_time;
+	io_time -= prev_io_time;
+	prev_io_time = value;
+
+	if (report_format == REPORT_FORMAT_JSON) {
+		printf("{\"time_ms\":%lld,\"iops\":%.1lf,\"mbps\":%.3lf,\"avg_us\":%.2lf,\"p50_us\":%lld,\"p99_us\":%lld,\"p999_us\":%lld,\"max_us\":%lld}\n",
+		    (now - test_start_us) / 1000, io_count / secs, (io_size_sum / 1048576.0) / secs,
+		    io_count ? (double)io_time / io_count : 0.0,
+		    latency_percentile(histogram, io_count, max_latency, 50.0),
+		    latency_percentile(histogram, io_count, max_latency, 99.0),
+		    latency_percentile(histogram, io_count, max_latency, 99.9),
+		    max_latency);
+	} else {
+		if (!header_printed) {
+			printf("time_ms,iops,mbps,avg_us,p50_us,p99_us,p999_us,max_us\n");
+			header_printed = 1;
+		}
+		printf("%lld,%.1lf,%.3lf,%.2lf,%lld,%lld,%lld,%lld\n",
+		    (now - test_start_us) / 1000, io_count / secs, (io_size_sum / 1048576.0) / secs,
+		    io_count ? (double)io_time / io_count : 0.0,
+		    latency_percentile(histogram, io_count, max_latency, 50.0),
+		    latency_percentile(histogram, io_count, max_latency, 99.0),
+		    latency_percentile(histogram, io_count, max_latency, 99.9),
+		    max_latency);
+	}
+	fflush(stdout);
+}
+
 void *calculate_throughput(void *arg)
 {
 	int64_t prev_total_io_size = 0;
-	int64_t size;
+	int64_t size, io_size_sum;
+	int64_t now, next, next_throughput, next_report;
+	int i;
+
+	next_throughput = test_start_us + (THROUGHPUT_INTERVAL * 1000);
+	next_report = report_interval_ms ? test_start_us + ((int64_t)report_interval_ms * 1000) : INT64_MAX;
 
 	while(1) {
-		usleep(THROUGHPUT_INTERVAL * 1000);
-		size = total_io_size - prev_total_io_size;
+		next = (next_report < next_throughput) ? next_report : next_throughput;
+		now = time_usecs();
+		if (next > now)
+			usleep((useconds_t)(next - now));
+		now = time_usecs();
+
+		if (now >= next_report) {
+			print_interval_report(now);
+			next_report += (int64_t)report_interval_ms * 1000;
+		}
+
+		if (now < next_throughput)
+			continue;
+		next_throughput += THROUGHPUT_INTERVAL * 1000;
+
+		for (io_size_sum = 0, i = 0; i < thread_count; i++)
+			io_size_sum += thread_stats[i].io_size;
+		size = io_size_sum - prev_total_io_size;
 		throughput_histogram[throughput_index] = size;
-		prev_total_io_size = total_io_size;
+		prev_total_io_size = io_size_sum;
 		throughput_index++;
 	}
 	pthread_exit(NULL);
@@ -366,16 +1039,24 @@ void *io_routine(void *arg)
 	struct timeval end_tv;
 	int64_t elapsed;
 	int64_t burst_elapsed;
-	char *data;
+	io_buffers_t bufs;
 	char test_filename[MAX_FILENAME];
 	struct stat filestat;
-	int i, fd, io_thread_id;
+	io_offset_gen_t gen;
+	io_thread_stats_t *stats;
+	io_job_t *job;
+	int i, fd, io_thread_id, type;
+	off_t offset;
 
 	io_thread_id = (int)arg;
-	if (user_specified_file)
-		strlcpy(test_filename, user_fname, MAX_FILENAME);
-	else
-		snprintf(test_filename, MAX_FILENAME, "iosim-%d-%d", (int)getpid(), io_thread_id);
+	stats = &thread_stats[io_thread_id];
+	job = &jobs[thread_job[io_thread_id]];
+
+	/* Each job runs at its own tier, unless there is only the one */
+	if (job_count > 1)
+		setup_io_policy(IOPOL_SCOPE_THREAD, job->io_tier);
+
+	test_file_name(test_filename, io_thread_id);
 
 	if (0 > (fd = open(test_filename, O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH))) {
 		printf("Error opening file %s!\n", test_filename);
@@ -387,73 +1068,177 @@ void *io_routine(void *arg)
 		exit(1);
 	}
 
-	if (filestat.st_size < io_size) {
-		printf("%s: File size (%lld) smaller than I/O size (%d)!\n", test_filename, filestat.st_size, io_size);
+	if (filestat.st_size < job->io_size) {
+		printf("%s: File size (%lld) smaller than I/O size (%d)!\n", test_filename, filestat.st_size, job->io_size);
 		exit(1);
 	}
 
-	if (!cached_io_flag)
+	init_offset_gen(job, &gen, filestat.st_size, ((uint64_t)getpid() << 32) ^ ((uint64_t)(io_thread_id + 1) * 0x9E3779B97F4A7C15ULL) ^ (uint64_t)time(NULL));
+
+	if (!job->cached_io_flag)
 		fcntl(fd, F_NOCACHE, 1);
 
 	fcntl(fd, F_RDAHEAD, 0);
 
-	if(!(data = (char *)calloc(io_size, 1))) {
-		perror("Error allocating buffers for I/O!\n");
-		exit(1);
-	}
-	memset(data, '\0', io_size);
+	setup_io_buffers(job, &bufs, gen.rng ^ 0x5DEECE66DULL);
+
+	if (job->target_iops)
+		perform_paced_io(fd, &bufs, job, &gen, stats);
 
 	while(1) {
 		burst_elapsed = 0;
 
-		for(i = 0; i < burst_count; i++) {
-			if (io_mode == IO_MODE_RANDOM) {
-				if (lseek(fd, (rand() % (filestat.st_size - io_size)) & PG_MASK, SEEK_SET) < 0) {
-					perror("Error lseek()ing to random location in file!\n");
-					exit(1);
-				}
-			}
+		if (job->queue_depth > 1)
+			burst_elapsed = perform_async_burst(fd, &bufs, job, &gen, stats);
+
+		for(i = 0; job->queue_depth == 1 && i < job->burst_count; i++) {
+			type = choose_io_type(job);
+			offset = next_io_offset(job, &gen);
 
 			start_qos_timer();
 
 			gettimeofday(&start_tv, NULL);
-			perform_io(fd, data, io_size, workload_type);
+			perform_io(fd, io_buffer(job, &bufs, 0, type, offset), job->io_size, type, offset);
 			gettimeofday(&end_tv, NULL);
 
 			stop_qos_timer();
 
-			OSAtomicIncrement64(&total_io_count);
-			OSAtomicAdd64(io_size, &total_io_size);
-			elapsed = ((end_tv.tv_sec - start_tv.tv_sec) * 1000000)  + (end_tv.tv_usec - start_tv.tv_usec);
-
-			if (elapsed > max_io_time) {
-				max_io_time = elapsed;
-			}
+			if (verify_flag && type == WORKLOAD_TYPE_RO)
+				verify_io_buffer(job, &bufs, 0, offset, stats);
 
-			OSAtomicAdd64(elapsed, &total_io_time);
-			OSAtomicIncrement64(&(latency_histogram[find_io_bin(elapsed, LATENCY_BIN_SIZE, LATENCY_BINS)]));
-			OSAtomicIncrement64(&(low_latency_histogram[find_io_bin(elapsed, LOW_LATENCY_BIN_SIZE, LOW_LATENCY_BINS)]));
+			elapsed = ((end_tv.tv_sec - start_tv.tv_sec) * 1000000)  + (end_tv.tv_usec - start_tv.tv_usec);
+			record_io(stats, job->io_size, elapsed);
 			burst_elapsed += elapsed;
 
-			if (inter_io_delay_ms)
-				usleep(inter_io_delay_ms * 1000);
+			if (job->inter_io_delay_ms)
+				usleep(job->inter_io_delay_ms * 1000);
 		}
 
-		burst_elapsed /= burst_count;
-		OSAtomicIncrement64(&(burst_latency_histogram[find_io_bin(burst_elapsed, LATENCY_BIN_SIZE, LATENCY_BINS)]));
-		OSAtomicIncrement64(&total_burst_count);
+		burst_elapsed /= job->burst_count;
+		stats->burst_latency_histogram[find_io_bin(burst_elapsed, LATENCY_BIN_SIZE, LATENCY_BINS)]++;
+		stats->burst_count++;
 
-		if(inter_burst_duration == -1)
+		if(job->inter_burst_duration == -1)
 			usleep((rand() % 100) * 1000);
 		else
-			usleep(inter_burst_duration * 1000);
+			usleep(job->inter_burst_duration * 1000);
 	}
 
-	free(data);
+	free(bufs.read_buf);
+	free(bufs.write_buf);
+	free(bufs.sums);
 	close(fd);
 	pthread_exit(NULL);
 }
 
+void test_file_name(char *fname, int thread_id)
+{
+	if (user_specified_file)
+		strlcpy(fname, user_fname, MAX_FILENAME);
+	else if (reuse_files_flag)
+		snprintf(fname, MAX_FILENAME, "iosim-%dp-%d", file_size, thread_id);
+	else
+		snprintf(fname, MAX_FILENAME, "iosim-%d-%d", (int)getpid(), thread_id);
+}
+
+/*
+ * Creates a test file of random data: the space is allocated up front, then
+ * filled with large uncached writes of xorshift64* output, which is as
+ * incompressible as /dev/urandom and far cheaper.
+ */
+void create_test_file(char *fname, off_t size)
+{
+	fstore_t store;
+	uint64_t *chunk, rng;
+	off_t offset;
+	size_t len, i;
+	ssize_t ret;
+	int fd;
+
+	if (0 > (fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH))) {
+		printf("Error creating file %s!\n", fname);
+		exit(1);
+	}
+	fcntl(fd, F_NOCACHE, 1);
+
+	/* Prefer contiguous space, but take any */
+	store.fst_flags = F_ALLOCATECONTIG | F_ALLOCATEALL;
+	store.fst_posmode = F_PEOFPOSMODE;
+	store.fst_offset = 0;
+	store.fst_length = size;
+	store.fst_bytesalloc = 0;
+	if (fcntl(fd, F_PREALLOCATE, &store) < 0) {
+		store.fst_flags = F_ALLOCATEALL;
+		(void)fcntl(fd, F_PREALLOCATE, &store);
+	}
+
+	if (posix_memalign((void **)&chunk, 4096, FILL_CHUNK_SIZE)) {
+		perror("Error allocating buffers for file creation!\n");
+		exit(1);
+	}
+	rng = ((uint64_t)getpid() << 32) ^ (uint64_t)(uintptr_t)fname ^ (uint64_t)time(NULL);
+	rng |= 1;
+
+	for (offset = 0; offset < size; offset += len) {
+		len = (size - offset < FILL_CHUNK_SIZE) ? (size_t)(size - offset) : FILL_CHUNK_SIZE;
+		for (i = 0; i < FILL_CHUNK_SIZE / sizeof(uint64_t); i++) {
+			rng ^= rng >> 12;
+			rng ^= rng << 25;
+			rng ^= rng >> 27;
+			chunk[i] = rng * 0x2545F4914F6CDD1DULL;
+		}
+		if ((ret = pwrite(fd, chunk, len, offset)) != (ssize_t)len) {
+			perror("Error writing test file!\n");
+			exit(1);
+		}
+	}
+
+	free(chunk);
+	close(fd);
+}
+
+/* File creation threads take the next file to create until there are none */
+void *fill_routine(void *arg)
+{
+	char fname[MAX_FILENAME];
+	struct stat filestat;
+	off_t size = (off_t)file_size * 4096;
+	int i;
+
+	while ((i = __sync_fetch_and_add(&fill_next_file, 1)) < thread_count) {
+		test_file_name(fname, i);
+		if (reuse_files_flag && stat(fname, &filestat) == 0 && filestat.st_size == size) {
+			printf("Reusing file %s of size %lld...\n", fname, (int64_t)size);
+			continue;
+		}
+		printf("Creating file %s of size %lld...\n", fname, (int64_t)size);
+		create_test_file(fname, size);
+	}
+	pthread_exit(NULL);
+}
+
+/* Writes back and evicts a file's cached pages, so the test starts cold */
+void drop_file_cache(char *fname)
+{
+	struct stat filestat;
+	void *addr;
+	int fd;
+
+	if (0 > (fd = open(fname, O_RDWR)) || fstat(fd, &filestat) < 0) {
+		printf("Error opening file %s!\n", fname);
+		exit(1);
+	}
+	fsync(fd);
+	if (filestat.st_size > 0) {
+		addr = mmap(NULL, filestat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (addr != MAP_FAILED) {
+			msync(addr, filestat.st_size, MS_INVALIDATE);
+			munmap(addr, filestat.st_size);
+		}
+	}
+	close(fd);
+}
+
 void validate_option(int value, int min, int max, char *option, char *units)
 {
 	if (value < min || value > max) {
@@ -470,43 +1255,151 @@ void print_test_setup(int value, char *option, char *units, char *comment)
 		printf("%32s: %16d %-16s (%s)\n", option, value, units, comment);
 }
 
-void setup_process_io_policy(int io_tier)
+void setup_io_policy(int scope, int io_tier)
 {
 	switch(io_tier)
 	{
 		case 0:
-			if (setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_PROCESS, IOPOL_IMPORTANT))
+			if (setiopolicy_np(IOPOL_TYPE_DISK, scope, IOPOL_IMPORTANT))
 				goto iopol_error;
 			break;
 		case 1:
-			if (setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_PROCESS, IOPOL_STANDARD))
+			if (setiopolicy_np(IOPOL_TYPE_DISK, scope, IOPOL_STANDARD))
                                 goto iopol_error;
                         break;
 		case 2:
-			if (setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_PROCESS, IOPOL_UTILITY))
+			if (setiopolicy_np(IOPOL_TYPE_DISK, scope, IOPOL_UTILITY))
                                 goto iopol_error;
                         break;
 		case 3:
-			if (setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_PROCESS, IOPOL_THROTTLE))
+			if (setiopolicy_np(IOPOL_TYPE_DISK, scope, IOPOL_THROTTLE))
                                 goto iopol_error;
                         break;
 	}
 	return;
 
 iopol_error:
-	printf("Error setting process-wide I/O policy to %d\n", io_tier);
+	printf("Error setting %s I/O policy to %d\n", (scope == IOPOL_SCOPE_PROCESS) ? "process-wide" : "thread", io_tier);
         exit(1);
 }
 
+/*
+ * Job files hold one section per group of threads:
+ *
+ *	[name]
+ *	key = value
+ *
+ * where the keys are those of job_keys below. Each group starts from the
+ * command line options, and '#' starts a comment.
+ */
+static const struct {
+	const char	*key;
+	size_t		offset;
+	int		min;
+	int		max;
+	char		*units;
+} job_keys[] = {
+	{ "threads",	offsetof(io_job_t, thread_count),		1,	MAX_THREADS,		"Threads" },
+	{ "type",	offsetof(io_job_t, workload_type),		0,	2,			"" },
+	{ "pattern",	offsetof(io_job_t, io_mode),			0,	3,			"" },
+	{ "size",	offsetof(io_job_t, io_size),			1,	INT_MAX,		"Bytes" },
+	{ "tier",	offsetof(io_job_t, io_tier),			0,	3,			"" },
+	{ "cached",	offsetof(io_job_t, cached_io_flag),		0,	1,			"" },
+	{ "burst",	offsetof(io_job_t, burst_count),		1,	INT_MAX,		"I/Os" },
+	{ "interval",	offsetof(io_job_t, inter_burst_duration),	-1,	INT_MAX,		"msecs" },
+	{ "delay",	offsetof(io_job_t, inter_io_delay_ms),		0,	INT_MAX,		"msecs" },
+	{ "depth",	offsetof(io_job_t, queue_depth),		1,	MAX_QUEUE_DEPTH,	"I/Os" },
+	{ "rate",	offsetof(io_job_t, target_iops),		0,	INT_MAX,		"IOPS" },
+};
+
+void parse_job_file(char *fname)
+{
+	char line[MAX_CMD_SIZE];
+	char *key, *value, *end;
+	io_job_t defaults = jobs[0];
+	io_job_t *job = NULL;
+	FILE *fp;
+	int lineno = 0, total_threads = 0;
+	unsigned int i;
+
+	if ((fp = fopen(fname, "r")) == NULL) {
+		printf("Error opening job file %s!\n", fname);
+		exit(1);
+	}
+
+	job_count = 0;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		key = line + strspn(line, " \t");
+		key[strcspn(key, "#\r\n")] = '\0';
+		for (end = key + strlen(key); end > key && isspace(end[-1]); end--)
+			end[-1] = '\0';
+		if (*key == '\0')
+			continue;
+
+		if (*key == '[') {
+			if ((end = strchr(key, ']')) == NULL || end == key + 1)
+				goto syntax_error;
+			if (job_count == MAX_JOBS) {
+				printf("%s: more than %d jobs!\n", fname, MAX_JOBS);
+				exit(1);
+			}
+			*end = '\0';
+			job = &jobs[job_count++];
+			*job = defaults;
+			strlcpy(job->name, key + 1, sizeof(job->name));
+			continue;
+		}
+
+		if (job == NULL || (value = strchr(key, '=')) == NULL)
+			goto syntax_error;
+		for (end = value; end > key && isspace(end[-1]); end--)
+			;
+		*end = '\0';
+		value += 1 + strspn(value + 1, " \t");
+
+		for (i = 0; i < sizeof(job_keys) / sizeof(job_keys[0]); i++) {
+			if (strcmp(key, job_keys[i].key) == 0)
+				break;
+		}
+		if (i == sizeof(job_keys) / sizeof(job_keys[0])) {
+			printf("%s:%d: unknown key %s\n", fname, lineno, key);
+			exit(1);
+		}
+		validate_option(atoi(value), job_keys[i].min, job_keys[i].max, (char *)job_keys[i].key, job_keys[i].units);
+		*(int *)((char *)job + job_keys[i].offset) = atoi(value);
+	}
+	fclose(fp);
+
+	if (job_count == 0) {
+		printf("%s: no jobs!\n", fname);
+		exit(1);
+	}
+
+	for (i = 0; i < (unsigned int)job_count; i++) {
+		jobs[i].first_thread = total_threads;
+		total_threads += jobs[i].thread_count;
+	}
+	if (total_threads > MAX_THREADS) {
+		printf("%s: %d threads, more than %d!\n", fname, total_threads, MAX_THREADS);
+		exit(1);
+	}
+	return;
+
+syntax_error:
+	printf("%s:%d: syntax error\n", fname, lineno);
+	exit(1);
+}
+
 int main(int argc, char *argv[])
 {
-	int i, option = 0;
+	int i, j, option = 0;
 	pthread_t thread_list[MAX_THREADS];
 	pthread_t sync_thread;
 	pthread_t throughput_thread;
 	char fname[MAX_FILENAME];
 
-	while((option = getopt(argc, argv,"hc:i:d:t:f:m:j:s:x:l:z:n:a:q:")) != -1) {
+	while((option = getopt(argc, argv,"hc:i:d:t:f:m:j:s:x:l:z:n:a:q:o:r:e:g:p:u:b:v:")) != -1) {
 		switch(option) {
 			case 'c':
 				burst_count = atoi(optarg);
@@ -530,7 +1423,7 @@ int main(int argc, char *argv[])
 				break;
 			case 'm':
 				io_mode = atoi(optarg);
-				validate_option(io_mode, 0, 1, "I/O Mode", "");
+				validate_option(io_mode, 0, 3, "I/O Mode", "");
 				break;
 			case 'j':
 				io_size = atoi(optarg);
@@ -567,6 +1460,37 @@ int main(int argc, char *argv[])
 				io_qos_timeout_ms = atoi(optarg);
 				validate_option(io_qos_timeout_ms, 0, INT_MAX, "I/O QoS timeout", "msecs");
 				break;
+			case 'o':
+				queue_depth = atoi(optarg);
+				validate_option(queue_depth, 1, MAX_QUEUE_DEPTH, "Outstanding I/Os", "I/Os");
+				break;
+			case 'r':
+				report_interval_ms = atoi(optarg);
+				validate_option(report_interval_ms, 0, INT_MAX, "Interval report period", "msecs");
+				break;
+			case 'e':
+				report_format = atoi(optarg);
+				validate_option(report_format, 0, 1, "Interval report format", "");
+				break;
+			case 'g':
+				job_fname = optarg;
+				break;
+			case 'b':
+				compressibility = atoi(optarg);
+				validate_option(compressibility, 0, 100, "Compressibility", "percent");
+				break;
+			case 'v':
+				verify_flag = atoi(optarg);
+				validate_option(verify_flag, 0, 1, "Data verification", "");
+				break;
+			case 'u':
+				reuse_files_flag = atoi(optarg);
+				validate_option(reuse_files_flag, 0, 1, "Reuse test files", "");
+				break;
+			case 'p':
+				target_iops = atoi(optarg);
+				validate_option(target_iops, 0, INT_MAX, "Target IOPS", "IOPS");
+				break;
 			default:
 				printf("Unknown option %c\n", option);
 				print_usage();
@@ -574,6 +1498,38 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	/* The command line describes the only job, or the defaults for a job file */
+	strlcpy(jobs[0].name, "default", sizeof(jobs[0].name));
+	jobs[0].thread_count = thread_count;
+	jobs[0].workload_type = workload_type;
+	jobs[0].io_mode = io_mode;
+	jobs[0].io_size = io_size;
+	jobs[0].io_tier = io_tier;
+	jobs[0].cached_io_flag = cached_io_flag;
+	jobs[0].burst_count = burst_count;
+	jobs[0].inter_burst_duration = inter_burst_duration;
+	jobs[0].inter_io_delay_ms = inter_io_delay_ms;
+	jobs[0].queue_depth = queue_depth;
+	jobs[0].target_iops = target_iops;
+	jobs[0].first_thread = 0;
+	job_count = 1;
+
+	if (job_fname)
+		parse_job_file(job_fname);
+
+	for (thread_count = 0, i = 0; i < job_count; i++) {
+		for (j = 0; j < jobs[i].thread_count; j++)
+			thread_job[thread_count++] = i;
+		if (verify_flag && (jobs[i].io_size % VERIFY_SECTOR_SIZE) != 0) {
+			printf("Data verification needs an I/O size that is a multiple of %d bytes.\n", VERIFY_SECTOR_SIZE);
+			exit(1);
+		}
+		if ((jobs[i].queue_depth > 1 || jobs[i].target_iops) && io_qos_timeout_ms > 0) {
+			printf("I/O QoS timeout cannot be used with more than one outstanding I/O or a target IOPS.\n");
+			exit(1);
+		}
+	}
+
 	printf("***********************TEST SETUP*************************\n");
 
 	print_test_setup(burst_count, "Burst Count", "I/Os", 0);
@@ -581,39 +1537,78 @@ int main(int argc, char *argv[])
 	print_test_setup(inter_io_delay_ms, "Inter I/O Delay", "msecs", 0);
 	print_test_setup(thread_count, "Thread Count", "Threads", 0);
 	print_test_setup(workload_type, "Workload Type", "", "0:R 1:W 2:RW");
-	print_test_setup(io_mode, "I/O Mode", "", "0:Seq. 1:Rnd");
+	print_test_setup(io_mode, "I/O Mode", "", "0:Seq. 1:Rnd 2:Zipf 3:Hot");
 	print_test_setup(io_size, "I/O Size", "Bytes", 0);
 	print_test_setup(sync_frequency_ms, "Sync. Frequency", "msecs", "0 indicates no sync. thread");
 	print_test_setup(test_duration, "Test duration", "secs", "0 indicates tool waits for Ctrl+C");
 	print_test_setup(io_tier, "I/O Tier", "", 0);
 	print_test_setup(cached_io_flag, "I/O Caching", "", "0 indicates non-cached I/Os");
 	print_test_setup(io_qos_timeout_ms, "I/O QoS Threshold Timeout", "msecs", 0);
+	print_test_setup(queue_depth, "Outstanding I/Os", "I/Os", "1 indicates synchronous I/O");
+	print_test_setup(target_iops, "Target IOPS", "IOPS", "0 indicates closed-loop bursts");
+	print_test_setup(compressibility, "Data Compressibility", "percent", "100 indicates zeros");
+	print_test_setup(verify_flag, "Data Verification", "", "0 indicates no verification");
+	print_test_setup(report_interval_ms, "Interval report period", "msecs", "0 indicates no interval reports");
+	print_test_setup(report_format, "Interval report format", "", "0:CSV 1:JSON");
 	print_test_setup(0, "File read-aheads", "", "0 indicates read-aheads disabled");
 
+	for (i = 0; job_count > 1 && i < job_count; i++) {
+		printf("%32s: %s\n", "Job", jobs[i].name);
+		print_test_setup(jobs[i].thread_count, "Thread Count", "Threads", 0);
+		print_test_setup(jobs[i].workload_type, "Workload Type", "", "0:R 1:W 2:RW");
+		print_test_setup(jobs[i].io_mode, "I/O Mode", "", "0:Seq. 1:Rnd 2:Zipf 3:Hot");
+		print_test_setup(jobs[i].io_size, "I/O Size", "Bytes", 0);
+		print_test_setup(jobs[i].io_tier, "I/O Tier", "", 0);
+		print_test_setup(jobs[i].cached_io_flag, "I/O Caching", "", "0 indicates non-cached I/Os");
+		print_test_setup(jobs[i].burst_count, "Burst Count", "I/Os", 0);
+		print_test_setup(jobs[i].inter_burst_duration, "Inter Burst duration", "msecs", "-1 indicates random burst duration");
+		print_test_setup(jobs[i].inter_io_delay_ms, "Inter I/O Delay", "msecs", 0);
+		print_test_setup(jobs[i].queue_depth, "Outstanding I/Os", "I/Os", "1 indicates synchronous I/O");
+		print_test_setup(jobs[i].target_iops, "Target IOPS", "IOPS", "0 indicates closed-loop bursts");
+	}
+
 	printf("**********************************************************\n");
 
 	if (user_specified_file == 0) {
-		char dd_command[MAX_CMD_SIZE];
-		for (i=0; i < thread_count; i++) {
-			snprintf(fname, MAX_FILENAME, "iosim-%d-%d", (int)getpid(), i);
-			snprintf(dd_command, MAX_CMD_SIZE, "dd if=/dev/urandom of=%s bs=4096 count=%d", fname, file_size);
-			printf("Creating file %s of size %lld...\n", fname, ((int64_t)file_size * 4096));
-			system_cmd(dd_command);
+		pthread_t fill_threads[MAX_FILL_THREADS];
+		int fill_count = (thread_count < MAX_FILL_THREADS) ? thread_count : MAX_FILL_THREADS;
+
+		for (i = 0; i < fill_count; i++) {
+			if (pthread_create(&fill_threads[i], NULL, fill_routine, NULL) < 0) {
+				perror("Could not create file creation thread!\n");
+				exit(1);
+			}
+		}
+		for (i = 0; i < fill_count; i++)
+			pthread_join(fill_threads[i], NULL);
+
+		for (i = 0; i < thread_count; i++) {
+			test_file_name(fname, i);
+			drop_file_cache(fname);
 		}
 	} else {
 		printf("Using user specified file %s for all threads...\n", user_fname);
+		drop_file_cache(user_fname);
 	}
-	system_cmd("purge");
-	setup_process_io_policy(io_tier);
+	if (job_count == 1)
+		setup_io_policy(IOPOL_SCOPE_PROCESS, jobs[0].io_tier);
 
 	setup_qos_device();
 
 	printf("**********************************************************\n");
 	printf("Creating threads and generating workload...\n");
 
+	if (posix_memalign((void **)&thread_stats, CACHE_LINE_SIZE, (thread_count + 1) * sizeof(io_thread_stats_t))) {
+		perror("Could not allocate thread statistics!\n");
+		exit(1);
+	}
+	memset(thread_stats, 0, (thread_count + 1) * sizeof(io_thread_stats_t));
+
 	signal(SIGINT, signalHandler);
 	signal(SIGALRM, signalHandler);
 
+	test_start_us = time_usecs();
+
 	for(i=0; i < thread_count; i++) {
 		if (pthread_create(&thread_list[i], NULL, io_routine, i) < 0) {
 			perror("Could not create I/O thread!\n");
@@ -132,27 +132,110 @@
 #include <IOKit/IOBSD.h>
 #include <mach/mach_host.h>	/* host_statistics */
 #include <err.h>
+#include <libproc.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <time.h>
 #include <unistd.h>
+#include "proctab.h"
 
 #define MAXDRIVES	16	/* most drives we will record */
 #define MAXDRIVENAME	31	/* largest drive name we allow */
+#define DRIVEHASHSIZE	32	/* buckets in the registry entry ID hash */
+
+/* I/O counters from an IOBlockStorageDriver's statistics, times in ns */
+struct drivecounters {
+	u_int64_t		bytes_read;
+	u_int64_t		bytes_written;
+	u_int64_t		reads;
+	u_int64_t		writes;
+	u_int64_t		read_time;
+	u_int64_t		write_time;
+	u_int64_t		latent_read_time;
+	u_int64_t		latent_write_time;
+};
 
 struct drivestats {
 	io_registry_entry_t	driver;
+	u_int64_t		entry_id;	/* of the IOMedia */
+	int			hnext;		/* drivehash chain, -1 ends */
 	char			name[MAXDRIVENAME + 1];
 	u_int64_t		blocksize;
 	u_int64_t		total_bytes;
 	u_int64_t		total_transfers;
 	u_int64_t		total_time;
+	struct drivecounters	last;		/* -x */
+	long double		max_read_ms;
+	long double		max_write_ms;
 };
 
+/*
+ * Slots in drivestat[] never move while a device is recorded; hotplug
+ * notifications find them through drivehash[] by registry entry ID, and
+ * driveorder[] lists the slots in use in compare_drivestats() order.
+ */
 static struct drivestats drivestat[MAXDRIVES];
+static int drivehash[DRIVEHASHSIZE];
+static int driveorder[MAXDRIVES];
+static u_int32_t driveused;		/* bitmap of occupied slots */
+
+#define DRIVEHASH(id)	((int)(((id) ^ ((id) >> 16)) % DRIVEHASHSIZE))
+#define DRIVE(i)	(drivestat[driveorder[(i)]])
+
+/* CLOCK_MONOTONIC_RAW, in nanoseconds since boot */
+static u_int64_t	cur_time, last_time;
+
+#define MINWAIT		0.01	/* shortest -w interval, in seconds */
+
+/* -F output formats */
+#define FORMAT_TEXT	0
+#define FORMAT_JSON	1
+#define FORMAT_CSV	2
+
+/* per-interval device figures shared by -x and -F, in output order */
+enum {
+	DS_READS,		/* reads per second */
+	DS_WRITES,		/* writes per second */
+	DS_KB_READ,		/* KB read per second */
+	DS_KB_WRITTEN,		/* KB written per second */
+	DS_MS_READ,		/* milliseconds per read */
+	DS_MS_WRITE,		/* milliseconds per write */
+	DS_QLEN,		/* average I/Os in flight */
+	DS_NFIELDS
+};
+
+/*
+ * -P keeps the disk counters of every process it has seen in a table
+ * indexed by pid, so that each interval is one pass over the pid list
+ * with no allocation; the start time tells a reused pid from the old one.
+ */
+#define PROC_PID_MAX	99999	/* pids never exceed this */
+
+struct procio {
+	u_int64_t		start;		/* ri_proc_start_abstime */
+	u_int64_t		bytes_read;
+	u_int64_t		bytes_written;
+};
+
+struct proctop {
+	pid_t			pid;
+	u_int64_t		bytes;		/* read + written, to rank by */
+	u_int64_t		bytes_read;
+	u_int64_t		bytes_written;
+};
+
+static struct procio *procio;
+static struct proctab procpids;	/* kept from one interval to the next */
+static struct proctop *proctop;
+static int topprocs;
 
-static struct timeval	cur_time, last_time;
+static const char *ds_fieldnames[DS_NFIELDS] = {
+	"reads_per_sec", "writes_per_sec", "kb_read_per_sec",
+	"kb_written_per_sec", "ms_per_read", "ms_per_write", "qlen",
+};
 
 struct statinfo {
 	long		tk_nin;
@@ -167,7 +250,8 @@ static mach_port_t masterPort;
 
 static int num_devices;
 static int maxshowdevs;
-static int dflag = 0, Iflag = 0, Cflag = 0, Tflag = 0, oflag = 0, Uflag = 0, Kflag = 0;
+static int dflag = 0, Iflag = 0, Cflag = 0, Tflag = 0, oflag = 0, Uflag = 0, Kflag = 0, xflag = 0;
+static int format = FORMAT_TEXT;
 static volatile sig_atomic_t phdr_flag = 0;
 static IONotificationPortRef notifyPort;
 
@@ -176,6 +260,15 @@ static void usage(void);
 static void phdr(int signo);
 static void do_phdr(void);
 static void devstats(int perf_select, long double etime, int havelast);
+static void xdevstats(long double etime, int havelast);
+static void interval_devstats(struct drivestats *ds, long double etime,
+			      long double values[DS_NFIELDS]);
+static void do_csvhdr(void);
+static void recstats(long double etime);
+static void cpu_sample(double pct[CPU_STATE_MAX]);
+static void procstats(long double etime);
+static int read_drivecounters(io_registry_entry_t driver,
+			      struct drivecounters *dc);
 static void cpustats(void);
 static void loadstats(void);
 static int readvar(const char *name, void *ptr, size_t len);
@@ -187,9 +280,10 @@ static int record_one_device(char *name);
 static int record_device(io_registry_entry_t drive);
 
 static int compare_drivestats(const void* pa, const void* pb);
+static int lookup_drive(u_int64_t entry_id);
 
-static long double compute_etime(struct timeval cur_time,
-				 struct timeval prev_time);
+static long double compute_etime(u_int64_t cur_time, u_int64_t prev_time);
+static double parse_wait(const char *arg);
 
 static void
 usage(void)
@@ -200,8 +294,8 @@ usage(void)
 	 * This isn't mentioned in the man page, or the usage statement,
 	 * but it is supported.
 	 */
-	fprintf(stderr, "usage: iostat [-CUdIKoT?] [-c count] [-n devs]\n"
-		"\t      [-w wait] [drives]\n");
+	fprintf(stderr, "usage: iostat [-CUdIKoTx?] [-c count] [-F json | csv]\n"
+		"\t      [-n devs] [-P procs] [-w wait] [drives]\n");
 }
 
 int
@@ -209,7 +303,9 @@ main(int argc, char **argv)
 {
 	int c;
 	int hflag = 0, cflag = 0, wflag = 0, nflag = 0;
-	int count = 0, waittime = 0;
+	int count = 0;
+	double waittime = 0;
+	u_int64_t deadline, now;
 	int headercount;
 	int num_devices_specified;
 	int havelast = 0;
@@ -218,7 +314,7 @@ main(int argc, char **argv)
 
 	maxshowdevs = 3;
 
-	while ((c = getopt(argc, argv, "c:CdIKM:n:oTUw:?")) != -1) {
+	while ((c = getopt(argc, argv, "c:CdF:IKM:n:oP:TUw:x?")) != -1) {
 		switch(c) {
 			case 'c':
 				cflag++;
@@ -232,6 +328,14 @@ main(int argc, char **argv)
 			case 'd':
 				dflag++;
 				break;
+			case 'F':
+				if (strcmp(optarg, "json") == 0)
+					format = FORMAT_JSON;
+				else if (strcmp(optarg, "csv") == 0)
+					format = FORMAT_CSV;
+				else
+					errx(1, "unknown format '%s'", optarg);
+				break;
 			case 'I':
 				Iflag++;
 				break;
@@ -248,6 +352,12 @@ main(int argc, char **argv)
 			case 'o':
 				oflag++;
 				break;
+			case 'P':
+				topprocs = atoi(optarg);
+				if (topprocs < 1)
+					errx(1, "number of processes %d is < 1",
+					     topprocs);
+				break;
 			case 'T':
 				Tflag++;
 				break;
@@ -256,9 +366,10 @@ main(int argc, char **argv)
 				break;
 			case 'w':
 				wflag++;
-				waittime = atoi(optarg);
-				if (waittime < 1)
-					errx(1, "wait time is < 1");
+				waittime = parse_wait(optarg);
+				break;
+			case 'x':
+				xflag++;
 				break;
 			default:
 				usage();
@@ -270,6 +381,19 @@ main(int argc, char **argv)
 	argc -= optind;
 	argv += optind;
 
+	if (xflag > 0 && (oflag > 0 || Iflag > 0))
+		errx(1, "-x cannot be used with -o or -I");
+	if (format != FORMAT_TEXT && (xflag > 0 || oflag > 0 || Iflag > 0))
+		errx(1, "-F cannot be used with -x, -o or -I");
+	if (format != FORMAT_TEXT && topprocs > 0)
+		errx(1, "-F cannot be used with -P");
+	if (topprocs > 0) {
+		procio = calloc(PROC_PID_MAX + 1, sizeof(*procio));
+		proctop = calloc(topprocs, sizeof(*proctop));
+		if (procio == NULL || proctop == NULL)
+			err(1, "calloc");
+	}
+
 	/*
 	 * Get the Mach private port.
 	 */
@@ -280,6 +404,9 @@ main(int argc, char **argv)
 	 */
 	IOMasterPort(bootstrap_port, &masterPort);
 
+	/* empty drive hash chains */
+	memset(drivehash, 0xff, sizeof(drivehash));
+
 	notifyPort = IONotificationPortCreate(masterPort);
 	rls = IONotificationPortGetRunLoopSource(notifyPort);
 	CFRunLoopAddSource(CFRunLoopGetCurrent(), rls, kCFRunLoopDefaultMode);
@@ -337,16 +464,20 @@ main(int argc, char **argv)
 	if ((num_devices_specified == 0) && record_all_devices())
 		err(1, "can't find any devices to display");
 
+	/* one device per line, or a record of them all, so show them all */
+	if ((xflag > 0 || format != FORMAT_TEXT) && nflag == 0)
+		maxshowdevs = MAXDRIVES;
+
 	/*
 	 * Look for the traditional wait time and count arguments.
 	 */
 	if (*argv) {
-		waittime = atoi(*argv);
+		waittime = parse_wait(*argv);
 
 		/* Let the user know he goofed, but keep going anyway */
 		if (wflag != 0)
 			warnx("discarding previous wait interval, using"
-			      " %d instead", waittime);
+			      " %g instead", waittime);
 		wflag++;
 
 		if (*++argv) {
@@ -379,11 +510,11 @@ main(int argc, char **argv)
 	cur.tk_nin = 0;
 
 	/*
-	 * Set the busy time to the system boot time, so the stats are
-	 * calculated since system boot.
+	 * The clock starts at boot, so with the busy time at zero the
+	 * first stats are calculated since system boot.
 	 */
-	if (readvar("kern.boottime", &cur_time,	sizeof(cur_time)) != 0)
-		exit(1);
+	cur_time = 0;
+	deadline = clock_gettime_nsec_np(CLOCK_MONOTONIC_RAW);
 
 	/*
 	 * If the user stops the program (control-Z) and then resumes it,
@@ -405,14 +536,20 @@ main(int argc, char **argv)
 			}
 		 }
 
-		if (!--headercount || phdr_flag) {
+		/* CSV gets a header only when the set of columns changes */
+		if (format == FORMAT_CSV && (headercount > 0 || phdr_flag)) {
+			phdr_flag = 0;
+			headercount = 0;
+			do_csvhdr();
+		} else if (format == FORMAT_TEXT && xflag == 0 &&
+		    (!--headercount || phdr_flag)) {
 			phdr_flag = 0;
 			headercount = 20;
 			do_phdr();
 		}
 
 		last_time = cur_time;
-		gettimeofday(&cur_time, NULL);
+		cur_time = clock_gettime_nsec_np(CLOCK_MONOTONIC_RAW);
 
 		if (Tflag > 0) {
 			tmp = cur.tk_nin;
@@ -428,19 +565,43 @@ main(int argc, char **argv)
 		if (etime == 0.0)
 			etime = 1.0;
 
-		if (Tflag > 0)
-			printf("%4.0Lf%5.0Lf", cur.tk_nin / etime,
-				cur.tk_nout / etime);
+		if (format != FORMAT_TEXT) {
+			recstats(etime);
+		} else {
+			if (xflag > 0) {
+				xdevstats(etime, havelast);
+				if (Cflag > 0 || Uflag > 0)
+					printf("\n%s%s\n%s%s\n",
+					    Cflag > 0 ? "      cpu" : "",
+					    Uflag > 0 ? "    load average" : "",
+					    Cflag > 0 ? " us sy id" : "",
+					    Uflag > 0 ? "   1m   5m   15m" : "");
+			}
 
-		devstats(hflag, etime, havelast);
+			if (Tflag > 0)
+				printf("%4.0Lf%5.0Lf", cur.tk_nin / etime,
+					cur.tk_nout / etime);
 
-		if (Cflag > 0)
-			cpustats();
+			if (xflag == 0)
+				devstats(hflag, etime, havelast);
 
-		if (Uflag > 0)
-			loadstats();
+			if (Cflag > 0)
+				cpustats();
 
-		printf("\n");
+			if (Uflag > 0)
+				loadstats();
+
+			if (xflag == 0 || Cflag > 0 || Uflag > 0)
+				printf("\n");
+			if (topprocs > 0) {
+				procstats(etime);
+				/* the table breaks up the columns */
+				if (xflag == 0)
+					headercount = 1;
+			}
+			if (xflag > 0)
+				printf("\n");
+		}
 		fflush(stdout);
 
 		if (count >= 0 && --count <= 0)
@@ -448,9 +609,19 @@ main(int argc, char **argv)
 
 		/*
 		 * Instead of sleep(waittime), wait in
-		 * the RunLoop for IONotifications.
+		 * the RunLoop for IONotifications, until the next sample
+		 * is due.  Samples are kept on a fixed schedule, unless
+		 * we fall a whole interval behind.
 		 */
-		CFRunLoopRunInMode(kCFRunLoopDefaultMode, (CFTimeInterval)waittime, 1);
+		deadline += (u_int64_t)(waittime * NSEC_PER_SEC);
+		now = clock_gettime_nsec_np(CLOCK_MONOTONIC_RAW);
+		if (now > deadline + (u_int64_t)(waittime * NSEC_PER_SEC))
+			deadline = now;
+		while (now < deadline) {
+			CFRunLoopRunInMode(kCFRunLoopDefaultMode,
+			    (CFTimeInterval)(deadline - now) / NSEC_PER_SEC, 1);
+			now = clock_gettime_nsec_np(CLOCK_MONOTONIC_RAW);
+		}
 
 		havelast = 1;
 	}
@@ -475,9 +646,9 @@ do_phdr(void)
 
 	for (i = 0; i < num_devices && i < maxshowdevs; i++){
 		if (oflag > 0)
-			(void)printf("%12.6s ", drivestat[i].name);
+			(void)printf("%12.6s ", DRIVE(i).name);
 		else
-			printf("%19.6s ", drivestat[i].name);
+			printf("%19.6s ", DRIVE(i).name);
 	}
 
 	if (Cflag > 0)
@@ -514,108 +685,101 @@ do_phdr(void)
 		printf("\n");
 }
 
+static u_int64_t
+stat_value(CFDictionaryRef statistics, CFStringRef key)
+{
+	CFNumberRef number;
+	u_int64_t value = 0;
+
+	if ((number = (CFNumberRef)CFDictionaryGetValue(statistics, key)))
+		CFNumberGetValue(number, kCFNumberSInt64Type, &value);
+	return (value);
+}
+
+/*
+ * Fetch the statistics of a drive.  If the drive goes away, we may not
+ * get any statistics for it, and the counters are left at zero.
+ */
+static int
+read_drivecounters(io_registry_entry_t driver, struct drivecounters *dc)
+{
+	CFTypeRef statistics;
+
+	memset(dc, 0, sizeof(*dc));
+
+	/*
+	 * Only copy the statistics, rather than every property of the
+	 * driver, so that short intervals stay cheap.
+	 */
+	statistics = IORegistryEntryCreateCFProperty(driver,
+		CFSTR(kIOBlockStorageDriverStatisticsKey),
+		kCFAllocatorDefault,
+		kNilOptions);
+	if (statistics == NULL)
+		return (0);
+
+	if (CFGetTypeID(statistics) == CFDictionaryGetTypeID()) {
+		dc->bytes_read = stat_value(statistics,
+		    CFSTR(kIOBlockStorageDriverStatisticsBytesReadKey));
+		dc->bytes_written = stat_value(statistics,
+		    CFSTR(kIOBlockStorageDriverStatisticsBytesWrittenKey));
+		dc->reads = stat_value(statistics,
+		    CFSTR(kIOBlockStorageDriverStatisticsReadsKey));
+		dc->writes = stat_value(statistics,
+		    CFSTR(kIOBlockStorageDriverStatisticsWritesKey));
+		dc->read_time = stat_value(statistics,
+		    CFSTR(kIOBlockStorageDriverStatisticsTotalReadTimeKey));
+		dc->write_time = stat_value(statistics,
+		    CFSTR(kIOBlockStorageDriverStatisticsTotalWriteTimeKey));
+		dc->latent_read_time = stat_value(statistics,
+		    CFSTR(kIOBlockStorageDriverStatisticsLatentReadTimeKey));
+		dc->latent_write_time = stat_value(statistics,
+		    CFSTR(kIOBlockStorageDriverStatisticsLatentWriteTimeKey));
+	}
+	CFRelease(statistics);
+	return (0);
+}
+
 static void
 devstats(int perf_select, long double etime, int havelast)
 {
-	CFNumberRef number;
-	CFDictionaryRef properties;
-	CFDictionaryRef statistics;
+	struct drivecounters dc;
 	long double transfers_per_second;
 	long double kb_per_transfer, mb_per_second;
-	u_int64_t value;
 	u_int64_t total_bytes, total_transfers, total_blocks, total_time;
 	u_int64_t interval_bytes, interval_transfers, interval_blocks;
 	u_int64_t interval_time;
 	long double interval_mb;
 	long double blocks_per_second, ms_per_transaction;
-	kern_return_t status;
 	int i;
 
 	for (i = 0; i < num_devices && i < maxshowdevs; i++) {
 
-		/*
-		 * If the drive goes away, we may not get any properties
-		 * for it.  So take some defaults.
-		 */
-		total_bytes = 0;
-		total_transfers = 0;
-		total_time = 0;
-
-		/* get drive properties */
-		status = IORegistryEntryCreateCFProperties(drivestat[i].driver,
-			(CFMutableDictionaryRef *)&properties,
-			kCFAllocatorDefault,
-			kNilOptions);
-		if (status != KERN_SUCCESS)
+		if (read_drivecounters(DRIVE(i).driver, &dc) != 0)
 			continue;
 
-		/* get statistics from properties */
-		statistics = (CFDictionaryRef)CFDictionaryGetValue(properties,
-			CFSTR(kIOBlockStorageDriverStatisticsKey));
-		if (statistics) {
-
-			/*
-			 * Get I/O volume.
-			 */
-			if ((number = (CFNumberRef)CFDictionaryGetValue(statistics,
-				CFSTR(kIOBlockStorageDriverStatisticsBytesReadKey)))) {
-				CFNumberGetValue(number, kCFNumberSInt64Type, &value);
-				total_bytes += value;
-			}
-			if ((number = (CFNumberRef)CFDictionaryGetValue(statistics,
-				CFSTR(kIOBlockStorageDriverStatisticsBytesWrittenKey)))) {
-				CFNumberGetValue(number, kCFNumberSInt64Type, &value);
-				total_bytes += value;
-			}
-
-			/*
-			 * Get I/O counts.
-			 */
-			if ((number = (CFNumberRef)CFDictionaryGetValue(statistics,
-				CFSTR(kIOBlockStorageDriverStatisticsReadsKey)))) {
-				CFNumberGetValue(number, kCFNumberSInt64Type, &value);
-				total_transfers += value;
-			}
-			if ((number = (CFNumberRef)CFDictionaryGetValue(statistics,
-				CFSTR(kIOBlockStorageDriverStatisticsWritesKey)))) {
-				CFNumberGetValue(number, kCFNumberSInt64Type, &value);
-				total_transfers += value;
-			}
-
-			/*
-			 * Get I/O time.
-			 */
-			if ((number = (CFNumberRef)CFDictionaryGetValue(statistics,
-				CFSTR(kIOBlockStorageDriverStatisticsLatentReadTimeKey)))) {
-				CFNumberGetValue(number, kCFNumberSInt64Type, &value);
-				total_time += value;
-			}
-			if ((number = (CFNumberRef)CFDictionaryGetValue(statistics,
-				CFSTR(kIOBlockStorageDriverStatisticsLatentWriteTimeKey)))) {
-				CFNumberGetValue(number, kCFNumberSInt64Type, &value);
-				total_time += value;
-			}
-
-		}
-		CFRelease(properties);
+		/* I/O volume, counts and time */
+		total_bytes = dc.bytes_read + dc.bytes_written;
+		total_transfers = dc.reads + dc.writes;
+		total_time = dc.latent_read_time + dc.latent_write_time;
 
 		/*
 		 * Compute delta values and stats.
 		 */
-		interval_bytes = total_bytes - drivestat[i].total_bytes;
+		interval_bytes = total_bytes - DRIVE(i).total_bytes;
 		interval_transfers = total_transfers
-			- drivestat[i].total_transfers;
-		interval_time = total_time - drivestat[i].total_time;
+			- DRIVE(i).total_transfers;
+		interval_time = total_time - DRIVE(i).total_time;
 
 		/* update running totals, only once for -I */
-		if ((Iflag == 0) || (drivestat[i].total_bytes == 0)) {
-			drivestat[i].total_bytes = total_bytes;
-			drivestat[i].total_transfers = total_transfers;
-			drivestat[i].total_time = total_time;
+		if ((Iflag == 0) || (DRIVE(i).total_bytes == 0)) {
+			DRIVE(i).total_bytes = total_bytes;
+			DRIVE(i).total_transfers = total_transfers;
+			DRIVE(i).total_time = total_time;
 		}
 
-		interval_blocks = interval_bytes / drivestat[i].blocksize;
-		total_blocks = total_bytes / drivestat[i].blocksize;
+		interval_blocks = interval_bytes / DRIVE(i).blocksize;
+		total_blocks = total_bytes / DRIVE(i).blocksize;
 
 		blocks_per_second = interval_blocks / etime;
 		transfers_per_second = interval_transfers / etime;
@@ -631,7 +795,7 @@ devstats(int perf_select, long double etime, int havelast)
 			/ 1000 : 0;
 
 		if (Kflag)
-			total_blocks = total_blocks * drivestat[i].blocksize
+			total_blocks = total_blocks * DRIVE(i).blocksize
 				/ 1024;
 
 		if (oflag > 0) {
@@ -668,8 +832,173 @@ devstats(int perf_select, long double etime, int havelast)
 	}
 }
 
+/*
+ * Extended statistics, one line per device: the read and write rates,
+ * the average service time of each, the largest average seen over an
+ * interval, and the average number of I/Os in flight (the time spent in
+ * I/O divided by the elapsed time).
+ */
+static void
+xdevstats(long double etime, int havelast)
+{
+	long double v[DS_NFIELDS];
+	int i;
+
+	printf("%-8s %7s %7s %8s %8s %6s %6s %6s %6s %5s\n",
+	    "device", "r/s", "w/s", "KB/s r", "KB/s w",
+	    "ms/r", "ms/w", "max/r", "max/w", "qlen");
+
+	for (i = 0; i < num_devices && i < maxshowdevs; i++) {
+		interval_devstats(&DRIVE(i), etime, v);
+
+		/* the first interval is since boot, and not a sample */
+		if (havelast) {
+			if (v[DS_MS_READ] > DRIVE(i).max_read_ms)
+				DRIVE(i).max_read_ms = v[DS_MS_READ];
+			if (v[DS_MS_WRITE] > DRIVE(i).max_write_ms)
+				DRIVE(i).max_write_ms = v[DS_MS_WRITE];
+		}
+
+		printf("%-8.8s %7.1Lf %7.1Lf %8.1Lf %8.1Lf %6.2Lf %6.2Lf %6.2Lf %6.2Lf %5.2Lf\n",
+		    DRIVE(i).name,
+		    v[DS_READS], v[DS_WRITES],
+		    v[DS_KB_READ], v[DS_KB_WRITTEN],
+		    v[DS_MS_READ], v[DS_MS_WRITE],
+		    DRIVE(i).max_read_ms, DRIVE(i).max_write_ms,
+		    v[DS_QLEN]);
+	}
+}
+
+/*
+ * Compute a drive's figures for the interval since the last call, and
+ * remember its counters for the next one.
+ */
+static void
+interval_devstats(struct drivestats *ds, long double etime,
+		  long double values[DS_NFIELDS])
+{
+	struct drivecounters dc, *last = &ds->last;
+	long double reads, writes;
+
+	read_drivecounters(ds->driver, &dc);
+
+	reads = dc.reads - last->reads;
+	writes = dc.writes - last->writes;
+
+	values[DS_READS] = reads / etime;
+	values[DS_WRITES] = writes / etime;
+	values[DS_KB_READ] = (dc.bytes_read - last->bytes_read) / etime / 1024;
+	values[DS_KB_WRITTEN] =
+		(dc.bytes_written - last->bytes_written) / etime / 1024;
+
+	/* times are in nanoseconds, convert to milliseconds */
+	values[DS_MS_READ] = (reads > 0) ?
+		(dc.read_time - last->read_time) / reads / 1000000 : 0;
+	values[DS_MS_WRITE] = (writes > 0) ?
+		(dc.write_time - last->write_time) / writes / 1000000 : 0;
+	values[DS_QLEN] = ((long double)(dc.read_time - last->read_time) +
+		(dc.write_time - last->write_time)) / (etime * 1000000000);
+
+	*last = dc;
+}
+
+static void
+do_csvhdr(void)
+{
+	int i, f;
+
+	printf("time,interval");
+	for (i = 0; i < num_devices && i < maxshowdevs; i++)
+		for (f = 0; f < DS_NFIELDS; f++)
+			printf(",%s.%s", DRIVE(i).name, ds_fieldnames[f]);
+	if (Cflag > 0)
+		printf(",cpu.user,cpu.system,cpu.idle");
+	if (Uflag > 0)
+		printf(",load.1m,load.5m,load.15m");
+	printf("\n");
+}
+
+/*
+ * One -F record for the interval: the wall clock time of the sample,
+ * its length, then every device, the CPU and the load averages, all on
+ * one line so that a collector can consume it without any state.
+ */
+static void
+recstats(long double etime)
+{
+	struct timespec now;
+	long double v[DS_NFIELDS];
+	double cpu[CPU_STATE_MAX], loadavg[3];
+	int i, f;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	if (Cflag > 0)
+		cpu_sample(cpu);
+	if (Uflag > 0 && getloadavg(loadavg, 3) != 3)
+		errx(1, "couldn't fetch load average");
+
+	if (format == FORMAT_CSV) {
+		printf("%ld.%03ld,%.3Lf", (long)now.tv_sec,
+		    now.tv_nsec / 1000000, etime);
+		for (i = 0; i < num_devices && i < maxshowdevs; i++) {
+			interval_devstats(&DRIVE(i), etime, v);
+			for (f = 0; f < DS_NFIELDS; f++)
+				printf(",%.2Lf", v[f]);
+		}
+		if (Cflag > 0)
+			printf(",%.1f,%.1f,%.1f", cpu[CPU_STATE_USER],
+			    cpu[CPU_STATE_SYSTEM], cpu[CPU_STATE_IDLE]);
+		if (Uflag > 0)
+			printf(",%.2f,%.2f,%.2f",
+			    loadavg[0], loadavg[1], loadavg[2]);
+		printf("\n");
+		return;
+	}
+
+	printf("{\"time\":%ld.%03ld,\"interval\":%.3Lf,\"devices\":[",
+	    (long)now.tv_sec, now.tv_nsec / 1000000, etime);
+	for (i = 0; i < num_devices && i < maxshowdevs; i++) {
+		interval_devstats(&DRIVE(i), etime, v);
+		printf("%s{\"name\":\"%s\"", i ? "," : "", DRIVE(i).name);
+		for (f = 0; f < DS_NFIELDS; f++)
+			printf(",\"%s\":%.2Lf", ds_fieldnames[f], v[f]);
+		printf("}");
+	}
+	printf("]");
+	if (Cflag > 0)
+		printf(",\"cpu\":{\"user\":%.1f,\"system\":%.1f,\"idle\":%.1f}",
+		    cpu[CPU_STATE_USER], cpu[CPU_STATE_SYSTEM],
+		    cpu[CPU_STATE_IDLE]);
+	if (Uflag > 0)
+		printf(",\"load\":[%.2f,%.2f,%.2f]",
+		    loadavg[0], loadavg[1], loadavg[2]);
+	printf("}\n");
+}
+
 static void
 cpustats(void)
+{
+	double pct[CPU_STATE_MAX];
+
+	cpu_sample(pct);
+
+	/*
+	 * Print times.
+	 */
+#define PTIME(kind) { \
+	double cpu = rint(pct[kind]);\
+	 printf("%*.0f", (100 == cpu) ? 4 : 3, cpu); \
+}
+	PTIME(CPU_STATE_USER);
+	PTIME(CPU_STATE_SYSTEM);
+	PTIME(CPU_STATE_IDLE);
+}
+
+/*
+ * Fetch the CPU ticks since the last call, as percentages of the total.
+ */
+static void
+cpu_sample(double pct[CPU_STATE_MAX])
 {
 	mach_msg_type_number_t count;
 	kern_return_t status;
@@ -705,16 +1034,71 @@ cpustats(void)
 		+= cur.load.cpu_ticks[CPU_STATE_IDLE];
 	time += cur.load.cpu_ticks[CPU_STATE_IDLE];
 
-	/*
-	 * Print times.
-	 */
-#define PTIME(kind) { \
-	double cpu = rint(100. * cur.load.cpu_ticks[kind] / (time ? time : 1));\
-	 printf("%*.0f", (100 == cpu) ? 4 : 3, cpu); \
+	memset(pct, 0, sizeof(pct[0]) * CPU_STATE_MAX);
+	pct[CPU_STATE_USER] = 100. * cur.load.cpu_ticks[CPU_STATE_USER] / (time ? time : 1);
+	pct[CPU_STATE_SYSTEM] = 100. * cur.load.cpu_ticks[CPU_STATE_SYSTEM] / (time ? time : 1);
+	pct[CPU_STATE_IDLE] = 100. * cur.load.cpu_ticks[CPU_STATE_IDLE] / (time ? time : 1);
 }
-	PTIME(CPU_STATE_USER);
-	PTIME(CPU_STATE_SYSTEM);
-	PTIME(CPU_STATE_IDLE);
+
+/*
+ * Print the processes that did the most disk I/O in the interval.
+ */
+static void
+procstats(long double etime)
+{
+	struct rusage_info_v2 ri;
+	struct procio *pio;
+	u_int64_t bytes_read, bytes_written;
+	char name[2 * MAXCOMLEN + 1];
+	int ntop, i, j;
+
+	if (proctab_refresh(&procpids) < 0)
+		err(1, "proc_listpids");
+
+	for (ntop = 0, i = 0; i < procpids.count; i++) {
+		pid_t pid = procpids.pids[i];
+
+		if (pid < 0 || pid > PROC_PID_MAX ||
+		    proc_pid_rusage(pid, RUSAGE_INFO_V2, (rusage_info_t *)&ri) != 0)
+			continue;
+
+		pio = &procio[pid];
+		if (pio->start != ri.ri_proc_start_abstime) {
+			pio->start = ri.ri_proc_start_abstime;
+			pio->bytes_read = 0;
+			pio->bytes_written = 0;
+		}
+		bytes_read = ri.ri_diskio_bytesread - pio->bytes_read;
+		bytes_written = ri.ri_diskio_byteswritten - pio->bytes_written;
+		pio->bytes_read = ri.ri_diskio_bytesread;
+		pio->bytes_written = ri.ri_diskio_byteswritten;
+
+		if (bytes_read + bytes_written == 0)
+			continue;
+
+		/* insert into the top list, which is kept sorted */
+		if (ntop == topprocs &&
+		    bytes_read + bytes_written <= proctop[ntop - 1].bytes)
+			continue;
+		if (ntop < topprocs)
+			ntop++;
+		for (j = ntop - 1; j > 0 &&
+		    proctop[j - 1].bytes < bytes_read + bytes_written; j--)
+			proctop[j] = proctop[j - 1];
+		proctop[j].pid = pid;
+		proctop[j].bytes = bytes_read + bytes_written;
+		proctop[j].bytes_read = bytes_read;
+		proctop[j].bytes_written = bytes_written;
+	}
+
+	printf("%7s %-16s %9s %9s\n", "pid", "command", "KB/s r", "KB/s w");
+	for (i = 0; i < ntop; i++) {
+		if (proc_name(proctop[i].pid, name, sizeof(name)) <= 0)
+			strlcpy(name, "-", sizeof(name));
+		printf("%7d %-16.16s %9.1Lf %9.1Lf\n", proctop[i].pid, name,
+		    proctop[i].bytes_read / etime / 1024,
+		    proctop[i].bytes_written / etime / 1024);
+	}
 }
 
 static void
@@ -769,23 +1153,30 @@ readvar(const char *name, void *ptr, size_t len)
 }
 
 static long double
-compute_etime(struct timeval cur_time, struct timeval prev_time)
+compute_etime(u_int64_t cur_time, u_int64_t prev_time)
 {
-	struct timeval busy_time;
-	u_int64_t busy_usec;
 	long double etime;
 
-	timersub(&cur_time, &prev_time, &busy_time);
-
-	busy_usec = busy_time.tv_sec;
-	busy_usec *= 1000000;
-	busy_usec += busy_time.tv_usec;
-	etime = busy_usec;
-	etime /= 1000000;
+	etime = cur_time - prev_time;
+	etime /= NSEC_PER_SEC;
 
 	return(etime);
 }
 
+static double
+parse_wait(const char *arg)
+{
+	char *end;
+	double wait;
+
+	wait = strtod(arg, &end);
+	if (end == arg || *end != '\0')
+		errx(1, "invalid wait time '%s'", arg);
+	if (wait < MINWAIT)
+		errx(1, "wait time is < %g", MINWAIT);
+	return (wait);
+}
+
 /*
  * Record all "whole" IOMedia objects as being interesting.
  */
@@ -835,13 +1226,10 @@ record_drivelist(void* context, io_iterator_t drivelist)
 {
 	io_registry_entry_t drive;
 	while ((drive = IOIteratorNext(drivelist))) {
-		if (num_devices < MAXDRIVES) {
-			record_device(drive);
+		if (num_devices < MAXDRIVES && record_device(drive) == 0)
 			phdr_flag = 1;
-		}
 		IOObjectRelease(drive);
 	}
-	qsort(drivestat, num_devices, sizeof(struct drivestats), &compare_drivestats);
 }
 
 static void
@@ -849,37 +1237,31 @@ remove_drivelist(void* context, io_iterator_t drivelist)
 {
 	io_registry_entry_t drive;
 	while ((drive = IOIteratorNext(drivelist))) {
-		kern_return_t status;
-		char bsdname[MAXDRIVENAME];
-		CFDictionaryRef properties;
-		CFStringRef name;
-
-		/* get drive properties */
-		status = IORegistryEntryCreateCFProperties(drive,
-			(CFMutableDictionaryRef *)&properties,
-			kCFAllocatorDefault,
-			kNilOptions);
-		if (status != KERN_SUCCESS) continue;
-
-		/* get name from properties */
-		name = (CFStringRef)CFDictionaryGetValue(properties,
-			CFSTR(kIOBSDNameKey));
-
-		if (name && CFStringGetCString(name, bsdname, MAXDRIVENAME, kCFStringEncodingUTF8)) {
-			int i;
-			for (i = 0; i < num_devices; ++i) {
-				if (strcmp(bsdname,drivestat[i].name) == 0) {
-					if (i < MAXDRIVES-1) {
-						memmove(&drivestat[i], &drivestat[i+1], sizeof(struct drivestats)*(MAXDRIVES-i));
-					}
-					--num_devices;
-					phdr_flag = 1;
-					qsort(drivestat, num_devices, sizeof(struct drivestats), &compare_drivestats);
-					break;
-				}
-			}
+		u_int64_t entry_id;
+		int slot, *link, i;
+
+		if (IORegistryEntryGetRegistryEntryID(drive, &entry_id) != KERN_SUCCESS ||
+		    (slot = lookup_drive(entry_id)) < 0) {
+			IOObjectRelease(drive);
+			continue;
 		}
-		CFRelease(properties);
+
+		/* unlink from the hash chain */
+		for (link = &drivehash[DRIVEHASH(entry_id)]; *link != slot;
+		     link = &drivestat[*link].hnext)
+			;
+		*link = drivestat[slot].hnext;
+
+		/* drop from the display order; the rest stays sorted */
+		for (i = 0; driveorder[i] != slot; i++)
+			;
+		memmove(&driveorder[i], &driveorder[i+1],
+			sizeof(driveorder[0]) * (num_devices - i - 1));
+		--num_devices;
+
+		IOObjectRelease(drivestat[slot].driver);
+		driveused &= ~(1U << slot);
+		phdr_flag = 1;
 		IOObjectRelease(drive);
 	}
 }
@@ -932,10 +1314,21 @@ static int
 record_device(io_registry_entry_t drive)
 {
 	io_registry_entry_t parent;
-	CFDictionaryRef properties;
+	struct drivestats *ds;
 	CFStringRef name;
 	CFNumberRef number;
 	kern_return_t status;
+	u_int64_t entry_id;
+	int slot, lo, hi;
+
+	/* already recorded (added twice, or seen by both scan and notify) */
+	status = IORegistryEntryGetRegistryEntryID(drive, &entry_id);
+	if (status != KERN_SUCCESS)
+		errx(1, "device has no registry entry ID");
+	if (lookup_drive(entry_id) >= 0)
+		return(0);
+	if (num_devices >= MAXDRIVES)
+		return(1);
 
 	/* get drive's parent */
 	status = IORegistryEntryGetParentEntry(drive,
@@ -943,43 +1336,58 @@ record_device(io_registry_entry_t drive)
 	if (status != KERN_SUCCESS)
 		errx(1, "device has no parent");
 	if (IOObjectConformsTo(parent, "IOBlockStorageDriver")) {
-		drivestat[num_devices].driver = parent;
+		for (slot = 0; driveused & (1U << slot); slot++)
+			;
+		ds = &drivestat[slot];
+		memset(ds, 0, sizeof(*ds));
+		ds->driver = parent;
+		ds->entry_id = entry_id;
 
-		/* get drive properties */
-		status = IORegistryEntryCreateCFProperties(drive,
-			(CFMutableDictionaryRef *)&properties,
-			kCFAllocatorDefault,
-			kNilOptions);
-		if (status != KERN_SUCCESS)
-			errx(1, "device has no properties");
-
-		/* get name from properties */
-		name = (CFStringRef)CFDictionaryGetValue(properties,
-			CFSTR(kIOBSDNameKey));
-		if (name)
-			CFStringGetCString(name, drivestat[num_devices].name,
+		/*
+		 * Fetch just the two properties we need rather than
+		 * the whole property table.
+		 */
+		name = (CFStringRef)IORegistryEntryCreateCFProperty(drive,
+			CFSTR(kIOBSDNameKey), kCFAllocatorDefault, kNilOptions);
+		if (name) {
+			CFStringGetCString(name, ds->name,
 					   MAXDRIVENAME, kCFStringEncodingUTF8);
-		else {
+			CFRelease(name);
+		} else {
 			errx(1, "device does not have a BSD name");
 		}
 
-		/* get blocksize from properties */
-		number = (CFNumberRef)CFDictionaryGetValue(properties,
-			CFSTR(kIOMediaPreferredBlockSizeKey));
-		if (number)
+		number = (CFNumberRef)IORegistryEntryCreateCFProperty(drive,
+			CFSTR(kIOMediaPreferredBlockSizeKey), kCFAllocatorDefault,
+			kNilOptions);
+		if (number) {
 			CFNumberGetValue(number, kCFNumberSInt64Type,
-					 &drivestat[num_devices].blocksize);
-		else
+					 &ds->blocksize);
+			CFRelease(number);
+		} else
 			errx(1, "device does not have a preferred block size");
 
 		// radar:18700383
-		if (drivestat[num_devices].blocksize == 0) {
-			warnx("%s claims a blocksize of 0; defaulting to 512. Its statistics may be inaccurate.", drivestat[num_devices].name);
-			drivestat[num_devices].blocksize = 512;
+		if (ds->blocksize == 0) {
+			warnx("%s claims a blocksize of 0; defaulting to 512. Its statistics may be inaccurate.", ds->name);
+			ds->blocksize = 512;
+		}
+
+		/* hash it, and insert it into the display order */
+		ds->hnext = drivehash[DRIVEHASH(entry_id)];
+		drivehash[DRIVEHASH(entry_id)] = slot;
+		for (lo = 0, hi = num_devices; lo < hi; ) {
+			int mid = (lo + hi) / 2;
+			if (compare_drivestats(&drivestat[driveorder[mid]], ds) <= 0)
+				lo = mid + 1;
+			else
+				hi = mid;
 		}
+		memmove(&driveorder[lo + 1], &driveorder[lo],
+			sizeof(driveorder[0]) * (num_devices - lo));
+		driveorder[lo] = slot;
+		driveused |= 1U << slot;
 
-		/* clean up, return success */
-		CFRelease(properties);
 		num_devices++;
 		return(0);
 	}
@@ -989,6 +1397,22 @@ record_device(io_registry_entry_t drive)
 	return(1);
 }
 
+/*
+ * Return the drivestat[] slot recording the IOMedia with the given
+ * registry entry ID, or -1.
+ */
+static int
+lookup_drive(u_int64_t entry_id)
+{
+	int slot;
+
+	for (slot = drivehash[DRIVEHASH(entry_id)]; slot >= 0;
+	     slot = drivestat[slot].hnext)
+		if (drivestat[slot].entry_id == entry_id)
+			return(slot);
+	return(-1);
+}
+
 static int
 compare_drivestats(const void* pa, const void* pb)
 {
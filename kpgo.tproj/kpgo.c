@@ -27,6 +27,8 @@
 
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -34,24 +36,117 @@
 static void usage(char **argv)
 {
 	fprintf (stderr, "usage: %s [-H] [-m] [-w] [uuid] >datafile\n", argv[0]);
+	fprintf (stderr, "       %s [-H] [-m] [-w] [-R] -o dir uuid ...\n", argv[0]);
         fprintf (stderr, "    uuid : the UUID of a kext\n");
+        fprintf (stderr, "    -o   : write each kext's data to dir/uuid.profraw\n");
         fprintf (stderr, "    -H   : grab data for the HIB segment\n");
         fprintf (stderr, "    -w   : wait for the kext to be unloaded\n");
         fprintf (stderr, "    -m   : request metadata\n");
-        fprintf (stderr, "    -R   : reset all counters\n");
+        fprintf (stderr, "    -R   : reset all counters (with -o, once all are written)\n");
 	exit(1);
 }
 
+static int write_all(int fd, const unsigned char *buffer, ssize_t size)
+{
+        ssize_t r;
+
+        while (size > 0) {
+            errno = 0;
+            r = write(fd, buffer, size);
+            if (r > 0) {
+                buffer += r;
+                size -= r;
+            } else {
+                return -1;
+            }
+        }
+        return 0;
+}
+
+/*
+ * Fetch the data for each kext in turn into one reused buffer and write it to
+ * its own file in dir, then reset the counters if asked, so that the next run
+ * starts a fresh profile window.  Counts made between a kext's fetch and the
+ * reset are lost.
+ */
+static int collect(const char *dir, char **uuids, int count, int flags, int data_flags, int reset)
+{
+        unsigned char *buffer = NULL;
+        ssize_t bufsize = 0;
+        int status = 0;
+        int i;
+
+        for (i = 0; i < count; i++) {
+            char path[PATH_MAX];
+            uuid_t uuid;
+            uuid_string_t name;
+            ssize_t size, r;
+            int fd;
+
+            if (uuid_parse(uuids[i], uuid) != 0) {
+                fprintf (stderr, "%s: not a UUID\n", uuids[i]);
+                status = 1;
+                continue;
+            }
+            uuid_unparse(uuid, name);
+
+            size = grab_pgo_data(&uuid, flags, NULL, 0);
+            if (size < 0) {
+                fprintf (stderr, "grab_pgo_data: %s: %s\n", name, strerror(errno));
+                status = 1;
+                continue;
+            }
+            if (size > bufsize) {
+                free(buffer);
+                buffer = valloc(size);
+                if (!buffer) {
+                    perror("valloc");
+                    return 1;
+                }
+                bufsize = size;
+            }
+
+            r = grab_pgo_data(&uuid, flags | data_flags, buffer, size);
+            if (r < 0) {
+                fprintf (stderr, "grab_pgo_data: %s: %s\n", name, strerror(errno));
+                status = 1;
+                continue;
+            }
+
+            snprintf(path, sizeof(path), "%s/%s.profraw", dir, name);
+            fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0 || write_all(fd, buffer, size) != 0) {
+                perror(path);
+                status = 1;
+            }
+            if (fd >= 0 && close(fd) != 0) {
+                perror(path);
+                status = 1;
+            }
+        }
+        free(buffer);
+
+        if (reset && grab_pgo_data(NULL, PGO_RESET_ALL, NULL, 0) < 0) {
+            perror("grab_pgo_data");
+            return 1;
+        }
+        return status;
+}
+
 int main(int argc, char **argv)
 {
 	int flags = 0;
         int data_flags = 0;
         uuid_t *uuidp = NULL;
         uuid_t uuid;
+        const char *outdir = NULL;
         int c;
 
-        while ((c = getopt(argc, argv, "hHwmR")) != EOF) {
+        while ((c = getopt(argc, argv, "hHwmRo:")) != EOF) {
             switch(c) {
+            case 'o':
+                outdir = optarg;
+                break;
             case 'R':
                 flags |= PGO_RESET_ALL;
                 break;
@@ -72,6 +167,14 @@ int main(int argc, char **argv)
             }
         }
 
+        if (outdir) {
+            if (optind == argc) {
+                usage(argv);
+            }
+            return collect(outdir, &argv[optind], argc - optind,
+                flags & ~PGO_RESET_ALL, data_flags, (flags & PGO_RESET_ALL) != 0);
+        }
+
         if (optind < argc)
         {
             if (optind == argc - 1 &&
@@ -128,16 +231,9 @@ int main(int argc, char **argv)
             return 1;
         }
 
-        while (size > 0) {
-            errno = 0;
-            r = write(STDOUT_FILENO, buffer, size);
-            if (r > 0) {
-                buffer += r;
-                size -= r;
-            } else {
-                perror ("write");
-                return 1;
-            }
+        if (write_all(STDOUT_FILENO, buffer, size) != 0) {
+            perror ("write");
+            return 1;
         }
 
 	return 0;
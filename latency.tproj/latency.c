@@ -41,12 +41,17 @@
 #include <errno.h>
 #include <err.h>
 #include <inttypes.h>
+#include <uuid/uuid.h>
+#include <paths.h>
+#include <pthread.h>
 
 #include <sys/types.h>
 #include <sys/param.h>
 #include <sys/time.h>
 #include <sys/sysctl.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #ifndef KERNEL_PRIVATE
 #define KERNEL_PRIVATE
@@ -56,6 +61,8 @@
 #include <sys/kdebug.h>
 #endif /*KERNEL_PRIVATE*/
 
+#include "kdcore.h"
+
 #include <mach/mach_error.h>
 #include <mach/mach_types.h>
 #include <mach/message.h>
@@ -64,6 +71,10 @@
 #include <mach/mach_time.h>
 
 #include <libkern/OSTypes.h>
+#include <libkern/OSByteOrder.h>
+#include <mach-o/loader.h>
+#include <mach-o/nlist.h>
+#include <mach-o/fat.h>
 
 
 int      s_usec_10_bins[10];
@@ -99,6 +110,37 @@ struct i_latencies {
 struct	i_latencies *i_lat;
 boolean_t i_latency_per_cpu = FALSE;
 
+/*
+ * Every latency is also counted in nanoseconds in a log-linear histogram,
+ * LAT_SUB_BUCKETS to each power of two (to within about 6%) from 1ns to
+ * about a minute: one per CPU for interrupts, and one per priority for
+ * the scheduler.  The percentiles on the screen and in the -H snapshots
+ * come from these.
+ */
+#define LAT_SUB_BUCKETS		16
+#define LAT_MAX_POWER		36
+#define LAT_HIST_BUCKETS	(LAT_SUB_BUCKETS * (LAT_MAX_POWER - 3))
+#define LAT_PRIORITIES		128
+
+struct lat_hist {
+	uint64_t	n;
+	uint64_t	max_ns;
+	uint32_t	counts[LAT_HIST_BUCKETS];
+};
+
+struct lat_hist *i_hist;			/* [num_cpus] */
+struct lat_hist  s_hist[LAT_PRIORITIES];
+
+FILE    *hist_fp = NULL;			/* -H */
+
+/*
+ * -j: no curses; a line of JSON with the latency statistics goes to
+ * stdout every json_interval seconds (once at the end with -R), for
+ * run_secs seconds if -t was given.
+ */
+int	json_interval = 0;
+int	run_secs = 0;
+
 int      i_high_res_bins[N_HIGH_RES_BINS];
 
 long     i_thresh_hold;
@@ -121,27 +163,68 @@ typedef struct {
 
 kern_sym_t *kern_sym_tbl;	/* pointer to the nm table       */
 int        kern_sym_count;	/* number of entries in nm table */
+char      *kern_sym_names;	/* the symbol strings, each NUL terminated */
+
+/*
+ * The kernel's __TEXT,__text symbols are read from its LC_SYMTAB and
+ * sorted, and then kept in a cache file keyed by its LC_UUID so that the
+ * next run can skip straight to using them:
+ *
+ *	struct ksym_cache_header
+ *	struct ksym_cache_entry [count], by address
+ *	names [names_size]
+ */
+#define KSYM_CACHE_MAGIC	0x4d59534b	/* "KSYM" */
+#define KSYM_CACHE_VERSION	1
+#define KSYM_CACHE_NAME		"com.apple.latency.ksyms.cache"
+
+struct ksym_cache_header {
+	uint32_t	magic;
+	uint32_t	version;
+	uuid_t		uuid;
+	uint32_t	count;
+	uint32_t	names_size;
+};
+
+struct ksym_cache_entry {
+	uint64_t	addr;
+	uint32_t	name;		/* offset into the names */
+	uint32_t	len;
+};
 
 
 
-#define MAX_ENTRIES 4096
-struct ct {
-	int type;
-	char name[32];
-} codes_tab[MAX_ENTRIES];
+/*
+ * The codes, compiled and cached by kdcore.h in the same cache file trace
+ * uses, so each can use the other's when it was compiled from just the
+ * one code file.
+ */
+struct kdc_codes codes;
 
 char *code_file = NULL;
-int	num_of_codes = 0;
+
+/*
+ * The symbol each recently seen kernel PC fell in, so that the interrupt
+ * handlers that keep turning up don't have to be searched for again.
+ */
+#define PC_CACHE_BITS	10
+#define PC_CACHE_SIZE	(1 << PC_CACHE_BITS)
+
+struct pc_cache_entry {
+	uint64_t	pc;
+	int		sym;		/* index into kern_sym_tbl, or -1 */
+} pc_cache[PC_CACHE_SIZE];
 
 
 double divisor;
 sig_atomic_t gotSIGWINCH = 0;
+sig_atomic_t gotExitSignal = 0;	/* the SIGINT, SIGQUIT, SIGTERM or SIGHUP to leave on */
 int	trace_enabled = 0;
 int	need_new_map = 1;
 int	set_remove_flag = 1;	/* By default, remove trace buffer */
 
 int	RAW_flag = 0;
-int	RAW_fd	 = 0;
+struct kdc_raw RAW_input = { -1, NULL, 0, 0 };
 
 uint64_t first_now = 0;
 uint64_t last_now = 0;
@@ -149,7 +232,9 @@ int	first_read = 1;
 
 
 #define	SAMPLE_TIME_USECS 50000
-#define SAMPLE_SIZE 300000
+#define	SAMPLE_MIN_USECS  5000
+#define SAMPLE_SIZE 300000	/* initial events per cpu */
+#define SAMPLE_MAX_SIZE (16 * 1024 * 1024)
 #define MAX_LOG_COUNT  30       /* limits the number of entries dumped in log_decrementer */
 
 kbufinfo_t bufinfo = {0, 0, 0};
@@ -162,6 +247,11 @@ uint32_t sample_TOD_usecs;
 uint64_t cpu_mask;
 
 int	sample_generation = 0;
+int	sample_usecs = SAMPLE_TIME_USECS;	/* shortened when the buffer wraps */
+int	sample_wraps = 0;
+uint64_t sample_dropped = 0;		/* estimated from the event rate */
+double	sample_rate = 0.0;		/* events per usec */
+uint64_t sample_last_abs = 0;
 int	num_i_latency_cpus = 1;
 int	num_cpus;
 void *my_buffer;
@@ -172,17 +262,6 @@ kd_buf **last_decrementer_kd;   /* last DECR_TRAP per cpu */
 
 #define NUMPARMS 23
 
-typedef struct event *event_t;
-
-struct event {
-	event_t	  ev_next;
-
-	uint64_t ev_thread;
-	uint32_t  ev_type;
-	uint64_t  ev_timestamp;
-};
-
-
 typedef struct lookup *lookup_t;
 
 struct lookup {
@@ -198,7 +277,7 @@ struct lookup {
 typedef struct threadmap *threadmap_t;
 
 struct threadmap {
-	threadmap_t	tm_next;
+	threadmap_t	tm_next;	/* on the free and temporary lists */
 
 	uint64_t	tm_thread;
 	uint64_t	tm_pthread;
@@ -230,36 +309,126 @@ struct thread_entry {
 #define HASH_SIZE       1024
 #define HASH_MASK       1023
 
-event_t         event_hash[HASH_SIZE];
-lookup_t        lookup_hash[HASH_SIZE];
-threadmap_t     threadmap_hash[HASH_SIZE];
-threadrun_t	threadrun_hash[HASH_SIZE];
+/*
+ * With -a, the time every thread spends runnable before it gets on a
+ * core is added up, whatever its priority, and the threads and the
+ * processes (by command name) that waited the longest are shown.
+ */
+typedef struct threadwait *threadwait_t;
+
+struct threadwait {
+	uint64_t	tw_thread;
+	char		tw_command[MAXCOMLEN + 1];
+	uint64_t	tw_switches;	/* times switched onto a core */
+	uint64_t	tw_waits;	/* ...of them after being made runnable */
+	uint64_t	tw_total;	/* mach time */
+	uint64_t	tw_max;
+};
+
+struct kdc_threads threadwait_table = KDC_THREADS_INITIALIZER(struct threadwait *);
+int		threadwait_count = 0;
+boolean_t	wait_accounting = FALSE;
+
+/*
+ * The run, start and lookup events only live until the end of the sample
+ * (or log) they were seen in, so they are carved out of pools of fixed
+ * size blocks, and are all reclaimed at once by resetting the pool.
+ * Resetting bumps the pool's generation, and a hash bucket stamped with
+ * an older generation is taken to be empty, so the buckets don't need to
+ * be walked either.  Each pool holds at most POOL_MAX_ENTRIES; events
+ * beyond that are dropped, and counted.
+ */
+#define POOL_BLOCK_ENTRIES	1024
+#define POOL_MAX_ENTRIES	(256 * 1024)
+
+struct pool {
+	const char	*p_name;
+	size_t		p_entry_size;	/* entries start with their next pointer */
+	char		**p_blocks;
+	int		p_nblocks;
+	int		p_used;		/* entries carved out of the blocks */
+	void		*p_free;	/* entries put back since the last reset */
+	int		p_in_use;
+	int		p_peak;
+	uint32_t	p_generation;
+	uint64_t	p_dropped;
+};
+
+#define POOL_INITIALIZER(name, type) { name, sizeof(type), NULL, 0, 0, NULL, 0, 0, 1, 0 }
+
+struct event_table {
+	struct pool	et_pool;
+	uint32_t	et_gen[HASH_SIZE];
+	void		*et_hash[HASH_SIZE];
+};
+
+struct event_table run_table = { POOL_INITIALIZER("run", struct threadrun) };
+struct event_table start_table = { POOL_INITIALIZER("start", struct kdc_start) };
+struct event_table lookup_table = { POOL_INITIALIZER("lookup", struct lookup) };
+
+struct pool	thread_entry_pool = POOL_INITIALIZER("entries", struct thread_entry);
+
+uint64_t	gc_count = 0;
+uint64_t	gc_time = 0;		/* mach time */
+
+struct kdc_threads threadmap_table = KDC_THREADS_INITIALIZER(threadmap_t);
 
-event_t         event_freelist;
-lookup_t        lookup_freelist;
-threadrun_t	threadrun_freelist;
 threadmap_t     threadmap_freelist;
 threadmap_t     threadmap_temp;
 
-thread_entry_t	thread_entry_freelist;
 thread_entry_t	thread_delete_list;
 thread_entry_t	thread_reset_list;
-thread_entry_t	thread_event_list;
-thread_entry_t	thread_lookup_list;
-thread_entry_t	thread_run_list;
 
 
-#ifndef	RAW_VERSION1
-typedef struct {
-	int version_no;
-	int thread_count;
-	uint64_t TOD_secs;
-	uint32_t TOD_usecs;
-} RAW_header;
-
-#define RAW_VERSION0    0x55aa0000
-#define RAW_VERSION1    0x55aa0101
-#endif
+/*
+ * -o: when a threshold is exceeded, the events from capture_window before
+ * the one that exceeded it to capture_window after go into a raw file,
+ * compressed like trace -L -z does (but without the chunk index; see
+ * trace.c), that trace -R (or latency -R) can read.  The sampler only
+ * copies the events into capture blocks; a separate thread compresses and
+ * writes them, and if it falls more than CAPTURE_MAX_QUEUED blocks behind,
+ * blocks are dropped.
+ */
+#define CAPTURE_BLOCK_EVENTS	(16 * 1024)
+#define CAPTURE_MAX_QUEUED	32
+#define CAPTURE_DEFAULT_MSECS	10
+
+struct capture_block {
+	struct capture_block *cb_next;
+	size_t		cb_len;		/* bytes of cb_data */
+	uint64_t	cb_first_timestamp;
+	uint8_t		cb_data[CAPTURE_BLOCK_EVENTS * sizeof(kd_buf)];
+};
+
+struct {
+	int		fd;
+	const char	*path;
+	int		window_msecs;
+	uint64_t	window;		/* mach time */
+	uint64_t	until;		/* the post-trigger window runs up to here */
+	kd_buf		*next;		/* first event of this sample not yet looked at */
+	struct capture_block *block;	/* being filled */
+	boolean_t	started;	/* header queued */
+	kd_threadmap	*map;		/* from the last read_command_map() */
+	int		map_threads;
+	uint64_t	triggers;
+	uint64_t	events;
+	uint64_t	dropped;
+
+	pthread_t	writer;
+	pthread_mutex_t	lock;
+	pthread_cond_t	cv;
+	struct capture_block *head, *tail;
+	int		queued;
+	boolean_t	done;
+	int		error;		/* errno of a failed write */
+	struct rawz_writer rawz;
+} capture = {
+	.fd = -1,
+	.window_msecs = CAPTURE_DEFAULT_MSECS,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cv = PTHREAD_COND_INITIALIZER,
+};
 
 
 #define	USER_MODE	0
@@ -331,20 +500,61 @@ static void enter_syscall(FILE *fp, kd_buf *kd, uint64_t thread, int type, char
 static void exit_syscall(FILE *fp, kd_buf *kd, uint64_t thread, int type, char *command, uint64_t now, uint64_t idelta, uint64_t start_bias, int print_info);
 static void print_entry(FILE *fp, kd_buf *kd, uint64_t thread, int type, char *command, uint64_t now, uint64_t idelta, uint64_t start_bias, kd_buf *kd_note);
 static void log_info(uint64_t now, uint64_t idelta, uint64_t start_bias, kd_buf *kd, kd_buf *kd_note);
-static char *find_code(int);
+static const char *find_code(int);
 static void pc_to_string(char *pcstring, uint64_t pc, int max_len, int mode);
 static void getdivisor(void);
 static int sample_sc(void);
+static void size_buffers(int nbufs);
+static void find_thread_name(uint64_t thread, char **command);
+static void capture_open(void);
+static void *capture_writer(void *);
+static void capture_queue(struct capture_block *);
+static struct capture_block *capture_new_block(void);
+static void capture_append(kd_buf *from, kd_buf *to);
+static void capture_header(uint64_t first_timestamp);
+static void capture_trigger(kd_buf *kd);
+static void capture_end_of_sample(kd_buf *end_of_sample);
+static void capture_finish(void);
+static void *pool_get(struct pool *);
+static void pool_put(struct pool *, void *);
+static void pool_reset(struct pool *);
+static void **table_bucket(struct event_table *, uint64_t thread);
+static void print_pool(char *, int *, const struct pool *);
+static threadwait_t find_wait_entry(uint64_t thread);
+static void account_wait(uint64_t thread, threadrun_t trp, uint64_t now);
+static int wait_compar(const void *, const void *);
+static int wait_command_compar(const void *, const void *);
+static void print_wait_entry(FILE *fp, const char *name, uint64_t thread, const struct threadwait *twp);
+static void wait_screen_update(FILE *fp);
+static void sample_adapt(ssize_t count, int wrapped);
 static void init_code_file(void);
-static void do_kernel_nm(void);
+static int pc_to_symbol(uint64_t);
+static void load_kernel_symbols(void);
+static const struct mach_header_64 *kernel_macho(const char *, size_t);
+static int kernel_symtab(const struct mach_header_64 *, size_t, uuid_t);
+static int ksym_compar(const void *, const void *);
+static int ksym_cache_path(char *, size_t);
+static int ksym_cache_load(const uuid_t);
+static void ksym_cache_save(const uuid_t);
 static void open_logfile(const char*);
 static int binary_search(kern_sym_t *list, int low, int high, uint64_t addr);
 
 static void create_map_entry(uint64_t, char *);
+static void insert_thread_entry(threadmap_t);
 static void check_for_thread_update(uint64_t thread, int debugid_base, kd_buf *kbufp, char **command);
 static void log_scheduler(kd_buf *kd_start, kd_buf *kd_stop, kd_buf *end_of_sample, int s_priority, double s_latency, uint64_t thread);
 static int check_for_scheduler_latency(int type, uint64_t *thread, uint64_t now, kd_buf *kd, kd_buf **kd_start, int *priority, double *latency);
 static void open_rawfile(const char *path);
+static void lat_hist_add(struct lat_hist *, double);
+static void lat_hist_merge(struct lat_hist *, const struct lat_hist *);
+static uint64_t lat_hist_bucket_max(int);
+static double lat_hist_percentile(const struct lat_hist *, double);
+static void print_percentile(FILE *, const char *, double);
+static void write_hist_json(FILE *, const char *, const char *, int, const struct lat_hist *);
+static void write_hist_snapshot(FILE *);
+static void write_json_stats(FILE *);
+static void run_done(void);
+static void leave_on_signal(int);
 
 static void screen_update(FILE *);
 
@@ -378,10 +588,7 @@ quit(char *s)
 void
 set_enable(int val)
 {
-	int mib[] = { CTL_KERN, KERN_KDEBUG, KERN_KDENABLE, val };
-	size_t needed;
-
-	if (sysctl(mib, ARRAYSIZE(mib), NULL, &needed, NULL, 0) < 0) {
+	if (kdc_enable(val) < 0) {
 		quit("trace facility failure, KERN_KDENABLE\n");
 	}
 }
@@ -389,40 +596,107 @@ set_enable(int val)
 static void
 set_numbufs(int nbufs)
 {
-	int mib1[] = { CTL_KERN, KERN_KDEBUG, KERN_KDSETBUF, nbufs };
-	int mib2[] = { CTL_KERN, KERN_KDEBUG, KERN_KDSETUP };
-	size_t needed;
-
-	if (sysctl(mib1, ARRAYSIZE(mib1), NULL, &needed, NULL, 0) < 0) {
+	if (kdc_setbuf(nbufs) < 0) {
 		quit("trace facility failure, KERN_KDSETBUF\n");
 	}
-	if (sysctl(mib2, ARRAYSIZE(mib2), NULL, &needed, NULL, 0) < 0) {
+	if (kdc_setup() < 0) {
 		quit("trace facility failure, KERN_KDSETUP\n");
 	}
 }
 
+/*
+ * (Re)size the kernel trace buffer, and the buffer it is read into, to
+ * hold nbufs events.
+ */
 static void
-set_pidexclude(int pid, int on_off)
+size_buffers(int nbufs)
+{
+	set_enable(0);
+	set_numbufs(nbufs);
+
+	get_bufinfo(&bufinfo);
+
+	set_enable(0);
+
+	set_pidexclude(getpid(), 1);
+	set_enable(1);
+
+	num_entries = bufinfo.nkdbufs;
+
+	free(my_buffer);
+
+	if ((my_buffer = malloc(num_entries * sizeof(kd_buf))) == NULL) {
+		quit("can't allocate memory for tracing info\n");
+	}
+}
+
+/*
+ * Called after each read of the live trace buffer with the number of
+ * events read.  The event rate is tracked from the samples that didn't
+ * wrap, and used to estimate how many events were lost when one did.
+ * A wrap first halves the sampling interval; once that is at its minimum,
+ * or when the rate says the buffer won't hold two intervals' worth,
+ * the buffer is grown instead.  The interval creeps back up once the
+ * samples are using less than a quarter of the buffer.
+ */
+static void
+sample_adapt(ssize_t count, int wrapped)
 {
-	int mib[] = { CTL_KERN, KERN_KDEBUG, KERN_KDPIDEX };
-	size_t needed = sizeof(kd_regtype);
+	uint64_t now_abs;
+	double	elapsed_usecs;
+	double	rate;
+	int	nbufs = num_entries;
+
+	now_abs = mach_absolute_time();
+	elapsed_usecs = (double)(now_abs - sample_last_abs) / divisor;
+	sample_last_abs = now_abs;
+
+	if (wrapped) {
+		sample_wraps++;
+
+		if (sample_rate > 0.0 && elapsed_usecs * sample_rate > (double)count) {
+			sample_dropped += (uint64_t)(elapsed_usecs * sample_rate) - count;
+		}
+		if (sample_usecs > SAMPLE_MIN_USECS) {
+			sample_usecs = MAX(sample_usecs / 2, SAMPLE_MIN_USECS);
+		} else {
+			nbufs = num_entries * 2;
+		}
+	} else {
+		if (elapsed_usecs > 0.0) {
+			rate = (double)count / elapsed_usecs;
+
+			if (sample_rate == 0.0) {
+				sample_rate = rate;
+			} else {
+				sample_rate = (sample_rate * 3 + rate) / 4;
+			}
+		}
+		if (count < num_entries / 4 && sample_usecs < SAMPLE_TIME_USECS) {
+			sample_usecs = MIN(sample_usecs * 2, SAMPLE_TIME_USECS);
+		}
+		if (sample_rate * sample_usecs * 2 > (double)num_entries) {
+			nbufs = (int)MIN(sample_rate * sample_usecs * 2, (double)SAMPLE_MAX_SIZE);
+		}
+	}
+	nbufs = MIN(nbufs, SAMPLE_MAX_SIZE);
 
-	kd_regtype kr = {
-		.type = KDBG_TYPENONE,
-		.value1 = pid,
-		.value2 = on_off
-	};
+	if (nbufs > num_entries) {
+		size_buffers(nbufs);
+		need_new_map = 1;
+	}
+}
 
-	sysctl(mib, ARRAYSIZE(mib), &kr, &needed, NULL, 0);
+static void
+set_pidexclude(int pid, int on_off)
+{
+	(void)kdc_pidcheck(KERN_KDPIDEX, pid, on_off);
 }
 
 static void
 get_bufinfo(kbufinfo_t *val)
 {
-	int mib[] = { CTL_KERN, KERN_KDEBUG, KERN_KDGETBUF };
-	size_t needed = sizeof (*val);
-
-	if (sysctl(mib, ARRAYSIZE(mib), val, &needed, 0, 0) < 0) {
+	if (kdc_getbuf(val) < 0) {
 		quit("trace facility failure, KERN_KDGETBUF\n");
 	}
 }
@@ -430,12 +704,9 @@ get_bufinfo(kbufinfo_t *val)
 void
 set_remove(void)
 {
-	int mib[] = { CTL_KERN, KERN_KDEBUG, KERN_KDREMOVE };
-	size_t needed;
-
 	errno = 0;
 
-	if (sysctl(mib, ARRAYSIZE(mib), NULL, &needed, NULL, 0) < 0) {
+	if (kdc_remove() < 0) {
 		set_remove_flag = 0;
 		if (errno == EBUSY) {
 			quit("the trace facility is currently in use...\n         fs_usage, sc_usage, and latency use this feature.\n\n");
@@ -462,29 +733,40 @@ write_high_res_latencies(void)
 	}
 }
 
+/*
+ * The handlers only note the signal: the sampling loop tidies up and
+ * exits in leave_on_signal(), where it is safe to write out the capture
+ * and the screen.
+ */
 static void
-sigintr(int signo __attribute__((unused)))
+sigintr(int signo)
 {
-	write_high_res_latencies();
-
-	set_enable(0);
-	set_pidexclude(getpid(), 0);
-	screen_update(log_fp);
-	endwin();
-	set_remove();
-
-	exit(1);
+	gotExitSignal = signo;
 }
 
 /* exit under normal conditions -- signal handler */
 static void
-leave(int signo __attribute__((unused)))
+leave(int signo)
+{
+	gotExitSignal = signo;
+}
+
+static void
+leave_on_signal(int signo)
 {
 	write_high_res_latencies();
+	capture_finish();
 
 	set_enable(0);
 	set_pidexclude(getpid(), 0);
-	endwin();
+	if (signo == SIGINT && (log_fp || json_interval == 0)) {
+		screen_update(log_fp);
+	}
+	if (json_interval) {
+		write_json_stats(stdout);
+	} else {
+		endwin();
+	}
 	set_remove();
 
 	exit(1);
@@ -583,6 +865,45 @@ screen_update(FILE *fp)
 		printw(tbuf);
 	}
 
+	if (!RAW_flag) {
+		sprintf(tbuf, "trace buffer %d events   sampled every %dms   wraps %d   events lost ~%" PRIu64 "\n",
+			num_entries, sample_usecs / 1000, sample_wraps, sample_dropped);
+		if (fp) {
+			fprintf(fp, "%s", tbuf);
+		} else {
+			printw(tbuf);
+		}
+	}
+	clen = sprintf(tbuf, "tables (entries/peak/dropped)");
+	print_pool(tbuf, &clen, &run_table.et_pool);
+	print_pool(tbuf, &clen, &start_table.et_pool);
+	print_pool(tbuf, &clen, &lookup_table.et_pool);
+	print_pool(tbuf, &clen, &thread_entry_pool);
+	sprintf(&tbuf[clen], "   gc %" PRIu64 " x %.1fus\n", gc_count, gc_count ? (double)gc_time / divisor / gc_count : 0.0);
+	if (fp) {
+		fprintf(fp, "%s", tbuf);
+	} else {
+		printw(tbuf);
+	}
+	if (capture.fd != -1) {
+		sprintf(tbuf, "captured %" PRIu64 " triggers   %" PRIu64 " events   %" PRIu64 " dropped\n",
+			capture.triggers, capture.events, capture.dropped);
+		if (fp) {
+			fprintf(fp, "%s", tbuf);
+		} else {
+			printw(tbuf);
+		}
+	}
+	if (wait_accounting) {
+		wait_screen_update(fp);
+
+		if (fp == NULL) {
+			refresh();
+		} else {
+			fflush(fp);
+		}
+		return;
+	}
 	sprintf(tbuf, "                     SCHEDULER     INTERRUPTS\n");
 	if (fp) {
 		fprintf(fp, "%s", tbuf);
@@ -858,6 +1179,10 @@ screen_update(FILE *fp)
 		printw(tbuf);
 	}
 
+	print_percentile(fp, "\n50th percentile(usecs)", 50.0);
+	print_percentile(fp, "\n99th percentile(usecs)", 99.0);
+	print_percentile(fp, "\n99.9 percentile(usecs)", 99.9);
+
 	for (itotal = 0, cpu = 0; cpu < num_i_latency_cpus; cpu++) {
 		il = &i_lat[cpu];
 
@@ -887,121 +1212,606 @@ screen_update(FILE *fp)
 	}
 }
 
-static int
-exit_usage(void)
+static void
+lat_hist_add(struct lat_hist *h, double usecs)
 {
-	fprintf(stderr, "Usage: latency [-p <priority>] [-h] [-m] [-st <threshold>] [-it <threshold>]\n");
-	fprintf(stderr, "               [-c <codefile>] [-l <logfile>] [-R <rawfile>] [-n <kernel>]\n\n");
+	uint64_t ns;
+	int e, b;
 
-	fprintf(stderr, "  -p    specify scheduling priority to watch... default is realtime. Can also be a range, e.g. \"31-47\".\n");
-	fprintf(stderr, "  -h    Display high resolution interrupt latencies and write them to latencies.csv (truncate existing file) upon exit.\n");
-	fprintf(stderr, "  -st   set scheduler latency threshold in microseconds... if latency exceeds this, then log trace\n");
-	fprintf(stderr, "  -m    specify per-CPU interrupt latency reporting\n");
-	fprintf(stderr, "  -it   set interrupt latency threshold in microseconds... if latency exceeds this, then log trace\n");
-	fprintf(stderr, "  -c    specify name of codes file... default is /usr/share/misc/trace.codes\n");
-	fprintf(stderr, "  -l    specify name of file to log trace entries to when the specified threshold is exceeded\n");
-	fprintf(stderr, "  -R    specify name of raw trace file to process\n");
-	fprintf(stderr, "  -n    specify kernel... default is /System/Library/Kernels/kernel.development\n");
+	ns = (uint64_t)(usecs * 1000.0);
 
-	fprintf(stderr, "\nlatency must be run as root\n\n");
+	if (ns >= (1ULL << LAT_MAX_POWER)) {
+		ns = (1ULL << LAT_MAX_POWER) - 1;
+	}
+	if (ns < LAT_SUB_BUCKETS) {
+		b = (int)ns;
+	} else {
+		e = 63 - __builtin_clzll(ns);
+		b = LAT_SUB_BUCKETS * (e - 3) + (int)((ns >> (e - 4)) & (LAT_SUB_BUCKETS - 1));
+	}
+	h->counts[b]++;
+	h->n++;
 
-	exit(1);
+	if ((uint64_t)(usecs * 1000.0) > h->max_ns) {
+		h->max_ns = (uint64_t)(usecs * 1000.0);
+	}
 }
 
 static void
-resetscr(void)
+lat_hist_merge(struct lat_hist *to, const struct lat_hist *from)
 {
-	(void)endwin();
+	int b;
+
+	for (b = 0; b < LAT_HIST_BUCKETS; b++) {
+		to->counts[b] += from->counts[b];
+	}
+	to->n += from->n;
+
+	if (from->max_ns > to->max_ns) {
+		to->max_ns = from->max_ns;
+	}
 }
 
-int
-main(int argc, char *argv[])
+/*
+ * The largest number of nanoseconds counted in bucket b.
+ */
+static uint64_t
+lat_hist_bucket_max(int b)
 {
-	int i;
+	int e;
 
-	if (0 != reexec_to_match_kernel()) {
-		fprintf(stderr, "Could not re-execute: %d\n", errno);
-		exit(1);
+	if (b < LAT_SUB_BUCKETS) {
+		return b;
 	}
-	while (argc > 1) {
-
-		if (strcmp(argv[1], "-R") == 0) {
-			argc--;
-			argv++;
+	e = b / LAT_SUB_BUCKETS + 3;
 
-			if (argc > 1) {
-				open_rawfile(argv[1]);
-			} else {
-				exit_usage();
-			}
+	return ((uint64_t)(LAT_SUB_BUCKETS + b % LAT_SUB_BUCKETS + 1) << (e - 4)) - 1;
+}
 
-			RAW_flag = 1;
+/*
+ * The pct'th percentile in microseconds, as the top of the bucket it is in.
+ */
+static double
+lat_hist_percentile(const struct lat_hist *h, double pct)
+{
+	uint64_t want, seen;
+	uint64_t ns;
+	int b;
 
-		} else if (strcmp(argv[1], "-p") == 0) {
-			argc--;
-			argv++;
+	if (h->n == 0) {
+		return 0.0;
+	}
+	want = (uint64_t)((double)h->n * pct / 100.0);
 
-			if (argc > 1) {
-				if (2 == sscanf(argv[1], "%d-%d", &watch_priority_min, &watch_priority_max)) {
-					if (watch_priority_min > watch_priority_max) {
-						exit_usage();
-					} else if (watch_priority_min < 0) {
-						exit_usage();
-					}
-				} else {
-					if (1 == sscanf(argv[1], "%d", &watch_priority_min)) {
-						watch_priority_max = watch_priority_min;
-					} else {
-						exit_usage();
-					}
-				}
-			} else {
-				exit_usage();
-			}
-		} else if (strcmp(argv[1], "-st") == 0) {
-			argc--;
-			argv++;
+	if (want == 0) {
+		want = 1;
+	}
+	for (seen = 0, b = 0; b < LAT_HIST_BUCKETS - 1; b++) {
+		if ((seen += h->counts[b]) >= want) {
+			break;
+		}
+	}
+	ns = lat_hist_bucket_max(b);
 
-			if (argc > 1) {
-				s_thresh_hold = atoi(argv[1]);
-			} else {
-				exit_usage();
-			}
-		} else if (strcmp(argv[1], "-it") == 0) {
-			argc--;
-			argv++;
+	if (ns > h->max_ns) {
+		ns = h->max_ns;
+	}
+	return (double)ns / 1000.0;
+}
 
-			if (argc > 1) {
-				i_thresh_hold = atoi(argv[1]);
-			} else {
-				exit_usage();
-			}
-		} else if (strcmp(argv[1], "-c") == 0) {
-			argc--;
-			argv++;
+static void
+print_percentile(FILE *fp, const char *label, double pct)
+{
+	struct lat_hist all_s, all_i;
+	char tbuf[1024];
+	int  clen;
+	int  cpu;
+	int  pri;
 
-			if (argc > 1) {
-				code_file = argv[1];
-			} else {
-				exit_usage();
-			}
-		} else if (strcmp(argv[1], "-l") == 0) {
-			argc--;
-			argv++;
+	bzero(&all_s, sizeof(all_s));
+	bzero(&all_i, sizeof(all_i));
 
-			if (argc > 1) {
-				open_logfile(argv[1]);
-			} else {
-				exit_usage();
-			}
-		} else if (strcmp(argv[1], "-n") == 0) {
-			argc--;
-			argv++;
+	for (pri = 0; pri < LAT_PRIORITIES; pri++) {
+		lat_hist_merge(&all_s, &s_hist[pri]);
+	}
+	for (cpu = 0; cpu < num_cpus; cpu++) {
+		lat_hist_merge(&all_i, &i_hist[cpu]);
+	}
+	clen = sprintf(tbuf, "%s %7.1f      %9.1f", label, lat_hist_percentile(&all_s, pct), lat_hist_percentile(&all_i, pct));
 
-			if (argc > 1) {
-				kernelpath = argv[1];
-			} else {
-				exit_usage();
+	if (i_latency_per_cpu == TRUE) {
+		for (cpu = 0; cpu < num_i_latency_cpus; cpu++) {
+			clen += sprintf(&tbuf[clen], " %9.1f", lat_hist_percentile(&i_hist[cpu], pct));
+		}
+	}
+	if (fp) {
+		fprintf(fp, "%s", tbuf);
+	} else {
+		printw(tbuf);
+	}
+}
+
+static void
+write_hist_json(FILE *fp, const char *sep, const char *key, int value, const struct lat_hist *h)
+{
+	int b;
+	const char *bsep = "";
+
+	fprintf(fp, "%s{\"%s\":%d,\"count\":%" PRIu64 ",\"p50_us\":%.3f,\"p99_us\":%.3f,\"p999_us\":%.3f,\"max_us\":%.3f,\"buckets\":[",
+		sep, key, value, h->n, lat_hist_percentile(h, 50.0), lat_hist_percentile(h, 99.0),
+		lat_hist_percentile(h, 99.9), (double)h->max_ns / 1000.0);
+
+	for (b = 0; b < LAT_HIST_BUCKETS; b++) {
+		if (h->counts[b]) {
+			fprintf(fp, "%s[%" PRIu64 ",%u]", bsep, lat_hist_bucket_max(b), h->counts[b]);
+			bsep = ",";
+		}
+	}
+	fprintf(fp, "]}");
+}
+
+/*
+ * Write one line of JSON with the histograms for each priority and CPU that
+ * has seen a latency.  The buckets are [nanoseconds at most, count] pairs,
+ * and are cumulative since latency was started.
+ */
+static void
+write_hist_snapshot(FILE *fp)
+{
+	const char *sep = "";
+	time_t now;
+	int pri;
+	int cpu;
+
+	now = RAW_flag ? (time_t)sample_TOD_secs : time(NULL);
+
+	fprintf(fp, "{\"time\":%ld,\"scheduler\":[", (long)now);
+
+	for (pri = 0; pri < LAT_PRIORITIES; pri++) {
+		if (s_hist[pri].n) {
+			write_hist_json(fp, sep, "priority", pri, &s_hist[pri]);
+			sep = ",";
+		}
+	}
+	fprintf(fp, "],\"interrupts\":[");
+
+	for (sep = "", cpu = 0; cpu < num_cpus; cpu++) {
+		if (i_hist[cpu].n) {
+			write_hist_json(fp, sep, "cpu", cpu, &i_hist[cpu]);
+			sep = ",";
+		}
+	}
+	fprintf(fp, "]}\n");
+	fflush(fp);
+}
+
+static threadwait_t
+find_wait_entry(uint64_t thread)
+{
+	threadwait_t	twp;
+	char		*command;
+
+	if ((twp = kdc_threads_find(&threadwait_table, thread))) {
+		return twp;
+	}
+	if ((twp = calloc(1, sizeof(struct threadwait))) == NULL ||
+	    kdc_threads_insert(&threadwait_table, thread, twp) == twp) {
+		quit("can't allocate memory for wait accounting\n");
+	}
+	twp->tw_thread = thread;
+	threadwait_count++;
+
+	find_thread_name(thread, &command);
+	(void)strncpy(twp->tw_command, command, MAXCOMLEN);
+
+	return twp;
+}
+
+/*
+ * thread has just been switched onto a core; trp is its run event, if it
+ * was made runnable during this sample.
+ */
+static void
+account_wait(uint64_t thread, threadrun_t trp, uint64_t now)
+{
+	threadwait_t	twp;
+	char		*command;
+	uint64_t	waited;
+
+	twp = find_wait_entry(thread);
+	twp->tw_switches++;
+
+	if (twp->tw_command[0] == '\0') {
+		find_thread_name(thread, &command);
+		(void)strncpy(twp->tw_command, command, MAXCOMLEN);
+	}
+	if (trp && now > trp->tr_timestamp) {
+		waited = now - trp->tr_timestamp;
+
+		twp->tw_waits++;
+		twp->tw_total += waited;
+
+		if (waited > twp->tw_max) {
+			twp->tw_max = waited;
+		}
+	}
+}
+
+static int
+wait_compar(const void *a, const void *b)
+{
+	const struct threadwait *twa = *(const struct threadwait * const *)a;
+	const struct threadwait *twb = *(const struct threadwait * const *)b;
+
+	if (twa->tw_total != twb->tw_total) {
+		return twa->tw_total > twb->tw_total ? -1 : 1;
+	}
+	return 0;
+}
+
+static int
+wait_command_compar(const void *a, const void *b)
+{
+	const struct threadwait *twa = *(const struct threadwait * const *)a;
+	const struct threadwait *twb = *(const struct threadwait * const *)b;
+
+	return strcmp(twa->tw_command, twb->tw_command);
+}
+
+static void
+print_wait_entry(FILE *fp, const char *name, uint64_t thread, const struct threadwait *twp)
+{
+	char tbuf[1024];
+
+	if (thread) {
+		sprintf(tbuf, "\n%-16.16s %#10" PRIx64 " %10" PRIu64 " %10" PRIu64 " %12.3f %10.1f %10.1f", name, thread,
+			twp->tw_switches, twp->tw_waits, (double)twp->tw_total / divisor / 1000.0,
+			twp->tw_waits ? (double)twp->tw_total / divisor / twp->tw_waits : 0.0, (double)twp->tw_max / divisor);
+	} else {
+		sprintf(tbuf, "\n%-16.16s %10s %10" PRIu64 " %10" PRIu64 " %12.3f %10.1f %10.1f", name, "",
+			twp->tw_switches, twp->tw_waits, (double)twp->tw_total / divisor / 1000.0,
+			twp->tw_waits ? (double)twp->tw_total / divisor / twp->tw_waits : 0.0, (double)twp->tw_max / divisor);
+	}
+	if (fp) {
+		fprintf(fp, "%s", tbuf);
+	} else {
+		printw(tbuf);
+	}
+}
+
+/*
+ * The processes, and then the threads, that have spent the most time in
+ * total waiting to get on a core after being made runnable.
+ */
+static void
+wait_screen_update(FILE *fp)
+{
+	threadwait_t	*sorted;
+	threadwait_t	*procs;
+	threadwait_t	twp;
+	struct kdc_threads_walk w;
+	int		nthreads, nprocs;
+	int		rows;
+	int		i, j;
+	char		tbuf[1024];
+
+	if (threadwait_count == 0) {
+		return;
+	}
+	if ((sorted = malloc(threadwait_count * sizeof(threadwait_t))) == NULL ||
+	    (procs = calloc(threadwait_count, sizeof(threadwait_t))) == NULL) {
+		quit("can't allocate memory for wait accounting\n");
+	}
+	nthreads = 0;
+
+	kdc_threads_walk_start(&threadwait_table, &w);
+
+	while ((twp = kdc_threads_next(&threadwait_table, &w))) {
+		sorted[nthreads++] = twp;
+	}
+
+	/*
+	 * Add up the threads of each command into a process entry.
+	 */
+	qsort(sorted, nthreads, sizeof(threadwait_t), wait_command_compar);
+
+	for (nprocs = 0, i = 0; i < nthreads; i++) {
+		if (nprocs == 0 || strcmp(procs[nprocs - 1]->tw_command, sorted[i]->tw_command)) {
+			if ((procs[nprocs] = calloc(1, sizeof(struct threadwait))) == NULL) {
+				quit("can't allocate memory for wait accounting\n");
+			}
+			strcpy(procs[nprocs]->tw_command, sorted[i]->tw_command);
+			nprocs++;
+		}
+		twp = procs[nprocs - 1];
+
+		twp->tw_switches += sorted[i]->tw_switches;
+		twp->tw_waits += sorted[i]->tw_waits;
+		twp->tw_total += sorted[i]->tw_total;
+
+		if (sorted[i]->tw_max > twp->tw_max) {
+			twp->tw_max = sorted[i]->tw_max;
+		}
+	}
+	qsort(sorted, nthreads, sizeof(threadwait_t), wait_compar);
+	qsort(procs, nprocs, sizeof(threadwait_t), wait_compar);
+
+	/*
+	 * Split what's left of the screen between the two, or show 20 of
+	 * each in the log file.
+	 */
+	if (fp) {
+		rows = 20;
+	} else {
+		rows = (LINES - 10) / 2;
+
+		if (rows < 1) {
+			rows = 1;
+		}
+	}
+	sprintf(tbuf, "\n%-16s %10s %10s %10s %12s %10s %10s", "COMMAND", "", "SWITCHES", "WAITS", "TOTAL(msecs)", "AVG(usecs)", "MAX(usecs)");
+
+	if (fp) {
+		fprintf(fp, "\n%s", tbuf);
+	} else {
+		printw("\n");
+		printw(tbuf);
+	}
+	for (i = 0; i < nprocs && i < rows; i++) {
+		print_wait_entry(fp, procs[i]->tw_command, 0, procs[i]);
+	}
+	sprintf(tbuf, "\n\n%-16s %10s %10s %10s %12s %10s %10s", "COMMAND", "THREAD", "SWITCHES", "WAITS", "TOTAL(msecs)", "AVG(usecs)", "MAX(usecs)");
+
+	if (fp) {
+		fprintf(fp, "%s", tbuf);
+	} else {
+		printw(tbuf);
+	}
+	for (j = 0; j < nthreads && j < rows; j++) {
+		print_wait_entry(fp, sorted[j]->tw_command, sorted[j]->tw_thread, sorted[j]);
+	}
+	if (fp) {
+		fprintf(fp, "\n");
+	} else {
+		printw("\n");
+	}
+	for (i = 0; i < nprocs; i++) {
+		free(procs[i]);
+	}
+	free(procs);
+	free(sorted);
+}
+
+static void
+print_pool(char *tbuf, int *clen, const struct pool *p)
+{
+	*clen += sprintf(&tbuf[*clen], "   %s %d/%d/%" PRIu64, p->p_name, p->p_nblocks * POOL_BLOCK_ENTRIES, p->p_peak, p->p_dropped);
+}
+
+/*
+ * One line of JSON with the scheduler statistics for the -p priorities,
+ * the interrupt statistics for each CPU, and how well the trace buffer
+ * kept up, all since latency started.
+ */
+static void
+write_json_stats(FILE *fp)
+{
+	struct lat_hist all_s;
+	struct i_latencies *il;
+	time_t	now;
+	int	pri;
+	int	cpu;
+
+	bzero(&all_s, sizeof(all_s));
+
+	for (pri = watch_priority_min; pri <= watch_priority_max && pri < LAT_PRIORITIES; pri++) {
+		lat_hist_merge(&all_s, &s_hist[pri]);
+	}
+	if (RAW_flag) {
+		now = (time_t)sample_TOD_secs + (time_t)(((last_now - first_now) / divisor) / 1000000);
+	} else {
+		now = time(NULL);
+	}
+	fprintf(fp, "{\"time\":%ld,\"elapsed\":%ld,\"buffer_events\":%d,\"sample_usecs\":%d,\"wraps\":%d,\"events_lost\":%" PRIu64 ",",
+		(long)now, RAW_flag ? (long)(((last_now - first_now) / divisor) / 1000000) : (long)(now - start_time),
+		num_entries, sample_usecs, sample_wraps, sample_dropped);
+
+	fprintf(fp, "\"scheduler\":{\"priority_min\":%d,\"priority_max\":%d,\"samples\":%d,\"min_us\":%d,\"max_us\":%d,\"avg_us\":%.1f,\"exceeded\":%d,\"p50_us\":%.3f,\"p99_us\":%.3f,\"p999_us\":%.3f},",
+		watch_priority_min, watch_priority_max, s_total_samples, s_min_latency, s_max_latency,
+		s_total_samples ? (double)s_total_latency / s_total_samples : 0.0, s_exceeded_threshold,
+		lat_hist_percentile(&all_s, 50.0), lat_hist_percentile(&all_s, 99.0), lat_hist_percentile(&all_s, 99.9));
+
+	fprintf(fp, "\"interrupts\":[");
+
+	for (cpu = 0; cpu < num_i_latency_cpus; cpu++) {
+		il = &i_lat[cpu];
+
+		fprintf(fp, "%s{\"cpu\":%d,\"samples\":%d,\"min_us\":%ld,\"max_us\":%ld,\"avg_us\":%.1f,\"exceeded\":%d,\"p50_us\":%.3f,\"p99_us\":%.3f,\"p999_us\":%.3f}",
+			cpu ? "," : "", cpu, il->i_total_samples, il->i_min_latency, il->i_max_latency,
+			il->i_total_samples ? (double)il->i_total_latency / il->i_total_samples : 0.0, il->i_exceeded_threshold,
+			lat_hist_percentile(&i_hist[cpu], 50.0), lat_hist_percentile(&i_hist[cpu], 99.0),
+			lat_hist_percentile(&i_hist[cpu], 99.9));
+	}
+	fprintf(fp, "]}\n");
+	fflush(fp);
+}
+
+/*
+ * -t ran out: tidy up like leave_on_signal() does, but exit cleanly.  The screen is
+ * put back by resetscr().
+ */
+static void
+run_done(void)
+{
+	write_high_res_latencies();
+	capture_finish();
+
+	set_enable(0);
+	set_pidexclude(getpid(), 0);
+
+	if (log_fp) {
+		screen_update(log_fp);
+	}
+	if (json_interval) {
+		write_json_stats(stdout);
+	}
+	set_remove();
+
+	exit(0);
+}
+
+static int
+exit_usage(void)
+{
+	fprintf(stderr, "Usage: latency [-p <priority>] [-h] [-m] [-a] [-st <threshold>] [-it <threshold>] [-j <secs>] [-t <secs>]\n");
+	fprintf(stderr, "               [-c <codefile>] [-l <logfile>] [-o <rawfile> [-ow <msecs>]] [-H <histfile>]\n");
+	fprintf(stderr, "               [-R <rawfile>] [-n <kernel>]\n\n");
+
+	fprintf(stderr, "  -p    specify scheduling priority to watch... default is realtime. Can also be a range, e.g. \"31-47\".\n");
+	fprintf(stderr, "  -h    Display high resolution interrupt latencies and write them to latencies.csv (truncate existing file) upon exit.\n");
+	fprintf(stderr, "  -st   set scheduler latency threshold in microseconds... if latency exceeds this, then log trace\n");
+	fprintf(stderr, "  -m    specify per-CPU interrupt latency reporting\n");
+	fprintf(stderr, "  -a    show the processes and threads of any priority that waited longest to run once runnable\n");
+	fprintf(stderr, "  -it   set interrupt latency threshold in microseconds... if latency exceeds this, then log trace\n");
+	fprintf(stderr, "  -c    specify name of codes file... default is /usr/share/misc/trace.codes\n");
+	fprintf(stderr, "  -l    specify name of file to log trace entries to when the specified threshold is exceeded\n");
+	fprintf(stderr, "  -o    specify name of compressed raw file to write the events around each exceeded threshold to\n");
+	fprintf(stderr, "  -ow   set the msecs of events before and after the threshold was exceeded to write with -o... default is 10\n");
+	fprintf(stderr, "  -j    don't use the screen, print a line of JSON with the latency statistics to stdout every <secs> seconds\n");
+	fprintf(stderr, "  -t    stop after <secs> seconds\n");
+	fprintf(stderr, "  -H    append a JSON line of the latency histograms to this file every second (at the end with -R)\n");
+	fprintf(stderr, "  -R    specify name of raw trace file to process\n");
+	fprintf(stderr, "  -n    specify kernel... default is /System/Library/Kernels/kernel.development\n");
+
+	fprintf(stderr, "\nlatency must be run as root\n\n");
+
+	exit(1);
+}
+
+static void
+resetscr(void)
+{
+	(void)endwin();
+}
+
+int
+main(int argc, char *argv[])
+{
+	int i;
+
+	if (0 != reexec_to_match_kernel()) {
+		fprintf(stderr, "Could not re-execute: %d\n", errno);
+		exit(1);
+	}
+	while (argc > 1) {
+
+		if (strcmp(argv[1], "-R") == 0) {
+			argc--;
+			argv++;
+
+			if (argc > 1) {
+				open_rawfile(argv[1]);
+			} else {
+				exit_usage();
+			}
+
+			RAW_flag = 1;
+
+		} else if (strcmp(argv[1], "-p") == 0) {
+			argc--;
+			argv++;
+
+			if (argc > 1) {
+				if (2 == sscanf(argv[1], "%d-%d", &watch_priority_min, &watch_priority_max)) {
+					if (watch_priority_min > watch_priority_max) {
+						exit_usage();
+					} else if (watch_priority_min < 0) {
+						exit_usage();
+					}
+				} else {
+					if (1 == sscanf(argv[1], "%d", &watch_priority_min)) {
+						watch_priority_max = watch_priority_min;
+					} else {
+						exit_usage();
+					}
+				}
+			} else {
+				exit_usage();
+			}
+		} else if (strcmp(argv[1], "-st") == 0) {
+			argc--;
+			argv++;
+
+			if (argc > 1) {
+				s_thresh_hold = atoi(argv[1]);
+			} else {
+				exit_usage();
+			}
+		} else if (strcmp(argv[1], "-it") == 0) {
+			argc--;
+			argv++;
+
+			if (argc > 1) {
+				i_thresh_hold = atoi(argv[1]);
+			} else {
+				exit_usage();
+			}
+		} else if (strcmp(argv[1], "-c") == 0) {
+			argc--;
+			argv++;
+
+			if (argc > 1) {
+				code_file = argv[1];
+			} else {
+				exit_usage();
+			}
+		} else if (strcmp(argv[1], "-l") == 0) {
+			argc--;
+			argv++;
+
+			if (argc > 1) {
+				open_logfile(argv[1]);
+			} else {
+				exit_usage();
+			}
+		} else if (strcmp(argv[1], "-o") == 0) {
+			argc--;
+			argv++;
+
+			if (argc > 1) {
+				capture.path = argv[1];
+			} else {
+				exit_usage();
+			}
+		} else if (strcmp(argv[1], "-ow") == 0) {
+			argc--;
+			argv++;
+
+			if (argc > 1) {
+				capture.window_msecs = atoi(argv[1]);
+			} else {
+				exit_usage();
+			}
+		} else if (strcmp(argv[1], "-H") == 0) {
+			argc--;
+			argv++;
+
+			if (argc > 1) {
+				if ((hist_fp = fopen(argv[1], "a")) == NULL) {
+					fprintf(stderr, "latency: failed to open histogram file [%s]\n", argv[1]);
+					exit_usage();
+				}
+			} else {
+				exit_usage();
+			}
+		} else if (strcmp(argv[1], "-n") == 0) {
+			argc--;
+			argv++;
+
+			if (argc > 1) {
+				kernelpath = argv[1];
+			} else {
+				exit_usage();
 			}
 		} else if (strcmp(argv[1], "-h") == 0) {
 			use_high_res_bins = TRUE;
@@ -1009,6 +1819,29 @@ main(int argc, char *argv[])
 		} else if (strcmp(argv[1], "-m") == 0) {
 			i_latency_per_cpu = TRUE;
 
+		} else if (strcmp(argv[1], "-a") == 0) {
+			wait_accounting = TRUE;
+
+		} else if (strcmp(argv[1], "-j") == 0) {
+			argc--;
+			argv++;
+
+			if (argc > 1) {
+				json_interval = atoi(argv[1]);
+			}
+			if (json_interval <= 0) {
+				exit_usage();
+			}
+		} else if (strcmp(argv[1], "-t") == 0) {
+			argc--;
+			argv++;
+
+			if (argc > 1) {
+				run_secs = atoi(argv[1]);
+			} else {
+				exit_usage();
+			}
+
 		} else {
 		        exit_usage();
 		}
@@ -1030,22 +1863,33 @@ main(int argc, char *argv[])
 		code_file = "/usr/share/misc/trace.codes";
 	}
 
-	do_kernel_nm();
+	load_kernel_symbols();
 
 	getdivisor();
 
+	if (capture.path) {
+		capture_open();
+	}
 	init_code_file();
 
+	if (json_interval) {
+		/*
+		 * The JSON lines always break the interrupts down by CPU.
+		 */
+		i_latency_per_cpu = TRUE;
+	}
 	if (!RAW_flag) {
-		if (initscr() == NULL) {
-			fprintf(stderr, "Unrecognized TERM type, try vt100\n");
-			exit(1);
-		}
-		atexit(resetscr);
-		clear();
-		refresh();
+		if (json_interval == 0) {
+			if (initscr() == NULL) {
+				fprintf(stderr, "Unrecognized TERM type, try vt100\n");
+				exit(1);
+			}
+			atexit(resetscr);
+			clear();
+			refresh();
 
-		signal(SIGWINCH, sigwinch);
+			signal(SIGWINCH, sigwinch);
+		}
 		signal(SIGINT, sigintr);
 		signal(SIGQUIT, leave);
 		signal(SIGTERM, leave);
@@ -1060,28 +1904,19 @@ main(int argc, char *argv[])
 		sysctl(mib, ARRAYSIZE(mib), &num_cpus, &len, NULL, 0);
 
 		set_remove();
-		set_numbufs(SAMPLE_SIZE * num_cpus);
-
-		get_bufinfo(&bufinfo);
-
-		set_enable(0);
-
-		set_pidexclude(getpid(), 1);
-		set_enable(1);
-
-		num_entries = bufinfo.nkdbufs;
+		size_buffers(MIN(SAMPLE_SIZE * num_cpus, SAMPLE_MAX_SIZE));
 	} else {
 		num_entries = 50000;
 		num_cpus    = 128;
+
+		if ((my_buffer = malloc(num_entries * sizeof(kd_buf))) == NULL) {
+			quit("can't allocate memory for tracing info\n");
+		}
 	}
 
 	for (cpu_mask = 0, i = 0; i < num_cpus; i++)
 		cpu_mask |= ((uint64_t)1 << i);
 
-	if ((my_buffer = malloc(num_entries * sizeof(kd_buf))) == NULL) {
-		quit("can't allocate memory for tracing info\n");
-	}
-
 	if ((last_decrementer_kd = (kd_buf **)malloc(num_cpus * sizeof(kd_buf *))) == NULL) {
 		quit("can't allocate memory for decrementer tracing info\n");
 	}
@@ -1098,6 +1933,10 @@ main(int argc, char *argv[])
 
 	bzero((char *)i_lat, num_i_latency_cpus * sizeof(struct i_latencies));
 
+	if ((i_hist = calloc(num_cpus, sizeof(struct lat_hist))) == NULL) {
+		quit("can't allocate memory for interrupt latency info\n");
+	}
+
 	if (RAW_flag) {
 		while (sample_sc()) {
 			continue;
@@ -1107,18 +1946,22 @@ main(int argc, char *argv[])
 			screen_update(log_fp);
 		}
 
-		screen_update(stdout);
+		if (json_interval) {
+			write_json_stats(stdout);
+		} else {
+			screen_update(stdout);
+		}
+
+		if (hist_fp) {
+			write_hist_snapshot(hist_fp);
+		}
+		capture_finish();
 
 	} else {
 		uint64_t adelay;
-		double	fdelay;
-		double	nanosecs_to_sleep;
-
-		nanosecs_to_sleep = (double)(SAMPLE_TIME_USECS * 1000);
-		fdelay = nanosecs_to_sleep * (divisor /1000);
-		adelay = (uint64_t)fdelay;
 
 		trace_enabled = 1;
+		sample_last_abs = mach_absolute_time();
 
 		start_time = time(NULL);
 		refresh_time = start_time;
@@ -1126,14 +1969,30 @@ main(int argc, char *argv[])
 		for (;;) {
 			curr_time = time(NULL);
 
+			if (run_secs && curr_time - start_time >= run_secs) {
+				run_done();
+			}
 			if (curr_time >= refresh_time) {
-				screen_update(NULL);
-				refresh_time = curr_time + 1;
+				if (json_interval) {
+					write_json_stats(stdout);
+				} else {
+					screen_update(NULL);
+				}
+
+				if (hist_fp) {
+					write_hist_snapshot(hist_fp);
+				}
+				refresh_time = curr_time + (json_interval ? json_interval : 1);
 			}
+			adelay = (uint64_t)((double)sample_usecs * divisor);
+
 			mach_wait_until(mach_absolute_time() + adelay);
 
 			sample_sc();
 
+			if (gotExitSignal) {
+				leave_on_signal(gotExitSignal);
+			}
 			if (gotSIGWINCH) {
 				/*
 				 * No need to check for initscr error return.
@@ -1155,77 +2014,62 @@ read_command_map(void)
 	kd_threadmap *mapptr = 0;
 	int	total_threads = 0;
 	size_t	size;
-	off_t	offset;
 	int	i;
 	RAW_header header = {0};
 
 	if (RAW_flag) {
-                if (read(RAW_fd, &header, sizeof(RAW_header)) != sizeof(RAW_header)) {
-                        perror("read failed");
+		if (kdc_raw_header(&RAW_input, &header) < 0) {
+			perror("read failed");
 			exit(2);
-                }
-		if (header.version_no != RAW_VERSION1) {
-			header.version_no = RAW_VERSION0;
-			header.TOD_secs = time(NULL);
-			header.TOD_usecs = 0;
-
-			lseek(RAW_fd, (off_t)0, SEEK_SET);
-
-			if (read(RAW_fd, &header.thread_count, sizeof(int)) != sizeof(int)) {
-				perror("read failed");
-				exit(2);
-			}
 		}
-                total_threads = header.thread_count;
+		total_threads = header.thread_count;
 
 		sample_TOD_secs = header.TOD_secs;
 		sample_TOD_usecs = header.TOD_usecs;
 
 		if (total_threads == 0 && header.version_no != RAW_VERSION0) {
-			offset = lseek(RAW_fd, (off_t)0, SEEK_CUR);
-			offset = (offset + (4095)) & ~4095;
-
-			lseek(RAW_fd, offset, SEEK_SET);
+			(void)kdc_raw_align(&RAW_input);
 		}
-	} else {
-		total_threads = bufinfo.nkdthreads;
-	}
+		size = total_threads * sizeof(kd_threadmap);
 
-	size = total_threads * sizeof(kd_threadmap);
-
-	if (size == 0 || ((mapptr = (kd_threadmap *) malloc(size)) == 0)) {
-		return;
-	}
-	bzero (mapptr, size);
+		if (size == 0 || ((mapptr = (kd_threadmap *) calloc(1, size)) == 0)) {
+			return;
+		}
 
-	/*
-	 * Now read the threadmap
-	 */
-	if (RAW_flag) {
-		if (read(RAW_fd, mapptr, size) != size) {
+		/*
+		 * Now read the threadmap
+		 */
+		if (kdc_raw_read(&RAW_input, mapptr, size) != size) {
 			printf("Can't read the thread map -- this is not fatal\n");
 		}
 		if (header.version_no != RAW_VERSION0) {
-			offset = lseek(RAW_fd, (off_t)0, SEEK_CUR);
-			offset = (offset + (4095)) & ~4095;
-
-			lseek(RAW_fd, offset, SEEK_SET);
+			(void)kdc_raw_align(&RAW_input);
 		}
 	} else {
-		int mib[] = { CTL_KERN, KERN_KDEBUG, KERN_KDTHRMAP};
-		if (sysctl(mib, ARRAYSIZE(mib), mapptr, &size, NULL, 0) < 0) {
+		if (bufinfo.nkdthreads == 0) {
+			return;
+		}
+		if ((mapptr = kdc_threadmap(bufinfo.nkdthreads, &total_threads)) == NULL) {
 			/*
 			 * This is not fatal -- just means I cant map command strings
 			 */
 			printf("Can't read the thread map -- this is not fatal\n");
-
-			total_threads = 0;
+			return;
 		}
 	}
+	/* size the table once for the whole map */
+	(void)kdc_threads_reserve(&threadmap_table, total_threads);
+
 	for (i = 0; i < total_threads; i++) {
 		create_map_entry(mapptr[i].thread, &mapptr[i].command[0]);
 	}
-	free(mapptr);
+	if (capture.fd != -1) {
+		free(capture.map);
+		capture.map = mapptr;
+		capture.map_threads = total_threads;
+	} else {
+		free(mapptr);
+	}
 }
 
 void
@@ -1245,10 +2089,24 @@ create_map_entry(uint64_t thread, char *command)
 	tme->tm_command[MAXCOMLEN] = '\0';
 	tme->tm_orig_command[0] = '\0';
 
-	int hashid = thread & HASH_MASK;
+	insert_thread_entry(tme);
+}
+
+/*
+ * Put tme in the table, in place of any earlier entry for its thread.
+ */
+static void
+insert_thread_entry(threadmap_t tme)
+{
+	threadmap_t old;
 
-	tme->tm_next = threadmap_hash[hashid];
-	threadmap_hash[hashid] = tme;
+	if ((old = kdc_threads_insert(&threadmap_table, tme->tm_thread, tme)) == tme) {
+		quit("can't allocate memory for thread map\n");
+	}
+	if (old) {
+		old->tm_next = threadmap_freelist;
+		threadmap_freelist = old;
+	}
 }
 
 static void
@@ -1256,26 +2114,9 @@ delete_thread_entry(uint64_t thread)
 {
 	threadmap_t tme;
 
-	int hashid = thread & HASH_MASK;
-
-	if ((tme = threadmap_hash[hashid])) {
-		if (tme->tm_thread == thread) {
-			threadmap_hash[hashid] = tme->tm_next;
-		} else {
-			threadmap_t tme_prev = tme;
-
-			for (tme = tme->tm_next; tme; tme = tme->tm_next) {
-				if (tme->tm_thread == thread) {
-					tme_prev->tm_next = tme->tm_next;
-					break;
-				}
-				tme_prev = tme;
-			}
-		}
-		if (tme) {
-			tme->tm_next = threadmap_freelist;
-			threadmap_freelist = tme;
-		}
+	if ((tme = kdc_threads_remove(&threadmap_table, thread))) {
+		tme->tm_next = threadmap_freelist;
+		threadmap_freelist = tme;
 	}
 }
 
@@ -1303,9 +2144,7 @@ find_and_insert_tmp_map_entry(uint64_t pthread, char *command)
 			tme->tm_command[MAXCOMLEN] = '\0';
 			tme->tm_orig_command[0] = '\0';
 
-			int hashid = tme->tm_thread & HASH_MASK;
-			tme->tm_next = threadmap_hash[hashid];
-			threadmap_hash[hashid] = tme;
+			insert_thread_entry(tme);
 		}
 	}
 }
@@ -1333,16 +2172,7 @@ create_tmp_map_entry(uint64_t thread, uint64_t pthread)
 static threadmap_t
 find_thread_entry(uint64_t thread)
 {
-	threadmap_t tme;
-
-	int hashid = thread & HASH_MASK;
-
-	for (tme = threadmap_hash[hashid]; tme; tme = tme->tm_next) {
-		if (tme->tm_thread == thread) {
-			return tme;
-		}
-	}
-	return 0;
+	return kdc_threads_find(&threadmap_table, thread);
 }
 
 static void
@@ -1362,12 +2192,9 @@ add_thread_entry_to_list(thread_entry_t *list, uint64_t thread)
 {
 	thread_entry_t	te;
 
-	if ((te = thread_entry_freelist)) {
-		thread_entry_freelist = te->te_next;
-	} else {
-		te = (thread_entry_t)malloc(sizeof(struct thread_entry));
+	if ((te = pool_get(&thread_entry_pool)) == NULL) {
+		return;
 	}
-
 	te->te_thread = thread;
 	te->te_next = *list;
 	*list = te;
@@ -1403,16 +2230,12 @@ gc_thread_entries(void)
 {
 	thread_entry_t te;
 	thread_entry_t te_next;
-	int count = 0;
 
 	for (te = thread_delete_list; te; te = te_next) {
 		delete_thread_entry(te->te_thread);
 
 		te_next = te->te_next;
-		te->te_next = thread_entry_freelist;
-		thread_entry_freelist = te;
-
-		count++;
+		pool_put(&thread_entry_pool, te);
 	}
 	thread_delete_list = 0;
 }
@@ -1422,14 +2245,10 @@ gc_reset_entries(void)
 {
 	thread_entry_t te;
 	thread_entry_t te_next;
-	int count = 0;
 
 	for (te = thread_reset_list; te; te = te_next) {
 		te_next = te->te_next;
-		te->te_next = thread_entry_freelist;
-		thread_entry_freelist = te;
-
-		count++;
+		pool_put(&thread_entry_pool, te);
 	}
 	thread_reset_list = 0;
 }
@@ -1439,7 +2258,6 @@ reset_thread_names(void)
 {
 	thread_entry_t te;
 	thread_entry_t te_next;
-	int count = 0;
 
 	for (te = thread_reset_list; te; te = te_next) {
 		threadmap_t     tme;
@@ -1452,10 +2270,7 @@ reset_thread_names(void)
 			}
 		}
 		te_next = te->te_next;
-		te->te_next = thread_entry_freelist;
-		thread_entry_freelist = te;
-
-		count++;
+		pool_put(&thread_entry_pool, te);
 	}
 	thread_reset_list = 0;
 }
@@ -1463,45 +2278,37 @@ reset_thread_names(void)
 static void
 delete_all_thread_entries(void)
 {
-	threadmap_t tme = 0;
-	threadmap_t tme_next = 0;
-	int i;
+	struct kdc_threads_walk w;
+	threadmap_t tme;
 
-	for (i = 0; i < HASH_SIZE; i++) {
-		for (tme = threadmap_hash[i]; tme; tme = tme_next) {
-			tme_next = tme->tm_next;
-                        tme->tm_next = threadmap_freelist;
-			threadmap_freelist = tme;
-		}
-		threadmap_hash[i] = 0;
+	kdc_threads_walk_start(&threadmap_table, &w);
+
+	while ((tme = kdc_threads_next(&threadmap_table, &w))) {
+		tme->tm_next = threadmap_freelist;
+		threadmap_freelist = tme;
 	}
+	kdc_threads_clear(&threadmap_table);
 }
 
 static void
 insert_run_event(uint64_t thread, int priority, kd_buf *kd, uint64_t now)
 {
+	threadrun_t	*bucket = (threadrun_t *)table_bucket(&run_table, thread);
 	threadrun_t	trp;
 
-	int hashid = thread & HASH_MASK;
-
-	for (trp = threadrun_hash[hashid]; trp; trp = trp->tr_next) {
+	for (trp = *bucket; trp; trp = trp->tr_next) {
 		if (trp->tr_thread == thread) {
 			break;
 		}
 	}
 	if (trp == NULL) {
-		if ((trp = threadrun_freelist)) {
-			threadrun_freelist = trp->tr_next;
-		} else {
-			trp = (threadrun_t)malloc(sizeof(struct threadrun));
+		if ((trp = pool_get(&run_table.et_pool)) == NULL) {
+			return;
 		}
-
 		trp->tr_thread = thread;
 
-		trp->tr_next = threadrun_hash[hashid];
-		threadrun_hash[hashid] = trp;
-
-		add_thread_entry_to_list(&thread_run_list, thread);
+		trp->tr_next = *bucket;
+		*bucket = trp;
 	}
 	trp->tr_entry = kd;
 	trp->tr_timestamp = now;
@@ -1512,9 +2319,8 @@ static threadrun_t
 find_run_event(uint64_t thread)
 {
 	threadrun_t trp;
-	int hashid = thread & HASH_MASK;
 
-	for (trp = threadrun_hash[hashid]; trp; trp = trp->tr_next) {
+	for (trp = *(threadrun_t *)table_bucket(&run_table, thread); trp; trp = trp->tr_next) {
 		if (trp->tr_thread == thread) {
 			return trp;
 		}
@@ -1525,14 +2331,13 @@ find_run_event(uint64_t thread)
 static void
 delete_run_event(uint64_t thread)
 {
+	threadrun_t	*bucket = (threadrun_t *)table_bucket(&run_table, thread);
 	threadrun_t	trp = 0;
 	threadrun_t trp_prev;
 
-	int hashid = thread & HASH_MASK;
-
-	if ((trp = threadrun_hash[hashid])) {
+	if ((trp = *bucket)) {
 		if (trp->tr_thread == thread) {
-			threadrun_hash[hashid] = trp->tr_next;
+			*bucket = trp->tr_next;
 		} else {
 			trp_prev = trp;
 
@@ -1545,8 +2350,7 @@ delete_run_event(uint64_t thread)
 			}
 		}
 		if (trp) {
-			trp->tr_next = threadrun_freelist;
-			threadrun_freelist = trp;
+			pool_put(&run_table.et_pool, trp);
 		}
 	}
 }
@@ -1554,28 +2358,7 @@ delete_run_event(uint64_t thread)
 static void
 gc_run_events(void)
 {
-	thread_entry_t te;
-	thread_entry_t te_next;
-	threadrun_t	trp;
-	threadrun_t	trp_next;
-	int count = 0;
-
-	for (te = thread_run_list; te; te = te_next) {
-		int hashid = te->te_thread & HASH_MASK;
-
-		for (trp = threadrun_hash[hashid]; trp; trp = trp_next) {
-			trp_next = trp->tr_next;
-			trp->tr_next = threadrun_freelist;
-			threadrun_freelist = trp;
-			count++;
-		}
-		threadrun_hash[hashid] = 0;
-
-		te_next = te->te_next;
-		te->te_next = thread_entry_freelist;
-		thread_entry_freelist = te;
-	}
-	thread_run_list = 0;
+	pool_reset(&run_table.et_pool);
 }
 
 
@@ -1583,67 +2366,34 @@ gc_run_events(void)
 static void
 insert_start_event(uint64_t thread, int type, uint64_t now)
 {
-	event_t evp;
-
-	int hashid = thread & HASH_MASK;
+	struct kdc_start **bucket = (struct kdc_start **)table_bucket(&start_table, thread);
+	struct kdc_start *evp;
 
-	for (evp = event_hash[hashid]; evp; evp = evp->ev_next) {
-		if (evp->ev_thread == thread && evp->ev_type == type) {
-			break;
-		}
+	if ((evp = kdc_start_find(*bucket, thread, type))) {
+		evp->timestamp = now;
+		return;
 	}
-	if (evp == NULL) {
-		if ((evp = event_freelist)) {
-			event_freelist = evp->ev_next;
-		} else {
-			evp = (event_t)malloc(sizeof(struct event));
-		}
-
-		evp->ev_thread = thread;
-		evp->ev_type = type;
-
-		evp->ev_next = event_hash[hashid];
-		event_hash[hashid] = evp;
-
-		add_thread_entry_to_list(&thread_event_list, thread);
+	if ((evp = pool_get(&start_table.et_pool)) == NULL) {
+		return;
 	}
-	evp->ev_timestamp = now;
+	kdc_start_push(bucket, evp, thread, type, now);
 }
 
 
 static uint64_t
 consume_start_event(uint64_t thread, int type, uint64_t now)
 {
-	event_t evp;
-	event_t evp_prev;
+	struct kdc_start *evp;
 	uint64_t elapsed = 0;
 
-	int hashid = thread & HASH_MASK;
-
-	if ((evp = event_hash[hashid])) {
-		if (evp->ev_thread == thread && evp->ev_type == type) {
-			event_hash[hashid] = evp->ev_next;
-		} else {
-			evp_prev = evp;
-
-			for (evp = evp->ev_next; evp; evp = evp->ev_next) {
-				if (evp->ev_thread == thread && evp->ev_type == type) {
-					evp_prev->ev_next = evp->ev_next;
-					break;
-				}
-				evp_prev = evp;
-			}
-		}
-		if (evp) {
-			elapsed = now - evp->ev_timestamp;
+	if ((evp = kdc_start_take((struct kdc_start **)table_bucket(&start_table, thread), thread, type))) {
+		elapsed = now - evp->timestamp;
 
-			if (now < evp->ev_timestamp) {
-				printf("consume: now = %qd,  timestamp = %qd\n", now, evp->ev_timestamp);
-				elapsed = 0;
-			}
-			evp->ev_next = event_freelist;
-			event_freelist = evp;
+		if (now < evp->timestamp) {
+			printf("consume: now = %qd,  timestamp = %qd\n", now, evp->timestamp);
+			elapsed = 0;
 		}
+		pool_put(&start_table.et_pool, evp);
 	}
 	return elapsed;
 }
@@ -1651,45 +2401,20 @@ consume_start_event(uint64_t thread, int type, uint64_t now)
 static void
 gc_start_events(void)
 {
-	thread_entry_t	te;
-	thread_entry_t	te_next;
-	event_t         evp;
-	event_t         evp_next;
-	int		count = 0;
-        int		hashid;
-
-	for (te = thread_event_list; te; te = te_next) {
-
-		hashid = te->te_thread & HASH_MASK;
-
-		for (evp = event_hash[hashid]; evp; evp = evp_next) {
-			evp_next = evp->ev_next;
-                        evp->ev_next = event_freelist;
-                        event_freelist = evp;
-			count++;
-		}
-		event_hash[hashid] = 0;
-
-		te_next = te->te_next;
-		te->te_next = thread_entry_freelist;
-		thread_entry_freelist = te;
-	}
-	thread_event_list = 0;
+	pool_reset(&start_table.et_pool);
 }
 
 static int
 thread_in_user_mode(uint64_t thread, char *command)
 {
-	event_t evp;
+	struct kdc_start *evp;
 
 	if (strcmp(command, "kernel_task") == 0) {
 		return 0;
 	}
 
-	int hashid = thread & HASH_MASK;
-
-	for (evp = event_hash[hashid]; evp; evp = evp->ev_next) {
-		if (evp->ev_thread == thread) {
+	for (evp = *(struct kdc_start **)table_bucket(&start_table, thread); evp; evp = evp->next) {
+		if (evp->thread == thread) {
 			return 0;
 		}
 	}
@@ -1699,16 +2424,15 @@ thread_in_user_mode(uint64_t thread, char *command)
 static lookup_t
 handle_lookup_event(uint64_t thread, int debugid, kd_buf *kdp)
 {
+	lookup_t *bucket = (lookup_t *)table_bucket(&lookup_table, thread);
 	lookup_t lkp;
 	boolean_t first_record = FALSE;
 
-	int hashid = thread & HASH_MASK;
-
 	if (debugid & DBG_FUNC_START) {
 		first_record = TRUE;
 	}
 
-	for (lkp = lookup_hash[hashid]; lkp; lkp = lkp->lk_next) {
+	for (lkp = *bucket; lkp; lkp = lkp->lk_next) {
 		if (lkp->lk_thread == thread) {
 			break;
 		}
@@ -1718,18 +2442,13 @@ handle_lookup_event(uint64_t thread, int debugid, kd_buf *kdp)
 			return 0;
 		}
 
-		if ((lkp = lookup_freelist)) {
-			lookup_freelist = lkp->lk_next;
-		} else {
-			lkp = (lookup_t)malloc(sizeof(struct lookup));
+		if ((lkp = pool_get(&lookup_table.et_pool)) == NULL) {
+			return 0;
 		}
-
 		lkp->lk_thread = thread;
 
-		lkp->lk_next = lookup_hash[hashid];
-		lookup_hash[hashid] = lkp;
-
-		add_thread_entry_to_list(&thread_lookup_list, thread);
+		lkp->lk_next = *bucket;
+		*bucket = lkp;
 	}
 
 	if (first_record == TRUE) {
@@ -1756,15 +2475,13 @@ handle_lookup_event(uint64_t thread, int debugid, kd_buf *kdp)
 static void
 delete_lookup_event(uint64_t thread, lookup_t lkp_to_delete)
 {
+	lookup_t	*bucket = (lookup_t *)table_bucket(&lookup_table, thread);
 	lookup_t	lkp;
 	lookup_t	lkp_prev;
-	int		hashid;
 
-	hashid = thread & HASH_MASK;
-
-	if ((lkp = lookup_hash[hashid])) {
+	if ((lkp = *bucket)) {
 		if (lkp == lkp_to_delete) {
-			lookup_hash[hashid] = lkp->lk_next;
+			*bucket = lkp->lk_next;
 		} else {
 			lkp_prev = lkp;
 
@@ -1777,8 +2494,7 @@ delete_lookup_event(uint64_t thread, lookup_t lkp_to_delete)
 			}
 		}
 		if (lkp) {
-			lkp->lk_next = lookup_freelist;
-			lookup_freelist = lkp;
+			pool_put(&lookup_table.et_pool, lkp);
 		}
 	}
 }
@@ -1786,35 +2502,76 @@ delete_lookup_event(uint64_t thread, lookup_t lkp_to_delete)
 static void
 gc_lookup_events(void)
 {
-	thread_entry_t	te;
-	thread_entry_t	te_next;
-	lookup_t	lkp;
-	lookup_t	lkp_next;
-	int		count = 0;
-        int		hashid;
+	pool_reset(&lookup_table.et_pool);
+}
 
-	for (te = thread_lookup_list; te; te = te_next) {
-		hashid = te->te_thread & HASH_MASK;
+static void *
+pool_get(struct pool *p)
+{
+	void	*entry;
+	char	**blocks;
 
-		for (lkp = lookup_hash[hashid]; lkp; lkp = lkp_next) {
-			lkp_next = lkp->lk_next;
-                        lkp->lk_next = lookup_freelist;
-                        lookup_freelist = lkp;
-			count++;
+	if ((entry = p->p_free)) {
+		p->p_free = *(void **)entry;
+	} else {
+		if (p->p_used == p->p_nblocks * POOL_BLOCK_ENTRIES) {
+			if (p->p_used >= POOL_MAX_ENTRIES) {
+				p->p_dropped++;
+				return NULL;
+			}
+			if ((blocks = realloc(p->p_blocks, (p->p_nblocks + 1) * sizeof(char *))) == NULL ||
+			    (blocks[p->p_nblocks] = malloc(POOL_BLOCK_ENTRIES * p->p_entry_size)) == NULL) {
+				quit("can't allocate memory for event tables\n");
+			}
+			p->p_blocks = blocks;
+			p->p_nblocks++;
 		}
-		lookup_hash[hashid] = 0;
+		entry = p->p_blocks[p->p_used / POOL_BLOCK_ENTRIES] + (p->p_used % POOL_BLOCK_ENTRIES) * p->p_entry_size;
+		p->p_used++;
+	}
+	if (++p->p_in_use > p->p_peak) {
+		p->p_peak = p->p_in_use;
+	}
+	return entry;
+}
 
-		te_next = te->te_next;
-		te->te_next = thread_entry_freelist;
-		thread_entry_freelist = te;
+static void
+pool_put(struct pool *p, void *entry)
+{
+	*(void **)entry = p->p_free;
+	p->p_free = entry;
+	p->p_in_use--;
+}
+
+/*
+ * Take back every entry, keeping the blocks for reuse.
+ */
+static void
+pool_reset(struct pool *p)
+{
+	p->p_used = 0;
+	p->p_free = NULL;
+	p->p_in_use = 0;
+	p->p_generation++;
+}
+
+static void **
+table_bucket(struct event_table *t, uint64_t thread)
+{
+	int hashid = thread & HASH_MASK;
+
+	if (t->et_gen[hashid] != t->et_pool.p_generation) {
+		t->et_gen[hashid] = t->et_pool.p_generation;
+		t->et_hash[hashid] = NULL;
 	}
-	thread_lookup_list = 0;
+	return &t->et_hash[hashid];
 }
 
 int
 sample_sc(void)
 {
 	kd_buf	*kd, *end_of_sample;
+	uint64_t gc_start;
 	int	keep_going = 1;
 	int	i;
 	ssize_t	count;
@@ -1833,7 +2590,7 @@ sample_sc(void)
 	if (RAW_flag) {
 		ssize_t bytes_read;
 
-		bytes_read = read(RAW_fd, my_buffer, num_entries * sizeof(kd_buf));
+		bytes_read = kdc_raw_read(&RAW_input, my_buffer, num_entries * sizeof(kd_buf));
 
 		if (bytes_read == -1) {
 			perror("read failed");
@@ -1852,10 +2609,9 @@ sample_sc(void)
 		}
 
 	} else {
-		int mib[] = { CTL_KERN, KERN_KDEBUG, KERN_KDREADTR };
 		size_t needed = bufinfo.nkdbufs * sizeof(kd_buf);
 
-		if (sysctl(mib, ARRAYSIZE(mib), my_buffer, &needed, NULL, 0) < 0) {
+		if (kdc_readtr(my_buffer, &needed) < 0) {
 			quit("trace facility failure, KERN_KDREADTR\n");
 		}
 
@@ -1881,6 +2637,7 @@ sample_sc(void)
 	for (i = 0; i < num_cpus; i++) {
 	      last_decrementer_kd[i] = (kd_buf *)my_buffer;
 	}
+	capture.next = (kd_buf *)my_buffer;
 
 	for (kd = (kd_buf *)my_buffer; kd < end_of_sample; kd++) {
 		kd_buf *kd_start;
@@ -1896,11 +2653,16 @@ sample_sc(void)
 			int cpunum = CPU_NUMBER(kd);
 			double i_latency = handle_decrementer(kd, cpunum);
 
-			if (log_fp) {
+			if (log_fp || capture.fd != -1) {
 				if (i_thresh_hold && (int)i_latency > i_thresh_hold) {
 					kd_start = last_decrementer_kd[cpunum];
 
-					log_decrementer(kd_start, kd, end_of_sample, i_latency);
+					if (capture.fd != -1) {
+						capture_trigger(kd);
+					}
+					if (log_fp) {
+						log_decrementer(kd_start, kd, end_of_sample, i_latency);
+					}
 				}
 				last_decrementer_kd[cpunum] = kd;
 			}
@@ -1908,25 +2670,41 @@ sample_sc(void)
 			double s_latency;
 			int s_priority;
 			if (check_for_scheduler_latency(type, &thread, now, kd, &kd_start, &s_priority, &s_latency)) {
-				log_scheduler(kd_start, kd, end_of_sample, s_priority, s_latency, thread);
+				if (capture.fd != -1) {
+					capture_trigger(kd);
+				}
+				if (log_fp) {
+					log_scheduler(kd_start, kd, end_of_sample, s_priority, s_latency, thread);
+				}
 			}
 		}
 	}
+	if (capture.fd != -1) {
+		capture_end_of_sample(end_of_sample);
+	}
 	if (log_fp) {
 		fflush(log_fp);
 	}
 
+	gc_start = mach_absolute_time();
+
 	gc_thread_entries();
 	gc_reset_entries();
 	gc_run_events();
 
+	gc_time += mach_absolute_time() - gc_start;
+	gc_count++;
+
+	if (!RAW_flag) {
+		sample_adapt(count, bufinfo.flags & KDBG_WRAPPED);
+	}
 	return keep_going;
 }
 
 void
 enter_syscall(FILE *fp, kd_buf *kd, uint64_t thread, int type, char *command, uint64_t now, uint64_t idelta, uint64_t start_bias, int print_info)
 {
-	char	*p;
+	const char	*p;
 	double	timestamp;
 	double	delta;
 	char	pcstring[128];
@@ -1973,7 +2751,7 @@ enter_syscall(FILE *fp, kd_buf *kd, uint64_t thread, int type, char *command, ui
 void
 exit_syscall(FILE *fp, kd_buf *kd, uint64_t thread, int type, char *command, uint64_t now, uint64_t idelta, uint64_t start_bias, int print_info)
 {
-	char   *p;
+	const char   *p;
 	uint64_t user_addr;
 	double	timestamp;
 	double	delta;
@@ -2014,7 +2792,7 @@ exit_syscall(FILE *fp, kd_buf *kd, uint64_t thread, int type, char *command, uin
 void
 print_entry(FILE *fp, kd_buf *kd, uint64_t thread, int type, char *command, uint64_t now, uint64_t idelta, uint64_t start_bias, kd_buf *kd_note)
 {
-	char	*p;
+	const char	*p;
 
 	if (!fp) {
 		return;
@@ -2279,8 +3057,13 @@ log_range(kd_buf *kd_buffer, kd_buf *kd_start, kd_buf *kd_stop, kd_buf *kd_note,
 			}
 		}
 	}
+	gc_start = mach_absolute_time();
+
 	gc_start_events();
 	gc_lookup_events();
+
+	gc_time += mach_absolute_time() - gc_start;
+	gc_count++;
 }
 
 kd_buf *
@@ -2414,7 +3197,7 @@ check_for_scheduler_latency(int type, uint64_t *thread, uint64_t now, kd_buf *kd
 	int found_latency = 0;
 
 	if (type == MACH_makerunnable) {
-		if (watch_priority_min <= kd->arg2 && kd->arg2 <= watch_priority_max) {
+		if (wait_accounting || (watch_priority_min <= kd->arg2 && kd->arg2 <= watch_priority_max)) {
 			insert_run_event(kd->arg1, (int)kd->arg2, kd, now);
 		}
 	} else if (type == MACH_sched || type == MACH_stkhandoff) {
@@ -2424,10 +3207,23 @@ check_for_scheduler_latency(int type, uint64_t *thread, uint64_t now, kd_buf *kd
 			*thread = kd->arg2;
 		}
 
+		if (wait_accounting) {
+			account_wait(*thread, trp, now);
+		}
 		if ((trp = find_run_event(*thread))) {
 			double d_s_latency = (((double)(now - trp->tr_timestamp)) / divisor);
 			int s_latency = (int)d_s_latency;
 
+			if (trp->tr_priority < watch_priority_min || trp->tr_priority > watch_priority_max) {
+				s_latency = 0;
+			}
+			/*
+			 * Every wakeup goes in the histogram, including the ones
+			 * under a microsecond that the bins below leave out.
+			 */
+			if (trp->tr_priority >= 0 && trp->tr_priority < LAT_PRIORITIES) {
+				lat_hist_add(&s_hist[trp->tr_priority], d_s_latency);
+			}
 			if (s_latency) {
 				if (s_latency < 100) {
 					s_usec_10_bins[s_latency/10]++;
@@ -2454,7 +3250,7 @@ check_for_scheduler_latency(int type, uint64_t *thread, uint64_t now, kd_buf *kd
 				if (s_thresh_hold && s_latency > s_thresh_hold) {
 					s_exceeded_threshold++;
 
-					if (log_fp) {
+					if (log_fp || capture.fd != -1) {
 						*kd_start = trp->tr_entry;
 						*priority = trp->tr_priority;
 						*latency = d_s_latency;
@@ -2475,17 +3271,20 @@ handle_decrementer(kd_buf *kd, int cpunum)
 	double latency;
 	long   elapsed_usecs;
 
+	if ((long)(kd->arg1) >= 0) {
+		latency = 1;
+	} else {
+		latency = (((double)(-1 - kd->arg1)) / divisor);
+	}
+	if (cpunum < num_cpus) {
+		lat_hist_add(&i_hist[cpunum], latency);
+	}
 	if (i_latency_per_cpu == FALSE) {
 		cpunum = 0;
 	}
 
 	il = &i_lat[cpunum];
 
-	if ((long)(kd->arg1) >= 0) {
-		latency = 1;
-	} else {
-		latency = (((double)(-1 - kd->arg1)) / divisor);
-	}
 	elapsed_usecs = (long)latency;
 
 	if (elapsed_usecs < 100) {
@@ -2511,181 +3310,410 @@ handle_decrementer(kd_buf *kd, int cpunum)
 	if (elapsed_usecs > il->i_max_latency) {
 	        il->i_max_latency = elapsed_usecs;
 	}
-	if (elapsed_usecs < il->i_min_latency || il->i_total_samples == 0) {
-	        il->i_min_latency = elapsed_usecs;
+	if (elapsed_usecs < il->i_min_latency || il->i_total_samples == 0) {
+	        il->i_min_latency = elapsed_usecs;
+	}
+	il->i_total_latency += elapsed_usecs;
+	il->i_total_samples++;
+
+	return latency;
+}
+
+const char *
+find_code(int type)
+{
+	return kdc_codes_lookup(&codes, (uint32_t)type);
+}
+
+void
+init_code_file(void)
+{
+	const char *files[1] = { code_file };
+	char	*key;
+	size_t	key_size;
+	FILE	*fp;
+	size_t	i;
+
+	if (kdc_codes_cache_key(files, 1, &key, &key_size) < 0) {
+		key = NULL;
+	} else if (kdc_codes_cache_load(&codes, key, key_size) == 0) {
+		free(key);
+		return;
+	}
+	if ((fp = fopen(code_file, "r")) == NULL) {
+		if (log_fp) {
+			fprintf(log_fp, "open of %s failed\n", code_file);
+		}
+		free(key);
+		return;
+	}
+	for (i = 0; ; i++) {
+		unsigned int code;
+		char name[128];
+		int n = fscanf(fp, "%x%127s\n", &code, name);
+
+		if (n == 1 && i == 0) {
+			/*
+			 * old code file format, just skip
+			 */
+			continue;
+		}
+		if (n != 2) {
+			break;
+		}
+		if (kdc_codes_add(&codes, code, name) < 0) {
+			quit("can't allocate memory for the code table\n");
+		}
+	}
+	fclose(fp);
+
+	if (kdc_codes_compile(&codes) < 0) {
+		quit("can't allocate memory for the code table\n");
+	}
+	/*
+	 * Failing to save it is not fatal; the code file is just parsed
+	 * again next time.
+	 */
+	if (key && codes.names_size) {
+		(void)kdc_codes_cache_save(&codes, key, key_size);
+	}
+	free(key);
+}
+
+/*
+ * Find the 64-bit Mach-O for this machine in the kernel file, which may
+ * be fat.
+ */
+static const struct mach_header_64 *
+kernel_macho(const char *map, size_t size)
+{
+	const struct fat_header *fh = (const struct fat_header *)(const void *)map;
+	const struct fat_arch *fa;
+	const struct mach_header_64 *mh;
+	uint32_t i, nfat;
+
+	if (size < sizeof(struct mach_header_64))
+		return NULL;
+
+	if (OSSwapBigToHostInt32(fh->magic) == FAT_MAGIC) {
+		nfat = OSSwapBigToHostInt32(fh->nfat_arch);
+		fa = (const struct fat_arch *)(const void *)(fh + 1);
+
+		if (sizeof(*fh) + (size_t)nfat * sizeof(*fa) > size)
+			return NULL;
+
+		for (i = 0; i < nfat; i++, fa++) {
+#if defined(__arm64__)
+			if ((cpu_type_t)OSSwapBigToHostInt32(fa->cputype) != CPU_TYPE_ARM64)
+				continue;
+#else
+			if ((cpu_type_t)OSSwapBigToHostInt32(fa->cputype) != CPU_TYPE_X86_64)
+				continue;
+#endif
+			if ((size_t)OSSwapBigToHostInt32(fa->offset) + OSSwapBigToHostInt32(fa->size) > size)
+				return NULL;
+			map += OSSwapBigToHostInt32(fa->offset);
+			size = OSSwapBigToHostInt32(fa->size);
+			break;
+		}
+		if (i == nfat)
+			return NULL;
+	}
+	mh = (const struct mach_header_64 *)(const void *)map;
+
+	if (size < sizeof(*mh) || mh->magic != MH_MAGIC_64 || sizeof(*mh) + mh->sizeofcmds > size)
+		return NULL;
+
+	return mh;
+}
+
+/*
+ * Fill in kern_sym_tbl from the __TEXT,__text symbols of the kernel at mh,
+ * unless uuid says they are already there from the cache.  Return -1 if
+ * the kernel doesn't have what is needed.
+ */
+static int
+kernel_symtab(const struct mach_header_64 *mh, size_t size, uuid_t uuid)
+{
+	const char *base = (const char *)mh;
+	const struct load_command *lc;
+	const struct symtab_command *st = NULL;
+	const struct segment_command_64 *sg;
+	const struct section_64 *sect;
+	const struct nlist_64 *nl;
+	const char *strtab;
+	uint32_t i, j, nsect = 0, text_sect = 0, names_size = 0;
+	int count;
+	char *p;
+
+	uuid_clear(uuid);
+	lc = (const struct load_command *)(const void *)(mh + 1);
+
+	for (i = 0; i < mh->ncmds; i++) {
+		if ((const char *)lc + sizeof(*lc) > base + sizeof(*mh) + mh->sizeofcmds || lc->cmdsize < sizeof(*lc))
+			return -1;
+
+		switch (lc->cmd) {
+		case LC_UUID:
+			memcpy(uuid, ((const struct uuid_command *)(const void *)lc)->uuid, sizeof(uuid_t));
+			break;
+
+		case LC_SYMTAB:
+			st = (const struct symtab_command *)(const void *)lc;
+			break;
+
+		case LC_SEGMENT_64:
+			/* sections are numbered from 1 across all the segments */
+			sg = (const struct segment_command_64 *)(const void *)lc;
+			sect = (const struct section_64 *)(const void *)(sg + 1);
+
+			if (sizeof(*sg) + (size_t)sg->nsects * sizeof(*sect) > lc->cmdsize)
+				return -1;
+
+			for (j = 0; j < sg->nsects; j++, sect++) {
+				nsect++;
+
+				if (strncmp(sect->segname, SEG_TEXT, sizeof(sect->segname)) == 0 &&
+				    strncmp(sect->sectname, SECT_TEXT, sizeof(sect->sectname)) == 0)
+					text_sect = nsect;
+			}
+			break;
+		}
+		lc = (const struct load_command *)(const void *)((const char *)lc + lc->cmdsize);
+	}
+	if (st == NULL || text_sect == 0 ||
+	    st->symoff + (size_t)st->nsyms * sizeof(*nl) > size || st->stroff + (size_t)st->strsize > size)
+		return -1;
+
+	if (ksym_cache_load(uuid) == 0)
+		return 0;
+
+	nl = (const struct nlist_64 *)(const void *)(base + st->symoff);
+	strtab = base + st->stroff;
+
+	for (count = 0, i = 0; i < st->nsyms; i++) {
+		if ((nl[i].n_type & (N_STAB | N_TYPE)) != N_SECT || nl[i].n_sect != text_sect ||
+		    nl[i].n_un.n_strx == 0 || nl[i].n_un.n_strx >= st->strsize)
+			continue;
+		count++;
+		names_size += strnlen(strtab + nl[i].n_un.n_strx, st->strsize - nl[i].n_un.n_strx) + 1;
+	}
+	if (count == 0)
+		return -1;
+
+	if ((kern_sym_tbl = malloc(count * sizeof(kern_sym_t))) == NULL ||
+	    (kern_sym_names = malloc(names_size)) == NULL) {
+		/*
+		 * Hmmm, lets not treat this as fatal
+		 */
+		fprintf(stderr, "Can't allocate memory for kernel symbol table\n");
+		free(kern_sym_tbl);
+		kern_sym_tbl = NULL;
+		return 0;
+	}
+	p = kern_sym_names;
+
+	for (count = 0, i = 0; i < st->nsyms; i++) {
+		if ((nl[i].n_type & (N_STAB | N_TYPE)) != N_SECT || nl[i].n_sect != text_sect ||
+		    nl[i].n_un.n_strx == 0 || nl[i].n_un.n_strx >= st->strsize)
+			continue;
+
+		kern_sym_tbl[count].k_sym_addr = (void *)(uintptr_t)nl[i].n_value;
+		kern_sym_tbl[count].k_sym_len = strnlen(strtab + nl[i].n_un.n_strx, st->strsize - nl[i].n_un.n_strx);
+		kern_sym_tbl[count].k_sym_name = p;
+
+		memcpy(p, strtab + nl[i].n_un.n_strx, kern_sym_tbl[count].k_sym_len);
+		p += kern_sym_tbl[count].k_sym_len;
+		*p++ = '\0';
+		count++;
 	}
-	il->i_total_latency += elapsed_usecs;
-	il->i_total_samples++;
+	qsort(kern_sym_tbl, count, sizeof(kern_sym_t), ksym_compar);
+	kern_sym_count = count;
 
-	return latency;
+	if (!uuid_is_null(uuid))
+		ksym_cache_save(uuid);
+
+	return 0;
 }
 
-char *
-find_code(int type)
+static int
+ksym_compar(const void *p1, const void *p2)
 {
-	int i;
-	for (i = 0; i < num_of_codes; i++) {
-		if (codes_tab[i].type == type) {
-			return codes_tab[i].name;
-		}
-	}
-	return NULL;
+	const kern_sym_t *s1 = p1;
+	const kern_sym_t *s2 = p2;
+
+	if (s1->k_sym_addr != s2->k_sym_addr)
+		return ((uintptr_t)s1->k_sym_addr < (uintptr_t)s2->k_sym_addr) ? -1 : 1;
+	return strcmp(s1->k_sym_name, s2->k_sym_name);
 }
 
 void
-init_code_file(void)
+load_kernel_symbols(void)
 {
-	FILE *fp;
-	int i;
+	struct stat st;
+	const struct mach_header_64 *mh;
+	uuid_t uuid;
+	void *map;
+	int fd;
 
-	if ((fp = fopen(code_file, "r")) == NULL) {
-		if (log_fp) {
-			fprintf(log_fp, "open of %s failed\n", code_file);
-		}
+	if ((fd = open(kernelpath, O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+		/* Hmmm, let's not treat this as fatal */
+		fprintf(stderr, "Failed to open kernel [%s]\n", kernelpath);
+		if (fd != -1)
+			close(fd);
 		return;
 	}
-	for (i = 0; i < MAX_ENTRIES; i++) {
-		int code;
-		char name[128];
-		int n = fscanf(fp, "%x%127s\n", &code, name);
-
-		if (n == 1 && i == 0) {
-			/*
-			 * old code file format, just skip
-			 */
-			continue;
-		}
-		if (n != 2) {
-			break;
-		}
+	map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
 
-		strncpy(codes_tab[i].name, name, 32);
-		codes_tab[i].type = code;
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Failed to map kernel [%s]\n", kernelpath);
+		return;
 	}
-	num_of_codes = i;
-
-	fclose(fp);
+	if ((mh = kernel_macho(map, (size_t)st.st_size)) == NULL ||
+	    kernel_symtab(mh, (size_t)st.st_size - (size_t)((const char *)mh - (const char *)map), uuid) == -1) {
+		/*
+		 * Hmmm, lets not treat this as fatal
+		 */
+		fprintf(stderr, "No kernel symbol table \n");
+	}
+	munmap(map, (size_t)st.st_size);
 }
 
-void
-do_kernel_nm(void)
+int
+ksym_cache_path(char *path, size_t size)
 {
-	int i;
 	size_t len;
-	FILE *fp = NULL;
-	char tmp_nm_file[128];
-	char tmpstr[1024];
-	char inchr;
 
-	bzero(tmp_nm_file, 128);
-	bzero(tmpstr, 1024);
+	len = confstr(_CS_DARWIN_USER_CACHE_DIR, path, size);
 
-	/*
-	 * Build the temporary nm file path
-	 */
-	strcpy(tmp_nm_file,"/tmp/knm.out.XXXXXX");
+	if (len == 0 || len > size)
+		return -1;
 
-	if (!mktemp(tmp_nm_file)) {
-		fprintf(stderr, "Error in mktemp call\n");
-		return;
+	if (strlcat(path, KSYM_CACHE_NAME, size) >= size)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Use the cached symbols if they came from the kernel with this uuid.  The
+ * names stay mapped from the cache file.
+ */
+int
+ksym_cache_load(const uuid_t uuid)
+{
+	const struct ksym_cache_header *hdr;
+	const struct ksym_cache_entry *ce;
+	struct stat st;
+	char path[PATH_MAX];
+	char *addr;
+	size_t size;
+	uint32_t i;
+	int fd;
+
+	if (uuid_is_null(uuid) || ksym_cache_path(path, sizeof(path)) == -1)
+		return -1;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return -1;
+
+	if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(*hdr)) {
+		close(fd);
+		return -1;
 	}
+	size = (size_t)st.st_size;
 
-	/*
-	 * Build the nm command and create a tmp file with the output
-	 */
-	sprintf (tmpstr, "/usr/bin/nm -n %s -s __TEXT __text > %s",
-		 kernelpath, tmp_nm_file);
-	system(tmpstr);
+	addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
 
-	/*
-	 * Parse the output from the nm command
-	 */
-	if ((fp = fopen(tmp_nm_file, "r")) == NULL) {
-		/* Hmmm, let's not treat this as fatal */
-		fprintf(stderr, "Failed to open nm symbol file [%s]\n", tmp_nm_file);
-		return;
+	if (addr == MAP_FAILED)
+		return -1;
+
+	hdr = (const struct ksym_cache_header *)(const void *)addr;
+	ce = (const struct ksym_cache_entry *)(const void *)(hdr + 1);
+
+	if (hdr->magic != KSYM_CACHE_MAGIC || hdr->version != KSYM_CACHE_VERSION ||
+	    uuid_compare(hdr->uuid, uuid) != 0 || hdr->count == 0 || hdr->names_size == 0 ||
+	    size != sizeof(*hdr) + (size_t)hdr->count * sizeof(*ce) + hdr->names_size ||
+	    addr[size - 1] != '\0' ||
+	    (kern_sym_tbl = malloc(hdr->count * sizeof(kern_sym_t))) == NULL) {
+		munmap(addr, size);
+		return -1;
 	}
-	/*
-	 * Count the number of symbols in the nm symbol table
-	 */
-	kern_sym_count = 0;
+	kern_sym_names = (char *)(ce + hdr->count);
 
-	while ((inchr = getc(fp)) != -1) {
-		if (inchr == '\n') {
-			kern_sym_count++;
+	for (i = 0; i < hdr->count; i++) {
+		if (ce[i].name >= hdr->names_size || ce[i].len >= hdr->names_size - ce[i].name) {
+			free(kern_sym_tbl);
+			kern_sym_tbl = NULL;
+			kern_sym_names = NULL;
+			munmap(addr, size);
+			return -1;
 		}
+		kern_sym_tbl[i].k_sym_addr = (void *)(uintptr_t)ce[i].addr;
+		kern_sym_tbl[i].k_sym_name = kern_sym_names + ce[i].name;
+		kern_sym_tbl[i].k_sym_len = ce[i].len;
 	}
-	rewind(fp);
+	kern_sym_count = hdr->count;
 
-	/*
-	 * Malloc the space for symbol table
-	 */
-	if (kern_sym_count > 0) {
-		kern_sym_tbl = malloc(kern_sym_count * sizeof(kern_sym_t));
+	return 0;
+}
 
-		if (!kern_sym_tbl) {
-			/*
-			 * Hmmm, lets not treat this as fatal
-			 */
-			fprintf(stderr, "Can't allocate memory for kernel symbol table\n");
-		} else {
-			bzero(kern_sym_tbl, kern_sym_count * sizeof(kern_sym_t));
-		}
-	} else {
-		/*
-		 * Hmmm, lets not treat this as fatal
-		 */
-		fprintf(stderr, "No kernel symbol table \n");
-	}
-	for (i = 0; i < kern_sym_count; i++) {
-		bzero(tmpstr, 1024);
+/*
+ * Write the symbols out for the next run, replacing the cache file all at
+ * once.  Failing to is not fatal.
+ */
+void
+ksym_cache_save(const uuid_t uuid)
+{
+	struct ksym_cache_header hdr;
+	struct ksym_cache_entry ce;
+	char path[PATH_MAX];
+	char tmp_path[PATH_MAX];
+	FILE *fp;
+	int fd, i;
 
-		if (fscanf(fp, "%p %c %s", &kern_sym_tbl[i].k_sym_addr, &inchr, tmpstr) != 3) {
-			break;
-		} else {
-			len = strlen(tmpstr);
-			kern_sym_tbl[i].k_sym_name = malloc(len + 1);
+	if (ksym_cache_path(path, sizeof(path)) == -1)
+		return;
 
-			if (kern_sym_tbl[i].k_sym_name == NULL) {
-				fprintf(stderr, "Can't allocate memory for symbol name [%s]\n", tmpstr);
-				kern_sym_tbl[i].k_sym_name = NULL;
-				len = 0;
-			} else {
-				strcpy(kern_sym_tbl[i].k_sym_name, tmpstr);
-			}
+	snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
 
-			kern_sym_tbl[i].k_sym_len = len;
-		}
+	if ((fd = mkstemp(tmp_path)) == -1)
+		return;
+
+	if ((fp = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		unlink(tmp_path);
+		return;
 	}
-	if (i != kern_sym_count) {
-		/*
-		 * Hmmm, didn't build up entire table from nm
-		 * scrap the entire thing
-		 */
-		free(kern_sym_tbl);
-		kern_sym_tbl = NULL;
-		kern_sym_count = 0;
+	bzero(&hdr, sizeof(hdr));
+	hdr.magic = KSYM_CACHE_MAGIC;
+	hdr.version = KSYM_CACHE_VERSION;
+	uuid_copy(hdr.uuid, uuid);
+	hdr.count = kern_sym_count;
+	hdr.names_size = 0;
+
+	for (i = 0; i < kern_sym_count; i++)
+		hdr.names_size += kern_sym_tbl[i].k_sym_len + 1;
+
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+
+	for (i = 0, ce.name = 0; i < kern_sym_count; i++) {
+		ce.addr = (uint64_t)(uintptr_t)kern_sym_tbl[i].k_sym_addr;
+		ce.len = (uint32_t)kern_sym_tbl[i].k_sym_len;
+		fwrite(&ce, sizeof(ce), 1, fp);
+		ce.name += ce.len + 1;
 	}
-	fclose(fp);
+	for (i = 0; i < kern_sym_count; i++)
+		fwrite(kern_sym_tbl[i].k_sym_name, kern_sym_tbl[i].k_sym_len + 1, 1, fp);
 
-	/*
-	 * Remove the temporary nm file
-	 */
-	unlink(tmp_nm_file);
-#if 0
-	/*
-	 * Dump the kernel symbol table
-	 */
-	for (i = 0; i < kern_sym_count; i++) {
-		if (kern_sym_tbl[i].k_sym_name) {
-			printf ("[%d] %-16p    %s\n", i,
-				kern_sym_tbl[i].k_sym_addr, kern_sym_tbl[i].k_sym_name);
-		} else {
-			printf ("[%d] %-16p    %s\n", i,
-				kern_sym_tbl[i].k_sym_addr, "No symbol name");
-		}
+	if (ferror(fp) | fclose(fp)) {
+		unlink(tmp_path);
+		return;
 	}
-#endif
+	if (rename(tmp_path, path) == -1)
+		unlink(tmp_path);
 }
 
 void
@@ -2698,7 +3726,7 @@ pc_to_string(char *pcstring, uint64_t pc, int max_len, int mode)
 		sprintf(pcstring, "%-16" PRIx64 " [usermode addr]", pc);
 		return;
 	}
-	ret = binary_search(kern_sym_tbl, 0, kern_sym_count-1, pc);
+	ret = pc_to_symbol(pc);
 
 	if (ret == -1 || kern_sym_tbl[ret].k_sym_name == NULL) {
 		sprintf(pcstring, "%-16" PRIx64, pc);
@@ -2713,6 +3741,20 @@ pc_to_string(char *pcstring, uint64_t pc, int max_len, int mode)
 	sprintf(&pcstring[len], "+0x%-5" PRIx64, pc - (uint64_t)kern_sym_tbl[ret].k_sym_addr);
 }
 
+static int
+pc_to_symbol(uint64_t pc)
+{
+	struct pc_cache_entry *pce;
+
+	pce = &pc_cache[((pc >> 2) * 0x9e3779b97f4a7c15ULL) >> (64 - PC_CACHE_BITS)];
+
+	if (pce->pc != pc || pc == 0) {
+		pce->pc = pc;
+		pce->sym = binary_search(kern_sym_tbl, 0, kern_sym_count-1, pc);
+	}
+	return pce->sym;
+}
+
 
 /*
  * Return -1 if not found, else return index
@@ -2771,23 +3813,295 @@ open_logfile(const char *path)
 void
 open_rawfile(const char *path)
 {
-	RAW_fd = open(path, O_RDONLY);
+	int	fd;
+
+	fd = open(path, O_RDONLY);
 
-	if (RAW_fd == -1) {
+	if (fd == -1) {
 		/*
 		 * failed to open path
 		 */
 		fprintf(stderr, "latency: failed to open RAWfile [%s]\n", path);
 		exit_usage();
 	}
+	if ((fd = rawz_expand(fd, "latency", NULL)) == -1)
+		err(1, "%s", path);
+	kdc_raw_open(&RAW_input, fd);
+}
+
+static void
+capture_open(void)
+{
+	sigset_t	all, old;
+
+	if ((capture.fd = open(capture.path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+		fprintf(stderr, "latency: failed to open capture file [%s]\n", capture.path);
+		exit_usage();
+	}
+	capture.window = (uint64_t)((double)capture.window_msecs * 1000.0 * divisor);
+
+	/* the header is the only block that can take more than one chunk */
+	if (rawz_writer_open(&capture.rawz, capture.fd, CAPTURE_BLOCK_EVENTS * sizeof(kd_buf), NULL) != 0) {
+		quit("can't write capture file header\n");
+	}
+
+	/*
+	 * Leave the signals to the sampling thread.
+	 */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+
+	if (pthread_create(&capture.writer, NULL, capture_writer, NULL) != 0) {
+		quit("can't create capture writer thread\n");
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static void *
+capture_writer(void *arg __attribute__((unused)))
+{
+	struct capture_block *cb;
+
+	pthread_mutex_lock(&capture.lock);
+
+	for (;;) {
+		while (capture.head == NULL && !capture.done) {
+			pthread_cond_wait(&capture.cv, &capture.lock);
+		}
+		if ((cb = capture.head) == NULL) {
+			break;
+		}
+		if ((capture.head = cb->cb_next) == NULL) {
+			capture.tail = NULL;
+		}
+		capture.queued--;
+
+		pthread_mutex_unlock(&capture.lock);
+
+		if (capture.error == 0) {
+			capture.error = rawz_writer_write(&capture.rawz, cb->cb_data, cb->cb_len, cb->cb_first_timestamp);
+		}
+		free(cb);
+
+		pthread_mutex_lock(&capture.lock);
+	}
+	pthread_mutex_unlock(&capture.lock);
+
+	return NULL;
+}
+
+/*
+ * Hand a block to the writer, or drop it if the writer is too far behind.
+ * The signal handlers finish the capture, so they are held off while the
+ * lock is taken.
+ */
+static void
+capture_queue(struct capture_block *cb)
+{
+	sigset_t	all, old;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	pthread_mutex_lock(&capture.lock);
+
+	if (capture.queued >= CAPTURE_MAX_QUEUED) {
+		capture.dropped += cb->cb_len / sizeof(kd_buf);
+		free(cb);
+	} else {
+		cb->cb_next = NULL;
+
+		if (capture.tail) {
+			capture.tail->cb_next = cb;
+		} else {
+			capture.head = cb;
+		}
+		capture.tail = cb;
+		capture.queued++;
+
+		pthread_cond_signal(&capture.cv);
+	}
+	pthread_mutex_unlock(&capture.lock);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static struct capture_block *
+capture_new_block(void)
+{
+	struct capture_block *cb;
+
+	if ((cb = malloc(sizeof(struct capture_block))) == NULL) {
+		quit("can't allocate memory for capture\n");
+	}
+	cb->cb_len = 0;
+	cb->cb_first_timestamp = 0;
+
+	return cb;
+}
+
+/*
+ * The raw file header and thread map, padded to a page like trace writes
+ * them, with the time of day of the first event captured.
+ */
+static void
+capture_header(uint64_t first_timestamp)
+{
+	struct capture_block *cb;
+	RAW_header	header = {0};
+	size_t		size;
+	struct timeval	tv;
+	uint64_t	usecs;
+
+	size = sizeof(RAW_header) + capture.map_threads * sizeof(kd_threadmap);
+	size = (size + 4095) & ~4095;
+
+	if ((cb = malloc(sizeof(struct capture_block) + size)) == NULL) {
+		quit("can't allocate memory for capture\n");
+	}
+	if (RAW_flag) {
+		usecs = sample_TOD_secs * 1000000 + sample_TOD_usecs +
+			(uint64_t)((double)(first_timestamp - first_now) / divisor);
+	} else {
+		gettimeofday(&tv, NULL);
+		usecs = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec -
+			(uint64_t)((double)(mach_absolute_time() - first_timestamp) / divisor);
+	}
+	header.version_no = RAW_VERSION1;
+	header.thread_count = capture.map_threads;
+	header.TOD_secs = usecs / 1000000;
+	header.TOD_usecs = usecs % 1000000;
+
+	bzero(cb->cb_data, size);
+	memcpy(cb->cb_data, &header, sizeof(header));
+	memcpy(cb->cb_data + sizeof(header), capture.map, capture.map_threads * sizeof(kd_threadmap));
+
+	cb->cb_len = size;
+	cb->cb_first_timestamp = 0;
+
+	capture_queue(cb);
+	capture.started = TRUE;
+}
+
+/*
+ * Copy the events [from, to) into the capture blocks.
+ */
+static void
+capture_append(kd_buf *from, kd_buf *to)
+{
+	struct capture_block *cb;
+	size_t	n;
+
+	if (from >= to) {
+		return;
+	}
+	if (capture.started == FALSE) {
+		capture_header(from->timestamp & KDBG_TIMESTAMP_MASK);
+	}
+	while (from < to) {
+		if ((cb = capture.block) == NULL) {
+			cb = capture.block = capture_new_block();
+			cb->cb_first_timestamp = from->timestamp & KDBG_TIMESTAMP_MASK;
+		}
+		n = MIN((size_t)(to - from), CAPTURE_BLOCK_EVENTS - cb->cb_len / sizeof(kd_buf));
+
+		memcpy(cb->cb_data + cb->cb_len, from, n * sizeof(kd_buf));
+		cb->cb_len += n * sizeof(kd_buf);
+		capture.events += n;
+		from += n;
+
+		if (cb->cb_len == CAPTURE_BLOCK_EVENTS * sizeof(kd_buf)) {
+			capture_queue(cb);
+			capture.block = NULL;
+		}
+	}
+}
+
+/*
+ * Take whatever is still in the last trigger's window, then the events
+ * from the window before kd, which exceeded a threshold.
+ */
+static void
+capture_trigger(kd_buf *kd)
+{
+	uint64_t now = kd->timestamp & KDBG_TIMESTAMP_MASK;
+	kd_buf	*start;
+
+	capture.triggers++;
+
+	while (capture.next < kd && (capture.next->timestamp & KDBG_TIMESTAMP_MASK) <= capture.until) {
+		capture_append(capture.next, capture.next + 1);
+		capture.next++;
+	}
+	for (start = kd; start > capture.next; start--) {
+		if ((start[-1].timestamp & KDBG_TIMESTAMP_MASK) + capture.window < now) {
+			break;
+		}
+	}
+	capture_append(start, kd + 1);
+
+	capture.next = kd + 1;
+	capture.until = now + capture.window;
+}
+
+/*
+ * Take the rest of the window from this sample, and pass what's been
+ * copied on to the writer unless the window runs on into the next one.
+ */
+static void
+capture_end_of_sample(kd_buf *end_of_sample)
+{
+	kd_buf	*kd;
+
+	for (kd = capture.next; kd < end_of_sample; kd++) {
+		if ((kd->timestamp & KDBG_TIMESTAMP_MASK) > capture.until) {
+			break;
+		}
+	}
+	capture_append(capture.next, kd);
+
+	if (kd < end_of_sample && capture.block) {
+		capture_queue(capture.block);
+		capture.block = NULL;
+	}
+}
+
+/*
+ * Wait for the writer to write out what is queued, and close the file.
+ */
+static void
+capture_finish(void)
+{
+	int	rc;
+
+	if (capture.fd == -1) {
+		return;
+	}
+	if (capture.block) {
+		capture_queue(capture.block);
+		capture.block = NULL;
+	}
+	pthread_mutex_lock(&capture.lock);
+	capture.done = TRUE;
+	pthread_cond_signal(&capture.cv);
+	pthread_mutex_unlock(&capture.lock);
+
+	pthread_join(capture.writer, NULL);
+
+	rc = rawz_writer_finish(&capture.rawz);
+
+	if (capture.error || rc) {
+		fprintf(stderr, "latency: failed to write capture file [%s]: %s\n", capture.path,
+			strerror(capture.error ? capture.error : rc));
+	}
+	close(capture.fd);
+	capture.fd = -1;
 }
 
 void
 getdivisor(void)
 {
-	mach_timebase_info_data_t info;
+	struct kdc_timebase tb;
 
-	(void)mach_timebase_info(&info);
+	kdc_timebase_init(&tb);
 
-	divisor = ((double)info.denom / (double)info.numer) * 1000;
+	divisor = tb.divisor;
 }
@@ -85,6 +85,7 @@ __FBSDID("$FreeBSD: src/usr.bin/login/login.c,v 1.106 2007/07/04 00:00:40 scf Ex
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <time.h>
 #include <ttyent.h>
 #include <unistd.h>
 #ifdef __APPLE__
@@ -127,6 +128,7 @@ __FBSDID("$FreeBSD: src/usr.bin/login/login.c,v 1.106 2007/07/04 00:00:40 scf Ex
 
 #include "login.h"
 #include "pathnames.h"
+#include "startup_phase.h"
 
 #ifdef USE_PAM
 static int		 auth_pam(int skip_auth);
@@ -286,6 +288,7 @@ main(int argc, char *argv[])
 	(void)setpriority(PRIO_PROCESS, 0, 0);
 
 	openlog("login", LOG_ODELAY, LOG_AUTH);
+	startup_phase(NULL);
 
 	uid = getuid();
 	euid = geteuid();
@@ -402,6 +405,7 @@ main(int argc, char *argv[])
 	} else {
 		tid.at_port = 0;
 	}
+	startup_phase("audit terminal id");
 #endif /* USE_BSM_AUDIT */
 #endif /* __APPLE__ */
 
@@ -476,6 +480,7 @@ main(int argc, char *argv[])
 #endif
 			bail(NO_SLEEP_EXIT, 1);
 		}
+		startup_phase("PAM setup");
 #endif /* USE_PAM */
 
 		if (pwd != NULL && pwd->pw_uid == 0)
@@ -521,6 +526,7 @@ main(int argc, char *argv[])
 		} else {
 			rval = -1;
 		}
+		startup_phase("authentication");
 
 #ifdef __APPLE__
 #ifndef USE_PAM
@@ -594,6 +600,7 @@ main(int argc, char *argv[])
 	/* Audit successful login. */
 	if (auditsuccess)
 		au_login_success(fflag);
+	startup_phase("login audit");
 #endif
 
 #ifdef LOGIN_CAP
@@ -801,6 +808,7 @@ main(int argc, char *argv[])
 		bail(NO_SLEEP_EXIT, 1);
 	}
 	pam_session_established = 1;
+	startup_phase("PAM session");
 #endif /* USE_PAM */
 
 #ifdef __APPLE__
@@ -1043,6 +1051,7 @@ main(int argc, char *argv[])
 		err(1, "asprintf()");
 	}
 
+	startup_phase("shell setup");
 #ifdef __APPLE__
 	if (fflag && *argv) {
 		*argv = arg0;
@@ -43,6 +43,7 @@
 #include <os/overflow.h>
 
 #include "common.h"
+#include "proctab.h"
 
 #define ARRAYLEN(x) (sizeof((x))/sizeof((x[0])))
 
@@ -51,13 +52,95 @@ static int verbose;
 static int all_pids;
 static int ignore_empty;
 static int raw;
+static int summary;
 
 static char *self = "lskq";
 
+#define MAX_WORKERS 16
+
+/*
+ * knote counts of a kqueue or process, for -s
+ */
+struct kq_summary {
+	int knotes;
+	int active;
+	int queued;
+	int filters[ARRAYLEN(filt_strs)]; /* by -filter, 0 for unknown filters */
+};
+
+/*
+ * process name of a pid, cached for the duration of a scan
+ */
+struct pidname {
+	int pid;                        /* 0 for an empty slot */
+	bool found;
+	char name[2 * MAXCOMLEN + 1];
+};
+
+/*
+ * per-thread state for scanning processes
+ */
+struct scanner {
+	FILE *out;
+	FILE *errout;
+	kqueue_id_t *kqids;
+	int kqids_len;
+	struct kq_summary pid_total;
+	int *fdindex;                   /* index in fdlist of each fd, or -1 */
+	int fdindex_len;                /* allocated */
+	int fdindex_used;               /* highest fd of the process + 1 */
+	struct pidname *pidnames;       /* open addressed, power of 2 in size */
+	int pidnames_size;
+	int pidnames_count;
+	struct kevent_extinfo *knotes;  /* buffers reused across kqueues and pids */
+	int knotes_len;
+	struct proc_fdinfo *fds;
+	int fds_len;
+};
+
+/*
+ * largest buffers any worker has needed so far, so that the others start
+ * out big enough (racy, but only a hint)
+ */
+static int knotes_hint = 256;
+static int fds_hint = 256;
+static int kqids_hint = 256;
+
+/*
+ * make sure a scanner buffer holds at least want elements, and at least
+ * as many as any other worker needed
+ */
+static bool
+scan_reserve(void **bufp, int *lenp, int want, int *hintp, size_t elsize)
+{
+	int len = MAX(want, *hintp);
+
+	if (len <= *lenp) {
+		return true;
+	}
+	free(*bufp);
+	*bufp = malloc(elsize * len);
+	if (!*bufp) {
+		*lenp = 0;
+		return false;
+	}
+	*lenp = len;
+	if (len > *hintp) {
+		*hintp = len;
+	}
+	return true;
+}
+
+static void
+scan_perror(struct scanner *sc, const char *msg)
+{
+	fprintf(sc->errout, "%s: %s\n", msg, strerror(errno));
+}
+
 static inline const char *
 filt_name(int16_t filt)
 {
-	static char unkn_filt[32];
+	static __thread char unkn_filt[32];
 	int idx = -filt;
 	if (idx >= 0 && idx < ARRAYLEN(filt_strs)) {
 		return filt_strs[idx];
@@ -70,7 +153,7 @@ filt_name(int16_t filt)
 static inline const char *
 fdtype_str(uint32_t type)
 {
-	static char unkn_fdtype[32];
+	static __thread char unkn_fdtype[32];
 	if (type < ARRAYLEN(fdtype_strs)) {
 		return fdtype_strs[type];
 	} else {
@@ -205,21 +288,104 @@ thread_qos_name(uint8_t th_qos)
 }
 
 /*
- * find index of fd in a list of fdinfo of length nfds
+ * index a list of fdinfo of length nfds by fd number
  */
-static inline int
-fd_list_getfd(struct proc_fdinfo *fds, int nfds, int fd)
+static void
+fd_list_index(struct scanner *sc, struct proc_fdinfo *fds, int nfds)
 {
-	int i;
+	int i, maxfd = -1;
+
+	for (i = 0; i < nfds; i++) {
+		maxfd = MAX(maxfd, fds[i].proc_fd);
+	}
+	if (maxfd >= sc->fdindex_len) {
+		free(sc->fdindex);
+		sc->fdindex_len = maxfd + 1;
+		sc->fdindex = malloc(sizeof(int) * sc->fdindex_len);
+		os_assert(sc->fdindex != NULL);
+	}
+	sc->fdindex_used = maxfd + 1;
+	memset(sc->fdindex, 0xff, sizeof(int) * sc->fdindex_used);
 	for (i = 0; i < nfds; i++) {
-		if (fds[i].proc_fd == fd) {
-			return i;
+		if (fds[i].proc_fd >= 0) {
+			sc->fdindex[fds[i].proc_fd] = i;
 		}
 	}
+}
+
+/*
+ * find index of fd in the list of fdinfo indexed by fd_list_index()
+ */
+static inline int
+fd_list_getfd(struct scanner *sc, int fd)
+{
+	if (fd >= 0 && fd < sc->fdindex_used) {
+		return sc->fdindex[fd];
+	}
 
 	return -1;
 }
 
+static struct pidname *
+pidname_slot(struct scanner *sc, int pid)
+{
+	unsigned int i, mask = sc->pidnames_size - 1;
+
+	for (i = ((unsigned int)pid * 2654435761u) & mask; ; i = (i + 1) & mask) {
+		if (sc->pidnames[i].pid == pid || sc->pidnames[i].pid == 0) {
+			return &sc->pidnames[i];
+		}
+	}
+}
+
+/*
+ * look up the name of a process, or NULL if it isn't running
+ */
+static const char *
+pidname_lookup(struct scanner *sc, int pid, struct proc_bsdinfo *bsdinfo_in)
+{
+	struct pidname *pn, *old;
+	struct proc_bsdinfo bsdinfo;
+	int i, oldsize, ret;
+
+	if (pid <= 0) {
+		return NULL;
+	}
+
+	if (sc->pidnames_count >= sc->pidnames_size / 2) {
+		old = sc->pidnames;
+		oldsize = sc->pidnames_size;
+		sc->pidnames_size = oldsize ? oldsize * 2 : 256;
+		sc->pidnames = calloc(sc->pidnames_size, sizeof(struct pidname));
+		os_assert(sc->pidnames != NULL);
+		for (i = 0; i < oldsize; i++) {
+			if (old[i].pid) {
+				*pidname_slot(sc, old[i].pid) = old[i];
+			}
+		}
+		free(old);
+	}
+
+	pn = pidname_slot(sc, pid);
+	if (pn->pid == 0) {
+		if (!bsdinfo_in) {
+			ret = proc_pidinfo(pid, PROC_PIDTBSDINFO, 0, &bsdinfo, sizeof(bsdinfo));
+			pn->found = (ret == sizeof(bsdinfo));
+			bsdinfo_in = &bsdinfo;
+		} else {
+			pn->found = true;
+		}
+		if (pn->found) {
+			strlcpy(pn->name, strlen(bsdinfo_in->pbi_name) ?
+					bsdinfo_in->pbi_name : bsdinfo_in->pbi_comm, sizeof(pn->name));
+		}
+		pn->pid = pid;
+		sc->pidnames_count++;
+	}
+
+	return pn->found ? pn->name : NULL;
+}
+
 /*
  * left truncate URL-form process names
  */
@@ -242,10 +408,12 @@ shorten_procname(const char *proc, int width)
  * stringify knote ident where possible (signals, processes)
  */
 static void
-print_ident(uint64_t ident, int16_t filter, int width)
+print_ident(struct scanner *sc, uint64_t ident, int16_t filter, int width)
 {
+	FILE *out = sc->out;
+
 	if (raw) {
-		printf("%#*llx ", width, ident);
+		fprintf(out, "%#*llx ", width, ident);
 		return;
 	}
 
@@ -255,7 +423,7 @@ print_ident(uint64_t ident, int16_t filter, int width)
 	case EVFILT_PROC: {
 		char str[128] = "";
 		char num[128];
-		char out[128];
+		char name[128];
 		int numlen = sprintf(num, "%llu", ident);
 		int strwidth = width - numlen - 1; // add room for a space
 
@@ -264,73 +432,67 @@ print_ident(uint64_t ident, int16_t filter, int width)
 				snprintf(str, strwidth + 1, "%s", sig_strs[ident]);
 			}
 		} else {
-			/* FIXME: this should be cached */
-			struct proc_bsdinfo bsdinfo;
-			int ret = proc_pidinfo((int)ident, PROC_PIDTBSDINFO, 0, &bsdinfo, sizeof(bsdinfo));
-			if (ret == sizeof(bsdinfo)) {
-				char *procname = bsdinfo.pbi_name;
-				if (strlen(procname) == 0) {
-					procname = bsdinfo.pbi_comm;
-				}
+			const char *procname = pidname_lookup(sc, (int)ident, NULL);
+			if (procname) {
 				snprintf(str, strwidth + 1, "%s", shorten_procname(procname, strwidth));
 			}
 		}
 
 		if (str[0] != '\0') {
-			snprintf(out, width + 1, "%-*s %s", strwidth, str, num);
+			snprintf(name, width + 1, "%-*s %s", strwidth, str, num);
 		} else {
-			snprintf(out, width + 1, "%s", num);
+			snprintf(name, width + 1, "%s", num);
 		}
 
-		printf("%*s ", width, out);
+		fprintf(out, "%*s ", width, name);
 		break;
 	}
 
 	case EVFILT_MACHPORT:
 	case EVFILT_TIMER:
 		/* hex, to match lsmp */
-		printf("%#*llx ", width, ident);
+		fprintf(out, "%#*llx ", width, ident);
 		break;
 
 	case EVFILT_WORKLOOP:
-		printf("%#*llx ", width, ident);
+		fprintf(out, "%#*llx ", width, ident);
 		break;
 
 	default:
-		printf("%*llu ", width, ident);
+		fprintf(out, "%*llu ", width, ident);
 		break;
 	}
 
 }
 
 static void
-print_kqid(int state, uint64_t kqid)
+print_kqid(FILE *out, int state, uint64_t kqid)
 {
 	if (state & KQ_WORKQ) {
-		printf("%18s ", "wq");
+		fprintf(out, "%18s ", "wq");
 	} else if (state & KQ_WORKLOOP) {
-		printf("%#18" PRIx64 " ", kqid);
+		fprintf(out, "%#18" PRIx64 " ", kqid);
 	} else {
-		printf("fd %15" PRIi64 " ", kqid);
+		fprintf(out, "fd %15" PRIi64 " ", kqid);
 	}
 }
 
 #define PROCNAME_WIDTH 20
 
 static void
-print_kq_info(int pid, const char *procname, uint64_t kqid, int state)
+print_kq_info(FILE *out, int pid, const char *procname, uint64_t kqid, int state)
 {
 	if (raw) {
-		printf("%5u ", pid);
-		print_kqid(state, kqid);
-		printf("%#10x ", state);
+		fprintf(out, "%5u ", pid);
+		print_kqid(out, state, kqid);
+		fprintf(out, "%#10x ", state);
 	} else {
 		char tmpstr[PROCNAME_WIDTH+1];
 		strlcpy(tmpstr, shorten_procname(procname, PROCNAME_WIDTH), PROCNAME_WIDTH+1);
-		printf("%-*s ", PROCNAME_WIDTH, tmpstr);
-		printf("%5u ", pid);
-		print_kqid(state, kqid);
-		printf(" %c%c%c ",
+		fprintf(out, "%-*s ", PROCNAME_WIDTH, tmpstr);
+		fprintf(out, "%5u ", pid);
+		print_kqid(out, state, kqid);
+		fprintf(out, " %c%c%c ",
 				(state & KQ_SLEEP)    ? 'k' : '-',
 				(state & KQ_SEL)      ? 's' : '-',
 				(state & KQ_WORKQ)    ? 'q' :
@@ -339,6 +501,68 @@ print_kq_info(int pid, const char *procname, uint64_t kqid, int state)
 	}
 }
 
+static void
+print_summary(FILE *out, int pid, const char *procname, uint64_t kqid, int state,
+		struct kq_summary *sum, bool total)
+{
+	char tmpstr[PROCNAME_WIDTH+1];
+	int i;
+
+	strlcpy(tmpstr, shorten_procname(procname, PROCNAME_WIDTH), PROCNAME_WIDTH+1);
+	fprintf(out, "%-*s ", PROCNAME_WIDTH, tmpstr);
+	fprintf(out, "%5u ", pid);
+	if (total) {
+		fprintf(out, "%18s ", "total");
+	} else {
+		print_kqid(out, state, kqid);
+	}
+	fprintf(out, "%6d %6d %6d", sum->knotes, sum->active, sum->queued);
+	for (i = 1; i < ARRAYLEN(filt_strs); i++) {
+		if (sum->filters[i]) {
+			fprintf(out, " %s=%d", filt_strs[i], sum->filters[i]);
+		}
+	}
+	if (sum->filters[0]) {
+		fprintf(out, " other=%d", sum->filters[0]);
+	}
+	fprintf(out, "\n");
+}
+
+/*
+ * count the knotes of a kqueue by filter and state, and add them to the
+ * process total
+ */
+static void
+summarize_kqueue(struct scanner *sc, struct kevent_extinfo *kqextinfo, int nknotes,
+		struct kq_summary *sum)
+{
+	struct kq_summary *total = &sc->pid_total;
+	int i, idx;
+
+	memset(sum, 0, sizeof(*sum));
+	for (i = 0; i < nknotes; i++) {
+		idx = -kqextinfo[i].kqext_kev.filter;
+		if (idx <= 0 || idx >= ARRAYLEN(filt_strs)) {
+			idx = 0;
+		}
+		sum->filters[idx]++;
+		if (kqextinfo[i].kqext_status & KN_ACTIVE) {
+			sum->active++;
+		}
+		if (kqextinfo[i].kqext_status & KN_QUEUED) {
+			sum->queued++;
+		}
+	}
+	sum->knotes = nknotes;
+
+	total->knotes += sum->knotes;
+	total->active += sum->active;
+	total->queued += sum->queued;
+	for (i = 0; i < ARRAYLEN(filt_strs); i++) {
+		total->filters[i] += sum->filters[i];
+	}
+}
+
 enum kqtype {
 	KQTYPE_FD,
 	KQTYPE_DYNAMIC
@@ -349,12 +573,13 @@ enum kqtype {
 #define POLICY_FIFO             4
 
 static int
-process_kqueue(int pid, const char *procname, enum kqtype type, uint64_t kqid,
-		struct proc_fdinfo *fdlist, int nfds)
+process_kqueue(struct scanner *sc, int pid, const char *procname, enum kqtype type,
+		uint64_t kqid, struct proc_fdinfo *fdlist, int nfds)
 {
+	FILE *out = sc->out, *errout = sc->errout;
 	int ret, i, nknotes;
 	char tmpstr[256];
-	int maxknotes = 256; /* arbitrary starting point */
+	int maxknotes = 0; /* start from the buffer already there */
 	int kq_state;
 	bool is_kev_64, is_kev_qos;
 	int err = 0;
@@ -382,35 +607,35 @@ process_kqueue(int pid, const char *procname, enum kqtype type, uint64_t kqid,
 	if (type == KQTYPE_FD && (int)kqid != -1) {
 		if (ret != sizeof(kqfdinfo)) {
 		/* every proc has an implicit workq kqueue, dont warn if its unused */
-			fprintf(stderr, "WARN: FD table changed (pid %i, kq %i)\n", pid,
+			fprintf(errout, "WARN: FD table changed (pid %i, kq %i)\n", pid,
 					fd);
 		}
 	} else if (type == KQTYPE_DYNAMIC) {
 		if (ret < sizeof(struct kqueue_info)) {
-			fprintf(stderr, "WARN: kqueue missing (pid %i, kq %#" PRIx64 ")\n",
+			fprintf(errout, "WARN: kqueue missing (pid %i, kq %#" PRIx64 ")\n",
 					pid, kqid);
 		} else {
 			kqfdinfo.kqueueinfo = kqinfo.kqdi_info;
 		}
-		if (verbose && ret >= sizeof(struct kqueue_dyninfo)) {
-			print_kq_info(pid, procname, kqid, kqinfo.kqdi_info.kq_state);
+		if (verbose && !summary && ret >= sizeof(struct kqueue_dyninfo)) {
+			print_kq_info(out, pid, procname, kqid, kqinfo.kqdi_info.kq_state);
 
 			if (kqinfo.kqdi_owner) {
-				printf("%#18llx ", kqinfo.kqdi_owner);    // ident
-				printf("%-9s ", "WL owned"); // filter
+				fprintf(out, "%#18llx ", kqinfo.kqdi_owner);    // ident
+				fprintf(out, "%-9s ", "WL owned"); // filter
 			} else if (kqinfo.kqdi_servicer) {
-				printf("%#18llx ", kqinfo.kqdi_servicer); // ident
-				printf("%-9s ", "WL"); // filter
+				fprintf(out, "%#18llx ", kqinfo.kqdi_servicer); // ident
+				fprintf(out, "%-9s ", "WL"); // filter
 			} else {
-				printf("%18s ", "-"); // ident
-				printf("%-9s ", "WL"); // filter
+				fprintf(out, "%18s ", "-"); // ident
+				fprintf(out, "%-9s ", "WL"); // filter
 			}
 			dynkq_printed = true;
 
 			if (raw) {
-				printf("%-10s ", " "); // fflags
-				printf("%-10s ", " "); // flags
-				printf("%-10s ", " "); // evst
+				fprintf(out, "%-10s ", " "); // fflags
+				fprintf(out, "%-10s ", " "); // flags
+				fprintf(out, "%-10s ", " "); // evst
 			} else {
 				const char *reqstate = "???";
 
@@ -435,7 +660,7 @@ process_kqueue(int pid, const char *procname, enum kqtype type, uint64_t kqid,
 					break;
 				}
 
-				printf("%-8s ", reqstate); // fdtype
+				fprintf(out, "%-8s ", reqstate); // fdtype
 				char policy_type;
 				switch (kqinfo.kqdi_pol) {
 				case POLICY_RR:
@@ -450,35 +675,35 @@ process_kqueue(int pid, const char *procname, enum kqtype type, uint64_t kqid,
 					break;
 				}
 				snprintf(tmpstr, 4, "%c%c%c", (kqinfo.kqdi_pri == 0)?'-':'P', policy_type, (kqinfo.kqdi_cpupercent == 0)?'-':'%');
-				printf("%-7s ", tmpstr); // fflags
-				printf("%-15s ", " "); // flags
-				printf("%-15s ", " "); // evst
+				fprintf(out, "%-7s ", tmpstr); // fflags
+				fprintf(out, "%-15s ", " "); // flags
+				fprintf(out, "%-15s ", " "); // evst
 			}
 
 			if (!raw && kqinfo.kqdi_pri != 0) {
-				printf("%3d ", kqinfo.kqdi_pri); //qos
+				fprintf(out, "%3d ", kqinfo.kqdi_pri); //qos
 			} else {
 				int qos = MAX(MAX(kqinfo.kqdi_events_qos, kqinfo.kqdi_async_qos),
 					kqinfo.kqdi_sync_waiter_qos);
-				printf("%3s ", thread_qos_name(qos)); //qos
+				fprintf(out, "%3s ", thread_qos_name(qos)); //qos
 			}
-			printf("\n");
+			fprintf(out, "\n");
 		}
 	}
 
 	/*
 	 * get extended kqueue info
 	 */
-	struct kevent_extinfo *kqextinfo = NULL;
+	struct kevent_extinfo *kqextinfo;
  again:
-	if (!kqextinfo) {
-		kqextinfo = malloc(sizeof(struct kevent_extinfo) * maxknotes);
-	}
-	if (!kqextinfo) {
+	if (!scan_reserve((void **)&sc->knotes, &sc->knotes_len, maxknotes,
+			&knotes_hint, sizeof(struct kevent_extinfo))) {
 		err = errno;
-		perror("failed allocating memory");
+		scan_perror(sc, "failed allocating memory");
 		goto out;
 	}
+	kqextinfo = sc->knotes;
+	maxknotes = sc->knotes_len;
 
 	errno = 0;
 	switch (type) {
@@ -500,19 +725,17 @@ process_kqueue(int pid, const char *procname, enum kqtype type, uint64_t kqid,
 		} else if (errno == EAGAIN) {
 			goto again;
 		} else if (errno == EBADF) {
-			fprintf(stderr, "WARN: FD table changed (pid %i, kq %#" PRIx64 ")\n", pid, kqid);
+			fprintf(errout, "WARN: FD table changed (pid %i, kq %#" PRIx64 ")\n", pid, kqid);
 			goto out;
 		} else {
 			err = errno;
-			perror("failed to get extended kqueue info");
+			scan_perror(sc, "failed to get extended kqueue info");
 			goto out;
 		}
 	}
 
 	if (nknotes > maxknotes) {
 		maxknotes = nknotes + 16; /* arbitrary safety margin */
-		free(kqextinfo);
-		kqextinfo = NULL;
 		goto again;
 	}
 
@@ -524,11 +747,21 @@ process_kqueue(int pid, const char *procname, enum kqtype type, uint64_t kqid,
 	is_kev_64 = (kq_state & PROC_KQUEUE_64);
 	is_kev_qos = (kq_state & PROC_KQUEUE_QOS);
 
+	if (summary) {
+		struct kq_summary sum;
+
+		summarize_kqueue(sc, kqextinfo, nknotes, &sum);
+		if (nknotes > 0 || !ignore_empty) {
+			print_summary(out, pid, procname, kqid, kq_state, &sum, false);
+		}
+		goto out;
+	}
+
 	if (nknotes == 0) {
 		if (!ignore_empty && !dynkq_printed) {
 			/* for empty kqueues, print a single empty entry */
-			print_kq_info(pid, procname, kqid, kq_state);
-			printf("%18s \n", "-");
+			print_kq_info(out, pid, procname, kqid, kq_state);
+			fprintf(out, "%18s \n", "-");
 		}
 		goto out;
 	}
@@ -536,32 +769,32 @@ process_kqueue(int pid, const char *procname, enum kqtype type, uint64_t kqid,
 	for (i = 0; i < nknotes; i++) {
 		struct kevent_extinfo *info = &kqextinfo[i];
 
-		print_kq_info(pid, procname, kqid, kqfdinfo.kqueueinfo.kq_state);
-		print_ident(info->kqext_kev.ident, info->kqext_kev.filter, 18);
-		printf("%-9s ", filt_name(info->kqext_kev.filter));
+		print_kq_info(out, pid, procname, kqid, kqfdinfo.kqueueinfo.kq_state);
+		print_ident(sc, info->kqext_kev.ident, info->kqext_kev.filter, 18);
+		fprintf(out, "%-9s ", filt_name(info->kqext_kev.filter));
 
 		if (raw) {
-			printf("%#10x ", info->kqext_sfflags);
-			printf("%#10x ", info->kqext_kev.flags);
-			printf("%#10x ", info->kqext_status);
+			fprintf(out, "%#10x ", info->kqext_sfflags);
+			fprintf(out, "%#10x ", info->kqext_kev.flags);
+			fprintf(out, "%#10x ", info->kqext_status);
 		} else {
 			/* for kevents attached to file descriptors, print the type of FD (file, socket, etc) */
 			const char *fdstr = "";
 			if (filter_is_fd_type(info->kqext_kev.filter)) {
 				fdstr = "<unkn>";
-				int knfd = fd_list_getfd(fdlist, nfds, (int)info->kqext_kev.ident);
+				int knfd = fd_list_getfd(sc, (int)info->kqext_kev.ident);
 				if (knfd >= 0) {
 					fdstr = fdtype_str(fdlist[knfd].proc_fdtype);
 				}
 			}
-			printf("%-8s ", fdstr);
+			fprintf(out, "%-8s ", fdstr);
 
 			/* print filter flags */
-			printf("%7s ", fflags_build(info, tmpstr, sizeof(tmpstr)));
+			fprintf(out, "%7s ", fflags_build(info, tmpstr, sizeof(tmpstr)));
 
 			/* print generic flags */
 			unsigned flg = info->kqext_kev.flags;
-			printf("%c%c%c%c %c%c%c%c %c%c%c%c%c ",
+			fprintf(out, "%c%c%c%c %c%c%c%c %c%c%c%c%c ",
 					(flg & EV_ADD)      ? 'a' : '-',
 					(flg & EV_ENABLE)   ? 'n' : '-',
 					(flg & EV_DISABLE)  ? 'd' : '-',
@@ -580,7 +813,7 @@ process_kqueue(int pid, const char *procname, enum kqtype type, uint64_t kqid,
 			);
 
 			unsigned st = info->kqext_status;
-			printf("%c%c%c%c%c %c%c%c%c %c%c%c ",
+			fprintf(out, "%c%c%c%c%c %c%c%c%c %c%c%c ",
 					(st & KN_ACTIVE)      ? 'a' : '-',
 					(st & KN_QUEUED)      ? 'q' : '-',
 					(st & KN_DISABLED)    ? 'd' : '-',
@@ -598,114 +831,114 @@ process_kqueue(int pid, const char *procname, enum kqtype type, uint64_t kqid,
 			);
 		}
 
-		printf("%3s ", thread_qos_name(info->kqext_kev.qos));
+		fprintf(out, "%3s ", thread_qos_name(info->kqext_kev.qos));
 
-		printf("%#18llx ", (unsigned long long)info->kqext_kev.data);
+		fprintf(out, "%#18llx ", (unsigned long long)info->kqext_kev.data);
 
 		if (verbose) {
-			printf("%#18llx ", (unsigned long long)info->kqext_kev.udata);
+			fprintf(out, "%#18llx ", (unsigned long long)info->kqext_kev.udata);
 			if (is_kev_qos || is_kev_64) {
-				printf("%#18llx ", (unsigned long long)info->kqext_kev.ext[0]);
-				printf("%#18llx ", (unsigned long long)info->kqext_kev.ext[1]);
+				fprintf(out, "%#18llx ", (unsigned long long)info->kqext_kev.ext[0]);
+				fprintf(out, "%#18llx ", (unsigned long long)info->kqext_kev.ext[1]);
 
 				if (is_kev_qos) {
-					printf("%#18llx ", (unsigned long long)info->kqext_kev.ext[2]);
-					printf("%#18llx ", (unsigned long long)info->kqext_kev.ext[3]);
-					printf("%#10lx ", (unsigned long)info->kqext_kev.xflags);
+					fprintf(out, "%#18llx ", (unsigned long long)info->kqext_kev.ext[2]);
+					fprintf(out, "%#18llx ", (unsigned long long)info->kqext_kev.ext[3]);
+					fprintf(out, "%#10lx ", (unsigned long)info->kqext_kev.xflags);
 				}
 			}
 		}
 
-		printf("\n");
+		fprintf(out, "\n");
 	}
 
 	if (overflow) {
-		printf("   ***** output truncated (>=%i knotes on kq %" PRIu64 ", proc %i) *****\n",
+		fprintf(out, "   ***** output truncated (>=%i knotes on kq %" PRIu64 ", proc %i) *****\n",
 				nknotes, kqid, pid);
 	}
 
  out:
-	if (kqextinfo) {
-		free(kqextinfo);
-		kqextinfo = NULL;
-	}
-
 	return err;
 }
 
 static int
-pid_kqids(pid_t pid, kqueue_id_t **kqids_out)
+pid_kqids(struct scanner *sc, pid_t pid, kqueue_id_t **kqids_out)
 {
-	static int kqids_len = 256;
-	static kqueue_id_t *kqids = NULL;
-	static uint32_t kqids_size;
-
+	uint32_t kqids_size;
 	int nkqids;
 
+	if (sc->kqids_len < kqids_hint) {
+		free(sc->kqids);
+		sc->kqids = NULL;
+		sc->kqids_len = kqids_hint;
+	}
+
 retry:
-	if (os_mul_overflow(sizeof(kqueue_id_t), kqids_len, &kqids_size)) {
-		assert(kqids_len > PROC_PIDDYNKQUEUES_MAX);
-		kqids_len = PROC_PIDDYNKQUEUES_MAX;
+	if (os_mul_overflow(sizeof(kqueue_id_t), sc->kqids_len, &kqids_size)) {
+		assert(sc->kqids_len > PROC_PIDDYNKQUEUES_MAX);
+		sc->kqids_len = PROC_PIDDYNKQUEUES_MAX;
 		goto retry;
 	}
-	if (!kqids) {
-		kqids = malloc(kqids_size);
-		os_assert(kqids != NULL);
+	if (!sc->kqids) {
+		sc->kqids = malloc(kqids_size);
+		os_assert(sc->kqids != NULL);
 	}
 
-	nkqids = proc_list_dynkqueueids(pid, kqids, kqids_size);
-	if (nkqids > kqids_len && kqids_len < PROC_PIDDYNKQUEUES_MAX) {
-		kqids_len *= 2;
-		if (kqids_len > PROC_PIDDYNKQUEUES_MAX) {
-			kqids_len = PROC_PIDDYNKQUEUES_MAX;
+	nkqids = proc_list_dynkqueueids(pid, sc->kqids, kqids_size);
+	if (nkqids > sc->kqids_len && sc->kqids_len < PROC_PIDDYNKQUEUES_MAX) {
+		sc->kqids_len *= 2;
+		if (sc->kqids_len > PROC_PIDDYNKQUEUES_MAX) {
+			sc->kqids_len = PROC_PIDDYNKQUEUES_MAX;
+		}
+		free(sc->kqids);
+		sc->kqids = NULL;
+		if (sc->kqids_len > kqids_hint) {
+			kqids_hint = sc->kqids_len;
 		}
-		free(kqids);
-		kqids = NULL;
 		goto retry;
 	}
 
-	*kqids_out = kqids;
-	return MIN(nkqids, kqids_len);
+	*kqids_out = sc->kqids;
+	return MIN(nkqids, sc->kqids_len);
 }
 
 static int
-process_pid(pid_t pid)
+process_pid(struct scanner *sc, pid_t pid)
 {
+	FILE *out = sc->out, *errout = sc->errout;
 	int i, nfds, nkqids;
 	kqueue_id_t *kqids;
 	int ret = 0;
-	int maxfds = 256; /* arbitrary starting point */
-	struct proc_fdinfo *fdlist = NULL;
+	int maxfds = 0; /* start from the buffer already there */
+	struct proc_fdinfo *fdlist;
 
 	/* enumerate file descriptors */
  again:
-	if (!fdlist) {
-		fdlist = malloc(sizeof(struct proc_fdinfo) * maxfds);
-	}
-	if (!fdlist) {
+	if (!scan_reserve((void **)&sc->fds, &sc->fds_len, maxfds, &fds_hint,
+			sizeof(struct proc_fdinfo))) {
 		ret = errno;
-		perror("failed to allocate");
+		scan_perror(sc, "failed to allocate");
 		goto out;
 	}
+	fdlist = sc->fds;
+	maxfds = sc->fds_len;
 
 	nfds = proc_pidinfo(pid, PROC_PIDLISTFDS, 0, fdlist,
 			sizeof(struct proc_fdinfo) * maxfds);
 	if (nfds <= 0) {
 		ret = errno;
-		fprintf(stderr, "%s: failed enumerating file descriptors of process %i: %s",
+		fprintf(errout, "%s: failed enumerating file descriptors of process %i: %s",
 				self, pid, strerror(ret));
 		if (ret == EPERM && geteuid() != 0) {
-			fprintf(stderr, " (are you root?)");
+			fprintf(errout, " (are you root?)");
 		}
-		fprintf(stderr, "\n");
+		fprintf(errout, "\n");
 		goto out;
 	}
 
 	nfds /= sizeof(struct proc_fdinfo);
 	if (nfds >= maxfds) {
 		maxfds = nfds + 16;
-		free(fdlist);
-		fdlist = NULL;
 		goto again;
 	}
 
@@ -713,7 +946,7 @@ process_pid(pid_t pid)
 	struct proc_bsdinfo bsdinfo;
 	ret = proc_pidinfo(pid, PROC_PIDTBSDINFO, 0, &bsdinfo, sizeof(bsdinfo));
 	if (ret != sizeof(bsdinfo)) {
-		perror("failed retrieving process info");
+		scan_perror(sc, "failed retrieving process info");
 		ret = -1;
 		goto out;
 	}
@@ -722,16 +955,20 @@ process_pid(pid_t pid)
 	if (strlen(procname) == 0) {
 		procname = bsdinfo.pbi_comm;
 	}
+	pidname_lookup(sc, pid, &bsdinfo);
+	fd_list_index(sc, fdlist, nfds);
+
+	memset(&sc->pid_total, 0, sizeof(sc->pid_total));
 
 	/* handle the special workq kq */
-	ret = process_kqueue(pid, procname, KQTYPE_FD, -1, fdlist, nfds);
+	ret = process_kqueue(sc, pid, procname, KQTYPE_FD, -1, fdlist, nfds);
 	if (ret) {
 		goto out;
 	}
 
 	for (i = 0; i < nfds; i++) {
 		if (fdlist[i].proc_fdtype == PROX_FDTYPE_KQUEUE) {
-			ret = process_kqueue(pid, procname, KQTYPE_FD,
+			ret = process_kqueue(sc, pid, procname, KQTYPE_FD,
 					(uint64_t)fdlist[i].proc_fd, fdlist, nfds);
 			if (ret) {
 				goto out;
@@ -739,84 +976,173 @@ process_pid(pid_t pid)
 		}
 	}
 
-	nkqids = pid_kqids(pid, &kqids);
+	nkqids = pid_kqids(sc, pid, &kqids);
 
 	for (i = 0; i < nkqids; i++) {
-		ret = process_kqueue(pid, procname, KQTYPE_DYNAMIC, kqids[i], fdlist, nfds);
+		ret = process_kqueue(sc, pid, procname, KQTYPE_DYNAMIC, kqids[i], fdlist, nfds);
 		if (ret) {
 			goto out;
 		}
 	}
 
 	if (nkqids >= PROC_PIDDYNKQUEUES_MAX) {
-		printf("   ***** output truncated (>=%i dynamic kqueues in proc %i) *****\n",
+		fprintf(out, "   ***** output truncated (>=%i dynamic kqueues in proc %i) *****\n",
 				nkqids, pid);
 	}
 
- out:
-	if (fdlist) {
-		free(fdlist);
-		fdlist = NULL;
+	if (summary && (sc->pid_total.knotes > 0 || !ignore_empty)) {
+		print_summary(out, pid, procname, 0, 0, &sc->pid_total, true);
 	}
 
+ out:
 	return ret;
 }
 
+/*
+ * output of one pid from a worker, printed by the main thread in pid order
+ */
+struct pid_result {
+	char *buf;
+	size_t len;
+	char *errbuf;
+	size_t errlen;
+	int ret;
+	bool done;
+};
+
+struct pid_scan {
+	int *pids;
+	int npids;
+	int next;
+	bool stop;
+	struct pid_result *results;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static void *
+scan_worker(void *arg)
+{
+	struct pid_scan *ps = arg;
+	struct scanner sc = {};
+	struct pid_result *r;
+	int i;
+
+	while (!ps->stop && (i = __sync_fetch_and_add(&ps->next, 1)) < ps->npids) {
+		r = &ps->results[i];
+		/* listpids gives us pid 0 for some reason */
+		if (ps->pids[i]) {
+			sc.out = open_memstream(&r->buf, &r->len);
+			sc.errout = open_memstream(&r->errbuf, &r->errlen);
+			os_assert(sc.out != NULL && sc.errout != NULL);
+			r->ret = process_pid(&sc, ps->pids[i]);
+			fclose(sc.out);
+			fclose(sc.errout);
+		}
+
+		pthread_mutex_lock(&ps->lock);
+		r->done = true;
+		pthread_cond_broadcast(&ps->cond);
+		pthread_mutex_unlock(&ps->lock);
+	}
+
+	free(sc.kqids);
+	free(sc.fdindex);
+	free(sc.pidnames);
+	free(sc.knotes);
+	free(sc.fds);
+	return NULL;
+}
+
 static int
 process_all_pids(void)
 {
-	int i, npids;
+	int i, npids, nworkers;
 	int ret = 0;
-	int maxpids = 2048;
-	int *pids = NULL;
+	int *pids;
+	struct proctab pt = {};
+	struct pid_scan ps = {};
+	pthread_t workers[MAX_WORKERS];
 
- again:
-	if (!pids) {
-		pids = malloc(sizeof(int) * maxpids);
+	if (proctab_refresh(&pt) < 0) {
+		ret = errno;
+		perror("failed enumerating pids");
+		goto out;
 	}
-	if (!pids) {
-		perror("failed allocating pids[]");
+	pids = pt.pids;
+	npids = pt.count;
+
+	/*
+	 * scan pids on a pool of workers, each writing to a buffer of its own,
+	 * and print the buffers in pid order so the output is the same as a
+	 * serial scan
+	 */
+	ps.pids = pids;
+	ps.npids = npids;
+	ps.results = calloc(MAX(npids, 1), sizeof(struct pid_result));
+	if (!ps.results) {
+		ret = errno;
+		perror("failed allocating results[]");
 		goto out;
 	}
+	pthread_mutex_init(&ps.lock, NULL);
+	pthread_cond_init(&ps.cond, NULL);
 
-	errno = 0;
-	npids = proc_listpids(PROC_ALL_PIDS, 0, pids, sizeof(int) * maxpids);
-	if (npids <= 0) {
-		if (errno == 0) {
-			/* empty pid list */
-		} else if (errno == EAGAIN) {
-			goto again;
-		} else {
-			ret = errno;
-			perror("failed enumerating pids");
-			goto out;
+	nworkers = (int)MIN(MAX(sysconf(_SC_NPROCESSORS_ONLN), 1), MAX_WORKERS);
+	for (i = 0; i < nworkers; i++) {
+		if (pthread_create(&workers[i], NULL, scan_worker, &ps) != 0) {
+			break;
 		}
 	}
-
-	npids /= sizeof(int);
-	if (npids >= maxpids) {
-		maxpids = npids + 16;
-		free(pids);
-		pids = NULL;
-		goto again;
+	nworkers = i;
+	if (nworkers == 0) {
+		/* no threads to be had, scan serially */
+		scan_worker(&ps);
 	}
 
 	for (i = 0; i < npids; i++) {
-		/* listpids gives us pid 0 for some reason */
+		struct pid_result *r = &ps.results[i];
+
+		pthread_mutex_lock(&ps.lock);
+		while (!r->done) {
+			pthread_cond_wait(&ps.cond, &ps.lock);
+		}
+		pthread_mutex_unlock(&ps.lock);
+
+		if (r->errbuf) {
+			fflush(stdout);
+			fwrite(r->errbuf, 1, r->errlen, stderr);
+			free(r->errbuf);
+			r->errbuf = NULL;
+		}
+		if (r->buf) {
+			fwrite(r->buf, 1, r->len, stdout);
+			free(r->buf);
+			r->buf = NULL;
+		}
 		if (pids[i]) {
-			ret = process_pid(pids[i]);
+			ret = r->ret;
 			/* ignore races with processes exiting */
 			if (ret && ret != ESRCH) {
-				goto out;
+				break;
 			}
 		}
 	}
 
-out:
-	if (pids) {
-		free(pids);
-		pids = NULL;
+	ps.stop = true;
+	for (i = 0; i < nworkers; i++) {
+		pthread_join(workers[i], NULL);
 	}
+	for (i = 0; i < npids; i++) {
+		free(ps.results[i].buf);
+		free(ps.results[i].errbuf);
+	}
+	free(ps.results);
+	pthread_mutex_destroy(&ps.lock);
+	pthread_cond_destroy(&ps.cond);
+
+out:
+	proctab_free(&pt);
 
 	return ret;
 }
@@ -856,12 +1182,18 @@ launchd                  1                  4  ks- netbiosd       250 PROC
 static void
 usage(void)
 {
-	fprintf(stderr, "usage: %s [-vher] [-a | -p <pid>]\n", self);
+	fprintf(stderr, "usage: %s [-vhers] [-a | -p <pid>]\n", self);
 }
 
 static void
 print_header(void)
 {
+	if (summary) {
+		printf("command                pid                 kq knotes active queued filters\n");
+		printf("-------------------- ----- ------------------ ------ ------ ------ -------\n");
+		return;
+	}
+
 	if (raw) {
 		printf("  pid                 kq       kqst               knid filter        fflags      flags       evst qos               data");
 	} else {
@@ -898,7 +1230,7 @@ main(int argc, char *argv[])
 		self = argv[0];
 	}
 
-	while ((opt = getopt(argc, argv, "eahvrp:")) != -1) {
+	while ((opt = getopt(argc, argv, "eahvrsp:")) != -1) {
 		switch (opt) {
 		case 'a':
 			all_pids = 1;
@@ -919,6 +1251,9 @@ main(int argc, char *argv[])
 		case 'r':
 			raw = 1;
 			break;
+		case 's':
+			summary = 1;
+			break;
 		case '?':
 		default:
 			usage();
@@ -956,7 +1291,8 @@ main(int argc, char *argv[])
 	if (all_pids) {
 		return process_all_pids();
 	} else {
-		return process_pid(pid);
+		struct scanner sc = { .out = stdout, .errout = stderr };
+		return process_pid(&sc, pid);
 	}
 
 	return 0;
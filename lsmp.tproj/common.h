@@ -36,7 +36,11 @@
 struct prog_configs {
     boolean_t show_all_tasks;
     boolean_t show_voucher_details;
+    boolean_t json_compact;         /* leave voucher recipes out of the JSON output */
     boolean_t verbose;
+    boolean_t summary;              /* per-task right counts instead of the port tables */
+    const char *snapshot_save;      /* write a snapshot of the port tables here */
+    const char *snapshot_diff;      /* report rights that changed since this snapshot */
     int       voucher_detail_length;
     pid_t     pid; /* if user focusing only one pid */
     JSON_t    json_output;
@@ -62,16 +66,33 @@ struct my_per_thread_info {
 };
 
 /* kobject to name hash table declarations */
-#define K2N_TABLE_SIZE	256
+#define K2N_TABLE_MIN_SIZE	64 /* must be a power of two */
+
+struct my_per_task_info;
 
 struct k2n_table_node {
     natural_t kobject; /* kobject referred to by the name -- the key into the table */
-    ipc_info_name_t *info_name; /* info about the name that refers to the key kobject -- value of the table */
-    struct k2n_table_node *next;
+    ipc_info_name_t *info_name; /* info about the name that refers to the key kobject -- value of the table, NULL for a free slot */
+    struct my_per_task_info *taskinfo; /* task whose space holds info_name */
+};
+
+/*
+ * Open-addressed (linear probing) table; the node array doubles as the node
+ * pool, so a task's whole table is a single allocation. Entries are never
+ * removed, which lets the same kobject be entered more than once.
+ */
+struct k2n_table {
+    struct k2n_table_node *nodes;
+    uint32_t size; /* power of two, or 0 while nothing has been entered */
+    uint32_t count;
+    uint64_t lookups;
+    uint64_t probes;
+    uint32_t max_probe;
 };
 
-struct k2n_table_node *k2n_table_lookup_next(struct k2n_table_node *node, natural_t kobject);
-struct k2n_table_node *k2n_table_lookup(struct k2n_table_node **table, natural_t kobject);
+struct k2n_table_node *k2n_table_lookup_next(struct k2n_table *table, struct k2n_table_node *node, natural_t kobject);
+struct k2n_table_node *k2n_table_lookup(struct k2n_table *table, natural_t kobject);
+void print_k2n_table_stats(FILE *out);
 
 /* private structure to wrap up per-task info */
 typedef struct my_per_task_info {
@@ -84,7 +105,7 @@ typedef struct my_per_task_info {
     ipc_info_tree_name_array_t tree;
     mach_msg_type_number_t treeCount;
     boolean_t valid; /* TRUE if all data is accurately collected */
-    struct k2n_table_node *k2ntable[K2N_TABLE_SIZE];
+    struct k2n_table k2ntable;
     char processName[PROC_NAME_LEN];
     struct exc_port_info exceptionInfo;
     struct my_per_thread_info * threadInfos; /* dynamically allocated in collect_per_task_info */
@@ -185,6 +206,7 @@ const char * kobject_name(natural_t kotype);
 void get_receive_port_context(task_read_t taskp, mach_port_name_t portname, mach_port_context_t *context);
 int get_recieve_port_status(task_read_t taskp, mach_port_name_t portname, mach_port_info_ext_t *info);
 void show_task_mach_ports(my_per_task_info_t *taskinfo, uint32_t taskCount, my_per_task_info_t *allTaskInfos, JSON_t json);
+void show_port_summary(my_per_task_info_t **taskinfos, uint32_t taskCount, JSON_t json);
 
 /* task and thread related helper functions */
 kern_return_t collect_per_task_info(my_per_task_info_t *taskinfo, task_read_t target_task);
@@ -193,6 +215,8 @@ void deallocate_taskinfo_memory(my_per_task_info_t *data);
 kern_return_t print_task_exception_info(my_per_task_info_t *taskinfo, JSON_t json);
 kern_return_t print_task_threads_special_ports(my_per_task_info_t *taskinfo, JSON_t json);
 my_per_task_info_t * get_taskinfo_by_kobject(natural_t kobj);
+int save_snapshot(const char *path, my_per_task_info_t *taskinfos, uint32_t taskCount);
+int diff_snapshot(const char *path, my_per_task_info_t *taskinfos, uint32_t taskCount, JSON_t json);
 
 void get_exc_behavior_string(exception_behavior_t b, char *out_string, size_t len);
 void get_exc_mask_string(exception_mask_t m, char *out_string, size_t len);
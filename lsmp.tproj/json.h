@@ -30,6 +30,10 @@
  * As a convenience, when the provided `json` stream is NULL (i.e. it was never initialized
  * by `JSON_OPEN`) these APIs will do nothing.
  *
+ * Output goes through a large, fully buffered stdio stream owned by the JSON_t, so
+ * full-system dumps are written in JSON_BUFFER_SIZE chunks and emitting a field
+ * never allocates.
+ *
  * Example usage:
  *
  *  JSON_t json = JSON_OPEN("/path/to/output.json")
@@ -67,35 +71,49 @@
   }
 #define _JSON_COMMA(json) \
   if (json->require_comma) { \
-    fprintf(json->stream, ","); \
+    putc(',', json->stream); \
   }
 
+#define JSON_BUFFER_SIZE (4 * 1024 * 1024)
+
 struct _JSON {
   FILE* stream;
   bool require_comma;
+  char *buffer;
 };
 typedef struct _JSON * JSON_t;
 
 #pragma mark Open/Close
-/* Return a new JSON_t stream */
+/* Return a new JSON_t stream, or NULL (with errno set) if `path` can't be opened */
 static inline JSON_t JSON_OPEN(const char *path) {
   JSON_t p = malloc(sizeof(struct _JSON));
+  if (p == NULL) {
+    return NULL;
+  }
   p->stream = fopen(path, "w+");
+  if (p->stream == NULL) {
+    free(p);
+    return NULL;
+  }
   p->require_comma = false;
+  p->buffer = malloc(JSON_BUFFER_SIZE);
+  if (p->buffer != NULL) {
+    setvbuf(p->stream, p->buffer, _IOFBF, JSON_BUFFER_SIZE);
+  }
   return p;
 }
 
 /* Close an existing JSON stream, removing trailing commas */
-#define JSON_CLOSE(json) _JSON_IF(json, fclose(json->stream); free(json))
+#define JSON_CLOSE(json) _JSON_IF(json, fclose(json->stream); free(json->buffer); free(json))
 
 #pragma mark Keys/Values
 /* Output the `key` half of a key/value pair */
-#define JSON_KEY(json, key) _JSON_IF(json, _JSON_COMMA(json); fprintf(json->stream, "\"" #key "\":"); json->require_comma = false)
+#define JSON_KEY(json, key) _JSON_IF(json, _JSON_COMMA(json); fputs("\"" #key "\":", json->stream); json->require_comma = false)
 /* Output the `value` half of a key/value pair */
 #define JSON_VALUE(json, format, ...) _JSON_IF(json, fprintf(json->stream, #format, ##__VA_ARGS__); json->require_comma = true)
 
-#define _JSON_BEGIN(json, character) _JSON_COMMA(json); fprintf(json->stream, #character); json->require_comma = false;
-#define _JSON_END(json, character) fprintf(json->stream, #character); json->require_comma = true;
+#define _JSON_BEGIN(json, character) _JSON_COMMA(json); fputs(#character, json->stream); json->require_comma = false;
+#define _JSON_END(json, character) fputs(#character, json->stream); json->require_comma = true;
 #define _JSON_BOOL(val) ( val ? "true" : "false" )
 
 #pragma mark Objects
@@ -29,8 +29,11 @@
 #include <libproc.h>
 #include <TargetConditionals.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sys/param.h>
 #include "common.h"
 #include "json.h"
+#include "proctab.h"
 
 #if (TARGET_OS_IPHONE && !TARGET_OS_SIMULATOR)
 #define TASK_FOR_PID_USAGE_MESG "\nPlease check your boot-args to ensure you have access to task_read_for_pid()."
@@ -41,18 +44,92 @@
 struct prog_configs lsmp_config = {
     .show_all_tasks         = FALSE,
     .show_voucher_details   = FALSE,
+    .json_compact           = FALSE,
     .verbose                = FALSE,
+    .summary                = FALSE,
+    .snapshot_save          = NULL,
+    .snapshot_diff          = NULL,
     .pid                    = 0,
     .json_output            = NULL,
 };
 
+/* upper bound on threads used to collect port spaces for -all */
+#define MAX_COLLECT_WORKERS 16
+
+struct collect_state {
+    my_per_task_info_t *taskinfos;
+    task_array_t tasks;
+    kern_return_t *results;
+    mach_msg_type_number_t count;
+    mach_msg_type_number_t next;
+    pthread_mutex_t lock;
+};
+
+static void *collect_worker(void *arg) {
+    struct collect_state *cs = arg;
+    mach_msg_type_number_t i;
+
+    for (;;) {
+        pthread_mutex_lock(&cs->lock);
+        i = cs->next++;
+        pthread_mutex_unlock(&cs->lock);
+        if (i >= cs->count)
+            break;
+        cs->results[i] = collect_per_task_info(&cs->taskinfos[i], cs->tasks[i]);
+    }
+    return NULL;
+}
+
+/*
+ * Gather the port space of every task into taskinfos[], spreading the
+ * mach_port_space_info() calls across a bounded pool of threads. Each slot
+ * is written by exactly one worker; the cross-task resolution done while
+ * printing only starts once every worker has been joined. Our own task is
+ * collected last, on the main thread, once the workers have exited, so its
+ * thread list and exception ports are not polluted by the pool.
+ */
+static void collect_all_task_info(my_per_task_info_t *taskinfos, task_array_t tasks, kern_return_t *results, mach_msg_type_number_t taskCount, boolean_t self_last) {
+    struct collect_state cs = {
+        .taskinfos = taskinfos,
+        .tasks = tasks,
+        .results = results,
+        .count = self_last ? taskCount - 1 : taskCount,
+        .next = 0,
+    };
+    pthread_t workers[MAX_COLLECT_WORKERS];
+    int nworkers, started = 0;
+
+    pthread_mutex_init(&cs.lock, NULL);
+    nworkers = (int)MIN(MAX(sysconf(_SC_NPROCESSORS_ONLN), 1), MAX_COLLECT_WORKERS);
+    nworkers = (int)MIN((mach_msg_type_number_t)nworkers, cs.count);
+    for (int i = 0; i < nworkers; i++) {
+        if (pthread_create(&workers[i], NULL, collect_worker, &cs) != 0)
+            break;
+        started++;
+    }
+    /* whatever the pool did not pick up (including everything, if no thread started) */
+    collect_worker(&cs);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    pthread_mutex_destroy(&cs.lock);
+
+    if (self_last) {
+        results[taskCount - 1] = collect_per_task_info(&taskinfos[taskCount - 1], tasks[taskCount - 1]);
+    }
+}
+
 static void print_usage(char *progname) {
-    fprintf(stderr, "Usage: %s -p <pid> [-a|-v|-h] \n", "lsmp");
+    fprintf(stderr, "Usage: %s -p <pid> [-a|-v|-h] [-j <path> [-c]] \n", "lsmp");
     fprintf(stderr, "Lists information about mach ports. Please see man page for description of each column.\n");
     fprintf(stderr, "\t-p <pid> :  print all mach ports for process id <pid>. \n");
     fprintf(stderr, "\t-a :  print all mach ports for all processeses. \n");
+    fprintf(stderr, "\t-s :  print only per-process right counts, most send rights first.\n");
+    fprintf(stderr, "\t-S <path> :  save a snapshot of the port tables to <path> instead of printing them.\n");
+    fprintf(stderr, "\t-D <path> :  print only the rights that appeared or disappeared since the snapshot at <path>.\n");
     fprintf(stderr, "\t-v :  print verbose details for kernel objects.\n");
     fprintf(stderr, "\t-j <path> :  save output as JSON to <path>.\n");
+    fprintf(stderr, "\t-c :  compact JSON, without voucher details.\n");
     fprintf(stderr, "\t-h :  print this help.\n");
     exit(1);
 }
@@ -81,8 +158,10 @@ int main(int argc, char *argv[]) {
     lsmp_config.voucher_detail_length = 128; /* default values for config */
     my_per_task_info_t *psettaskinfo;
     mach_msg_type_number_t taskCount;
+    kern_return_t *results;
+    boolean_t self_last = FALSE;
 
-    while((option = getopt(argc, argv, "hvalp:j:")) != -1) {
+    while((option = getopt(argc, argv, "hvalcsp:j:S:D:")) != -1) {
 		switch(option) {
             case 'a':
                 /* user asked for info on all processes */
@@ -108,6 +187,22 @@ int main(int argc, char *argv[]) {
                 }
                 break;
 
+            case 's':
+                lsmp_config.summary = TRUE;
+                break;
+
+            case 'S':
+                lsmp_config.snapshot_save = optarg;
+                break;
+
+            case 'D':
+                lsmp_config.snapshot_diff = optarg;
+                break;
+
+            case 'c':
+                lsmp_config.json_compact = TRUE;
+                break;
+
             case 'j':
                 lsmp_config.json_output = JSON_OPEN(optarg);
                 if (lsmp_config.json_output == NULL) {
@@ -131,36 +226,9 @@ int main(int argc, char *argv[]) {
 
 	/* if privileged, get the info for all tasks so we can match ports up */
 	if (geteuid() == 0) {
-		processor_set_name_array_t psets;
-		mach_msg_type_number_t psetCount;
-		mach_port_t pset_priv;
-
-		ret = host_processor_sets(mach_host_self(), &psets, &psetCount);
-		if (ret != KERN_SUCCESS) {
-			fprintf(stderr, "host_processor_sets() failed: %s\n", mach_error_string(ret));
-			exit(1);
-		}
-		if (psetCount != 1) {
-			fprintf(stderr, "Assertion Failure: pset count greater than one (%d)\n", psetCount);
+		/* a task read port for every task */
+		if (proctab_tasks(TASK_FLAVOR_READ, &tasks, &taskCount) < 0)
 			exit(1);
-		}
-
-		/* convert the processor-set-name port to a privileged port */
-		ret = host_processor_set_priv(mach_host_self(), psets[0], &pset_priv);
-		if (ret != KERN_SUCCESS) {
-			fprintf(stderr, "host_processor_set_priv() failed: %s\n", mach_error_string(ret));
-			exit(1);
-		}
-		mach_port_deallocate(mach_task_self(), psets[0]);
-		vm_deallocate(mach_task_self(), (vm_address_t)psets, (vm_size_t)psetCount * sizeof(mach_port_t));
-
-		/* convert the processor-set-priv to a list of task read ports for the processor set */
-		ret = processor_set_tasks_with_flavor(pset_priv, TASK_FLAVOR_READ, &tasks, &taskCount);
-		if (ret != KERN_SUCCESS) {
-			fprintf(stderr, "processor_set_tasks_with_flavor() failed: %s\n", mach_error_string(ret));
-			exit(1);
-		}
-		mach_port_deallocate(mach_task_self(), pset_priv);
 
         /* swap my current instances port to be last to collect all threads and exception port info */
         int myTaskPosition = -1;
@@ -175,6 +243,7 @@ int main(int argc, char *argv[]) {
             swap_holder = tasks[taskCount - 1];
             tasks[taskCount - 1] = tasks[myTaskPosition];
             tasks[myTaskPosition] = swap_holder;
+            self_last = TRUE;
         }
 
 	}
@@ -193,9 +262,16 @@ int main(int argc, char *argv[]) {
 
     /* convert each task to structure of pointer for the task info */
     psettaskinfo = allocate_taskinfo_memory(taskCount);
+    results = calloc(taskCount, sizeof(kern_return_t));
+    if (psettaskinfo == NULL || results == NULL) {
+        fprintf(stderr, "Failed to allocate memory for %d tasks\n", taskCount);
+        exit(1);
+    }
+
+    collect_all_task_info(psettaskinfo, tasks, results, taskCount, self_last);
 
     for (i = 0; i < taskCount; i++) {
-        ret = collect_per_task_info(&psettaskinfo[i], tasks[i]);
+        ret = results[i];
         if (ret != KERN_SUCCESS) {
             printf("Ignoring failure of mach_port_space_info() for task %d for '-all'\n", tasks[i]);
             continue;
@@ -211,11 +287,45 @@ int main(int argc, char *argv[]) {
     JSON_KEY(lsmp_config.json_output, processes);
     JSON_ARRAY_BEGIN(lsmp_config.json_output);
 
-    if (lsmp_config.show_all_tasks == FALSE) {
-        if (taskinfo == NULL) {
-            fprintf(stderr, "Failed to find task ipc information for pid %d\n", lsmp_config.pid);
+    if (lsmp_config.show_all_tasks == FALSE && taskinfo == NULL) {
+        fprintf(stderr, "Failed to find task ipc information for pid %d\n", lsmp_config.pid);
+        exit(1);
+    }
+
+    if (lsmp_config.snapshot_save || lsmp_config.snapshot_diff) {
+        my_per_task_info_t *snaptasks = psettaskinfo;
+        uint32_t nsnaptasks = taskCount;
+
+        if (lsmp_config.show_all_tasks == FALSE) {
+            snaptasks = taskinfo;
+            nsnaptasks = 1;
+        }
+        /* diff first, so the same path can be compared and then replaced */
+        if (lsmp_config.snapshot_diff &&
+            diff_snapshot(lsmp_config.snapshot_diff, snaptasks, nsnaptasks, lsmp_config.json_output) != 0)
+            exit(1);
+        if (lsmp_config.snapshot_save &&
+            save_snapshot(lsmp_config.snapshot_save, snaptasks, nsnaptasks) != 0)
+            exit(1);
+    } else if (lsmp_config.summary) {
+        my_per_task_info_t **summarized = calloc(taskCount, sizeof(my_per_task_info_t *));
+        uint32_t nsummarized = 0;
+
+        if (summarized == NULL) {
+            fprintf(stderr, "Failed to allocate memory for %d tasks\n", taskCount);
             exit(1);
         }
+        if (lsmp_config.show_all_tasks == FALSE) {
+            summarized[nsummarized++] = taskinfo;
+        } else {
+            for (i = 0; i < taskCount; i++) {
+                if (psettaskinfo[i].valid == TRUE)
+                    summarized[nsummarized++] = &psettaskinfo[i];
+            }
+        }
+        show_port_summary(summarized, nsummarized, lsmp_config.json_output);
+        free(summarized);
+    } else if (lsmp_config.show_all_tasks == FALSE) {
         print_task_info(taskinfo, taskCount, psettaskinfo, TRUE, lsmp_config.json_output);
     } else {
         for (i=0; i < taskCount; i++) {
@@ -229,11 +339,16 @@ int main(int argc, char *argv[]) {
     JSON_ARRAY_END(lsmp_config.json_output);
     JSON_OBJECT_END(lsmp_config.json_output);
 
+    if (lsmp_config.verbose) {
+        print_k2n_table_stats(stderr);
+    }
+
 	if (taskCount > 1) {
         vm_deallocate(mach_task_self(), (vm_address_t)tasks, (vm_size_t)taskCount * sizeof(mach_port_t));
     }
 
     deallocate_taskinfo_memory(psettaskinfo);
+    free(results);
 
     JSON_CLOSE(lsmp_config.json_output);
 
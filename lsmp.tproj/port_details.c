@@ -126,7 +126,8 @@ const port_status_flag_info_t port_status_flags[] = {
 #define VOUCHER_DETAIL_PREFIX "            "
 
 static const unsigned int voucher_contents_size = 8192;
-static uint8_t voucher_contents[voucher_contents_size];
+/* per thread, as task port spaces are collected concurrently */
+static __thread uint8_t voucher_contents[voucher_contents_size];
 
 typedef struct {
     int total;
@@ -307,6 +308,174 @@ void show_task_mach_ports(my_per_task_info_t *taskinfo, uint32_t taskCount, my_p
     printf("VOUCHERS  = %d\n", counts.vouchercount);
 }
 
+#pragma mark port leak summary
+
+/* number of most common kobject types listed per task in the summary */
+#define SUMMARY_TOP_KOTYPES 3
+
+struct task_port_summary {
+    my_per_task_info_t *taskinfo;
+    task_table_entry_counts counts;
+    int kotypes[IKOT_MAX_TYPE];
+};
+
+/*
+ * Tally one entry the way show_task_table_entry() does, but from the
+ * ipc_info_name_t alone: the only call into the kernel is the kobject type
+ * lookup for send rights whose receive right lives elsewhere.
+ */
+static void count_task_table_entry(ipc_info_name_t *entry, my_per_task_info_t *taskinfo, struct task_port_summary *summary) {
+    task_table_entry_counts_t counts = &summary->counts;
+    unsigned int kotype = 0;
+    unsigned int kobject = 0;
+
+    if ((entry->iin_type & MACH_PORT_TYPE_ALL_RIGHTS) == 0) {
+        counts->total--;
+        return;
+    }
+
+    if (entry->iin_type == MACH_PORT_TYPE_PORT_SET) {
+        counts->portsetcount++;
+        return;
+    }
+
+    if (entry->iin_type & MACH_PORT_TYPE_SEND) {
+        counts->sendcount++;
+    }
+
+    if (entry->iin_type & MACH_PORT_TYPE_DNREQUEST) {
+        counts->dncount++;
+    }
+
+    if (entry->iin_type & MACH_PORT_TYPE_RECEIVE) {
+        counts->receivecount++;
+        return;
+    }
+
+    if (entry->iin_type & MACH_PORT_TYPE_DEAD_NAME) {
+        counts->deadcount++;
+        return;
+    }
+
+    if (entry->iin_type & MACH_PORT_TYPE_SEND_ONCE) {
+        counts->sendoncecount++;
+    }
+
+    if (mach_port_kernel_object(taskinfo->task, entry->iin_name, &kotype, &kobject) == KERN_SUCCESS && kotype != 0) {
+        if (kotype >= IKOT_MAX_TYPE) {
+            kotype = IKOT_UNKNOWN;
+        }
+        summary->kotypes[kotype]++;
+        if (kotype == IKOT_VOUCHER) {
+            counts->vouchercount++;
+        }
+    }
+}
+
+/* most send rights first, as that's what a leaking task accumulates */
+static int summary_compare(const void *a, const void *b) {
+    const struct task_port_summary *sa = a, *sb = b;
+
+    if (sa->counts.sendcount != sb->counts.sendcount)
+        return sb->counts.sendcount - sa->counts.sendcount;
+    if (sa->counts.total != sb->counts.total)
+        return sb->counts.total - sa->counts.total;
+    return sa->taskinfo->pid - sb->taskinfo->pid;
+}
+
+/* fill top[] with the indices of the most common kobject types, -1 past the end */
+static void summary_top_kotypes(const struct task_port_summary *summary, int top[SUMMARY_TOP_KOTYPES]) {
+    for (int t = 0; t < SUMMARY_TOP_KOTYPES; t++) {
+        top[t] = -1;
+        for (int k = 1; k < IKOT_MAX_TYPE; k++) {
+            boolean_t taken = FALSE;
+            if (summary->kotypes[k] == 0)
+                continue;
+            for (int u = 0; u < t; u++) {
+                if (top[u] == k)
+                    taken = TRUE;
+            }
+            if (!taken && (top[t] < 0 || summary->kotypes[k] > summary->kotypes[top[t]]))
+                top[t] = k;
+        }
+    }
+}
+
+void show_port_summary(my_per_task_info_t **taskinfos, uint32_t taskCount, JSON_t json)
+{
+    struct task_port_summary *summaries = calloc(taskCount, sizeof(struct task_port_summary));
+    int top[SUMMARY_TOP_KOTYPES];
+
+    if (summaries == NULL) {
+        fprintf(stderr, "Failed to allocate memory for %d task summaries\n", taskCount);
+        exit(1);
+    }
+
+    for (uint32_t i = 0; i < taskCount; i++) {
+        my_per_task_info_t *taskinfo = taskinfos[i];
+        summaries[i].taskinfo = taskinfo;
+        summaries[i].counts.total = taskinfo->tableCount + taskinfo->treeCount;
+        for (unsigned int k = 0; k < taskinfo->tableCount; k++) {
+            count_task_table_entry(&taskinfo->table[k], taskinfo, &summaries[i]);
+        }
+    }
+    qsort(summaries, taskCount, sizeof(struct task_port_summary), summary_compare);
+
+    printf("  pid  process                   total   send   recv  sonce  pset  dead  dnreq  vouchers  kobject types
+");
+    printf("------ ------------------------ ------ ------ ------ ------ ----- ----- ------ ---------  -------------
+");
+    for (uint32_t i = 0; i < taskCount; i++) {
+        struct task_port_summary *summary = &summaries[i];
+        task_table_entry_counts_t counts = &summary->counts;
+
+        JSON_OBJECT_BEGIN(json);
+        JSON_OBJECT_SET(json, pid, %d, summary->taskinfo->pid);
+        JSON_OBJECT_SET(json, name, "%s", summary->taskinfo->processName);
+        JSON_OBJECT_SET(json, total, %d, counts->total);
+        JSON_OBJECT_SET(json, send_rights, %d, counts->sendcount);
+        JSON_OBJECT_SET(json, receive_rights, %d, counts->receivecount);
+        JSON_OBJECT_SET(json, send_once_rights, %d, counts->sendoncecount);
+        JSON_OBJECT_SET(json, port_sets, %d, counts->portsetcount);
+        JSON_OBJECT_SET(json, dead_names, %d, counts->deadcount);
+        JSON_OBJECT_SET(json, dead_name requests, %d, counts->dncount);
+        JSON_OBJECT_SET(json, vouchers, %d, counts->vouchercount);
+
+        printf("%6d %-24.24s %6d %6d %6d %6d %5d %5d %6d %9d ",
+               summary->taskinfo->pid,
+               summary->taskinfo->processName,
+               counts->total,
+               counts->sendcount,
+               counts->receivecount,
+               counts->sendoncecount,
+               counts->portsetcount,
+               counts->deadcount,
+               counts->dncount,
+               counts->vouchercount);
+
+        summary_top_kotypes(summary, top);
+        for (int t = 0; t < SUMMARY_TOP_KOTYPES && top[t] >= 0; t++) {
+            printf(" %s:%d", kobject_name(top[t]), summary->kotypes[top[t]]);
+        }
+
+        JSON_KEY(json, kobject_types);
+        JSON_ARRAY_BEGIN(json);
+        for (int k = 1; k < IKOT_MAX_TYPE; k++) {
+            if (summary->kotypes[k] == 0)
+                continue;
+            JSON_OBJECT_BEGIN(json);
+            JSON_OBJECT_SET(json, type, "%s", kobject_name(k));
+            JSON_OBJECT_SET(json, count, %d, summary->kotypes[k]);
+            JSON_OBJECT_END(json); // kobject type
+        }
+        JSON_ARRAY_END(json); // kobject_types
+        JSON_OBJECT_END(json); // process
+        printf("\n");
+    }
+
+    free(summaries);
+}
+
 static void show_task_table_entry(ipc_info_name_t *entry, my_per_task_info_t *taskinfo, uint32_t taskCount, my_per_task_info_t *allTaskInfos, task_table_entry_counts_t counts, JSON_t json) {
     int j, k, port_status_flag_idx;
     kern_return_t ret;
@@ -538,7 +707,7 @@ static void show_task_table_entry(ipc_info_name_t *entry, my_per_task_info_t *ta
             if (allTaskInfos[j].valid == FALSE)
                 continue;
 
-            k2nnode = k2n_table_lookup(allTaskInfos[j].k2ntable, entry->iin_object);
+            k2nnode = k2n_table_lookup(&allTaskInfos[j].k2ntable, entry->iin_object);
 
             while (k2nnode) {
                 if (k2nnode->info_name != entry) {
@@ -556,7 +725,7 @@ static void show_task_table_entry(ipc_info_name_t *entry, my_per_task_info_t *ta
                            allTaskInfos[j].processName);
                 }
 
-                k2nnode = k2n_table_lookup_next(k2nnode, entry->iin_object);
+                k2nnode = k2n_table_lookup_next(&allTaskInfos[j].k2ntable, k2nnode, entry->iin_object);
             }
         }
         return;
@@ -666,10 +835,11 @@ static void show_task_table_entry(ipc_info_name_t *entry, my_per_task_info_t *ta
         if (kotype == IKOT_VOUCHER) {
             counts->vouchercount++;
             if (lsmp_config.show_voucher_details) {
-                JSON_KEY(json, recipes);
-                JSON_ARRAY_BEGIN(json);
-                char * detail = copy_voucher_detail(taskinfo->task, entry->iin_name, json);
-                JSON_ARRAY_END(json); // recipes
+                JSON_t recipes_json = lsmp_config.json_compact ? NULL : json;
+                JSON_KEY(recipes_json, recipes);
+                JSON_ARRAY_BEGIN(recipes_json);
+                char * detail = copy_voucher_detail(taskinfo->task, entry->iin_name, recipes_json);
+                JSON_ARRAY_END(recipes_json); // recipes
                 printf("%s\n", detail);
                 free(detail);
             }
@@ -0,0 +1,222 @@
+/*
+ * Copyright (c) 2026 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+ * System-wide process enumeration shared by lsmp, lskq, ltop,
+ * vm_purgeable_stat, iostat and taskpolicy: the pids of every process,
+ * kept in buffers that are reused from one refresh to the next along with
+ * what changed since the last one, and the task ports of every task.
+ *
+ * It is all static inline; include it as "proctab.h".
+ */
+
+#ifndef _PROCTAB_H_
+#define _PROCTAB_H_
+
+#include <sys/types.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libproc.h>
+#include <mach/mach.h>
+#include <mach/mach_error.h>
+
+/*
+ * pids is the list as the kernel handed it over.  After each refresh,
+ * added and removed hold, in pid order, the pids that are new since the
+ * refresh before and those that have gone; the first refresh adds every
+ * pid.  A pid that exits and is reused between two refreshes is not seen
+ * to change.
+ */
+struct proctab {
+	pid_t		*pids;
+	int		count;
+	uint64_t	generation;	/* refreshes so far */
+	pid_t		*added;
+	int		nadded;
+	pid_t		*removed;
+	int		nremoved;
+
+	/* the current and previous pids, sorted */
+	pid_t		*sorted;
+	pid_t		*prev;
+	int		nprev;
+	int		alloc;		/* entries in each of the buffers */
+};
+
+static inline int
+proctab_pid_compare(const void *a, const void *b)
+{
+	pid_t	pa = *(const pid_t *)a, pb = *(const pid_t *)b;
+
+	return ((pa > pb) - (pa < pb));
+}
+
+static inline int
+proctab_grow(struct proctab *pt, int alloc)
+{
+	pid_t	**bufs[] = { &pt->pids, &pt->added, &pt->removed, &pt->sorted, &pt->prev };
+	pid_t	*p;
+	size_t	i;
+
+	for (i = 0; i < sizeof(bufs) / sizeof(bufs[0]); i++) {
+		if ((p = realloc(*bufs[i], (size_t)alloc * sizeof(pid_t))) == NULL)
+			return (-1);
+		*bufs[i] = p;
+	}
+	pt->alloc = alloc;
+
+	return (0);
+}
+
+/*
+ * List the pids again.  Returns 0, or -1 with errno set.
+ */
+static inline int
+proctab_refresh(struct proctab *pt)
+{
+	pid_t	*swap;
+	int	n, i, j;
+
+	for (;;) {
+		if (pt->alloc == 0 && proctab_grow(pt, 2048) < 0)
+			return (-1);
+
+		errno = 0;
+		n = proc_listpids(PROC_ALL_PIDS, 0, pt->pids, pt->alloc * (int)sizeof(pid_t));
+
+		if (n <= 0) {
+			if (errno == EAGAIN)
+				continue;
+			if (errno != 0)
+				return (-1);
+			n = 0;
+		}
+		n /= (int)sizeof(pid_t);
+
+		/* a full buffer may have been short; leave some room to grow */
+		if (n < pt->alloc)
+			break;
+		if (proctab_grow(pt, n + n / 4 + 16) < 0)
+			return (-1);
+	}
+	pt->count = n;
+
+	memcpy(pt->sorted, pt->pids, (size_t)n * sizeof(pid_t));
+	qsort(pt->sorted, (size_t)n, sizeof(pid_t), proctab_pid_compare);
+
+	pt->nadded = pt->nremoved = 0;
+
+	for (i = j = 0; i < n || j < pt->nprev;) {
+		if (j == pt->nprev || (i < n && pt->sorted[i] < pt->prev[j]))
+			pt->added[pt->nadded++] = pt->sorted[i++];
+		else if (i == n || pt->prev[j] < pt->sorted[i])
+			pt->removed[pt->nremoved++] = pt->prev[j++];
+		else
+			i++, j++;
+	}
+
+	swap = pt->prev;
+	pt->prev = pt->sorted;
+	pt->sorted = swap;
+	pt->nprev = n;
+	pt->generation++;
+
+	return (0);
+}
+
+/*
+ * Whether pid was there at the last refresh.
+ */
+static inline int
+proctab_has(const struct proctab *pt, pid_t pid)
+{
+	return (bsearch(&pid, pt->prev, (size_t)pt->nprev, sizeof(pid_t), proctab_pid_compare) != NULL);
+}
+
+static inline void
+proctab_free(struct proctab *pt)
+{
+	free(pt->pids);
+	free(pt->added);
+	free(pt->removed);
+	free(pt->sorted);
+	free(pt->prev);
+	memset(pt, 0, sizeof(*pt));
+}
+
+/*
+ * A port of the given flavor for every task on the system, which needs
+ * root.  Failures are reported on stderr, and return -1.  The ports and
+ * the array are released with proctab_release_tasks().
+ */
+static inline int
+proctab_tasks(mach_task_flavor_t flavor, task_array_t *tasks, mach_msg_type_number_t *count)
+{
+	processor_set_name_array_t psets;
+	mach_msg_type_number_t psetCount;
+	mach_port_t pset_priv;
+	kern_return_t ret;
+
+	ret = host_processor_sets(mach_host_self(), &psets, &psetCount);
+	if (ret != KERN_SUCCESS) {
+		fprintf(stderr, "host_processor_sets() failed: %s\n", mach_error_string(ret));
+		return -1;
+	}
+	if (psetCount != 1) {
+		fprintf(stderr, "Assertion Failure: pset count greater than one (%d)\n", psetCount);
+		return -1;
+	}
+
+	/* convert the processor-set-name port to a privileged port */
+	ret = host_processor_set_priv(mach_host_self(), psets[0], &pset_priv);
+	if (ret != KERN_SUCCESS) {
+		fprintf(stderr, "host_processor_set_priv() failed: %s\n", mach_error_string(ret));
+		return -1;
+	}
+	mach_port_deallocate(mach_task_self(), psets[0]);
+	vm_deallocate(mach_task_self(), (vm_address_t)psets, (vm_size_t)psetCount * sizeof(mach_port_t));
+
+	/* convert the processor-set-priv to a list of tasks for the processor set */
+	ret = processor_set_tasks_with_flavor(pset_priv, flavor, tasks, count);
+	if (ret != KERN_SUCCESS) {
+		fprintf(stderr, "processor_set_tasks_with_flavor() failed: %s\n", mach_error_string(ret));
+		return -1;
+	}
+	mach_port_deallocate(mach_task_self(), pset_priv);
+	return 0;
+}
+
+static inline void
+proctab_release_tasks(task_array_t tasks, mach_msg_type_number_t count)
+{
+	mach_msg_type_number_t i;
+
+	for (i = 0; i < count; i++)
+		mach_port_deallocate(mach_task_self(), tasks[i]);
+	vm_deallocate(mach_task_self(), (vm_address_t)tasks, (vm_size_t)count * sizeof(task_t));
+}
+
+#endif /* _PROCTAB_H_ */
@@ -28,65 +28,109 @@
 #include <stdlib.h>
 #include <libproc.h>
 #include <assert.h>
+#include <sys/param.h>
+#include <errno.h>
+#include <string.h>
 
 #include "common.h"
 
 #pragma mark kobject to name hash table implementation
 
-#if (K2N_TABLE_SIZE & (K2N_TABLE_SIZE - 1) != 0)
-#error K2N_TABLE_SIZE must be a power of two
+#if (K2N_TABLE_MIN_SIZE & (K2N_TABLE_MIN_SIZE - 1)) != 0
+#error K2N_TABLE_MIN_SIZE must be a power of two
 #endif
 
-#define K2N_TABLE_MASK	(K2N_TABLE_SIZE - 1)
-
 static uint32_t k2n_hash(natural_t kobject) {
     return (uint64_t)kobject * 2654435761 >> 32;
 }
 
-static struct k2n_table_node *k2n_table_lookup_next_internal(struct k2n_table_node *node, natural_t kobject) {
-    while (node) {
-        if (kobject == node->kobject)
-            return node;
+/* scan forward from slot i for the next node holding kobject */
+static struct k2n_table_node *k2n_table_probe(struct k2n_table *table, uint32_t i, natural_t kobject) {
+    uint32_t mask = table->size - 1;
+    uint32_t probes = 0;
+    struct k2n_table_node *node = NULL;
 
-        node = node->next;
+    for (;;) {
+        probes++;
+        if (table->nodes[i].info_name == NULL)
+            break;
+        if (table->nodes[i].kobject == kobject) {
+            node = &table->nodes[i];
+            break;
+        }
+        i = (i + 1) & mask;
     }
 
-    return NULL;
+    table->lookups++;
+    table->probes += probes;
+    if (probes > table->max_probe)
+        table->max_probe = probes;
+    return node;
 }
 
-struct k2n_table_node *k2n_table_lookup_next(struct k2n_table_node *node, natural_t kobject) {
+struct k2n_table_node *k2n_table_lookup_next(struct k2n_table *table, struct k2n_table_node *node, natural_t kobject) {
     if (!node) {
         return NULL;
     }
-    return k2n_table_lookup_next_internal(node->next, kobject);
+    return k2n_table_probe(table, ((uint32_t)(node - table->nodes) + 1) & (table->size - 1), kobject);
 }
 
-struct k2n_table_node *k2n_table_lookup(struct k2n_table_node **table, natural_t kobject) {
-    uint32_t hv;
-    struct k2n_table_node *node;
-
-    hv = k2n_hash(kobject);
+struct k2n_table_node *k2n_table_lookup(struct k2n_table *table, natural_t kobject) {
+    if (table->count == 0) {
+        return NULL;
+    }
+    return k2n_table_probe(table, k2n_hash(kobject) & (table->size - 1), kobject);
+}
 
-    node = table[hv & K2N_TABLE_MASK];
+static void k2n_table_insert(struct k2n_table_node *nodes, uint32_t size, struct k2n_table_node *entry) {
+    uint32_t i = k2n_hash(entry->kobject) & (size - 1);
 
-    return k2n_table_lookup_next_internal(node, kobject);
+    while (nodes[i].info_name != NULL) {
+        i = (i + 1) & (size - 1);
+    }
+    nodes[i] = *entry;
 }
 
-static void k2n_table_enter(struct k2n_table_node **table, natural_t kobject, ipc_info_name_t *info_name) {
-    uint32_t hv;
-    struct k2n_table_node *node;
+/* keep the table at most half full, doubling (and rehashing) as needed */
+static void k2n_table_reserve(struct k2n_table *table, uint32_t count) {
+    uint32_t size = table->size ? table->size : K2N_TABLE_MIN_SIZE;
+    struct k2n_table_node *nodes;
+
+    while (size / 2 < count) {
+        size *= 2;
+    }
+    if (size == table->size) {
+        return;
+    }
 
-    hv = k2n_hash(kobject);
+    nodes = calloc(size, sizeof(struct k2n_table_node));
+    assert(nodes);
+    for (uint32_t i = 0; i < table->size; i++) {
+        if (table->nodes[i].info_name != NULL) {
+            k2n_table_insert(nodes, size, &table->nodes[i]);
+        }
+    }
+    free(table->nodes);
+    table->nodes = nodes;
+    table->size = size;
+}
 
-    node = malloc(sizeof (struct k2n_table_node));
-    assert(node);
+static void k2n_table_enter(struct k2n_table *table, natural_t kobject, ipc_info_name_t *info_name, my_per_task_info_t *taskinfo) {
+    struct k2n_table_node node = {
+        .kobject = kobject,
+        .info_name = info_name,
+        .taskinfo = taskinfo,
+    };
 
-    node->kobject = kobject;
-    node->info_name = info_name;
     assert(kobject == info_name->iin_object);
+    k2n_table_reserve(table, table->count + 1);
+    k2n_table_insert(table->nodes, table->size, &node);
+    table->count++;
+}
 
-    node->next = table[hv & K2N_TABLE_MASK];
-    table[hv & K2N_TABLE_MASK] = node;
+static void k2n_table_free(struct k2n_table *table) {
+    free(table->nodes);
+    bzero(table, sizeof(*table));
 }
 
 #pragma mark -
@@ -120,6 +164,10 @@ static void proc_pid_to_name(int pid, char *pname){
 static my_per_task_info_t *global_taskinfo = NULL;
 static uint32_t global_taskcount = 0;
 
+/* receive rights of every collected task, keyed by kobject; built on first use */
+static struct k2n_table global_receivers;
+static boolean_t global_receivers_built = FALSE;
+
 my_per_task_info_t * allocate_taskinfo_memory(uint32_t taskCount)
 {
     my_per_task_info_t * retval = malloc(taskCount * sizeof(my_per_task_info_t));
@@ -133,6 +181,11 @@ my_per_task_info_t * allocate_taskinfo_memory(uint32_t taskCount)
 
 void deallocate_taskinfo_memory(my_per_task_info_t *data){
     if (data) {
+        for (uint32_t i = 0; i < global_taskcount; i++) {
+            k2n_table_free(&data[i].k2ntable);
+        }
+        k2n_table_free(&global_receivers);
+        global_receivers_built = FALSE;
         free(data);
         global_taskinfo = NULL;
         global_taskcount = 0;
@@ -228,9 +281,9 @@ kern_return_t collect_per_task_info(my_per_task_info_t *taskinfo, task_read_t ta
         return ret;
     }
 
-    bzero(taskinfo->k2ntable, K2N_TABLE_SIZE * sizeof (struct k2n_table_node *));
+    k2n_table_reserve(&taskinfo->k2ntable, taskinfo->tableCount);
     for (i = 0; i < taskinfo->tableCount; i++) {
-        k2n_table_enter(taskinfo->k2ntable, taskinfo->table[i].iin_object, &taskinfo->table[i]);
+        k2n_table_enter(&taskinfo->k2ntable, taskinfo->table[i].iin_object, &taskinfo->table[i], taskinfo);
     }
 
     proc_pid_to_name(taskinfo->pid, taskinfo->processName);
@@ -474,21 +527,59 @@ static kern_return_t _get_taskinfo_of_receiver_by_send_right(natural_t kobject,
     *out_taskinfo = &NOT_FOUND_TASK_INFO;
     struct k2n_table_node *k2nnode;
 
-    for (unsigned int j = 0; j < global_taskcount; j++) {
-        if ((k2nnode = k2n_table_lookup(global_taskinfo[j].k2ntable, kobject))) {
-            assert(k2nnode->info_name->iin_object == kobject);
-
-            if (k2nnode->info_name->iin_type & MACH_PORT_TYPE_RECEIVE) {
-                *out_taskinfo = &global_taskinfo[j];
-                *out_recv_info = k2nnode->info_name->iin_name;
-                return KERN_SUCCESS;
+    if (!global_receivers_built) {
+        /* one pass over every task instead of a lookup in each task per query */
+        for (unsigned int j = 0; j < global_taskcount; j++) {
+            struct k2n_table *table = &global_taskinfo[j].k2ntable;
+            for (uint32_t i = 0; i < table->size; i++) {
+                k2nnode = &table->nodes[i];
+                if (k2nnode->info_name != NULL && (k2nnode->info_name->iin_type & MACH_PORT_TYPE_RECEIVE)) {
+                    k2n_table_enter(&global_receivers, k2nnode->kobject, k2nnode->info_name, k2nnode->taskinfo);
+                }
             }
         }
+        global_receivers_built = TRUE;
+    }
+
+    /* the first task (in task order) holding the receive right wins */
+    struct k2n_table_node *found = NULL;
+    for (k2nnode = k2n_table_lookup(&global_receivers, kobject); k2nnode;
+         k2nnode = k2n_table_lookup_next(&global_receivers, k2nnode, kobject)) {
+        if (found == NULL || k2nnode->taskinfo < found->taskinfo)
+            found = k2nnode;
+    }
+    if (found) {
+        assert(found->info_name->iin_object == kobject);
+        *out_taskinfo = found->taskinfo;
+        *out_recv_info = found->info_name->iin_name;
+        return KERN_SUCCESS;
     }
 
     return KERN_FAILURE;
 }
 
+void print_k2n_table_stats(FILE *out)
+{
+    uint64_t count = 0, size = 0, lookups = 0, probes = 0;
+    uint32_t max_probe = 0;
+
+    for (unsigned int j = 0; j < global_taskcount; j++) {
+        struct k2n_table *table = &global_taskinfo[j].k2ntable;
+        count += table->count;
+        size += table->size;
+        lookups += table->lookups;
+        probes += table->probes;
+        max_probe = MAX(max_probe, table->max_probe);
+    }
+
+    fprintf(out, "kobject tables: %llu names in %llu slots across %u tasks, %llu lookups, %.2f probes/lookup, max %u\n",
+            count, size, global_taskcount, lookups, lookups ? (double)probes / lookups : 0.0, max_probe);
+    fprintf(out, "receiver table: %u receive rights in %u slots, %llu lookups, %.2f probes/lookup, max %u\n",
+            global_receivers.count, global_receivers.size, global_receivers.lookups,
+            global_receivers.lookups ? (double)global_receivers.probes / global_receivers.lookups : 0.0,
+            global_receivers.max_probe);
+}
+
 kern_return_t get_taskinfo_of_receiver_by_send_right(ipc_info_name_t sendright, my_per_task_info_t **out_taskinfo, mach_port_name_t *out_recv_info)
 {
     return _get_taskinfo_of_receiver_by_send_right(sendright.iin_object, out_taskinfo, out_recv_info);
@@ -498,3 +589,298 @@ kern_return_t get_taskinfo_of_receiver_by_send_right_info(ipc_info_port_t sendri
 {
     return _get_taskinfo_of_receiver_by_send_right(sendright_info.iip_port_object, out_taskinfo, out_recv_info);
 }
+
+#pragma mark snapshots
+
+/*
+ * A snapshot is a header followed, per task, by a snapshot_task record and
+ * its names. Only what is needed to tell which rights came and went is kept,
+ * in host byte order; it is meant to be diffed on the machine it came from.
+ */
+#define SNAPSHOT_MAGIC   0x504d534c /* "LSMP" */
+#define SNAPSHOT_VERSION 1
+
+struct snapshot_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t taskCount;
+};
+
+struct snapshot_task {
+    int32_t pid;
+    uint32_t nameCount;
+    char processName[PROC_NAME_LEN];
+};
+
+struct snapshot_name {
+    mach_port_name_t name;
+    natural_t object;
+    mach_port_type_t type;
+    mach_port_urefs_t urefs;
+};
+
+struct snapshot {
+    struct snapshot_task task;
+    struct snapshot_name *names; /* sorted by name */
+};
+
+#define SNAPSHOT_RIGHTS (MACH_PORT_TYPE_ALL_RIGHTS | MACH_PORT_TYPE_DEAD_NAME)
+
+static int snapshot_name_compare(const void *a, const void *b) {
+    const struct snapshot_name *na = a, *nb = b;
+
+    if (na->name != nb->name)
+        return na->name < nb->name ? -1 : 1;
+    return 0;
+}
+
+static int snapshot_pid_compare(const void *a, const void *b) {
+    const struct snapshot *sa = a, *sb = b;
+
+    return sa->task.pid - sb->task.pid;
+}
+
+/* build the in-memory snapshot of the valid tasks, sorted by pid then name */
+static struct snapshot *snapshot_collect(my_per_task_info_t *taskinfos, uint32_t taskCount, uint32_t *out_count) {
+    struct snapshot *snaps = calloc(MAX(taskCount, 1), sizeof(struct snapshot));
+    uint32_t count = 0;
+
+    assert(snaps);
+    for (uint32_t i = 0; i < taskCount; i++) {
+        my_per_task_info_t *taskinfo = &taskinfos[i];
+        struct snapshot *snap;
+
+        if (taskinfo->valid != TRUE)
+            continue;
+        snap = &snaps[count++];
+        snap->task.pid = taskinfo->pid;
+        strlcpy(snap->task.processName, taskinfo->processName, sizeof(snap->task.processName));
+        snap->names = malloc(MAX(taskinfo->tableCount, 1) * sizeof(struct snapshot_name));
+        assert(snap->names);
+        for (unsigned int k = 0; k < taskinfo->tableCount; k++) {
+            ipc_info_name_t *entry = &taskinfo->table[k];
+            if ((entry->iin_type & SNAPSHOT_RIGHTS) == 0)
+                continue;
+            snap->names[snap->task.nameCount++] = (struct snapshot_name){
+                .name = entry->iin_name,
+                .object = entry->iin_object,
+                .type = entry->iin_type & SNAPSHOT_RIGHTS,
+                .urefs = entry->iin_urefs,
+            };
+        }
+        qsort(snap->names, snap->task.nameCount, sizeof(struct snapshot_name), snapshot_name_compare);
+    }
+    qsort(snaps, count, sizeof(struct snapshot), snapshot_pid_compare);
+    *out_count = count;
+    return snaps;
+}
+
+static void snapshot_free(struct snapshot *snaps, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        free(snaps[i].names);
+    }
+    free(snaps);
+}
+
+int save_snapshot(const char *path, my_per_task_info_t *taskinfos, uint32_t taskCount)
+{
+    struct snapshot_header header = { .magic = SNAPSHOT_MAGIC, .version = SNAPSHOT_VERSION };
+    struct snapshot *snaps = snapshot_collect(taskinfos, taskCount, &header.taskCount);
+    FILE *f = fopen(path, "w");
+    int ret = 0;
+
+    if (f == NULL) {
+        ret = errno;
+        fprintf(stderr, "Unable to open \"%s\": %s\n", path, strerror(ret));
+        snapshot_free(snaps, header.taskCount);
+        return ret;
+    }
+
+    if (fwrite(&header, sizeof(header), 1, f) != 1)
+        ret = errno;
+    for (uint32_t i = 0; ret == 0 && i < header.taskCount; i++) {
+        if (fwrite(&snaps[i].task, sizeof(snaps[i].task), 1, f) != 1 ||
+            fwrite(snaps[i].names, sizeof(struct snapshot_name), snaps[i].task.nameCount, f) != snaps[i].task.nameCount)
+            ret = errno;
+    }
+    if (fclose(f) != 0 && ret == 0)
+        ret = errno;
+    if (ret != 0)
+        fprintf(stderr, "Unable to write snapshot \"%s\": %s\n", path, strerror(ret));
+
+    snapshot_free(snaps, header.taskCount);
+    return ret;
+}
+
+static struct snapshot *load_snapshot(const char *path, uint32_t *out_count) {
+    struct snapshot_header header;
+    struct snapshot *snaps = NULL;
+    uint32_t count = 0;
+    FILE *f = fopen(path, "r");
+
+    if (f == NULL) {
+        fprintf(stderr, "Unable to open \"%s\": %s\n", path, strerror(errno));
+        return NULL;
+    }
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+        header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION) {
+        fprintf(stderr, "\"%s\" is not an lsmp snapshot\n", path);
+        goto fail;
+    }
+
+    snaps = calloc(MAX(header.taskCount, 1), sizeof(struct snapshot));
+    assert(snaps);
+    for (count = 0; count < header.taskCount; count++) {
+        struct snapshot *snap = &snaps[count];
+        if (fread(&snap->task, sizeof(snap->task), 1, f) != 1)
+            goto truncated;
+        snap->task.processName[PROC_NAME_LEN - 1] = '\0';
+        snap->names = malloc(MAX(snap->task.nameCount, 1) * sizeof(struct snapshot_name));
+        assert(snap->names);
+        if (fread(snap->names, sizeof(struct snapshot_name), snap->task.nameCount, f) != snap->task.nameCount) {
+            count++;
+            goto truncated;
+        }
+    }
+    fclose(f);
+    *out_count = count;
+    return snaps;
+
+truncated:
+    fprintf(stderr, "Snapshot \"%s\" is truncated\n", path);
+fail:
+    fclose(f);
+    if (snaps)
+        snapshot_free(snaps, count);
+    return NULL;
+}
+
+static const char *snapshot_rights_string(mach_port_type_t type) {
+    if (type == MACH_PORT_TYPE_PORT_SET)
+        return "port-set";
+    if (type & MACH_PORT_TYPE_DEAD_NAME)
+        return "dead-name";
+    if ((type & MACH_PORT_TYPE_RECEIVE) && (type & MACH_PORT_TYPE_SEND))
+        return "recv,send";
+    if (type & MACH_PORT_TYPE_RECEIVE)
+        return "recv";
+    if (type & MACH_PORT_TYPE_SEND)
+        return "send";
+    if (type & MACH_PORT_TYPE_SEND_ONCE)
+        return "send-once";
+    return "unknown";
+}
+
+static void diff_print_name(char change, const struct snapshot_name *n, JSON_t json) {
+    JSON_OBJECT_BEGIN(json);
+    JSON_OBJECT_SET(json, change, "%s", change == '+' ? "appeared" : "disappeared");
+    JSON_OBJECT_SET(json, name, "0x%08x", n->name);
+    JSON_OBJECT_SET(json, ipc-object, "0x%08x", n->object);
+    JSON_OBJECT_SET(json, rights, "%s", snapshot_rights_string(n->type));
+    JSON_OBJECT_SET(json, urefs, %d, n->urefs);
+    JSON_OBJECT_END(json);
+
+    printf("  %c 0x%08x  0x%08x  %-10s %5d\n", change, n->name, n->object, snapshot_rights_string(n->type), n->urefs);
+}
+
+/*
+ * Walk the two sorted name lists of one task. A name whose object or rights
+ * changed counts as the old right disappearing and a new one appearing;
+ * uref changes on an otherwise unchanged right are not reported.
+ */
+static void diff_task(const struct snapshot *old, const struct snapshot *new, JSON_t json) {
+    uint32_t o = 0, n = 0, appeared = 0, disappeared = 0;
+    const struct snapshot *who = new ? new : old;
+    uint32_t ocount = old ? old->task.nameCount : 0;
+    uint32_t ncount = new ? new->task.nameCount : 0;
+    boolean_t header = FALSE;
+
+    while (o < ocount || n < ncount) {
+        const struct snapshot_name *on = o < ocount ? &old->names[o] : NULL;
+        const struct snapshot_name *nn = n < ncount ? &new->names[n] : NULL;
+        const struct snapshot_name *gone = NULL, *came = NULL;
+
+        if (nn == NULL || (on != NULL && on->name < nn->name)) {
+            gone = on;
+            o++;
+        } else if (on == NULL || nn->name < on->name) {
+            came = nn;
+            n++;
+        } else {
+            if (on->object != nn->object || on->type != nn->type) {
+                gone = on;
+                came = nn;
+            }
+            o++;
+            n++;
+        }
+        if (gone == NULL && came == NULL)
+            continue;
+
+        if (!header) {
+            printf("Process (%d) : %s%s\n", who->task.pid, who->task.processName,
+                   old == NULL ? " (new)" : new == NULL ? " (exited)" : "");
+            JSON_OBJECT_BEGIN(json);
+            JSON_OBJECT_SET(json, pid, %d, who->task.pid);
+            JSON_OBJECT_SET(json, name, "%s", who->task.processName);
+            JSON_OBJECT_SET(json, status, "%s", old == NULL ? "new" : new == NULL ? "exited" : "running");
+            JSON_KEY(json, changes);
+            JSON_ARRAY_BEGIN(json);
+            header = TRUE;
+        }
+        if (gone) {
+            diff_print_name('-', gone, json);
+            disappeared++;
+        }
+        if (came) {
+            diff_print_name('+', came, json);
+            appeared++;
+        }
+    }
+
+    if (header) {
+        JSON_ARRAY_END(json); // changes
+        JSON_OBJECT_SET(json, appeared, %d, appeared);
+        JSON_OBJECT_SET(json, disappeared, %d, disappeared);
+        JSON_OBJECT_END(json); // process
+        printf("  %u appeared, %u disappeared\n\n", appeared, disappeared);
+    }
+}
+
+int diff_snapshot(const char *path, my_per_task_info_t *taskinfos, uint32_t taskCount, JSON_t json)
+{
+    uint32_t ocount = 0, ncount = 0, o = 0, n = 0;
+    struct snapshot *olds = load_snapshot(path, &ocount);
+    struct snapshot *news;
+
+    if (olds == NULL)
+        return EINVAL;
+    news = snapshot_collect(taskinfos, taskCount, &ncount);
+
+    /* both sides are sorted by pid; a reused pid with a new name is a new task */
+    while (o < ocount || n < ncount) {
+        struct snapshot *os = o < ocount ? &olds[o] : NULL;
+        struct snapshot *ns = n < ncount ? &news[n] : NULL;
+
+        if (ns == NULL || (os != NULL && os->task.pid < ns->task.pid)) {
+            diff_task(os, NULL, json);
+            o++;
+        } else if (os == NULL || ns->task.pid < os->task.pid) {
+            diff_task(NULL, ns, json);
+            n++;
+        } else if (strcmp(os->task.processName, ns->task.processName) != 0) {
+            diff_task(os, NULL, json);
+            diff_task(NULL, ns, json);
+            o++;
+            n++;
+        } else {
+            diff_task(os, ns, json);
+            o++;
+            n++;
+        }
+    }
+
+    snapshot_free(olds, ocount);
+    snapshot_free(news, ncount);
+    return 0;
+}
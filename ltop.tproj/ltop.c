@@ -5,11 +5,13 @@
 #include <string.h>
 #include <unistd.h>
 #include <libproc.h>
+#include <time.h>
 #include <sys/types.h>
-#include <sys/sysctl.h>
 #include <Kernel/kern/ledger.h>
 #include <mach/mach_types.h>
 
+#include "proctab.h"
+
 extern int ledger(int cmd, caddr_t arg1, caddr_t arg2, caddr_t arg3);
 
 int pid = -1;
@@ -17,28 +19,59 @@ char *group_print = NULL;
 char *resource_print = NULL;
 int diff_mode = 0;
 
+/* -s: rank processes by one resource's entry; -n: show only the first top_n */
+enum sort_field { SORT_BALANCE, SORT_CREDIT, SORT_DEBIT, SORT_RATE };
+char *sort_resource = NULL;
+enum sort_field sort_field = SORT_BALANCE;
+int top_n = 0;
+
+/* -o: one CSV row per entry, or one JSON object per sample, instead of the table */
+enum output_format { OUTPUT_TEXT, OUTPUT_CSV, OUTPUT_JSON };
+enum output_format output_format = OUTPUT_TEXT;
+
+/*
+ * Processes and ledgers persist across refreshes, each on a list (procs is
+ * kept sorted by pid for display) and in a small chained hash so a refresh
+ * costs one lookup per pid rather than a walk of every list.
+ */
+#define	HASH_SIZE	1024	/* must be a power of two */
+#define	HASH(key)	((uint32_t)(key) * 2654435761u >> 22 & (HASH_SIZE - 1))
+
 struct proc_list {
 	int pid;
 	int seen;
 	char name[2 * MAXCOMLEN];
 	struct ledger *ledger;
 	struct proc_list *next;
+	struct proc_list *hnext;
 };
 
 struct proc_list *procs = NULL;
+struct proc_list *proc_hash[HASH_SIZE];
 struct ledger_template_info *template = NULL;
 int entry_cnt = 0;
 
+/* processes first seen during this refresh, merged into procs afterwards */
+struct proc_list **new_procs = NULL;
+int new_procs_cnt = 0;
+int new_procs_alloc = 0;
+
 struct ledger {
 	int64_t id;
 	int seen;
 	int64_t entries;
+	int64_t alloc;		/* capacity of info and old_info */
 	struct ledger_entry_info *info;
 	struct ledger_entry_info *old_info;
 	struct ledger *next;
+	struct ledger *hnext;
 };
 
 struct ledger *ledgers = NULL;
+struct ledger *ledger_hash[HASH_SIZE];
+
+/* every pid, relisted each interval into the same buffers */
+struct proctab ptab;
 
 static void
 get_template_info(void)
@@ -68,6 +101,7 @@ top:
 		goto top;
 	}
 	entry_cnt = cnt;
+	free(template);
 	template = buf;
 }
 
@@ -114,43 +148,37 @@ validate_group(void)
 	exit (1);
 }
 
-static void
-validate_resource(void)
+static int
+find_resource(const char *name)
 {
 	int i;
 
-	if (template == NULL)
-		get_template_info();
-
 	for (i = 0; i < entry_cnt; i++)
-		if (!strcmp(resource_print, template[i].lti_name))
-			return;
-
-	fprintf(stderr, "No such resource: %s\n", resource_print);
-	exit (1);
+		if (!strcmp(name, template[i].lti_name))
+			return (i);
+	return (-1);
 }
 
-static size_t
-get_kern_max_proc(void)
+static void
+validate_resource(const char *name)
 {
-	int mib[] = { CTL_KERN, KERN_MAXPROC };
-	int max;
-	size_t max_sz = sizeof (max);
+	if (template == NULL)
+		get_template_info();
 
-	if (sysctl(mib, 2, &max, &max_sz, NULL, 0) < 0) {
-		perror("Failed to get max proc count");
-		exit (1);
-	}
+	if (find_resource(name) >= 0)
+		return;
 
-	return (max);
+	fprintf(stderr, "No such resource: %s\n", name);
+	exit (1);
 }
 
 static struct ledger *
 ledger_find(struct ledger_info *li)
 {
 	struct ledger *l;
+	uint32_t h = HASH(li->li_id);
 
-	for (l = ledgers; l && (li->li_id != l->id); l = l->next)
+	for (l = ledger_hash[h]; l && (li->li_id != l->id); l = l->hnext)
 		;
 
 	if (l == NULL) {
@@ -159,34 +187,73 @@ ledger_find(struct ledger_info *li)
 			fprintf(stderr, "Out of memory");
 			exit (1);
 		}
+		/* an entry the cached template doesn't describe yet */
+		if (li->li_entries > entry_cnt)
+			get_template_info();
+
 		l->id = li->li_id;
 		l->entries = li->li_entries;
+		l->alloc = 0;
 		l->next = ledgers;
+		l->hnext = ledger_hash[h];
 		l->seen = 0;
 		l->info = NULL;
 		l->old_info = NULL;
 		ledgers = l;
+		ledger_hash[h] = l;
 	}
 	return (l);
 }
 
-static void
+/* returns 0, or errno if the process is gone */
+static int
 ledger_update(pid_t pid, struct ledger *l)
 {
 	void *arg;
-	struct ledger_entry_info *lei;
 	int64_t cnt;
 
 	cnt = l->entries;
 	if (cnt > entry_cnt)
 		cnt = entry_cnt;
+
+	/* info and old_info are swapped, not freed, between refreshes */
+	if (cnt > l->alloc) {
+		/* the template grew; the previous sample is too short to diff against */
+		free(l->info);
+		free(l->old_info);
+		l->info = NULL;
+		l->old_info = NULL;
+		l->alloc = cnt;
+	}
+	if (l->info == NULL) {
+		l->info = (struct ledger_entry_info *)calloc((size_t)l->alloc, sizeof (*l->info));
+		if (l->info == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			exit (1);
+		}
+	}
+
 	arg = (void *)(long)pid;
-    lei = (struct ledger_entry_info *)malloc((size_t)(cnt * sizeof (*lei)));
-	if (ledger(LEDGER_ENTRY_INFO, arg, (caddr_t)lei, (caddr_t)&cnt) < 0) {
+	errno = 0;
+	if (ledger(LEDGER_ENTRY_INFO, arg, (caddr_t)l->info, (caddr_t)&cnt) < 0) {
+		if (errno == ENOENT || errno == ESRCH)
+			return (errno);
+
 	perror("ledger_info() failed: ");
 		exit (1);
 	}
-	l->info = lei;
+	return (0);
+}
+
+static struct proc_list *
+proc_find(int pid)
+{
+	struct proc_list *proc;
+
+	for (proc = proc_hash[HASH(pid)]; proc; proc = proc->hnext)
+		if (proc->pid == pid)
+			break;
+	return (proc);
 }
 
 static void
@@ -200,6 +267,19 @@ get_proc_info(int pid)
 	if (pid == 0)
 		return;
 
+	/*
+	 * A pid we already track keeps its ledger, so skip LEDGER_INFO and
+	 * read the entries straight into that ledger's buffer.
+	 */
+	proc = proc_find(pid);
+	if (proc != NULL) {
+		if (ledger_update(pid, proc->ledger) == 0) {
+			proc->ledger->seen = 1;
+			proc->seen = 1;
+		}
+		return;
+	}
+
 	arg = (void *)(long)pid;
     errno = 0;
     if (ledger(LEDGER_INFO, arg, (caddr_t)&li, NULL) < 0) {
@@ -212,71 +292,87 @@ get_proc_info(int pid)
 	}
 
 	ledgerp = ledger_find(&li);
-	ledger_update(pid, ledgerp);
+	if (ledger_update(pid, ledgerp) != 0)
+		return;
 	ledgerp->seen = 1;
 
-	for (proc = procs; proc; proc = proc->next)
-		if (proc->pid == pid)
-			break;
+	proc = (struct proc_list *)malloc(sizeof (*proc));
 	if (proc == NULL) {
-		proc = (struct proc_list *)malloc(sizeof (*proc));
-		if (proc == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit (1);
+	}
+
+	if (proc_name(pid, proc->name, sizeof (proc->name)) == 0)
+		strlcpy(proc->name, "Error", sizeof (proc->name));
+
+	proc->pid = pid;
+	proc->ledger = ledgerp;
+	proc->next = NULL;
+	proc->hnext = proc_hash[HASH(pid)];
+	proc_hash[HASH(pid)] = proc;
+
+	if (new_procs_cnt == new_procs_alloc) {
+		new_procs_alloc = new_procs_alloc ? new_procs_alloc * 2 : 64;
+		new_procs = realloc(new_procs, new_procs_alloc * sizeof (*new_procs));
+		if (new_procs == NULL) {
 			fprintf(stderr, "Out of memory\n");
 			exit (1);
 		}
-
-		if (proc_name(pid, proc->name, sizeof (proc->name)) == 0)
-			strlcpy(proc->name, "Error", sizeof (proc->name));
-
-		proc->pid = pid;
-		proc->ledger = ledgerp;
-		proc->next = procs;
-		procs = proc;
 	}
+	new_procs[new_procs_cnt++] = proc;
 	proc->seen = 1;
 }
 
 static int
-pid_compare(const void *a, const void *b)
+proc_compare(const void *a, const void *b)
 {
-	pid_t *pid_a = (pid_t *)a;
-	pid_t *pid_b = (pid_t *)b;
+	const struct proc_list *proc_a = *(struct proc_list * const *)a;
+	const struct proc_list *proc_b = *(struct proc_list * const *)b;
 
-	return (*pid_b - *pid_a);
+	return (proc_a->pid - proc_b->pid);
 }
 
+/* merge the processes first seen this refresh into the pid-ordered list */
 static void
-get_all_info(void)
+merge_new_procs(void)
 {
-	pid_t *pids;
-	int sz, cnt, i;
-
-	if (pid < 0)
-		cnt = (int) get_kern_max_proc();
-	else
-		cnt = 1;
-
-	sz = cnt * sizeof(pid_t);
-	pids = (pid_t *)malloc(sz);
-	if (pids == NULL) {
-		perror("can't allocate memory for proc buffer\n");
-		exit (1);
+	struct proc_list *head = NULL, **tail = &head, *p = procs;
+	int i = 0;
+
+	if (new_procs_cnt == 0)
+		return;
+
+	qsort(new_procs, new_procs_cnt, sizeof (*new_procs), proc_compare);
+	while (p || i < new_procs_cnt) {
+		if (i == new_procs_cnt || (p && p->pid < new_procs[i]->pid)) {
+			*tail = p;
+			p = p->next;
+		} else {
+			*tail = new_procs[i++];
+		}
+		tail = &(*tail)->next;
 	}
+	*tail = NULL;
+	procs = head;
+	new_procs_cnt = 0;
+}
+
+static void
+get_all_info(void)
+{
+	int i;
 
 	if (pid < 0) {
-		cnt = proc_listallpids(pids, sz);
-		if (cnt < 0) {
+		if (proctab_refresh(&ptab) < 0) {
 			perror("failed to get list of active pids");
 			exit (1);
 		}
-		qsort(pids, cnt, sizeof (pid_t), pid_compare);
+		for (i = 0; i < ptab.count; i++)
+			get_proc_info(ptab.pids[i]);
 	} else {
-		pids[0] = pid;
+		get_proc_info(pid);
 	}
-
-	for (i = 0; i < cnt; i++)
-		get_proc_info(pids[i]);
-	free(pids);
+	merge_new_procs();
 }
 
 static void
@@ -315,67 +411,241 @@ print_num(int64_t num, int64_t delta)
 	printf("%*lld%s%c ", numwidth, num, suf, posneg);
 }
 
+static int
+entry_selected(int i)
+{
+	if (group_print && strcmp(group_print, template[i].lti_group))
+		return (0);
+	if (resource_print && strcmp(resource_print, template[i].lti_name))
+		return (0);
+	return (1);
+}
+
 static void
-dump_all_info(void)
+print_json_string(const char *str)
 {
-	struct ledger_entry_info *info, *old;
-	struct proc_list *p;
-	int line, i;
+	const char *c;
+
+	putchar('"');
+	for (c = str; *c; c++) {
+		if (*c == '"' || *c == '\\')
+			printf("\\%c", *c);
+		else if ((unsigned char)*c < 0x20)
+			printf("\\u%04x", (unsigned char)*c);
+		else
+			putchar(*c);
+	}
+	putchar('"');
+}
+
+/* the value of an entry as printed: the raw value, or with -d its delta */
+static int64_t
+entry_value(int64_t num, int64_t delta)
+{
+	return (diff_mode ? delta : num);
+}
+
+static int
+print_proc_text(struct proc_list *p)
+{
+	struct ledger_entry_info *info = p->ledger->info;
+	struct ledger_entry_info *old = p->ledger->old_info;
+	int line = 0, i;
 	int64_t d;
 
-	printf("\n%5s %32s %32s %10s  %10s  %10s  %10s  %10s \n", "PID", "COMMAND",
-	    "RESOURCE", "CREDITS", "DEBITS", "BALANCE", "LIMIT", "PERIOD");
+	printf("%5d %32s ", p->pid, p->name);
 
-	for (p = procs; p; p = p->next) {
-		if (p->seen == 0)
+	for (i = 0; i < p->ledger->entries; i++) {
+		if (!entry_selected(i))
 			continue;
 
-		printf("%5d %32s ", p->pid, p->name);
-		line = 0;
+		if (line++)
+			printf("%5s %32s ", "", "");
+		printf("%32s ", template[i].lti_name);
 
-		info = p->ledger->info;
-		old = p->ledger->old_info;
-		for (i = 0; i < p->ledger->entries; i++) {
-			if (group_print &&
-			    strcmp(group_print, template[i].lti_group))
-				continue;
+		d = old ? info[i].lei_credit - old[i].lei_credit : 0;
+		print_num(info[i].lei_credit, d);
 
-			if (resource_print &&
-			    strcmp(resource_print, template[i].lti_name))
-				continue;
+		d = old ? info[i].lei_debit - old[i].lei_debit : 0;
+		print_num(info[i].lei_debit, d);
+
+		d = old ? info[i].lei_balance - old[i].lei_balance : 0;
+		print_num(info[i].lei_balance, d);
+
+		if (info[i].lei_limit == LEDGER_LIMIT_INFINITY) {
+			printf("%10s  %10s", "none", "-");
+		} else {
+			print_num(info[i].lei_limit, 0);
+			print_num(info[i].lei_refill_period, 0);
+		}
+		printf("\n");
+	}
+	if (line == 0)
+		printf("\n");
+	return (line);
+}
+
+static int
+print_proc_csv(struct proc_list *p, time_t now)
+{
+	struct ledger_entry_info *info = p->ledger->info;
+	struct ledger_entry_info *old = p->ledger->old_info;
+	int line = 0, i;
+
+	for (i = 0; i < p->ledger->entries; i++) {
+		if (!entry_selected(i))
+			continue;
+		line++;
+
+		/* process names may hold commas; quote them */
+		printf("%ld,%d,\"%s\",%s,%s,%lld,%lld,%lld,", (long)now, p->pid, p->name,
+		    template[i].lti_group, template[i].lti_name,
+		    entry_value(info[i].lei_credit, old ? info[i].lei_credit - old[i].lei_credit : 0),
+		    entry_value(info[i].lei_debit, old ? info[i].lei_debit - old[i].lei_debit : 0),
+		    entry_value(info[i].lei_balance, old ? info[i].lei_balance - old[i].lei_balance : 0));
+		if (info[i].lei_limit == LEDGER_LIMIT_INFINITY)
+			printf(",\n");
+		else
+			printf("%lld,%lld\n", info[i].lei_limit, info[i].lei_refill_period);
+	}
+	return (line);
+}
+
+static int
+print_proc_json(struct proc_list *p, int first)
+{
+	struct ledger_entry_info *info = p->ledger->info;
+	struct ledger_entry_info *old = p->ledger->old_info;
+	int line = 0, i;
+
+	printf("%s{\"pid\":%d,\"command\":", first ? "" : ",", p->pid);
+	print_json_string(p->name);
+	printf(",\"entries\":[");
+	for (i = 0; i < p->ledger->entries; i++) {
+		if (!entry_selected(i))
+			continue;
+
+		printf("%s{\"group\":", line++ ? "," : "");
+		print_json_string(template[i].lti_group);
+		printf(",\"resource\":");
+		print_json_string(template[i].lti_name);
+		printf(",\"credit\":%lld,\"debit\":%lld,\"balance\":%lld,",
+		    entry_value(info[i].lei_credit, old ? info[i].lei_credit - old[i].lei_credit : 0),
+		    entry_value(info[i].lei_debit, old ? info[i].lei_debit - old[i].lei_debit : 0),
+		    entry_value(info[i].lei_balance, old ? info[i].lei_balance - old[i].lei_balance : 0));
+		if (info[i].lei_limit == LEDGER_LIMIT_INFINITY)
+			printf("\"limit\":null,\"period\":null}");
+		else
+			printf("\"limit\":%lld,\"period\":%lld}", info[i].lei_limit,
+			    info[i].lei_refill_period);
+	}
+	printf("]}");
+	return (line);
+}
 
-			if (line++)
-				printf("%5s %32s ", "", "");
-			printf("%32s ", template[i].lti_name);
+int sort_index = -1;
 
-			d = old ? info[i].lei_credit - old[i].lei_credit : 0;
-			print_num(info[i].lei_credit, d);
+static int64_t
+sort_value(const struct proc_list *p)
+{
+	const struct ledger_entry_info *info = p->ledger->info;
+	const struct ledger_entry_info *old = p->ledger->old_info;
+
+	if (sort_index >= p->ledger->entries)
+		return (INT64_MIN);
+
+	switch (sort_field) {
+	case SORT_CREDIT:
+		return (info[sort_index].lei_credit);
+	case SORT_DEBIT:
+		return (info[sort_index].lei_debit);
+	case SORT_RATE:
+		return (old ? info[sort_index].lei_balance - old[sort_index].lei_balance : 0);
+	case SORT_BALANCE:
+	default:
+		return (info[sort_index].lei_balance);
+	}
+}
 
-			d = old ? info[i].lei_debit - old[i].lei_debit : 0;
-			print_num(info[i].lei_debit, d);
+static int
+sort_compare(const void *a, const void *b)
+{
+	const struct proc_list *proc_a = *(struct proc_list * const *)a;
+	const struct proc_list *proc_b = *(struct proc_list * const *)b;
+	int64_t va = sort_value(proc_a), vb = sort_value(proc_b);
+
+	/* largest first, in pid order on ties */
+	if (va != vb)
+		return (va < vb ? 1 : -1);
+	return (proc_a->pid - proc_b->pid);
+}
 
-			d = old ? info[i].lei_balance - old[i].lei_balance : 0;
-			print_num(info[i].lei_balance, d);
+struct proc_list **ranked = NULL;
+int ranked_alloc = 0;
+int csv_header_printed = 0;
 
-			if (info[i].lei_limit == LEDGER_LIMIT_INFINITY) {
-				printf("%10s  %10s", "none", "-");
-			} else {
-				print_num(info[i].lei_limit, 0);
-				print_num(info[i].lei_refill_period, 0);
+static void
+dump_all_info(void)
+{
+	struct proc_list *p;
+	int lines = 0, cnt = 0, i;
+	time_t now = time(NULL);
+
+	for (p = procs; p; p = p->next) {
+		if (p->seen == 0)
+			continue;
+		if (cnt == ranked_alloc) {
+			ranked_alloc = ranked_alloc ? ranked_alloc * 2 : 256;
+			ranked = realloc(ranked, ranked_alloc * sizeof (*ranked));
+			if (ranked == NULL) {
+				fprintf(stderr, "Out of memory\n");
+				exit (1);
 			}
-			printf("\n");
 		}
+		ranked[cnt++] = p;
 	}
 
-	if (line == 0)
+	if (sort_resource) {
+		/* the template is refetched every sample, so look the index up again */
+		sort_index = find_resource(sort_resource);
+		if (sort_index >= 0)
+			qsort(ranked, cnt, sizeof (*ranked), sort_compare);
+	}
+	if (top_n > 0 && cnt > top_n)
+		cnt = top_n;
+
+	switch (output_format) {
+	case OUTPUT_TEXT:
+		printf("\n%5s %32s %32s %10s  %10s  %10s  %10s  %10s \n", "PID", "COMMAND",
+		    "RESOURCE", "CREDITS", "DEBITS", "BALANCE", "LIMIT", "PERIOD");
+		for (i = 0; i < cnt; i++)
+			lines += print_proc_text(ranked[i]);
+		break;
+	case OUTPUT_CSV:
+		if (csv_header_printed++ == 0)
+			printf("time,pid,command,group,resource,credit,debit,balance,limit,period\n");
+		for (i = 0; i < cnt; i++)
+			lines += print_proc_csv(ranked[i], now);
+		break;
+	case OUTPUT_JSON:
+		printf("{\"time\":%ld,\"processes\":[", (long)now);
+		for (i = 0; i < cnt; i++)
+			lines += print_proc_json(ranked[i], i == 0);
+		printf("]}\n");
+		break;
+	}
+	fflush(stdout);
+
+	if (lines == 0)
 		exit (0);
 }
 
 static void
 cleanup(void)
 {
-	struct proc_list *p, *pnext, *plast;
-	struct ledger *l, *lnext, *llast;
+	struct proc_list *p, *pnext, *plast, **pp;
+	struct ledger *l, *lnext, *llast, **lp;
+	struct ledger_entry_info *swap;
 
 	plast = NULL;
 	for (p = procs; p; p = pnext) {
@@ -386,9 +656,13 @@ cleanup(void)
 			else
 				procs = pnext;
 
+			for (pp = &proc_hash[HASH(p->pid)]; *pp != p; pp = &(*pp)->hnext)
+				;
+			*pp = p->hnext;
 			free(p);
 		} else {
 			p->seen = 0;
+			plast = p;
 		}
 	}
 
@@ -400,20 +674,23 @@ cleanup(void)
 				llast->next = lnext;
 			else
 				ledgers = lnext;
+
+			for (lp = &ledger_hash[HASH(l->id)]; *lp != l; lp = &(*lp)->hnext)
+				;
+			*lp = l->hnext;
 			free(l->info);
 			if (l->old_info)
 				free(l->old_info);
 			free(l);
 		} else {
 			l->seen = 0;
-			free(l->old_info);
+			/* keep the buffer; the next sample overwrites the oldest one */
+			swap = l->old_info;
 			l->old_info = l->info;
-			l->info = NULL;
+			l->info = swap;
+			llast = l;
 		}
 	}
-
-	free(template);
-	template = NULL;
 }
 
 const char *pname;
@@ -421,7 +698,8 @@ const char *pname;
 static void
 usage(void)
 {
-	printf("%s [-hdL] [-g group] [-p pid] [-r resource] [interval]\n", pname);
+	printf("%s [-hdL] [-g group] [-p pid] [-r resource] [-s resource[:balance|credit|debit|rate]]\n"
+	    "\t[-n count] [-o text|csv|json] [interval]\n", pname);
 }
 
 int
@@ -432,7 +710,7 @@ main(int argc, char **argv)
 
 	pname = argv[0];
 
-	while ((c = getopt(argc, argv, "g:hdLp:r:")) != -1) {
+	while ((c = getopt(argc, argv, "g:hdLn:o:p:r:s:")) != -1) {
 		switch (c) {
 		case 'g':
 			group_print = optarg;
@@ -459,6 +737,49 @@ main(int argc, char **argv)
 			resource_print = optarg;
 			break;
 
+		case 'n':
+			top_n = atoi(optarg);
+			if (top_n <= 0) {
+				fprintf(stderr, "Invalid count: %s\n", optarg);
+				exit (1);
+			}
+			break;
+
+		case 'o':
+			if (!strcmp(optarg, "text"))
+				output_format = OUTPUT_TEXT;
+			else if (!strcmp(optarg, "csv"))
+				output_format = OUTPUT_CSV;
+			else if (!strcmp(optarg, "json"))
+				output_format = OUTPUT_JSON;
+			else {
+				fprintf(stderr, "Unknown output format: %s\n", optarg);
+				exit (1);
+			}
+			break;
+
+		case 's': {
+			char *field = strchr(optarg, ':');
+
+			sort_resource = optarg;
+			if (field == NULL)
+				break;
+			*field++ = '\0';
+			if (!strcmp(field, "balance"))
+				sort_field = SORT_BALANCE;
+			else if (!strcmp(field, "credit"))
+				sort_field = SORT_CREDIT;
+			else if (!strcmp(field, "debit"))
+				sort_field = SORT_DEBIT;
+			else if (!strcmp(field, "rate"))
+				sort_field = SORT_RATE;
+			else {
+				fprintf(stderr, "Unknown sort field: %s\n", field);
+				exit (1);
+			}
+			break;
+		}
+
 		default:
 			usage();
 			exit(1);
@@ -479,10 +800,15 @@ main(int argc, char **argv)
 	if (group_print)
 		validate_group();
 	if (resource_print)
-		validate_resource();
+		validate_resource(resource_print);
+	if (sort_resource)
+		validate_resource(sort_resource);
 
-	do {
+	/* fetched once; ledger_find() refetches it if a ledger outgrows it */
+	if (template == NULL)
 		get_template_info();
+
+	do {
 		get_all_info();
 		dump_all_info();
 		cleanup();
@@ -10,34 +10,196 @@
 #include <mach/mach.h>
 #include <mach/task.h>
 #include <mach/thread_act.h>
+#include <mach/thread_info.h>
 #include <mach/thread_policy.h>
 
 #include <errno.h>
 #include <getopt.h>
+#include <libproc.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+
+/*
+ * A process whose threads are being set.  When watching, the ids of the
+ * threads already set are kept so that each pass only touches new ones.
+ */
+struct target {
+	pid_t pid;
+	mach_port_t task;
+	boolean_t reported;
+	uint64_t *tids;
+	unsigned int ntids, maxtids;
+};
+
+static struct target *targets;
+static int ntargets, maxtargets;
+static boolean_t watching;
 
 void usage(void);
 
 void
 usage(void)
 {
-		fprintf(stderr, "Usage: mean -[r|s|u] <pid>\n");
+		fprintf(stderr, "Usage: mean -[r|s|u] [-w interval] [-g pgid] <pid> ...\n");
 		fprintf(stderr,  "\tLower <pid>'s priority.\n");
 		fprintf(stderr,  "\t-u: return <pid> to normal priority\n");
 		fprintf(stderr,  "\t-r: resume <pid>\n");
 		fprintf(stderr,  "\t-s: suspend <pid>\n");
+		fprintf(stderr,  "\t-g: also act on every process in process group <pgid>\n");
+		fprintf(stderr,  "\t-w: keep running, setting new threads and processes every <interval> seconds\n");
 		exit(0);
 }
 
-int
-main(int argc, char **argv)
+/*
+ * Add pid to the targets, unless it is already there.  Returns false if its
+ * task port can't be had.
+ */
+static boolean_t
+add_target(pid_t pid)
 {
-	int pid, err, i, ch;
-	unsigned int count;
+	struct target *t;
 	mach_port_t task;
+	int i, err;
+
+	for (i = 0; i < ntargets; i++) {
+		if (targets[i].pid == pid)
+			return 1;
+	}
+
+	err = task_for_pid(mach_task_self(), pid, &task);
+	if (err) {
+		fprintf(stderr, "Failed to get task port for %d (%d)\n", pid, err);
+		return 0;
+	}
+
+	if (ntargets == maxtargets) {
+		maxtargets = maxtargets ? maxtargets * 2 : 8;
+		targets = reallocf(targets, maxtargets * sizeof(*targets));
+		if (targets == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+	t = &targets[ntargets++];
+	t->pid = pid;
+	t->task = task;
+	t->reported = 0;
+	t->tids = NULL;
+	t->ntids = t->maxtids = 0;
+	return 1;
+}
+
+static void
+remove_target(int i)
+{
+	mach_port_deallocate(mach_task_self(), targets[i].task);
+	free(targets[i].tids);
+	targets[i] = targets[--ntargets];
+}
+
+/*
+ * Add every process in the process group pgid to the targets.
+ */
+static void
+add_pgrp(pid_t pgid)
+{
+	pid_t *pids;
+	int i, n;
+
+	if ((n = proc_listpgrppids(pgid, NULL, 0)) <= 0)
+		return;
+	n += 16;	/* room for a few more that start meanwhile */
+	if ((pids = malloc(n * sizeof(*pids))) == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	n = proc_listpgrppids(pgid, pids, n * sizeof(*pids));
+	for (i = 0; i < n; i++) {
+		if (pids[i] != 0)
+			add_target(pids[i]);
+	}
+	free(pids);
+}
+
+/*
+ * Note that the thread tid of t has been set, returning true if it already
+ * had been.
+ */
+static boolean_t
+seen_thread(struct target *t, uint64_t tid)
+{
+	unsigned int i;
+
+	for (i = 0; i < t->ntids; i++) {
+		if (t->tids[i] == tid)
+			return 1;
+	}
+	if (t->ntids == t->maxtids) {
+		t->maxtids = t->maxtids ? t->maxtids * 2 : 16;
+		t->tids = reallocf(t->tids, t->maxtids * sizeof(*t->tids));
+		if (t->tids == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+	t->tids[t->ntids++] = tid;
+	return 0;
+}
+
+/*
+ * Set the precedence of t's threads to importance, skipping the ones set
+ * by an earlier pass when watching.  Returns -1 if the thread list can't be
+ * had, which is what happens once the process has exited.
+ */
+static int
+set_threads(struct target *t, integer_t importance)
+{
 	thread_act_array_t threads;
+	mach_msg_type_number_t count, icount;
 	thread_precedence_policy_data_t policy;
+	thread_identifier_info_data_t ident;
+	unsigned int i;
+	int err;
+
+	err = task_threads(t->task, &threads, &count);
+	if (err) {
+		if (!watching)
+			fprintf(stderr, "Failed to get thread list (%d)\n", err);
+		return -1;
+	}
+
+	policy.importance = importance;
+	for (i = 0; i < count; i++) {
+		if (watching) {
+			icount = THREAD_IDENTIFIER_INFO_COUNT;
+			if (thread_info(threads[i], THREAD_IDENTIFIER_INFO,
+					(thread_info_t) &ident, &icount) == KERN_SUCCESS &&
+			    seen_thread(t, ident.thread_id))
+				goto next;
+		}
+		err = thread_policy_set(threads[i],
+				THREAD_PRECEDENCE_POLICY,
+				(thread_policy_t) &policy,
+				THREAD_PRECEDENCE_POLICY_COUNT);
+		/* a thread that exited since task_threads() is no failure */
+		if (err && err != KERN_TERMINATED && err != MACH_SEND_INVALID_DEST)
+			fprintf(stderr, "Failed to set thread priority (%d)\n", err);
+next:
+		mach_port_deallocate(mach_task_self(), threads[i]);
+	}
+	vm_deallocate(mach_task_self(), (vm_address_t) threads,
+			count * sizeof(*threads));
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	int pid, err, i, ch;
+	int interval = 0, npgids = 0;
+	pid_t pgids[16];
+	integer_t importance;
 
 	boolean_t do_high = 0, do_resume = 0, do_suspend = 0;
 	boolean_t do_low = 1;
@@ -45,8 +207,16 @@ main(int argc, char **argv)
 	if (argc < 2)
 		usage();
 
-	while ((ch = getopt(argc, argv, "rsu")) != -1)
+	while ((ch = getopt(argc, argv, "g:rsuw:")) != -1)
 	switch (ch) {
+		case 'g':
+			if (npgids == sizeof(pgids) / sizeof(pgids[0])) {
+				fprintf(stderr, "Too many process groups\n");
+				exit(1);
+			}
+			if ((pgids[npgids++] = atoi(optarg)) <= 0)
+				usage();
+			continue;
 		case 'u':
 			do_high = 1;
 			do_low = 0;
@@ -59,68 +229,83 @@ main(int argc, char **argv)
 			do_suspend = 1;
 			do_low = 0;
 			continue;
+		case 'w':
+			if ((interval = atoi(optarg)) <= 0)
+				usage();
+			watching = 1;
+			continue;
 		default:
 			usage();
 	}
 
 	argc -= optind; argv += optind;
 
-	if (argc == 0)
+	if (argc == 0 && npgids == 0)
 		usage();
-
-	pid = atoi(*argv);
-	if (!pid)
+	if (watching && !(do_low || do_high))
 		usage();
 
-	err = task_for_pid(mach_task_self(), pid, &task);
-	if (err) {
-		fprintf(stderr, "Failed to get task port (%d)\n", err);
-		exit(0);
+	for (; *argv != NULL; argv++) {
+		pid = atoi(*argv);
+		if (!pid)
+			usage();
+		add_target(pid);
 	}
+	for (i = 0; i < npgids; i++)
+		add_pgrp(pgids[i]);
+
+	if (ntargets == 0)
+		exit(0);
 
 	if (do_low || do_high) {
+		importance = do_low ? -100 : 0;
 
-		err = task_threads(task, &threads, &count);
-		if (err) {
-			fprintf(stderr, "Failed to get thread list (%d)\n", err);
-			exit(0);
+		for (;;) {
+			for (i = 0; i < ntargets; ) {
+				if (set_threads(&targets[i], importance) == -1) {
+					remove_target(i);
+					continue;
+				}
+				if (!targets[i].reported) {
+					printf("Process %d's threads set to %s priority.\n",
+							targets[i].pid,
+							(do_low ? "lowest" : "highest"));
+					targets[i].reported = 1;
+				}
+				i++;
+			}
+			if (!watching)
+				break;
+			fflush(stdout);
+
+			sleep(interval);
+			/* processes that joined the groups since the last pass */
+			for (i = 0; i < npgids; i++)
+				add_pgrp(pgids[i]);
+			if (ntargets == 0)
+				break;
 		}
+	}
 
-		if (do_low)
-			policy.importance = -100;
-		else
-			policy.importance = 0;
+	for (i = 0; i < ntargets; i++) {
+		pid = targets[i].pid;
 
-		for (i = 0; i < count; i++) {
-			err = thread_policy_set(threads[i],
-					THREAD_PRECEDENCE_POLICY,
-					(thread_policy_t) &policy,
-					THREAD_PRECEDENCE_POLICY_COUNT);
+		if (do_suspend) {
+			err = task_suspend(targets[i].task);
 			if (err) {
-				fprintf(stderr, "Failed to set thread priority (%d)\n", err);
-				exit(0);
+				fprintf(stderr, "Failed to suspend task (%d)\n", err);
+			} else {
+				printf("Process %d suspended.\n", pid);
 			}
 		}
 
-		printf("Process %d's threads set to %s priority.\n", pid,
-				(do_low ? "lowest" : "highest"));
-	}
-
-	if (do_suspend) {
-		err = task_suspend(task);
-		if (err) {
-			fprintf(stderr, "Failed to suspend task (%d)\n", err);
-		} else {
-			printf("Process %d suspended.\n", pid);
-		}
-	}
-
-	if (do_resume) {
-		err = task_resume(task);
-		if (err) {
-			fprintf(stderr, "Failed to resume task (%d)\n", err);
-		} else {
-			printf("Process %d resumed.\n", pid);
+		if (do_resume) {
+			err = task_resume(targets[i].task);
+			if (err) {
+				fprintf(stderr, "Failed to resume task (%d)\n", err);
+			} else {
+				printf("Process %d resumed.\n", pid);
+			}
 		}
 	}
 
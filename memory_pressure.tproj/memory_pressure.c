@@ -24,6 +24,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <string.h>
 #include <mach/i386/vm_param.h>
@@ -36,6 +37,11 @@
 #include <sys/mman.h>
 #include <pthread.h>
 #include <assert.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
 #include <dispatch/private.h>
 
 long long	phys_mem = 0;            /* amount of physical memory in bytes */
@@ -57,6 +63,26 @@ unsigned int		desired_level = 0, desired_percent = 0;
 unsigned int		percent_for_level = 0;
 int			tool_mode = 0;
 
+/*
+ * -t/-r: fault pages in from several threads, optionally paced to a total
+ * rate. Threads claim TOUCH_BATCH_PAGES at a time from a shared cursor and
+ * only check the pressure target between batches.
+ */
+#define TOUCH_BATCH_PAGES	256
+#define MAX_TOUCH_THREADS	64
+
+int			touch_threads = 1;
+double			touch_rate_gbps = 0.0;	/* 0 means as fast as possible */
+
+/*
+ * -f: what newly allocated pages are filled with. Every mode except the
+ * default builds a pool of FILL_POOL_PAGES pages up front and page N of the
+ * range gets pool page N % FILL_POOL_PAGES, so filling stays a memcpy.
+ */
+#define FILL_POOL_PAGES		256
+
+char			*fill_pool = NULL;	/* NULL: copy random_data */
+
 #define	TOOL_MODE_FOR_PERCENT	1
 #define TOOL_MODE_FOR_LEVEL	2
 
@@ -73,6 +99,7 @@ char		random_data[] = "ffd8ffe000104a46494600010101002400240000ffe10074457869660
 void print_vm_statistics(void);
 void munch_for_level(unsigned int, unsigned int);
 void munch_for_percentage(unsigned int, unsigned int, unsigned int);
+void monitor_pressure(void) __attribute__((noreturn));
 
 static void
 usage(void)
@@ -88,6 +115,10 @@ usage(void)
 			"  -v <print VM stats>   - print VM statistics every sampling interval\n"
 			"  -Q <quiet mode>	 - reduces the tool's output\n"
 			"  -S			 - simulate the system's memory pressure level without applying any real pressure\n"
+			"  -t <threads>          - touch newly allocated pages from this many threads\n"
+			"  -r <GB/s>             - limit the rate at which pages are allocated\n"
+			"  -f <fill>             - fill pages with default, random, ratio:<percent-compressible> or file:<path> data\n"
+			"  -M			 - don't allocate, log pressure level transitions as JSON lines until interrupted\n"
 			"  \n"
 	       );
 	exit(0);
@@ -204,6 +235,182 @@ get_max_range_size()
 	return the_max_range_size;
 }
 
+/*
+ * -M: passive monitor. A memory pressure dispatch source wakes us on level
+ * changes; nothing runs in between, so the only cost is one host_statistics64
+ * and one sysctl per notification.
+ */
+#define MONITOR_NLEVELS		3
+
+struct monitor_state {
+	unsigned int		level;		/* kern.memorystatus_vm_pressure_level */
+	uint64_t		since_ns;	/* monotonic time level was entered */
+	uint64_t		start_ns;
+	vm_statistics64_data_t	vm_stat;	/* statistics when level was entered */
+	uint64_t		level_ns[MONITOR_NLEVELS];
+	unsigned int		entered[MONITOR_NLEVELS];
+	unsigned int		transitions;
+};
+
+static struct monitor_state monitor;
+static const char *monitor_level_names[MONITOR_NLEVELS] = { "normal", "warn", "critical" };
+
+static uint64_t
+monitor_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+static int
+monitor_level_index(unsigned int level)
+{
+	switch (level) {
+	case DISPATCH_MEMORYPRESSURE_WARN:
+		return 1;
+	case DISPATCH_MEMORYPRESSURE_CRITICAL:
+		return 2;
+	default:
+		return 0;
+	}
+}
+
+static const char *
+monitor_level_name(unsigned int level)
+{
+	return monitor_level_names[monitor_level_index(level)];
+}
+
+static void
+monitor_read_vm_stat(vm_statistics64_data_t *vm_stat)
+{
+	unsigned int count = HOST_VM_INFO64_COUNT;
+	kern_return_t ret;
+
+	ret = host_statistics64(mach_host_self(), HOST_VM_INFO64, (host_info64_t)vm_stat, &count);
+	if (ret != KERN_SUCCESS) {
+		fprintf(stderr, "Failed to get statistics. Error %d\n", ret);
+		bzero(vm_stat, sizeof(*vm_stat));
+	}
+}
+
+static void
+monitor_print_prefix(const char *event, uint64_t now_ns)
+{
+	struct timespec wall;
+	unsigned int percent_free = 0;
+
+	clock_gettime(CLOCK_REALTIME, &wall);
+	get_percent_free(&percent_free);
+	printf("{\"event\":\"%s\",\"time\":%ld.%06ld,\"elapsed_s\":%.6f,\"percent_free\":%u",
+	    event, (long)wall.tv_sec, (long)(wall.tv_nsec / NSEC_PER_USEC),
+	    (double)(now_ns - monitor.start_ns) / NSEC_PER_SEC, percent_free);
+}
+
+static void
+monitor_transition(void)
+{
+	vm_statistics64_data_t vm_stat;
+	unsigned int level;
+	uint64_t now_ns, in_level_ns;
+	int from;
+
+	level = read_sysctl_int("kern.memorystatus_vm_pressure_level");
+	if (level == monitor.level) {
+		return;
+	}
+	now_ns = monitor_now_ns();
+	monitor_read_vm_stat(&vm_stat);
+
+	from = monitor_level_index(monitor.level);
+	in_level_ns = now_ns - monitor.since_ns;
+	monitor.level_ns[from] += in_level_ns;
+	monitor.entered[monitor_level_index(level)]++;
+	monitor.transitions++;
+
+#define VM_DELTA(field)	((int64_t)(vm_stat.field - monitor.vm_stat.field))
+	monitor_print_prefix("transition", now_ns);
+	printf(",\"from\":\"%s\",\"to\":\"%s\",\"time_in_level_s\":%.6f"
+	    ",\"free_pages\":%llu,\"compressor_pages\":%llu"
+	    ",\"delta\":{\"free\":%lld,\"compressor\":%lld,\"compressions\":%lld,\"decompressions\":%lld"
+	    ",\"swapins\":%lld,\"swapouts\":%lld,\"pageins\":%lld,\"pageouts\":%lld,\"purges\":%lld}}\n",
+	    monitor_level_name(monitor.level), monitor_level_name(level), (double)in_level_ns / NSEC_PER_SEC,
+	    (uint64_t)(vm_stat.free_count - vm_stat.speculative_count), (uint64_t)vm_stat.compressor_page_count,
+	    (int64_t)(vm_stat.free_count - vm_stat.speculative_count) -
+	    (int64_t)(monitor.vm_stat.free_count - monitor.vm_stat.speculative_count),
+	    VM_DELTA(compressor_page_count), VM_DELTA(compressions), VM_DELTA(decompressions),
+	    VM_DELTA(swapins), VM_DELTA(swapouts), VM_DELTA(pageins), VM_DELTA(pageouts), VM_DELTA(purges));
+#undef VM_DELTA
+	fflush(stdout);
+
+	monitor.level = level;
+	monitor.since_ns = now_ns;
+	monitor.vm_stat = vm_stat;
+}
+
+static void
+monitor_summary(void)
+{
+	uint64_t now_ns;
+	int i;
+
+	now_ns = monitor_now_ns();
+	monitor.level_ns[monitor_level_index(monitor.level)] += now_ns - monitor.since_ns;
+	monitor.since_ns = now_ns;
+
+	monitor_print_prefix("summary", now_ns);
+	printf(",\"transitions\":%u,\"levels\":{", monitor.transitions);
+	for (i = 0; i < MONITOR_NLEVELS; i++) {
+		printf("%s\"%s\":{\"entered\":%u,\"time_s\":%.6f}", i ? "," : "",
+		    monitor_level_names[i],
+		    monitor.entered[i], (double)monitor.level_ns[i] / NSEC_PER_SEC);
+	}
+	printf("}}\n");
+	fflush(stdout);
+}
+
+void
+monitor_pressure(void)
+{
+	dispatch_source_t pressure_source, signal_source;
+	dispatch_queue_t queue;
+
+	queue = dispatch_queue_create("com.apple.memory_pressure.monitor", DISPATCH_QUEUE_SERIAL);
+
+	monitor.start_ns = monitor.since_ns = monitor_now_ns();
+	monitor.level = read_sysctl_int("kern.memorystatus_vm_pressure_level");
+	monitor.entered[monitor_level_index(monitor.level)]++;
+	monitor_read_vm_stat(&monitor.vm_stat);
+
+	monitor_print_prefix("start", monitor.start_ns);
+	printf(",\"level\":\"%s\"}\n", monitor_level_name(monitor.level));
+	fflush(stdout);
+
+	pressure_source = dispatch_source_create(DISPATCH_SOURCE_TYPE_MEMORYPRESSURE, 0,
+	    DISPATCH_MEMORYPRESSURE_NORMAL | DISPATCH_MEMORYPRESSURE_WARN | DISPATCH_MEMORYPRESSURE_CRITICAL, queue);
+	if (pressure_source == NULL) {
+		fprintf(stderr, "Failed to create memory pressure source\n");
+		exit(-1);
+	}
+	dispatch_source_set_event_handler(pressure_source, ^{
+		monitor_transition();
+	});
+	dispatch_resume(pressure_source);
+
+	signal(SIGINT, SIG_IGN);
+	signal_source = dispatch_source_create(DISPATCH_SOURCE_TYPE_SIGNAL, SIGINT, 0, queue);
+	dispatch_source_set_event_handler(signal_source, ^{
+		monitor_transition();
+		monitor_summary();
+		exit(0);
+	});
+	dispatch_resume(signal_source);
+
+	dispatch_main();
+}
+
 static int
 reached_or_bypassed_desired_result(void)
 {
@@ -279,6 +486,185 @@ again:
 	goto again;
 }
 
+/* fill pages [addr, addr + size) with the -f content */
+static inline void
+fill_pages(char *addr, size_t size)
+{
+	char *end = addr + size;
+	uintptr_t index;
+
+	for (; addr < end; addr += PAGE_SIZE) {
+		if (fill_pool == NULL) {
+			memcpy(addr, random_data, PAGE_SIZE);
+			continue;
+		}
+		index = ((uintptr_t)addr - (uintptr_t)range_start_addr) / PAGE_SIZE;
+		memcpy(addr, fill_pool + (index % FILL_POOL_PAGES) * PAGE_SIZE, PAGE_SIZE);
+	}
+}
+
+/*
+ * Build the fill pool for -f. "random" is incompressible, "ratio:<percent>"
+ * leaves <percent> of each page zeroed after a random prefix, and
+ * "file:<path>" samples consecutive pages of a file, wrapping at its end.
+ */
+static void
+setup_fill_pool(const char *mode)
+{
+	size_t pool_size = FILL_POOL_PAGES * PAGE_SIZE;
+	size_t random_bytes = PAGE_SIZE;
+	size_t done, file_size;
+	ssize_t nread;
+	char *endp;
+	long percent;
+	int fd, i;
+
+	if (strcmp(mode, "default") == 0) {
+		return;
+	}
+
+	fill_pool = calloc(1, pool_size);
+	if (fill_pool == NULL) {
+		perror("Failed to allocate fill pool");
+		exit(-1);
+	}
+
+	if (strcmp(mode, "random") == 0) {
+		arc4random_buf(fill_pool, pool_size);
+	} else if (strncmp(mode, "ratio:", 6) == 0) {
+		percent = strtol(mode + 6, &endp, 10);
+		if (*endp != '\0' || endp == mode + 6 || percent < 0 || percent > 100) {
+			printf("Compressible percentage must be between 0 and 100. Specified: %s\n", mode + 6);
+			exit(0);
+		}
+		random_bytes = PAGE_SIZE - (PAGE_SIZE * percent) / 100;
+		for (i = 0; i < FILL_POOL_PAGES; i++) {
+			arc4random_buf(fill_pool + i * PAGE_SIZE, random_bytes);
+		}
+	} else if (strncmp(mode, "file:", 5) == 0) {
+		fd = open(mode + 5, O_RDONLY);
+		if (fd == -1) {
+			perror(mode + 5);
+			exit(-1);
+		}
+		for (done = 0; done < pool_size; done += nread) {
+			nread = read(fd, fill_pool + done, pool_size - done);
+			if (nread == -1) {
+				perror(mode + 5);
+				exit(-1);
+			}
+			if (nread == 0) {
+				if (done == 0) {
+					printf("Fill file %s is empty\n", mode + 5);
+					exit(0);
+				}
+				/* short file: repeat what we have */
+				for (file_size = done; done < pool_size; done++) {
+					fill_pool[done] = fill_pool[done % file_size];
+				}
+				break;
+			}
+		}
+		close(fd);
+	} else {
+		printf("Unknown fill mode: %s\n", mode);
+		usage();
+	}
+}
+
+struct touch_state {
+	char			*start;
+	char			*end;
+	_Atomic(uintptr_t)	next;		/* first page not yet claimed */
+	_Atomic(uint64_t)	touched;	/* bytes written so far */
+	atomic_bool		stop;
+	uint64_t		start_ns;
+};
+
+static uint64_t
+touch_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+static void *
+touch_worker(void *arg)
+{
+	struct touch_state *ts = arg;
+	size_t batch = TOUCH_BATCH_PAGES * PAGE_SIZE;
+	char *addr, *end;
+	uint64_t touched, due_ns, now_ns;
+
+	while (!atomic_load_explicit(&ts->stop, memory_order_relaxed)) {
+		addr = (char *)atomic_fetch_add(&ts->next, batch);
+		if (addr >= ts->end) {
+			break;
+		}
+		end = (addr + batch < ts->end) ? addr + batch : ts->end;
+
+		fill_pages(addr, end - addr);
+		touched = atomic_fetch_add(&ts->touched, batch) + batch;
+
+		if (reached_or_bypassed_desired_result()) {
+			atomic_store(&ts->stop, true);
+			break;
+		}
+
+		if (touch_rate_gbps > 0.0) {
+			/* sleep off any lead over the requested rate, shared by all threads */
+			due_ns = ts->start_ns + (uint64_t)(touched / touch_rate_gbps);
+			now_ns = touch_now_ns();
+			if (due_ns > now_ns) {
+				usleep((useconds_t)((due_ns - now_ns) / NSEC_PER_USEC));
+			}
+		}
+	}
+	return NULL;
+}
+
+/* fault in up to num_pages from range_current_addr on touch_threads threads */
+static void
+touch_pages_parallel(int num_pages)
+{
+	struct touch_state ts;
+	pthread_t threads[MAX_TOUCH_THREADS];
+	int i, started = 0;
+	char *claimed;
+
+	ts.start = range_current_addr;
+	ts.end = ts.start + (size_t)num_pages * PAGE_SIZE;
+	if (ts.end > (char *)range_end_addr) {
+		ts.end = range_end_addr;
+	}
+	atomic_init(&ts.next, (uintptr_t)ts.start);
+	atomic_init(&ts.touched, 0);
+	atomic_init(&ts.stop, false);
+	ts.start_ns = touch_now_ns();
+
+	for (i = 1; i < touch_threads; i++) {
+		if (pthread_create(&threads[started], NULL, touch_worker, &ts) != 0) {
+			break;
+		}
+		started++;
+	}
+	touch_worker(&ts);
+	for (i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	/* everything below the cursor has been claimed; untouched tails are just unfaulted */
+	claimed = (char *)atomic_load(&ts.next);
+	range_current_addr = (claimed < ts.end) ? claimed : ts.end;
+
+	if (range_current_addr >= range_end_addr && !atomic_load(&ts.stop)) {
+		printf("\nRun out of allocable memory\n");
+		exit(0);
+	}
+}
+
 static void
 process_pages(int num_pages, int page_op)
 {
@@ -296,7 +682,7 @@ process_pages(int num_pages, int page_op)
 					exit(-1);
 				}
 
-				memset(range_current_addr, 0xFF, size);
+				fill_pages(range_current_addr, size);
 				range_current_addr += size;
 
 			} else {
@@ -309,6 +695,11 @@ process_pages(int num_pages, int page_op)
 				}
 				pthread_mutex_unlock(&reference_pages_mutex);
 
+				if (touch_threads > 1 || touch_rate_gbps > 0.0) {
+					touch_pages_parallel(num_pages);
+					num_pages = 0;
+				}
+
 				for (i=0; i < num_pages; i++) {
 
 					if (reached_or_bypassed_desired_result()) {
@@ -316,7 +707,7 @@ process_pages(int num_pages, int page_op)
 						break;
 					}
 					if ((uintptr_t)range_current_addr < get_max_range_size()) {
-						memcpy(range_current_addr, random_data, PAGE_SIZE);
+						fill_pages(range_current_addr, PAGE_SIZE);
 						range_current_addr += PAGE_SIZE;
 					} else {
 						printf("\nRun out of allocable memory\n");
@@ -616,8 +1007,10 @@ main(int argc, char * const argv[])
 	unsigned int current_percent = 0;
 	unsigned int print_vm_stats = 0;
 	char	     level[10];
+	const char   *fill_mode = "default";
+	boolean_t    monitor_mode_on = FALSE;
 
-	while ((opt = getopt(argc, argv, "hl:p:s:w:y:vQS")) != -1) {
+	while ((opt = getopt(argc, argv, "f:hl:p:r:s:t:w:y:vMQS")) != -1) {
 		switch (opt) {
 			case 'h':
 				usage();
@@ -650,12 +1043,32 @@ main(int argc, char * const argv[])
 			case 'w':
 				wait_percent_free = atoi(optarg);
 				break;
+			case 't':
+				touch_threads = atoi(optarg);
+				if (touch_threads < 1 || touch_threads > MAX_TOUCH_THREADS) {
+					printf("Thread count must be between 1 and %d. Specified: %s\n", MAX_TOUCH_THREADS, optarg);
+					exit(0);
+				}
+				break;
+			case 'r':
+				touch_rate_gbps = atof(optarg);
+				if (touch_rate_gbps <= 0.0) {
+					printf("Allocation rate must be positive. Specified: %s\n", optarg);
+					exit(0);
+				}
+				break;
+			case 'f':
+				fill_mode = optarg;
+				break;
 			case 'y':
 				requested_hysteresis_seconds = atoi(optarg);
 				break;
 			case 'v':
 				print_vm_stats = 1;
 				break;
+			case 'M':
+				monitor_mode_on = TRUE;
+				break;
 			case 'Q':
 				quiet_mode_on = TRUE;
 				break;
@@ -679,6 +1092,14 @@ main(int argc, char * const argv[])
 		}
 	}
 
+	if (monitor_mode_on == TRUE) {
+		monitor_pressure();
+	}
+
+	if (simulate_mode_on == FALSE) {
+		setup_fill_pool(fill_mode);
+	}
+
 	phys_mem   = read_sysctl_long_long("hw.memsize");
 	phys_pages = (unsigned int) (phys_mem / PAGE_SIZE);
 
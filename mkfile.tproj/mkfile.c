@@ -40,24 +40,81 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <err.h>
+#include <pthread.h>
+#include <stdint.h>
 
-#define BF_SZ	512	/* Size of write chunks */
+#define BF_SZ	(1024 * 1024)	/* Size of write chunks */
+
+/* How the file's blocks are produced */
+#define FILL_ZERO	0	/* write zeroes */
+#define FILL_EMPTY	1	/* -n: sparse, nothing allocated */
+#define FILL_PREALLOC	2	/* -p: reserve blocks with F_PREALLOCATE, no writes */
+
+/*
+ * -f: what the written blocks contain. Everything but zeroes is generated
+ * per chunk from the chunk's file offset, so threads need no shared state
+ * and a file always gets the same bytes for a given seed.
+ */
+#define CONTENT_ZERO	0
+#define CONTENT_RANDOM	1	/* incompressible */
+#define CONTENT_RATIO	2	/* random head, zeroed tail in every block */
+#define CONTENT_PATTERN	3	/* a repeated string */
+#define CONTENT_BLOCK	4096	/* unit for CONTENT_RATIO */
+
+static int content = CONTENT_ZERO;
+static int content_percent;		/* CONTENT_RATIO: zeroed share of a block */
+static char *content_pattern;
+static size_t content_pattern_len;
+static uint64_t content_seed;
+
+#define REGION_SZ	(64 * 1024 * 1024)	/* Unit of work for -t */
+#define MAX_THREADS	64
+
+/*
+ * -t: every file is cut into REGION_SZ regions and a pool of threads
+ * pwrite()s whichever region is next, so one large file or many files
+ * fill concurrently. A failed write marks its file; failed files are
+ * removed once all threads are done.
+ */
+struct fill_file {
+	char	*name;
+	int	fd;
+	quad_t	size;
+	int	error;		/* errno of the first failed write, or 0 */
+};
+
+struct fill_region {
+	struct fill_file *file;
+	off_t	offset;
+	quad_t	length;
+};
+
+struct fill_job {
+	struct fill_region *regions;
+	size_t	count;
+	size_t	next;		/* next region to claim */
+};
 
 extern void usage(char *, char *);
 extern void create_file(char *, quad_t, int, int);
+extern void create_files_parallel(char **, quad_t, int, int);
+extern int preallocate(int, quad_t);
+extern void parse_content(char *);
+extern void fill_buffer(char *, size_t, off_t);
 extern void err_rm(char *, char *);
 
 int
 main(int argc, char **argv)
 {
 	char *b_num, *prog_name;
-	char *options = "nv";
+	char *options = "f:npt:v";
 	char c;
 	off_t multiplier = 1;
 	off_t file_size;
 	size_t len;
-	int empty = 0;
+	int fill = FILL_ZERO;
 	int verbose = 0;
+	int threads = 1;
 	char* endptr = NULL;
 
 	prog_name = argv[0];	/* Get program name */
@@ -73,7 +130,18 @@ main(int argc, char **argv)
 			verbose = 1;
 			break;
 		case 'n':   /* Create an empty file */
-			empty = 1;
+			fill = FILL_EMPTY;
+			break;
+		case 'p':   /* Reserve the blocks without writing them */
+			fill = FILL_PREALLOC;
+			break;
+		case 'f':   /* Content of the written blocks */
+			parse_content(optarg);
+			break;
+		case 't':   /* Fill with several threads */
+			threads = (int)strtol(optarg, &endptr, 10);
+			if (*endptr != '\0' || threads < 1 || threads > MAX_THREADS)
+				errx(1, "Thread count must be between 1 and %d", MAX_THREADS);
 			break;
 		default:
 			usage(prog_name, options);
@@ -120,8 +188,16 @@ main(int argc, char **argv)
 		err(1, "Bad file size!");
 	}
 
+	if (content != CONTENT_ZERO && fill != FILL_ZERO)
+		errx(1, "-f cannot be combined with -n or -p");
+
+	if (threads > 1 && fill == FILL_ZERO) {
+		create_files_parallel(argv, file_size*multiplier, threads, verbose);
+		return (0);
+	}
+
 	while ( *argv != NULL ) {	/* Create file for each file_name */
-		create_file(*argv, file_size*multiplier, empty, verbose);
+		create_file(*argv, file_size*multiplier, fill, verbose);
 		argv++;
 	}
 
@@ -129,14 +205,37 @@ main(int argc, char **argv)
 }
 
 
-/* Create a file and make it empty (lseek) or zero'd */
+/*
+ * Reserve size bytes for fd, contiguously if the filesystem can, and set
+ * the file length. The blocks are not written, but read back as zeroes.
+ */
+int
+preallocate(int fd, quad_t size)
+{
+	fstore_t store;
+
+	store.fst_flags = F_ALLOCATECONTIG | F_ALLOCATEALL;
+	store.fst_posmode = F_PEOFPOSMODE;
+	store.fst_offset = 0;
+	store.fst_length = size;
+	store.fst_bytesalloc = 0;
+
+	if (fcntl(fd, F_PREALLOCATE, &store) == -1) {
+		store.fst_flags = F_ALLOCATEALL;
+		if (fcntl(fd, F_PREALLOCATE, &store) == -1)
+			return (-1);
+	}
+	return (ftruncate(fd, (off_t)size));
+}
+
+/* Create a file and make it empty (lseek), preallocated or zero'd */
 
 void
-create_file(char *file_name, quad_t size, int empty, int verbose)
+create_file(char *file_name, quad_t size, int fill, int verbose)
 {
-	char buff[BF_SZ];
+	char *buff;
 	int fd;
-	ssize_t bytes_written = BF_SZ;
+	ssize_t bytes_written;
 	quad_t i;
 	mode_t mode = S_IRUSR | S_IWUSR;
 
@@ -147,32 +246,38 @@ create_file(char *file_name, quad_t size, int empty, int verbose)
                 err(1, NULL);
 
 
-        if (empty) {			/* Create an empty file */
+        if (fill == FILL_EMPTY) {	/* Create an empty file */
                 lseek(fd, (off_t)size-1, SEEK_SET);
                 if ( 1 != write(fd, "\0", 1))
 			err_rm(file_name, "Write Error");
         }
+	else if (fill == FILL_PREALLOC) {
+		if (size > 0 && preallocate(fd, size) == -1)
+			err_rm(file_name, "Preallocate Error");
+	}
 	else {
-		bzero(buff, BF_SZ);
-
 		/*
-		 * First loop: write BF_SZ chunks until you have
-		 * less then BF_SZ bytes to write.
-		 * Second loop: write the remaining bytes.
+		 * Write page-aligned BF_SZ chunks with the buffer cache
+		 * bypassed, so large files neither copy through nor evict
+		 * the cache. Reserving the space first keeps the file
+		 * contiguous; it is only a hint, so failure is ignored.
 		 * ERRORS in the write process will cause the
 		 * file to be removed before the error is
 		 * reported.
 		 */
-		for (i = size; i > BF_SZ; i -= bytes_written) {
-			bytes_written = write (fd, buff, BF_SZ);
+		if ((buff = valloc(BF_SZ)) == NULL)
+			err_rm(file_name, "Out of memory");
+		bzero(buff, BF_SZ);
+		(void)fcntl(fd, F_NOCACHE, 1);
+		(void)preallocate(fd, size);
+
+		for (i = size; i > 0; i -= bytes_written) {
+			fill_buffer(buff, (i > BF_SZ) ? BF_SZ : (size_t)i, (off_t)(size - i));
+			bytes_written = write(fd, buff, (i > BF_SZ) ? BF_SZ : (size_t)i);
 			if ( bytes_written == -1 )
                                 err_rm (file_name, "Write Error");
 		}
-		for (; i > 0; i -= bytes_written) {
-			bytes_written = write (fd, buff, (size_t)i);
-                        if ( bytes_written == -1 )
-                                err_rm (file_name, "Write Error");
-		}
+		free(buff);
 	}
 
 	if (fchmod(fd, mode))	/* Change permissions */
@@ -185,6 +290,204 @@ create_file(char *file_name, quad_t size, int empty, int verbose)
 		(void)fprintf(stderr, "%s %qd bytes\n", file_name, size);
 }
 
+/*
+ * Parse the -f argument: zero, random, ratio:<percent zeroed> or
+ * pattern:<string>.
+ */
+void
+parse_content(char *arg)
+{
+	char *endptr;
+
+	if (strcmp(arg, "zero") == 0) {
+		content = CONTENT_ZERO;
+	} else if (strcmp(arg, "random") == 0) {
+		content = CONTENT_RANDOM;
+	} else if (strncmp(arg, "ratio:", 6) == 0) {
+		content = CONTENT_RATIO;
+		content_percent = (int)strtol(arg + 6, &endptr, 10);
+		if (endptr == arg + 6 || *endptr != '\0' ||
+		    content_percent < 0 || content_percent > 100)
+			errx(1, "Bad compressibility ratio: %s", arg + 6);
+	} else if (strncmp(arg, "pattern:", 8) == 0 && arg[8] != '\0') {
+		content = CONTENT_PATTERN;
+		content_pattern = arg + 8;
+		content_pattern_len = strlen(content_pattern);
+	} else {
+		errx(1, "Unknown fill content: %s", arg);
+	}
+	content_seed = ((uint64_t)arc4random() << 32) | arc4random();
+}
+
+/* splitmix64: fast, and seedable per chunk */
+static inline uint64_t
+content_next(uint64_t *state)
+{
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return (z ^ (z >> 31));
+}
+
+static void
+fill_random(char *buff, size_t len, uint64_t *state)
+{
+	uint64_t word;
+	size_t i;
+
+	for (i = 0; i + sizeof(word) <= len; i += sizeof(word)) {
+		word = content_next(state);
+		memcpy(buff + i, &word, sizeof(word));
+	}
+	if (i < len) {
+		word = content_next(state);
+		memcpy(buff + i, &word, len - i);
+	}
+}
+
+/* Generate the -f content for the len bytes that go at offset */
+void
+fill_buffer(char *buff, size_t len, off_t offset)
+{
+	uint64_t state = content_seed ^ (uint64_t)offset;
+	size_t i, n, head, filled;
+
+	switch (content) {
+	case CONTENT_ZERO:
+		/* the buffer was zeroed once when allocated */
+		break;
+	case CONTENT_RANDOM:
+		fill_random(buff, len, &state);
+		break;
+	case CONTENT_RATIO:
+		head = CONTENT_BLOCK - (CONTENT_BLOCK * content_percent) / 100;
+		for (i = 0; i < len; i += CONTENT_BLOCK) {
+			n = (len - i < CONTENT_BLOCK) ? len - i : CONTENT_BLOCK;
+			fill_random(buff + i, (n < head) ? n : head, &state);
+			if (n > head)
+				bzero(buff + i + head, n - head);
+		}
+		break;
+	case CONTENT_PATTERN:
+		/* lay down one period in phase with offset, then double it */
+		for (filled = 0; filled < len && filled < content_pattern_len; filled++)
+			buff[filled] = content_pattern[(offset + filled) % content_pattern_len];
+		for (; filled < len; filled += n) {
+			n = (filled < len - filled) ? filled : len - filled;
+			n -= n % content_pattern_len;
+			if (n == 0)
+				n = (len - filled < content_pattern_len) ? len - filled : content_pattern_len;
+			memcpy(buff + filled, buff, n);
+		}
+		break;
+	}
+}
+
+static void *
+fill_worker(void *arg)
+{
+	struct fill_job *job = arg;
+	struct fill_region *region;
+	char *buff;
+	ssize_t bytes_written;
+	quad_t done;
+	size_t n, chunk;
+
+	if ((buff = valloc(BF_SZ)) == NULL)
+		return (NULL);
+	bzero(buff, BF_SZ);
+
+	while ((n = __sync_fetch_and_add(&job->next, 1)) < job->count) {
+		region = &job->regions[n];
+		for (done = 0; done < region->length; done += bytes_written) {
+			if (region->file->error)
+				break;
+			chunk = (region->length - done > BF_SZ) ? BF_SZ : (size_t)(region->length - done);
+			fill_buffer(buff, chunk, region->offset + done);
+			bytes_written = pwrite(region->file->fd, buff, chunk, region->offset + done);
+			if (bytes_written == -1) {
+				region->file->error = errno;
+				break;
+			}
+		}
+	}
+	free(buff);
+	return (NULL);
+}
+
+/* Create and zero all files at once on threads threads */
+
+void
+create_files_parallel(char **file_names, quad_t size, int threads, int verbose)
+{
+	struct fill_file *files;
+	struct fill_job job;
+	pthread_t tids[MAX_THREADS];
+	size_t nfiles, per_file, i, r;
+	int started, failed = 0;
+	mode_t mode = S_IRUSR | S_IWUSR;
+
+	/* If superuser, then set sticky bit */
+	if (!geteuid()) mode |= S_ISVTX;
+
+	for (nfiles = 0; file_names[nfiles] != NULL; nfiles++)
+		;
+	per_file = (size_t)((size + REGION_SZ - 1) / REGION_SZ);
+	if ((files = calloc(nfiles, sizeof(*files))) == NULL ||
+	    (job.regions = calloc(nfiles * per_file + 1, sizeof(*job.regions))) == NULL)
+		err(1, NULL);
+	job.count = 0;
+	job.next = 0;
+
+	for (i = 0; i < nfiles; i++) {
+		files[i].name = file_names[i];
+		files[i].size = size;
+		if ((files[i].fd = open(files[i].name, O_RDWR | O_CREAT | O_TRUNC, mode)) == -1)
+			err(1, NULL);
+		(void)fcntl(files[i].fd, F_NOCACHE, 1);
+		(void)preallocate(files[i].fd, size);
+
+		for (r = 0; r < per_file; r++) {
+			job.regions[job.count].file = &files[i];
+			job.regions[job.count].offset = (off_t)r * REGION_SZ;
+			job.regions[job.count].length = (size - (quad_t)r * REGION_SZ > REGION_SZ) ?
+			    REGION_SZ : size - (quad_t)r * REGION_SZ;
+			job.count++;
+		}
+	}
+
+	for (started = 0; started < threads - 1; started++)
+		if (pthread_create(&tids[started], NULL, fill_worker, &job) != 0)
+			break;
+	fill_worker(&job);
+	for (i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+
+	/* regions never claimed mean no worker could get a buffer */
+	for (r = job.next; r < job.count; r++)
+		if (job.regions[r].file->error == 0)
+			job.regions[r].file->error = ENOMEM;
+
+	for (i = 0; i < nfiles; i++) {
+		if (files[i].error == 0 && fchmod(files[i].fd, mode))
+			files[i].error = errno;
+		if (close(files[i].fd) == -1 && files[i].error == 0)
+			files[i].error = errno;
+		if (files[i].error) {
+			unlink(files[i].name);
+			warnc(files[i].error, "(%s removed) %s", files[i].name, "Write Error");
+			failed = 1;
+		} else if (verbose)
+			(void)fprintf(stderr, "%s %qd bytes\n", files[i].name, size);
+	}
+	if (failed)
+		exit(1);
+
+	free(job.regions);
+	free(files);
+}
+
 /* On error remove the file */
 
 void
@@ -8,15 +8,28 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <fnmatch.h>
 #include <string.h>
+#include <sys/param.h>
 #include <sys/sysctl.h>
+#include <dispatch/dispatch.h>
+#include <libproc.h>
 #include <stack_logging.h>
 
 #define    BSD_PID_MAX    99999        /* Copy of PID_MAX from sys/proc_internal.h. */
 
+struct msl_target {
+    pid_t pid;
+    char name[2 * MAXCOMLEN + 1];
+    int error;
+};
+
+static struct msl_target *targets;
+static size_t ntargets, maxtargets;
+
 static void print_usage()
 {
-    printf("usage: mslutil pid [--disable] | [--enable malloc | vm | full | lite | vmlite]\n");
+    printf("usage: mslutil pid | name ... [--disable] | [--enable malloc | vm | full | lite | vmlite]\n");
 }
 
 static int send_msl_command(uint64_t pid, uint64_t flavor)
@@ -28,13 +41,66 @@ static int send_msl_command(uint64_t pid, uint64_t flavor)
     
     int ret = sysctlbyname("kern.memorystatus_vm_pressure_send", 0, 0, &flags, sizeof(flags));
     
-    if (ret) {
-        printf("send_msl_command - sysctl: kern.memorystatus_vm_pressure_send failed %s\n", strerror(errno));
-    } else {
-        printf("send_msl_command - success!\n");
+    return ret ? errno : 0;
+}
+
+static void add_target(pid_t pid, const char *name)
+{
+    for (size_t i = 0; i < ntargets; i++) {
+        if (targets[i].pid == pid) {
+            return;
+        }
+    }
+    
+    if (ntargets == maxtargets) {
+        maxtargets = maxtargets ? maxtargets * 2 : 16;
+        targets = reallocf(targets, maxtargets * sizeof(*targets));
+        if (targets == NULL) {
+            printf("Out of memory\n");
+            exit(1);
+        }
+    }
+    
+    targets[ntargets].pid = pid;
+    strlcpy(targets[ntargets].name, name, sizeof(targets[ntargets].name));
+    targets[ntargets].error = 0;
+    ntargets++;
+}
+
+/*
+ * Add every process whose name matches the shell pattern, returning how
+ * many did.
+ */
+static int add_matching(const char *pattern)
+{
+    int count = proc_listallpids(NULL, 0);
+    if (count <= 0) {
+        printf("proc_listallpids failed %s\n", strerror(errno));
+        exit(1);
+    }
+    
+    count += 64;    /* room for processes that start meanwhile */
+    pid_t *pids = malloc(count * sizeof(*pids));
+    if (pids == NULL) {
+        printf("Out of memory\n");
+        exit(1);
     }
+    count = proc_listallpids(pids, count * (int)sizeof(*pids));
     
-    return ret;
+    int matched = 0;
+    char name[2 * MAXCOMLEN + 1];
+    for (int i = 0; i < count; i++) {
+        if (pids[i] <= 0 || proc_name(pids[i], name, sizeof(name)) <= 0) {
+            continue;
+        }
+        if (fnmatch(pattern, name, 0) == 0) {
+            add_target(pids[i], name);
+            matched++;
+        }
+    }
+    free(pids);
+    
+    return matched;
 }
 
 int main(int argc, const char * argv[])
@@ -44,32 +110,49 @@ int main(int argc, const char * argv[])
         exit(1);
     }
     
-    int ret = -1;
+    int ret = 0;
+    int argi;
     
-    pid_t pid = atoi(argv[1]);
+    /* Everything up to the first option is a pid or a process name pattern */
+    for (argi = 1; argi < argc && strncmp(argv[argi], "--", 2) != 0; argi++) {
+        const char *arg = argv[argi];
+        char *end;
+        long pid = strtol(arg, &end, 10);
+        
+        if (*arg != '\0' && *end == '\0') {
+            if (pid <= 0 || pid > BSD_PID_MAX) {
+                printf("Invalid pid\n");
+                exit(1);
+            }
+            add_target((pid_t)pid, "");
+        } else if (add_matching(arg) == 0) {
+            printf("No process matches %s\n", arg);
+            ret = -1;
+        }
+    }
     
-    if (pid <= 0 || pid > BSD_PID_MAX) {
-        printf("Invalid pid\n");
+    if (argi == 1 || argi == argc) {
+        print_usage();
         exit(1);
     }
     
-    if (strcmp(argv[2], "--enable") == 0) {
-        if (argc < 4) {
+    uint64_t flavor = 0;
+    
+    if (strcmp(argv[argi], "--enable") == 0) {
+        if (argi + 1 >= argc) {
             print_usage();
             exit(1);
         }
         
-        uint64_t flavor = 0;
-        
-        if (strcmp(argv[3], "full") == 0) {
+        if (strcmp(argv[argi + 1], "full") == 0) {
             flavor = MEMORYSTATUS_ENABLE_MSL_MALLOC | MEMORYSTATUS_ENABLE_MSL_VM;
-        } else if (strcmp(argv[3], "malloc") == 0) {
+        } else if (strcmp(argv[argi + 1], "malloc") == 0) {
             flavor = MEMORYSTATUS_ENABLE_MSL_MALLOC;
-        } else if (strcmp(argv[3], "vm") == 0) {
+        } else if (strcmp(argv[argi + 1], "vm") == 0) {
             flavor = MEMORYSTATUS_ENABLE_MSL_VM;
-        } else if (strcmp(argv[3], "lite") == 0) {
+        } else if (strcmp(argv[argi + 1], "lite") == 0) {
             flavor = MEMORYSTATUS_ENABLE_MSL_LITE_FULL;
-        } else if (strcmp(argv[3], "vmlite") == 0) {
+        } else if (strcmp(argv[argi + 1], "vmlite") == 0) {
             flavor = MEMORYSTATUS_ENABLE_MSL_LITE_VM;
         }
         
@@ -77,20 +160,42 @@ int main(int argc, const char * argv[])
             print_usage();
             exit(1);
         }
-        
-        ret = send_msl_command(pid, flavor);
-    } else if (strcmp(argv[2], "--disable") == 0) {
-        ret = send_msl_command(pid, MEMORYSTATUS_DISABLE_MSL);
+    } else if (strcmp(argv[argi], "--disable") == 0) {
+        flavor = MEMORYSTATUS_DISABLE_MSL;
     } else {
         print_usage();
         exit(1);
     }
     
+    /* Send to all of the processes at once, then report in order */
+    dispatch_apply(ntargets, dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0), ^(size_t i) {
+        targets[i].error = send_msl_command(targets[i].pid, flavor);
+    });
+    
+    for (size_t i = 0; i < ntargets; i++) {
+        struct msl_target *t = &targets[i];
+        
+        if (ntargets == 1 && t->name[0] == '\0') {
+            /* a lone pid reports as it always has */
+            if (t->error) {
+                printf("send_msl_command - sysctl: kern.memorystatus_vm_pressure_send failed %s\n", strerror(t->error));
+            } else {
+                printf("send_msl_command - success!\n");
+            }
+        } else if (t->error) {
+            printf("%d%s%s%s: failed %s\n", t->pid, t->name[0] ? " (" : "", t->name, t->name[0] ? ")" : "", strerror(t->error));
+        } else {
+            printf("%d%s%s%s: success\n", t->pid, t->name[0] ? " (" : "", t->name, t->name[0] ? ")" : "");
+        }
+        
+        if (t->error) {
+            ret = -1;
+        }
+    }
+    
     if (ret != 0) {
         exit(1);
     } else {
         exit(0);
     }
 }
-
-
@@ -29,6 +29,7 @@ cc -o nvram nvram.c -framework CoreFoundation -framework IOKit -Wall
 #include <IOKit/IOKitKeysPrivate.h>
 #include <CoreFoundation/CoreFoundation.h>
 #include <err.h>
+#include <fnmatch.h>
 #include <mach/mach_error.h>
 #include <sys/stat.h>
 
@@ -40,10 +41,21 @@ static void SetOrGetOFVariable(char *str);
 static kern_return_t GetOFVariable(const char *name, CFStringRef *nameRef,
                                    CFTypeRef *valueRef);
 static kern_return_t SetOFVariable(const char *name, const char *value);
+static void QueueOFVariable(const char *name, const char *value);
+static void FlushOFVariables(void);
+static void SetPendingOFVariable(const void *key, const void *value, void *context);
+static void CreatePendingOFVariables(void);
+static void LoadCurrentOFVariables(void);
+static void ReleaseCurrentOFVariables(void);
 static void DeleteOFVariable(const char *name);
-static void PrintOFVariables(void);
+static void PrintOFVariables(const char *pattern);
 static void PrintOFVariable(const void *key,const void *value,void *context);
+static void FilterOFVariables(CFMutableDictionaryRef dict, const char *pattern);
+static void PrintJSONVariables(CFDictionaryRef dict);
+static void PrintJSONString(CFStringRef string);
+static void PrintJSONValue(CFTypeRef value);
 static void SetOFVariableFromFile(const void *key, const void *value, void *context);
+static void QueueOFVariableFromFile(const void *key, const void *value, void *context);
 static void ClearOFVariables(void);
 static void ClearOFVariable(const void *key,const void *value,void *context);
 static CFTypeRef ConvertValueToCFTypeRef(CFTypeID typeID, const char *value);
@@ -55,8 +67,17 @@ static io_registry_entry_t gOptionsRef;
 static io_registry_entry_t gSystemOptionsRef;
 static io_registry_entry_t gSelectedOptionsRef;
 static bool                gUseXML;
+static bool                gUseJSON;
 static bool                gUseForceSync;
 
+// Sets are queued in gPendingVariables and committed together by
+// FlushOFVariables().  gPendingStrings holds the text of the queued
+// variables that did not exist yet, whose type was only guessed.
+static CFMutableDictionaryRef gPendingVariables;
+static CFMutableDictionaryRef gPendingStrings;
+static CFDictionaryRef        gCurrentVariables;
+static bool                   gSyncPending;
+
 #if TARGET_OS_BRIDGE /* Stuff for nvram bridge -> intel */
 #include <dlfcn.h>
 #include <libMacEFIManager/MacEFIHostInterfaceAPI.h>
@@ -116,11 +137,32 @@ int main(int argc, char **argv)
               return 1;
             }
 #endif
-            PrintOFVariables();
+            PrintOFVariables(NULL);
+            break;
+
+          case 'P' :
+#if TARGET_OS_BRIDGE
+            if (gBridgeToIntel) {
+              fprintf(stderr, "-P not supported for Mac NVRAM store.\n");
+              return 1;
+            }
+#endif
+            cnt++;
+            if (cnt < argc && *argv[cnt] != '-') {
+              PrintOFVariables(argv[cnt]);
+            } else {
+              UsageMessage("missing pattern");
+            }
             break;
 
           case 'x' :
             gUseXML = true;
+            gUseJSON = false;
+            break;
+
+          case 'j' :
+            gUseJSON = true;
+            gUseXML = false;
             break;
 
           case 'f':
@@ -188,6 +230,8 @@ int main(int argc, char **argv)
             // to write to the system NVRAM region if available
             if (gSystemOptionsRef) {
               fprintf(stderr, "Selecting options-system node.\n");
+              FlushOFVariables();
+              ReleaseCurrentOFVariables();
               gSelectedOptionsRef = gSystemOptionsRef;
             } else {
               fprintf(stderr, "No options-system node, using options.\n");
@@ -207,11 +251,16 @@ int main(int argc, char **argv)
       }
   }
 
+  FlushOFVariables();
+
+  // Sync once for all the variables set, rather than after each one.
   // radar:25206371
-  if (argcount == 0 && gUseForceSync == true) {
+  if (gSyncPending || (argcount == 0 && gUseForceSync == true)) {
     NVRamSyncNow();
   }
 
+  ReleaseCurrentOFVariables();
+
   IOObjectRelease(gOptionsRef);
 
   if (gSystemOptionsRef) {
@@ -229,10 +278,13 @@ static void UsageMessage(const char *message)
 {
   warnx("(usage: %s)", message);
 
-  printf("nvram [-x] [-p] [-f filename] [-d name] [-c] name[=value] ...\n");
+  printf("nvram [-x | -j] [-p] [-P pattern] [-f filename] [-d name] [-c] name[=value] ...\n");
   printf("\t-x         use XML format for printing or reading variables\n");
-  printf("\t           (must appear before -p or -f)\n");
+  printf("\t           (must appear before -p, -P or -f)\n");
+  printf("\t-j         use JSON format for printing variables\n");
+  printf("\t           (must appear before -p or -P)\n");
   printf("\t-p         print all firmware variables\n");
+  printf("\t-P         print the firmware variables matching a glob pattern\n");
   printf("\t-f         set firmware variables from a text file\n");
   printf("\t-d         delete the named variable\n");
   printf("\t-c         delete all variables\n");
@@ -274,7 +326,6 @@ static void ParseFile(const char *fileName)
   char name[kMaxNameSize];
   char value[kMaxStringSize];
   FILE *patches;
-  kern_return_t kret;
 
   if (gUseXML) {
     ParseXMLFile(fileName);
@@ -370,10 +421,7 @@ static void ParseFile(const char *fileName)
     if (state == kSetenv) {
       name[ni] = 0;
       value[vi] = 0;
-      if ((kret = SetOFVariable(name, value)) != KERN_SUCCESS) {
-        errx(1, "Error setting variable - '%s': %s", name,
-             mach_error_string(kret));
-      }
+      QueueOFVariable(name, value);
       state = kFirstColumn;
     }
   }
@@ -450,7 +498,7 @@ static void ParseXMLFile(const char *fileName)
 
   free(buffer);
 
-  CFDictionaryApplyFunction(plist, &SetOFVariableFromFile, 0);
+  CFDictionaryApplyFunction(plist, &QueueOFVariableFromFile, 0);
 
   CFRelease(plist);
 }
@@ -535,9 +583,10 @@ static void SetOrGetOFVariable(char *str)
     else
 #endif
     {
-      result = SetOFVariable(name, value);
+      QueueOFVariable(name, value);
       /* Try syncing the new data to device, best effort! */
-      NVRamSyncNow();
+      gSyncPending = true;
+      result = KERN_SUCCESS;
     }
     if (result != KERN_SUCCESS) {
       errx(1, "Error setting variable - '%s': %s", name,
@@ -605,6 +654,8 @@ static kern_return_t LinkMacNVRAMSymbols()
 static kern_return_t GetOFVariable(const char *name, CFStringRef *nameRef,
                                    CFTypeRef *valueRef)
 {
+  FlushOFVariables();
+
   *nameRef = CFStringCreateWithCString(kCFAllocatorDefault, name,
                                        kCFStringEncodingUTF8);
   if (*nameRef == 0) {
@@ -694,6 +745,172 @@ static kern_return_t SetOFVariable(const char *name, const char *value)
   return result;
 }
 
+// QueueOFVariable(name, value)
+//
+//   Queue the variable to be set by the next FlushOFVariables().
+//   Its type is taken from the current value, as SetOFVariable()
+//   does; a new variable is queued as the first type its value
+//   converts to, and set with SetOFVariable() if that is refused.
+//
+static void QueueOFVariable(const char *name, const char *value)
+{
+  CFStringRef   nameRef;
+  CFTypeRef     valueRef = 0;
+  CFTypeRef     currentRef;
+  CFStringRef   stringRef;
+  CFTypeID      typeIDs[4];
+  long          cnt;
+
+  nameRef = CFStringCreateWithCString(kCFAllocatorDefault, name,
+                                      kCFStringEncodingUTF8);
+  if (nameRef == 0) {
+      errx(1, "Error creating CFString for key %s", name);
+  }
+
+  LoadCurrentOFVariables();
+
+  currentRef = CFDictionaryGetValue(gCurrentVariables, nameRef);
+  if (currentRef) {
+      valueRef = ConvertValueToCFTypeRef(CFGetTypeID(currentRef), value);
+      if (valueRef == 0) {
+          errx(1, "Error creating CFTypeRef for value %s", value);
+      }
+      CFDictionaryRemoveValue(gPendingStrings, nameRef);
+  } else {
+      // In the default case, try data, string, number, then boolean.
+      typeIDs[0] = CFDataGetTypeID();
+      typeIDs[1] = CFStringGetTypeID();
+      typeIDs[2] = CFNumberGetTypeID();
+      typeIDs[3] = CFBooleanGetTypeID();
+
+      for (cnt = 0; cnt < 4 && valueRef == 0; cnt++) {
+          valueRef = ConvertValueToCFTypeRef(typeIDs[cnt], value);
+      }
+      if (valueRef == 0) {
+          errx(1, "Error setting variable - '%s': %s", name,
+               mach_error_string(kIOReturnBadArgument));
+      }
+
+      stringRef = CFStringCreateWithCString(kCFAllocatorDefault, value,
+                                            kCFStringEncodingUTF8);
+      if (stringRef == 0) {
+          errx(1, "Error creating CFString for value %s", value);
+      }
+      CFDictionarySetValue(gPendingStrings, nameRef, stringRef);
+      CFRelease(stringRef);
+  }
+
+  CFDictionarySetValue(gPendingVariables, nameRef, valueRef);
+
+  CFRelease(valueRef);
+  CFRelease(nameRef);
+}
+
+// FlushOFVariables()
+//
+//   Commit the queued variables with one IORegistryEntrySetCFProperties().
+//   If that is refused, set them one at a time to find the culprit.
+//
+static void FlushOFVariables(void)
+{
+  kern_return_t result;
+
+  if (gPendingVariables == 0 || CFDictionaryGetCount(gPendingVariables) == 0) {
+    return;
+  }
+
+  result = IORegistryEntrySetCFProperties(gSelectedOptionsRef, gPendingVariables);
+  if (result != KERN_SUCCESS) {
+    CFDictionaryApplyFunction(gPendingVariables, &SetPendingOFVariable, 0);
+  }
+
+  CFDictionaryRemoveAllValues(gPendingVariables);
+  CFDictionaryRemoveAllValues(gPendingStrings);
+
+  // The types of any new variables are now known.
+  ReleaseCurrentOFVariables();
+}
+
+static void SetPendingOFVariable(const void *key, const void *value, void *context)
+{
+  CFStringRef   stringRef;
+  CFIndex       nameLen, valueLen;
+  char          *nameBuffer, *valueBuffer;
+  kern_return_t result;
+
+  stringRef = CFDictionaryGetValue(gPendingStrings, key);
+  if (stringRef == 0) {
+    SetOFVariableFromFile(key, value, context);
+    return;
+  }
+
+  // A new variable; let SetOFVariable() try each type in turn.
+  nameLen = CFStringGetMaximumSizeForEncoding(CFStringGetLength(key),
+      kCFStringEncodingUTF8) + 1;
+  valueLen = CFStringGetMaximumSizeForEncoding(CFStringGetLength(stringRef),
+      kCFStringEncodingUTF8) + 1;
+  nameBuffer = malloc(nameLen);
+  valueBuffer = malloc(valueLen);
+  if (nameBuffer == 0 || valueBuffer == 0 ||
+      !CFStringGetCString(key, nameBuffer, nameLen, kCFStringEncodingUTF8) ||
+      !CFStringGetCString(stringRef, valueBuffer, valueLen, kCFStringEncodingUTF8)) {
+    errx(1, "Unable to convert queued variable to C string");
+  }
+
+  if ((result = SetOFVariable(nameBuffer, valueBuffer)) != KERN_SUCCESS) {
+    errx(1, "Error setting variable - '%s': %s", nameBuffer,
+         mach_error_string(result));
+  }
+
+  free(nameBuffer);
+  free(valueBuffer);
+}
+
+static void CreatePendingOFVariables(void)
+{
+  if (gPendingVariables == 0) {
+    gPendingVariables = CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+        &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    gPendingStrings = CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+        &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    if (gPendingVariables == 0 || gPendingStrings == 0) {
+      errx(1, "Error creating dictionary for queued variables");
+    }
+  }
+}
+
+// LoadCurrentOFVariables()
+//
+//   Read all of the variables once, so that queued sets can look up
+//   the types of existing variables without a round trip each.
+//
+static void LoadCurrentOFVariables(void)
+{
+  kern_return_t          result;
+  CFMutableDictionaryRef dict;
+
+  CreatePendingOFVariables();
+
+  if (gCurrentVariables != 0) {
+    return;
+  }
+
+  result = IORegistryEntryCreateCFProperties(gSelectedOptionsRef, &dict, 0, 0);
+  if (result != KERN_SUCCESS) {
+    errx(1, "Error getting the firmware variables: %s", mach_error_string(result));
+  }
+
+  gCurrentVariables = dict;
+}
+
+static void ReleaseCurrentOFVariables(void)
+{
+  if (gCurrentVariables != 0) {
+    CFRelease(gCurrentVariables);
+    gCurrentVariables = 0;
+  }
+}
+
 #if TARGET_OS_BRIDGE
 static kern_return_t SetMacOFVariable(char *name, char *value)
 {
@@ -707,7 +924,9 @@ static kern_return_t SetMacOFVariable(char *name, char *value)
 //
 static void DeleteOFVariable(const char *name)
 {
+  FlushOFVariables();
   SetOFVariable(kIONVRAMDeletePropertyKey, name);
+  ReleaseCurrentOFVariables();
 }
 
 #if TARGET_OS_BRIDGE
@@ -726,21 +945,49 @@ static void NVRamSyncNow(void)
   }
 }
 
-// PrintOFVariables()
+// PrintOFVariables(pattern)
 //
-//   Print all of the firmware variables.
+//   Print all of the firmware variables, or those whose names match
+//   the glob pattern.  Variables are filtered out before their values
+//   are formatted, and a pattern with no wildcards reads just the one.
 //
-static void PrintOFVariables(void)
+static void PrintOFVariables(const char *pattern)
 {
   kern_return_t          result;
   CFMutableDictionaryRef dict;
+  CFStringRef            nameRef;
+  CFTypeRef              valueRef;
 
-  result = IORegistryEntryCreateCFProperties(gSelectedOptionsRef, &dict, 0, 0);
-  if (result != KERN_SUCCESS) {
-    errx(1, "Error getting the firmware variables: %s", mach_error_string(result));
+  FlushOFVariables();
+
+  if (pattern != NULL && strpbrk(pattern, "*?[\\") == NULL) {
+    dict = CFDictionaryCreateMutable(kCFAllocatorDefault, 1,
+        &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    if (dict == NULL) {
+      errx(1, "Error creating dictionary for variable value");
+    }
+
+    if (GetOFVariable(pattern, &nameRef, &valueRef) == KERN_SUCCESS) {
+      CFDictionarySetValue(dict, nameRef, valueRef);
+      CFRelease(valueRef);
+    }
+    CFRelease(nameRef);
+  } else {
+    result = IORegistryEntryCreateCFProperties(gSelectedOptionsRef, &dict, 0, 0);
+    if (result != KERN_SUCCESS) {
+      errx(1, "Error getting the firmware variables: %s", mach_error_string(result));
+    }
+
+    if (pattern != NULL) {
+      FilterOFVariables(dict, pattern);
+    }
   }
 
-  if (gUseXML) {
+  if (gUseJSON) {
+
+    PrintJSONVariables(dict);
+
+  } else if (gUseXML) {
     CFDataRef data;
 
     data = CFPropertyListCreateData( kCFAllocatorDefault, dict, kCFPropertyListXMLFormat_v1_0, 0, NULL );
@@ -782,6 +1029,19 @@ static void PrintOFVariable(const void *key, const void *value, void *context)
   long          length;
   CFTypeID      typeID;
 
+  if (gUseJSON) {
+    CFDictionaryRef dict = CFDictionaryCreate(kCFAllocatorDefault, &key, &value, 1,
+                                              &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+    if (dict == NULL) {
+      errx(1, "Error creating dictionary for variable value");
+    }
+
+    PrintJSONVariables(dict);
+
+    CFRelease(dict);
+    return;
+  }
+
   if (gUseXML) {
     CFDataRef data;
     CFDictionaryRef dict = CFDictionaryCreate(kCFAllocatorDefault, &key, &value, 1,
@@ -867,6 +1127,133 @@ static void PrintOFVariable(const void *key, const void *value, void *context)
   if (valueBuffer != 0) free(valueBuffer);
 }
 
+// FilterOFVariables(dict, pattern)
+//
+//   Remove the variables whose names do not match the glob pattern.
+//
+static void FilterOFVariables(CFMutableDictionaryRef dict, const char *pattern)
+{
+  CFIndex     count, cnt, nameLen;
+  const void  **keys;
+  char        *nameBuffer;
+
+  count = CFDictionaryGetCount(dict);
+  keys = malloc(count * sizeof(*keys));
+  if (keys == NULL && count != 0) {
+    errx(1, "Error allocating %ld variable names", (long)count);
+  }
+  CFDictionaryGetKeysAndValues(dict, keys, NULL);
+
+  for (cnt = 0; cnt < count; cnt++) {
+    nameLen = CFStringGetMaximumSizeForEncoding(CFStringGetLength(keys[cnt]),
+        kCFStringEncodingUTF8) + 1;
+    nameBuffer = malloc(nameLen);
+    if (nameBuffer == NULL ||
+        !CFStringGetCString(keys[cnt], nameBuffer, nameLen, kCFStringEncodingUTF8) ||
+        fnmatch(pattern, nameBuffer, 0) != 0) {
+      CFDictionaryRemoveValue(dict, keys[cnt]);
+    }
+    free(nameBuffer);
+  }
+
+  free(keys);
+}
+
+static int CompareNames(const void *a, const void *b)
+{
+  return (int)CFStringCompare(*(CFStringRef const *)a, *(CFStringRef const *)b, 0);
+}
+
+// PrintJSONVariables(dict)
+//
+//   Print the variables as a JSON object, sorted by name.  Data values
+//   are printed as strings of hex digits.
+//
+static void PrintJSONVariables(CFDictionaryRef dict)
+{
+  CFIndex     count, cnt;
+  const void  **keys;
+
+  count = CFDictionaryGetCount(dict);
+  keys = malloc(count * sizeof(*keys));
+  if (keys == NULL && count != 0) {
+    errx(1, "Error allocating %ld variable names", (long)count);
+  }
+  CFDictionaryGetKeysAndValues(dict, keys, NULL);
+  qsort(keys, count, sizeof(*keys), CompareNames);
+
+  printf("{");
+  for (cnt = 0; cnt < count; cnt++) {
+    printf("%s\n  ", cnt ? "," : "");
+    PrintJSONString(keys[cnt]);
+    printf(": ");
+    PrintJSONValue(CFDictionaryGetValue(dict, keys[cnt]));
+  }
+  printf("\n}\n");
+
+  free(keys);
+}
+
+static void PrintJSONString(CFStringRef string)
+{
+  CFIndex       length;
+  char          *buffer;
+  const char    *cp;
+
+  length = CFStringGetMaximumSizeForEncoding(CFStringGetLength(string),
+      kCFStringEncodingUTF8) + 1;
+  buffer = malloc(length);
+  if (buffer == NULL || !CFStringGetCString(string, buffer, length, kCFStringEncodingUTF8)) {
+    warnx("Unable to convert string to UTF-8");
+    printf("null");
+    free(buffer);
+    return;
+  }
+
+  putchar('"');
+  for (cp = buffer; *cp; cp++) {
+    if (*cp == '"' || *cp == '\\') {
+      printf("\\%c", *cp);
+    } else if ((unsigned char)*cp < 0x20) {
+      printf("\\u%04x", (unsigned char)*cp);
+    } else {
+      putchar(*cp);
+    }
+  }
+  putchar('"');
+
+  free(buffer);
+}
+
+static void PrintJSONValue(CFTypeRef value)
+{
+  CFTypeID      typeID;
+  SInt64        number;
+  const UInt8   *dataPtr;
+  CFIndex       length, cnt;
+
+  typeID = CFGetTypeID(value);
+
+  if (typeID == CFBooleanGetTypeID()) {
+    printf("%s", CFBooleanGetValue(value) ? "true" : "false");
+  } else if (typeID == CFNumberGetTypeID()) {
+    CFNumberGetValue(value, kCFNumberSInt64Type, &number);
+    printf("%lld", (long long)number);
+  } else if (typeID == CFStringGetTypeID()) {
+    PrintJSONString(value);
+  } else if (typeID == CFDataGetTypeID()) {
+    length = CFDataGetLength(value);
+    dataPtr = CFDataGetBytePtr(value);
+    putchar('"');
+    for (cnt = 0; cnt < length; cnt++) {
+      printf("%02x", dataPtr[cnt]);
+    }
+    putchar('"');
+  } else {
+    printf("null");
+  }
+}
+
 // ClearOFVariables()
 //
 //   Deletes all OF variables
@@ -876,6 +1263,8 @@ static void ClearOFVariables(void)
     kern_return_t          result;
     CFMutableDictionaryRef dict;
 
+    FlushOFVariables();
+
     result = IORegistryEntryCreateCFProperties(gSelectedOptionsRef, &dict, 0, 0);
     if (result != KERN_SUCCESS) {
       errx(1, "Error getting the firmware variables: %s", mach_error_string(result));
@@ -883,6 +1272,7 @@ static void ClearOFVariables(void)
     CFDictionaryApplyFunction(dict, &ClearOFVariable, 0);
 
     CFRelease(dict);
+    ReleaseCurrentOFVariables();
 }
 
 static void ClearOFVariable(const void *key, const void *value, void *context)
@@ -980,3 +1370,11 @@ static void SetOFVariableFromFile(const void *key, const void *value, void *cont
          mach_error_string(result));
   }
 }
+
+static void QueueOFVariableFromFile(const void *key, const void *value, void *context)
+{
+  CreatePendingOFVariables();
+
+  CFDictionaryRemoveValue(gPendingStrings, key);
+  CFDictionarySetValue(gPendingVariables, key, value);
+}
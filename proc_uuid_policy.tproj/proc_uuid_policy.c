@@ -22,8 +22,10 @@
  */
 
 /* Header Declarations */
+#include <dispatch/dispatch.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fts.h>
 #include <libkern/OSByteOrder.h>
 #include <libproc.h>
 #include <mach-o/fat.h>
@@ -31,7 +33,6 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <uuid/uuid.h>
@@ -40,6 +41,7 @@
 /* Constant Declarations */
 #define SUCCESS                     0
 #define FAILURE                     -1
+#define NOT_MACHO                   1
 #define MAX_CHUNK_SIZE              1024 * 1024 * 16
 
 #ifndef PROC_UUID_ALT_DYLD_POLICY
@@ -53,11 +55,45 @@ struct uuid_bucket
     uuid_t          *binary_uuids;
 };
 
+/* Path to parse */
+struct uuid_path
+{
+    char            *path;
+    bool            walked;     /* found by walking a directory */
+};
+
+/* Paths found on the command line and in directories */
+struct uuid_path_list
+{
+    unsigned int        num_paths;
+    unsigned int        capacity;
+    struct uuid_path    *paths;
+};
+
 /* Static Function Definitions */
 static
 void
 usage();
 
+static
+int
+add_path(
+    struct uuid_path_list *path_list,
+    const char *path,
+    bool walked);
+
+static
+int
+walk_directory(
+    const char *path,
+    struct uuid_path_list *path_list);
+
+static
+int
+compare_uuids(
+    const void *a,
+    const void *b);
+
 static
 int
 parse_macho_uuids(
@@ -67,7 +103,8 @@ parse_macho_uuids(
 static
 int
 parse_macho_slice(
-    const void *mapped,
+    const int fd,
+    const off_t file_size,
     const unsigned int offset,
     const unsigned int slice_index,
     struct uuid_bucket *uuid_bucket);
@@ -78,24 +115,30 @@ main(
     int argc,
     char **argv)
 {
-    int                 exit_status = EXIT_FAILURE;
-    const char          *verb_string;
-    const char          *policy_string;
-    const char          *uuid_path_string;
-    int                 operation = 0;
-    const char          *operation_string = NULL;
-    int                 policy = 0;
-    uuid_t              uuid;
-    struct stat         sb;
-    struct uuid_bucket  uuid_bucket = {0, NULL};
-    unsigned int        i;
-    uuid_string_t       uuid_string = "";
+    int                     exit_status = EXIT_FAILURE;
+    const char              *verb_string;
+    const char              *policy_string;
+    const char              *uuid_path_string;
+    int                     operation = 0;
+    const char              *operation_string = NULL;
+    int                     policy = 0;
+    uuid_t                  uuid;
+    struct stat             sb;
+    struct uuid_bucket      uuid_bucket = {0, NULL};
+    struct uuid_bucket      named_uuids = {0, NULL};
+    struct uuid_path_list   path_list = {0, 0, NULL};
+    struct uuid_bucket      *path_buckets = NULL;
+    int                     *path_results = NULL;
+    unsigned int            num_uuids;
+    unsigned int            i;
+    int                     arg_index;
+    uuid_string_t           uuid_string = "";
 
     /*
      * Parse the arguments.
      */
 
-    if (argc != 4) {
+    if (argc < 4) {
 
         usage();
         goto BAIL;
@@ -103,7 +146,6 @@ main(
 
     verb_string = argv[1];
     policy_string = argv[2];
-    uuid_path_string = argv[3];
 
     if (strcmp(verb_string, "clear") == 0) {
 
@@ -143,35 +185,133 @@ main(
         goto BAIL;
     }
 
-    if (uuid_parse(uuid_path_string, uuid) == -1) {
+    /*
+     * Sort the remaining arguments into UUIDs and paths, walking any
+     * directories for the files beneath them.
+     */
+
+    named_uuids.binary_uuids = calloc((size_t)(argc - 3), sizeof(uuid_t));
+    if (named_uuids.binary_uuids == NULL) {
+
+        fprintf(stderr, "Could not allocate %d UUIDs\n", argc - 3);
+        goto BAIL;
+    }
+
+    for (arg_index = 3; arg_index < argc; arg_index++) {
 
-        /* Is this a path to a macho file? */
+        uuid_path_string = argv[arg_index];
+
+        if (uuid_parse(uuid_path_string, uuid) == 0) {
+
+            memcpy(named_uuids.binary_uuids[named_uuids.num_uuids++], uuid, sizeof(uuid_t));
+            continue;
+        }
+
+        /* Is this a path to a macho file or a directory of them? */
         if (stat(uuid_path_string, &sb) == -1) {
 
             fprintf(stderr, "%s is not a UUID nor path: %s\n", uuid_path_string, strerror(errno));
             goto BAIL;
-        } else {
+        }
+
+        if (S_ISDIR(sb.st_mode)) {
 
-            /* Parse the UUID from the macho file. */
-            if (parse_macho_uuids(uuid_path_string, &uuid_bucket)) {
+            if (walk_directory(uuid_path_string, &path_list)) {
 
-                fprintf(stderr, "Could not parse %s for its UUID\n", uuid_path_string);
                 goto BAIL;
             }
+        } else if (add_path(&path_list, uuid_path_string, false)) {
+
+            goto BAIL;
         }
-    } else {
+    }
+
+    /*
+     * Parse the UUIDs from every file in parallel, each into its own
+     * bucket.  Files found by walking a directory that are not mach-o
+     * are skipped.
+     */
 
-        uuid_bucket.num_uuids = 1;
-        uuid_bucket.binary_uuids = calloc(1, sizeof(uuid_t));
-        if (uuid_bucket.binary_uuids == NULL) {
+    if (path_list.num_paths > 0) {
+
+        path_buckets = calloc(path_list.num_paths, sizeof(struct uuid_bucket));
+        path_results = calloc(path_list.num_paths, sizeof(int));
+        if (path_buckets == NULL || path_results == NULL) {
+
+            fprintf(stderr, "Could not allocate %u UUID buckets\n", path_list.num_paths);
+            goto BAIL;
+        }
+
+        dispatch_apply(path_list.num_paths, DISPATCH_APPLY_AUTO, ^(size_t p) {
+            path_results[p] = parse_macho_uuids(path_list.paths[p].path, &path_buckets[p]);
+        });
+    }
+
+    num_uuids = named_uuids.num_uuids;
+
+    for (i = 0; i < path_list.num_paths; i++) {
+
+        if (path_results[i] == SUCCESS) {
+
+            num_uuids += path_buckets[i].num_uuids;
+        } else if (!path_list.paths[i].walked) {
+
+            if (path_results[i] == NOT_MACHO) {
+
+                fprintf(stderr, "%s is not a mach-o file\n", path_list.paths[i].path);
+            }
 
-            fprintf(stderr, "Could not allocate single UUID bucket\n");
+            fprintf(stderr, "Could not parse %s for its UUID\n", path_list.paths[i].path);
             goto BAIL;
+        } else if (path_results[i] == FAILURE) {
+
+            fprintf(stderr, "Skipping %s\n", path_list.paths[i].path);
         }
+    }
+
+    if (num_uuids == 0) {
+
+        fprintf(stderr, "No UUIDs found\n");
+        goto BAIL;
+    }
+
+    /*
+     * Gather the UUIDs into one sorted bucket without duplicates, so that
+     * each is passed to the kernel once however many copies of a binary
+     * a bundle contains.
+     */
 
-        memcpy(uuid_bucket.binary_uuids[0], uuid, sizeof(uuid_t));
+    uuid_bucket.binary_uuids = calloc(num_uuids, sizeof(uuid_t));
+    if (uuid_bucket.binary_uuids == NULL) {
+
+        fprintf(stderr, "Could not allocate %u UUIDs\n", num_uuids);
+        goto BAIL;
     }
 
+    memcpy(uuid_bucket.binary_uuids, named_uuids.binary_uuids, named_uuids.num_uuids * sizeof(uuid_t));
+    uuid_bucket.num_uuids = named_uuids.num_uuids;
+
+    for (i = 0; i < path_list.num_paths; i++) {
+
+        if (path_results[i] == SUCCESS) {
+
+            memcpy(uuid_bucket.binary_uuids[uuid_bucket.num_uuids], path_buckets[i].binary_uuids, path_buckets[i].num_uuids * sizeof(uuid_t));
+            uuid_bucket.num_uuids += path_buckets[i].num_uuids;
+        }
+    }
+
+    qsort(uuid_bucket.binary_uuids, uuid_bucket.num_uuids, sizeof(uuid_t), compare_uuids);
+
+    num_uuids = 1;
+    for (i = 1; i < uuid_bucket.num_uuids; i++) {
+
+        if (uuid_compare(uuid_bucket.binary_uuids[i], uuid_bucket.binary_uuids[num_uuids - 1]) != 0) {
+
+            memcpy(uuid_bucket.binary_uuids[num_uuids++], uuid_bucket.binary_uuids[i], sizeof(uuid_t));
+        }
+    }
+    uuid_bucket.num_uuids = num_uuids;
+
     for (i = 0; i < uuid_bucket.num_uuids; i++) {
 
         uuid_unparse(uuid_bucket.binary_uuids[i], uuid_string);
@@ -198,6 +338,25 @@ BAIL:
         free(uuid_bucket.binary_uuids);
     }
 
+    if (named_uuids.binary_uuids != NULL) {
+
+        free(named_uuids.binary_uuids);
+    }
+
+    for (i = 0; i < path_list.num_paths; i++) {
+
+        if (path_buckets != NULL && path_buckets[i].binary_uuids != NULL) {
+
+            free(path_buckets[i].binary_uuids);
+        }
+
+        free(path_list.paths[i].path);
+    }
+
+    free(path_buckets);
+    free(path_results);
+    free(path_list.paths);
+
     return exit_status;
 }
 
@@ -206,7 +365,7 @@ static
 void
 usage(void)
 {
-    fprintf(stderr, "usage: %s <verb> <policy> <uuid | path>\n", getprogname());
+    fprintf(stderr, "usage: %s <verb> <policy> <uuid | path | directory> ...\n", getprogname());
     fprintf(stderr, "Verbs:\n");
     fprintf(stderr, "\tclear\tClear all policies for a given UUID\n");
     fprintf(stderr, "\tadd\tAdd a specific policy\n");
@@ -219,6 +378,115 @@ usage(void)
     fprintf(stderr, "\talt-dyld\tPROC_UUID_ALT_DYLD_POLICY\n");
 }
 
+static
+int
+add_path(
+    struct uuid_path_list *path_list,
+    const char *path,
+    bool walked)
+{
+    struct uuid_path    *paths;
+    unsigned int        capacity;
+
+    if (path_list->num_paths == path_list->capacity) {
+
+        capacity = path_list->capacity ? path_list->capacity * 2 : 64;
+
+        paths = realloc(path_list->paths, capacity * sizeof(struct uuid_path));
+        if (paths == NULL) {
+
+            fprintf(stderr, "Could not allocate %u paths\n", capacity);
+            return FAILURE;
+        }
+
+        path_list->paths = paths;
+        path_list->capacity = capacity;
+    }
+
+    path_list->paths[path_list->num_paths].path = strdup(path);
+    if (path_list->paths[path_list->num_paths].path == NULL) {
+
+        fprintf(stderr, "Could not allocate path %s\n", path);
+        return FAILURE;
+    }
+
+    path_list->paths[path_list->num_paths].walked = walked;
+    path_list->num_paths++;
+
+    return SUCCESS;
+}
+
+static
+int
+walk_directory(
+    const char *path,
+    struct uuid_path_list *path_list)
+{
+    int                 result = FAILURE;
+    FTS                 *fts;
+    FTSENT              *entry;
+    char * const        fts_paths[] = { (char *)path, NULL };
+
+    /* Collect every regular file, without following symbolic links. */
+    fts = fts_open(fts_paths, FTS_PHYSICAL | FTS_NOCHDIR, NULL);
+    if (fts == NULL) {
+
+        fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+        goto BAIL;
+    }
+
+    while ((entry = fts_read(fts)) != NULL) {
+
+        switch (entry->fts_info) {
+
+            case FTS_F: {
+
+                if (add_path(path_list, entry->fts_path, true)) {
+
+                    goto BAIL;
+                }
+            }break;
+
+            case FTS_DNR:
+            case FTS_ERR:
+            case FTS_NS: {
+
+                fprintf(stderr, "Could not read %s: %s\n", entry->fts_path, strerror(entry->fts_errno));
+            }break;
+
+            default:
+                break;
+        }
+    }
+
+    if (errno != 0) {
+
+        fprintf(stderr, "Could not walk %s: %s\n", path, strerror(errno));
+        goto BAIL;
+    }
+
+    /* Set the result to success. */
+    result = SUCCESS;
+
+BAIL:
+
+    if (fts != NULL) {
+
+        (void) fts_close(fts);
+    }
+
+    return result;
+}
+
+static
+int
+compare_uuids(
+    const void *a,
+    const void *b)
+{
+    return uuid_compare(*(const uuid_t *)a, *(const uuid_t *)b);
+}
+
 static
 int
 parse_macho_uuids(
@@ -228,16 +496,15 @@ parse_macho_uuids(
     int                 result = FAILURE;
     int                 fd = -1;
     struct stat         sb;
-    void                *mapped = MAP_FAILED;
 
-    struct fat_header   *fat_header_pointer;
-    struct fat_arch     *fat_arch_pointer;
+    struct fat_header   fat_header;
+    struct fat_arch     *fat_arches = NULL;
     bool                swapped = false;
 
     uint32_t            nfat_arch = 0;
     unsigned int        i;
     uint32_t            arch_offset;
-    uint32_t            arch_size;
+    size_t              arches_size;
 
     /* Open the file and determine its size. */
     fd = open(path, O_RDONLY);
@@ -253,31 +520,30 @@ parse_macho_uuids(
         goto BAIL;
     }
 
-    /* Memory map the file. */
-    mapped = mmap (0, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    if (mapped == MAP_FAILED) {
-
-        fprintf(stderr, "Could not memory map %s: %s\n", path, strerror(errno));
-        goto BAIL;
-    }
-
     /*
-     * Determine the file type.
+     * Determine the file type.  Only the headers and load commands are
+     * read, never the segments themselves.
      */
 
-    fat_header_pointer = (struct fat_header *) mapped;
+    if (pread(fd, &fat_header.magic, sizeof(fat_header.magic), 0) != sizeof(fat_header.magic)) {
 
-    switch (fat_header_pointer->magic) {
+        result = NOT_MACHO;
+        goto BAIL;
+    }
 
-        case FAT_MAGIC: {
-
-            nfat_arch = fat_header_pointer->nfat_arch;
-        }break;
+    switch (fat_header.magic) {
 
+        case FAT_MAGIC:
         case FAT_CIGAM: {
 
-            swapped = true;
-            nfat_arch = OSSwapInt32(fat_header_pointer->nfat_arch);
+            if (pread(fd, &fat_header, sizeof(fat_header), 0) != sizeof(fat_header)) {
+
+                result = NOT_MACHO;
+                goto BAIL;
+            }
+
+            swapped = (fat_header.magic == FAT_CIGAM);
+            nfat_arch = swapped ? OSSwapInt32(fat_header.nfat_arch) : fat_header.nfat_arch;
         }break;
 
         case MH_MAGIC:
@@ -294,7 +560,7 @@ parse_macho_uuids(
                 goto BAIL;
             }
 
-            if (parse_macho_slice(mapped, 0, 0, uuid_bucket)) {
+            if (parse_macho_slice(fd, sb.st_size, 0, 0, uuid_bucket)) {
 
                 fprintf(stderr, "Could not parse slice\n");
                 goto BAIL;
@@ -303,37 +569,42 @@ parse_macho_uuids(
 
         default: {
 
-            fprintf(stderr, "Unknown magic: %d\n", fat_header_pointer->magic);
+            result = NOT_MACHO;
             goto BAIL;
         }
     }
 
+    /* Java class files share FAT_MAGIC; their "fat_arch" count overruns the file. */
+    arches_size = (size_t)nfat_arch * sizeof(struct fat_arch);
+    if (nfat_arch > 0 && sizeof(struct fat_header) + (uint64_t)arches_size > (uint64_t)sb.st_size) {
+
+        result = NOT_MACHO;
+        goto BAIL;
+    }
+
     if (nfat_arch > 0) {
 
         uuid_bucket->num_uuids = nfat_arch;
 
         uuid_bucket->binary_uuids = calloc(nfat_arch, sizeof(uuid_t));
-        if (uuid_bucket->binary_uuids == NULL) {
+        fat_arches = malloc(arches_size);
+        if (uuid_bucket->binary_uuids == NULL || fat_arches == NULL) {
 
             fprintf(stderr, "Could not allocate %d UUIDs\n", nfat_arch);
             goto BAIL;
         }
 
-        for (i = 0; i < nfat_arch; i++) {
+        if (pread(fd, fat_arches, arches_size, sizeof(struct fat_header)) != (ssize_t)arches_size) {
 
-            fat_arch_pointer = (struct fat_arch *)(mapped + sizeof(struct fat_header) + (sizeof(struct fat_arch) * i));
-
-            if (swapped) {
+            fprintf(stderr, "Could not read the fat header of %s: %s\n", path, strerror(errno));
+            goto BAIL;
+        }
 
-                arch_offset = OSSwapInt32(fat_arch_pointer->offset);
-                arch_size = OSSwapInt32(fat_arch_pointer->size);
-            } else {
+        for (i = 0; i < nfat_arch; i++) {
 
-                arch_offset = fat_arch_pointer->offset;
-                arch_size = fat_arch_pointer->size;
-            }
+            arch_offset = swapped ? OSSwapInt32(fat_arches[i].offset) : fat_arches[i].offset;
 
-            if (parse_macho_slice(mapped, arch_offset, i, uuid_bucket)) {
+            if (parse_macho_slice(fd, sb.st_size, arch_offset, i, uuid_bucket)) {
 
                 fprintf(stderr, "Could not parse slice %d of %d\n", i, nfat_arch);
                 goto BAIL;
@@ -350,10 +621,10 @@ BAIL:
      * Clean up.
      */
 
-    if (mapped != MAP_FAILED) {
+    if (fat_arches != NULL) {
 
-        (void) munmap(mapped, (size_t)sb.st_size);
-        mapped = MAP_FAILED;
+        free(fat_arches);
+        fat_arches = NULL;
     }
 
     if (fd != -1) {
@@ -368,28 +639,43 @@ BAIL:
 static
 int
 parse_macho_slice(
-    const void *mapped,
+    const int fd,
+    const off_t file_size,
     const unsigned int offset,
     const unsigned int slice_index,
     struct uuid_bucket *uuid_bucket)
 {
     int                     result = FAILURE;
 
-    struct mach_header      *mach_header_pointer;
-    struct mach_header_64   *mach_header_64_pointer;
+    struct mach_header_64   mach_header;
+    size_t                  header_size;
+    void                    *load_commands = NULL;
     struct load_command     *load_command_pointer;
 
     bool                    swapped = false;
 
     unsigned int            number_load_commands = 0;
+    uint32_t                size_of_commands = 0;
+    uint32_t                command;
+    uint32_t                command_size;
+    uint32_t                command_offset;
     unsigned int            i;
 
     bool                    found_uuid_load_command = false;
     struct uuid_command     *uuid_load_command_pointer = NULL;
 
-    mach_header_pointer = (struct mach_header *)(mapped + offset);
+    /*
+     * Read the header, which is large enough for either width; the
+     * 32-bit header is a prefix of the 64-bit one.
+     */
+
+    if (pread(fd, &mach_header.magic, sizeof(mach_header.magic), offset) != sizeof(mach_header.magic)) {
+
+        fprintf(stderr, "Could not read the mach header at offset %u\n", offset);
+        goto BAIL;
+    }
 
-    switch (mach_header_pointer->magic) {
+    switch (mach_header.magic) {
 
         case FAT_MAGIC: {
 
@@ -403,56 +689,84 @@ parse_macho_slice(
             goto BAIL;
         }break;
 
-        case MH_MAGIC: {
+        case MH_MAGIC:
+        case MH_CIGAM: {
 
-            number_load_commands = mach_header_pointer->ncmds;
-            load_command_pointer = (struct load_command *)(void *)(mach_header_pointer + 1);
+            header_size = sizeof(struct mach_header);
         }break;
 
-        case MH_CIGAM: {
-
-            swapped = true;
+        case MH_MAGIC_64:
+        case MH_CIGAM_64: {
 
-            number_load_commands = OSSwapInt32(mach_header_pointer->ncmds);
-            load_command_pointer = (struct load_command *)(void *)(mach_header_pointer + 1);
+            header_size = sizeof(struct mach_header_64);
         }break;
 
-        case MH_MAGIC_64: {
+        default: {
 
-            mach_header_64_pointer = (struct mach_header_64 *)(mapped + offset);
-            number_load_commands = mach_header_64_pointer->ncmds;
+            fprintf(stderr, "Unknown magic: %d\n", mach_header.magic);
+            goto BAIL;
+        }
+    }
 
-            load_command_pointer = (struct load_command *)(void *)(mach_header_64_pointer + 1);
-        }break;
+    if (pread(fd, &mach_header, header_size, offset) != (ssize_t)header_size) {
 
-        case MH_CIGAM_64: {
+        fprintf(stderr, "Could not read the mach header at offset %u\n", offset);
+        goto BAIL;
+    }
 
-            swapped = true;
+    swapped = (mach_header.magic == MH_CIGAM || mach_header.magic == MH_CIGAM_64);
+    number_load_commands = swapped ? OSSwapInt32(mach_header.ncmds) : mach_header.ncmds;
+    size_of_commands = swapped ? OSSwapInt32(mach_header.sizeofcmds) : mach_header.sizeofcmds;
 
-            mach_header_64_pointer = (struct mach_header_64 *)(mapped + offset);
-            number_load_commands = OSSwapInt32(mach_header_64_pointer->ncmds);
+    /* Read just the load commands. */
+    if (size_of_commands > MAX_CHUNK_SIZE ||
+        (uint64_t)offset + header_size + size_of_commands > (uint64_t)file_size) {
 
-            load_command_pointer = (struct load_command *)(void *)(mach_header_64_pointer + 1);
-        }break;
+        fprintf(stderr, "Load commands of %u bytes at offset %u overrun the file\n", size_of_commands, offset);
+        goto BAIL;
+    }
 
-        default: {
+    load_commands = malloc(size_of_commands ? size_of_commands : 1);
+    if (load_commands == NULL) {
 
-            fprintf(stderr, "Unknown magic: %d\n", mach_header_pointer->magic);
-            goto BAIL;
-        }
+        fprintf(stderr, "Could not allocate %u bytes of load commands\n", size_of_commands);
+        goto BAIL;
+    }
+
+    if (pread(fd, load_commands, size_of_commands, (off_t)offset + (off_t)header_size) != (ssize_t)size_of_commands) {
+
+        fprintf(stderr, "Could not read the load commands at offset %u: %s\n", offset, strerror(errno));
+        goto BAIL;
     }
 
     /* Walk the load commands looking for LC_UUID. */
+    command_offset = 0;
     for (i = 0; i < number_load_commands; i++) {
 
-        if (load_command_pointer->cmd == LC_UUID) {
+        if (size_of_commands - command_offset < sizeof(struct load_command)) {
+
+            fprintf(stderr, "Load command %u overruns sizeofcmds\n", i);
+            goto BAIL;
+        }
+
+        load_command_pointer = (struct load_command *)((uintptr_t)load_commands + command_offset);
+        command = swapped ? OSSwapInt32(load_command_pointer->cmd) : load_command_pointer->cmd;
+        command_size = swapped ? OSSwapInt32(load_command_pointer->cmdsize) : load_command_pointer->cmdsize;
+
+        if (command_size < sizeof(struct load_command) || command_size > size_of_commands - command_offset) {
+
+            fprintf(stderr, "Load command %u has a bad size %u\n", i, command_size);
+            goto BAIL;
+        }
+
+        if (command == LC_UUID && command_size >= sizeof(struct uuid_command)) {
 
             found_uuid_load_command = true;
             uuid_load_command_pointer = (struct uuid_command *)load_command_pointer;
             memcpy(uuid_bucket->binary_uuids[slice_index], uuid_load_command_pointer->uuid, sizeof(uuid_t));
         }
 
-        load_command_pointer = (struct load_command *)((uintptr_t)load_command_pointer + load_command_pointer->cmdsize);
+        command_offset += command_size;
     }
 
     if (found_uuid_load_command == false) {
@@ -466,5 +780,10 @@ parse_macho_slice(
 
 BAIL:
 
+    if (load_commands != NULL) {
+
+        free(load_commands);
+    }
+
     return result;
 }
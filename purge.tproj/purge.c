@@ -24,19 +24,171 @@
 
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <err.h>
+#include <fcntl.h>
+#include <fts.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <mach/mach.h>
+#include <mach/mach_time.h>
 
 extern int vfs_purge(void);
 
+static uint64_t files_purged;
+static uint64_t bytes_purged;
+static int errors;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: purge [-v] [file | directory ...]\n");
+	exit(1);
+}
+
+static bool
+vm_stats(vm_statistics64_data_t *vs)
+{
+	mach_msg_type_number_t count = HOST_VM_INFO64_COUNT;
+
+	return host_statistics64(mach_host_self(), HOST_VM_INFO64,
+	    (host_info64_t)vs, &count) == KERN_SUCCESS;
+}
+
+/*
+ * Evict one file's pages from the unified buffer cache: write back any
+ * dirty pages, then invalidate the file's cached pages through a
+ * mapping of it.
+ */
+static void
+purge_file(const char *path, off_t size)
+{
+	void *addr;
+	int fd;
+
+	if (size == 0)
+		return;
+
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		warn("%s", path);
+		errors++;
+		return;
+	}
+
+	addr = mmap(NULL, (size_t)size, PROT_READ, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		warn("mmap %s", path);
+		errors++;
+		close(fd);
+		return;
+	}
+
+	if (msync(addr, (size_t)size, MS_SYNC | MS_INVALIDATE) == -1) {
+		warn("msync %s", path);
+		errors++;
+	} else {
+		files_purged++;
+		bytes_purged += (uint64_t)size;
+	}
+
+	munmap(addr, (size_t)size);
+	close(fd);
+}
+
+static void
+purge_path(char *path)
+{
+	char *paths[] = { path, NULL };
+	FTS *fts;
+	FTSENT *ent;
+
+	if ((fts = fts_open(paths, FTS_PHYSICAL | FTS_NOCHDIR, NULL)) == NULL) {
+		warn("%s", path);
+		errors++;
+		return;
+	}
+
+	while ((ent = fts_read(fts)) != NULL) {
+		switch (ent->fts_info) {
+		case FTS_F:
+			purge_file(ent->fts_path, ent->fts_statp->st_size);
+			break;
+		case FTS_DNR:
+		case FTS_ERR:
+		case FTS_NS:
+			warnx("%s: %s", ent->fts_path, strerror(ent->fts_errno));
+			errors++;
+			break;
+		default:
+			break;
+		}
+	}
+
+	fts_close(fts);
+}
+
 int
 main(int argc, char **argv)
 {
-	int rv = vfs_purge();
+	vm_statistics64_data_t before, after;
+	mach_timebase_info_data_t tb;
+	uint64_t start, elapsed;
+	bool verbose = false, have_stats;
+	int ch, rv;
+
+	while ((ch = getopt(argc, argv, "v")) != -1) {
+		switch (ch) {
+		case 'v':
+			verbose = true;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	have_stats = verbose && vm_stats(&before);
+	start = mach_absolute_time();
+
+	if (argc == 0) {
+		rv = vfs_purge();
+
+		if (rv) {
+			perror("Unable to purge disk buffers");
+
+			return 1;
+		}
+	} else {
+		for (int i = 0; i < argc; i++)
+			purge_path(argv[i]);
+	}
+
+	elapsed = mach_absolute_time() - start;
 
-	if (rv) {
-		perror("Unable to purge disk buffers");
+	if (verbose) {
+		mach_timebase_info(&tb);
+		if (argc == 0)
+			printf("Purged the disk cache");
+		else
+			printf("Purged %llu file%s (%.1f MB)", files_purged,
+			    files_purged == 1 ? "" : "s", bytes_purged / 1048576.0);
+		printf(" in %.3f seconds\n",
+		    (double)elapsed * tb.numer / tb.denom / NSEC_PER_SEC);
 
-		return 1;
+		if (have_stats && vm_stats(&after)) {
+			printf("File-backed memory: %.1f MB -> %.1f MB\n",
+			    (double)before.external_page_count * vm_page_size / 1048576.0,
+			    (double)after.external_page_count * vm_page_size / 1048576.0);
+			printf("Free memory: %.1f MB -> %.1f MB (%+.1f MB)\n",
+			    (double)before.free_count * vm_page_size / 1048576.0,
+			    (double)after.free_count * vm_page_size / 1048576.0,
+			    ((double)after.free_count - (double)before.free_count) *
+			    vm_page_size / 1048576.0);
+		}
 	}
 
-	return 0;
+	return errors ? 1 : 0;
 }
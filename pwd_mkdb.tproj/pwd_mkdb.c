@@ -48,6 +48,9 @@ __unused static const char rcsid[] = "$OpenBSD: pwd_mkdb.c,v 1.36 2003/06/08 21:
 
 #include <sys/param.h>
 #include <sys/stat.h>
+#ifdef __APPLE__
+#include <sys/clonefile.h>
+#endif
 
 #include <db.h>
 #include <err.h>
@@ -76,6 +79,19 @@ __unused static const char rcsid[] = "$OpenBSD: pwd_mkdb.c,v 1.36 2003/06/08 21:
 
 #define	SHADOW_GROUP	"wheel"
 
+/*
+ * Private key in the secure database: PW_KEYOFFSET followed by the user
+ * name maps to a struct pw_offset for that user's line in master.passwd,
+ * so -u can go straight to it.  getpwent(3) only looks at records by
+ * number, so it never sees these.
+ */
+#define	PW_KEYOFFSET	"__OFF!"
+
+struct pw_offset {
+	u_int	cnt;				/* line number */
+	off_t	off;				/* byte offset of the line */
+};
+
 HASHINFO openinfo = {
 	.bsize = 4096,
 	.ffactor = 32,
@@ -98,7 +114,11 @@ void	mv(char *, char *);
 int	scan(FILE *, struct passwd *, int *);
 void	usage(void);
 char	*changedir(char *path, char *dir);
-void	db_store(FILE *, FILE *, DB *, DB *,struct passwd *, int, char *, uid_t);
+void	db_store(FILE *, FILE *, DB *, DB *,struct passwd *, char *, uid_t);
+int	db_store_indexed(FILE *, DB *, DB *, struct passwd *, char *, uid_t);
+void	del_olduid(DB *, DB *, struct passwd *, uid_t);
+void	store_offset(DB *, struct passwd *, u_int, off_t, int);
+void	store_record(DB *, DB *, struct passwd *, int, u_int, int);
 
 int
 main(int argc, char **argv)
@@ -200,9 +220,10 @@ main(int argc, char **argv)
 
         /* If only updating a single record, stash the old uid */
 	if (username) {
-		dp = dbopen(_PATH_MP_DB, O_RDONLY, 0, DB_HASH, NULL);
+		dp = dbopen(changedir(_PATH_MP_DB, basedir), O_RDONLY, 0,
+		    DB_HASH, NULL);
 		if (dp == NULL)
-			error(_PATH_MP_DB);
+			error(changedir(_PATH_MP_DB, basedir));
 		buf[0] = _PW_KEYBYNAME;
 		strlcpy(buf + 1, username, sizeof(buf) - 1);
 		key.data = (u_char *)buf;
@@ -293,13 +314,20 @@ main(int argc, char **argv)
 
 	/*
 	 * Write the .db files.
-	 * We do this three times, one per key type (for getpw{nam,uid,ent}).
-	 * The first time through we also check for YP, issue warnings
-	 * and save the V7 format passwd file if necessary.
+	 * This is a single pass over the file: each record is built once
+	 * and stored under all three key types (for getpw{nam,uid,ent}).
+	 * Along the way we also check for YP, issue warnings and save the
+	 * V7 format passwd file if necessary.
+	 *
+	 * When only updating one record, try reading just that user's line
+	 * at the offset saved by the last run; if it has moved, fall back
+	 * to the full pass, which saves the offsets again.
 	 */
-	db_store(fp, oldfp, edp, dp, &pwd, _PW_KEYBYNAME, username, olduid);
-	db_store(fp, oldfp, edp, dp, &pwd, _PW_KEYBYUID, username, olduid);
-	db_store(fp, oldfp, edp, dp, &pwd, _PW_KEYBYNUM, username, olduid);
+	if (username == NULL || makeold ||
+	    !db_store_indexed(fp, edp, dp, &pwd, username, olduid)) {
+		rewind(fp);
+		db_store(fp, oldfp, edp, dp, &pwd, username, olduid);
+	}
 
 	/* Store YP token, if needed. */
 	if (hasyp && !username) {
@@ -391,6 +419,14 @@ cp(char *from, char *to, mode_t mode)
 	int from_fd, to_fd;
 	ssize_t rcount, wcount;
 
+#ifdef __APPLE__
+	/* a clone costs the same however large the database is */
+	if (clonefile(from, to, 0) == 0) {
+		if (chmod(to, mode) != 0)
+			error(to);
+		return;
+	}
+#endif
 	if ((from_fd = open(from, O_RDONLY, 0)) < 0)
 		error(from);
 	if ((to_fd = open(to, O_WRONLY|O_CREAT|O_EXCL, mode)) < 0)
@@ -488,75 +524,213 @@ changedir(char *path, char *dir)
 	return (fixed);
 }
 
+/* The key types each record is stored under, in lookup order. */
+static const int keytypes[] = { _PW_KEYBYNAME, _PW_KEYBYUID, _PW_KEYBYNUM };
+
 void
 db_store(FILE *fp, FILE *oldfp, DB *edp, DB *dp, struct passwd *pw,
-	 int keytype, char *username, uid_t olduid)
+	 char *username, uid_t olduid)
 {
 	int flags = 0;
 	int dbmode, found = 0;
 	u_int cnt;
-	char *p, *t, buf[LINE_MAX * 2], tbuf[1024];
-	DBT data, key;
-	size_t len;
-	static int firsttime = 1;
+	off_t off;
 
 	/* If given a username just add that record to the existing db. */
 	dbmode = username ? 0 : R_NOOVERWRITE;
 
-	rewind(fp);
-	data.data = (u_char *)buf;
-	key.data = (u_char *)tbuf;
-	for (cnt = 1; scan(fp, pw, &flags); ++cnt) {
+	for (cnt = 1, off = ftello(fp); scan(fp, pw, &flags);
+	    ++cnt, off = ftello(fp)) {
 
 #ifdef __APPLE__
 		if (pw->pw_name == NULL)
 			continue;
 #endif
 
-		if (firsttime) {
-			/* Look like YP? */
-			if ((pw->pw_name[0] == '+') || (pw->pw_name[0] == '-'))
-				hasyp++;
-
-			/* Warn about potentially unsafe uid/gid overrides. */
-			if (pw->pw_name[0] == '+') {
-				if (!(flags & _PASSWORD_NOUID) && !pw->pw_uid)
-					warnx("line %d: superuser override in "
-					    "YP inclusion", cnt);
-				if (!(flags & _PASSWORD_NOGID) && !pw->pw_gid)
-					warnx("line %d: wheel override in "
-					    "YP inclusion", cnt);
-			}
-
-			/* Create V7 format password file entry. */
-			if (oldfp != NULL)
-				if (fprintf(oldfp, "%s:*:%u:%u:%s:%s:%s\n",
-				    pw->pw_name, pw->pw_uid, pw->pw_gid,
-				    pw->pw_gecos, pw->pw_dir, pw->pw_shell)
-				    == EOF)
-					error("write old");
+		/* Look like YP? */
+		if ((pw->pw_name[0] == '+') || (pw->pw_name[0] == '-'))
+			hasyp++;
+
+		/* Warn about potentially unsafe uid/gid overrides. */
+		if (pw->pw_name[0] == '+') {
+			if (!(flags & _PASSWORD_NOUID) && !pw->pw_uid)
+				warnx("line %d: superuser override in "
+				    "YP inclusion", cnt);
+			if (!(flags & _PASSWORD_NOGID) && !pw->pw_gid)
+				warnx("line %d: wheel override in "
+				    "YP inclusion", cnt);
 		}
 
+		/* Create V7 format password file entry. */
+		if (oldfp != NULL)
+			if (fprintf(oldfp, "%s:*:%u:%u:%s:%s:%s\n",
+			    pw->pw_name, pw->pw_uid, pw->pw_gid,
+			    pw->pw_gecos, pw->pw_dir, pw->pw_shell)
+			    == EOF)
+				error("write old");
+
+		store_offset(edp, pw, cnt, off, dbmode);
+
 		/* Are we updating a specific record? */
 		if (username) {
 			if (strcmp(username, pw->pw_name) != 0)
 				continue;
 			found = 1;
-			/* If the uid changed, remove the old record by uid. */
-			if (olduid != UID_MAX && olduid != pw->pw_uid) {
-				tbuf[0] = _PW_KEYBYUID;
-				memcpy(tbuf + 1, &olduid, sizeof(olduid));
-				key.size = sizeof(olduid) + 1;
-				(edp->del)(edp, &key, 0);
-				if (dp)
-					(dp->del)(dp, &key, 0);
-			}
+			del_olduid(edp, dp, pw, olduid);
 			/* XXX - should check to see if line number changed. */
 		}
 
+		store_record(edp, dp, pw, flags, cnt, dbmode);
+	}
+	if (username && !found && olduid != UID_MAX)
+		errorx("can't find user in master.passwd");
+}
+
+/*
+ * Update the record for username alone, reading only its line.  Returns
+ * 0 if the saved offset is missing or no longer points at that user.
+ */
+int
+db_store_indexed(FILE *fp, DB *edp, DB *dp, struct passwd *pw,
+	 char *username, uid_t olduid)
+{
+	static char line[LINE_MAX];
+	struct pw_offset po;
+	DBT data, key;
+	char tbuf[1024], *p;
+	int flags;
+	size_t len;
+
+	len = strlen(PW_KEYOFFSET);
+	memcpy(tbuf, PW_KEYOFFSET, len);
+	strlcpy(tbuf + len, username, sizeof(tbuf) - len);
+	key.data = (u_char *)tbuf;
+	key.size = len + strlen(username);
+	if ((edp->get)(edp, &key, &data, 0) != 0 || data.size != sizeof(po))
+		return (0);
+	memcpy(&po, data.data, sizeof(po));
+
+	/* The offset must still be the start of a line... */
+	if (po.off > 0) {
+		char c;
+
+		if (pread(fileno(fp), &c, 1, po.off - 1) != 1 || c != '\n')
+			return (0);
+	}
+	if (fseeko(fp, po.off, SEEK_SET) == -1 ||
+	    fgets(line, sizeof(line), fp) == NULL)
+		return (0);
+	if ((p = strchr(line, '\n')) == NULL)
+		return (0);
+	*p = '\0';
+
+	/* ...and of this user's line; the full pass reports bad entries. */
+	if (!pw_scan(line, pw, &flags) || pw->pw_name == NULL ||
+	    strcmp(username, pw->pw_name) != 0)
+		return (0);
+
+	del_olduid(edp, dp, pw, olduid);
+	store_record(edp, dp, pw, flags, po.cnt, 0);
+	return (1);
+}
+
+/* If the uid changed, remove the old record by uid. */
+void
+del_olduid(DB *edp, DB *dp, struct passwd *pw, uid_t olduid)
+{
+	char tbuf[1 + sizeof(olduid)];
+	DBT key;
+
+	if (olduid == UID_MAX || olduid == pw->pw_uid)
+		return;
+	tbuf[0] = _PW_KEYBYUID;
+	memcpy(tbuf + 1, &olduid, sizeof(olduid));
+	key.data = (u_char *)tbuf;
+	key.size = sizeof(olduid) + 1;
+	(edp->del)(edp, &key, 0);
+	if (dp)
+		(dp->del)(dp, &key, 0);
+}
+
+/* Save where the user's line is, for the next -u. */
+void
+store_offset(DB *edp, struct passwd *pw, u_int cnt, off_t off, int dbmode)
+{
+	struct pw_offset po;
+	char tbuf[1024];
+	DBT data, key;
+	size_t len;
+
+	if (off == -1)
+		return;
+	len = strlen(PW_KEYOFFSET);
+	memcpy(tbuf, PW_KEYOFFSET, len);
+	strlcpy(tbuf + len, pw->pw_name, sizeof(tbuf) - len);
+	key.data = (u_char *)tbuf;
+	key.size = len + strlen(tbuf + len);
+	po.cnt = cnt;
+	po.off = off;
+	data.data = (u_char *)&po;
+	data.size = sizeof(po);
+	if ((edp->put)(edp, &key, &data, dbmode) == -1)
+		error("put");
+}
+
+/*
+ * Store the secure record, and the insecure one if dp is set, under
+ * each key type.
+ */
+void
+store_record(DB *edp, DB *dp, struct passwd *pw, int flags, u_int cnt,
+	 int dbmode)
+{
+	u_int i;
+	char *p, *t, buf[LINE_MAX * 2], ibuf[LINE_MAX * 2], tbuf[1024];
+	DBT data, idata, key;
+	size_t len;
+
+	data.data = (u_char *)buf;
+	idata.data = (u_char *)ibuf;
+	key.data = (u_char *)tbuf;
+
+#define	COMPACT(e)	t = e; while ((*p++ = *t++));
+	/* Create the secure record. */
+	p = buf;
+	COMPACT(pw->pw_name);
+	COMPACT(pw->pw_passwd);
+	memmove(p, &pw->pw_uid, sizeof(uid_t));
+	p += sizeof(uid_t);
+	memmove(p, &pw->pw_gid, sizeof(gid_t));
+	p += sizeof(gid_t);
+	memmove(p, &pw->pw_change, sizeof(time_t));
+	p += sizeof(time_t);
+	COMPACT(pw->pw_class);
+	COMPACT(pw->pw_gecos);
+	COMPACT(pw->pw_dir);
+	COMPACT(pw->pw_shell);
+	memmove(p, &pw->pw_expire, sizeof(time_t));
+	p += sizeof(time_t);
+	memmove(p, &flags, sizeof(int));
+	p += sizeof(int);
+	data.size = p - buf;
+
+	/* Star out password to make insecure record. */
+	if (dp != NULL) {
+		len = strlen(pw->pw_name) + 1;	/* keep pw_name */
+		memcpy(ibuf, buf, len);
+		p = ibuf + len;
+		t = buf + len + strlen(pw->pw_passwd) + 1;
+		if (*pw->pw_passwd != '\0')
+			*p++ = '*';
+		*p++ = '\0';
+		memcpy(p, t, data.size - (t - buf));
+		idata.size = (p - ibuf) + data.size - (t - buf);
+	}
+
+	for (i = 0; i < sizeof(keytypes) / sizeof(keytypes[0]); i++) {
 		/* Build the key. */
-		tbuf[0] = keytype;
-		switch (keytype) {
+		tbuf[0] = keytypes[i];
+		switch (keytypes[i]) {
 		case _PW_KEYBYNUM:
 			memmove(tbuf + 1, &cnt, sizeof(cnt));
 			key.size = sizeof(cnt) + 1;
@@ -574,52 +748,12 @@ db_store(FILE *fp, FILE *oldfp, DB *edp, DB *dp, struct passwd *pw,
 			break;
 		}
 
-#define	COMPACT(e)	t = e; while ((*p++ = *t++));
-		/* Create the secure record. */
-		p = buf;
-		COMPACT(pw->pw_name);
-		COMPACT(pw->pw_passwd);
-		memmove(p, &pw->pw_uid, sizeof(uid_t));
-		p += sizeof(uid_t);
-		memmove(p, &pw->pw_gid, sizeof(gid_t));
-		p += sizeof(gid_t);
-		memmove(p, &pw->pw_change, sizeof(time_t));
-		p += sizeof(time_t);
-		COMPACT(pw->pw_class);
-		COMPACT(pw->pw_gecos);
-		COMPACT(pw->pw_dir);
-		COMPACT(pw->pw_shell);
-		memmove(p, &pw->pw_expire, sizeof(time_t));
-		p += sizeof(time_t);
-		memmove(p, &flags, sizeof(int));
-		p += sizeof(int);
-		data.size = p - buf;
-
 		/* Write the secure record. */
 		if ((edp->put)(edp, &key, &data, dbmode) == -1)
 			error("put");
 
-		if (dp == NULL)
-			continue;
-
-		/* Star out password to make insecure record. */
-		p = buf + strlen(pw->pw_name) + 1;	/* skip pw_name */
-		len = strlen(pw->pw_passwd);
-		memset(p, 0, len);			/* zero pw_passwd */
-		t = p + len + 1;			/* skip pw_passwd */
-		if (len != 0)
-			*p++ = '*';
-		*p++ = '\0';
-		memmove(p, t, data.size - (t - buf));
-		data.size -= len - 1;
-
 		/* Write the insecure record. */
-		if ((dp->put)(dp, &key, &data, dbmode) == -1)
+		if (dp != NULL && (dp->put)(dp, &key, &idata, dbmode) == -1)
 			error("put");
 	}
-	if (firsttime) {
-		firsttime = 0;
-		if (username && !found && olduid != UID_MAX)
-			errorx("can't find user in master.passwd");
-	}
 }
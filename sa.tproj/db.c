@@ -36,6 +36,7 @@ __FBSDID("$FreeBSD: src/usr.sbin/sa/db.c,v 1.3 2008/02/21 07:12:56 grog Exp $");
 #include <errno.h>
 #include <db.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -209,3 +210,110 @@ db_destroy(DB *db, const char *uname)
 	if (DB_CLOSE(db) < 0)
 		warn("destroying %s stats", uname);
 }
+
+#define	CI_TABLE_MIN	256	/* initial ci_table slots */
+
+static size_t
+ci_table_hash(const struct ci_table *ct, const struct cmdinfo *ci)
+{
+	const unsigned char *p;
+	uint64_t h;
+
+	if (ct->ct_byuid)
+		return ((size_t)((uint64_t)ci->ci_uid * 0x9e3779b97f4a7c15ULL >> 32));
+
+	/* FNV-1a */
+	h = 0xcbf29ce484222325ULL;
+	for (p = (const unsigned char *)ci->ci_comm; *p != '\0'; p++)
+		h = (h ^ *p) * 0x100000001b3ULL;
+	return ((size_t)h);
+}
+
+static int
+ci_table_match(const struct ci_table *ct, const struct cmdinfo *a,
+    const struct cmdinfo *b)
+{
+	if (ct->ct_byuid)
+		return (a->ci_uid == b->ci_uid);
+	return (strcmp(a->ci_comm, b->ci_comm) == 0);
+}
+
+static struct cmdinfo *
+ci_table_slot(struct ci_table *ct, const struct cmdinfo *ci)
+{
+	size_t i, mask = ct->ct_size - 1;
+
+	for (i = ci_table_hash(ct, ci) & mask;; i = (i + 1) & mask)
+		if (ct->ct_entries[i].ci_calls == 0 ||
+		    ci_table_match(ct, &ct->ct_entries[i], ci))
+			return (&ct->ct_entries[i]);
+}
+
+/*
+ * Set up an empty table.
+ * Return 0 if OK, -1 on error.
+ */
+int
+ci_table_init(struct ci_table *ct, int byuid)
+{
+	ct->ct_size = CI_TABLE_MIN;
+	ct->ct_count = 0;
+	ct->ct_byuid = byuid;
+	if ((ct->ct_entries = calloc(ct->ct_size, sizeof(struct cmdinfo))) == NULL) {
+		warn("allocating accounting table");
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Add ci's counters to the entry for its key, creating it if needed.
+ * Return 0 if OK, -1 on error.
+ */
+int
+ci_table_add(struct ci_table *ct, const struct cmdinfo *ci)
+{
+	struct cmdinfo *old, *slot;
+	size_t i, osize;
+
+	if (ci->ci_calls == 0)
+		return (0);
+
+	/* keep the load factor at or below one half */
+	if ((ct->ct_count + 1) * 2 > ct->ct_size) {
+		old = ct->ct_entries;
+		osize = ct->ct_size;
+		if ((ct->ct_entries = calloc(osize * 2, sizeof(struct cmdinfo))) == NULL) {
+			warn("growing accounting table");
+			ct->ct_entries = old;
+			return (-1);
+		}
+		ct->ct_size = osize * 2;
+		for (i = 0; i < osize; i++)
+			if (old[i].ci_calls != 0)
+				*ci_table_slot(ct, &old[i]) = old[i];
+		free(old);
+	}
+
+	slot = ci_table_slot(ct, ci);
+	if (slot->ci_calls == 0) {
+		*slot = *ci;
+		ct->ct_count++;
+		return (0);
+	}
+	slot->ci_calls += ci->ci_calls;
+	slot->ci_etime += ci->ci_etime;
+	slot->ci_utime += ci->ci_utime;
+	slot->ci_stime += ci->ci_stime;
+	slot->ci_mem += ci->ci_mem;
+	slot->ci_io += ci->ci_io;
+	return (0);
+}
+
+void
+ci_table_free(struct ci_table *ct)
+{
+	free(ct->ct_entries);
+	ct->ct_entries = NULL;
+	ct->ct_size = ct->ct_count = 0;
+}
@@ -75,6 +75,18 @@ struct userinfo {
 #endif
 };
 
+/*
+ * In-memory aggregation of cmdinfo records, keyed by command name or,
+ * with ct_byuid, by user id. Records are summed here while an accounting
+ * file is scanned and merged into the btree databases afterwards.
+ */
+struct ci_table {
+	struct cmdinfo	*ct_entries;	/* open addressing; ci_calls 0 is free */
+	size_t		 ct_size;	/* slots, a power of two */
+	size_t		 ct_count;	/* slots in use */
+	int		 ct_byuid;
+};
+
 /* typedefs */
 
 typedef	int (*cmpf_t)(const DBT *, const DBT *);
@@ -85,6 +97,9 @@ int db_copy_in(DB **mdb, const char *dbname, const char *name,
 int db_copy_out(DB *mdb, const char *dbname, const char *name,
     BTREEINFO *bti);
 void db_destroy(DB *db, const char *uname);
+int	ci_table_init(struct ci_table *, int byuid);
+int	ci_table_add(struct ci_table *, const struct cmdinfo *);
+void	ci_table_free(struct ci_table *);
 
 /* external functions in pdb.c */
 int	pacct_init(void);
@@ -92,6 +107,7 @@ void	pacct_destroy(void);
 int	pacct_add(const struct cmdinfo *);
 int	pacct_update(void);
 void	pacct_print(void);
+void	print_json_string(const char *);
 
 #ifndef __APPLE__
 /* external functions in readrec.c */
@@ -109,7 +125,8 @@ void	usracct_print(void);
 
 extern int	aflag, bflag, cflag, dflag, Dflag, fflag, iflag, jflag, kflag;
 extern int	Kflag, lflag, mflag, qflag, rflag, sflag, tflag, uflag, vflag;
-extern u_quad_t	cutoff;
+extern int	Vflag, Jflag;
+extern u_quad_t	cutoff, print_limit;
 extern cmpf_t	sa_cmp;
 extern const char *pdb_file, *usrdb_file;
 
@@ -44,23 +44,39 @@ __FBSDID("$FreeBSD: src/usr.sbin/sa/main.c,v 1.18 2007/05/22 06:51:38 dds Exp $"
 
 #include <sys/types.h>
 #include <sys/acct.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __APPLE__
+#include <compression.h>
+#endif
 #include <ctype.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include "extern.h"
 #include "pathnames.h"
 
 static FILE	*acct_load(const char *, int);
 #ifdef __APPLE__
+static size_t	 acct_load_archive(int, const char *);
+#endif
+#ifdef __APPLE__
+static void	 acct_decode(const struct acct *, struct cmdinfo *);
+static size_t	 acct_scan(const struct acct *, size_t);
+static void	*acct_scan_range(void *);
 static u_quad_t	decode_comp_t(comp_t);
+#else
+static void	 acct_decode(const struct acctv2 *, struct cmdinfo *);
 #endif
+static void	 acct_record(const struct cmdinfo *);
 static int	 cmp_comm(const char *, const char *);
 static int	 cmp_usrsys(const DBT *, const DBT *);
 static int	 cmp_avgusrsys(const DBT *, const DBT *);
@@ -73,10 +89,15 @@ static void	 usage(void);
 
 int aflag, bflag, cflag, dflag, Dflag, fflag, iflag, jflag, kflag;
 int Kflag, lflag, mflag, qflag, rflag, sflag, tflag, uflag, vflag;
+int Vflag, Jflag;
+int nthreads;
 u_quad_t cutoff = 1;
+u_quad_t print_limit;		/* -N: commands to print, 0 for all */
 const char *pdb_file = _PATH_SAVACCT;
 const char *usrdb_file = _PATH_USRACCT;
 
+#define	ACCT_MAX_THREADS	32	/* cap for -T and the default */
+
 static char	*dfltargv[] = { NULL };
 static int	dfltargc = (sizeof dfltargv/sizeof(char *));
 
@@ -92,7 +113,7 @@ main(int argc, char **argv)
 
 	dfltargv[0] = pathacct;
 
-	while ((ch = getopt(argc, argv, "abcdDfijkKlmnP:qrstuU:v:")) != -1)
+	while ((ch = getopt(argc, argv, "abcdDfijJkKlmnN:P:qrstT:uU:v:V")) != -1)
 		switch (ch) {
 			case 'a':
 				/* print all commands */
@@ -129,6 +150,10 @@ main(int argc, char **argv)
 				/* instead of total minutes, give sec/call */
 				jflag = 1;
 				break;
+			case 'J':
+				/* print the report as JSON */
+				Jflag = 1;
+				break;
 			case 'k':
 				/* sort by cpu-time average memory usage */
 				kflag = 1;
@@ -151,6 +176,12 @@ main(int argc, char **argv)
 				/* sort by number of calls */
 				sa_cmp = cmp_calls;
 				break;
+			case 'N':
+				/* print only the first so many commands */
+				print_limit = strtoull(optarg, NULL, 10);
+				if (print_limit == 0)
+					errx(1, "-N requires a positive count");
+				break;
 			case 'P':
 				/* specify program database summary file */
 				pdb_file = optarg;
@@ -171,6 +202,12 @@ main(int argc, char **argv)
 				/* report ratio of user and system times */
 				tflag = 1;
 				break;
+			case 'T':
+				/* number of threads scanning each file */
+				nthreads = atoi(optarg);
+				if (nthreads < 1)
+					errx(1, "-T requires a positive thread count");
+				break;
 			case 'u':
 				/* first, print uid and command name */
 				uflag = 1;
@@ -184,6 +221,10 @@ main(int argc, char **argv)
 				vflag = 1;
 				cutoff = atoi(optarg);
 				break;
+			case 'V':
+				/* report accounting file read rates */
+				Vflag = 1;
+				break;
 			case '?':
 	                default:
 				usage();
@@ -192,6 +233,14 @@ main(int argc, char **argv)
 	argc -= optind;
 	argv += optind;
 
+	if (nthreads == 0) {
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+		nthreads = ncpu < 1 ? 1 : ncpu > ACCT_MAX_THREADS ?
+		    ACCT_MAX_THREADS : (int)ncpu;
+	} else if (nthreads > ACCT_MAX_THREADS)
+		nthreads = ACCT_MAX_THREADS;
+
 	/* various argument checking */
 	if (fflag && !vflag)
 		errx(1, "only one of -f requires -v");
@@ -306,22 +355,56 @@ static void
 usage(void)
 {
 	(void)fprintf(stderr,
-		"usage: sa [-abcdDfijkKlmnqrstu] [-P file] [-U file] [-v cutoff] [file ...]\n");
+		"usage: sa [-abcdDfijJkKlmnqrstuV] [-N count] [-P file] [-T threads] [-U file]\n"
+		"          [-v cutoff] [file ...]\n");
 	exit(1);
 }
 
+/* records per read() for whatever is not covered by the mapping */
+#define	ACCT_READ_RECORDS	8192
+
+/*
+ * Large mapped files are cut into one range per thread. Each thread sums
+ * its range into private tables, which are merged with pacct_add() and
+ * usracct_add() after the join; -u output stays serial to keep its order.
+ */
+#define	ACCT_PARALLEL_MIN	65536	/* records before threads are used */
+
+/*
+ * Compressed archive written by accton -r (keep in sync with
+ * accton.tproj/accton.c): ACZ_MAGIC, then blocks of two host-order
+ * uint32_t, the raw and stored sizes, followed by the stored bytes.
+ * A block is LZFSE unless both sizes are equal.
+ */
+#define	ACZ_MAGIC	"ACZ1"
+#define	ACZ_BLOCK_SIZE	(1024 * 1024)
+
+struct acct_range {
+	const struct acct *ar_recs;
+	size_t		 ar_nrecs;
+	int		 ar_pacct, ar_usracct;	/* which tables to fill */
+	struct ci_table	 ar_cmds;
+	struct ci_table	 ar_users;
+	int		 ar_error;
+};
+
 static FILE *
 acct_load(const char *pn, int wr)
 {
 #ifdef __APPLE__
-	struct acct ac;
+	struct acct *buf;
+	struct stat sb;
+	struct timespec start, end;
+	size_t nrecs = 0, mapped = 0, have = 0;
+	void *map;
+	char magic[sizeof(ACZ_MAGIC) - 1];
+	int fd;
 #else
 	struct acctv2 ac;
-#endif
 	struct cmdinfo ci;
+#endif
 	ssize_t rv;
 	FILE *f;
-	int i;
 
 	/*
 	 * open the file
@@ -332,87 +415,308 @@ acct_load(const char *pn, int wr)
 		return (NULL);
 	}
 
+#ifdef __APPLE__
+	fd = fileno(f);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+	    memcmp(magic, ACZ_MAGIC, sizeof(magic)) == 0) {
+		nrecs = acct_load_archive(fd, pn);
+		goto done;
+	}
+
 	/*
-	 * read all we can; don't stat and open because more processes
-	 * could exit, and we'd miss them
+	 * map the complete records already in the file and decode them
+	 * straight from the mapping
+	 */
+	if (fstat(fd, &sb) == 0 && sb.st_size >= (off_t)sizeof(struct acct)) {
+		mapped = (size_t)sb.st_size - (size_t)sb.st_size % sizeof(struct acct);
+		map = mmap(NULL, mapped, PROT_READ, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED) {
+			mapped = 0;
+		} else {
+			(void)madvise(map, mapped, MADV_SEQUENTIAL);
+			nrecs += acct_scan(map, mapped / sizeof(struct acct));
+			(void)munmap(map, mapped);
+			if (lseek(fd, (off_t)mapped, SEEK_SET) == -1) {
+				warn("seek %s", pn);
+				return (f);
+			}
+		}
+	}
+
+	/*
+	 * read all we can past the mapping in large blocks; don't trust
+	 * the size from fstat because more processes could exit, and
+	 * we'd miss them
 	 */
+	if ((buf = malloc(ACCT_READ_RECORDS * sizeof(struct acct))) == NULL) {
+		warn("reading %s", pn);
+		return (f);
+	}
 	while (1) {
-		/* get one accounting entry and punt if there's an error */
-#ifdef __APPLE__
-		rv = read(fileno(f), &ac, sizeof(struct acct));
+		rv = read(fd, (char *)buf + have,
+		    ACCT_READ_RECORDS * sizeof(struct acct) - have);
 		if (rv == -1)
 			warn("error reading %s", pn);
-		else if (rv > 0 && rv < (int)sizeof(struct acct))
-			warnx("short read of accounting data in %s", pn);
-		if (rv != sizeof(struct acct))
+		if (rv <= 0) {
+			if (have > 0)
+				warnx("short read of accounting data in %s", pn);
 			break;
+		}
+		have += rv;
+		nrecs += acct_scan(buf, have / sizeof(struct acct));
+
+		/* keep a trailing partial record for the next read */
+		memmove(buf, (char *)buf + have - have % sizeof(struct acct),
+		    have % sizeof(struct acct));
+		have %= sizeof(struct acct);
+	}
+	free(buf);
+
+done:
+	if (Vflag) {
+		double secs;
+
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		secs = (end.tv_sec - start.tv_sec) +
+		    (end.tv_nsec - start.tv_nsec) / 1e9;
+		fprintf(stderr, "%s: %zu records (%zu mapped) in %.3f seconds, "
+		    "%.0f records/sec\n", pn, nrecs, mapped / sizeof(struct acct),
+		    secs, secs > 0 ? nrecs / secs : 0.0);
+	}
 #else
+	/*
+	 * read all we can; don't stat and open because more processes
+	 * could exit, and we'd miss them
+	 */
+	while (1) {
+		/* get one accounting entry and punt if there's an error */
 		rv = readrec_forward(f, &ac);
 		if (rv != 1) {
 			if (rv == EOF)
 				warn("error reading %s", pn);
 			break;
 		}
+		acct_decode(&ac, &ci);
+		acct_record(&ci);
+	}
 #endif
 
-		/* decode it */
-		ci.ci_calls = 1;
-		for (i = 0; i < (int)sizeof ac.ac_comm && ac.ac_comm[i] != '\0';
-		    i++) {
-			char c = ac.ac_comm[i];
-
-			if (!isascii(c) || iscntrl(c)) {
-				ci.ci_comm[i] = '?';
-				ci.ci_flags |= CI_UNPRINTABLE;
-			} else
-				ci.ci_comm[i] = c;
-		}
+	/* Finally, return the file stream for possible truncation. */
+	return (f);
+}
+
 #ifdef __APPLE__
-		if (ac.ac_flag & AFORK)
-			ci.ci_comm[i++] = '*';
-		ci.ci_comm[i++] = '\0';
-		ci.ci_etime = decode_comp_t(ac.ac_etime);
-		ci.ci_utime = decode_comp_t(ac.ac_utime);
-		ci.ci_stime = decode_comp_t(ac.ac_stime);
-		ci.ci_uid = ac.ac_uid;
-		ci.ci_mem = ac.ac_mem;
-		ci.ci_io = decode_comp_t(ac.ac_io) / AHZ;
+/*
+ * Decompress an accton -r archive block by block and scan the records;
+ * a record may straddle two blocks. Returns the number of records.
+ */
+static size_t
+acct_load_archive(int fd, const char *pn)
+{
+	uint8_t *packed, *raw;
+	uint32_t sizes[2];
+	size_t nrecs = 0, have = 0, len;
+	off_t off = sizeof(ACZ_MAGIC) - 1;
+	ssize_t rv;
+
+	packed = malloc(ACZ_BLOCK_SIZE);
+	raw = malloc(ACZ_BLOCK_SIZE + sizeof(struct acct));
+	if (packed == NULL || raw == NULL) {
+		warn("reading %s", pn);
+		goto out;
+	}
+	while ((rv = pread(fd, sizes, sizeof(sizes), off)) != 0) {
+		if (rv != sizeof(sizes) || sizes[0] > ACZ_BLOCK_SIZE ||
+		    sizes[1] > sizes[0] || sizes[0] == 0) {
+			if (rv == -1)
+				warn("error reading %s", pn);
+			else
+				warnx("corrupt archive header in %s", pn);
+			break;
+		}
+		off += sizeof(sizes);
+		if (pread(fd, packed, sizes[1], off) != (ssize_t)sizes[1]) {
+			warnx("short read of archive data in %s", pn);
+			break;
+		}
+		off += sizes[1];
+
+		/* append after the partial record left by the last block */
+		if (sizes[1] == sizes[0]) {
+			memcpy(raw + have, packed, sizes[0]);
+			len = sizes[0];
+		} else
+			len = compression_decode_buffer(raw + have, sizes[0],
+			    packed, sizes[1], NULL, COMPRESSION_LZFSE);
+		if (len != sizes[0]) {
+			warnx("corrupt archive block in %s", pn);
+			break;
+		}
+		have += len;
+		nrecs += acct_scan((struct acct *)raw, have / sizeof(struct acct));
+		memmove(raw, raw + have - have % sizeof(struct acct),
+		    have % sizeof(struct acct));
+		have %= sizeof(struct acct);
+	}
+	if (have > 0)
+		warnx("short read of accounting data in %s", pn);
+out:
+	free(packed);
+	free(raw);
+	return (nrecs);
+}
+
+/* Decode and record nrecs consecutive records; returns nrecs. */
+static size_t
+acct_scan(const struct acct *recs, size_t nrecs)
+{
+	struct acct_range ranges[ACCT_MAX_THREADS];
+	pthread_t threads[ACCT_MAX_THREADS];
+	int started[ACCT_MAX_THREADS];
+	struct cmdinfo ci;
+	size_t n, i, per;
+	int t, nt;
+
+	if (uflag || nthreads < 2 || nrecs < ACCT_PARALLEL_MIN) {
+		for (n = 0; n < nrecs; n++) {
+			acct_decode(&recs[n], &ci);
+			acct_record(&ci);
+		}
+		return (nrecs);
+	}
+
+	nt = nthreads;
+	per = (nrecs + nt - 1) / nt;
+	for (t = 0; t < nt; t++) {
+		ranges[t].ar_recs = recs + t * per;
+		ranges[t].ar_nrecs = (t == nt - 1) ? nrecs - t * per : per;
+		ranges[t].ar_pacct = sflag || (!mflag && !qflag);
+		ranges[t].ar_usracct = sflag || (mflag && !qflag);
+		ranges[t].ar_error = 0;
+		if (ci_table_init(&ranges[t].ar_cmds, 0) != 0)
+			ranges[t].ar_error = 1;
+		else if (ci_table_init(&ranges[t].ar_users, 1) != 0) {
+			ci_table_free(&ranges[t].ar_cmds);
+			ranges[t].ar_error = 1;
+		}
+	}
+	for (t = 0; t < nt; t++) {
+		/* a range that can't get a thread or tables is done inline */
+		started[t] = !ranges[t].ar_error &&
+		    pthread_create(&threads[t], NULL, acct_scan_range,
+		    &ranges[t]) == 0;
+	}
+	for (t = 0; t < nt; t++) {
+		if (started[t])
+			pthread_join(threads[t], NULL);
+		else if (!ranges[t].ar_error)
+			acct_scan_range(&ranges[t]);
+		if (ranges[t].ar_error) {
+			for (n = 0; n < ranges[t].ar_nrecs; n++) {
+				acct_decode(&ranges[t].ar_recs[n], &ci);
+				acct_record(&ci);
+			}
+			continue;
+		}
+		for (i = 0; i < ranges[t].ar_cmds.ct_size; i++)
+			if (ranges[t].ar_cmds.ct_entries[i].ci_calls != 0)
+				pacct_add(&ranges[t].ar_cmds.ct_entries[i]);
+		for (i = 0; i < ranges[t].ar_users.ct_size; i++)
+			if (ranges[t].ar_users.ct_entries[i].ci_calls != 0)
+				usracct_add(&ranges[t].ar_users.ct_entries[i]);
+		ci_table_free(&ranges[t].ar_cmds);
+		ci_table_free(&ranges[t].ar_users);
+	}
+	return (nrecs);
+}
+
+static void *
+acct_scan_range(void *arg)
+{
+	struct acct_range *ar = arg;
+	struct cmdinfo ci;
+	size_t n;
+
+	for (n = 0; n < ar->ar_nrecs; n++) {
+		acct_decode(&ar->ar_recs[n], &ci);
+		if (ar->ar_pacct)
+			(void)ci_table_add(&ar->ar_cmds, &ci);
+		if (ar->ar_usracct)
+			(void)ci_table_add(&ar->ar_users, &ci);
+	}
+	return (NULL);
+}
+
+static void
+acct_decode(const struct acct *acp, struct cmdinfo *cip)
 #else
-		if (ac.ac_flagx & AFORK)
-			ci.ci_comm[i++] = '*';
-		ci.ci_comm[i++] = '\0';
-		ci.ci_etime = ac.ac_etime;
-		ci.ci_utime = ac.ac_utime;
-		ci.ci_stime = ac.ac_stime;
-		ci.ci_uid = ac.ac_uid;
-		ci.ci_mem = ac.ac_mem;
-		ci.ci_io = ac.ac_io;
+static void
+acct_decode(const struct acctv2 *acp, struct cmdinfo *cip)
 #endif
+{
+	int i;
 
-		if (!uflag) {
-			/* and enter it into the usracct and pacct databases */
-			if (sflag || (!mflag && !qflag))
-				pacct_add(&ci);
-			if (sflag || (mflag && !qflag))
-				usracct_add(&ci);
-		} else if (!qflag)
+	cip->ci_calls = 1;
+	cip->ci_flags = 0;
+	for (i = 0; i < (int)sizeof acp->ac_comm && acp->ac_comm[i] != '\0';
+	    i++) {
+		char c = acp->ac_comm[i];
+
+		if (!isascii(c) || iscntrl(c)) {
+			cip->ci_comm[i] = '?';
+			cip->ci_flags |= CI_UNPRINTABLE;
+		} else
+			cip->ci_comm[i] = c;
+	}
 #ifdef __APPLE__
-			printf("%6u %12.2f cpu %12juk mem %12ju io %s\n",
-			    ci.ci_uid,
-			    (ci.ci_utime + ci.ci_stime) / (double) AHZ,
-			    (uintmax_t)ci.ci_mem, (uintmax_t)ci.ci_io,
-			    ci.ci_comm);
+	if (acp->ac_flag & AFORK)
+		cip->ci_comm[i++] = '*';
+	cip->ci_comm[i++] = '\0';
+	cip->ci_etime = decode_comp_t(acp->ac_etime);
+	cip->ci_utime = decode_comp_t(acp->ac_utime);
+	cip->ci_stime = decode_comp_t(acp->ac_stime);
+	cip->ci_uid = acp->ac_uid;
+	cip->ci_mem = acp->ac_mem;
+	cip->ci_io = decode_comp_t(acp->ac_io) / AHZ;
 #else
-			printf("%6u %12.3lf cpu %12.0lfk mem %12.0lf io %s\n",
-			    ci.ci_uid,
-			    (ci.ci_utime + ci.ci_stime) / 1000000,
-			    ci.ci_mem, ci.ci_io,
-			    ci.ci_comm);
+	if (acp->ac_flagx & AFORK)
+		cip->ci_comm[i++] = '*';
+	cip->ci_comm[i++] = '\0';
+	cip->ci_etime = acp->ac_etime;
+	cip->ci_utime = acp->ac_utime;
+	cip->ci_stime = acp->ac_stime;
+	cip->ci_uid = acp->ac_uid;
+	cip->ci_mem = acp->ac_mem;
+	cip->ci_io = acp->ac_io;
 #endif
-	}
+}
 
-	/* Finally, return the file stream for possible truncation. */
-	return (f);
+/* Enter one decoded record into the databases, or print it for -u. */
+static void
+acct_record(const struct cmdinfo *cip)
+{
+	if (!uflag) {
+		/* and enter it into the usracct and pacct databases */
+		if (sflag || (!mflag && !qflag))
+			pacct_add(cip);
+		if (sflag || (mflag && !qflag))
+			usracct_add(cip);
+	} else if (!qflag)
+#ifdef __APPLE__
+		printf("%6u %12.2f cpu %12juk mem %12ju io %s\n",
+		    cip->ci_uid,
+		    (cip->ci_utime + cip->ci_stime) / (double) AHZ,
+		    (uintmax_t)cip->ci_mem, (uintmax_t)cip->ci_io,
+		    cip->ci_comm);
+#else
+		printf("%6u %12.3lf cpu %12.0lfk mem %12.0lf io %s\n",
+		    cip->ci_uid,
+		    (cip->ci_utime + cip->ci_stime) / 1000000,
+		    cip->ci_mem, cip->ci_io,
+		    cip->ci_comm);
+#endif
 }
 
 #ifdef __APPLE__
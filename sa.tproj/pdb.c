@@ -39,6 +39,7 @@ __FBSDID("$FreeBSD: src/usr.sbin/sa/pdb.c,v 1.14 2007/05/22 06:51:38 dds Exp $")
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "extern.h"
 #include "pathnames.h"
@@ -46,8 +47,16 @@ __FBSDID("$FreeBSD: src/usr.sbin/sa/pdb.c,v 1.14 2007/05/22 06:51:38 dds Exp $")
 static int check_junk(const struct cmdinfo *);
 static void add_ci(const struct cmdinfo *, struct cmdinfo *);
 static void print_ci(const struct cmdinfo *, const struct cmdinfo *);
+static void print_ci_json(const struct cmdinfo *, const struct cmdinfo *);
+static void print_entry(const struct cmdinfo *, const struct cmdinfo *, int *);
+static int rank_ci(const struct cmdinfo *, const struct cmdinfo *);
+static int rank_ci_qsort(const void *, const void *);
+static void heap_offer(struct cmdinfo *, u_quad_t *, const struct cmdinfo *);
+static int pacct_db_add(const struct cmdinfo *);
+static int pacct_merge(void);
 
 static DB	*pacct_db;
+static struct ci_table pacct_table;	/* records not yet in pacct_db */
 
 /* Legacy format in AHZV1 units. */
 struct cmdinfov1 {
@@ -96,6 +105,8 @@ v1_to_v2(DBT *key __unused, DBT *data)
 int
 pacct_init(void)
 {
+	if (ci_table_init(&pacct_table, 0) != 0)
+		return (-1);
 	return (db_copy_in(&pacct_db, pdb_file, "process accounting",
 	    NULL, v1_to_v2));
 }
@@ -103,11 +114,36 @@ pacct_init(void)
 void
 pacct_destroy(void)
 {
+	ci_table_free(&pacct_table);
 	db_destroy(pacct_db, "process accounting");
 }
 
+/* Sum a record into the in-memory table; pacct_merge() folds it into the db. */
 int
 pacct_add(const struct cmdinfo *ci)
+{
+	return (ci_table_add(&pacct_table, ci));
+}
+
+/* Fold everything summed by pacct_add() into pacct_db and empty the table. */
+static int
+pacct_merge(void)
+{
+	size_t i;
+	int error = 0;
+
+	for (i = 0; i < pacct_table.ct_size; i++)
+		if (pacct_table.ct_entries[i].ci_calls != 0 &&
+		    pacct_db_add(&pacct_table.ct_entries[i]) != 0)
+			error = -1;
+	bzero(pacct_table.ct_entries,
+	    pacct_table.ct_size * sizeof(struct cmdinfo));
+	pacct_table.ct_count = 0;
+	return (error);
+}
+
+static int
+pacct_db_add(const struct cmdinfo *ci)
 {
 	DBT key, data;
 	struct cmdinfo newci;
@@ -152,18 +188,86 @@ pacct_add(const struct cmdinfo *ci)
 int
 pacct_update(void)
 {
+	if (pacct_merge() != 0)
+		return (-1);
 	return (db_copy_out(pacct_db, pdb_file, "process accounting",
 	    NULL));
 }
 
+/*
+ * Order in which commands are reported: > 0 if c1 is printed before c2.
+ * Matches walking a btree sorted by sa_cmp backwards (or forwards for -r).
+ */
+static int
+rank_ci(const struct cmdinfo *c1, const struct cmdinfo *c2)
+{
+	DBT d1, d2;
+	int rv;
+
+	d1.data = (void *)c1;
+	d1.size = sizeof *c1;
+	d2.data = (void *)c2;
+	d2.size = sizeof *c2;
+	rv = (*sa_cmp)(&d1, &d2);
+	return (rflag ? -rv : rv);
+}
+
+static int
+rank_ci_qsort(const void *a, const void *b)
+{
+	return (rank_ci(b, a));
+}
+
+/*
+ * Keep the print_limit best commands seen so far in a heap whose root is
+ * the worst of them, so -N costs O(n log N) instead of sorting everything.
+ */
+static void
+heap_offer(struct cmdinfo *heap, u_quad_t *nheap, const struct cmdinfo *cip)
+{
+	struct cmdinfo tmp;
+	u_quad_t i, child;
+
+	if (*nheap < print_limit) {
+		/* sift up */
+		i = (*nheap)++;
+		heap[i] = *cip;
+		while (i > 0 && rank_ci(&heap[(i - 1) / 2], &heap[i]) > 0) {
+			tmp = heap[i];
+			heap[i] = heap[(i - 1) / 2];
+			heap[(i - 1) / 2] = tmp;
+			i = (i - 1) / 2;
+		}
+		return;
+	}
+	if (rank_ci(cip, &heap[0]) <= 0)
+		return;
+
+	/* replace the root and sift down */
+	heap[0] = *cip;
+	for (i = 0; (child = 2 * i + 1) < *nheap; i = child) {
+		if (child + 1 < *nheap && rank_ci(&heap[child], &heap[child + 1]) > 0)
+			child++;
+		if (rank_ci(&heap[i], &heap[child]) <= 0)
+			break;
+		tmp = heap[i];
+		heap[i] = heap[child];
+		heap[child] = tmp;
+	}
+}
+
 void
 pacct_print(void)
 {
 	BTREEINFO bti;
 	DBT key, data, ndata;
-	DB *output_pacct_db;
+	DB *output_pacct_db = NULL;
 	struct cmdinfo *cip, ci, ci_total, ci_other, ci_junk;
-	int rv;
+	struct cmdinfo *heap = NULL;
+	u_quad_t nheap = 0, i;
+	int rv, first = 1;
+
+	(void)pacct_merge();
 
 	bzero(&ci_total, sizeof ci_total);
 	strcpy(ci_total.ci_comm, "");
@@ -173,15 +277,23 @@ pacct_print(void)
 	strcpy(ci_junk.ci_comm, "**junk**");
 
 	/*
-	 * Retrieve them into new DB, sorted by appropriate key.
-	 * At the same time, cull 'other' and 'junk'
+	 * Retrieve them into new DB, sorted by appropriate key, or into
+	 * the -N heap. At the same time, cull 'other' and 'junk'
 	 */
-	bzero(&bti, sizeof bti);
-	bti.compare = sa_cmp;
-	output_pacct_db = dbopen(NULL, O_RDWR, 0, DB_BTREE, &bti);
-	if (output_pacct_db == NULL) {
-		warn("couldn't sort process accounting stats");
-		return;
+	if (print_limit) {
+		heap = calloc(print_limit, sizeof(struct cmdinfo));
+		if (heap == NULL) {
+			warn("couldn't sort process accounting stats");
+			return;
+		}
+	} else {
+		bzero(&bti, sizeof bti);
+		bti.compare = sa_cmp;
+		output_pacct_db = dbopen(NULL, O_RDWR, 0, DB_BTREE, &bti);
+		if (output_pacct_db == NULL) {
+			warn("couldn't sort process accounting stats");
+			return;
+		}
 	}
 
 	ndata.data = NULL;
@@ -208,6 +320,10 @@ pacct_print(void)
 			add_ci(&ci, &ci_other);
 			goto next;
 		}
+		if (heap != NULL) {
+			heap_offer(heap, &nheap, &ci);
+			goto next;
+		}
 		rv = DB_PUT(output_pacct_db, &data, &ndata, 0);
 		if (rv < 0)
 			warn("sorting process accounting stats");
@@ -218,14 +334,19 @@ next:		rv = DB_SEQ(pacct_db, &key, &data, R_NEXT);
 	}
 
 	/* insert **junk** and ***other */
-	if (ci_junk.ci_calls != 0) {
+	if (heap != NULL) {
+		if (ci_junk.ci_calls != 0)
+			heap_offer(heap, &nheap, &ci_junk);
+		if (ci_other.ci_calls != 0)
+			heap_offer(heap, &nheap, &ci_other);
+	} else if (ci_junk.ci_calls != 0) {
 		data.data = &ci_junk;
 		data.size = sizeof ci_junk;
 		rv = DB_PUT(output_pacct_db, &data, &ndata, 0);
 		if (rv < 0)
 			warn("sorting process accounting stats");
 	}
-	if (ci_other.ci_calls != 0) {
+	if (heap == NULL && ci_other.ci_calls != 0) {
 		data.data = &ci_other;
 		data.size = sizeof ci_other;
 		rv = DB_PUT(output_pacct_db, &data, &ndata, 0);
@@ -234,24 +355,95 @@ next:		rv = DB_SEQ(pacct_db, &key, &data, R_NEXT);
 	}
 
 	/* print out the total */
-	print_ci(&ci_total, &ci_total);
-
-	/* print out; if reversed, print first (smallest) first */
-	rv = DB_SEQ(output_pacct_db, &data, &ndata, rflag ? R_FIRST : R_LAST);
-	if (rv < 0)
-		warn("retrieving process accounting report");
-	while (rv == 0) {
-		cip = (struct cmdinfo *) data.data;
-		bcopy(cip, &ci, sizeof ci);
-
-		print_ci(&ci, &ci_total);
+	if (Jflag) {
+		printf("{\"total\":");
+		print_ci_json(&ci_total, &ci_total);
+		printf(",\"commands\":[");
+	} else
+		print_ci(&ci_total, &ci_total);
 
+	if (heap != NULL) {
+		qsort(heap, nheap, sizeof(struct cmdinfo), rank_ci_qsort);
+		for (i = 0; i < nheap; i++)
+			print_entry(&heap[i], &ci_total, &first);
+		free(heap);
+	} else {
+		/* print out; if reversed, print first (smallest) first */
 		rv = DB_SEQ(output_pacct_db, &data, &ndata,
-		    rflag ? R_NEXT : R_PREV);
+		    rflag ? R_FIRST : R_LAST);
 		if (rv < 0)
 			warn("retrieving process accounting report");
+		while (rv == 0) {
+			cip = (struct cmdinfo *) data.data;
+			bcopy(cip, &ci, sizeof ci);
+
+			print_entry(&ci, &ci_total, &first);
+
+			rv = DB_SEQ(output_pacct_db, &data, &ndata,
+			    rflag ? R_NEXT : R_PREV);
+			if (rv < 0)
+				warn("retrieving process accounting report");
+		}
+		DB_CLOSE(output_pacct_db);
 	}
-	DB_CLOSE(output_pacct_db);
+
+	if (Jflag)
+		printf("]}\n");
+}
+
+static void
+print_entry(const struct cmdinfo *cip, const struct cmdinfo *totalcip,
+    int *first)
+{
+	if (!Jflag) {
+		print_ci(cip, totalcip);
+		return;
+	}
+	if (!*first)
+		putchar(',');
+	*first = 0;
+	print_ci_json(cip, totalcip);
+}
+
+void
+print_json_string(const char *s)
+{
+	putchar('"');
+	for (; *s != '\0'; s++) {
+		if (*s == '"' || *s == '\\')
+			printf("\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			printf("\\u%04x", (unsigned char)*s);
+		else
+			putchar(*s);
+	}
+	putchar('"');
+}
+
+#ifdef __APPLE__
+#define	CI_SECS(t)	((double)(t) / AHZ)
+#else
+#define	CI_SECS(t)	((t) / 1000000.0)
+#endif
+
+/* One command as a JSON object; times in seconds, memory in k*sec. */
+static void
+print_ci_json(const struct cmdinfo *cip, const struct cmdinfo *totalcip)
+{
+	double c = cip->ci_calls ? cip->ci_calls : 1;
+
+	printf("{\"command\":");
+	print_json_string(cip->ci_comm);
+	printf(",\"calls\":%ju,\"real\":%.6f,\"user\":%.6f,\"system\":%.6f"
+	    ",\"cpu\":%.6f,\"io\":%.0f,\"avg_io\":%.2f,\"mem\":%.0f",
+	    (uintmax_t)cip->ci_calls, CI_SECS(cip->ci_etime),
+	    CI_SECS(cip->ci_utime), CI_SECS(cip->ci_stime),
+	    CI_SECS(cip->ci_utime + cip->ci_stime), (double)cip->ci_io,
+	    (double)cip->ci_io / c, (double)cip->ci_mem);
+	if (cip != totalcip && totalcip->ci_calls != 0)
+		printf(",\"calls_pct\":%.2f",
+		    100.0 * cip->ci_calls / (double)totalcip->ci_calls);
+	putchar('}');
 }
 
 static int
@@ -46,8 +46,11 @@ __FBSDID("$FreeBSD: src/usr.sbin/sa/usrdb.c,v 1.16 2007/05/22 06:51:38 dds Exp $
 #include "pathnames.h"
 
 static int uid_compare(const DBT *, const DBT *);
+static int usracct_db_add(const struct cmdinfo *);
+static int usracct_merge(void);
 
 static DB	*usracct_db;
+static struct ci_table usracct_table;	/* records not yet in usracct_db */
 
 /* Legacy format in AHZV1 units. */
 struct userinfov1 {
@@ -104,6 +107,8 @@ usracct_init(void)
 	bzero(&bti, sizeof bti);
 	bti.compare = uid_compare;
 
+	if (ci_table_init(&usracct_table, 1) != 0)
+		return (-1);
 	return (db_copy_in(&usracct_db, usrdb_file, "user accounting",
 	    &bti, v1_to_v2));
 }
@@ -111,11 +116,36 @@ usracct_init(void)
 void
 usracct_destroy(void)
 {
+	ci_table_free(&usracct_table);
 	db_destroy(usracct_db, "user accounting");
 }
 
+/* Sum a record into the in-memory table; usracct_merge() folds it into the db. */
 int
 usracct_add(const struct cmdinfo *ci)
+{
+	return (ci_table_add(&usracct_table, ci));
+}
+
+/* Fold everything summed by usracct_add() into usracct_db and empty the table. */
+static int
+usracct_merge(void)
+{
+	size_t i;
+	int error = 0;
+
+	for (i = 0; i < usracct_table.ct_size; i++)
+		if (usracct_table.ct_entries[i].ci_calls != 0 &&
+		    usracct_db_add(&usracct_table.ct_entries[i]) != 0)
+			error = -1;
+	bzero(usracct_table.ct_entries,
+	    usracct_table.ct_size * sizeof(struct cmdinfo));
+	usracct_table.ct_count = 0;
+	return (error);
+}
+
+static int
+usracct_db_add(const struct cmdinfo *ci)
 {
 	DBT key, data;
 	struct userinfo newui;
@@ -173,6 +203,8 @@ usracct_update(void)
 	bzero(&bti, sizeof bti);
 	bti.compare = uid_compare;
 
+	if (usracct_merge() != 0)
+		return (-1);
 	return (db_copy_out(usracct_db, usrdb_file, "user accounting",
 	    &bti));
 }
@@ -183,15 +215,41 @@ usracct_print(void)
 	DBT key, data;
 	struct userinfo uistore, *ui = &uistore;
 	double t;
-	int rv;
+	int rv, first = 1;
+
+	(void)usracct_merge();
 
 	rv = DB_SEQ(usracct_db, &key, &data, R_FIRST);
 	if (rv < 0)
 		warn("retrieving user accounting stats");
 
+	if (Jflag)
+		printf("{\"users\":[");
 	while (rv == 0) {
 		memcpy(ui, data.data, sizeof(struct userinfo));
 
+		if (Jflag) {
+			if (!first)
+				putchar(',');
+			first = 0;
+			printf("{\"user\":");
+			print_json_string(user_from_uid(ui->ui_uid, 0));
+#ifdef __APPLE__
+			printf(",\"uid\":%u,\"calls\":%ju,\"cpu\":%.6f,"
+			    "\"io\":%ju,\"mem\":%ju}", ui->ui_uid,
+			    (uintmax_t)ui->ui_calls,
+			    (ui->ui_utime + ui->ui_stime) / (double) AHZ,
+			    (uintmax_t)ui->ui_io, (uintmax_t)ui->ui_mem);
+#else
+			printf(",\"uid\":%u,\"calls\":%ju,\"cpu\":%.6f,"
+			    "\"io\":%.0f,\"mem\":%.0f}", ui->ui_uid,
+			    (uintmax_t)ui->ui_calls,
+			    (ui->ui_utime + ui->ui_stime) / 1000000,
+			    ui->ui_io, ui->ui_mem);
+#endif
+			goto next;
+		}
+
 		printf("%-*s %9ju ", MAXLOGNAME - 1,
 		    user_from_uid(ui->ui_uid, 0), (uintmax_t)ui->ui_calls);
 
@@ -238,10 +296,12 @@ usracct_print(void)
 
 		printf("\n");
 
-		rv = DB_SEQ(usracct_db, &key, &data, R_NEXT);
+next:		rv = DB_SEQ(usracct_db, &key, &data, R_NEXT);
 		if (rv < 0)
 			warn("retrieving user accounting stats");
 	}
+	if (Jflag)
+		printf("]}\n");
 }
 
 static int
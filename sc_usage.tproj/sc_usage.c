@@ -26,7 +26,7 @@
 cc -I. -DPRIVATE -D__APPLE_PRIVATE -O -o sc_usage sc_usage.c -lncurses
 */
 
-#define	Default_DELAY	1	/* default delay interval */
+#define	Default_DELAY	1.0	/* default delay interval */
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -55,6 +55,8 @@ cc -I. -DPRIVATE -D__APPLE_PRIVATE -O -o sc_usage sc_usage.c -lncurses
 #include <sys/kdebug.h>
 #endif /*KERNEL_PRIVATE*/
 
+#include "kdcore.h"
+
 #include <sys/sysctl.h>
 #include <errno.h>
 #include <mach/mach_time.h>
@@ -69,30 +71,58 @@ int    Header_lines = HEADER_LINES;
 
 int    how_to_sort = 0;
 int    no_screen_refresh = 0;
+
+/*
+ * With -o, nothing is drawn: each interval's deltas are written to
+ * stdout instead, as CSV lines or as a JSON object per interval.
+ */
+#define OUTPUT_SCREEN	0
+#define OUTPUT_CSV	1
+#define OUTPUT_JSON	2
+
+int    output_format = OUTPUT_SCREEN;
 int    execute_flag = 0;
 int    topn = 0;
 int    pid;
-int    called = 0;
-int    sort_now = 0;
 int    waiting_index = 0;
 FILE   *dfp = 0;  /*Debug output file */
 long   start_time = 0;
 
 #define SAMPLE_SIZE 20000
+#define ALL_SAMPLE_SIZE 200000	/* with -a */
 
 #define DBG_ZERO_FILL_FAULT   1
 #define DBG_PAGEIN_FAULT      2
 #define DBG_COW_FAULT         3
 #define DBG_CACHE_HIT_FAULT   4
 
-#define MAX_SC 1024
-#define MAX_THREADS 16
-#define MAX_NESTED  8
 #define MAX_FAULTS  5
 
+/*
+ * The per-thread state is kept in a table keyed by thread id, and grows as
+ * threads turn up; each thread's stack of nested calls grows as they nest.
+ * The system calls, mach traps and MSG_ codes each get an entry in sc_tab
+ * as they are named in the code file (or first seen, if they aren't),
+ * found through the index tables by their debugid's code.
+ */
+#define HASH_SIZE	1024
+#define HASH_MASK	(HASH_SIZE - 1)
+#define INITIAL_NESTED	8
+#define SC_CODES	(1 << 14)	/* the code bits of a debugid */
+
 
 #define NUMPARMS 23
 
+/*
+ * The elapsed time of each call is counted in power of two buckets of
+ * microseconds, bucket n holding the calls that took less than 2^n usecs,
+ * which is enough to give the 99th percentile.  The percentile and the
+ * longest call are shown at the end of each row on screens of at least
+ * LAT_COLS columns.
+ */
+#define LAT_BUCKETS	32
+#define LAT_COLS	100
+
 
 char *state_name[] = {
         "Dont Know",
@@ -112,6 +142,7 @@ struct entry {
         int  sc_state;
         int  type;
         int  code;
+        double start;		/* when the call was made */
         double otime;
         double stime;
         double ctime;
@@ -119,13 +150,16 @@ struct entry {
 };
 
 struct th_info {
+        struct th_info *next;	/* on th_freelist */
         uint64_t thread;
         int  depth;
+        int  max_depth;		/* entries in th_entry */
         int  vfslookup;
         int  curpri;
         int64_t *pathptr;
         int64_t pathname[NUMPARMS + 1];
-        struct entry th_entry[MAX_NESTED];
+        struct entry *th_entry;
+        struct proc_usage *pu;	/* with -a, who the calls are charged to */
 };
 
 struct sc_entry {
@@ -135,22 +169,60 @@ struct sc_entry {
         int  waiting;
         unsigned int stime_secs;
         double       stime_usecs;
+        unsigned int delta_stime_secs;
+        double       delta_stime_usecs;
         unsigned int wtime_secs;
         double       wtime_usecs;
         unsigned int delta_wtime_secs;
         double       delta_wtime_usecs;
+        double       max_usecs;
+        unsigned int lat_hist[LAT_BUCKETS];
 };
 
-struct th_info th_state[MAX_THREADS];
+struct kdc_threads th_table = KDC_THREADS_INITIALIZER(struct th_info *);
+struct th_info *th_freelist;
 struct sc_entry faults[MAX_FAULTS];
 
 struct sc_entry *sc_tab;
-int  *msgcode_tab;
+int    sc_cnt;               /* entries in sc_tab, 0 is unused */
+int    sc_alloc = 0;
+int    *bsc_index;           /* BSC_ code to sc_tab index */
+int    *msc_index;           /* MSC_ code to sc_tab index */
+struct msgcode {
+        int  code;
+        int  index;
+} *msgcode_tab;
 int    msgcode_cnt;          /* number of MSG_ codes */
+int    msgcode_alloc;
 
 int    num_of_threads = 0;
 int    now_collect_cpu_time = 0;
 
+/*
+ * With -a, every call is also charged to the process (or with -g, the
+ * command) that made it.  Threads are matched to their process through
+ * the kernel's thread map, read when tracing starts, and kept up to date
+ * from the new thread and exec events.
+ */
+int    all_procs = 0;
+int    group_by_command = 0;
+
+struct proc_usage {
+        struct proc_usage *next;	/* hash chain */
+        struct proc_usage *link;	/* all of them */
+        int  pid;
+        char command[MAXCOMLEN + 1];
+        struct sc_entry se;
+};
+
+struct proc_usage *pu_hash[HASH_SIZE];
+struct proc_usage *pu_list;
+int    pu_cnt;
+struct proc_usage **sort_by_proc;
+int    sort_by_proc_cnt;            /* as of the last sort_procs() */
+int    sort_by_proc_alloc;
+struct kdc_threads tp_table = KDC_THREADS_INITIALIZER(struct proc_usage *);	/* thread to its proc_usage */
+
 unsigned int utime_secs;
 double       utime_usecs;
 
@@ -180,6 +252,29 @@ int    bsc_exit = 0;
 int    *sort_by_count;
 int    *sort_by_wtime;
 
+/*
+ * The calls that have been made are kept in both orders as they are
+ * counted, rather than sorted afresh for each update: count_pos and
+ * wtime_pos give where each sc_tab entry is in sort_by_count and
+ * sort_by_wtime (or -1), and since the count and wait time of a call
+ * only grow, an entry only ever moves up its lists.
+ */
+int    *count_pos;
+int    *wtime_pos;
+int    sorted_cnt;
+
+/*
+ * The screen is written a line at a time through output(), which only
+ * rewrites the lines that have changed since the last update.
+ */
+#define LINE_SIZE 256
+
+char   (*screen_lines)[LINE_SIZE];
+int    screen_nlines;
+int    screen_row;
+char   line_buf[LINE_SIZE];
+size_t line_len;
+
 char   proc_name[32];
 
 #define DBG_FUNC_ALL	(DBG_FUNC_START | DBG_FUNC_END)
@@ -216,6 +311,7 @@ static void set_init(void);
 void quit(char *);
 int argtopid(char *);
 int argtoi(int, char*, char*, int);
+double argtod(int, char*, char*);
 
 void get_bufinfo(kbufinfo_t *);
 static void reset_counters(void);
@@ -223,8 +319,38 @@ static void getdivisor(void);
 static void screen_update(void);
 static void sc_tab_init(char *);
 static void sort_scalls(void);
+static void sc_update_rank(int);
+static void output(char *);
+static void output_line(void);
+static void output_start(void);
+static void output_end(void);
+static void output_resize(void);
+static void clear_deltas(void);
+static void write_batch(void);
+static int write_entry(int, const char *, struct sc_entry *, const char *);
+static int cmp_wtime(struct sc_entry *, struct sc_entry *);
 static void sample_sc(void);
 static int find_msgcode(int);
+static int sc_tab_add(char *);
+static int find_sc(int *, int, char *);
+static struct th_info *find_thread(uint64_t);
+static struct th_info *add_thread(uint64_t);
+static void delete_thread(struct th_info *);
+static void delete_all_threads(void);
+static struct entry *push_entry(struct th_info *);
+static void charge_call(struct sc_entry *, struct entry *, uint64_t);
+static void charge_wait(struct sc_entry *, double);
+static double lat_percentile(struct sc_entry *, double);
+static void clear_latency(struct sc_entry *);
+static void print_usecs(char *, double);
+static struct proc_usage *find_proc_usage(int, char *);
+static struct proc_usage *find_thread_proc(uint64_t);
+static void set_thread_proc(uint64_t, struct proc_usage *);
+static void read_thread_map(void);
+static void new_thread(uint64_t, uint64_t, int);
+static void exec_thread(uint64_t, char *);
+static void sort_procs(void);
+static void print_procs(int);
 
 /*
  *  signal handlers
@@ -240,7 +366,8 @@ leave(__unused int unused)
 		endwin();
 	}
 	set_enable(0);
-	set_pidcheck(pid, 0);
+	if (all_procs == 0)
+	        set_pidcheck(pid, 0);
 	set_remove();
 	exit(0);
 }
@@ -255,12 +382,15 @@ sigwinch(__unused int unused)
 static int
 exit_usage(char *myname)
 {
-        fprintf(stderr, "Usage: %s [-c codefile] [-e] [-l] [-sn] pid | cmd | -E execute path\n", myname);
+        fprintf(stderr, "Usage: %s [-c codefile] [-e] [-l] [-o format] [-sn] pid | cmd | -E execute path | -a [-g]\n", myname);
+	fprintf(stderr, "  -a         sample all processes, and show the calls of each\n");
+	fprintf(stderr, "  -g         with -a, show the calls of each command rather than each process\n");
 	fprintf(stderr, "  -c         name of codefile containing mappings for syscalls\n");
 	fprintf(stderr, "             Default is /usr/share/misc/trace.codes\n");
 	fprintf(stderr, "  -e         enable sort by call count\n");
 	fprintf(stderr, "  -l         turn off top style output\n");
-	fprintf(stderr, "  -sn        change sample rate to every n seconds\n");
+	fprintf(stderr, "  -o format  write each interval's deltas as csv or json instead\n");
+	fprintf(stderr, "  -sn        change sample rate to every n seconds (down to 0.1)\n");
 	fprintf(stderr, "  pid        selects process to sample\n");
 	fprintf(stderr, "  cmd        selects command to sample\n");
 	fprintf(stderr, "  -E         Execute the given path and optional arguments\n");
@@ -304,7 +434,8 @@ main(int argc, char *argv[])
 	char    *codefile = "/usr/share/misc/trace.codes";
 	char    ch;
 	char    *ptr;
-	int	delay = Default_DELAY;
+	double	delay = Default_DELAY;
+	int	ticks;
 
 	if ( geteuid() != 0 ) {
 	      printf("'sc_usage' must be run as root...\n");
@@ -328,10 +459,17 @@ main(int argc, char *argv[])
 		}
 	}
 
-	while ((ch = getopt(argc, argv, "c:els:d:E")) != EOF) {
+	while ((ch = getopt(argc, argv, "ac:eglo:s:d:E")) != EOF) {
 	       switch(ch) {
+		case 'a':
+		        all_procs = 1;
+			break;
+		case 'g':
+		        all_procs = 1;
+		        group_by_command = 1;
+			break;
 		case 's':
-		        delay = argtoi('s', "decimal number", optarg, 10);
+		        delay = argtod('s', "number of seconds", optarg);
 			break;
 		case 'e':
 			how_to_sort = 1;
@@ -339,6 +477,15 @@ main(int argc, char *argv[])
 		case 'l':
 		        no_screen_refresh = 1;
 			break;
+		case 'o':
+		        if (strcmp(optarg, "csv") == 0)
+			        output_format = OUTPUT_CSV;
+			else if (strcmp(optarg, "json") == 0)
+			        output_format = OUTPUT_JSON;
+			else
+			        exit_usage(myname);
+		        no_screen_refresh = 1;
+			break;
 	        case 'c':
 		        codefile = optarg;
 		        break;
@@ -355,7 +502,13 @@ main(int argc, char *argv[])
 
 	sc_tab_init(codefile);
 
-	if (argc)
+	if (all_procs)
+	  {
+	    if (argc || execute_flag)
+	      exit_usage(myname);
+	    strcpy(proc_name, "all");
+	  }
+	else if (argc)
 	  {
 	    if (!execute_flag)
 	      {
@@ -427,6 +580,7 @@ main(int argc, char *argv[])
 
 		clear();
 		refresh();
+		output_resize();
 	}
 
 
@@ -445,27 +599,33 @@ main(int argc, char *argv[])
 	}
 
 	set_remove();
-	set_numbufs(SAMPLE_SIZE);
+	set_numbufs(all_procs ? ALL_SAMPLE_SIZE : SAMPLE_SIZE);
 	set_init();
-	set_pidcheck(pid, 1);
+	if (all_procs == 0)
+	        set_pidcheck(pid, 1);
 	set_enable(1);
 	if (execute_flag)
 	  ptrace(7, pid, (caddr_t)1, 0);  /* PT_CONTINUE */
 	getdivisor();
 
-	if (delay == 0)
-	        delay = 1;
-	if ((sort_now = 10 / delay) < 2)
-	        sort_now = 2;
+	/*
+	 * The loop below samples every 100ms
+	 */
+	if ((ticks = (int)(delay * 10 + 0.5)) < 1)
+	        ticks = 1;
 
 	get_bufinfo(&bufinfo);
 
+	if (all_procs)
+	        read_thread_map();
+
 	my_buffer = malloc(bufinfo.nkdbufs * sizeof(kd_buf));
 	if(my_buffer == (char *) 0)
 		quit("can't allocate memory for tracing info\n");
 
 	(void)sort_scalls();
-	(void)screen_update();
+	if (output_format == OUTPUT_SCREEN)
+	        (void)screen_update();
 
 	/* main loop */
 
@@ -473,7 +633,7 @@ main(int argc, char *argv[])
 	        int     i;
 		char    c;
 
-	        for (i = 0; i < (10 * delay) && newLINES == 0; i++) {
+	        for (i = 0; i < ticks && newLINES == 0; i++) {
 
 			if (no_screen_refresh == 0) {
 			        if ((c = getch()) != ERR && (char)c == 'q')
@@ -494,12 +654,87 @@ main(int argc, char *argv[])
 		        endwin();
 			clear();
 			refresh();
+			output_resize();
 
 		        topn = LINES - Header_lines;
 		        newLINES = 0;
 		}
-		(void)screen_update();
+		if (output_format == OUTPUT_SCREEN)
+		        (void)screen_update();
+		else
+		        write_batch();
+	}
+}
+
+static void
+output(char *s)
+{
+        if (no_screen_refresh) {
+	        printf("%s", s);
+		return;
+	}
+	for (; *s; s++) {
+	        if (*s == '\n')
+		        output_line();
+		else if (line_len < LINE_SIZE - 1)
+		        line_buf[line_len++] = *s;
+	}
+}
+
+static void
+output_line(void)
+{
+        line_buf[line_len] = '\0';
+
+	if (screen_row < screen_nlines && strcmp(screen_lines[screen_row], line_buf)) {
+	        strcpy(screen_lines[screen_row], line_buf);
+		mvaddstr(screen_row, 0, line_buf);
+		clrtoeol();
 	}
+	screen_row++;
+	line_len = 0;
+}
+
+static void
+output_start(void)
+{
+        screen_row = 0;
+	line_len = 0;
+}
+
+static void
+output_end(void)
+{
+        if (no_screen_refresh) {
+	        printf("\n=================\n");
+		return;
+	}
+	if (line_len)
+	        output_line();
+
+	/* blank what's left of the last update */
+	for (; screen_row < screen_nlines; screen_row++) {
+	        if (screen_lines[screen_row][0]) {
+		        screen_lines[screen_row][0] = '\0';
+			move(screen_row, 0);
+			clrtoeol();
+		}
+	}
+	move(0, 0);
+	refresh();
+}
+
+/*
+ * The screen has been cleared, so the next update redraws every line.
+ */
+static void
+output_resize(void)
+{
+        free(screen_lines);
+
+	screen_nlines = LINES;
+	if ((screen_lines = calloc(screen_nlines, LINE_SIZE)) == NULL)
+	        quit("can't allocate memory for the screen\n");
 }
 
 static void
@@ -547,11 +782,20 @@ print_row(struct sc_entry *se, int no_wtime)
 			}
 		}
 	}
+	if ((no_screen_refresh || COLS >= LAT_COLS) && se->max_usecs) {
+	        if (clen < 80) {
+		        memset(&tbuf[clen], ' ', 80 - clen);
+			clen = 80;
+		}
+		print_usecs(&tbuf[clen], lat_percentile(se, 0.99));
+		clen += strlen(&tbuf[clen]);
+
+		tbuf[clen++] = ' ';
+		print_usecs(&tbuf[clen], se->max_usecs);
+		clen += strlen(&tbuf[clen]);
+	}
 	sprintf(&tbuf[clen], "\n");
-	if (no_screen_refresh)
-	        printf("%s", tbuf);
-	else
-	        printw(tbuf);
+	output(tbuf);
 }
 
 static void
@@ -569,13 +813,12 @@ screen_update(void)
 	struct  sc_entry *se;
 	int     output_lf;
 	int     max_rows;
+	int     thread_rows;
+	struct kdc_threads_walk w;
 	struct th_info *ti;
+	struct proc_usage *pu;
 
-	if (no_screen_refresh == 0) {
-	        /* clear for new display */
-	        erase();
-		move(0, 0);
-	}
+	output_start();
 	rows = 0;
 
 	sprintf(tbuf, "%-14.14s", proc_name);
@@ -622,10 +865,7 @@ screen_update(void)
 	clen = 78 - 8;
 
 	sprintf(&tbuf[clen], "%-8.8s\n", &(ctime(&curr_time)[11]));
-	if (no_screen_refresh)
-	        printf("%s", tbuf);
-	else
-	        printw(tbuf);
+	output(tbuf);
 
 	if (total_faults == 1)
 	        p1 = "fault ";
@@ -641,24 +881,18 @@ screen_update(void)
 	clen = strlen(tbuf);
 	sprintf(&tbuf[clen], "                    %3ld:%02ld:%02ld\n", 
 		hours, minutes % 60, elapsed_secs % 60);
-	if (no_screen_refresh)
-	        printf("%s", tbuf);
-	else
-	        printw(tbuf);
+	output(tbuf);
 
 
 
-	sprintf(tbuf, "\nTYPE                           NUMBER        CPU_TIME   WAIT_TIME\n");
-	if (no_screen_refresh)
-	        printf("%s", tbuf);
+	if (no_screen_refresh || COLS >= LAT_COLS)
+	        sprintf(tbuf, "\n%-80s     P99      MAX\n", "TYPE                           NUMBER        CPU_TIME   WAIT_TIME");
 	else
-	        printw(tbuf);
+	        sprintf(tbuf, "\nTYPE                           NUMBER        CPU_TIME   WAIT_TIME\n");
+	output(tbuf);
 
 	sprintf(tbuf, "------------------------------------------------------------------------------\n");
-	if (no_screen_refresh)
-	        printf("%s", tbuf);
-	else
-	        printw(tbuf);
+	output(tbuf);
 	rows = 0;
 
 
@@ -681,10 +915,7 @@ screen_update(void)
 		clen += strlen(&tbuf[clen]);
 	}
         sprintf(&tbuf[clen], "\n");
-	if (no_screen_refresh)
-	        printf("%s", tbuf);
-	else
-	        printw(tbuf);
+	output(tbuf);
 	rows++;
 
 
@@ -707,10 +938,7 @@ screen_update(void)
 		clen += strlen(&tbuf[clen]);
 	}
         sprintf(&tbuf[clen], "\n");
-	if (no_screen_refresh)
-	        printf("%s", tbuf);
-	else
-	        printw(tbuf);
+	output(tbuf);
 	rows++;
 
 
@@ -721,14 +949,22 @@ screen_update(void)
 	clen += strlen(&tbuf[clen]);
 
 	sprintf(&tbuf[clen], "\n");
-	if (no_screen_refresh)
-	        printf("%s", tbuf);
-	else
-	        printw(tbuf);
+	output(tbuf);
 	rows++;
 
-	if (num_of_threads)
-	        max_rows = topn - (num_of_threads + 3);
+	/*
+	 * Leave at least half the screen to the calls.
+	 */
+	if (all_procs)
+	        thread_rows = sort_by_proc_cnt;
+	else
+	        thread_rows = num_of_threads;
+
+	if (no_screen_refresh == 0 && thread_rows > (topn - 3) / 2)
+	        thread_rows = (topn - 3) / 2;
+
+	if (thread_rows > 0)
+	        max_rows = topn - (thread_rows + 3);
 	else
 	        max_rows = topn;
 
@@ -739,10 +975,7 @@ screen_update(void)
 		        continue;
 		if (output_lf == 1) {
 		        sprintf(tbuf, "\n");
-			if (no_screen_refresh)
-			        printf("%s", tbuf);
-			else
-			        printw(tbuf);
+			output(tbuf);
 			rows++;
 
 			if (rows >= max_rows)
@@ -754,10 +987,7 @@ screen_update(void)
 	}
 	sprintf(tbuf, "\n");
 
-	if (no_screen_refresh)
-	        printf("%s", tbuf);
-	else
-	        printw(tbuf);
+	output(tbuf);
 	rows++;
 
 	for (i = 0; rows < max_rows; i++) {
@@ -775,27 +1005,25 @@ screen_update(void)
 	sprintf(tbuf, "\n");
 	if (no_screen_refresh == 0) {
 	        while (rows++ < max_rows)
-		        printw(tbuf);
+		        output(tbuf);
 	} else
-	        printf("%s", tbuf);
+	        output(tbuf);
 
-	if (num_of_threads) {
+	if (all_procs) {
+	        print_procs(thread_rows);
+		thread_rows = 0;
+	}
+	if (thread_rows > 0) {
 	        sprintf(tbuf, "\nCURRENT_TYPE              LAST_PATHNAME_WAITED_FOR     CUR_WAIT_TIME THRD# PRI\n");
 
-		if (no_screen_refresh)
-		        printf("%s", tbuf);
-		else
-		        printw(tbuf);
+		output(tbuf);
 
 	        sprintf(tbuf, "------------------------------------------------------------------------------\n");
-		if (no_screen_refresh)
-		        printf("%s", tbuf);
-		else
-		        printw(tbuf);
+		output(tbuf);
 	}
-	ti = &th_state[0];
+	kdc_threads_walk_start(&th_table, &w);
 
-	for (i = 0; i < num_of_threads; i++, ti++) {
+	for (i = 0; i < thread_rows; i++) {
 	        struct entry *te;
 		char	*p;
 		uint64_t now;
@@ -803,9 +1031,7 @@ screen_update(void)
 
 		now = mach_absolute_time();
 
-		while (ti->thread == 0 && ti < &th_state[MAX_THREADS])
-		        ti++;
-		if (ti == &th_state[MAX_THREADS])
+		if ((ti = kdc_threads_next(&th_table, &w)) == NULL)
 		        break;
 
 	        if (ti->depth) {
@@ -844,32 +1070,57 @@ screen_update(void)
 		print_time(&tbuf[clen], time_usecs, time_secs);
 		clen += strlen(&tbuf[clen]);
 		sprintf(&tbuf[clen], "    %2d    %3d\n", i, ti->curpri);
-		if (no_screen_refresh)
-		        printf("%s", tbuf);
-		else
-		        printw(tbuf);
+		output(tbuf);
 	}
-	if (no_screen_refresh == 0) {
-	        move(0, 0);
-	        refresh();
-	} else
-	        printf("\n=================\n");
+	output_end();
 
+	clear_deltas();
+}
 
+static void
+clear_deltas(void)
+{
+	struct proc_usage *pu;
+	int n, i;
 
-	for (i = 0; i < (MAX_SC + msgcode_cnt); i++) {
+	for (i = 0; i < sc_cnt; i++) {
 	        if ((n = sort_by_count[i]) == -1)
 		        break;
 		sc_tab[n].delta_count = 0;
 		sc_tab[n].waiting = 0;
 		sc_tab[n].delta_wtime_usecs = 0;
 		sc_tab[n].delta_wtime_secs = 0;
+		sc_tab[n].delta_stime_usecs = 0;
+		sc_tab[n].delta_stime_secs = 0;
+	}
+	for (pu = pu_list; pu; pu = pu->link) {
+		pu->se.delta_count = 0;
+		pu->se.waiting = 0;
+		pu->se.delta_wtime_usecs = 0;
+		pu->se.delta_wtime_secs = 0;
+		pu->se.delta_stime_usecs = 0;
+		pu->se.delta_stime_secs = 0;
 	}
 	for (i = 1; i < MAX_FAULTS; i++) {
 	        faults[i].delta_count = 0;
 		faults[i].waiting = 0;
 		faults[i].delta_wtime_usecs = 0;
 		faults[i].delta_wtime_secs = 0;
+		faults[i].delta_stime_usecs = 0;
+		faults[i].delta_stime_secs = 0;
+	}
+	/*
+	 * -o writes the p99 and max of each interval, so they start over
+	 * with the deltas; the screen keeps them since the last reset, like
+	 * the totals beside them.
+	 */
+	if (output_format != OUTPUT_SCREEN) {
+		for (i = 0; i < sc_cnt; i++)
+			clear_latency(&sc_tab[i]);
+		for (pu = pu_list; pu; pu = pu->link)
+			clear_latency(&pu->se);
+		for (i = 1; i < MAX_FAULTS; i++)
+			clear_latency(&faults[i]);
 	}
 	preempted = 0;
 	csw = 0;
@@ -881,12 +1132,106 @@ screen_update(void)
 	delta_otime_usecs = 0;
 }
 
+/*
+ * Write the deltas for the interval just ended, in place of the screen.
+ */
+static void
+write_batch(void)
+{
+        static int header_done = 0;
+        struct timeval tv;
+	struct proc_usage *pu;
+	char tod[32];
+	int i, n, written;
+
+	gettimeofday(&tv, NULL);
+	sprintf(tod, "%ld.%06d", (long)tv.tv_sec, (int)tv.tv_usec);
+
+	if (output_format == OUTPUT_CSV) {
+	        if (header_done == 0) {
+		        printf("time,type,name,count,total_count,cpu_usecs,wait_usecs,waiting,p99_usecs,max_usecs\n");
+			header_done = 1;
+		}
+		printf("%s,system,preemptions,%d,,,,,,\n", tod, preempted);
+		printf("%s,system,context_switches,%d,,,,,,\n", tod, csw);
+		printf("%s,system,idle,,,%.0f,,,,\n", tod, (double)delta_itime_secs * 1000000 + delta_itime_usecs);
+		printf("%s,system,busy,,,%.0f,,,,\n", tod, (double)delta_otime_secs * 1000000 + delta_otime_usecs);
+	} else {
+	        printf("{\"time\":%s,\"process\":\"%s\",\"pid\":%d,\"preemptions\":%d,\"context_switches\":%d,"
+		       "\"faults\":%d,\"system_calls\":%d,\"idle_usecs\":%.0f,\"busy_usecs\":%.0f",
+		       tod, proc_name, all_procs ? -1 : pid, preempted, csw, total_faults, scalls,
+		       (double)delta_itime_secs * 1000000 + delta_itime_usecs,
+		       (double)delta_otime_secs * 1000000 + delta_otime_usecs);
+	}
+	if (output_format == OUTPUT_JSON)
+	        printf(",\"calls\":[");
+	for (written = 0, i = 0; (n = sort_by_wtime[i]) != -1; i++)
+	        written += write_entry(written, "call", &sc_tab[n], tod);
+
+	if (output_format == OUTPUT_JSON)
+	        printf("],\"fault_types\":[");
+	for (written = 0, i = 1; i < MAX_FAULTS; i++)
+	        written += write_entry(written, "fault", &faults[i], tod);
+
+	if (all_procs) {
+	        if (output_format == OUTPUT_JSON)
+		        printf("],\"processes\":[");
+		for (written = 0, pu = pu_list; pu; pu = pu->link)
+		        written += write_entry(written, "process", &pu->se, tod);
+	}
+	if (output_format == OUTPUT_JSON)
+	        printf("]}\n");
+	fflush(stdout);
+
+	clear_deltas();
+}
+
+/*
+ * Write the deltas of one call, fault type or process, if it has any.
+ */
+static int
+write_entry(int written, const char *type, struct sc_entry *se, const char *tod)
+{
+	double cpu_usecs, wait_usecs;
+
+	if (se->delta_count == 0 && se->waiting == 0)
+	        return (0);
+
+	cpu_usecs = (double)se->delta_stime_secs * 1000000 + se->delta_stime_usecs;
+	wait_usecs = (double)se->delta_wtime_secs * 1000000 + se->delta_wtime_usecs;
+
+	if (output_format == OUTPUT_JSON)
+	        printf("%s{\"name\":\"%s\",\"count\":%d,\"total_count\":%d,\"cpu_usecs\":%.0f,\"wait_usecs\":%.0f,\"waiting\":%d,"
+		       "\"p99_usecs\":%.0f,\"max_usecs\":%.0f}",
+		       written ? "," : "", se->name, se->delta_count, se->total_count, cpu_usecs, wait_usecs, se->waiting,
+		       lat_percentile(se, 0.99), se->max_usecs);
+	else
+	        printf("%s,%s,%s,%d,%d,%.0f,%.0f,%d,%.0f,%.0f\n",
+		       tod, type, se->name, se->delta_count, se->total_count, cpu_usecs, wait_usecs, se->waiting,
+		       lat_percentile(se, 0.99), se->max_usecs);
+	return (1);
+}
 static void
 reset_counters(void)
 {
         int   i;
-
-	for (i = 0; i < (MAX_SC + msgcode_cnt) ; i++) {
+	struct proc_usage *pu;
+
+	for (pu = pu_list; pu; pu = pu->link) {
+		pu->se.delta_count = 0;
+		pu->se.total_count = 0;
+		pu->se.waiting = 0;
+		pu->se.delta_wtime_usecs = 0;
+		pu->se.delta_wtime_secs = 0;
+		pu->se.wtime_usecs = 0;
+		pu->se.wtime_secs = 0;
+		pu->se.stime_usecs = 0;
+		pu->se.stime_secs = 0;
+		pu->se.delta_stime_usecs = 0;
+		pu->se.delta_stime_secs = 0;
+		clear_latency(&pu->se);
+	}
+	for (i = 0; i < sc_cnt; i++) {
 		sc_tab[i].delta_count = 0;
 		sc_tab[i].total_count = 0;
 		sc_tab[i].waiting = 0;
@@ -896,6 +1241,9 @@ reset_counters(void)
 		sc_tab[i].wtime_secs = 0;
 		sc_tab[i].stime_usecs = 0;
 		sc_tab[i].stime_secs = 0;
+		sc_tab[i].delta_stime_usecs = 0;
+		sc_tab[i].delta_stime_secs = 0;
+		clear_latency(&sc_tab[i]);
 	}
 	for (i = 1; i < MAX_FAULTS; i++) {
 	        faults[i].delta_count = 0;
@@ -907,12 +1255,21 @@ reset_counters(void)
 		faults[i].wtime_secs = 0;
 		faults[i].stime_usecs = 0;
 		faults[i].stime_secs = 0;
+		faults[i].delta_stime_usecs = 0;
+		faults[i].delta_stime_secs = 0;
+		clear_latency(&faults[i]);
 	}
 	preempted = 0;
 	csw = 0;
 	total_faults = 0;
 	scalls = 0;
-	called = 0;
+
+	for (i = 0; i < sorted_cnt; i++) {
+	        count_pos[sort_by_count[i]] = -1;
+	        wtime_pos[sort_by_wtime[i]] = -1;
+	}
+	sorted_cnt = 0;
+	sort_by_count[0] = sort_by_wtime[0] = -1;
 
 	utime_secs = 0;
 	utime_usecs = 0;
@@ -931,7 +1288,6 @@ sc_tab_init(char *codefile)
 {
         int  code;
 	int  n;
-	int msgcode_indx=0;
 	char name[56];
         FILE *fp;
 
@@ -939,40 +1295,11 @@ sc_tab_init(char *codefile)
 		printf("Failed to open code description file %s\n", codefile);
 		exit(1);
 	}
-
-	/* Count Mach message MSG_ codes */
-	for (msgcode_cnt=0;;) {
-	        n = fscanf(fp, "%x%55s\n", &code, &name[0]);
-		if (n != 2)
-		  break;
-		if (strncmp ("MSG_", &name[0], 4) == 0)
-		  msgcode_cnt++;
-		if (strcmp("TRACE_LAST_WRAPPER", &name[0]) == 0)
-		        break;
-	}
-
-	sc_tab = (struct sc_entry *)malloc((MAX_SC+msgcode_cnt) * sizeof (struct sc_entry));
-        if(!sc_tab)
+	bsc_index = (int *)calloc(SC_CODES, sizeof(int));
+	msc_index = (int *)calloc(SC_CODES, sizeof(int));
+	if (!bsc_index || !msc_index)
 	    quit("can't allocate memory for system call table\n");
-	bzero(sc_tab,(MAX_SC+msgcode_cnt) * sizeof (struct sc_entry));
-
-	msgcode_tab = (int *)malloc(msgcode_cnt * sizeof(int));
-        if (!msgcode_tab)
-	    quit("can't allocate memory for msgcode table\n");
-	bzero(msgcode_tab,(msgcode_cnt * sizeof(int)));
-
-	sort_by_count = (int *)malloc((MAX_SC + msgcode_cnt + 1) * sizeof(int));
-        if (!sort_by_count)
-	    quit("can't allocate memory for sort_by_count table\n");
-	bzero(sort_by_count,(MAX_SC + msgcode_cnt + 1) * sizeof(int));
-
-	sort_by_wtime = (int *)malloc((MAX_SC + msgcode_cnt + 1) * sizeof(int));
-        if (!sort_by_wtime)
-	    quit("can't allocate memory for sort_by_wtime table\n");
-	bzero(sort_by_wtime, (MAX_SC + msgcode_cnt + 1) * sizeof(int));
-
-
-	rewind(fp);
+	(void)sc_tab_add("");
 
 	for (;;) {
 	        n = fscanf(fp, "%x%55s\n", &code, &name[0]);
@@ -1013,31 +1340,85 @@ sc_tab_init(char *codefile)
 			continue;
 		}
 		if (strncmp("MSG_", &name[0], 4) == 0) {
-		        msgcode_tab[msgcode_indx] = ((code & 0x00ffffff) >>2);
-		        n = MAX_SC + msgcode_indx;
-			strncpy(&sc_tab[n].name[0], &name[4], 31 );
-			msgcode_indx++;
+		        if (msgcode_cnt == msgcode_alloc) {
+			        msgcode_alloc = msgcode_alloc ? msgcode_alloc * 2 : 256;
+				msgcode_tab = (struct msgcode *)reallocf(msgcode_tab, msgcode_alloc * sizeof(struct msgcode));
+				if (!msgcode_tab)
+				    quit("can't allocate memory for msgcode table\n");
+			}
+		        msgcode_tab[msgcode_cnt].code = ((code & 0x00ffffff) >>2);
+			msgcode_tab[msgcode_cnt].index = sc_tab_add(&name[4]);
+			msgcode_cnt++;
 			continue;
 		}
 		if (strncmp("MSC_", &name[0], 4) == 0) {
-		        n = 512 + ((code>>2) & 0x1ff);
-			strcpy(&sc_tab[n].name[0], &name[4]);
+		        n = (code>>2) & (SC_CODES - 1);
+			if (msc_index[n] == 0)
+			        msc_index[n] = sc_tab_add(&name[4]);
 			continue;
 		}
 		if (strncmp("BSC_", &name[0], 4) == 0) {
-		        n = (code>>2) & 0x1ff;
-			strcpy(&sc_tab[n].name[0], &name[4]);
+		        n = (code>>2) & (SC_CODES - 1);
+			if (bsc_index[n] == 0)
+			        bsc_index[n] = sc_tab_add(&name[4]);
 			continue;
 		}
 		if (strcmp("TRACE_LAST_WRAPPER", &name[0]) == 0)
 		        break;
 	}
+	fclose(fp);
+
 	strcpy(&faults[1].name[0], "zero_fill");
 	strcpy(&faults[2].name[0], "pagein");
 	strcpy(&faults[3].name[0], "copy_on_write");
 	strcpy(&faults[4].name[0], "cache_hit");
 }
 
+/*
+ * Add an entry to sc_tab, and grow the sort tables to match.
+ */
+static int
+sc_tab_add(char *name)
+{
+        if (sc_cnt == sc_alloc) {
+	        sc_alloc = sc_alloc ? sc_alloc * 2 : 1024;
+
+		sc_tab = (struct sc_entry *)reallocf(sc_tab, sc_alloc * sizeof(struct sc_entry));
+		sort_by_count = (int *)reallocf(sort_by_count, (sc_alloc + 1) * sizeof(int));
+		sort_by_wtime = (int *)reallocf(sort_by_wtime, (sc_alloc + 1) * sizeof(int));
+		count_pos = (int *)reallocf(count_pos, sc_alloc * sizeof(int));
+		wtime_pos = (int *)reallocf(wtime_pos, sc_alloc * sizeof(int));
+
+		if (!sc_tab || !sort_by_count || !sort_by_wtime || !count_pos || !wtime_pos)
+		    quit("can't allocate memory for system call table\n");
+		if (sc_cnt == 0) {
+		        sort_by_count[0] = -1;
+		        sort_by_wtime[0] = -1;
+		}
+	}
+	bzero(&sc_tab[sc_cnt], sizeof(struct sc_entry));
+	count_pos[sc_cnt] = wtime_pos[sc_cnt] = -1;
+	strncpy(&sc_tab[sc_cnt].name[0], name, sizeof(sc_tab[sc_cnt].name) - 1);
+
+	return (sc_cnt++);
+}
+
+/*
+ * The sc_tab index of a system call or mach trap, adding one for a call
+ * that wasn't in the code file.
+ */
+static int
+find_sc(int *sc_index, int code, char *prefix)
+{
+        char name[64];
+
+	if (sc_index[code] == 0) {
+	        snprintf(name, sizeof(name), "%s%d", prefix, code);
+		sc_index[code] = sc_tab_add(name);
+	}
+	return (sc_index[code]);
+}
+
 static void
 find_proc_names(void)
 {
@@ -1064,14 +1445,387 @@ find_proc_names(void)
 
 static struct th_info *
 find_thread(uint64_t thread)
+{
+       return (kdc_threads_find(&th_table, thread));
+}
+
+static struct th_info *
+add_thread(uint64_t thread)
 {
        struct th_info *ti;
 
-       for (ti = th_state; ti < &th_state[MAX_THREADS]; ti++) {
-	       if (ti->thread == thread)
-		       return(ti);
+       if ((ti = th_freelist))
+	       th_freelist = ti->next;
+       else {
+	       if ((ti = (struct th_info *)calloc(1, sizeof(struct th_info))) == NULL ||
+		   (ti->th_entry = (struct entry *)malloc(INITIAL_NESTED * sizeof(struct entry))) == NULL)
+		       quit("can't allocate memory for thread state\n");
+	       ti->max_depth = INITIAL_NESTED;
        }
-       return ((struct th_info *)0);
+       ti->thread = thread;
+       ti->depth = 0;
+       ti->vfslookup = 0;
+       ti->curpri = 0;
+       ti->pathptr = (int64_t *)NULL;
+       ti->pathname[0] = 0;
+       bzero(&ti->th_entry[0], sizeof(struct entry));
+
+       if (all_procs)
+	       ti->pu = find_thread_proc(thread);
+       else
+	       ti->pu = NULL;
+
+       if (kdc_threads_insert(&th_table, thread, ti) == ti)
+	       quit("can't allocate memory for thread state\n");
+       num_of_threads++;
+
+       return (ti);
+}
+
+/*
+ * Put ti, once it is out of th_table, on the free list.
+ */
+static void
+delete_thread(struct th_info *ti)
+{
+       ti->thread = 0;
+       ti->next = th_freelist;
+       th_freelist = ti;
+       num_of_threads--;
+}
+
+static void
+delete_all_threads(void)
+{
+       struct kdc_threads_walk w;
+       struct th_info *ti;
+
+       kdc_threads_walk_start(&th_table, &w);
+
+       while ((ti = kdc_threads_next(&th_table, &w))) {
+	       ti->thread = 0;
+	       ti->next = th_freelist;
+	       th_freelist = ti;
+       }
+       kdc_threads_clear(&th_table);
+       num_of_threads = 0;
+}
+
+/*
+ * The entry for a call nested one deeper, making room for it if need be.
+ */
+static struct entry *
+push_entry(struct th_info *ti)
+{
+       struct entry *te;
+
+       if (ti->depth == ti->max_depth) {
+	       if ((te = (struct entry *)realloc(ti->th_entry, ti->max_depth * 2 * sizeof(struct entry))) == NULL)
+		       quit("can't allocate memory for thread state\n");
+	       ti->th_entry = te;
+	       ti->max_depth *= 2;
+       }
+       return (&ti->th_entry[ti->depth++]);
+}
+
+/*
+ * Charge a finished call's cpu and wait time to se.
+ */
+static void
+charge_call(struct sc_entry *se, struct entry *te, uint64_t now)
+{
+        int secs;
+	int n;
+	double usecs;
+
+	usecs = ((double)now - te->start) / divisor;
+
+	if (usecs > se->max_usecs)
+	        se->max_usecs = usecs;
+	for (n = 0; n < LAT_BUCKETS - 1 && usecs >= (double)(1U << n); n++)
+	        ;
+	se->lat_hist[n]++;
+
+	se->stime_usecs += te->ctime / divisor;
+	se->stime_usecs += ((double)now - te->stime) / divisor;
+	se->delta_stime_usecs += te->ctime / divisor;
+	se->delta_stime_usecs += ((double)now - te->stime) / divisor;
+
+	se->wtime_usecs += te->wtime / divisor;
+	se->delta_wtime_usecs += te->wtime / divisor;
+
+	secs = se->stime_usecs / 1000000;
+	se->stime_usecs -= secs * 1000000;
+	se->stime_secs += secs;
+
+	secs = se->delta_stime_usecs / 1000000;
+	se->delta_stime_usecs -= secs * 1000000;
+	se->delta_stime_secs += secs;
+
+	secs = se->wtime_usecs / 1000000;
+	se->wtime_usecs -= secs * 1000000;
+	se->wtime_secs += secs;
+
+	secs = se->delta_wtime_usecs / 1000000;
+	se->delta_wtime_usecs -= secs * 1000000;
+	se->delta_wtime_secs += secs;
+}
+
+/*
+ * The elapsed time that fraction of the calls finished within, as the
+ * top of the bucket it falls in but no more than the longest call.
+ */
+static double
+lat_percentile(struct sc_entry *se, double fraction)
+{
+        unsigned int total, want, sum;
+	int n;
+
+	for (total = 0, n = 0; n < LAT_BUCKETS; n++)
+	        total += se->lat_hist[n];
+	if (total == 0)
+	        return (0);
+	want = (unsigned int)(total * fraction);
+	if (want == 0)
+	        want = 1;
+
+	for (sum = 0, n = 0; n < LAT_BUCKETS - 1; n++) {
+	        if ((sum += se->lat_hist[n]) >= want)
+		        break;
+	}
+	if ((double)(1U << n) < se->max_usecs)
+	        return ((double)(1U << n));
+	return (se->max_usecs);
+}
+
+static void
+clear_latency(struct sc_entry *se)
+{
+        se->max_usecs = 0;
+	bzero(se->lat_hist, sizeof(se->lat_hist));
+}
+
+static void
+print_usecs(char *p, double usecs)
+{
+        if (usecs < 1000)
+	        sprintf(p, "%6.0fus", usecs);
+	else if (usecs < 1000000)
+	        sprintf(p, "%6.1fms", usecs / 1000);
+	else
+	        sprintf(p, "%7.1fs", usecs / 1000000);
+}
+
+/*
+ * Charge the time so far of a call that is still waiting to se.
+ */
+static void
+charge_wait(struct sc_entry *se, double usecs)
+{
+        int secs;
+
+	se->waiting++;
+	se->wtime_usecs += usecs;
+	se->delta_wtime_usecs += usecs;
+
+	secs = se->wtime_usecs / 1000000;
+	se->wtime_usecs -= secs * 1000000;
+	se->wtime_secs += secs;
+
+	secs = se->delta_wtime_usecs / 1000000;
+	se->delta_wtime_usecs -= secs * 1000000;
+	se->delta_wtime_secs += secs;
+}
+
+/*
+ * The usage of a process, or with -g of a command, adding it if it's new.
+ */
+static struct proc_usage *
+find_proc_usage(int pid, char *command)
+{
+        struct proc_usage *pu;
+	unsigned int hashid;
+	char *p;
+
+	if (group_by_command) {
+	        for (hashid = 0, p = command; *p; p++)
+		        hashid = hashid * 31 + *p;
+		pid = -1;
+	} else
+	        hashid = pid;
+	hashid &= HASH_MASK;
+
+	for (pu = pu_hash[hashid]; pu; pu = pu->next) {
+	        if (group_by_command) {
+		        if (strcmp(pu->command, command) == 0)
+			        return (pu);
+		} else if (pu->pid == pid)
+		        return (pu);
+	}
+	if ((pu = (struct proc_usage *)calloc(1, sizeof(struct proc_usage))) == NULL)
+	        quit("can't allocate memory for process usage\n");
+
+	pu->pid = pid;
+	strncpy(pu->command, command, MAXCOMLEN);
+
+	if (pid == -1)
+	        snprintf(pu->se.name, sizeof(pu->se.name), "%s", pu->command);
+	else
+	        snprintf(pu->se.name, sizeof(pu->se.name), "%s(%d)", pu->command, pid);
+
+	pu->next = pu_hash[hashid];
+	pu_hash[hashid] = pu;
+	pu->link = pu_list;
+	pu_list = pu;
+	pu_cnt++;
+
+	return (pu);
+}
+
+/*
+ * Who a thread's calls are charged to; threads we haven't seen created
+ * are lumped together.
+ */
+static struct proc_usage *
+find_thread_proc(uint64_t thread)
+{
+        struct proc_usage *pu;
+
+	if ((pu = kdc_threads_find(&tp_table, thread)))
+	        return (pu);
+	return (find_proc_usage(-1, "unknown"));
+}
+
+static void
+set_thread_proc(uint64_t thread, struct proc_usage *pu)
+{
+	struct th_info *ti;
+
+	if (kdc_threads_insert(&tp_table, thread, pu) == pu)
+	        quit("can't allocate memory for thread map\n");
+
+	if ((ti = find_thread(thread)))
+	        ti->pu = pu;
+}
+
+static void
+read_thread_map(void)
+{
+        kd_threadmap *mapptr;
+	int count;
+	int i;
+	char command[MAXCOMLEN + 1];
+
+	if ((mapptr = kdc_threadmap(bufinfo.nkdthreads, &count)) == NULL) {
+	        /*
+		 * Not fatal, the calls just can't be charged to
+		 * the processes that were running when we started
+		 */
+		return;
+	}
+	(void)kdc_threads_reserve(&tp_table, count);
+
+	for (i = 0; i < count; i++) {
+	        if (mapptr[i].valid == 0)
+		        continue;
+		strncpy(command, mapptr[i].command, MAXCOMLEN);
+		command[MAXCOMLEN] = '\0';
+
+		/* valid holds the pid */
+		set_thread_proc(mapptr[i].thread, find_proc_usage(mapptr[i].valid, command));
+	}
+	free(mapptr);
+}
+
+/*
+ * A new thread starts out in its parent's command, in the process it
+ * was created for.
+ */
+static void
+new_thread(uint64_t parent, uint64_t thread, int pid)
+{
+        struct proc_usage *pu;
+
+	pu = find_thread_proc(parent);
+
+	set_thread_proc(thread, find_proc_usage(pid, pu->command));
+}
+
+static void
+exec_thread(uint64_t thread, char *name)
+{
+        struct proc_usage *pu;
+	char command[MAXCOMLEN + 1];
+
+	strncpy(command, name, MAXCOMLEN);
+	command[MAXCOMLEN] = '\0';
+
+	pu = find_thread_proc(thread);
+
+	if (group_by_command)
+	        set_thread_proc(thread, find_proc_usage(-1, command));
+	else if (pu->pid != -1) {
+	        strcpy(pu->command, command);
+	        snprintf(pu->se.name, sizeof(pu->se.name), "%s(%d)", pu->command, pu->pid);
+	}
+}
+
+static int
+proc_compar(const void *p1, const void *p2)
+{
+        struct proc_usage *pu1 = *(struct proc_usage **)p1;
+        struct proc_usage *pu2 = *(struct proc_usage **)p2;
+
+	if (cmp_wtime(&pu1->se, &pu2->se))
+	        return (-1);
+	if (cmp_wtime(&pu2->se, &pu1->se))
+	        return (1);
+	return (pu2->se.total_count - pu1->se.total_count);
+}
+
+/*
+ * Sort the processes that have made calls by their wait time.
+ */
+static void
+sort_procs(void)
+{
+        struct proc_usage *pu;
+	int n;
+
+	if (pu_cnt > sort_by_proc_alloc) {
+	        sort_by_proc_alloc = pu_cnt * 2;
+		sort_by_proc = (struct proc_usage **)reallocf(sort_by_proc, sort_by_proc_alloc * sizeof(struct proc_usage *));
+		if (!sort_by_proc)
+		        quit("can't allocate memory for process usage\n");
+	}
+	for (n = 0, pu = pu_list; pu; pu = pu->link) {
+	        if (pu->se.total_count)
+		        sort_by_proc[n++] = pu;
+	}
+	qsort(sort_by_proc, n, sizeof(struct proc_usage *), proc_compar);
+	sort_by_proc_cnt = n;
+}
+
+static void
+print_procs(int rows)
+{
+        char tbuf[256];
+	int i;
+
+	if (rows <= 0)
+	        return;
+
+	if (no_screen_refresh || COLS >= LAT_COLS)
+	        sprintf(tbuf, "\n%-80s     P99      MAX\n", "PROCESS                        NUMBER        CPU_TIME   WAIT_TIME");
+	else
+	        sprintf(tbuf, "\nPROCESS                        NUMBER        CPU_TIME   WAIT_TIME\n");
+	output(tbuf);
+
+	sprintf(tbuf, "------------------------------------------------------------------------------\n");
+	output(tbuf);
+
+	for (i = 0; i < rows; i++)
+	        print_row(&sort_by_proc[i]->se, 0);
 }
 
 static int
@@ -1089,7 +1843,7 @@ cmp_wtime(struct sc_entry *s1, struct sc_entry *s2)
 static void
 sort_scalls(void)
 {
-        int  i, n, k, cnt, secs;
+	struct kdc_threads_walk w;
 	struct th_info *ti;
 	struct sc_entry *se;
 	struct entry *te;
@@ -1097,10 +1851,9 @@ sort_scalls(void)
 
 	now = mach_absolute_time();
 
-	for (ti = th_state; ti < &th_state[MAX_THREADS]; ti++) {
-	        if (ti->thread == 0)
-		        continue;
+	kdc_threads_walk_start(&th_table, &w);
 
+	while ((ti = kdc_threads_next(&th_table, &w))) {
 	        if (ti->depth) {
 		        te = &ti->th_entry[ti->depth-1];
 
@@ -1109,77 +1862,74 @@ sort_scalls(void)
 				        se = &sc_tab[te->code];
 				else
 				        se = &faults[DBG_PAGEIN_FAULT];
-				se->waiting++;
-			        se->wtime_usecs += ((double)now - te->stime) / divisor;
-			        se->delta_wtime_usecs += ((double)now - te->stime) / divisor;
-				te->stime = (double)now;
+				charge_wait(se, ((double)now - te->stime) / divisor);
 
-				secs = se->wtime_usecs / 1000000;
-				se->wtime_usecs -= secs * 1000000;
-				se->wtime_secs += secs;
+				if (te->code)
+				        sc_update_rank(te->code);
 
-				secs = se->delta_wtime_usecs / 1000000;
-				se->delta_wtime_usecs -= secs * 1000000;
-				se->delta_wtime_secs += secs;
+				if (ti->pu)
+				        charge_wait(&ti->pu->se, ((double)now - te->stime) / divisor);
+				te->stime = (double)now;
 			}
 		} else {
 		        te = &ti->th_entry[0];
 
 			if (te->sc_state == PREEMPTED) {
 			        if ((unsigned long)(((double)now - te->otime) / divisor) > 5000000) {
-				        ti->thread = 0;
-					ti->vfslookup = 0;
-					ti->pathptr = (int64_t *)NULL;
-					ti->pathname[0] = 0;
-					num_of_threads--;
+				        kdc_threads_walk_remove(&th_table, &w);
+				        delete_thread(ti);
 				}
 			}
 		}
 	}
-        if ((called % sort_now) == 0) {
-	        sort_by_count[0] = -1;
-	        sort_by_wtime[0] = -1;
-	        for (cnt = 1, n = 1; n < (MAX_SC + msgcode_cnt); n++) {
-		        if (sc_tab[n].total_count) {
-			        for (i = 0; i < cnt; i++) {
-				        if ((k = sort_by_count[i]) == -1 ||
-					        sc_tab[n].total_count > sc_tab[k].total_count) {
-
-					        for (k = cnt - 1; k >= i; k--)
-						        sort_by_count[k+1] = sort_by_count[k];
-						sort_by_count[i] = n;
-						break;
-					}
-				}
-				if (how_to_sort == 0) {
-				        for (i = 0; i < cnt; i++) {
-					        if ((k = sort_by_wtime[i]) == -1 ||
-						        cmp_wtime(&sc_tab[n], &sc_tab[k])) {
-
-						        for (k = cnt - 1; k >= i; k--)
-							        sort_by_wtime[k+1] = sort_by_wtime[k];
-							sort_by_wtime[i] = n;
-							break;
-						}
-					}
-				}
-				cnt++;
-			}
-		}
+	if (all_procs)
+	        sort_procs();
+}
+
+/*
+ * Move sc_tab[n] up its place in sort_by_count and sort_by_wtime, after
+ * its count or wait time has grown, adding it if it's the first call.
+ */
+static void
+sc_update_rank(int n)
+{
+        int i, k;
+
+	if (count_pos[n] == -1) {
+	        if (sc_tab[n].total_count == 0)
+		        return;
+	        count_pos[n] = wtime_pos[n] = sorted_cnt;
+		sort_by_count[sorted_cnt] = sort_by_wtime[sorted_cnt] = n;
+		sorted_cnt++;
+		sort_by_count[sorted_cnt] = sort_by_wtime[sorted_cnt] = -1;
 	}
-	called++;
+	for (i = count_pos[n]; i > 0; i--) {
+	        k = sort_by_count[i - 1];
+
+		if (sc_tab[n].total_count <= sc_tab[k].total_count)
+		        break;
+		sort_by_count[i] = k;
+		count_pos[k] = i;
+	}
+	sort_by_count[i] = n;
+	count_pos[n] = i;
+
+	for (i = wtime_pos[n]; i > 0; i--) {
+	        k = sort_by_wtime[i - 1];
+
+		if (!cmp_wtime(&sc_tab[n], &sc_tab[k]))
+		        break;
+		sort_by_wtime[i] = k;
+		wtime_pos[k] = i;
+	}
+	sort_by_wtime[i] = n;
+	wtime_pos[n] = i;
 }
 
 static void
 set_enable(int val)
 {
-	mib[0] = CTL_KERN;
-	mib[1] = KERN_KDEBUG;
-	mib[2] = KERN_KDENABLE;		/* protocol */
-	mib[3] = val;
-	mib[4] = 0;
-	mib[5] = 0;		        /* no flags */
-	if (sysctl(mib, 4, NULL, &needed, NULL, 0) < 0)
+	if (kdc_enable(val) < 0)
 	        quit("trace facility failure, KERN_KDENABLE\n");
 
 	if (val)
@@ -1191,42 +1941,17 @@ set_enable(int val)
 static void
 set_numbufs(int nbufs)
 {
-	mib[0] = CTL_KERN;
-	mib[1] = KERN_KDEBUG;
-	mib[2] = KERN_KDSETBUF;
-	mib[3] = nbufs;
-	mib[4] = 0;
-	mib[5] = 0;		        /* no flags */
-	if (sysctl(mib, 4, NULL, &needed, NULL, 0) < 0)
+	if (kdc_setbuf(nbufs) < 0)
 	        quit("trace facility failure, KERN_KDSETBUF\n");
 
-	mib[0] = CTL_KERN;
-	mib[1] = KERN_KDEBUG;
-	mib[2] = KERN_KDSETUP;
-	mib[3] = 0;
-	mib[4] = 0;
-	mib[5] = 0;		        /* no flags */
-	if (sysctl(mib, 3, NULL, &needed, NULL, 0) < 0)
+	if (kdc_setup() < 0)
 	        quit("trace facility failure, KERN_KDSETUP\n");
-
 }
 
 static void
 set_pidcheck(int pid, int on_off)
 {
-        kd_regtype kr;
-
-	kr.type = KDBG_TYPENONE;
-	kr.value1 = pid;
-	kr.value2 = on_off;
-	needed = sizeof(kd_regtype);
-	mib[0] = CTL_KERN;
-	mib[1] = KERN_KDEBUG;
-	mib[2] = KERN_KDPIDTR;
-	mib[3] = 0;
-	mib[4] = 0;
-	mib[5] = 0;
-	if (sysctl(mib, 3, &kr, &needed, NULL, 0) < 0) {
+	if (kdc_pidcheck(KERN_KDPIDTR, pid, on_off) < 0) {
 	        if (on_off == 1) {
 		        printf("pid %d does not exist\n", pid);
 			set_remove();
@@ -1238,16 +1963,8 @@ set_pidcheck(int pid, int on_off)
 void
 get_bufinfo(kbufinfo_t *val)
 {
-        needed = sizeof (*val);
-	mib[0] = CTL_KERN;
-	mib[1] = KERN_KDEBUG;
-	mib[2] = KERN_KDGETBUF;
-	mib[3] = 0;
-	mib[4] = 0;
-	mib[5] = 0;		/* no flags */
-	if (sysctl(mib, 3, val, &needed, 0, 0) < 0)
+	if (kdc_getbuf(val) < 0)
 	        quit("trace facility failure, KERN_KDGETBUF\n");
-
 }
 
 static void
@@ -1257,14 +1974,7 @@ set_remove(void)
 
         errno = 0;
 
-	mib[0] = CTL_KERN;
-	mib[1] = KERN_KDEBUG;
-	mib[2] = KERN_KDREMOVE;		/* protocol */
-	mib[3] = 0;
-	mib[4] = 0;
-	mib[5] = 0;		/* no flags */
-
-	if (sysctl(mib, 3, NULL, &needed, NULL, 0) < 0)
+	if (kdc_remove() < 0)
 	  {
 	    set_remove_flag = 0;
 
@@ -1278,28 +1988,10 @@ set_remove(void)
 static void
 set_init(void)
 {
-	kd_regtype kr;
-
-	kr.type = KDBG_RANGETYPE;
-	kr.value1 = 0;
-	kr.value2 = -1;
-	needed = sizeof(kd_regtype);
-	mib[0] = CTL_KERN;
-	mib[1] = KERN_KDEBUG;
-	mib[2] = KERN_KDSETREG;
-	mib[3] = 0;
-	mib[4] = 0;
-	mib[5] = 0;		/* no flags */
-	if (sysctl(mib, 3, &kr, &needed, NULL, 0) < 0)
+	if (kdc_setreg(KDBG_RANGETYPE, 0, -1) < 0)
 	        quit("trace facility failure, KERN_KDSETREG\n");
 
-	mib[0] = CTL_KERN;
-	mib[1] = KERN_KDEBUG;
-	mib[2] = KERN_KDSETUP;
-	mib[3] = 0;
-	mib[4] = 0;
-	mib[5] = 0;		/* no flags */
-	if (sysctl(mib, 3, NULL, &needed, NULL, 0) < 0)
+	if (kdc_setup() < 0)
 	        quit("trace facility failure, KERN_KDSETUP\n");
 }
 
@@ -1317,33 +2009,20 @@ sample_sc(void)
 	get_bufinfo(&bufinfo);
 
 	needed = bufinfo.nkdbufs * sizeof(kd_buf);
-	mib[0] = CTL_KERN;
-	mib[1] = KERN_KDEBUG;
-	mib[2] = KERN_KDREADTR;
-	mib[3] = 0;
-	mib[4] = 0;
-	mib[5] = 0;
 
-	if (sysctl(mib, 3, my_buffer, &needed, NULL, 0) < 0)
+	if (kdc_readtr(my_buffer, &needed) < 0)
 		quit("trace facility failure, KERN_KDREADTR\n");
 
 	count = needed;
 
-	if (bufinfo.flags & KDBG_WRAPPED) {
-	        for (i = 0; i < MAX_THREADS; i++) {
-		        th_state[i].depth = 0;
-			th_state[i].thread = 0;
-			th_state[i].vfslookup = 0;
-			th_state[i].pathptr = (int64_t *)NULL;
-			th_state[i].pathname[0] = 0;
-		}
-		num_of_threads = 0;
-	}
+	if (bufinfo.flags & KDBG_WRAPPED)
+	        delete_all_threads();
 
 #ifdef OLD_KDEBUG
 	set_remove();
 	set_init();
-	set_pidcheck(pid, 1);
+	if (all_procs == 0)
+	        set_pidcheck(pid, 1);
 	set_enable(1);          /* re-enable kernel logging */
 #endif
 	kd = (kd_buf *)my_buffer;
@@ -1369,6 +2048,16 @@ sample_sc(void)
 
 		baseid = debugid & 0xffff0000;
 
+		if (all_procs) {
+		        if (type == TRACE_DATA_NEWTHREAD) {
+			        new_thread(thread, kd[i].arg1, (int)kd[i].arg2);
+				continue;
+			}
+			if (type == TRACE_STRING_EXEC) {
+			        exec_thread(thread, (char *)&kd[i].arg1);
+				continue;
+			}
+		}
 		if (type == vfs_lookup) {
 		        int64_t *sargptr;
 
@@ -1429,9 +2118,9 @@ sample_sc(void)
 			continue;
 
 		} else if (baseid == bsc_base)
-		        code = (debugid >> 2) & 0x1ff;
+		        code = find_sc(bsc_index, (debugid >> 2) & (SC_CODES - 1), "bsc_");
 		else if (baseid == msc_base)
-		        code = 512 + ((debugid >> 2) & 0x1ff);
+		        code = find_sc(msc_index, (debugid >> 2) & (SC_CODES - 1), "msc_");
 		else if (type == mach_idle) {
 			if (debugid & DBG_FUNC_START) {
 				switched_out = find_thread(kd[i].arg5);
@@ -1552,17 +2241,8 @@ sample_sc(void)
 			}
 			continue;
 		}
-		if ((ti = find_thread(thread)) == (struct th_info *)0) {
-		        for (ti = &th_state[0]; ti < &th_state[MAX_THREADS]; ti++) {
-			        if (ti->thread == 0) {
-				        ti->thread = thread;
-					num_of_threads++;
-					break;
-				}
-			}
-			if (ti == &th_state[MAX_THREADS])
-			        continue;
-		}
+		if ((ti = find_thread(thread)) == (struct th_info *)0)
+		        ti = add_thread(thread);
 		if (debugid & DBG_FUNC_START) {
 		        ti->vfslookup = 0;
 
@@ -1580,18 +2260,16 @@ sample_sc(void)
 			te->stime = (double)now;
 			te->otime = (double)now;
 
-			if (ti->depth < MAX_NESTED) {
-			        te = &ti->th_entry[ti->depth];
+			te = push_entry(ti);
 
-			        te->sc_state = KERNEL_MODE;
-				te->type = type;
-				te->code = code;
-				te->stime = (double)now;
-				te->otime = (double)now;
-				te->ctime = (double)0;
-				te->wtime = (double)0;
-				ti->depth++;
-			}
+			te->sc_state = KERNEL_MODE;
+			te->type = type;
+			te->code = code;
+			te->stime = (double)now;
+			te->otime = (double)now;
+			te->start = (double)now;
+			te->ctime = (double)0;
+			te->wtime = (double)0;
 
 		} else if (debugid & DBG_FUNC_END) {
 		        if (code) {
@@ -1601,32 +2279,22 @@ sample_sc(void)
 			        se = &faults[kd[i].arg4];
 				total_faults++;
 			}
-			if (se->total_count == 0)
-			        called = 0;
 			se->delta_count++;
 			se->total_count++;
 
+			if (ti->pu) {
+			        ti->pu->se.delta_count++;
+			        ti->pu->se.total_count++;
+			}
+
 		        while (ti->depth) {
 			        te = &ti->th_entry[ti->depth-1];
 
 			        if (te->type == type) {
-				        se->stime_usecs += te->ctime / divisor;
-					se->stime_usecs += ((double)now - te->stime) / divisor;
-
-					se->wtime_usecs += te->wtime / divisor;
-					se->delta_wtime_usecs += te->wtime / divisor;
-
-					secs = se->stime_usecs / 1000000;
-					se->stime_usecs -= secs * 1000000;
-					se->stime_secs += secs;
+				        charge_call(se, te, now);
 
-					secs = se->wtime_usecs / 1000000;
-					se->wtime_usecs -= secs * 1000000;
-					se->wtime_secs += secs;
-
-					secs = se->delta_wtime_usecs / 1000000;
-					se->delta_wtime_usecs -= secs * 1000000;
-					se->delta_wtime_secs += secs;
+					if (ti->pu)
+					        charge_call(&ti->pu->se, te, now);
 
 					ti->depth--;
 
@@ -1658,6 +2326,8 @@ sample_sc(void)
 					te->otime = (double)now;
 				}
 			}
+			if (code)
+			        sc_update_rank(code);
 		}
 	}
 	secs = utime_usecs / 1000000;
@@ -1712,11 +2382,11 @@ quit(char *s)
 static void
 getdivisor(void)
 {
-	mach_timebase_info_data_t info;
+	struct kdc_timebase tb;
 
-	(void) mach_timebase_info (&info);
+	kdc_timebase_init(&tb);
 
-	divisor = ( (double)info.denom / (double)info.numer) * 1000;
+	divisor = tb.divisor;
 }
 
 int
@@ -1768,11 +2438,22 @@ find_msgcode(int debugid)
 	int indx;
 
 	for (indx=0; indx< msgcode_cnt; indx++) {
-		if (msgcode_tab[indx] == ((debugid & 0x00ffffff) >>2))
-			return (MAX_SC+indx);
+		if (msgcode_tab[indx].code == ((debugid & 0x00ffffff) >>2))
+			return (msgcode_tab[indx].index);
 	}
 	return (0);
 }
+double
+argtod(int flag, char *req, char *str)
+{
+	char *cp;
+	double ret;
+
+	ret = strtod(str, &cp);
+	if (cp == str || *cp)
+		errx(EINVAL, "-%c flag requires a %s", flag, req);
+	return (ret);
+}
 
 int
 argtoi(int flag, char *req, char *str, int base)
@@ -14,6 +14,8 @@
 #include <kern/debug.h>
 #include <unistd.h>
 #include <assert.h>
+#include <errno.h>
+#include <signal.h>
 
 #include <kern/kcdata.h>
 
@@ -28,6 +30,441 @@ stackshot_get_mach_absolute_time(void *buffer, uint32_t size)
     return *(uint64_t *)kcdata_iter_payload(iter);
 }
 
+/*
+ * Sampling mode (-r) writes a stream of stackshots: a stream header, then
+ * one frame per capture.  The first frame is a full stackshot and each one
+ * after it a delta against the capture before.
+ *
+ * With a ring size (-R), the file after the header is split into two
+ * regions that are used in turn, each starting with a full stackshot, and
+ * an end frame is kept after the last frame written in a region.  A reader
+ * takes the frames of both regions up to their end frames, oldest region
+ * (by sequence number) first, so at least half the ring of recent history
+ * is always there.
+ */
+#define STACKSHOT_STREAM_MAGIC  0x53535452  /* 'SSTR' */
+#define STACKSHOT_STREAM_VERSION 1
+#define STACKSHOT_FRAME_MAGIC   0x53534652  /* 'SSFR' */
+
+enum {
+    STACKSHOT_FRAME_FULL = 1,
+    STACKSHOT_FRAME_DELTA = 2,
+    STACKSHOT_FRAME_END = 3,
+};
+
+struct stackshot_stream_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t regions;       /* 0 if not a ring, otherwise 2 */
+    uint32_t reserved;
+    uint64_t region_size;
+};
+
+struct stackshot_frame_header {
+    uint32_t magic;
+    uint32_t type;
+    uint64_t seq;
+    uint64_t timestamp;     /* mach_absolute_time() of the capture */
+    uint64_t length;        /* bytes of kcdata that follow */
+};
+
+static volatile sig_atomic_t stopping;
+
+static void
+stop(int sig __unused)
+{
+    stopping = 1;
+}
+
+/* Write all of buf, at *offp if offp isn't NULL, else at the file offset. */
+static int
+write_all(int fd, const void *buf, size_t len, off_t *offp)
+{
+    const char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = offp ? pwrite(fd, p, len, *offp) : write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("write");
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+        if (offp)
+            *offp += n;
+    }
+    return 0;
+}
+
+static int
+write_frame(int fd, off_t *offp, uint32_t type, uint64_t seq, uint64_t timestamp,
+    const void *buf, uint32_t size)
+{
+    struct stackshot_frame_header fh = {
+        .magic = STACKSHOT_FRAME_MAGIC,
+        .type = type,
+        .seq = seq,
+        .timestamp = timestamp,
+        .length = size,
+    };
+
+    if (write_all(fd, &fh, sizeof(fh), offp) != 0)
+        return -1;
+    return size ? write_all(fd, buf, size, offp) : 0;
+}
+
+/* Take a stackshot, or a delta one against since if it isn't zero. */
+static int
+capture(void *config, uint32_t flags, uint64_t since, void **bufp, uint32_t *sizep)
+{
+    int err;
+
+    if (stackshot_config_get_stackshot_buffer(config) != NULL) {
+        err = stackshot_config_dealloc_buffer(config);
+        assert(!err);
+    }
+
+    err = stackshot_config_set_flags(config, since ? (flags | STACKSHOT_COLLECT_DELTA_SNAPSHOT) : flags);
+    if (err != 0) {
+        perror("stackshot_config_set_flags");
+        return -1;
+    }
+
+    if (since) {
+        err = stackshot_config_set_delta_timestamp(config, since);
+        if (err != 0) {
+            perror("stackshot_config_delta_timestamp");
+            return -1;
+        }
+    }
+
+    err = stackshot_capture_with_config(config);
+    if (err != 0) {
+        perror("stackshot_capture_with_config");
+        return -1;
+    }
+
+    *bufp = stackshot_config_get_stackshot_buffer(config);
+    if (!*bufp) {
+        perror("stackshot_config_get_stackshot_buffer");
+        return -1;
+    }
+
+    *sizep = stackshot_config_get_stackshot_size(config);
+    return 0;
+}
+
+/*
+ * Capture at rate Hz until count frames are written (forever if count is
+ * zero) or we are interrupted.
+ */
+static int
+sample(void *config, uint32_t flags, int fd, double rate, uint64_t count, uint64_t ring)
+{
+    struct stackshot_stream_header sh = {
+        .magic = STACKSHOT_STREAM_MAGIC,
+        .version = STACKSHOT_STREAM_VERSION,
+        .regions = ring ? 2 : 0,
+        .region_size = ring ? (ring - sizeof(sh)) / 2 : 0,
+    };
+    const off_t frame_overhead = 2 * sizeof(struct stackshot_frame_header);
+    mach_timebase_info_data_t tb;
+    uint64_t interval, deadline, now;
+    uint64_t seq = 0, last = 0;
+    off_t pos = 0, region_end = 0;
+    off_t *posp = ring ? &pos : NULL;
+    int region = 0;
+    void *buf;
+    uint32_t size, type;
+
+    mach_timebase_info(&tb);
+    interval = (uint64_t)(1e9 / rate) * tb.denom / tb.numer;
+
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+
+    if (write_all(fd, &sh, sizeof(sh), posp) != 0)
+        return 1;
+    region_end = sizeof(sh) + (off_t)sh.region_size;
+
+    deadline = mach_absolute_time();
+    while (!stopping && (count == 0 || seq < count)) {
+        if (capture(config, flags, last, &buf, &size) != 0)
+            return 1;
+        type = last ? STACKSHOT_FRAME_DELTA : STACKSHOT_FRAME_FULL;
+
+        if (ring && pos + frame_overhead + size > region_end) {
+            /* Switch regions; the new one has to start with a full stackshot. */
+            region ^= 1;
+            pos = sizeof(sh) + region * (off_t)sh.region_size;
+            region_end = pos + (off_t)sh.region_size;
+            if (type == STACKSHOT_FRAME_DELTA) {
+                if (capture(config, flags, 0, &buf, &size) != 0)
+                    return 1;
+                type = STACKSHOT_FRAME_FULL;
+            }
+            if (pos + frame_overhead + size > region_end) {
+                fprintf(stderr, "ring size too small for a %u byte stackshot\n", size);
+                return 1;
+            }
+        }
+
+        last = stackshot_get_mach_absolute_time(buf, size);
+        if (write_frame(fd, posp, type, seq++, last, buf, size) != 0)
+            return 1;
+        if (ring) {
+            off_t end = pos;
+
+            if (write_frame(fd, &end, STACKSHOT_FRAME_END, seq, last, NULL, 0) != 0)
+                return 1;
+        }
+
+        /* Keep to the rate, but don't try to make up for slow captures. */
+        deadline += interval;
+        now = mach_absolute_time();
+        if (deadline > now)
+            mach_wait_until(deadline);
+        else
+            deadline = now;
+    }
+
+    return 0;
+}
+
+/*
+ * Stress mode (-S) captures back to back and reports what each capture
+ * cost.  The optional flags below can be benchmarked in every combination
+ * (-A), a report interval at a time.
+ */
+#define STRESS_MAX_RETRIES      10
+#define STRESS_HIST_BUCKETS     32      /* by log2 of microseconds */
+
+enum {
+    STRESS_OPT_INSTRS = 0x01,           /* -i */
+    STRESS_OPT_COALITIONS = 0x02,       /* -c */
+    STRESS_OPT_THREAD_GROUP = 0x04,     /* -g */
+    STRESS_OPT_NO_LOADINFO = 0x08,      /* -L */
+    STRESS_OPT_NO_IOSTATS = 0x10,       /* -I */
+    STRESS_OPT_ALL = 0x1f,
+};
+
+static const struct {
+    uint32_t opt;
+    const char *name;
+} stress_opt_names[] = {
+    { STRESS_OPT_INSTRS, "-i" },
+    { STRESS_OPT_COALITIONS, "-c" },
+    { STRESS_OPT_THREAD_GROUP, "-g" },
+    { STRESS_OPT_NO_LOADINFO, "-L" },
+    { STRESS_OPT_NO_IOSTATS, "-I" },
+};
+
+struct stress_stats {
+    uint32_t opts;
+    uint64_t captures;
+    uint64_t retries;
+    uint64_t failures;
+    uint64_t min_ns, max_ns, total_ns;
+    uint64_t min_size, max_size, total_size;
+    uint64_t hist[STRESS_HIST_BUCKETS];
+};
+
+static mach_timebase_info_data_t timebase;
+
+static uint64_t
+abs_to_ns(uint64_t t)
+{
+    if (timebase.denom == 0)
+        mach_timebase_info(&timebase);
+    return t * timebase.numer / timebase.denom;
+}
+
+static uint64_t
+ns_to_abs(uint64_t ns)
+{
+    if (timebase.denom == 0)
+        mach_timebase_info(&timebase);
+    return ns * timebase.denom / timebase.numer;
+}
+
+static void
+stress_record(struct stress_stats *st, uint64_t ns, uint32_t size)
+{
+    uint64_t us = ns / 1000;
+    int bucket = 0;
+
+    while (us > 1 && bucket < STRESS_HIST_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    st->hist[bucket]++;
+
+    if (st->captures == 0 || ns < st->min_ns)
+        st->min_ns = ns;
+    if (ns > st->max_ns)
+        st->max_ns = ns;
+    if (st->captures == 0 || size < st->min_size)
+        st->min_size = size;
+    if (size > st->max_size)
+        st->max_size = size;
+    st->total_ns += ns;
+    st->total_size += size;
+    st->captures++;
+}
+
+static void
+stress_report(const struct stress_stats *st)
+{
+    uint64_t most = 0;
+    size_t i;
+    int b, lo, hi;
+
+    printf("flags:");
+    for (i = 0; i < sizeof(stress_opt_names) / sizeof(stress_opt_names[0]); i++) {
+        if (st->opts & stress_opt_names[i].opt)
+            printf(" %s", stress_opt_names[i].name);
+    }
+    if (st->opts == 0)
+        printf(" (none)");
+    printf("\n");
+
+    printf("  %" PRIu64 " captures, %" PRIu64 " retries, %" PRIu64 " failures\n",
+        st->captures, st->retries, st->failures);
+    if (st->captures == 0)
+        return;
+    printf("  latency min/avg/max %.3f/%.3f/%.3f ms\n", st->min_ns / 1e6,
+        st->total_ns / 1e6 / st->captures, st->max_ns / 1e6);
+    printf("  size    min/avg/max %" PRIu64 "/%" PRIu64 "/%" PRIu64 " KB\n",
+        st->min_size >> 10, (st->total_size / st->captures) >> 10, st->max_size >> 10);
+
+    for (lo = 0; lo < STRESS_HIST_BUCKETS && st->hist[lo] == 0; lo++)
+        ;
+    for (hi = STRESS_HIST_BUCKETS - 1; hi > lo && st->hist[hi] == 0; hi--)
+        ;
+    for (b = lo; b <= hi; b++) {
+        if (st->hist[b] > most)
+            most = st->hist[b];
+    }
+    for (b = lo; b <= hi; b++) {
+        int bar = (int)(st->hist[b] * 40 / most);
+
+        printf("  %8llu us %10" PRIu64 " %.*s\n", b ? 1ULL << b : 0ULL, st->hist[b], bar,
+            "****************************************");
+    }
+    fflush(stdout);
+}
+
+/*
+ * Capture as fast as we can until count captures are done (forever if
+ * count is zero) or we are interrupted, printing the statistics every
+ * second.  opts chooses among the optional flags; with all_combos, each
+ * second moves on to the next combination of them.  With delta, each
+ * capture after the first is a delta against the one before.
+ */
+static int
+stress_test(uint32_t base_flags, uint32_t loadinfo, uint32_t opts, boolean_t all_combos,
+    boolean_t delta, pid_t pid, uint64_t count)
+{
+    struct stress_stats stats[STRESS_OPT_ALL + 1];
+    struct stress_stats *st;
+    uint32_t combo = all_combos ? 0 : opts;
+    uint64_t done = 0, last = 0, start, report_at, one_second;
+    void *config, *buf;
+    uint32_t size, flags;
+    int tries, ok;
+
+    memset(stats, 0, sizeof(stats));
+    one_second = ns_to_abs(1000000000ULL);
+    report_at = mach_absolute_time() + one_second;
+
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+
+    config = stackshot_config_create();
+    if (!config) {
+        perror("stackshot_config_create");
+        return 1;
+    }
+    if (pid != -1 && stackshot_config_set_pid(config, pid) != 0) {
+        perror("stackshot_config_set_pid");
+        return 1;
+    }
+
+    while (!stopping && (count == 0 || done < count)) {
+        st = &stats[combo];
+        st->opts = combo;
+        flags = base_flags |
+            ((combo & STRESS_OPT_INSTRS) ? STACKSHOT_INSTRS_CYCLES : 0) |
+            ((combo & STRESS_OPT_COALITIONS) ? STACKSHOT_SAVE_JETSAM_COALITIONS : 0) |
+            ((combo & STRESS_OPT_THREAD_GROUP) ? STACKSHOT_THREAD_GROUP : 0) |
+            ((combo & STRESS_OPT_NO_LOADINFO) ? 0 : loadinfo) |
+            ((combo & STRESS_OPT_NO_IOSTATS) ? STACKSHOT_NO_IO_STATS : 0);
+        /* Delta stackshots don't support thread groups. */
+        if (!delta || (combo & STRESS_OPT_THREAD_GROUP))
+            last = 0;
+
+        /* The latency includes any retries. */
+        start = mach_absolute_time();
+        for (tries = 0; !(ok = (capture(config, flags, last, &buf, &size) == 0)) &&
+            tries < STRESS_MAX_RETRIES && !stopping; tries++)
+            ;
+        st->retries += tries;
+        if (!ok) {
+            st->failures++;
+            last = 0;
+        } else {
+            stress_record(st, abs_to_ns(mach_absolute_time() - start), size);
+            last = stackshot_get_mach_absolute_time(buf, size);
+        }
+        done++;
+
+        if (mach_absolute_time() >= report_at) {
+            stress_report(st);
+            report_at = mach_absolute_time() + one_second;
+            if (all_combos) {
+                /* Next combination of the given options. */
+                combo = (combo - opts) & opts;
+                last = 0;
+            }
+        }
+    }
+
+    printf("totals:\n");
+    for (combo = 0; combo <= STRESS_OPT_ALL; combo++) {
+        if (stats[combo].captures || stats[combo].failures)
+            stress_report(&stats[combo]);
+    }
+    stackshot_config_dealloc(config);
+    return 0;
+}
+
+static uint64_t
+parse_size(const char *arg)
+{
+    char *end;
+    unsigned long long size = strtoull(arg, &end, 10);
+
+    switch (*end) {
+    case 'k': case 'K':
+        size <<= 10;
+        end++;
+        break;
+    case 'm': case 'M':
+        size <<= 20;
+        end++;
+        break;
+    case 'g': case 'G':
+        size <<= 30;
+        end++;
+        break;
+    }
+    if (*end != '\0' || end == arg)
+        return 0;
+    return size;
+}
+
 __dead2 static void usage(char **argv)
 {
     fprintf (stderr, "usage: %s [options] [file]\n", argv[0]);
@@ -40,9 +477,13 @@ __dead2 static void usage(char **argv)
     fprintf (stderr, "    -L      : disable loadinfo\n");
     fprintf (stderr, "    -k      : active kernel threads only\n");
     fprintf (stderr, "    -I      : disable io statistics\n");
-    fprintf (stderr, "    -S      : stress test: while(1) stackshot; \n");
+    fprintf (stderr, "    -S      : stress test: capture back to back, reporting latency and size\n");
+    fprintf (stderr, "    -A      : with -S, cycle through every combination of -i, -c, -g, -L and -I given\n");
     fprintf (stderr, "    -p PID  : target a pid\n");
     fprintf (stderr, "    -E      : grab existing kernel buffer\n");
+    fprintf (stderr, "    -r HZ   : sample: a stackshot, then deltas HZ times a second\n");
+    fprintf (stderr, "    -n N    : stop sampling or stress testing after N stackshots\n");
+    fprintf (stderr, "    -R SIZE : keep the sample file to SIZE bytes (k, m or g suffix) as a ring\n");
     fprintf (stderr, "If no file is provided and stdout is not a TTY, the stackshot will be written to stdout.\n");
     exit(1);
 }
@@ -75,15 +516,21 @@ int main(int argc, char **argv) {
     boolean_t delta = FALSE;
     boolean_t sleep = FALSE;
     boolean_t stress = FALSE;
+    boolean_t all_combos = FALSE;
+    uint32_t stress_opts = 0;
     pid_t pid = -1;
+    double rate = 0;
+    uint64_t count = 0;
+    uint64_t ring = 0;
     int c;
     FILE *file;
     bool closefile;
 
-    while ((c = getopt(argc, argv, "SgIikbcLdtsp:E")) != -1) {
+    while ((c = getopt(argc, argv, "SgIikbcLdtsp:Er:n:R:A")) != -1) {
         switch(c) {
         case 'I':
             iostats |= STACKSHOT_NO_IO_STATS;
+            stress_opts |= STRESS_OPT_NO_IOSTATS;
             break;
         case 'k':
             active_kernel_threads_only |= STACKSHOT_ACTIVE_KERNEL_THREADS_ONLY;
@@ -94,15 +541,19 @@ int main(int argc, char **argv) {
             break;
         case 'c':
             coalition |= STACKSHOT_SAVE_JETSAM_COALITIONS;
+            stress_opts |= STRESS_OPT_COALITIONS;
             break;
         case 'i':
             instrs_cycles |= STACKSHOT_INSTRS_CYCLES;
+            stress_opts |= STRESS_OPT_INSTRS;
             break;
         case 'L':
             loadinfo = 0;
+            stress_opts |= STRESS_OPT_NO_LOADINFO;
             break;
         case 'g':
             thread_group |= STACKSHOT_THREAD_GROUP;
+            stress_opts |= STRESS_OPT_THREAD_GROUP;
             break;
         case 'd':
             delta = TRUE;
@@ -116,9 +567,29 @@ int main(int argc, char **argv) {
         case 'S':
             stress = TRUE;
             break;
+        case 'A':
+            all_combos = TRUE;
+            break;
         case 'E':
             flags = flags | STACKSHOT_RETRIEVE_EXISTING_BUFFER;
             break;
+        case 'r':
+            rate = strtod(optarg, NULL);
+            if (rate <= 0 || rate > 1000) {
+                fprintf(stderr, "sampling rate must be more than 0 and at most 1000 Hz\n");
+                return 1;
+            }
+            break;
+        case 'n':
+            count = strtoull(optarg, NULL, 10);
+            break;
+        case 'R':
+            ring = parse_size(optarg);
+            if (ring <= sizeof(struct stackshot_stream_header)) {
+                fprintf(stderr, "bad ring size: %s\n", optarg);
+                return 1;
+            }
+            break;
         case '?':
         case 'h':
         default:
@@ -127,11 +598,40 @@ int main(int argc, char **argv) {
         }
     }
 
-    if (thread_group && delta) {
+    if (all_combos && !stress) {
+        fprintf(stderr, "-A needs stress mode (-S)\n");
+        return 1;
+    }
+
+    if (stress) {
+        /* -L is one of the options being measured; keep -k's loadinfo choice. */
+        loadinfo = STACKSHOT_SAVE_LOADINFO | STACKSHOT_SAVE_KEXT_LOADINFO;
+        if (active_kernel_threads_only)
+            loadinfo &= ~STACKSHOT_SAVE_LOADINFO;
+        if (rate || ring || optind != argc) {
+            fprintf(stderr, "-S takes no output file and can't be used with -r or -R\n");
+            return 1;
+        }
+        return stress_test(flags | STACKSHOT_SAVE_IMP_DONATION_PIDS | STACKSHOT_GET_DQ |
+            STACKSHOT_KCDATA_FORMAT | STACKSHOT_THREAD_WAITINFO | bootprofile |
+            active_kernel_threads_only, loadinfo, stress_opts, all_combos, delta, pid, count);
+    }
+
+    if (thread_group && (delta || rate)) {
         fprintf(stderr, "stackshot does not support delta snapshots with thread groups\n");
         return 1;
     }
 
+    if ((count || ring) && !rate) {
+        fprintf(stderr, "-n and -R need a sampling rate (-r) or -S\n");
+        return 1;
+    }
+
+    if (rate && (delta || (flags & STACKSHOT_RETRIEVE_EXISTING_BUFFER))) {
+        fprintf(stderr, "-r can't be used with -d or -E\n");
+        return 1;
+    }
+
     if (optind == argc - 1) {
         const char *const filename = argv[optind];
         file = fopen(filename, "wx");
@@ -148,8 +648,10 @@ int main(int argc, char **argv) {
         usage(argv);
     }
 
-top:
-    ;
+    if (ring && !closefile) {
+        fprintf(stderr, "-R needs an output file\n");
+        return 1;
+    }
 
     void * config = stackshot_config_create();
     if (!config) {
@@ -173,6 +675,15 @@ top:
         }
     }
 
+    if (rate) {
+        err = sample(config, flags, fileno(file), rate, count, ring);
+        stackshot_config_dealloc(config);
+        if (closefile) {
+            fclose(file);
+        }
+        return err;
+    }
+
     err = stackshot_capture_with_config(config);
     if (err != 0) {
         perror("stackshot_capture_with_config");
@@ -230,14 +741,6 @@ top:
 
     }
 
-    if (stress) {
-        if (config) {
-            stackshot_config_dealloc(config);
-            config = NULL;
-        }
-        goto top;
-    }
-
     fwrite(buf, size, 1, file);
 
     if (closefile) {
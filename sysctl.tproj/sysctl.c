@@ -62,16 +62,62 @@ __unused static const char rcsid[] =
 #include <locale.h>
 #ifdef __APPLE__
 #endif
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 static int	aflag, bflag, dflag, eflag, hflag, iflag;
-static int	Nflag, nflag, oflag, qflag, xflag, warncount;
+static int	Nflag, nflag, jflag, oflag, qflag, vflag, xflag, warncount;
+static int	json_entries;
+static const char *cachefile;
+static long	sysctl_calls;
+static u_int	watch_interval;
+static struct oidlist {
+	struct oidval	*ovs;
+	size_t		count;
+	size_t		alloc;
+} watchlist;
+
+#define	FETCH_THREADS	8	/* most threads fetching values for -a */
+#define	FETCH_BATCH	32	/* fewer variables are fetched serially */
+
+/*
+ * Cache of name -> OID and OID -> format resolutions, kept on disk with -c
+ * so that repeated runs can skip the {0,3} and {0,4} queries entirely.
+ */
+struct oident {
+	struct oident	*next;		/* all entries, for saving */
+	struct oident	*nhnext;	/* name hash chain */
+	struct oident	*ohnext;	/* OID hash chain */
+	int		oid[CTL_MAXNAME];
+	int		len;
+	u_int		kind;
+	char		*name;
+	char		*fmt;
+};
+
+#define	OIDHASHSIZE	256
+static struct oident *oidcache, *namehash[OIDHASHSIZE], *oidhash[OIDHASHSIZE];
+static int	oidcache_dirty;
 
 static int	oidfmt(int *, int, char *, u_int *);
 static void	parse(const char *);
+static void	parsefile(const char *);
+static struct oident *oidcache_byname(const char *);
+static struct oident *oidcache_byoid(int *, int);
+static void	oidcache_add(const char *, int *, int, u_int, const char *);
+static void	oidcache_load(void);
+static void	oidcache_save(void);
+static int	do_sysctl(int *, u_int, void *, size_t *, void *, size_t);
+static void	report_calls(void);
+static void	oidlist_add(struct oidlist *, int *, int);
+static void	collect_oids(int *, int, struct oidlist *);
+static void	watch(struct oidlist *, u_int);
+static void	json_string(const char *, size_t);
+static void	json_end(void);
+static void	print_name(const char *, const char *);
 #ifdef __APPLE__
 static int	show_var(int *, int, int);
 #else
@@ -104,22 +150,24 @@ static void
 usage(void)
 {
 
-	(void)fprintf(stderr, "%s\n%s\n",
-	    "usage: sysctl [-bdehiNnoqx] name[=value] ...",
-	    "       sysctl [-bdehNnoqx] -a");
+	(void)fprintf(stderr, "%s\n%s\n%s\n%s\n",
+	    "usage: sysctl [-bdehijNnoqvx] [-c cachefile] name[=value] ...",
+	    "       sysctl [-bdehijNnoqvx] [-c cachefile] -f filename",
+	    "       sysctl [-bdehjNnoqvx] -a",
+	    "       sysctl [-ehinqvx] [-c cachefile] [-f filename] -W interval name ...");
 	exit(1);
 }
 
 int
 main(int argc, char **argv)
 {
+	const char *filename = NULL;
+	char *endptr;
 	int ch;
 
 	setlocale(LC_NUMERIC, "");
-	setbuf(stdout,0);
-	setbuf(stderr,0);
 
-	while ((ch = getopt(argc, argv, "AabdehiNnoqwxX")) != -1) {
+	while ((ch = getopt(argc, argv, "Aabc:def:hijNnoqvW:wxX")) != -1) {
 		switch (ch) {
 		case 'A':
 			/* compatibility */
@@ -131,18 +179,27 @@ main(int argc, char **argv)
 		case 'b':
 			bflag = 1;
 			break;
+		case 'c':
+			cachefile = optarg;
+			break;
 		case 'd':
 			dflag = 1;
 			break;
 		case 'e':
 			eflag = 1;
 			break;
+		case 'f':
+			filename = optarg;
+			break;
 		case 'h':
 			hflag = 1;
 			break;
 		case 'i':
 			iflag = 1;
 			break;
+		case 'j':
+			jflag = 1;
+			break;
 		case 'N':
 			Nflag = 1;
 			break;
@@ -155,6 +212,15 @@ main(int argc, char **argv)
 		case 'q':
 			qflag = 1;
 			break;
+		case 'v':
+			vflag = 1;
+			break;
+		case 'W':
+			watch_interval = (u_int)strtoul(optarg, &endptr, 10);
+			if (*optarg == '\0' || *endptr != '\0' ||
+			    watch_interval == 0)
+				errx(1, "invalid interval '%s'", optarg);
+			break;
 		case 'w':
 			/* compatibility */
 			/* ignored */
@@ -175,14 +241,44 @@ main(int argc, char **argv)
 
 	if (Nflag && nflag)
 		usage();
-	if (aflag && argc == 0)
-		exit(sysctl_all(0, 0));
-	if (argc == 0)
+	if (watch_interval && (aflag || bflag || dflag || Nflag))
+		usage();
+	if (jflag && (bflag || Nflag || nflag || watch_interval))
+		usage();
+	if (jflag)
+		setlocale(LC_NUMERIC, "C");
+
+	/*
+	 * A batch prints its values with a single write where possible,
+	 * rather than one per printf.
+	 */
+	if (filename == NULL)
+		setbuf(stdout,0);
+	setbuf(stderr,0);
+	if (vflag)
+		atexit(report_calls);
+
+	if (aflag && argc == 0 && filename == NULL) {
+		ch = sysctl_all(0, 0);
+		json_end();
+		exit(ch);
+	}
+	if (argc == 0 && filename == NULL)
 		usage();
 
+	if (cachefile != NULL) {
+		oidcache_load();
+		atexit(oidcache_save);
+	}
+
 	warncount = 0;
+	if (filename != NULL)
+		parsefile(filename);
 	while (argc-- > 0)
 		parse(*argv++);
+	if (watch_interval)
+		watch(&watchlist, watch_interval);
+	json_end();
 	exit(warncount);
 }
 
@@ -231,6 +327,17 @@ parse(const char *string)
 	if (oidfmt(mib, len, fmt, &kind))
 		err(1, "couldn't find format of oid '%s'", bufp);
 
+	if (watch_interval) {
+		if (newval != NULL)
+			errx(1, "oid '%s': values cannot be set while watching",
+			    bufp);
+		if ((kind & CTLTYPE) == CTLTYPE_NODE)
+			collect_oids(mib, len, &watchlist);
+		else
+			oidlist_add(&watchlist, mib, len);
+		return;
+	}
+
 	if (newval == NULL || dflag) {
 		if ((kind & CTLTYPE) == CTLTYPE_NODE) {
 			if (dflag) {
@@ -239,7 +346,7 @@ parse(const char *string)
 #else
 				i = show_var(mib, len);
 #endif
-				if (!i && !bflag)
+				if (!i && !bflag && !jflag)
 					putchar('\n');
 			}
 			sysctl_all(mib, len);
@@ -249,7 +356,7 @@ parse(const char *string)
 #else
 			i = show_var(mib, len);
 #endif
-			if (!i && !bflag)
+			if (!i && !bflag && !jflag)
 				putchar('\n');
 		}
 	} else {
@@ -343,13 +450,16 @@ parse(const char *string)
 					kind & CTLTYPE);
 		}
 
+		/* JSON holds just the new value */
+		i = 1;
+		if (!jflag)
 #ifdef __APPLE__
-		i = show_var(mib, len, 1);
+			i = show_var(mib, len, 1);
 #else
-		i = show_var(mib, len);
+			i = show_var(mib, len);
 #endif
-		if (sysctl(mib, len, 0, 0, newval, newsize) == -1) {
-			if (!i && !bflag)
+		if (do_sysctl(mib, len, 0, 0, newval, newsize) == -1) {
+			if (!i && !bflag && !jflag)
 				putchar('\n');
 			switch (errno) {
 #ifdef __APPLE__
@@ -370,7 +480,7 @@ parse(const char *string)
 				return;
 			}
 		}
-		if (!bflag)
+		if (!bflag && !jflag)
 			printf(" -> ");
 		i = nflag;
 		nflag = 1;
@@ -379,12 +489,112 @@ parse(const char *string)
 #else
 		j = show_var(mib, len);
 #endif
-		if (!j && !bflag)
+		if (!j && !bflag && !jflag)
 			putchar('\n');
 		nflag = i;
 	}
 }
 
+/*
+ * All queries go through here so that -v can count them.
+ */
+static int
+do_sysctl(int *name, u_int namelen, void *oldp, size_t *oldlenp, void *newp,
+    size_t newlen)
+{
+
+	__sync_fetch_and_add(&sysctl_calls, 1);
+	return (sysctl(name, namelen, oldp, oldlenp, newp, newlen));
+}
+
+static void
+report_calls(void)
+{
+
+	fflush(stdout);
+	fprintf(stderr, "%ld sysctl calls\n", sysctl_calls);
+}
+
+/*
+ * Parse each line of a file (or stdin, for "-") as if given on the command
+ * line.  Blank lines and text following a '#' are ignored.
+ */
+static void
+parsefile(const char *filename)
+{
+	FILE *file;
+	char *line = NULL, *cp, *ep;
+	size_t linecap = 0;
+
+	if (strcmp(filename, "-") == 0)
+		file = stdin;
+	else if ((file = fopen(filename, "r")) == NULL)
+		err(1, "%s", filename);
+	while (getline(&line, &linecap, file) > 0) {
+		if ((cp = strchr(line, '#')) != NULL)
+			*cp = '\0';
+		for (cp = line; isspace((unsigned char)*cp); cp++)
+			;
+		for (ep = cp + strlen(cp); ep > cp &&
+		    isspace((unsigned char)ep[-1]); ep--)
+			;
+		*ep = '\0';
+		if (*cp != '\0')
+			parse(cp);
+	}
+	if (ferror(file))
+		err(1, "%s", filename);
+	free(line);
+	if (file != stdin)
+		fclose(file);
+}
+
+/*
+ * With -j, the output is a single JSON object with a member for each
+ * variable, named by the variable.
+ */
+static void
+json_string(const char *str, size_t len)
+{
+	const u_char *p = (const u_char *)str, *end = p + len;
+
+	putchar('"');
+	for (; p < end && *p != '\0'; p++) {
+		if (*p == '"' || *p == '\\')
+			printf("\\%c", *p);
+		else if (*p == '\n')
+			printf("\\n");
+		else if (*p == '\t')
+			printf("\\t");
+		else if (*p < 0x20)
+			printf("\\u%04x", *p);
+		else
+			putchar(*p);
+	}
+	putchar('"');
+}
+
+static void
+json_end(void)
+{
+
+	if (!jflag)
+		return;
+	printf(json_entries ? "\n}\n" : "{}\n");
+}
+
+static void
+print_name(const char *name, const char *sep)
+{
+
+	if (jflag) {
+		printf(json_entries++ ? ",\n\t" : "{\n\t");
+		json_string(name, strlen(name));
+		printf(": ");
+	} else if (!nflag)
+		printf("%s%s", name, sep);
+}
+
 /* These functions will dump out various interesting structures. */
 
 static int
@@ -396,6 +606,15 @@ S_clockinfo(int l2, void *p)
 		warnx("S_clockinfo %d != %zu", l2, sizeof(*ci));
 		return (1);
 	}
+	if (jflag) {
+		printf("{ \"hz\": %d, \"tick\": %d, \"profhz\": %d, "
+		    "\"stathz\": %d", ci->hz, ci->tick, ci->profhz, ci->stathz);
+#ifdef __APPLE__
+		printf(", \"tickadj\": %d", ci->tickadj);
+#endif
+		printf(" }");
+		return (0);
+	}
 #ifdef __APPLE__
 	printf(hflag ? "{ hz = %'d, tick = %'d, tickadj = %'d, profhz = %'d, stathz = %'d }" :
 	       "{ hz = %d, tick = %d, tickadj = %d, profhz = %d, stathz = %d }",
@@ -417,7 +636,8 @@ S_loadavg(int l2, void *p)
 		warnx("S_loadavg %d != %zu", l2, sizeof(*tv));
 		return (1);
 	}
-	printf(hflag ? "{ %'.2f %'.2f %'.2f }" : "{ %.2f %.2f %.2f }",
+	printf(jflag ? "[ %.2f, %.2f, %.2f ]" :
+	    hflag ? "{ %'.2f %'.2f %'.2f }" : "{ %.2f %.2f %.2f }",
 		(double)tv->ldavg[0]/(double)tv->fscale,
 		(double)tv->ldavg[1]/(double)tv->fscale,
 		(double)tv->ldavg[2]/(double)tv->fscale);
@@ -435,6 +655,11 @@ S_timeval(int l2, void *p)
 		warnx("S_timeval %d != %zu", l2, sizeof(*tv));
 		return (1);
 	}
+	if (jflag) {
+		printf("{ \"sec\": %jd, \"usec\": %ld }",
+		    (intmax_t)tv->tv_sec, (long)tv->tv_usec);
+		return (0);
+	}
 	printf(hflag ? "{ sec = %'jd, usec = %'ld } " :
 		"{ sec = %jd, usec = %ld } ",
 		(intmax_t)tv->tv_sec, (long)tv->tv_usec);
@@ -460,6 +685,20 @@ S_vmtotal(int l2, void *p)
 		return (1);
 	}
 
+	if (jflag) {
+		printf("{ \"rq\": %hd, \"dw\": %hd, \"pw\": %hd, \"sl\": %hd, "
+		    "\"vm_kb\": %d, \"avm_kb\": %d, \"rm_kb\": %d, \"arm_kb\": %d, "
+		    "\"vmshr_kb\": %d, \"avmshr_kb\": %d, \"rmshr_kb\": %d, "
+		    "\"armshr_kb\": %d, \"free_kb\": %d }",
+		    v->t_rq, v->t_dw, v->t_pw, v->t_sl,
+		    v->t_vm * pageKilo, v->t_avm * pageKilo,
+		    v->t_rm * pageKilo, v->t_arm * pageKilo,
+		    v->t_vmshr * pageKilo, v->t_avmshr * pageKilo,
+		    v->t_rmshr * pageKilo, v->t_armshr * pageKilo,
+		    v->t_free * pageKilo);
+		return (0);
+	}
+
 	printf(
 	    "\nSystem wide totals computed every five seconds:"
 	    " (values in kilobytes)\n");
@@ -520,6 +759,14 @@ S_xswusage(int l2, void *p)
 		warnx("S_xswusage %d != %ld", l2, sizeof(*xsu));
 		return (1);
 	}
+	if (jflag) {
+		printf("{ \"total\": %llu, \"used\": %llu, \"free\": %llu, "
+		    "\"encrypted\": %s }", (unsigned long long)xsu->xsu_total,
+		    (unsigned long long)xsu->xsu_used,
+		    (unsigned long long)xsu->xsu_avail,
+		    xsu->xsu_encrypted ? "true" : "false");
+		return (0);
+	}
 	fprintf(stdout,
 		"total = %.2fM  used = %.2fM  free = %.2fM  %s",
 		((double)xsu->xsu_total) / (1024.0 * 1024.0),
@@ -538,6 +785,14 @@ T_dev_t(int l2, void *p)
 		warnx("T_dev_T %d != %ld", l2, sizeof(*d));
 		return (1);
 	}
+	if (jflag) {
+		if ((int)(*d) != -1)
+			printf("{ \"major\": %d, \"minor\": %d }",
+			    major(*d), minor(*d));
+		else
+			printf("null");
+		return (0);
+	}
 	if ((int)(*d) != -1) {
 		if (minor(*d) > 255 || minor(*d) < 0)
 			printf("{ major = %d, minor = 0x%x }",
@@ -556,17 +811,21 @@ S_quads(int len, void *p)
 	if (len & (size-1)) {
 		return 1;
 	}
+	if (jflag)
+		printf("[ ");
 	while (len > 0) {
 		int64_t i = *(int64_t *)p;
 		printf("%llu", i);
 		if (len > size) {
 			len -= size;
 			p = (uintptr_t)p + size;
-			printf(" ");
+			printf(jflag ? ", " : " ");
 		} else {
 			break;
 		}
 	}
+	if (jflag)
+		printf(" ]");
 	return 0;
 }
 #endif // __APPLE__
@@ -586,6 +845,9 @@ name2oid(char *name, int *oidp)
 	int oid[2];
 	int i;
 	size_t j;
+	struct oident *ent;
+	char fmt[BUFSIZ];
+	u_int kind;
 
 #ifdef __APPLE__
 	// Support for CTL_USER
@@ -608,14 +870,23 @@ name2oid(char *name, int *oidp)
 	}
 #endif
 
+	if (cachefile != NULL && (ent = oidcache_byname(name)) != NULL) {
+		memcpy(oidp, ent->oid, ent->len * sizeof(int));
+		return (ent->len);
+	}
+
 	oid[0] = 0;
 	oid[1] = 3;
 
 	j = CTL_MAXNAME * sizeof(int);
-	i = sysctl(oid, 2, oidp, &j, name, strlen(name));
+	i = do_sysctl(oid, 2, oidp, &j, name, strlen(name));
 	if (i < 0)
 		return (i);
 	j /= sizeof(int);
+
+	/* Our caller wants the format next, so resolve it now for the cache. */
+	if (cachefile != NULL && oidfmt(oidp, (int)j, fmt, &kind) == 0)
+		oidcache_add(name, oidp, (int)j, kind, fmt);
 	return (int)j;
 }
 
@@ -626,13 +897,22 @@ oidfmt(int *oid, int len, char *fmt, u_int *kind)
 	u_char buf[BUFSIZ];
 	int i;
 	size_t j;
+	struct oident *ent;
+
+	if (cachefile != NULL && (ent = oidcache_byoid(oid, len)) != NULL) {
+		if (kind)
+			*kind = ent->kind;
+		if (fmt)
+			strcpy(fmt, ent->fmt);
+		return (0);
+	}
 
 	qoid[0] = 0;
 	qoid[1] = 4;
 	memcpy(qoid + 2, oid, len * sizeof(int));
 
 	j = sizeof(buf);
-	i = sysctl(qoid, len + 2, buf, &j, 0, 0);
+	i = do_sysctl(qoid, len + 2, buf, &j, 0, 0);
 #ifdef __APPLE__
 	if (i && errno == ENOENT) {
 		// Support for CTL_USER
@@ -702,6 +982,204 @@ oidfmt(int *oid, int len, char *fmt, u_int *kind)
 	return (0);
 }
 
+static u_int
+oidcache_namehash(const char *name)
+{
+	u_int h = 2166136261u;
+
+	while (*name)
+		h = (h ^ (u_char)*name++) * 16777619u;
+	return (h % OIDHASHSIZE);
+}
+
+static u_int
+oidcache_oidhash(int *oid, int len)
+{
+	u_int h = 0;
+	int i;
+
+	for (i = 0; i < len; i++)
+		h = h * 31 + (u_int)oid[i];
+	return (h % OIDHASHSIZE);
+}
+
+static struct oident *
+oidcache_byname(const char *name)
+{
+	struct oident *ent;
+
+	for (ent = namehash[oidcache_namehash(name)]; ent; ent = ent->nhnext)
+		if (strcmp(ent->name, name) == 0)
+			return (ent);
+	return (NULL);
+}
+
+static struct oident *
+oidcache_byoid(int *oid, int len)
+{
+	struct oident *ent;
+
+	for (ent = oidhash[oidcache_oidhash(oid, len)]; ent; ent = ent->ohnext)
+		if (ent->len == len &&
+		    memcmp(ent->oid, oid, len * sizeof(int)) == 0)
+			return (ent);
+	return (NULL);
+}
+
+static void
+oidcache_insert(const char *name, int *oid, int len, u_int kind,
+    const char *fmt)
+{
+	struct oident *ent;
+	u_int h;
+
+	if (len < 1 || len > CTL_MAXNAME)
+		return;
+	if ((ent = calloc(1, sizeof(*ent))) == NULL ||
+	    (ent->name = strdup(name)) == NULL ||
+	    (ent->fmt = strdup(fmt)) == NULL)
+		err(1, "malloc failed");
+	memcpy(ent->oid, oid, len * sizeof(int));
+	ent->len = len;
+	ent->kind = kind;
+	ent->next = oidcache;
+	oidcache = ent;
+	h = oidcache_namehash(name);
+	ent->nhnext = namehash[h];
+	namehash[h] = ent;
+	h = oidcache_oidhash(oid, len);
+	ent->ohnext = oidhash[h];
+	oidhash[h] = ent;
+}
+
+static void
+oidcache_add(const char *name, int *oid, int len, u_int kind,
+    const char *fmt)
+{
+#ifdef __APPLE__
+	// CTL_USER is resolved in this program, there is nothing to cache.
+	if (oid[0] == CTL_USER)
+		return;
+#endif
+	oidcache_insert(name, oid, len, kind, fmt);
+	oidcache_dirty = 1;
+}
+
+/*
+ * OIDs registered with OID_AUTO are numbered as they are registered, so
+ * cached entries are only valid for the kernel and boot that produced them.
+ */
+static void
+oidcache_key(char *key, size_t keylen)
+{
+	int mib[2];
+	char version[BUFSIZ];
+	struct timeval boottime;
+	uint64_t h = 14695981039346656037ULL;
+	size_t i, len;
+
+	mib[0] = CTL_KERN;
+	mib[1] = KERN_VERSION;
+	len = sizeof(version);
+	if (do_sysctl(mib, 2, version, &len, 0, 0) == -1)
+		err(1, "sysctl kern.version");
+	for (i = 0; i < len; i++)
+		h = (h ^ (u_char)version[i]) * 1099511628211ULL;
+	mib[1] = KERN_BOOTTIME;
+	len = sizeof(boottime);
+	if (do_sysctl(mib, 2, &boottime, &len, 0, 0) == -1)
+		err(1, "sysctl kern.boottime");
+	snprintf(key, keylen, "%016" PRIx64 ".%jd", h,
+	    (intmax_t)boottime.tv_sec);
+}
+
+/*
+ * The cache file holds a key line, then one line per entry of the form
+ *	name <tab> kind <tab> oid.oid... <tab> format
+ * and is thrown away whenever its key does not match the running kernel.
+ */
+static void
+oidcache_load(void)
+{
+	FILE *file;
+	char key[64], *line = NULL, *cp, *name, *kind, *oids, *fmt;
+	size_t linecap = 0;
+	ssize_t linelen;
+	int oid[CTL_MAXNAME], len;
+
+	oidcache_key(key, sizeof(key));
+	if ((file = fopen(cachefile, "r")) == NULL) {
+		if (errno != ENOENT)
+			warn("%s", cachefile);
+		oidcache_dirty = 1;
+		return;
+	}
+	if (getline(&line, &linecap, file) <= 0 ||
+	    strncmp(line, key, strlen(key)) != 0 || line[strlen(key)] != '\n') {
+		oidcache_dirty = 1;
+		goto done;
+	}
+	while ((linelen = getline(&line, &linecap, file)) > 0) {
+		if (line[linelen - 1] == '\n')
+			line[linelen - 1] = '\0';
+		cp = line;
+		name = strsep(&cp, "\t");
+		kind = strsep(&cp, "\t");
+		oids = strsep(&cp, "\t");
+		fmt = cp;
+		if (fmt == NULL)
+			continue;
+		for (len = 0; oids != NULL && *oids != '\0' &&
+		    len < CTL_MAXNAME; len++)
+			oid[len] = (int)strtol(strsep(&oids, "."), NULL, 10);
+		if (oidcache_byname(name) == NULL)
+			oidcache_insert(name, oid, len,
+			    (u_int)strtoul(kind, NULL, 0), fmt);
+	}
+done:
+	free(line);
+	fclose(file);
+}
+
+static void
+oidcache_save(void)
+{
+	struct oident *ent;
+	char key[64], tmpname[PATH_MAX];
+	FILE *file;
+	int fd, i;
+
+	if (!oidcache_dirty)
+		return;
+	oidcache_dirty = 0;
+	oidcache_key(key, sizeof(key));
+	if (snprintf(tmpname, sizeof(tmpname), "%s.XXXXXX", cachefile) >=
+	    (int)sizeof(tmpname)) {
+		warnx("%s: name too long", cachefile);
+		return;
+	}
+	if ((fd = mkstemp(tmpname)) == -1 ||
+	    (file = fdopen(fd, "w")) == NULL) {
+		warn("%s", tmpname);
+		if (fd != -1) {
+			close(fd);
+			unlink(tmpname);
+		}
+		return;
+	}
+	fprintf(file, "%s\n", key);
+	for (ent = oidcache; ent; ent = ent->next) {
+		fprintf(file, "%s\t%#x\t", ent->name, ent->kind);
+		for (i = 0; i < ent->len; i++)
+			fprintf(file, i ? ".%d" : "%d", ent->oid[i]);
+		fprintf(file, "\t%s\n", ent->fmt);
+	}
+	if (fclose(file) == EOF || rename(tmpname, cachefile) == -1) {
+		warn("%s", cachefile);
+		unlink(tmpname);
+	}
+}
+
 static int ctl_sign[CTLTYPE+1] = {
 	[CTLTYPE_INT] = 1,
 	[CTLTYPE_LONG] = 1,
@@ -718,46 +1196,96 @@ static int ctl_size[CTLTYPE+1] = {
 };
 
 /*
- * This formats and outputs the value of one variable
- *
- * Returns zero if anything was actually output.
- * Returns one if didn't know what to do with this.
- * Return minus one if we had errors.
+ * One variable, as fetched from the kernel by fetch_var() and then
+ * formatted by print_var().
+ */
+struct oidval {
+	int	oid[CTL_MAXNAME];
+	int	len;
+	int	status;		/* zero if there is anything to print */
+	u_int	kind;
+	char	*fmt;
+	char	*name;
+	u_char	*val;		/* the value, or the description with -d */
+	size_t	vallen;
+};
+
+/*
+ * Read the value of a variable into a NUL terminated buffer.  Nearly
+ * every value fits in BUFSIZ, so try that first and only ask for the
+ * size of the ones that don't.
  */
 static int
-#ifdef __APPLE__
-show_var(int *oid, int nlen, int show_masked)
-#else
-show_var(int *oid, int nlen)
-#endif
+fetch_value(int *oid, int nlen, u_char **valp, size_t *lenp)
 {
-	u_char buf[BUFSIZ], *val, *oval, *p;
-	char name[BUFSIZ], *fmt;
-	const char *sep, *sep1;
-	int qoid[CTL_MAXNAME+2];
-	uintmax_t umv;
-	intmax_t mv;
-	int i, hexlen, sign, ctltype;
-	size_t intlen;
+	u_char *val;
+	int i;
 	size_t j, len;
-	u_int kind;
-	int (*func)(int, void *);
 
-	/* Silence GCC. */
-	umv = mv = intlen = 0;
+	len = BUFSIZ;
+	if ((val = malloc(len + 1)) == NULL) {
+		warnx("malloc failed");
+		return (1);
+	}
+	i = do_sysctl(oid, nlen, val, &len, 0, 0);
+	if (i && errno == ENOMEM) {
+		/* find an estimate of how much we need for this var */
+		j = 0;
+		i = do_sysctl(oid, nlen, 0, &j, 0, 0);
+		j += j; /* we want to be sure :-) */
+
+		free(val);
+		if ((val = malloc(j + 1)) == NULL) {
+			warnx("malloc failed");
+			return (1);
+		}
+		len = j;
+		i = do_sysctl(oid, nlen, val, &len, 0, 0);
+	}
+	if (i || !len) {
+		free(val);
+		return (1);
+	}
+	val[len] = '\0';
+	*valp = val;
+	*lenp = len;
+	return (0);
+}
+
+/*
+ * This fetches everything needed to print one variable.  It does not
+ * print anything, so that sysctl_all() can run it on several threads.
+ */
+static void
+fetch_var(struct oidval *ov, int show_masked)
+{
+	u_char buf[BUFSIZ];
+	char name[BUFSIZ];
+	const char *sep;
+	int qoid[CTL_MAXNAME+2];
+	struct oident *ent;
+	int *oid = ov->oid, nlen = ov->len;
+	int i;
+	size_t j;
+
+	ov->status = 1;
+	ov->fmt = ov->name = NULL;
+	ov->val = NULL;
+	ov->vallen = 0;
 
 	bzero(buf, BUFSIZ);
 	bzero(name, BUFSIZ);
 	qoid[0] = 0;
 	memcpy(qoid + 2, oid, nlen * sizeof(int));
-	fmt = (char *)buf;
-	oidfmt(oid, nlen, fmt, &kind);
+	oidfmt(oid, nlen, (char *)buf, &ov->kind);
 
 #ifdef __APPLE__
-	if (!show_masked && (kind & CTLFLAG_MASKED)) {
-		return (1);
+	if (!show_masked && (ov->kind & CTLFLAG_MASKED)) {
+		return;
 	}
 #endif
+	if ((ov->fmt = strdup((char *)buf)) == NULL)
+		err(1, "malloc failed");
 
 #ifdef __APPLE__
 	// Support for CTL_USER
@@ -774,14 +1302,80 @@ show_var(int *oid, int nlen)
 		i = 0;
 	} else {
 #endif
-	qoid[1] = 1;
-	j = sizeof(name);
-	i = sysctl(qoid, nlen + 2, name, &j, 0, 0);
-	if (i || !j)
-		err(1, "sysctl name %d %zu %d", i, j, errno);
+	if (cachefile != NULL && (ent = oidcache_byoid(oid, nlen)) != NULL) {
+		strlcpy(name, ent->name, sizeof(name));
+	} else {
+		qoid[1] = 1;
+		j = sizeof(name);
+		i = do_sysctl(qoid, nlen + 2, name, &j, 0, 0);
+		if (i || !j)
+			err(1, "sysctl name %d %zu %d", i, j, errno);
+	}
 #ifdef __APPLE__
 	}
 #endif
+	if ((ov->name = strdup(name)) == NULL)
+		err(1, "malloc failed");
+
+	if (Nflag) {
+		ov->status = 0;
+		return;
+	}
+
+	if (dflag) {	/* just fetch description */
+		qoid[1] = 5;
+		j = sizeof(buf);
+		i = do_sysctl(qoid, nlen + 2, buf, &j, 0, 0);
+		buf[sizeof(buf) - 1] = '\0';
+		if ((ov->val = (u_char *)strdup((char *)buf)) == NULL)
+			err(1, "malloc failed");
+		ov->vallen = strlen((char *)buf);
+		ov->status = 0;
+		return;
+	}
+
+	if (fetch_value(oid, nlen, &ov->val, &ov->vallen) == 0)
+		ov->status = 0;
+}
+
+static void
+free_var(struct oidval *ov)
+{
+
+	free(ov->fmt);
+	free(ov->name);
+	free(ov->val);
+}
+
+/*
+ * This formats and outputs the value of one variable
+ *
+ * Returns zero if anything was actually output.
+ * Returns one if didn't know what to do with this.
+ * Return minus one if we had errors.
+ */
+static int
+print_var(struct oidval *ov)
+{
+	u_char *val, *p;
+	char *name, *fmt;
+	const char *sep, *sep1;
+	uintmax_t umv;
+	intmax_t mv;
+	int i, hexlen, sign, ctltype;
+	size_t intlen;
+	size_t len;
+	u_int kind;
+	int (*func)(int, void *);
+
+	/* Silence GCC. */
+	umv = mv = intlen = 0;
+
+	if (ov->status)
+		return (1);
+	name = ov->name;
+	fmt = ov->fmt;
+	kind = ov->kind;
 
 	if (Nflag) {
 		printf("%s", name);
@@ -794,37 +1388,20 @@ show_var(int *oid, int nlen)
 		sep = ": ";
 
 	if (dflag) {	/* just print description */
-		qoid[1] = 5;
-		j = sizeof(buf);
-		i = sysctl(qoid, nlen + 2, buf, &j, 0, 0);
-		if (!nflag)
-			printf("%s%s", name, sep);
-		printf("%s", buf);
+		print_name(name, sep);
+		if (jflag)
+			json_string((char *)ov->val, ov->vallen);
+		else
+			printf("%s", ov->val);
 		return (0);
 	}
-	/* find an estimate of how much we need for this var */
-	j = 0;
-	i = sysctl(oid, nlen, 0, &j, 0, 0);
-	j += j; /* we want to be sure :-) */
-
-	val = oval = malloc(j + 1);
-	if (val == NULL) {
-		warnx("malloc failed");
-		return (1);
-	}
-	len = j;
-	i = sysctl(oid, nlen, val, &len, 0, 0);
-	if (i || !len) {
-		free(oval);
-		return (1);
-	}
 
+	val = ov->val;
+	len = ov->vallen;
 	if (bflag) {
 		fwrite(val, 1, len, stdout);
-		free(oval);
 		return (0);
 	}
-	val[len] = '\0';
 	p = val;
 	ctltype = (kind & CTLTYPE);
 	sign = ctl_sign[ctltype];
@@ -832,10 +1409,11 @@ show_var(int *oid, int nlen)
 
 	switch (ctltype) {
 	case CTLTYPE_STRING:
-		if (!nflag)
-			printf("%s%s", name, sep);
-		printf("%.*s", (int)len, p);
-		free(oval);
+		print_name(name, sep);
+		if (jflag)
+			json_string((char *)p, len);
+		else
+			printf("%.*s", (int)len, p);
 		return (0);
 
 	case CTLTYPE_INT:
@@ -844,10 +1422,13 @@ show_var(int *oid, int nlen)
 	case CTLTYPE_ULONG:
 	case CTLTYPE_S64:
 	case CTLTYPE_U64:
-		if (!nflag)
-			printf("%s%s", name, sep);
+		print_name(name, sep);
 		hexlen = (int)(2 + (intlen * CHAR_BIT + 3) / 4);
 		sep1 = "";
+		if (jflag && len > intlen)
+			printf("[ ");
+		else if (jflag && len < intlen)
+			printf("null");
 		while (len >= intlen) {
 			switch (kind & CTLTYPE) {
 			case CTLTYPE_INT:
@@ -867,7 +1448,14 @@ show_var(int *oid, int nlen)
 				break;
 			}
 			fputs(sep1, stdout);
-			if (xflag)
+			if (jflag) {
+				if (!sign)
+					printf("%ju", umv);
+				else if (fmt[1] == 'K' && mv >= 0)
+					printf("%.1f", (mv - 2732.0) / 10);
+				else
+					printf("%jd", mv);
+			} else if (xflag)
 				printf("%#0*jx", hexlen, umv);
 			else if (!sign)
 				printf(hflag ? "%'ju" : "%ju", umv);
@@ -878,11 +1466,12 @@ show_var(int *oid, int nlen)
 					printf("%.1fC", (mv - 2732.0) / 10);
 			} else
 				printf(hflag ? "%'jd" : "%jd", mv);
-			sep1 = " ";
+			sep1 = jflag ? ", " : " ";
 			len -= intlen;
 			p += intlen;
 		}
-		free(oval);
+		if (jflag && *sep1 == ',')
+			printf(" ]");
 		return (0);
 
 	case CTLTYPE_OPAQUE:
@@ -907,32 +1496,105 @@ show_var(int *oid, int nlen)
 		else
 			func = NULL;
 		if (func) {
-			if (!nflag)
-				printf("%s%s", name, sep);
+			print_name(name, sep);
 			i = (*func)((int)len, p);
-			free(oval);
+			if (i && jflag)
+				printf("null");
 			return (i);
 		}
 		/* FALLTHROUGH */
 	default:
 		if (!oflag && !xflag) {
-			free(oval);
 			return (1);
 		}
-		if (!nflag)
-			printf("%s%s", name, sep);
+		print_name(name, sep);
+		if (jflag) {
+			printf("{ \"format\": ");
+			json_string(fmt, strlen(fmt));
+			printf(", \"length\": %zu, \"dump\": \"", len);
+			while (len-- && (xflag || p < val + 16))
+				printf("%02x", *p++);
+			printf("\" }");
+			return (0);
+		}
 		printf("Format:%s Length:%zu Dump:0x", fmt, len);
 		while (len-- && (xflag || p < val + 16))
 			printf("%02x", *p++);
 		if (!xflag && len > 16)
 			printf("...");
-		free(oval);
 		return (0);
 	}
-	free(oval);
 	return (1);
 }
 
+static int
+#ifdef __APPLE__
+show_var(int *oid, int nlen, int show_masked)
+#else
+show_var(int *oid, int nlen)
+#endif
+{
+	struct oidval ov;
+	int i;
+
+	memcpy(ov.oid, oid, nlen * sizeof(int));
+	ov.len = nlen;
+#ifdef __APPLE__
+	fetch_var(&ov, show_masked);
+#else
+	fetch_var(&ov, 1);
+#endif
+	i = print_var(&ov);
+	free_var(&ov);
+	return (i);
+}
+
+struct fetchq {
+	struct oidval	*ovs;
+	size_t		count;
+	size_t		next;	/* next entry to fetch, taken atomically */
+	int		show_masked;
+};
+
+static void *
+fetch_thread(void *arg)
+{
+	struct fetchq *q = arg;
+	size_t k;
+
+	while ((k = __sync_fetch_and_add(&q->next, 1)) < q->count)
+		fetch_var(&q->ovs[k], q->show_masked);
+	return (NULL);
+}
+
+/*
+ * Fetch a list of variables on up to FETCH_THREADS threads.  Most of the
+ * time goes into the handlers in the kernel, which run concurrently.
+ */
+static void
+fetch_all(struct oidval *ovs, size_t count, int show_masked)
+{
+	pthread_t threads[FETCH_THREADS];
+	struct fetchq q;
+	long ncpu;
+	int i, nthreads;
+
+	q.ovs = ovs;
+	q.count = count;
+	q.next = 0;
+	q.show_masked = show_masked;
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	nthreads = ncpu < 1 ? 1 : ncpu > FETCH_THREADS ? FETCH_THREADS : (int)ncpu;
+	if (count < FETCH_BATCH)
+		nthreads = 1;
+	for (i = 1; i < nthreads; i++)
+		if (pthread_create(&threads[i], NULL, fetch_thread, &q) != 0)
+			break;
+	fetch_thread(&q);
+	while (--i > 0)
+		pthread_join(threads[i], NULL);
+}
+
 #ifdef __APPLE__
 // Support for CTL_USER
 static void
@@ -945,27 +1607,40 @@ sysctl_all_user(int *oid, int len)
 	for (i = 0; i < user_names_count; ++i) {
 		int oid[2] = { CTL_USER, i };
 		j = show_var(oid, 2, 0);
-		if (!j && !bflag) {
+		if (!j && !bflag && !jflag) {
 			putchar('\n');
 		}
 	}
 }
 #endif
 
-static int
-sysctl_all(int *oid, int len)
+static void
+oidlist_add(struct oidlist *list, int *oid, int len)
 {
-#ifdef __APPLE__
-#endif
 
+	if (len > CTL_MAXNAME)
+		errx(1, "OID of length %d is too long", len);
+	if (list->count == list->alloc) {
+		list->alloc = list->alloc ? list->alloc * 2 : 1024;
+		if ((list->ovs = realloc(list->ovs,
+		    list->alloc * sizeof(*list->ovs))) == NULL)
+			err(1, "malloc failed");
+	}
+	memcpy(list->ovs[list->count].oid, oid, len * sizeof(int));
+	list->ovs[list->count].len = len;
+	list->count++;
+}
+
+/*
+ * Append every OID below oid (or all of them, if len is zero) to list.
+ */
+static void
+collect_oids(int *oid, int len, struct oidlist *list)
+{
 	int name1[22], name2[22];
 	int i, j;
 	size_t l1, l2;
 
-#ifdef __APPLE__
-	sysctl_all_user(oid, len);
-#endif
-
 	name1[0] = 0;
 	name1[1] = 2;
 	l1 = 2;
@@ -978,10 +1653,10 @@ sysctl_all(int *oid, int len)
 	}
 	for (;;) {
 		l2 = sizeof(name2);
-		j = sysctl(name1, (u_int)l1, name2, &l2, 0, 0);
+		j = do_sysctl(name1, (u_int)l1, name2, &l2, 0, 0);
 		if (j < 0) {
 			if (errno == ENOENT)
-				return (0);
+				return;
 			else
 				err(1, "sysctl(getnext) %d %zu", j, l2);
 		}
@@ -989,21 +1664,148 @@ sysctl_all(int *oid, int len)
 		l2 /= sizeof(int);
 
 		if (len < 0 || l2 < (unsigned int)len)
-			return (0);
+			return;
 
 		for (i = 0; i < len; i++)
 			if (name2[i] != oid[i])
-				return (0);
+				return;
+
+		oidlist_add(list, name2, (int)l2);
 
+		memcpy(name1+2, name2, l2 * sizeof(int));
+		l1 = 2 + l2;
+	}
+}
+
+static int
+sysctl_all(int *oid, int len)
+{
 #ifdef __APPLE__
-		i = show_var(name2, (u_int)l2, 0);
-#else
-		i = show_var(name2, (u_int)l2);
 #endif
-		if (!i && !bflag)
+
+	struct oidlist list;
+	size_t k;
+	int i;
+
+#ifdef __APPLE__
+	sysctl_all_user(oid, len);
+#endif
+
+	/*
+	 * Walk the tree for the whole list of OIDs first, so that their
+	 * values can be fetched in parallel and then printed in order.
+	 */
+	bzero(&list, sizeof(list));
+	collect_oids(oid, len, &list);
+	fetch_all(list.ovs, list.count, 0);
+	for (k = 0; k < list.count; k++) {
+		i = print_var(&list.ovs[k]);
+		if (!i && !bflag && !jflag)
 			putchar('\n');
+		free_var(&list.ovs[k]);
+	}
+	free(list.ovs);
+	return (0);
+}
 
-		memcpy(name1+2, name2, l2 * sizeof(int));
-		l1 = 2 + l2;
+/*
+ * Returns the number of counters in a value that -W can compute rates
+ * for, and their size, or zero if it is not numeric.
+ */
+static size_t
+watch_counters(struct oidval *ov, size_t *intlen)
+{
+	int ctltype = ov->kind & CTLTYPE;
+
+	if (ctltype == CTLTYPE_OPAQUE && strcmp(ov->fmt, "Q") == 0)
+		*intlen = sizeof(int64_t);
+	else if ((*intlen = ctl_size[ctltype]) == 0)
+		return (0);
+	return (ov->vallen / *intlen);
+}
+
+static intmax_t
+watch_delta(struct oidval *ov, size_t intlen, u_char *new, u_char *old)
+{
+
+	/* Unsigned counters are allowed to wrap. */
+	switch (intlen) {
+	case sizeof(int32_t):
+		if (ctl_sign[ov->kind & CTLTYPE])
+			return ((intmax_t)*(int32_t *)(void *)new -
+			    *(int32_t *)(void *)old);
+		return ((uint32_t)(*(uint32_t *)(void *)new -
+		    *(uint32_t *)(void *)old));
+	case sizeof(int64_t):
+		if (ctl_sign[ov->kind & CTLTYPE])
+			return (*(int64_t *)(void *)new -
+			    *(int64_t *)(void *)old);
+		return ((intmax_t)(*(uint64_t *)(void *)new -
+		    *(uint64_t *)(void *)old));
+	}
+	return (0);
+}
+
+/*
+ * Print each variable, then re-read just its value every interval
+ * seconds.  Numeric variables are printed as the change since the last
+ * interval and its rate per second; anything else is printed whenever
+ * it changes.
+ */
+static void
+watch(struct oidlist *list, u_int interval)
+{
+	struct oidval *ov;
+	struct timespec then, now;
+	u_char *val;
+	const char *sep;
+	double secs;
+	intmax_t delta;
+	size_t k, n, ncounters, intlen, len;
+
+	sep = eflag ? "=" : ": ";
+	fetch_all(list->ovs, list->count, 1);
+	clock_gettime(CLOCK_MONOTONIC, &then);
+	for (k = 0; k < list->count; k++)
+		if (!print_var(&list->ovs[k]))
+			putchar('\n');
+	for (;;) {
+		fflush(stdout);
+		sleep(interval);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		secs = (now.tv_sec - then.tv_sec) +
+		    (now.tv_nsec - then.tv_nsec) / 1e9;
+		then = now;
+		for (k = 0; k < list->count; k++) {
+			ov = &list->ovs[k];
+			if (ov->status ||
+			    fetch_value(ov->oid, ov->len, &val, &len) != 0)
+				continue;
+			ncounters = watch_counters(ov, &intlen);
+			if (ncounters == 0 || len != ov->vallen) {
+				if (len != ov->vallen ||
+				    memcmp(val, ov->val, len) != 0) {
+					free(ov->val);
+					ov->val = val;
+					ov->vallen = len;
+					if (!print_var(ov))
+						putchar('\n');
+				} else
+					free(val);
+				continue;
+			}
+			if (!nflag)
+				printf("%s%s", ov->name, sep);
+			for (n = 0; n < ncounters; n++) {
+				delta = watch_delta(ov, intlen,
+				    val + n * intlen, ov->val + n * intlen);
+				printf(hflag ? "%s%+'jd (%'.1f/s)" :
+				    "%s%+jd (%.1f/s)", n ? " " : "", delta,
+				    secs > 0 ? delta / secs : 0.0);
+			}
+			putchar('\n');
+			free(ov->val);
+			ov->val = val;
+		}
 	}
 }
@@ -25,6 +25,7 @@
 #include <System/sys/proc.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/resource.h>
@@ -34,6 +35,9 @@
 #include <sysexits.h>
 #include <mach/mach.h>
 #include <mach/task_policy.h>
+#include <libproc.h>
+#include <fnmatch.h>
+#include "proctab.h"
 
 #include <spawn.h>
 #include <spawn_private.h>
@@ -44,14 +48,28 @@
 
 extern char **environ;
 
+/* What to change in each running process selected with -p, -P, -G or -n. */
+struct target_policy {
+	bool background;
+	bool foreground;
+	struct task_qos_policy qosinfo;
+	const char *latency_tier;
+	const char *throughput_tier;
+};
+
 static void usage(void);
 static int parse_disk_policy(const char *strpolicy);
 static int parse_qos_tier(const char *strpolicy, int parameter);
 static uint64_t parse_qos_clamp(const char *qos_string);
+static void parse_pid_list(const char *str, pid_t **pids, int *npids);
+static int select_procs(pid_t **pids, int *npids, pid_t ppid, pid_t pgid, const char *pattern);
+static int apply_policy(pid_t pid, const struct target_policy *policy, bool report);
+static int pid_cmp(const void *a, const void *b);
+static int proc_cmp(const void *a, const void *b);
 
 int main(int argc, char * argv[])
 {
-	int ch, ret;
+	int ch, ret, i, failed;
 	pid_t pid = 0;
     posix_spawnattr_t attr;
     extern char **environ;
@@ -59,8 +77,13 @@ int main(int argc, char * argv[])
 	int flagd = -1, flagg = -1;
 	struct task_qos_policy qosinfo = { LATENCY_QOS_TIER_UNSPECIFIED, THROUGHPUT_QOS_TIER_UNSPECIFIED };
     uint64_t qos_clamp = POSIX_SPAWN_PROC_CLAMP_NONE;
+	pid_t *pids = NULL, ppid = 0, pgid = 0;
+	int npids = 0;
+	const char *pattern = NULL;
+	struct target_policy policy = { 0 };
+	bool targets, bulk;
 
-	while ((ch = getopt(argc, argv, "xXbBd:g:c:t:l:p:a")) != -1) {
+	while ((ch = getopt(argc, argv, "xXbBd:g:c:t:l:p:P:G:n:a")) != -1) {
 		switch (ch) {
 			case 'x':
 				flagx = true;
@@ -101,6 +124,7 @@ int main(int argc, char * argv[])
 					warnx("Could not parse '%s' as a qos tier", optarg);
 					usage();
 				}
+				policy.throughput_tier = optarg;
 				break;
 			case 'l':
 				qosinfo.task_latency_qos_tier = parse_qos_tier(optarg, QOS_PARAMETER_LATENCY);
@@ -108,14 +132,28 @@ int main(int argc, char * argv[])
 					warnx("Could not parse '%s' as a qos tier", optarg);
 					usage();
 				}
+				policy.latency_tier = optarg;
 				break;
 			case 'p':
-				pid = atoi(optarg);
-				if (pid == 0) {
+				parse_pid_list(optarg, &pids, &npids);
+				break;
+			case 'P':
+				ppid = atoi(optarg);
+				if (ppid <= 0) {
 					warnx("Invalid pid '%s' specified", optarg);
 					usage();
 				}
 				break;
+			case 'G':
+				pgid = atoi(optarg);
+				if (pgid <= 0) {
+					warnx("Invalid process group '%s' specified", optarg);
+					usage();
+				}
+				break;
+			case 'n':
+				pattern = optarg;
+				break;
 			case 'a':
 				flaga = true;
 				break;
@@ -127,12 +165,20 @@ int main(int argc, char * argv[])
 	argc -= optind;
 	argv += optind;
 
-	if (pid == 0 && argc == 0) {
+	targets = (npids > 0 || ppid != 0 || pgid != 0 || pattern != NULL);
+	bulk = (targets && !(npids == 1 && ppid == 0 && pgid == 0 && pattern == NULL));
+
+	if (!targets && argc == 0) {
 		usage();
 	}
 
-	if (pid != 0 && (flagx || flagX || flagg != -1 || flagd != -1)) {
-		warnx("Incompatible option(s) used with -p");
+	/*
+	 * I/O policies and QoS clamps can only be set by a process on itself,
+	 * so they apply only to a program run by taskpolicy.
+	 */
+	if (targets && (flagx || flagX || flagg != -1 || flagd != -1 ||
+	    qos_clamp != POSIX_SPAWN_PROC_CLAMP_NONE || flaga)) {
+		warnx("Incompatible option(s) used with -p, -P, -G or -n");
 		usage();
 	}
 
@@ -146,11 +192,37 @@ int main(int argc, char * argv[])
 		usage();
 	}
 
-	if (flagB && pid == 0) {
-		warnx("The -B option can only be used with the -p option");
+	if (flagB && !targets) {
+		warnx("The -B option can only be used with the -p, -P, -G or -n options");
 		usage();
 	}
 
+	if (targets) {
+		if (select_procs(&pids, &npids, ppid, pgid, pattern) == -1) {
+			errx(EX_SOFTWARE, "Could not list the running processes");
+		}
+		if (npids == 0) {
+			errx(EX_NOINPUT, "No matching processes");
+		}
+
+		policy.background = flagb;
+		policy.foreground = flagB;
+		policy.qosinfo = qosinfo;
+
+		for (failed = 0, i = 0; i < npids; i++) {
+			if (apply_policy(pids[i], &policy, bulk) == -1) {
+				failed++;
+			}
+		}
+
+		if (bulk) {
+			printf("Changed %d of %d processes\n", npids - failed, npids);
+		}
+
+		free(pids);
+		return failed ? EX_SOFTWARE : 0;
+	}
+
 	if (flagx) {
 		ret = setiopolicy_np(IOPOL_TYPE_VFS_HFS_CASE_SENSITIVITY, IOPOL_SCOPE_PROCESS, IOPOL_VFS_HFS_CASE_SENSITIVITY_FORCE_CASE_SENSITIVE);
 		if (ret == -1) {
@@ -166,14 +238,7 @@ int main(int argc, char * argv[])
 	}
 
 	if (flagb) {
-		ret = setpriority(PRIO_DARWIN_PROCESS, pid, PRIO_DARWIN_BG);
-		if (ret == -1) {
-			err(EX_SOFTWARE, "setpriority()");
-		}
-	}
-
-	if (flagB) {
-		ret = setpriority(PRIO_DARWIN_PROCESS, pid, 0);
+		ret = setpriority(PRIO_DARWIN_PROCESS, 0, PRIO_DARWIN_BG);
 		if (ret == -1) {
 			err(EX_SOFTWARE, "setpriority()");
 		}
@@ -195,25 +260,12 @@ int main(int argc, char * argv[])
 
 	if (qosinfo.task_latency_qos_tier != LATENCY_QOS_TIER_UNSPECIFIED ||
 	    qosinfo.task_throughput_qos_tier != THROUGHPUT_QOS_TIER_UNSPECIFIED){
-		mach_port_t task;
-		if (pid) {
-			ret = task_name_for_pid(mach_task_self(), pid, &task);
-			if (ret != KERN_SUCCESS) {
-				err(EX_SOFTWARE, "task_name_for_pid(%d) failed", pid);
-				return EX_OSERR;
-			}
-		} else {
-			task = mach_task_self();
-		}
-		ret = task_policy_set((task_t)task, TASK_OVERRIDE_QOS_POLICY, (task_policy_t)&qosinfo, TASK_QOS_POLICY_COUNT);
+		ret = task_policy_set(mach_task_self(), TASK_OVERRIDE_QOS_POLICY, (task_policy_t)&qosinfo, TASK_QOS_POLICY_COUNT);
 		if (ret != KERN_SUCCESS){
 			err(EX_SOFTWARE, "task_policy_set(...TASK_OVERRIDE_QOS_POLICY...)");
 		}
 	}
 
-	if (pid != 0)
-		return 0;
-
     ret = posix_spawnattr_init(&attr);
     if (ret != 0) errc(EX_NOINPUT, ret, "posix_spawnattr_init");
 
@@ -243,10 +295,211 @@ static void usage(void)
 {
 	fprintf(stderr, "Usage: %s [-x|-X] [-d <policy>] [-g policy] [-c clamp] [-b] [-t <tier>]\n"
                     "                  [-l <tier>] [-a] <program> [<pargs> [...]]\n", getprogname());
-	fprintf(stderr, "       %s [-b|-B] [-t <tier>] [-l <tier>] -p pid\n", getprogname());
+	fprintf(stderr, "       %s [-b|-B] [-t <tier>] [-l <tier>] [-p pid[,pid...]] [-P ppid] [-G pgid]\n"
+                    "                  [-n pattern]\n", getprogname());
 	exit(EX_USAGE);
 }
 
+static void parse_pid_list(const char *str, pid_t **pids, int *npids)
+{
+	char *list, *tok, *next, *endptr;
+	long pid;
+
+	if ((list = strdup(str)) == NULL) {
+		err(EX_OSERR, "strdup");
+	}
+
+	for (next = list; (tok = strsep(&next, ", ")) != NULL; ) {
+		if (*tok == '\0') {
+			continue;
+		}
+
+		pid = strtol(tok, &endptr, 10);
+		if (*endptr != '\0' || pid <= 0 || pid > INT_MAX) {
+			warnx("Invalid pid '%s' specified", tok);
+			usage();
+		}
+
+		*pids = reallocf(*pids, (*npids + 1) * sizeof(pid_t));
+		if (*pids == NULL) {
+			err(EX_OSERR, "reallocf");
+		}
+		(*pids)[(*npids)++] = (pid_t)pid;
+	}
+
+	free(list);
+}
+
+/*
+ * Add the processes in process group pgid, those whose names match
+ * pattern, and ppid with all of its descendants to the pid list, in one
+ * pass over the running processes.  The list is then sorted and any
+ * duplicates removed.
+ */
+static int select_procs(pid_t **pids, int *npids, pid_t ppid, pid_t pgid, const char *pattern)
+{
+	struct proc_bsdshortinfo *procs = NULL, *ancestor, key;
+	struct proctab pt = {};
+	pid_t self = getpid(), parent;
+	char comm[MAXCOMLEN + 1];
+	int nprocs, i, j, depth;
+	bool selected;
+
+	if (ppid != 0 || pgid != 0 || pattern != NULL) {
+		if (proctab_refresh(&pt) < 0) {
+			return -1;
+		}
+
+		procs = malloc((pt.count ? pt.count : 1) * sizeof(struct proc_bsdshortinfo));
+		if (procs == NULL) {
+			err(EX_OSERR, "malloc");
+		}
+
+		for (nprocs = 0, i = 0; i < pt.count; i++) {
+			if (proc_pidinfo(pt.pids[i], PROC_PIDT_SHORTBSDINFO, 0, &procs[nprocs],
+			    sizeof(procs[nprocs])) == sizeof(procs[nprocs])) {
+				nprocs++;
+			}
+		}
+
+		/* sorted by pid, so that ancestors can be looked up */
+		qsort(procs, nprocs, sizeof(struct proc_bsdshortinfo), proc_cmp);
+
+		for (i = 0; i < nprocs; i++) {
+			if ((pid_t)procs[i].pbsi_pid == self) {
+				continue;
+			}
+
+			memcpy(comm, procs[i].pbsi_comm, MAXCOMLEN);
+			comm[MAXCOMLEN] = '\0';
+
+			selected = (pgid != 0 && (pid_t)procs[i].pbsi_pgid == pgid) ||
+			    (pattern != NULL && fnmatch(pattern, comm, 0) == 0) ||
+			    (ppid != 0 && (pid_t)procs[i].pbsi_pid == ppid);
+
+			/* walk up the ancestors looking for ppid */
+			for (parent = procs[i].pbsi_ppid, depth = 0;
+			    ppid != 0 && !selected && parent > 0 && depth < nprocs; depth++) {
+				if (parent == ppid) {
+					selected = true;
+					break;
+				}
+				key.pbsi_pid = parent;
+				ancestor = bsearch(&key, procs, nprocs, sizeof(struct proc_bsdshortinfo), proc_cmp);
+				if (ancestor == NULL || (pid_t)ancestor->pbsi_ppid == parent) {
+					break;
+				}
+				parent = ancestor->pbsi_ppid;
+			}
+
+			if (selected) {
+				*pids = reallocf(*pids, (*npids + 1) * sizeof(pid_t));
+				if (*pids == NULL) {
+					err(EX_OSERR, "reallocf");
+				}
+				(*pids)[(*npids)++] = procs[i].pbsi_pid;
+			}
+		}
+
+		proctab_free(&pt);
+		free(procs);
+	}
+
+	if (*npids > 1) {
+		qsort(*pids, *npids, sizeof(pid_t), pid_cmp);
+		for (i = j = 1; i < *npids; i++) {
+			if ((*pids)[i] != (*pids)[j - 1]) {
+				(*pids)[j++] = (*pids)[i];
+			}
+		}
+		*npids = j;
+	}
+
+	return 0;
+}
+
+/*
+ * Apply the policy to one running process.  With report, print what was
+ * changed and carry on after a failure rather than exiting.
+ */
+static int apply_policy(pid_t pid, const struct target_policy *policy, bool report)
+{
+	char name[2 * MAXCOMLEN + 1] = "";
+	char change[128] = "";
+	mach_port_t task;
+	int ret, was_bg;
+
+	if (report && proc_name(pid, name, sizeof(name)) <= 0) {
+		strlcpy(name, "-", sizeof(name));
+	}
+
+	if (policy->background || policy->foreground) {
+		errno = 0;
+		was_bg = getpriority(PRIO_DARWIN_PROCESS, pid);
+		if (was_bg == -1 && errno != 0) {
+			was_bg = -1;
+		}
+
+		ret = setpriority(PRIO_DARWIN_PROCESS, pid, policy->background ? PRIO_DARWIN_BG : 0);
+		if (ret == -1) {
+			if (!report) {
+				err(EX_SOFTWARE, "setpriority()");
+			}
+			warn("%d (%s): setpriority()", pid, name);
+			return -1;
+		}
+
+		snprintf(change, sizeof(change), "darwin bg %s%s",
+		    was_bg == -1 ? "" : (was_bg ? "on -> " : "off -> "),
+		    policy->background ? "on" : "off");
+	}
+
+	if (policy->qosinfo.task_latency_qos_tier != LATENCY_QOS_TIER_UNSPECIFIED ||
+	    policy->qosinfo.task_throughput_qos_tier != THROUGHPUT_QOS_TIER_UNSPECIFIED) {
+		ret = task_name_for_pid(mach_task_self(), pid, &task);
+		if (ret != KERN_SUCCESS) {
+			if (!report) {
+				err(EX_SOFTWARE, "task_name_for_pid(%d) failed", pid);
+			}
+			warnx("%d (%s): task_name_for_pid() failed", pid, name);
+			return -1;
+		}
+
+		ret = task_policy_set((task_t)task, TASK_OVERRIDE_QOS_POLICY,
+		    (task_policy_t)&policy->qosinfo, TASK_QOS_POLICY_COUNT);
+		mach_port_deallocate(mach_task_self(), task);
+		if (ret != KERN_SUCCESS) {
+			if (!report) {
+				err(EX_SOFTWARE, "task_policy_set(...TASK_OVERRIDE_QOS_POLICY...)");
+			}
+			warnx("%d (%s): task_policy_set(...TASK_OVERRIDE_QOS_POLICY...) failed", pid, name);
+			return -1;
+		}
+
+		if (policy->latency_tier != NULL) {
+			snprintf(change + strlen(change), sizeof(change) - strlen(change),
+			    "%slatency tier %s", change[0] ? ", " : "", policy->latency_tier);
+		}
+		if (policy->throughput_tier != NULL) {
+			snprintf(change + strlen(change), sizeof(change) - strlen(change),
+			    "%sthroughput tier %s", change[0] ? ", " : "", policy->throughput_tier);
+		}
+	}
+
+	if (report) {
+		printf("%6d %-16s %s\n", pid, name, change[0] ? change : "unchanged");
+	}
+
+	return 0;
+}
+
+static int pid_cmp(const void *a, const void *b)
+{
+	pid_t pa = *(const pid_t *)a, pb = *(const pid_t *)b;
+
+	return (pa > pb) - (pa < pb);
+}
+
 static int parse_disk_policy(const char *strpolicy)
 {
 	long policy;
@@ -323,3 +576,11 @@ static uint64_t parse_qos_clamp(const char *qos_string) {
         return POSIX_SPAWN_PROC_CLAMP_NONE;
     }
 }
+
+static int proc_cmp(const void *a, const void *b)
+{
+	uint32_t pa = ((const struct proc_bsdshortinfo *)a)->pbsi_pid;
+	uint32_t pb = ((const struct proc_bsdshortinfo *)b)->pbsi_pid;
+
+	return (pa > pb) - (pa < pb);
+}
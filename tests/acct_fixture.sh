@@ -0,0 +1,86 @@
+#!/bin/sh
+#
+# Synthetic accounting inputs for the sa and ac benchmarks in
+# system_cmds.plist, in the host's (little-endian, LP64) record layouts.
+#
+#	acct_fixture.sh acct count out	write count struct acct records, as
+#					in /var/account/acct, to out
+#	acct_fixture.sh wtmpx count out	write a utmpx signature and count
+#					login and logout struct utmpx records
+#					to out, whose name must end in x for
+#					wtmpxname(3)
+#
+# awk lays each record out as a line of octal escapes, which the shell's
+# builtin printf turns into bytes without a process per record.
+#
+
+ACCT_FIELDS='
+function le(n, k,	s, i) {
+	for (i = 0; i < k; i++) {
+		s = s sprintf("\\%03o", n % 256)
+		n = int(n / 256)
+	}
+	return s
+}
+function str(x, k,	s, i) {
+	for (i = 1; i <= k; i++)
+		s = s sprintf("\\%03o", i <= length(x) ? ord[substr(x, i, 1)] : 0)
+	return s
+}
+BEGIN {
+	for (i = 32; i < 127; i++)
+		ord[sprintf("%c", i)] = i
+	t0 = 1700000000
+}
+'
+
+emit() {
+	while IFS= read -r l; do
+		printf "$l"
+	done
+}
+
+# struct acct: ac_comm[10], ac_utime, ac_stime, ac_etime (comp_t),
+# ac_btime, ac_uid, ac_gid, ac_mem (u_int16_t), ac_io (comp_t), ac_tty,
+# ac_flag, padding; 40 bytes.
+acct() {
+	awk -v n=$1 "$ACCT_FIELDS"'
+	BEGIN {
+		for (i = 0; i < n; i++)
+			print str("bench" i % 200, 10) le(i % 50, 2) le(i % 20, 2) \
+			    le(i % 100 + 1, 2) le(t0 + i, 4) le(10000 + i % 100, 4) \
+			    le(20, 4) le(i % 4096, 2) le(i % 64, 2) le(4294967295, 4) \
+			    le(i % 7 == 0 ? 1 : 0, 1) le(0, 3)
+	}' | emit
+}
+
+# struct utmpx: ut_user[256], ut_id[4], ut_line[32], ut_pid, ut_type,
+# padding, ut_tv (8 byte tv_sec, 4 byte tv_usec, padding), ut_host[256],
+# ut_pad[16]; 640 bytes.
+wtmpx() {
+	awk -v n=$1 "$ACCT_FIELDS"'
+	function utmpx(user, id, line, pid, type, sec) {
+		return str(user, 256) str(id, 4) str(line, 32) le(pid, 4) \
+		    le(type, 2) le(0, 6) le(sec, 8) le(0, 8) str("", 256) le(0, 64)
+	}
+	BEGIN {
+		print utmpx("utmpx-1.00", "", "", 0, 10, 0)
+		for (i = 0; i < n; i += 2) {
+			tty = sprintf("ttys%03d", i / 2 % 256)
+			id = sprintf("s%03d", i / 2 % 256)
+			print utmpx("bench" i / 2 % 100, id, tty, 1000 + i, 7, t0 + i * 30)
+			print utmpx("", id, tty, 1000 + i, 8, t0 + i * 30 + 45)
+		}
+	}' | emit
+}
+
+case "$1" in
+acct|wtmpx)
+	[ $# = 3 ] || exit 2
+	$1 $2 > "$3"
+	;;
+*)
+	echo "usage: $0 acct | wtmpx count out" >&2
+	exit 2
+	;;
+esac
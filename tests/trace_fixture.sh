@@ -0,0 +1,90 @@
+#!/bin/sh
+#
+# Raw trace files shared by the replay tests in system_cmds.plist, so that
+# trace, fs_usage and latency all read the same recording.
+#
+#	trace_fixture.sh record		record /tmp/system_cmds.bench.raw with
+#					trace -L, unless it is already there,
+#					and print its name
+#	trace_fixture.sh record-z	the same with trace -L -z, into
+#					/tmp/system_cmds.bench.rawz
+#	trace_fixture.sh rawz in out	copy the raw file in to out as
+#					a compressed raw file whose chunks are
+#					all stored as is
+#
+# The stored chunks let a test compare replaying the compressed form with
+# replaying the plain one byte for byte, without an LZ4 encoder at hand.
+#
+
+TRACE=/usr/bin/trace
+RAWZ_MAGIC=$((0x315a444b))
+RAWZ_CHUNK=8388608		# what trace -L -z writes, STREAM_BUF_EVENTS kd_bufs
+
+le32() {
+	printf "$(printf '\\%03o\\%03o\\%03o\\%03o' \
+	    $(($1 & 255)) $(($1 >> 8 & 255)) $(($1 >> 16 & 255)) $(($1 >> 24 & 255)))"
+}
+
+le64() {
+	le32 $(($1 & 4294967295))
+	le32 $(($1 >> 32))
+}
+
+record() {
+	f=$1
+	shift
+	if [ ! -s $f ]; then
+		$TRACE -i -b 1000000 && $TRACE -e || exit 1
+		$TRACE -L $f.tmp "$@" -S 5 > /dev/null
+		s=$?
+		$TRACE -r
+		if [ $s != 0 ]; then
+			rm -f $f.tmp
+			exit 1
+		fi
+		mv $f.tmp $f || exit 1
+	fi
+	echo $f
+}
+
+rawz() {
+	in=$1
+	out=$2
+	size=$(($(wc -c < "$in")))
+
+	{ le32 $RAWZ_MAGIC; le32 1; le32 256; le32 $RAWZ_CHUNK; } > "$out" || exit 1
+	: > "$out.index"
+
+	offset=16 raw_offset=0 n=0
+	while [ $raw_offset -lt $size ]; do
+		len=$((size - raw_offset < RAWZ_CHUNK ? size - raw_offset : RAWZ_CHUNK))
+
+		{ le32 $len; le32 $len; le64 0; } >> "$out"
+		dd if="$in" bs=$RAWZ_CHUNK skip=$n count=1 2> /dev/null >> "$out" || exit 1
+		{ le64 $offset; le64 $raw_offset; le64 0; } >> "$out.index"
+
+		offset=$((offset + 16 + len))
+		raw_offset=$((raw_offset + len))
+		n=$((n + 1))
+	done
+	cat "$out.index" >> "$out"
+	rm -f "$out.index"
+	{ le64 $offset; le32 $n; le32 $RAWZ_MAGIC; } >> "$out"
+}
+
+case "$1" in
+record)
+	record /tmp/system_cmds.bench.raw
+	;;
+record-z)
+	record /tmp/system_cmds.bench.rawz -z
+	;;
+rawz)
+	[ $# = 3 ] || exit 2
+	rawz "$2" "$3"
+	;;
+*)
+	echo "usage: $0 record | record-z | rawz in out" >&2
+	exit 2
+	;;
+esac
@@ -0,0 +1,1137 @@
+/*
+ * Copyright (c) 2026 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+ * The kdebug plumbing shared by trace, latency and sc_usage: the
+ * KERN_KDEBUG sysctls, the kernel's thread map, raw trace files and their
+ * compressed form from rawz.h, a table of per-thread state keyed by thread
+ * id, start and end event pairing, the compiled code files and their cache,
+ * and mach time conversion.
+ *
+ * Include it after <sys/kdebug.h>.  It is all static inline, so there is
+ * nothing to link.  Failures come back as -1 (or NULL) with errno set,
+ * leaving the messages, and whether they are fatal, to each tool.
+ */
+
+#ifndef _KDCORE_H_
+#define _KDCORE_H_
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysctl.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+
+#include "rawz.h"
+
+#ifndef RAW_VERSION1
+typedef struct {
+	int version_no;
+	int thread_count;
+	uint64_t TOD_secs;
+	uint32_t TOD_usecs;
+} RAW_header;
+
+#define RAW_VERSION0	0x55aa0000
+#define RAW_VERSION1	0x55aa0101
+#endif
+
+/*
+ * KERN_KDEBUG operations.  buf and size are the sysctl's old value, which
+ * is where the kernel both takes and returns kd_regtype and friends; an
+ * operation with an argument, like KERN_KDENABLE, takes it as the fourth
+ * component of the name.
+ */
+static inline int
+kdc_op(int op, void *buf, size_t *size)
+{
+	int	mib[] = { CTL_KERN, KERN_KDEBUG, op };
+	size_t	needed = 0;
+
+	return (sysctl(mib, 3, buf, size ? size : &needed, NULL, 0));
+}
+
+static inline int
+kdc_op_value(int op, int value)
+{
+	int	mib[] = { CTL_KERN, KERN_KDEBUG, op, value };
+	size_t	needed = 0;
+
+	return (sysctl(mib, 4, NULL, &needed, NULL, 0));
+}
+
+static inline int
+kdc_enable(int val)
+{
+	return (kdc_op_value(KERN_KDENABLE, val));
+}
+
+static inline int
+kdc_setbuf(int nbufs)
+{
+	return (kdc_op_value(KERN_KDSETBUF, nbufs));
+}
+
+static inline int
+kdc_setup(void)
+{
+	return (kdc_op(KERN_KDSETUP, NULL, NULL));
+}
+
+static inline int
+kdc_remove(void)
+{
+	return (kdc_op(KERN_KDREMOVE, NULL, NULL));
+}
+
+static inline int
+kdc_getbuf(kbufinfo_t *bufinfo)
+{
+	size_t	size = sizeof(*bufinfo);
+
+	return (kdc_op(KERN_KDGETBUF, bufinfo, &size));
+}
+
+static inline int
+kdc_setreg(int type, unsigned int value1, unsigned int value2)
+{
+	kd_regtype kr = { .type = type, .value1 = value1, .value2 = value2 };
+	size_t	size = sizeof(kr);
+
+	return (kdc_op(KERN_KDSETREG, &kr, &size));
+}
+
+/*
+ * Turn the KERN_KDPIDTR (trace only pid) or KERN_KDPIDEX (trace all but
+ * pid) filter on or off for pid.
+ */
+static inline int
+kdc_pidcheck(int op, int pid, int on)
+{
+	kd_regtype kr = { .type = KDBG_TYPENONE, .value1 = pid, .value2 = on };
+	size_t	size = sizeof(kr);
+
+	return (kdc_op(op, &kr, &size));
+}
+
+/*
+ * Read the trace buffer into buf, which is *size bytes.  On return *size
+ * is the number of events read, not their size.
+ */
+static inline int
+kdc_readtr(void *buf, size_t *size)
+{
+	return (kdc_op(KERN_KDREADTR, buf, size));
+}
+
+/*
+ * The kernel's map of threads to commands, for nthreads threads (from
+ * kbufinfo_t.nkdthreads).  *count is set to the entries actually filled
+ * in; the map is the caller's to free().
+ */
+static inline kd_threadmap *
+kdc_threadmap(int nthreads, int *count)
+{
+	kd_threadmap *map;
+	size_t	size;
+
+	if (nthreads <= 0) {
+		errno = ENOENT;
+		return (NULL);
+	}
+	if ((map = calloc((size_t)nthreads, sizeof(kd_threadmap))) == NULL)
+		return (NULL);
+
+	size = (size_t)nthreads * sizeof(kd_threadmap);
+
+	if (kdc_op(KERN_KDTHRMAP, map, &size) < 0) {
+		free(map);
+		return (NULL);
+	}
+	if (size > (size_t)nthreads * sizeof(kd_threadmap))
+		size = (size_t)nthreads * sizeof(kd_threadmap);
+	*count = (int)(size / sizeof(kd_threadmap));
+
+	return (map);
+}
+
+/*
+ * Raw trace files.  A regular file is mapped and its records are walked
+ * in place; anything else, such as a pipe, or a failure to map, is read
+ * with read().  offset is the read position within the mapping.
+ */
+struct kdc_raw {
+	int	fd;
+	char	*map;
+	size_t	size;
+	size_t	offset;
+};
+
+static inline void
+kdc_raw_open(struct kdc_raw *raw, int fd)
+{
+	struct stat	st;
+	void		*addr;
+
+	raw->fd = fd;
+	raw->map = NULL;
+	raw->size = 0;
+	raw->offset = 0;
+
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+		return;
+
+	if ((uint64_t)st.st_size > SIZE_MAX)
+		return;
+
+	addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	if (addr == MAP_FAILED)
+		return;
+
+	(void)madvise(addr, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+	raw->map = addr;
+	raw->size = (size_t)st.st_size;
+}
+
+/*
+ * Bytes left in the mapping, or 0 if the file isn't mapped.
+ */
+static inline size_t
+kdc_raw_left(const struct kdc_raw *raw)
+{
+	return (raw->size - raw->offset);
+}
+
+/*
+ * Return a pointer to the next len bytes of the mapped file and move past
+ * them, or NULL if there aren't that many left.
+ */
+static inline void *
+kdc_raw_take(struct kdc_raw *raw, size_t len)
+{
+	void	*p;
+
+	if (kdc_raw_left(raw) < len)
+		return (NULL);
+
+	p = raw->map + raw->offset;
+	raw->offset += len;
+
+	return (p);
+}
+
+/*
+ * read() and lseek() on the file, from the mapping when there is one.
+ */
+static inline ssize_t
+kdc_raw_read(struct kdc_raw *raw, void *buf, size_t len)
+{
+	size_t	left;
+	ssize_t	n;
+	char	*p = buf;
+
+	if (!raw->map) {
+		/* a pipe may hand over less than it was asked for */
+		for (left = len; left; left -= (size_t)n, p += n) {
+			if ((n = read(raw->fd, p, left)) <= 0) {
+				if (n < 0 && left == len)
+					return (-1);
+				break;
+			}
+		}
+		return ((ssize_t)(len - left));
+	}
+	if (len > kdc_raw_left(raw))
+		len = kdc_raw_left(raw);
+	memcpy(buf, raw->map + raw->offset, len);
+	raw->offset += len;
+
+	return ((ssize_t)len);
+}
+
+static inline off_t
+kdc_raw_seek(struct kdc_raw *raw, off_t offset, int whence)
+{
+	if (!raw->map)
+		return (lseek(raw->fd, offset, whence));
+
+	if (whence == SEEK_CUR)
+		offset += (off_t)raw->offset;
+	else if (whence != SEEK_SET) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (offset < 0 || (uint64_t)offset > raw->size) {
+		errno = EINVAL;
+		return (-1);
+	}
+	raw->offset = (size_t)offset;
+
+	return (offset);
+}
+
+/*
+ * Read the file's header.  A RAW_VERSION0 file has only the thread count,
+ * and is given the current time as its time of day.
+ */
+static inline int
+kdc_raw_header(struct kdc_raw *raw, RAW_header *header)
+{
+	errno = 0;
+
+	if (kdc_raw_read(raw, header, sizeof(*header)) != sizeof(*header))
+		goto short_read;
+
+	if (header->version_no != RAW_VERSION1) {
+		header->version_no = RAW_VERSION0;
+		header->TOD_secs = (uint64_t)time(NULL);
+		header->TOD_usecs = 0;
+
+		if (kdc_raw_seek(raw, 0, SEEK_SET) < 0)
+			return (-1);
+		if (kdc_raw_read(raw, &header->thread_count, sizeof(int)) != sizeof(int))
+			goto short_read;
+	}
+	return (0);
+
+short_read:
+	if (errno == 0)
+		errno = EINVAL;
+	return (-1);
+}
+
+/*
+ * RAW_VERSION1 files start the events (and with trace, the cpu map) on
+ * the page after the thread map.
+ */
+static inline int
+kdc_raw_align(struct kdc_raw *raw)
+{
+	off_t	offset;
+
+	if ((offset = kdc_raw_seek(raw, 0, SEEK_CUR)) < 0)
+		return (-1);
+
+	return (kdc_raw_seek(raw, (offset + 4095) & ~(off_t)4095, SEEK_SET) < 0 ? -1 : 0);
+}
+
+/*
+ * A table of per-thread state, by thread id: open addressing from a
+ * multiplicative hash, kept at most three quarters full, with deleted
+ * slots filled by shifting back the entries that probed past them, so
+ * lookups never walk tombstones.
+ *
+ * Each slot holds a value of value_size bytes, set when the table is
+ * declared:
+ *
+ *	struct kdc_threads t = KDC_THREADS_INITIALIZER(struct state);
+ *
+ * kdc_threads_claim() and kdc_threads_lookup() return a pointer to the
+ * value in its slot, which is only good until the table next changes: a
+ * claim may move everything, and a release may move its neighbours.
+ * Tables whose values are the caller's own pointers, which stay put, can
+ * use kdc_threads_find(), kdc_threads_insert() and kdc_threads_remove()
+ * instead.
+ */
+#define KDC_THREADS_MIN_SIZE	1024
+
+#define KDC_THREADS_INITIALIZER(type)	{ .value_size = sizeof(type) }
+
+struct kdc_thread_slot {
+	uint64_t	thread;
+	uint32_t	used;
+	uint32_t	pad;
+	/* then the value */
+};
+
+struct kdc_threads {
+	char		*slots;
+	size_t		value_size;
+	size_t		slot_size;
+	uint32_t	size;		/* a power of 2 */
+	uint32_t	shift;
+	uint32_t	count;
+	uint32_t	peak;
+	uint32_t	resizes;
+	uint32_t	max_probe;
+};
+
+static inline struct kdc_thread_slot *
+kdc_threads_at(const struct kdc_threads *t, uint32_t i)
+{
+	return ((struct kdc_thread_slot *)(void *)(t->slots + (size_t)i * t->slot_size));
+}
+
+static inline void *
+kdc_threads_value(struct kdc_thread_slot *s)
+{
+	return (s + 1);
+}
+
+/*
+ * The thread a value returned by the table belongs to.
+ */
+static inline uint64_t
+kdc_threads_thread(const void *value)
+{
+	return (((const struct kdc_thread_slot *)value - 1)->thread);
+}
+
+static inline uint32_t
+kdc_threads_hash(const struct kdc_threads *t, uint64_t thread)
+{
+	return ((uint32_t)((thread * 0x9e3779b97f4a7c15ULL) >> t->shift));
+}
+
+static inline int
+kdc_threads_resize(struct kdc_threads *t, uint32_t size)
+{
+	struct kdc_thread_slot *s;
+	char		*old_slots = t->slots;
+	uint32_t	old_size = t->size;
+	uint32_t	i, j;
+
+	t->slot_size = sizeof(struct kdc_thread_slot) + ((t->value_size + 7) & ~(size_t)7);
+
+	if ((t->slots = calloc(size, t->slot_size)) == NULL) {
+		t->slots = old_slots;
+		return (-1);
+	}
+	if (old_slots)
+		t->resizes++;
+	t->size = size;
+	t->shift = 64 - (uint32_t)__builtin_ctz(size);
+
+	for (i = 0; i < old_size; i++) {
+		s = (struct kdc_thread_slot *)(void *)(old_slots + (size_t)i * t->slot_size);
+
+		if (!s->used)
+			continue;
+
+		for (j = kdc_threads_hash(t, s->thread); kdc_threads_at(t, j)->used; j = (j + 1) & (size - 1))
+			;
+		memcpy(kdc_threads_at(t, j), s, t->slot_size);
+	}
+	free(old_slots);
+
+	return (0);
+}
+
+/*
+ * Size the table for n more threads, so that loading a thread map doesn't
+ * resize it over and over.
+ */
+static inline int
+kdc_threads_reserve(struct kdc_threads *t, uint32_t n)
+{
+	uint32_t	size;
+
+	for (size = t->size ? t->size : KDC_THREADS_MIN_SIZE; (uint64_t)(t->count + n) * 4 > (uint64_t)size * 3; size *= 2)
+		;
+	if (size == t->size)
+		return (0);
+
+	return (kdc_threads_resize(t, size));
+}
+
+static inline struct kdc_thread_slot *
+kdc_threads_slot(struct kdc_threads *t, uint64_t thread)
+{
+	struct kdc_thread_slot *s;
+	uint32_t	i, probe;
+
+	if (t->slots == NULL)
+		return (NULL);
+
+	for (i = kdc_threads_hash(t, thread), probe = 0;; i = (i + 1) & (t->size - 1), probe++) {
+		s = kdc_threads_at(t, i);
+
+		if (!s->used)
+			return (NULL);
+		if (s->thread == thread)
+			break;
+	}
+	if (probe > t->max_probe)
+		t->max_probe = probe;
+
+	return (s);
+}
+
+/*
+ * Return thread's value, or NULL if it has none.
+ */
+static inline void *
+kdc_threads_lookup(struct kdc_threads *t, uint64_t thread)
+{
+	struct kdc_thread_slot *s = kdc_threads_slot(t, thread);
+
+	return (s ? kdc_threads_value(s) : NULL);
+}
+
+/*
+ * Return thread's value, giving it a zeroed one if it has none.  Fails,
+ * returning NULL, if the table can't grow.
+ */
+static inline void *
+kdc_threads_claim(struct kdc_threads *t, uint64_t thread)
+{
+	struct kdc_thread_slot *s;
+	uint32_t i;
+
+	if ((s = kdc_threads_slot(t, thread)))
+		return (kdc_threads_value(s));
+
+	if (kdc_threads_reserve(t, 1) < 0)
+		return (NULL);
+
+	for (i = kdc_threads_hash(t, thread); kdc_threads_at(t, i)->used; i = (i + 1) & (t->size - 1))
+		;
+	s = kdc_threads_at(t, i);
+	s->thread = thread;
+	s->used = 1;
+
+	if (++t->count > t->peak)
+		t->peak = t->count;
+
+	return (kdc_threads_value(s));
+}
+
+/*
+ * Give up the slot of a value the table returned.
+ */
+static inline void
+kdc_threads_release(struct kdc_threads *t, void *value)
+{
+	struct kdc_thread_slot *s = (struct kdc_thread_slot *)value - 1;
+	uint32_t	mask = t->size - 1;
+	uint32_t	i, j, k;
+
+	t->count--;
+	memset(s, 0, t->slot_size);
+
+	for (i = j = (uint32_t)(((char *)s - t->slots) / t->slot_size);;) {
+		j = (j + 1) & mask;
+
+		if (!kdc_threads_at(t, j)->used)
+			return;
+
+		k = kdc_threads_hash(t, kdc_threads_at(t, j)->thread);
+
+		/* leave it if its home slot is cyclically in (i, j] */
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+
+		memcpy(kdc_threads_at(t, i), kdc_threads_at(t, j), t->slot_size);
+		memset(kdc_threads_at(t, j), 0, t->slot_size);
+		i = j;
+	}
+}
+
+/*
+ * Make dst a copy of src, which holds the same type of value.  Values
+ * that point elsewhere are the caller's to copy in turn.
+ */
+static inline int
+kdc_threads_copy(struct kdc_threads *dst, const struct kdc_threads *src)
+{
+	*dst = *src;
+	dst->slots = NULL;
+
+	if (src->slots == NULL)
+		return (0);
+
+	if ((dst->slots = malloc((size_t)src->size * src->slot_size)) == NULL)
+		return (-1);
+	memcpy(dst->slots, src->slots, (size_t)src->size * src->slot_size);
+
+	return (0);
+}
+
+/*
+ * For tables of pointers: return thread's pointer, or NULL.
+ */
+static inline void *
+kdc_threads_find(struct kdc_threads *t, uint64_t thread)
+{
+	void	**v = kdc_threads_lookup(t, thread);
+
+	return (v ? *v : NULL);
+}
+
+/*
+ * For tables of pointers: set thread's pointer, which must not be NULL,
+ * returning the one it replaced, or NULL.  Fails, returning value itself,
+ * if the table can't grow.
+ */
+static inline void *
+kdc_threads_insert(struct kdc_threads *t, uint64_t thread, void *value)
+{
+	void	**v, *old;
+
+	if ((v = kdc_threads_claim(t, thread)) == NULL)
+		return (value);
+
+	old = *v;
+	*v = value;
+
+	return (old);
+}
+
+/*
+ * For tables of pointers: take thread out of the table, returning its
+ * pointer, or NULL if it wasn't there.
+ */
+static inline void *
+kdc_threads_remove(struct kdc_threads *t, uint64_t thread)
+{
+	void	**v, *value;
+
+	if ((v = kdc_threads_lookup(t, thread)) == NULL)
+		return (NULL);
+
+	value = *v;
+	kdc_threads_release(t, v);
+
+	return (value);
+}
+
+/*
+ * Visit every thread, in no particular order:
+ *
+ *	kdc_threads_walk_start(&t, &w);
+ *	while ((v = kdc_threads_walk_next(&t, &w)))
+ *		...
+ *
+ * kdc_threads_walk_next() returns each value in its slot, and
+ * kdc_threads_next() the pointer held in it, for tables of pointers.
+ * The walk starts just past an empty slot, so no run of entries spans its
+ * ends, and the thread just returned can be dropped with
+ * kdc_threads_walk_remove() without anything being visited twice or
+ * skipped.  Anything else that changes the table ends the walk.
+ */
+struct kdc_threads_walk {
+	uint32_t	slot;
+	uint32_t	left;		/* slots still to visit */
+	int		again;		/* look at slot again, it was refilled */
+};
+
+static inline void
+kdc_threads_walk_start(struct kdc_threads *t, struct kdc_threads_walk *w)
+{
+	uint32_t	i;
+
+	w->slot = 0;
+	w->left = 0;
+	w->again = 0;
+
+	if (t->slots == NULL || t->count == 0)
+		return;
+
+	for (i = 0; kdc_threads_at(t, i)->used; i++)
+		;
+	w->slot = i;
+	w->left = t->size;
+}
+
+static inline void *
+kdc_threads_walk_next(struct kdc_threads *t, struct kdc_threads_walk *w)
+{
+	for (;;) {
+		if (w->again)
+			w->again = 0;
+		else {
+			if (w->left == 0)
+				return (NULL);
+			w->slot = (w->slot + 1) & (t->size - 1);
+			w->left--;
+		}
+		if (kdc_threads_at(t, w->slot)->used)
+			return (kdc_threads_value(kdc_threads_at(t, w->slot)));
+	}
+}
+
+static inline void *
+kdc_threads_next(struct kdc_threads *t, struct kdc_threads_walk *w)
+{
+	void	**v = kdc_threads_walk_next(t, w);
+
+	return (v ? *v : NULL);
+}
+
+static inline void
+kdc_threads_walk_remove(struct kdc_threads *t, struct kdc_threads_walk *w)
+{
+	kdc_threads_release(t, kdc_threads_value(kdc_threads_at(t, w->slot)));
+	w->again = 1;
+}
+
+/*
+ * Empty the table, keeping its slots for the next lot of threads.
+ */
+static inline void
+kdc_threads_clear(struct kdc_threads *t)
+{
+	if (t->slots)
+		memset(t->slots, 0, (size_t)t->size * t->slot_size);
+	t->count = 0;
+}
+
+static inline void
+kdc_threads_free(struct kdc_threads *t)
+{
+	size_t	value_size = t->value_size;
+
+	free(t->slots);
+	memset(t, 0, sizeof(*t));
+	t->value_size = value_size;
+}
+
+/*
+ * Pairing DBG_FUNC_START events with their DBG_FUNC_END, to time them: a
+ * list of the debugids started on threads and when, kept per thread or
+ * per hash bucket of threads.  The entries start with their next pointer,
+ * so they can come from the caller's pools, and are the caller's to
+ * allocate and free.
+ */
+struct kdc_start {
+	struct kdc_start *next;
+	uint64_t	thread;
+	uint32_t	debugid;
+	uint64_t	timestamp;
+};
+
+static inline struct kdc_start *
+kdc_start_find(struct kdc_start *list, uint64_t thread, uint32_t debugid)
+{
+	for (; list; list = list->next) {
+		if (list->thread == thread && list->debugid == debugid)
+			break;
+	}
+	return (list);
+}
+
+/*
+ * Note in e, linked onto the list, that thread started debugid at now.
+ */
+static inline void
+kdc_start_push(struct kdc_start **list, struct kdc_start *e, uint64_t thread, uint32_t debugid, uint64_t now)
+{
+	e->thread = thread;
+	e->debugid = debugid;
+	e->timestamp = now;
+	e->next = *list;
+	*list = e;
+}
+
+/*
+ * Unlink and return thread's start of debugid, or NULL if there is none.
+ */
+static inline struct kdc_start *
+kdc_start_take(struct kdc_start **list, uint64_t thread, uint32_t debugid)
+{
+	struct kdc_start *e;
+
+	for (; (e = *list); list = &e->next) {
+		if (e->thread == thread && e->debugid == debugid) {
+			*list = e->next;
+			break;
+		}
+	}
+	return (e);
+}
+
+/*
+ * The codes from the code files, compiled into an open-addressed table
+ * keyed by debugid with the names kept in a separate pool.  Codes are
+ * added in the order the files list them, and of duplicate debugids the
+ * first one wins.
+ *
+ * The compiled table is cached on disk, keyed by the code files' paths,
+ * sizes and modification times, and reused while none of them changes.
+ * trace and latency share the one cache file, so each can use the table
+ * the other compiled from the same files.
+ */
+#define KDC_CODES_CACHE_MAGIC	0x54524343	/* 'TRCC' */
+#define KDC_CODES_CACHE_VERSION	2
+#define KDC_CODES_CACHE_NAME	"com.apple.trace.codes.cache"
+
+struct kdc_code_slot {
+	uint32_t	debugid;	/* 0 if the slot is empty */
+	uint32_t	name;		/* offset into names */
+};
+
+struct kdc_codes {
+	struct kdc_code_slot *table;
+	uint32_t	size;		/* slots, a power of 2 */
+	uint32_t	shift;
+	char		*names;
+	size_t		names_size;
+	int		dupes;		/* some debugid was defined twice */
+
+	/* the codes added so far, until kdc_codes_compile() */
+	struct kdc_code_slot *added;
+	size_t		nadded;
+	size_t		added_alloc;
+	size_t		names_alloc;
+
+	/* the cache file, if the table came from it */
+	void		*map;
+	size_t		map_size;
+};
+
+struct kdc_codes_cache_header {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	key_size;	/* the code files' paths, sizes and mtimes */
+	uint32_t	table_size;	/* slots, a power of 2 */
+	uint32_t	names_size;
+	uint32_t	dupes;
+};
+
+static inline uint32_t
+kdc_codes_hash(const struct kdc_codes *c, uint32_t debugid)
+{
+	return ((debugid * 0x9e3779b1U) >> c->shift);
+}
+
+/*
+ * Add a code, copying its name.  Codes with a debugid of 0 are skipped.
+ */
+static inline int
+kdc_codes_add(struct kdc_codes *c, uint32_t debugid, const char *name)
+{
+	size_t	len = strlen(name) + 1, need;
+	void	*p;
+
+	if (debugid == 0)
+		return (0);
+
+	if (c->nadded == c->added_alloc) {
+		c->added_alloc = c->added_alloc ? c->added_alloc * 2 : 1024;
+
+		if ((p = realloc(c->added, c->added_alloc * sizeof(struct kdc_code_slot))) == NULL)
+			return (-1);
+		c->added = p;
+	}
+	/* offset 0 is kept empty */
+	need = c->names_size + len + (c->names_size == 0);
+
+	if (need > c->names_alloc) {
+		while (need > c->names_alloc)
+			c->names_alloc = c->names_alloc ? c->names_alloc * 2 : 64 * 1024;
+
+		if ((p = realloc(c->names, c->names_alloc)) == NULL)
+			return (-1);
+		c->names = p;
+	}
+	if (c->names_size == 0)
+		c->names[c->names_size++] = '\0';
+
+	c->added[c->nadded].debugid = debugid;
+	c->added[c->nadded].name = (uint32_t)c->names_size;
+	c->nadded++;
+
+	memcpy(&c->names[c->names_size], name, len);
+	c->names_size += len;
+
+	return (0);
+}
+
+/*
+ * Build the table from the codes added, keeping it at most half full.
+ */
+static inline int
+kdc_codes_compile(struct kdc_codes *c)
+{
+	uint32_t	slot;
+	size_t		i;
+	int		bits;
+
+	for (bits = 4; ((size_t)1 << bits) < c->nadded * 2; bits++)
+		;
+	if ((c->table = calloc((size_t)1 << bits, sizeof(struct kdc_code_slot))) == NULL)
+		return (-1);
+	c->size = 1U << bits;
+	c->shift = 32 - (uint32_t)bits;
+
+	for (i = 0; i < c->nadded; i++) {
+		for (slot = kdc_codes_hash(c, c->added[i].debugid); c->table[slot].debugid;
+		     slot = (slot + 1) & (c->size - 1)) {
+			if (c->table[slot].debugid == c->added[i].debugid)
+				break;
+		}
+		if (c->table[slot].debugid) {
+			c->dupes = 1;
+			continue;
+		}
+		c->table[slot] = c->added[i];
+	}
+	free(c->added);
+	c->added = NULL;
+	c->nadded = c->added_alloc = 0;
+
+	return (0);
+}
+
+static inline const struct kdc_code_slot *
+kdc_codes_find(const struct kdc_codes *c, uint32_t debugid)
+{
+	uint32_t	slot;
+
+	if (c->table == NULL || debugid == 0)
+		return (NULL);
+
+	for (slot = kdc_codes_hash(c, debugid); c->table[slot].debugid; slot = (slot + 1) & (c->size - 1)) {
+		if (c->table[slot].debugid == debugid)
+			return (&c->table[slot]);
+	}
+	return (NULL);
+}
+
+static inline const char *
+kdc_codes_lookup(const struct kdc_codes *c, uint32_t debugid)
+{
+	const struct kdc_code_slot *s = kdc_codes_find(c, debugid);
+
+	return (s ? &c->names[s->name] : NULL);
+}
+
+/*
+ * The cache key for the code files, each one's real path, size and
+ * modification time, in a buffer for the caller to free.
+ */
+static inline int
+kdc_codes_cache_key(const char **files, int nfiles, char **key, size_t *key_size)
+{
+	struct stat	st;
+	char		real_path[PATH_MAX];
+	FILE		*fp;
+	int		i;
+
+	*key = NULL;
+	*key_size = 0;
+
+	if ((fp = open_memstream(key, key_size)) == NULL)
+		return (-1);
+
+	for (i = 0; i < nfiles; i++) {
+		if (stat(files[i], &st) == -1 || realpath(files[i], real_path) == NULL)
+			break;
+		fprintf(fp, "%s %lld %ld.%09ld\n", real_path, (long long)st.st_size,
+			(long)st.st_mtimespec.tv_sec, (long)st.st_mtimespec.tv_nsec);
+	}
+	fclose(fp);
+
+	if (i < nfiles) {
+		free(*key);
+		*key = NULL;
+		return (-1);
+	}
+	return (0);
+}
+
+static inline int
+kdc_codes_cache_path(char *path, size_t size)
+{
+	size_t	len = confstr(_CS_DARWIN_USER_CACHE_DIR, path, size);
+
+	if (len == 0 || len > size || strlcat(path, KDC_CODES_CACHE_NAME, size) >= size) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Map the cached table, if it was compiled from the code files that key
+ * describes.  It fails with EFTYPE if the cache is for other files, or
+ * isn't one this version can read.
+ */
+static inline int
+kdc_codes_cache_load(struct kdc_codes *c, const char *key, size_t key_size)
+{
+	const struct kdc_codes_cache_header *hdr;
+	struct stat	st;
+	char		path[PATH_MAX];
+	char		*addr;
+	size_t		size;
+	int		fd;
+
+	if (kdc_codes_cache_path(path, sizeof(path)) < 0)
+		return (-1);
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return (-1);
+
+	if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(*hdr)) {
+		close(fd);
+		errno = EFTYPE;
+		return (-1);
+	}
+	size = (size_t)st.st_size;
+
+	addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (addr == MAP_FAILED)
+		return (-1);
+
+	hdr = (const struct kdc_codes_cache_header *)(void *)addr;
+
+	if (hdr->magic != KDC_CODES_CACHE_MAGIC || hdr->version != KDC_CODES_CACHE_VERSION ||
+	    hdr->key_size != key_size || hdr->table_size < 16 ||
+	    (hdr->table_size & (hdr->table_size - 1)) != 0 || hdr->names_size == 0 ||
+	    size != sizeof(*hdr) + hdr->key_size + (size_t)hdr->table_size * sizeof(struct kdc_code_slot) +
+	    hdr->names_size ||
+	    memcmp(addr + sizeof(*hdr), key, key_size) != 0 ||
+	    addr[size - 1] != '\0') {
+		munmap(addr, size);
+		errno = EFTYPE;
+		return (-1);
+	}
+	c->table = (struct kdc_code_slot *)(void *)(addr + sizeof(*hdr) + hdr->key_size);
+	c->size = hdr->table_size;
+	c->shift = 32 - (uint32_t)__builtin_ctz(c->size);
+	c->names = (char *)&c->table[c->size];
+	c->names_size = hdr->names_size;
+	c->dupes = hdr->dupes != 0;
+	c->map = addr;
+	c->map_size = size;
+
+	return (0);
+}
+
+/*
+ * Write the table out to the cache, replacing the old one atomically.
+ */
+static inline int
+kdc_codes_cache_save(const struct kdc_codes *c, const char *key, size_t key_size)
+{
+	struct kdc_codes_cache_header hdr;
+	char		path[PATH_MAX];
+	char		tmp_path[PATH_MAX];
+	FILE		*fp;
+	int		fd, saved_errno;
+
+	if (kdc_codes_cache_path(path, sizeof(path)) < 0)
+		return (-1);
+
+	if (snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path) >= (int)sizeof(tmp_path)) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = KDC_CODES_CACHE_MAGIC;
+	hdr.version = KDC_CODES_CACHE_VERSION;
+	hdr.key_size = (uint32_t)key_size;
+	hdr.table_size = c->size;
+	hdr.names_size = (uint32_t)c->names_size;
+	hdr.dupes = (uint32_t)c->dupes;
+
+	if ((fd = mkstemp(tmp_path)) == -1)
+		return (-1);
+
+	if ((fp = fdopen(fd, "w")) == NULL) {
+		saved_errno = errno;
+		close(fd);
+		unlink(tmp_path);
+		errno = saved_errno;
+		return (-1);
+	}
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+	fwrite(key, key_size, 1, fp);
+	fwrite(c->table, sizeof(struct kdc_code_slot), c->size, fp);
+	fwrite(c->names, 1, c->names_size, fp);
+
+	if (fclose(fp) != 0 || rename(tmp_path, path) != 0) {
+		saved_errno = errno;
+		unlink(tmp_path);
+		errno = saved_errno;
+		return (-1);
+	}
+	return (0);
+}
+
+static inline void
+kdc_codes_free(struct kdc_codes *c)
+{
+	if (c->map) {
+		munmap(c->map, c->map_size);
+	} else {
+		free(c->table);
+		free(c->names);
+	}
+	free(c->added);
+	memset(c, 0, sizeof(*c));
+}
+
+/*
+ * mach_absolute_time() units.  divisor is ticks per microsecond, what the
+ * tools have always divided by; kdc_abs_to_ns() is exact, without going
+ * through a double.
+ */
+struct kdc_timebase {
+	uint32_t	numer;
+	uint32_t	denom;
+	double		divisor;
+};
+
+static inline void
+kdc_timebase_init(struct kdc_timebase *tb)
+{
+	mach_timebase_info_data_t info;
+
+	(void)mach_timebase_info(&info);
+
+	tb->numer = info.numer;
+	tb->denom = info.denom;
+	tb->divisor = ((double)info.denom / (double)info.numer) * 1000;
+}
+
+static inline uint64_t
+kdc_abs_to_ns(const struct kdc_timebase *tb, uint64_t t)
+{
+	if (tb->numer == tb->denom)
+		return (t);
+
+	return ((t / tb->denom) * tb->numer + (t % tb->denom) * tb->numer / tb->denom);
+}
+
+static inline double
+kdc_abs_to_us(const struct kdc_timebase *tb, uint64_t t)
+{
+	return ((double)t / tb->divisor);
+}
+
+#endif /* _KDCORE_H_ */
@@ -0,0 +1,337 @@
+/*
+ * Copyright (c) 2026 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Compressed raw trace files, as written by trace -L -z and latency -o:
+ * the raw file in LZ4 compressed chunks of at most chunk_size bytes, the
+ * first ones holding the header and thread map and the rest a buffer of
+ * events each, followed by an index of where each chunk starts and the
+ * time of its first event:
+ *
+ *	struct rawz_header
+ *	{ struct rawz_chunk, data } ...
+ *	struct rawz_index [nchunks]
+ *	struct rawz_trailer
+ *
+ * A file cut short, without the index, can still be read up to its last
+ * complete chunk.  trace, fs_usage and latency -R expand these files
+ * before reading them.
+ *
+ * It needs nothing from kdebug, so fs_usage includes it on its own as
+ * "rawz.h"; kdcore.h includes it for the others.  It is all static inline.
+ * The reader fails with -1 and errno set; the writer, whose writes are
+ * often made on a thread of their own, returns 0 or an errno value.
+ */
+
+#ifndef _RAWZ_H_
+#define _RAWZ_H_
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <paths.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <compression.h>
+
+#define RAWZ_MAGIC		0x315a444b	/* "KDZ1" */
+#define RAWZ_VERSION		1
+
+struct rawz_header {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	algorithm;	/* a compression_algorithm */
+	uint32_t	chunk_size;
+};
+
+struct rawz_chunk {
+	uint32_t	raw_size;
+	uint32_t	comp_size;	/* equal to raw_size if stored as is */
+	uint64_t	first_timestamp;
+};
+
+struct rawz_index {
+	uint64_t	offset;		/* of the struct rawz_chunk */
+	uint64_t	raw_offset;	/* in the uncompressed file */
+	uint64_t	first_timestamp;
+};
+
+struct rawz_trailer {
+	uint64_t	index_offset;
+	uint32_t	nchunks;
+	uint32_t	magic;
+};
+
+/*
+ * Write all of buf, returning 0 or the errno of the failed write().
+ */
+static inline int
+rawz_write_all(int fd, const void *buf, size_t len)
+{
+	const char	*p = buf;
+	ssize_t		n;
+
+	while (len) {
+		if ((n = write(fd, p, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return (errno);
+		}
+		p += n;
+		len -= n;
+	}
+	return (0);
+}
+
+/*
+ * If fd is a compressed raw file, expand it into an unlinked temporary
+ * file named after prefix, close fd and return the new one, positioned at
+ * the start like fd would be.  Anything else is returned as is.  A file of
+ * an unknown version, or with a corrupt chunk, fails with EFTYPE.  If
+ * has_index is given, it is set to whether the file ended with its index.
+ */
+static inline int
+rawz_expand(int fd, const char *prefix, int *has_index)
+{
+	struct rawz_header	hdr;
+	struct rawz_trailer	trailer;
+	struct rawz_chunk	chunk;
+	char	tmp_path[MAXPATHLEN];
+	const char *tmpdir;
+	struct stat st;
+	uint8_t	*src = NULL, *dst = NULL;
+	off_t	offset, end;
+	int	tmp_fd, rc = 0;
+
+	if (has_index)
+		*has_index = 1;
+
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+	    pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || hdr.magic != RAWZ_MAGIC)
+		return (fd);
+
+	if (hdr.version != RAWZ_VERSION) {
+		errno = EFTYPE;
+		return (-1);
+	}
+	end = st.st_size;
+
+	if (pread(fd, &trailer, sizeof(trailer), end - (off_t)sizeof(trailer)) == sizeof(trailer) &&
+	    trailer.magic == RAWZ_MAGIC && trailer.index_offset <= (uint64_t)end)
+		end = (off_t)trailer.index_offset;
+	else if (has_index)
+		*has_index = 0;
+
+	if ((tmpdir = getenv("TMPDIR")) == NULL)
+		tmpdir = _PATH_TMP;
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s/%s.XXXXXX", tmpdir, prefix);
+
+	if ((tmp_fd = mkstemp(tmp_path)) == -1)
+		return (-1);
+	unlink(tmp_path);
+
+	if ((src = malloc(hdr.chunk_size)) == NULL || (dst = malloc(hdr.chunk_size)) == NULL) {
+		rc = ENOMEM;
+		goto out;
+	}
+	for (offset = sizeof(hdr); offset + (off_t)sizeof(chunk) <= end; offset += chunk.comp_size) {
+		if (pread(fd, &chunk, sizeof(chunk), offset) != sizeof(chunk))
+			break;
+		offset += sizeof(chunk);
+
+		if (chunk.raw_size > hdr.chunk_size || chunk.comp_size > chunk.raw_size) {
+			rc = EFTYPE;
+			break;
+		}
+		/* without the index, read as far as the last complete chunk */
+		if (offset + chunk.comp_size > end ||
+		    pread(fd, src, chunk.comp_size, offset) != (ssize_t)chunk.comp_size)
+			break;
+
+		if (chunk.comp_size == chunk.raw_size)
+			memcpy(dst, src, chunk.raw_size);
+		else if (compression_decode_buffer(dst, chunk.raw_size, src, chunk.comp_size,
+						   NULL, (compression_algorithm)hdr.algorithm) != chunk.raw_size) {
+			rc = EFTYPE;
+			break;
+		}
+		if ((rc = rawz_write_all(tmp_fd, dst, chunk.raw_size)) != 0)
+			break;
+	}
+out:
+	free(src);
+	free(dst);
+
+	if (rc) {
+		close(tmp_fd);
+		errno = rc;
+		return (-1);
+	}
+	close(fd);
+	lseek(tmp_fd, (off_t)0, SEEK_SET);
+
+	return (tmp_fd);
+}
+
+/*
+ * A compressed raw file being written.  write_fn is how the bytes get to fd,
+ * rawz_write_all() unless the tool has its own, such as one that waits on
+ * a non-blocking socket.
+ */
+struct rawz_writer {
+	int		fd;
+	int		(*write_fn)(int, const void *, size_t);
+	uint32_t	chunk_size;
+	void		*dst;
+	void		*scratch;
+	struct rawz_index *index;
+	uint32_t	nchunks;
+	uint32_t	nalloc;
+	uint64_t	offset;		/* bytes written to the file */
+	uint64_t	raw_offset;	/* bytes before compression */
+};
+
+static inline void
+rawz_writer_free(struct rawz_writer *w)
+{
+	free(w->index);
+	free(w->scratch);
+	free(w->dst);
+	w->index = NULL;
+	w->scratch = NULL;
+	w->dst = NULL;
+}
+
+/*
+ * Start a file of chunks of at most chunk_size bytes on fd, and write its
+ * header.
+ */
+static inline int
+rawz_writer_open(struct rawz_writer *w, int fd, uint32_t chunk_size,
+		 int (*write_fn)(int, const void *, size_t))
+{
+	struct rawz_header hdr;
+	int	rc;
+
+	memset(w, 0, sizeof(*w));
+	w->fd = fd;
+	w->write_fn = write_fn ? write_fn : rawz_write_all;
+	w->chunk_size = chunk_size;
+
+	w->dst = malloc(chunk_size);
+	w->scratch = malloc(compression_encode_scratch_buffer_size(COMPRESSION_LZ4));
+
+	if (w->dst == NULL || w->scratch == NULL) {
+		rawz_writer_free(w);
+		return (ENOMEM);
+	}
+	hdr.magic = RAWZ_MAGIC;
+	hdr.version = RAWZ_VERSION;
+	hdr.algorithm = COMPRESSION_LZ4;
+	hdr.chunk_size = chunk_size;
+
+	if ((rc = w->write_fn(fd, &hdr, sizeof(hdr))) != 0) {
+		rawz_writer_free(w);
+		return (rc);
+	}
+	w->offset = sizeof(hdr);
+
+	return (0);
+}
+
+/*
+ * Compress len bytes of the raw file, in chunks of at most chunk_size, and
+ * write them out, noting each in the index.  A chunk that doesn't get any
+ * smaller is stored as is.
+ */
+static inline int
+rawz_writer_write(struct rawz_writer *w, const void *buf, size_t len, uint64_t first_timestamp)
+{
+	const uint8_t	*p = buf;
+	struct rawz_chunk chunk;
+	struct rawz_index *ip;
+	size_t	n, comp_size;
+	int	rc;
+
+	while (len) {
+		n = MIN(len, w->chunk_size);
+
+		comp_size = compression_encode_buffer(w->dst, n - 1, p, n, w->scratch, COMPRESSION_LZ4);
+
+		chunk.raw_size = (uint32_t)n;
+		chunk.comp_size = comp_size ? (uint32_t)comp_size : (uint32_t)n;
+		chunk.first_timestamp = first_timestamp;
+
+		if (w->nchunks == w->nalloc) {
+			w->nalloc = w->nalloc ? w->nalloc * 2 : 1024;
+
+			if ((ip = realloc(w->index, w->nalloc * sizeof(struct rawz_index))) == NULL)
+				return (ENOMEM);
+			w->index = ip;
+		}
+		ip = &w->index[w->nchunks++];
+		ip->offset = w->offset;
+		ip->raw_offset = w->raw_offset;
+		ip->first_timestamp = first_timestamp;
+
+		if ((rc = w->write_fn(w->fd, &chunk, sizeof(chunk))) != 0 ||
+		    (rc = w->write_fn(w->fd, comp_size ? w->dst : p, chunk.comp_size)) != 0)
+			return (rc);
+
+		w->offset += sizeof(chunk) + chunk.comp_size;
+		w->raw_offset += n;
+
+		p += n;
+		len -= n;
+	}
+	return (0);
+}
+
+/*
+ * Write the index and trailer, and free what the writer allocated.  fd is
+ * left for the caller to close.
+ */
+static inline int
+rawz_writer_finish(struct rawz_writer *w)
+{
+	struct rawz_trailer trailer;
+	int	rc;
+
+	trailer.index_offset = w->offset;
+	trailer.nchunks = w->nchunks;
+	trailer.magic = RAWZ_MAGIC;
+
+	if ((rc = w->write_fn(w->fd, w->index, w->nchunks * sizeof(struct rawz_index))) == 0)
+		rc = w->write_fn(w->fd, &trailer, sizeof(trailer));
+
+	rawz_writer_free(w);
+
+	return (rc);
+}
+
+#endif /* _RAWZ_H_ */
@@ -19,10 +19,14 @@
 #include <sys/time.h>
 #include <sys/proc.h>
 #include <sys/ptrace.h>
+#include <sys/un.h>
 #include <sys/sysctl.h>
 #include <sys/wait.h>
 #include <sys/resource.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <ctype.h>
@@ -36,6 +40,7 @@
 #include <assert.h>
 #include <signal.h>
 #include <sysexits.h>
+#include <pthread.h>
 
 #include <libutil.h>
 
@@ -51,6 +56,8 @@
 #include <mach/mach.h>
 #include <mach/mach_time.h>
 
+#include "kdcore.h"
+
 int nbufs = 0;
 int enable_flag=0;
 int execute_flag=0;
@@ -76,6 +83,7 @@ int pid_exflag=0;
 int ppt_flag=0;
 int done_with_args=0;
 int no_default_codes_flag=0;
+int aggregate_flag=0;
 
 unsigned int value1=0;
 unsigned int value2=0;
@@ -93,6 +101,12 @@ size_t needed;
 
 char *logfile = (char *)0;      /* This file is trace format */
 char *RAW_file = (char *)0;
+
+/*
+ * A RAW_file that is a regular file is mapped rather than read, and its
+ * records are walked in place.
+ */
+struct kdc_raw raw = { -1, NULL, 0, 0 };
 FILE *output_file;
 int   output_fd;
 
@@ -118,7 +132,12 @@ uint8_t* type_filter_bitmap;
 #define EMPTYSTRING ""
 #define UNKNOWN "unknown"
 
-char tmpcommand[MAXCOMLEN];
+/*
+ * The thread names, lookups and start events that decoding keeps track of
+ * are per thread, so that -j can decode several chunks of a raw file at
+ * once.
+ */
+__thread char tmpcommand[MAXCOMLEN];
 
 int total_threads = 0;
 int nthreads = 0;
@@ -126,6 +145,7 @@ kd_threadmap *mapptr = 0;
 
 kd_cpumap_header* cpumap_header = NULL;
 kd_cpumap* cpumap = NULL;
+boolean_t cpumap_mapped = FALSE;
 
 /*
    If NUMPARMS changes from the kernel,
@@ -140,7 +160,7 @@ kd_cpumap* cpumap = NULL;
 #define US_TO_SLEEP	50000
 #define BASE_EVENTS	500000
 
-mach_timebase_info_data_t mach_timebase;
+struct kdc_timebase timebase;
 double divisor;
 
 typedef struct {
@@ -151,17 +171,12 @@ typedef struct {
 code_type_t*	codesc = 0;
 size_t			codesc_idx = 0; // Index into first empty codesc entry
 
+/*
+ * The codes from all the code files, compiled and cached by kdcore.h.
+ */
+struct kdc_codes codes;
 
 
-typedef struct event *event_t;
-
-struct event {
-	event_t	  ev_next;
-
-	uint64_t ev_thread;
-	uint32_t  ev_debugid;
-	uint64_t  ev_timestamp;
-};
 
 typedef struct lookup *lookup_t;
 
@@ -185,17 +200,143 @@ struct threadmap {
 	char		tm_command[MAXCOMLEN + 1];
 };
 
-#define HASH_SIZE	1024
-#define HASH_MASK	1023
+/*
+ * Thread names, pathname lookups in progress and start events waiting for
+ * their end are all kept per thread, in a kdcore.h thread table that grows
+ * as threads appear.  The entries themselves come out of pools, so they
+ * stay put when the table is resized and are only malloc'd a block at a
+ * time.  Each pooled entry starts with its next pointer, which links it
+ * on the pool's free list.
+ */
+#define POOL_BLOCK_ENTRIES	256
+
+struct pool_block {
+	struct pool_block	*pb_next;
+};
+
+struct pool {
+	size_t			entry_size;
+	void			*free;
+	struct pool_block	*blocks;
+	uint32_t		in_use;
+	uint32_t		peak;
+	uint32_t		allocated;
+};
+
+/*
+ * A thread's slot is given up when it holds none of the three.
+ */
+struct thread_state {
+	threadmap_t		ts_map;
+	lookup_t		ts_lookup;
+	struct kdc_start	*ts_events;
+};
+
+struct thread_table {
+	struct kdc_threads	states;
+	threadmap_t		temp;		/* waiting for their pthread to be named */
+
+	struct pool		events;
+	struct pool		lookups;
+	struct pool		maps;
+};
+
+#define THREAD_TABLE_INITIALIZER {					\
+	.states = KDC_THREADS_INITIALIZER(struct thread_state),	\
+	.events = { .entry_size = sizeof(struct kdc_start) },		\
+	.lookups = { .entry_size = sizeof(struct lookup) },	\
+	.maps = { .entry_size = sizeof(struct threadmap) },	\
+}
+
+__thread struct thread_table	threads = THREAD_TABLE_INITIALIZER;
+
+/*
+ * Where decoding a run of records picks up from the records before it.
+ * Everything else it needs is in the thread table above.
+ */
+struct decode_state {
+	int		firsttime;
+	int		lines;
+	int		io_lines;
+	uint64_t	bias;
+	uint64_t	prevdelta;
+	double		last_event_time;
+};
+
+/*
+ * A copy of the thread table above, taken where a -j chunk starts and
+ * handed to the thread that decodes it.
+ */
+struct decode_snapshot {
+	struct thread_table	threads;
+};
+
+/*
+ * With -j, a mapped raw file is split into chunks of records.  The main
+ * thread finds the state each chunk starts from, njobs threads decode
+ * them, and the main thread writes their output out in order.
+ */
+struct decode_chunk {
+	kd_buf			*kd;
+	uint32_t		count;
+	struct decode_state	state;
+	struct decode_snapshot	*snapshot;
+	char			*output;
+	size_t			output_len;
+	boolean_t		done;
+};
+
+/*
+ * -A: count the events with each debugid, and the time from each
+ * DBG_FUNC_START to its DBG_FUNC_END, instead of printing the events.
+ * Durations are also counted in log-linear buckets, AGG_SUB_BUCKETS to
+ * each power of two, for the percentiles.
+ */
+#define AGG_SUB_BUCKETS		8
+#define AGG_BUCKETS		(AGG_SUB_BUCKETS * 62)
+#define AGG_MAX_CPUS		256
+
+struct agg_entry {
+	uint32_t	debugid;
+	uint64_t	count;
+	uint64_t	pairs;
+	uint64_t	total;
+	uint64_t	min;
+	uint64_t	max;
+	uint32_t	*buckets;	/* once there is a duration */
+};
 
-event_t		event_hash[HASH_SIZE];
-lookup_t	lookup_hash[HASH_SIZE];
-threadmap_t	threadmap_hash[HASH_SIZE];
+struct agg_cpu {
+	uint64_t	count;
+	uint64_t	pairs;
+	uint64_t	total;
+};
 
-event_t		event_freelist;
-lookup_t	lookup_freelist;
-threadmap_t	threadmap_freelist;
-threadmap_t	threadmap_temp;
+struct {
+	struct agg_entry *entries;
+	uint32_t	nentries;
+	uint32_t	nalloc;
+	uint32_t	*slots;		/* index + 1 into entries, or 0 */
+	uint32_t	size;		/* a power of two */
+	uint32_t	shift;
+	uint64_t	events;
+	uint64_t	first;
+	uint64_t	last;
+	struct agg_cpu	cpus[AGG_MAX_CPUS];
+	uint32_t	ncpus;
+} agg;
+
+int			njobs = 1;
+struct decode_chunk	*decode_chunks;
+size_t			decode_nchunks;
+size_t			decode_next_chunk;
+size_t			decode_chunks_ready;
+pthread_mutex_t		decode_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t		decode_cond = PTHREAD_COND_INITIALIZER;
+
+#define DECODE_CHUNK_RECORDS	(64 * 1024)
+/* at most this many chunks per job are decoded ahead of the output */
+#define DECODE_BACKLOG		4
 
 
 #define		SBUFFER_SIZE	(128 * 4096)
@@ -204,18 +345,90 @@ char		sbuffer[SBUFFER_SIZE];
 int secs_to_run = 0;
 int use_current_buf = 0;
 
+/*
+ * -L -m: read the kernel buffer into a ring of stream_nbufs buffers, which
+ * a separate thread writes to the file, so that a slow disk doesn't hold up
+ * emptying the kernel buffer.
+ */
+#define STREAM_BUF_EVENTS	(128 * 1024)
+#define STREAM_STATS_MS		1000
+
+int stream_nbufs = 0;
+
+struct stream_buf {
+	kd_buf	*kd;
+	size_t	count;
+};
+
+struct {
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	struct stream_buf	*bufs;
+	int			head;	/* the next buffer to fill */
+	int			tail;	/* the next buffer to write */
+	int			filled;
+	boolean_t		done;
+	int			fd;
+	int			error;
+	uint64_t		bytes_written;
+	uint64_t		send_waits;	/* times the socket was full */
+	uint64_t		send_wait_ms;
+} stream = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+/*
+ * -L -z: the raw file is written in the compressed format of rawz.h, one
+ * stream buffer to a chunk.
+ */
+#define STREAM_DEFAULT_BUFS	4
+
+boolean_t compress_flag = FALSE;
+
+/*
+ * -L tcp:host:port or -L unix:path: stream the raw file to a collector
+ * instead.  It goes out framed as with -z, and a collector that saves what
+ * it is sent as is has a file that -R reads.  The socket is non-blocking,
+ * and when every stream buffer is still waiting to be sent, new events are
+ * dropped rather than leaving them in the kernel buffer to wrap.
+ */
+#define STREAM_SNDBUF		(4 * 1024 * 1024)
+
+boolean_t stream_socket = FALSE;
+
+/*
+ * -L -W: keep the last recorder_secs seconds of events in a fixed ring of
+ * buffers (-m of them, or RECORDER_DEFAULT_BUFS), and only write those to
+ * the file when tracing stops: at -S, on SIGINT or SIGUSR1, on an event
+ * with one of the -k debugids, or when a DBG_FUNC_START to DBG_FUNC_END
+ * pair takes longer than -y microseconds.
+ */
+#define RECORDER_BUF_EVENTS	(16 * 1024)
+#define RECORDER_DEFAULT_BUFS	64
+
+int		recorder_secs = 0;
+uint64_t	recorder_threshold_us = 0;
+unsigned int	recorder_codes[4];
+int		recorder_ncodes = 0;
+volatile sig_atomic_t recorder_signalled = 0;
+
+struct rawz_writer rawz;
+
 
 kbufinfo_t bufinfo = {0, 0, 0, 0};
 
 int   codenum = 0;
-int   codeindx_cache = 0;
 
 static void quit(char *);
 static int match_debugid(unsigned int, char *, int *);
 static void usage(int short_help);
 static int argtoi(int flag, char *req, char *str, int base);
 static int parse_codefile(const char *filename);
+static void load_codefiles(const char **files, int nfiles);
+static void codesc_compile(void);
 static void codesc_find_dupes(void);
+static void codesc_dupes_warning(void);
 static int read_command_map(int, uint32_t);
 static void read_cpu_map(int);
 static void find_thread_command(kd_buf *, char **);
@@ -237,7 +450,23 @@ static void set_kval_list();
 static void readtrace(char *);
 static void log_trace();
 static void Log_trace();
+static int log_open(const char *);
+static int log_connect(const char *);
+static void stream_trace(int, uint64_t);
+static void *stream_writer(void *);
+static void recorder_trace(int, uint64_t);
+static const char *recorder_check(kd_buf *, size_t);
+static void recorder_signal(int);
 static void read_trace();
+static void read_trace_parallel(struct decode_state *, uint32_t);
+static void decode_records(kd_buf *, uint32_t, struct decode_state *, FILE *);
+static void decode_write_chunks(size_t *, size_t);
+static struct decode_snapshot *decode_snapshot_take(void);
+static void decode_snapshot_install(struct decode_snapshot *);
+static void *decode_worker(void *);
+static int write_all(int, const void *, size_t);
+static void rawz_init(int);
+static int rawz_write_header(void);
 static void signal_handler(int);
 static void signal_handler_RAW(int);
 static void delete_thread_entry(uint64_t);
@@ -251,6 +480,22 @@ static int  write_command_map(int);
 static int  debugid_compar(const void *, const void *);
 
 static threadmap_t find_thread_entry(uint64_t);
+static void *pool_get(struct pool *);
+static void pool_put(struct pool *, void *);
+static void pool_free(struct pool *);
+static void pool_reserve(struct pool *, uint32_t);
+static void thread_table_reserve(uint32_t);
+static struct thread_state *thread_state_find(uint64_t);
+static struct thread_state *thread_state_get(uint64_t);
+static void thread_state_release(struct thread_state *);
+static void thread_table_free(struct thread_table *);
+static void thread_table_stats(void);
+static struct agg_entry *aggregate_entry(uint32_t);
+static void aggregate_event(uint32_t, uint32_t, uint64_t);
+static void aggregate_duration(uint32_t, uint32_t, uint64_t);
+static uint64_t aggregate_percentile(struct agg_entry *, double);
+static int aggregate_compar(const void *, const void *);
+static void aggregate_print(FILE *);
 
 static void saw_filter_class(uint8_t class);
 static void saw_filter_end_range(uint8_t end_class);
@@ -278,18 +523,6 @@ static void quit_args(const char *fmt, ...)  __printflike(1, 2);
 #define F_FLUSH_DATA	40
 #endif
 
-#ifndef RAW_VERSION1
-typedef struct {
-        int             version_no;
-        int             thread_count;
-        uint64_t        TOD_secs;
-        uint32_t        TOD_usecs;
-} RAW_header;
-
-#define RAW_VERSION0	0x55aa0000
-#define RAW_VERSION1    0x55aa0101
-#endif
-
 #define ARRAYSIZE(x) ((int)(sizeof(x) / sizeof(*x)))
 
 #define EXTRACT_CLASS_LOW(debugid)     ( (uint8_t) ( ((debugid) & 0xFF00   ) >> 8 ) )
@@ -304,21 +537,11 @@ RAW_header	raw_header;
 
 void set_enable(int val)
 {
-	mib[0] = CTL_KERN;
-	mib[1] = KERN_KDEBUG;
-	mib[2] = KERN_KDENABLE;
 #ifdef	KDEBUG_ENABLE_PPT
-	if (ppt_flag && val) {
-		mib[3] = KDEBUG_ENABLE_PPT;
-	} else {
-		mib[3] = val;
-	}
-#else
-	mib[3] = val;
+	if (ppt_flag && val)
+		val = KDEBUG_ENABLE_PPT;
 #endif
-	mib[4] = 0;
-	mib[5] = 0;
-	if (sysctl(mib, 4, NULL, &needed, NULL, 0) < 0) {
+	if (kdc_enable(val) < 0) {
 		if (errno == EINVAL) {
 			quit_args("trace facility failure, KERN_KDENABLE: trace buffer is uninitialized\n");
 		}
@@ -332,13 +555,7 @@ void set_remove(void)
 
 	errno = 0;
 
-	mib[0] = CTL_KERN;
-	mib[1] = KERN_KDEBUG;
-	mib[2] = KERN_KDREMOVE;
-	mib[3] = 0;
-	mib[4] = 0;
-	mib[5] = 0;
-	if (sysctl(mib, 3, NULL, &needed, NULL, 0) < 0)
+	if (kdc_remove() < 0)
 	{
 		if (errno == EBUSY)
 			quit("the trace facility is currently in use...\n          fs_usage, sc_usage, trace, and latency use this feature.\n\n");
@@ -349,53 +566,23 @@ void set_remove(void)
 
 void set_numbufs(int nbufs)
 {
-	mib[0] = CTL_KERN;
-	mib[1] = KERN_KDEBUG;
-	mib[2] = KERN_KDSETBUF;
-	mib[3] = nbufs;
-	mib[4] = 0;
-	mib[5] = 0;
-	if (sysctl(mib, 4, NULL, &needed, NULL, 0) < 0)
+	if (kdc_setbuf(nbufs) < 0)
 		quit_args("trace facility failure, KERN_KDSETBUF: %s\n", strerror(errno));
 
-	mib[0] = CTL_KERN;
-	mib[1] = KERN_KDEBUG;
-	mib[2] = KERN_KDSETUP;
-	mib[3] = 0;
-	mib[4] = 0;
-	mib[5] = 0;
-	if (sysctl(mib, 3, NULL, &needed, NULL, 0) < 0)
+	if (kdc_setup() < 0)
 		quit_args("trace facility failure, KERN_KDSETUP: %s\n", strerror(errno));
 }
 
 void set_nowrap(void)
 {
-        mib[0] = CTL_KERN;
-        mib[1] = KERN_KDEBUG;
-        mib[2] = KERN_KDEFLAGS;
-        mib[3] = KDBG_NOWRAP;
-        mib[4] = 0;
-        mib[5] = 0;		/* no flags */
-        if (sysctl(mib, 4, NULL, &needed, NULL, 0) < 0)
+	if (kdc_op_value(KERN_KDEFLAGS, KDBG_NOWRAP) < 0)
 		quit_args("trace facility failure, KDBG_NOWRAP: %s\n", strerror(errno));
 
 }
 
 void set_pidcheck(int pid, int on_off_flag)
 {
-	kd_regtype kr;
-
-	kr.type = KDBG_TYPENONE;
-	kr.value1 = pid;
-	kr.value2 = on_off_flag;
-	needed = sizeof(kd_regtype);
-	mib[0] = CTL_KERN;
-	mib[1] = KERN_KDEBUG;
-	mib[2] = KERN_KDPIDTR;
-	mib[3] = 0;
-	mib[4] = 0;
-	mib[5] = 0;
-	if (sysctl(mib, 3, &kr, &needed, NULL, 0) < 0)
+	if (kdc_pidcheck(KERN_KDPIDTR, pid, on_off_flag) < 0)
 	{
 		if (errno == EACCES)
 		{
@@ -417,19 +604,7 @@ void set_pidcheck(int pid, int on_off_flag)
 
 void set_pidexclude(int pid, int on_off_flag)
 {
-	kd_regtype kr;
-
-	kr.type = KDBG_TYPENONE;
-	kr.value1 = pid;
-	kr.value2 = on_off_flag;
-	needed = sizeof(kd_regtype);
-	mib[0] = CTL_KERN;
-	mib[1] = KERN_KDEBUG;
-	mib[2] = KERN_KDPIDEX;
-	mib[3] = 0;
-	mib[4] = 0;
-	mib[5] = 0;
-	if (sysctl(mib, 3, &kr, &needed, NULL, 0) < 0)
+	if (kdc_pidcheck(KERN_KDPIDEX, pid, on_off_flag) < 0)
 	{
 		if (on_off_flag == 1)
 		{
@@ -442,13 +617,7 @@ void set_pidexclude(int pid, int on_off_flag)
 
 void set_freerun(void)
 {
-        mib[0] = CTL_KERN;
-        mib[1] = KERN_KDEBUG;
-        mib[2] = KERN_KDEFLAGS;
-        mib[3] = KDBG_FREERUN;
-        mib[4] = 0;
-        mib[5] = 0;
-        if (sysctl(mib, 4, NULL, &needed, NULL, 0) < 0)
+	if (kdc_op_value(KERN_KDEFLAGS, KDBG_FREERUN) < 0)
 		quit_args("trace facility failure, KDBG_FREERUN: %s\n", strerror(errno));
 }
 
@@ -466,42 +635,17 @@ static int get_ktrace_state(void)
 
 void get_bufinfo(kbufinfo_t *val)
 {
-	needed = sizeof (*val);
-	mib[0] = CTL_KERN;
-	mib[1] = KERN_KDEBUG;
-	mib[2] = KERN_KDGETBUF;
-	mib[3] = 0;
-	mib[4] = 0;
-	mib[5] = 0;
-	if (sysctl(mib, 3, val, &needed, 0, 0) < 0)
+	if (kdc_getbuf(val) < 0)
 		quit_args("trace facility failure, KERN_KDGETBUF: %s\n", strerror(errno));
 }
 
 void set_init(void)
 {
-        kd_regtype kr;
-
-        kr.type = KDBG_RANGETYPE;
-        kr.value1 = 0;
-        kr.value2 = -1;
-        needed = sizeof(kd_regtype);
-        mib[0] = CTL_KERN;
-        mib[1] = KERN_KDEBUG;
-        mib[2] = KERN_KDSETREG;
-        mib[3] = 0;
-        mib[4] = 0;
-	mib[5] = 0;
-        if (sysctl(mib, 3, &kr, &needed, NULL, 0) < 0)
-            quit_args("trace facility failure, KERN_KDSETREG (rangetype): %s\n", strerror(errno));
+	if (kdc_setreg(KDBG_RANGETYPE, 0, -1) < 0)
+		quit_args("trace facility failure, KERN_KDSETREG (rangetype): %s\n", strerror(errno));
 
-        mib[0] = CTL_KERN;
-        mib[1] = KERN_KDEBUG;
-        mib[2] = KERN_KDSETUP;
-        mib[3] = 0;
-        mib[4] = 0;
-        mib[5] = 0;
-        if (sysctl(mib, 3, NULL, &needed, NULL, 0) < 0)
-            quit_args("trace facility failure, KERN_KDSETUP: %s\n", strerror(errno));
+	if (kdc_setup() < 0)
+		quit_args("trace facility failure, KERN_KDSETUP: %s\n", strerror(errno));
 }
 
 static void
@@ -539,28 +683,14 @@ void set_kval_list(void)
 
 void readtrace(char *buffer)
 {
-	mib[0] = CTL_KERN;
-	mib[1] = KERN_KDEBUG;
-	mib[2] = KERN_KDREADTR;
-	mib[3] = 0;
-	mib[4] = 0;
-	mib[5] = 0;
-
-	if (sysctl(mib, 3, buffer, &needed, NULL, 0) < 0)
+	if (kdc_readtr(buffer, &needed) < 0)
 		quit_args("trace facility failure, KERN_KDREADTR: %s\n", strerror(errno));
 }
 
 
 int writetrace(int fd)
 {
-	mib[0] = CTL_KERN;
-	mib[1] = KERN_KDEBUG;
-	mib[2] = KERN_KDWRITETR;
-	mib[3] = fd;
-	mib[4] = 0;
-	mib[5] = 0;
-
-	if (sysctl(mib, 4, NULL, &needed, NULL, 0) < 0)
+	if (kdc_op_value(KERN_KDWRITETR, fd) < 0)
 		return 1;
 
 	return 0;
@@ -569,14 +699,7 @@ int writetrace(int fd)
 
 int write_command_map(int fd)
 {
-	mib[0] = CTL_KERN;
-	mib[1] = KERN_KDEBUG;
-	mib[2] = KERN_KDWRITEMAP;
-	mib[3] = fd;
-	mib[4] = 0;
-	mib[5] = 0;
-
-	if (sysctl(mib, 4, NULL, &needed, NULL, 0) < 0) {
+	if (kdc_op_value(KERN_KDWRITEMAP, fd) < 0) {
 		if (errno == ENODATA) {
 			if (verbose_flag) {
 				printf("Cannot write thread map -- this is not fatal\n");
@@ -590,215 +713,497 @@ int write_command_map(int fd)
 }
 
 
-static
-lookup_t handle_lookup_event(uint64_t thread, int debugid, kd_buf *kdp)
+/*
+ * Make sure n more entries can be had from pool without a malloc.
+ */
+static void
+pool_reserve(struct pool *pool, uint32_t n)
 {
-	lookup_t	lkp;
-	int		hashid;
-	boolean_t	first_record = FALSE;
-
-	hashid = thread & HASH_MASK;
+	struct pool_block *pb;
+	char	*p;
+	uint32_t i;
 
-	if (debugid & DBG_FUNC_START)
-		first_record = TRUE;
+	if (pool->allocated - pool->in_use >= n)
+		return;
+	n -= pool->allocated - pool->in_use;
 
-	for (lkp = lookup_hash[hashid]; lkp; lkp = lkp->lk_next) {
-		if (lkp->lk_thread == thread)
-			break;
-	}
-	if (lkp == NULL) {
-		if (first_record == FALSE)
-			return (0);
+	if ((pb = malloc(sizeof(struct pool_block) + n * pool->entry_size)) == NULL)
+		quit("can't allocate memory for tracing info\n");
 
-		if ((lkp = lookup_freelist))
-			lookup_freelist = lkp->lk_next;
-		else
-			lkp = (lookup_t)malloc(sizeof(struct lookup));
+	pb->pb_next = pool->blocks;
+	pool->blocks = pb;
+	pool->allocated += n;
 
-		lkp->lk_thread = thread;
+	/* hand them out in order, so that a bulk load fills the block front to back */
+	p = (char *)(pb + 1) + (n - 1) * pool->entry_size;
 
-		lkp->lk_next = lookup_hash[hashid];
-		lookup_hash[hashid] = lkp;
+	for (i = 0; i < n; i++, p -= pool->entry_size) {
+		*(void **)(void *)p = pool->free;
+		pool->free = p;
 	}
+}
 
-	if (first_record == TRUE) {
-		lkp->lk_pathptr = lkp->lk_pathname;
-		lkp->lk_dvp = kdp->arg1;
-	} else {
-                if (lkp->lk_pathptr > &lkp->lk_pathname[NUMPARMS-4])
-			return (lkp);
+static void *
+pool_get(struct pool *pool)
+{
+	char	*p;
 
-		*lkp->lk_pathptr++ = kdp->arg1;
-	}
-	*lkp->lk_pathptr++ = kdp->arg2;
-	*lkp->lk_pathptr++ = kdp->arg3;
-	*lkp->lk_pathptr++ = kdp->arg4;
-	*lkp->lk_pathptr = 0;
+	if (pool->free == NULL)
+		pool_reserve(pool, POOL_BLOCK_ENTRIES);
 
-	return (lkp);
+	p = pool->free;
+	pool->free = *(void **)(void *)p;
+
+	if (++pool->in_use > pool->peak)
+		pool->peak = pool->in_use;
+
+	return (p);
 }
 
+static void
+pool_put(struct pool *pool, void *entry)
+{
+	*(void **)entry = pool->free;
+	pool->free = entry;
+	pool->in_use--;
+}
 
-static
-void delete_lookup_event(uint64_t thread, lookup_t lkp_to_delete)
+static void
+pool_free(struct pool *pool)
 {
-	lookup_t	lkp;
-	lookup_t	lkp_prev;
-	int		hashid;
+	struct pool_block *pb;
 
-	hashid = thread & HASH_MASK;
+	while ((pb = pool->blocks)) {
+		pool->blocks = pb->pb_next;
+		free(pb);
+	}
+	pool->free = NULL;
+	pool->in_use = 0;
+	pool->allocated = 0;
+}
 
-	if ((lkp = lookup_hash[hashid])) {
-		if (lkp == lkp_to_delete)
-			lookup_hash[hashid] = lkp->lk_next;
-		else {
-			lkp_prev = lkp;
 
-			for (lkp = lkp->lk_next; lkp; lkp = lkp->lk_next) {
-				if (lkp == lkp_to_delete) {
-					lkp_prev->lk_next = lkp->lk_next;
-					break;
-				}
-				lkp_prev = lkp;
-			}
-		}
-		if (lkp) {
-			lkp->lk_next = lookup_freelist;
-			lookup_freelist = lkp;
-		}
-	}
+/*
+ * Size the table for n more threads, so that loading them doesn't resize
+ * it over and over.
+ */
+static void
+thread_table_reserve(uint32_t n)
+{
+	if (kdc_threads_reserve(&threads.states, n) < 0)
+		quit("can't allocate memory for tracing info\n");
 }
 
+/*
+ * Return the state kept for thread, or NULL if there is none.
+ */
+static struct thread_state *
+thread_state_find(uint64_t thread)
+{
+	return (kdc_threads_lookup(&threads.states, thread));
+}
 
-static
-void insert_start_event(uint64_t thread, int debugid, uint64_t now)
+/*
+ * Return the state kept for thread, claiming a slot for it if there is
+ * none.  The pointer is only good until the next thread is claimed: the
+ * table may move.
+ */
+static struct thread_state *
+thread_state_get(uint64_t thread)
 {
-	event_t		evp;
-	int		hashid;
+	struct thread_state *ts;
 
-	hashid = thread & HASH_MASK;
+	if ((ts = kdc_threads_claim(&threads.states, thread)) == NULL)
+		quit("can't allocate memory for tracing info\n");
 
-	for (evp = event_hash[hashid]; evp; evp = evp->ev_next) {
-		if (evp->ev_thread == thread && evp->ev_debugid == debugid)
-			break;
-	}
-	if (evp == NULL) {
-		if ((evp = event_freelist))
-			event_freelist = evp->ev_next;
-		else
-			evp = (event_t)malloc(sizeof(struct event));
+	return (ts);
+}
 
-		evp->ev_thread = thread;
-		evp->ev_debugid = debugid;
+/*
+ * Give up ts's slot if nothing is left in it.
+ */
+static void
+thread_state_release(struct thread_state *ts)
+{
+	if (ts->ts_map == NULL && ts->ts_lookup == NULL && ts->ts_events == NULL)
+		kdc_threads_release(&threads.states, ts);
+}
 
-		evp->ev_next = event_hash[hashid];
-		event_hash[hashid] = evp;
-	}
-	evp->ev_timestamp = now;
+static void
+thread_table_free(struct thread_table *tt)
+{
+	kdc_threads_free(&tt->states);
+	tt->temp = NULL;
+
+	pool_free(&tt->events);
+	pool_free(&tt->lookups);
+	pool_free(&tt->maps);
 }
 
+static void
+thread_table_stats(void)
+{
+	printf("Thread table: %u slots, %u threads, %u at most, %u resizes, longest probe %u\n",
+	       threads.states.size, threads.states.count, threads.states.peak,
+	       threads.states.resizes, threads.states.max_probe);
+	printf("Entries in use (at most, allocated): names %u (%u, %u), lookups %u (%u, %u), start events %u (%u, %u)\n",
+	       threads.maps.in_use, threads.maps.peak, threads.maps.allocated,
+	       threads.lookups.in_use, threads.lookups.peak, threads.lookups.allocated,
+	       threads.events.in_use, threads.events.peak, threads.events.allocated);
+}
 
-static
-uint64_t consume_start_event(uint64_t thread, int debugid, uint64_t now)
+
+/*
+ * Find or add the -A entry for debugid.
+ */
+static struct agg_entry *
+aggregate_entry(uint32_t debugid)
 {
-	event_t		evp;
-	event_t		evp_prev;
-	int		hashid;
-	uint64_t	elapsed = 0;
+	struct agg_entry *ae;
+	uint32_t	i, n;
 
-	hashid = thread & HASH_MASK;
+	if (agg.nentries * 2 >= agg.size) {
+		uint32_t	*old_slots = agg.slots;
+		uint32_t	old_size = agg.size;
 
-	if ((evp = event_hash[hashid])) {
-		if (evp->ev_thread == thread && evp->ev_debugid == debugid)
-			event_hash[hashid] = evp->ev_next;
-		else {
-			evp_prev = evp;
+		agg.size = old_size ? old_size * 2 : 1024;
+		agg.shift = 32 - (uint32_t)__builtin_ctz(agg.size);
 
-			for (evp = evp->ev_next; evp; evp = evp->ev_next) {
+		if ((agg.slots = calloc(agg.size, sizeof(uint32_t))) == NULL)
+			quit("can't allocate memory for tracing info\n");
 
-				if (evp->ev_thread == thread && evp->ev_debugid == debugid) {
-					evp_prev->ev_next = evp->ev_next;
-					break;
-				}
-				evp_prev = evp;
-			}
+		for (n = 0; n < old_size; n++) {
+			if (old_slots[n] == 0)
+				continue;
+			for (i = (agg.entries[old_slots[n] - 1].debugid * 0x9e3779b9U) >> agg.shift; agg.slots[i]; i = (i + 1) & (agg.size - 1))
+				;
+			agg.slots[i] = old_slots[n];
 		}
-		if (evp) {
-			elapsed = now - evp->ev_timestamp;
+		free(old_slots);
+	}
 
-			evp->ev_next = event_freelist;
-			event_freelist = evp;
-		}
+	for (i = (debugid * 0x9e3779b9U) >> agg.shift; agg.slots[i]; i = (i + 1) & (agg.size - 1)) {
+		ae = &agg.entries[agg.slots[i] - 1];
+
+		if (ae->debugid == debugid)
+			return (ae);
 	}
-	return (elapsed);
+
+	if (agg.nentries == agg.nalloc) {
+		agg.nalloc = agg.nalloc ? agg.nalloc * 2 : 512;
+
+		if ((ae = realloc(agg.entries, agg.nalloc * sizeof(struct agg_entry))) == NULL)
+			quit("can't allocate memory for tracing info\n");
+		agg.entries = ae;
+	}
+	ae = &agg.entries[agg.nentries++];
+	bzero(ae, sizeof(struct agg_entry));
+	ae->debugid = debugid;
+	ae->min = UINT64_MAX;
+
+	agg.slots[i] = agg.nentries;
+
+	return (ae);
 }
 
-void
-log_trace(void)
+static void
+aggregate_event(uint32_t debugid, uint32_t cpunum, uint64_t now)
 {
-	int fd = -1;
-	int ret = 0;
-	char *buffer;
-	uint32_t buffer_size = 1000000 * sizeof(kd_buf);
+	aggregate_entry(debugid)->count++;
 
-	if (logfile[0] == '-' && logfile[1] == '\0') {
-		fd = STDOUT_FILENO;
-	} else {
-		fd = open(logfile, O_TRUNC | O_WRONLY | O_CREAT, 0777);
-	}
+	if (agg.events++ == 0)
+		agg.first = now;
+	agg.last = now;
 
-	if (fd == -1) {
-		perror("Can't open logfile");
-		exit(1);
-	}
-	get_bufinfo(&bufinfo);
+	if (cpunum < AGG_MAX_CPUS) {
+		agg.cpus[cpunum].count++;
 
-	if (bufinfo.nolog != 1) {
-		reenable = 1;
-		set_enable(0);  /* disable logging*/
+		if (cpunum >= agg.ncpus)
+			agg.ncpus = cpunum + 1;
 	}
-	get_bufinfo(&bufinfo);
+}
 
-	if (verbose_flag) {
-		if (bufinfo.flags & KDBG_WRAPPED)
-			printf("Buffer has wrapped\n");
-		else
-			printf("Buffer has not wrapped\n");
-	}
+static void
+aggregate_duration(uint32_t debugid, uint32_t cpunum, uint64_t elapsed)
+{
+	struct agg_entry *ae;
+	uint32_t	e, b;
 
-	ret = write_command_map(fd);
-	if (ret) {
-		close(fd);
-		perror("failed to write logfile");
-		exit(1);
+	ae = aggregate_entry(debugid);
+
+	if (ae->buckets == NULL &&
+	    (ae->buckets = calloc(AGG_BUCKETS, sizeof(uint32_t))) == NULL)
+		quit("can't allocate memory for tracing info\n");
+
+	ae->pairs++;
+	ae->total += elapsed;
+
+	if (elapsed < ae->min)
+		ae->min = elapsed;
+	if (elapsed > ae->max)
+		ae->max = elapsed;
+
+	if (elapsed < AGG_SUB_BUCKETS)
+		b = (uint32_t)elapsed;
+	else {
+		e = 63 - (uint32_t)__builtin_clzll(elapsed);
+		b = AGG_SUB_BUCKETS * (e - 2) + (uint32_t)((elapsed >> (e - 3)) & (AGG_SUB_BUCKETS - 1));
 	}
+	ae->buckets[b]++;
 
-	buffer = malloc(buffer_size);
-	if (buffer == NULL) {
-		quit("can't allocate memory for events\n");
+	if (cpunum < AGG_MAX_CPUS) {
+		agg.cpus[cpunum].pairs++;
+		agg.cpus[cpunum].total += elapsed;
 	}
+}
 
-	for (;;) {
-		needed = buffer_size;
+/*
+ * The largest duration in the bucket holding the pct'th percentile.
+ */
+static uint64_t
+aggregate_percentile(struct agg_entry *ae, double pct)
+{
+	uint64_t	want, seen = 0, upper;
+	uint32_t	b, e;
 
-		readtrace(buffer);
+	want = (uint64_t)(ae->pairs * pct / 100.0);
+	if (want == 0)
+		want = 1;
 
-		if (needed == 0) {
+	for (b = 0; b < AGG_BUCKETS; b++) {
+		if ((seen += ae->buckets[b]) >= want)
 			break;
-		}
-
-		write(fd, buffer, needed * sizeof(kd_buf));
 	}
+	if (b < AGG_SUB_BUCKETS)
+		upper = b;
+	else {
+		e = b / AGG_SUB_BUCKETS + 2;
+		upper = ((uint64_t)(AGG_SUB_BUCKETS + b % AGG_SUB_BUCKETS + 1) << (e - 3)) - 1;
+	}
+	return (MIN(upper, ae->max));
+}
 
-	free(buffer);
+static int
+aggregate_compar(const void *p1, const void *p2)
+{
+	const struct agg_entry *a1 = p1;
+	const struct agg_entry *a2 = p2;
 
-	close(fd);
+	if (a1->count != a2->count)
+		return (a1->count > a2->count ? -1 : 1);
+	return (a1->debugid < a2->debugid ? -1 : a1->debugid > a2->debugid);
 }
 
 /*
- * Why does this function exist?
- * trace -L needs millisecond level wait times.
- * When this code is running remotely, the mach_timebase_info_t data may
+ * Print the -A counts, busiest debugids first, then the totals for each
+ * CPU.  Times are in microseconds.
+ */
+static void
+aggregate_print(FILE *out)
+{
+	struct agg_entry *ae;
+	char	name[80];
+	int	dmsgindex;
+	uint32_t i;
+
+	qsort(agg.entries, agg.nentries, sizeof(struct agg_entry), aggregate_compar);
+
+	fprintf(out, "%" PRIu64 " events with %u debugids over %.1f secs\n\n",
+		agg.events, agg.nentries, (double)(agg.last - agg.first) / divisor / 1000000.0);
+
+	fprintf(out, "%-28s %12s %10s %14s %10s %10s %10s %10s %10s %10s\n",
+		"debugid", "count", "pairs", "total(Us)", "min", "avg", "p50", "p90", "p99", "max");
+
+	for (i = 0; i < agg.nentries; i++) {
+		ae = &agg.entries[i];
+
+		if (match_debugid(ae->debugid, name, &dmsgindex))
+			snprintf(name, sizeof(name), "%x", ae->debugid);
+
+		fprintf(out, "%-28.28s %12" PRIu64 " %10" PRIu64, name, ae->count, ae->pairs);
+
+		if (ae->pairs)
+			fprintf(out, " %14.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f",
+				(double)ae->total / divisor, (double)ae->min / divisor,
+				(double)ae->total / ae->pairs / divisor,
+				(double)aggregate_percentile(ae, 50.0) / divisor,
+				(double)aggregate_percentile(ae, 90.0) / divisor,
+				(double)aggregate_percentile(ae, 99.0) / divisor,
+				(double)ae->max / divisor);
+		fprintf(out, "\n");
+
+		free(ae->buckets);
+		ae->buckets = NULL;
+	}
+
+	fprintf(out, "\n%-4s %12s %10s %14s\n", "cpu#", "count", "pairs", "total(Us)");
+
+	for (i = 0; i < agg.ncpus; i++) {
+		if (agg.cpus[i].count == 0)
+			continue;
+
+		fprintf(out, "%-4u %12" PRIu64 " %10" PRIu64 " %14.1f\n",
+			i, agg.cpus[i].count, agg.cpus[i].pairs, (double)agg.cpus[i].total / divisor);
+	}
+}
+
+
+static
+lookup_t handle_lookup_event(uint64_t thread, int debugid, kd_buf *kdp)
+{
+	struct thread_state *ts;
+	lookup_t	lkp;
+	boolean_t	first_record = FALSE;
+
+	if (debugid & DBG_FUNC_START)
+		first_record = TRUE;
+
+	if (first_record == TRUE) {
+		ts = thread_state_get(thread);
+
+		if ((lkp = ts->ts_lookup) == NULL) {
+			lkp = pool_get(&threads.lookups);
+			lkp->lk_thread = thread;
+
+			ts->ts_lookup = lkp;
+		}
+	} else {
+		if ((ts = thread_state_find(thread)) == NULL || (lkp = ts->ts_lookup) == NULL)
+			return (0);
+	}
+
+	if (first_record == TRUE) {
+		lkp->lk_pathptr = lkp->lk_pathname;
+		lkp->lk_dvp = kdp->arg1;
+	} else {
+                if (lkp->lk_pathptr > &lkp->lk_pathname[NUMPARMS-4])
+			return (lkp);
+
+		*lkp->lk_pathptr++ = kdp->arg1;
+	}
+	*lkp->lk_pathptr++ = kdp->arg2;
+	*lkp->lk_pathptr++ = kdp->arg3;
+	*lkp->lk_pathptr++ = kdp->arg4;
+	*lkp->lk_pathptr = 0;
+
+	return (lkp);
+}
+
+
+static
+void delete_lookup_event(uint64_t thread, lookup_t lkp_to_delete)
+{
+	struct thread_state *ts;
+
+	if ((ts = thread_state_find(thread)) && ts->ts_lookup == lkp_to_delete) {
+		ts->ts_lookup = NULL;
+		pool_put(&threads.lookups, lkp_to_delete);
+
+		thread_state_release(ts);
+	}
+}
+
+
+static
+void insert_start_event(uint64_t thread, int debugid, uint64_t now)
+{
+	struct thread_state *ts;
+	struct kdc_start *evp;
+
+	ts = thread_state_get(thread);
+
+	if ((evp = kdc_start_find(ts->ts_events, thread, debugid)))
+		evp->timestamp = now;
+	else
+		kdc_start_push(&ts->ts_events, pool_get(&threads.events), thread, debugid, now);
+}
+
+
+static
+uint64_t consume_start_event(uint64_t thread, int debugid, uint64_t now)
+{
+	struct thread_state *ts;
+	struct kdc_start *evp;
+	uint64_t	elapsed = 0;
+
+	if ((ts = thread_state_find(thread)) == NULL)
+		return (0);
+
+	if ((evp = kdc_start_take(&ts->ts_events, thread, debugid))) {
+		elapsed = now - evp->timestamp;
+
+		pool_put(&threads.events, evp);
+		thread_state_release(ts);
+	}
+	return (elapsed);
+}
+
+void
+log_trace(void)
+{
+	int fd = -1;
+	int ret = 0;
+	char *buffer;
+	uint32_t buffer_size = 1000000 * sizeof(kd_buf);
+
+	if (logfile[0] == '-' && logfile[1] == '\0') {
+		fd = STDOUT_FILENO;
+	} else {
+		fd = open(logfile, O_TRUNC | O_WRONLY | O_CREAT, 0777);
+	}
+
+	if (fd == -1) {
+		perror("Can't open logfile");
+		exit(1);
+	}
+	get_bufinfo(&bufinfo);
+
+	if (bufinfo.nolog != 1) {
+		reenable = 1;
+		set_enable(0);  /* disable logging*/
+	}
+	get_bufinfo(&bufinfo);
+
+	if (verbose_flag) {
+		if (bufinfo.flags & KDBG_WRAPPED)
+			printf("Buffer has wrapped\n");
+		else
+			printf("Buffer has not wrapped\n");
+	}
+
+	ret = write_command_map(fd);
+	if (ret) {
+		close(fd);
+		perror("failed to write logfile");
+		exit(1);
+	}
+
+	buffer = malloc(buffer_size);
+	if (buffer == NULL) {
+		quit("can't allocate memory for events\n");
+	}
+
+	for (;;) {
+		needed = buffer_size;
+
+		readtrace(buffer);
+
+		if (needed == 0) {
+			break;
+		}
+
+		write(fd, buffer, needed * sizeof(kd_buf));
+	}
+
+	free(buffer);
+
+	close(fd);
+}
+
+/*
+ * Why does this function exist?
+ * trace -L needs millisecond level wait times.
+ * When this code is running remotely, the mach_timebase_info_t data may
  * be from a device with a different timebase. This code avoids using
  * mach_absolute_time(), so that time calculations come out correct both
  * locally and remotely.
@@ -820,7 +1225,7 @@ Log_trace(void)
 	uint64_t last_time_written;
 	uint32_t ms_to_run;
 
-	if ((fd = open(logfile, O_TRUNC|O_WRONLY|O_CREAT, 0777)) == -1) {
+	if ((fd = log_open(logfile)) == -1) {
 		perror("Can't open logfile");
 		exit(1);
 	}
@@ -852,7 +1257,14 @@ Log_trace(void)
 	if (use_current_buf == 0)
 		set_enable(1);
 
-	if (write_command_map(fd)) {
+	if (recorder_secs) {
+		/* the header is written with the events, once they are picked */
+	} else if (compress_flag) {
+		rawz_init(fd);
+
+		if (rawz_write_header())
+			quit("can't write tracefile header\n");
+	} else if (write_command_map(fd)) {
 		quit("can't write tracefile header\n");
 	}
 
@@ -864,7 +1276,12 @@ Log_trace(void)
 	} else
 		ms_to_run = 0;
 
-	while (LogRAW_flag) {
+	if (recorder_secs)
+		recorder_trace(fd, ending_ms);
+	else if (stream_nbufs)
+		stream_trace(fd, ending_ms);
+
+	while (LogRAW_flag && !stream_nbufs && !recorder_secs) {
 		needed = ms_to_run;
 
 		if (writetrace(fd)) {
@@ -902,6 +1319,444 @@ Log_trace(void)
 	close(fd);
 }
 
+/*
+ * The -L file, or a socket connected to the collector it names.
+ */
+static int
+log_open(const char *path)
+{
+	if (stream_socket)
+		return (log_connect(path));
+
+	return (open(path, O_TRUNC|O_WRONLY|O_CREAT, 0777));
+}
+
+static int
+log_connect(const char *target)
+{
+	struct addrinfo hints, *res, *ai;
+	struct sockaddr_un sun;
+	char	host[NI_MAXHOST];
+	const char *port;
+	int	fd = -1, size = STREAM_SNDBUF, on = 1, rc;
+
+	if (strncmp(target, "unix:", 5) == 0) {
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+
+		if (strlcpy(sun.sun_path, target + 5, sizeof(sun.sun_path)) >= sizeof(sun.sun_path)) {
+			errno = ENAMETOOLONG;
+			return (-1);
+		}
+		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+			return (-1);
+
+		if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+			close(fd);
+			return (-1);
+		}
+	} else {
+		/* tcp:host:port, with a numeric IPv6 host in brackets */
+		target += 4;
+
+		if ((port = strrchr(target, ':')) == NULL || (size_t)(port - target) >= sizeof(host))
+			quit_args("%s: not a tcp:host:port address\n", logfile);
+
+		snprintf(host, sizeof(host), "%.*s", (int)(port - target), target);
+		port++;
+
+		if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+			host[strlen(host) - 1] = '\0';
+			memmove(host, host + 1, strlen(host));
+		}
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+
+		if ((rc = getaddrinfo(host, port, &hints, &res)) != 0)
+			quit_args("%s: %s\n", logfile, gai_strerror(rc));
+
+		for (ai = res; ai; ai = ai->ai_next) {
+			if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == -1)
+				continue;
+			if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+				break;
+			close(fd);
+			fd = -1;
+		}
+		freeaddrinfo(res);
+
+		if (fd == -1)
+			return (-1);
+	}
+	/* a collector that goes away is a write error, not a SIGPIPE */
+	(void)setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+	(void)setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1) {
+		close(fd);
+		return (-1);
+	}
+	return (fd);
+}
+
+/*
+ * Copy events out of the kernel buffer with KERN_KDREADTR into the next
+ * free stream buffer, and leave writing them to stream_writer().  Stop at
+ * ending_ms, if set, or when interrupted.  When streaming to a socket and
+ * no buffer is free, the events are read into a spare one and dropped.
+ */
+static void
+stream_trace(int fd, uint64_t ending_ms)
+{
+	pthread_t	writer;
+	struct stream_buf *sb;
+	struct stream_buf spare = { NULL, 0 };
+	boolean_t	drop;
+	uint64_t	current_ms;
+	uint64_t	last_stats_ms;
+	uint64_t	last_bytes = 0;
+	uint64_t	events = 0;
+	uint64_t	wraps = 0;
+	uint64_t	stalls = 0;
+	uint64_t	dropped = 0;
+	uint64_t	drops = 0;
+	int		i, rc;
+
+	stream.bufs = calloc(stream_nbufs, sizeof(struct stream_buf));
+	if (stream.bufs == NULL)
+		quit("can't allocate memory for events\n");
+
+	for (i = 0; i < stream_nbufs; i++) {
+		if ((stream.bufs[i].kd = malloc(STREAM_BUF_EVENTS * sizeof(kd_buf))) == NULL)
+			quit("can't allocate memory for events\n");
+	}
+	if (stream_socket && (spare.kd = malloc(STREAM_BUF_EVENTS * sizeof(kd_buf))) == NULL)
+		quit("can't allocate memory for events\n");
+	stream.fd = fd;
+
+	if ((rc = pthread_create(&writer, NULL, stream_writer, NULL)) != 0)
+		quit_args("can't create writer thread: %s\n", strerror(rc));
+
+	last_stats_ms = current_millis();
+
+	while (LogRAW_flag) {
+		pthread_mutex_lock(&stream.lock);
+
+		drop = FALSE;
+
+		if (stream.filled == stream_nbufs) {
+			if (stream_socket) {
+				/* the collector is behind; keep the kernel buffer from wrapping */
+				drop = TRUE;
+			} else {
+				/* all the buffers are waiting on the disk */
+				stalls++;
+
+				while (stream.filled == stream_nbufs && !stream.error)
+					pthread_cond_wait(&stream.cond, &stream.lock);
+			}
+		}
+		sb = drop ? &spare : &stream.bufs[stream.head];
+		rc = stream.error;
+
+		pthread_mutex_unlock(&stream.lock);
+
+		if (rc) {
+			errno = rc;
+			perror("write failed");
+			break;
+		}
+
+		/* events lost since the last read */
+		get_bufinfo(&bufinfo);
+		if (bufinfo.flags & KDBG_WRAPPED)
+			wraps++;
+
+		needed = STREAM_BUF_EVENTS;
+		readtrace((char *)sb->kd);
+		sb->count = needed;
+
+		if (needed && drop) {
+			events += needed;
+			dropped += needed;
+			drops++;
+		} else if (needed) {
+			events += needed;
+
+			pthread_mutex_lock(&stream.lock);
+			stream.head = (stream.head + 1) % stream_nbufs;
+			stream.filled++;
+			pthread_cond_broadcast(&stream.cond);
+			pthread_mutex_unlock(&stream.lock);
+		}
+
+		current_ms = current_millis();
+
+		if (current_ms - last_stats_ms >= STREAM_STATS_MS) {
+			uint64_t bytes, waits, wait_ms;
+
+			pthread_mutex_lock(&stream.lock);
+			bytes = stream.bytes_written;
+			waits = stream.send_waits;
+			wait_ms = stream.send_wait_ms;
+			pthread_mutex_unlock(&stream.lock);
+
+			if (stream_socket)
+				fprintf(stderr, "read %" PRIu64 " events, sent %.1f MB/sec, %" PRIu64 " buffer wraps, "
+					"%" PRIu64 " events dropped in %" PRIu64 " buffers, %" PRIu64 " waits for the collector (%.1f secs)\n",
+					events, (double)(bytes - last_bytes) / (1024 * 1024) * 1000 / (current_ms - last_stats_ms),
+					wraps, dropped, drops, waits, (double)wait_ms / 1000.0);
+			else
+				fprintf(stderr, "read %" PRIu64 " events, wrote %.1f MB/sec, %" PRIu64 " buffer wraps, %" PRIu64 " stalls\n",
+					events, (double)(bytes - last_bytes) / (1024 * 1024) * 1000 / (current_ms - last_stats_ms),
+					wraps, stalls);
+
+			last_stats_ms = current_ms;
+			last_bytes = bytes;
+		}
+
+		if (ending_ms && current_ms > ending_ms)
+			break;
+
+		/* let a less than half full kernel buffer fill up some more */
+		if (needed < STREAM_BUF_EVENTS / 2)
+			usleep(US_TO_SLEEP);
+	}
+
+	pthread_mutex_lock(&stream.lock);
+	stream.done = TRUE;
+	pthread_cond_broadcast(&stream.cond);
+	pthread_mutex_unlock(&stream.lock);
+
+	pthread_join(writer, NULL);
+
+	if (compress_flag && !stream.error) {
+		if ((rc = rawz_writer_finish(&rawz)) != 0) {
+			errno = rc;
+			perror("write failed");
+		} else if (verbose_flag && rawz.offset) {
+			printf("compressed %" PRIu64 " bytes to %" PRIu64 " (%.1f:1) in %u chunks\n",
+			       rawz.raw_offset, rawz.offset, (double)rawz.raw_offset / rawz.offset, rawz.nchunks);
+		}
+	}
+	if (stream_socket)
+		fprintf(stderr, "sent %" PRIu64 " bytes; dropped %" PRIu64 " of %" PRIu64 " events, in %" PRIu64 " buffers; "
+			"waited %.1f secs for the collector\n",
+			rawz.offset, dropped, events, drops, (double)stream.send_wait_ms / 1000.0);
+
+	for (i = 0; i < stream_nbufs; i++)
+		free(stream.bufs[i].kd);
+	free(stream.bufs);
+	stream.bufs = NULL;
+	free(spare.kd);
+}
+
+static void *
+stream_writer(void *arg)
+{
+	struct stream_buf *sb;
+	uint64_t before;
+	size_t	len;
+	int	rc;
+
+	for (;;) {
+		pthread_mutex_lock(&stream.lock);
+
+		while (stream.filled == 0 && !stream.done)
+			pthread_cond_wait(&stream.cond, &stream.lock);
+
+		if (stream.filled == 0) {
+			pthread_mutex_unlock(&stream.lock);
+			return (NULL);
+		}
+		sb = &stream.bufs[stream.tail];
+
+		pthread_mutex_unlock(&stream.lock);
+
+		len = sb->count * sizeof(kd_buf);
+		before = rawz.offset;
+
+		if (compress_flag)
+			rc = rawz_writer_write(&rawz, sb->kd, len, sb->kd[0].timestamp & KDBG_TIMESTAMP_MASK);
+		else
+			rc = write_all(stream.fd, sb->kd, len);
+
+		if (rc) {
+			pthread_mutex_lock(&stream.lock);
+			stream.error = rc;
+			stream.filled = 0;
+			pthread_cond_broadcast(&stream.cond);
+			pthread_mutex_unlock(&stream.lock);
+
+			return (NULL);
+		}
+		if (compress_flag)
+			len = (size_t)(rawz.offset - before);
+
+		pthread_mutex_lock(&stream.lock);
+		stream.bytes_written += len;
+		stream.tail = (stream.tail + 1) % stream_nbufs;
+		stream.filled--;
+		pthread_cond_broadcast(&stream.cond);
+		pthread_mutex_unlock(&stream.lock);
+	}
+}
+
+
+/*
+ * Read events into a ring of buffers, overwriting the oldest, until one of
+ * the -W triggers fires.  Then write the header and the events from the
+ * last recorder_secs seconds.
+ */
+static void
+recorder_trace(int fd, uint64_t ending_ms)
+{
+	struct stream_buf *ring, *sb;
+	const char	*why = NULL;
+	uint64_t	window, newest = 0, cutoff, first_kept = 0, events = 0;
+	uint32_t	j;
+	int		nbufs, head = 0, filled = 0, start, i, rc = 0;
+
+	nbufs = stream_nbufs ? stream_nbufs : RECORDER_DEFAULT_BUFS;
+
+	if ((ring = calloc(nbufs, sizeof(struct stream_buf))) == NULL)
+		quit("can't allocate memory for events\n");
+
+	for (i = 0; i < nbufs; i++) {
+		if ((ring[i].kd = malloc(RECORDER_BUF_EVENTS * sizeof(kd_buf))) == NULL)
+			quit("can't allocate memory for events\n");
+	}
+	window = (uint64_t)(recorder_secs * 1000000.0 * divisor);
+
+	signal(SIGUSR1, recorder_signal);
+
+	while (LogRAW_flag) {
+		sb = &ring[head];
+
+		needed = RECORDER_BUF_EVENTS;
+		readtrace((char *)sb->kd);
+		sb->count = needed;
+
+		if (needed) {
+			head = (head + 1) % nbufs;
+			if (filled < nbufs)
+				filled++;
+
+			newest = sb->kd[needed - 1].timestamp & KDBG_TIMESTAMP_MASK;
+
+			if ((why = recorder_check(sb->kd, sb->count)))
+				break;
+		}
+		if (recorder_signalled) {
+			why = "SIGUSR1";
+			break;
+		}
+		if (ending_ms && current_millis() > ending_ms) {
+			why = "time limit";
+			break;
+		}
+		/* let a less than half full kernel buffer fill up some more */
+		if (needed < RECORDER_BUF_EVENTS / 2)
+			usleep(US_TO_SLEEP);
+	}
+	if (why == NULL)
+		why = "interrupted";
+
+	if (compress_flag) {
+		rawz_init(fd);
+
+		if (rawz_write_header())
+			quit("can't write tracefile header\n");
+	} else if (write_command_map(fd)) {
+		quit("can't write tracefile header\n");
+	}
+	cutoff = newest > window ? newest - window : 0;
+	start = filled < nbufs ? 0 : head;
+
+	for (i = 0; i < filled && rc == 0; i++) {
+		sb = &ring[(start + i) % nbufs];
+
+		for (j = 0; j < sb->count && (sb->kd[j].timestamp & KDBG_TIMESTAMP_MASK) < cutoff; j++)
+			;
+		if (j == sb->count)
+			continue;
+
+		if (events == 0)
+			first_kept = sb->kd[j].timestamp & KDBG_TIMESTAMP_MASK;
+		events += sb->count - j;
+
+		if (compress_flag)
+			rc = rawz_writer_write(&rawz, &sb->kd[j], (sb->count - j) * sizeof(kd_buf), sb->kd[j].timestamp & KDBG_TIMESTAMP_MASK);
+		else
+			rc = write_all(fd, &sb->kd[j], (sb->count - j) * sizeof(kd_buf));
+	}
+	if (rc == 0 && compress_flag)
+		rc = rawz_writer_finish(&rawz);
+
+	if (rc) {
+		errno = rc;
+		perror("write failed");
+	}
+	printf("%s: wrote %" PRIu64 " events from the last %.1f secs\n",
+	       why, events, events ? (double)(newest - first_kept) / divisor / 1000000.0 : 0.0);
+
+	if (filled == nbufs && first_kept > cutoff)
+		fprintf(stderr, "Only %.1f of the %d secs asked for fit in %d buffers; use -m for more\n",
+			(double)(newest - first_kept) / divisor / 1000000.0, recorder_secs, nbufs);
+
+	for (i = 0; i < nbufs; i++)
+		free(ring[i].kd);
+	free(ring);
+}
+
+/*
+ * Look for a -k debugid in count events starting at kd, and time each
+ * start to end pair against -y.  Return why tracing should stop, or NULL.
+ */
+static const char *
+recorder_check(kd_buf *kd, size_t count)
+{
+	static char	why[128];
+	uint64_t	now, elapsed;
+	uint32_t	debugid_base;
+	size_t		i;
+	int		k;
+
+	for (i = 0; i < count; i++) {
+		debugid_base = kd[i].debugid & DBG_FUNC_MASK;
+
+		for (k = 0; k < recorder_ncodes; k++) {
+			if (debugid_base == (recorder_codes[k] & DBG_FUNC_MASK)) {
+				snprintf(why, sizeof(why), "debugid 0x%x", kd[i].debugid);
+				return (why);
+			}
+		}
+		if (recorder_threshold_us == 0)
+			continue;
+
+		now = kd[i].timestamp & KDBG_TIMESTAMP_MASK;
+
+		if (kd[i].debugid & DBG_FUNC_START)
+			insert_start_event(kd[i].arg5, debugid_base, now);
+		else if (kd[i].debugid & DBG_FUNC_END) {
+			elapsed = consume_start_event(kd[i].arg5, debugid_base, now);
+
+			if (elapsed && (double)elapsed / divisor >= recorder_threshold_us) {
+				snprintf(why, sizeof(why), "debugid 0x%x took %.1f usecs", debugid_base, (double)elapsed / divisor);
+				return (why);
+			}
+		}
+	}
+	return (NULL);
+}
+
+static void
+recorder_signal(int sig)
+{
+	recorder_signalled = 1;
+}
+
 
 void read_trace(void)
 {
@@ -909,12 +1764,9 @@ void read_trace(void)
 	uint32_t	buffer_size;
         kd_buf		*kd;
 	int		fd;
-	int		firsttime = 1;
-	int		lines = 0;
-	int		io_lines = 0;
-	uint64_t	bias = 0;
+	int		has_index;
+	struct decode_state ds = { .firsttime = 1 };
 	uint32_t	count_of_names;
-	double		last_event_time = 0.0;
 	time_t		trace_time;
 
 	if (!readRAW_flag) {
@@ -940,22 +1792,17 @@ void read_trace(void)
 			perror("Can't open file");
 			exit(1);
 		}
-		if (read(fd, &raw_header, sizeof(RAW_header)) != sizeof(RAW_header)) {
+		if ((fd = rawz_expand(fd, "trace", &has_index)) == -1)
+			quit_args("can't expand %s: %s\n", RAW_file, strerror(errno));
+		if (!has_index && verbose_flag)
+			printf("%s has no chunk index, reading as far as it goes -- this is not fatal\n", RAW_file);
+		kdc_raw_open(&raw, fd);
+
+		if (kdc_raw_header(&raw, &raw_header) < 0) {
 			perror("read failed");
 			exit(2);
 		}
-		if (raw_header.version_no != RAW_VERSION1) {
-			raw_header.version_no = RAW_VERSION0;
-			raw_header.TOD_secs = time((long *)0);
-			raw_header.TOD_usecs = 0;
-
-			lseek(fd, (off_t)0, SEEK_SET);
-
-			if (read(fd, &raw_header.thread_count, sizeof(int)) != sizeof(int)) {
-				perror("read failed");
-				exit(2);
-			}
-		} else if (raw_header.version_no == RAW_VERSION1) {
+		if (raw_header.version_no == RAW_VERSION1) {
 #if defined(__ILP32__)
 			/*
 			 * If the raw trace file was written by armv7k, the 64-bit alignment
@@ -968,296 +1815,662 @@ void read_trace(void)
 			if (sizeof(raw_header) == 20) {
 				uint32_t alignment_garbage;
 
-				if (read(fd, &alignment_garbage, sizeof(alignment_garbage)) != sizeof(alignment_garbage)) {
-					perror("read failed");
-					exit(2);
-				}
+				if (kdc_raw_read(&raw, &alignment_garbage, sizeof(alignment_garbage)) != sizeof(alignment_garbage)) {
+					perror("read failed");
+					exit(2);
+				}
+
+				if ((alignment_garbage == 0) || (alignment_garbage >= 0x80000000)) {
+					if (verbose_flag) {
+						printf("Skipping 4 bytes to find valid thread map\n");
+					}
+				} else {
+					/* oops, go back to where we were */
+					kdc_raw_seek(&raw, -(off_t)sizeof(alignment_garbage), SEEK_CUR);
+				}
+			}
+#endif
+		}
+		count_of_names = raw_header.thread_count;
+		trace_time = (time_t) (raw_header.TOD_secs);
+
+		printf("%s\n", ctime(&trace_time));
+	}
+	buffer_size = 1000000 * sizeof(kd_buf);
+
+	if (raw.map) {
+		buffer = (char *) 0;
+		kd = NULL;
+	} else {
+		buffer = malloc(buffer_size);
+
+		if (buffer == (char *) 0)
+			quit("can't allocate memory for tracing info\n");
+
+		kd = (kd_buf *)(uintptr_t)buffer;
+	}
+
+	read_command_map(fd, count_of_names);
+	read_cpu_map(fd);
+
+	if (njobs > 1) {
+		if (raw.map) {
+			read_trace_parallel(&ds, DECODE_CHUNK_RECORDS);
+
+			if (verbose_flag)
+				thread_table_stats();
+			return;
+		}
+		if (verbose_flag)
+			printf("%s can't be mapped, decoding it on one thread\n", RAW_file);
+	}
+
+	for (;;) {
+		uint32_t count;
+
+		if (!readRAW_flag) {
+			needed = buffer_size;
+
+			if (kdc_readtr(buffer, &needed) < 0)
+				quit_args("trace facility failure, KERN_KDREADTR: %s\n", strerror(errno));
+
+			if (needed == 0)
+				break;
+			count = (uint32_t)needed;
+
+		} else if (raw.map) {
+			/*
+			 * Walk the mapped records in place, a buffer's worth at
+			 * a time like the read() path below.
+			 */
+			count = (uint32_t)MIN(kdc_raw_left(&raw) / sizeof(kd_buf), buffer_size / sizeof(kd_buf));
+
+			if (count == 0)
+				break;
+
+			kd = kdc_raw_take(&raw, count * sizeof(kd_buf));
+		} else {
+			ssize_t bytes_read;
+
+			bytes_read = kdc_raw_read(&raw, buffer, buffer_size);
+
+			if (bytes_read == -1) {
+				perror("read failed");
+				exit(2);
+			}
+			count = bytes_read / sizeof(kd_buf);
+
+			if (count == 0)
+				break;
+		}
+		decode_records(kd, count, &ds, aggregate_flag ? NULL : output_file);
+	}
+	if (aggregate_flag)
+		aggregate_print(output_file);
+
+	if (verbose_flag)
+		thread_table_stats();
+
+	if (reenable == 1)
+		set_enable(1);  /* re-enable kernel logging */
+}
+
+
+
+/*
+ * Print count records starting at kd to out, picking up from and updating
+ * ds.  With no out, only the state is kept up to date: -j uses that to find
+ * where each chunk of a raw file starts from.
+ */
+static void
+decode_records(kd_buf *kd, uint32_t count, struct decode_state *ds, FILE *out)
+{
+	uint64_t now = 0;
+	uint64_t prev;
+	uint64_t elapsed;
+	uint32_t cpunum = 0;
+	uint64_t thread;
+	double	x = 0.0;
+	double	y = 0.0;
+	double  event_elapsed_time = 0;
+	kd_buf *kdp;
+	lookup_t  lkp;
+	boolean_t ending_event;
+	int	i;
+	int	debugid;
+	int	debugid_base;
+	int	dmsgindex;
+	char	dbgmessge[80];
+	char	outbuf[32];
+	char	*command;
+
+	for (kdp = &kd[0], i = 0; i < count; i++, kdp++) {
+
+		prev = now;
+		debugid = kdp->debugid;
+		debugid_base = debugid & DBG_FUNC_MASK;
+		now = kdp->timestamp & KDBG_TIMESTAMP_MASK;
+		cpunum = kdbg_get_cpu(kdp);
+
+		/*
+		 * Is this event from an IOP? If so, there will be no
+		 * thread command, label it with the symbolic IOP name
+		 */
+		if (cpumap && (cpunum < cpumap_header->cpu_count) && (cpumap[cpunum].flags & KDBG_CPUMAP_IS_IOP)) {
+			command = cpumap[cpunum].name;
+		} else {
+			find_thread_command(kdp, &command);
+		}
+
+		/*
+		 * The internal use TRACE points clutter the output.
+		 * Print them only if in verbose mode.
+		 */
+		if (!verbose_flag)
+		{
+			/* Is this entry of Class DBG_TRACE */
+			if ((debugid >> 24) == DBG_TRACE) {
+				if (((debugid >> 16) & 0xff) != DBG_TRACE_INFO)
+					continue;
+			}
+		}
+
+		if (aggregate_flag)
+			aggregate_event(debugid_base, cpunum, now);
+
+		if (ds->firsttime)
+			ds->bias = now;
+		now -= ds->bias;
+
+		thread = kdp->arg5;
+
+		if (ds->lines == 64 || ds->firsttime)
+		{
+			ds->prevdelta = now - ds->prevdelta;
+
+			if (ds->firsttime)
+				ds->firsttime = 0;
+			else if (out) {
+				x = (double)ds->prevdelta;
+				x /= divisor;
+
+				fprintf(out, "\n\nNumber of microsecs since in last page %8.1f\n", x);
+			}
+			ds->prevdelta = now;
+
+			/*
+			 * Output description row to output file (make sure to format correctly for 32-bit and 64-bit)
+			 */
+			if (out)
+				fprintf(out,
+#ifdef __LP64__
+					"   AbsTime(Us)      Delta            debugid                       arg1             arg2             arg3             arg4              thread         cpu#  command\n\n"
+#else
+					"   AbsTime(Us)      Delta            debugid                       arg1           arg2           arg3           arg4                thread   cpu#  command\n\n"
+#endif
+					);
+
+			ds->lines = 0;
+
+			if (ds->io_lines > 15000) {
+				if (out == output_file)
+					fcntl(output_fd, F_FLUSH_DATA, 0);
+
+				ds->io_lines = 0;
+			}
+		}
+		lkp = 0;
+
+		if (debugid_base == VFS_LOOKUP) {
+			lkp = handle_lookup_event(thread, debugid, kdp);
+
+			if ( !lkp || !(debugid & DBG_FUNC_END))
+				continue;
+		}
+
+		x = (double)now;
+		x /= divisor;
+
+		if (ds->last_event_time)
+			y = x - ds->last_event_time;
+		else
+			y = x;
+		ds->last_event_time = x;
+		ending_event = FALSE;
+
+		if ( !lkp) {
+			int t_debugid;
+			uint64_t t_thread;
+
+			if ((debugid & DBG_FUNC_START) || debugid == MACH_MAKERUNNABLE) {
+
+				if (debugid_base != BSC_thread_terminate && debugid_base != BSC_exit) {
+
+					if (debugid == MACH_MAKERUNNABLE)
+						t_thread = kdp->arg1;
+					else
+						t_thread = thread;
+
+					insert_start_event(t_thread, debugid_base, now);
+				}
+
+			} else if ((debugid & DBG_FUNC_END) || debugid == MACH_STKHANDOFF || debugid == MACH_SCHEDULED) {
+
+				if (debugid == MACH_STKHANDOFF || debugid == MACH_SCHEDULED) {
+					t_debugid = MACH_MAKERUNNABLE;
+					t_thread = kdp->arg2;
+				} else {
+					t_debugid = debugid_base;
+					t_thread = thread;
+				}
+				elapsed = consume_start_event(t_thread, t_debugid, now);
+
+				if (aggregate_flag && elapsed)
+					aggregate_duration(t_debugid, cpunum, elapsed);
+
+				event_elapsed_time = (double)elapsed;
+				event_elapsed_time /= divisor;
+				ending_event = TRUE;
+
+				if (event_elapsed_time == 0 && (debugid == MACH_STKHANDOFF || debugid == MACH_SCHEDULED))
+					ending_event = FALSE;
+			}
+		}
+		if (!out) {
+			/* only the state is wanted */
+			if (lkp)
+				delete_lookup_event(thread, lkp);
+			ds->lines++;
+			ds->io_lines++;
+			continue;
+		}
+		if (ending_event) {
+			char *ch;
+
+			sprintf(&outbuf[0], "(%-10.1f)", event_elapsed_time);
+			/*
+			 * fix that right paren
+			 */
+			ch = &outbuf[11];
+
+			if (*ch != ')') {
+				ch = strchr (&outbuf[0], ')');
+			}
+			if (ch)
+			{
+				*ch = ' ';
+				--ch;
+
+				while (ch != &outbuf[0])
+				{
+					if (*ch == ' ')
+						--ch;
+					else
+					{
+						*(++ch) = ')';
+						break;
+					}
+				}
+			}
+		}
+		if (match_debugid(debugid_base, dbgmessge, &dmsgindex)) {
+			if (ending_event)
+				fprintf(out, "%13.1f %10.1f%s %-28x  ", x, y, outbuf, debugid_base);
+			else
+				fprintf(out, "%13.1f %10.1f             %-28x  ", x, y, debugid_base);
+		} else {
+			if (ending_event)
+				fprintf(out, "%13.1f %10.1f%s %-28.28s  ", x, y, outbuf, dbgmessge);
+			else
+				fprintf(out, "%13.1f %10.1f             %-28.28s  ", x, y, dbgmessge);
+		}
+		if (lkp) {
+			char *strptr;
+			int	len;
+
+			strptr = (char *)lkp->lk_pathname;
+
+			/*
+			 * print the tail end of the pathname
+			 */
+			len = (int)strlen(strptr);
+			if (len > 51)
+				len -= 51;
+			else
+				len = 0;
+#if defined(__LP64__) || defined(__arm64__)
+
+			fprintf(out, "%-16llx %-51s %-16" PRIx64 "  %-2d %s\n", (uint64_t)lkp->lk_dvp, &strptr[len], thread, cpunum, command);
+#else
+			fprintf(out, "%-8x   %-51s   %-8" PRIx64 "   %-2d  %s\n", (unsigned int)lkp->lk_dvp, &strptr[len], thread, cpunum, command);
+#endif
+			delete_lookup_event(thread, lkp);
+		} else if (debugid == TRACE_INFO_STRING) {
+#if defined(__LP64__) || defined(__arm64__)
+			fprintf(out, "%-32s%-36s %-16" PRIx64 "  %-2d %s\n", (char *) &kdp->arg1, "", thread, cpunum, command);
+#else
+			fprintf(out, "%-16s%-46s   %-8" PRIx64 "   %-2d  %s\n", (char *) &kdp->arg1, "", thread, cpunum, command);
+#endif
+		} else {
+#if defined(__LP64__) || defined(__arm64__)
+			fprintf(out, "%-16" PRIx64 " %-16" PRIx64 " %-16" PRIx64 " %-16" PRIx64 "  %-16" PRIx64 "  %-2d %s\n",
+				(uint64_t)kdp->arg1, (uint64_t)kdp->arg2, (uint64_t)kdp->arg3, (uint64_t)kdp->arg4, thread, cpunum, command);
+#else
+			fprintf(out, "%-8" PRIx64 "       %-8" PRIx64 "       %-8" PRIx64 "       %-8" PRIx64 "            %-8" PRIx64 "   %-2d  %s\n",
+				(uint64_t)kdp->arg1, (uint64_t)kdp->arg2, (uint64_t)kdp->arg3, (uint64_t)kdp->arg4, thread, cpunum, command);
+#endif
+		}
+		ds->lines++;
+		ds->io_lines++;
+	}
+}
+
+
+/*
+ * Copy this thread's thread names, lookups and start events.
+ */
+static struct decode_snapshot *
+decode_snapshot_take(void)
+{
+	struct decode_snapshot *snap;
+	struct thread_table *tt;
+	struct thread_state *ts;
+	struct kdc_threads_walk w;
+	struct kdc_start *evp, **evpp;
+	lookup_t	lkp;
+	threadmap_t	tme, *tmep;
+
+	if ((snap = calloc(1, sizeof(struct decode_snapshot))) == NULL)
+		quit("can't allocate memory for tracing info\n");
+
+	tt = &snap->threads;
+	*tt = (struct thread_table)THREAD_TABLE_INITIALIZER;
+
+	/* the copied slots still point into this thread's pools */
+	if (kdc_threads_copy(&tt->states, &threads.states) < 0)
+		quit("can't allocate memory for tracing info\n");
+
+	pool_reserve(&tt->maps, threads.maps.in_use);
+	pool_reserve(&tt->lookups, threads.lookups.in_use);
+	pool_reserve(&tt->events, threads.events.in_use);
+
+	kdc_threads_walk_start(&tt->states, &w);
 
-				if ((alignment_garbage == 0) || (alignment_garbage >= 0x80000000)) {
-					if (verbose_flag) {
-						printf("Skipping 4 bytes to find valid thread map\n");
-					}
-				} else {
-					/* oops, go back to where we were */
-					lseek(fd, -(off_t)sizeof(alignment_garbage), SEEK_CUR);
-				}
-			}
-#endif
+	while ((ts = kdc_threads_walk_next(&tt->states, &w))) {
+		if ((tme = ts->ts_map)) {
+			ts->ts_map = pool_get(&tt->maps);
+			*ts->ts_map = *tme;
 		}
-		count_of_names = raw_header.thread_count;
-		trace_time = (time_t) (raw_header.TOD_secs);
+		if ((lkp = ts->ts_lookup)) {
+			ts->ts_lookup = pool_get(&tt->lookups);
+			*ts->ts_lookup = *lkp;
+			ts->ts_lookup->lk_pathptr = ts->ts_lookup->lk_pathname +
+			    (lkp->lk_pathptr - lkp->lk_pathname);
+		}
+		evpp = &ts->ts_events;
 
-		printf("%s\n", ctime(&trace_time));
+		for (evp = *evpp; evp; evp = evp->next) {
+			*evpp = pool_get(&tt->events);
+			**evpp = *evp;
+			evpp = &(*evpp)->next;
+		}
+		*evpp = NULL;
 	}
-	buffer_size = 1000000 * sizeof(kd_buf);
-	buffer = malloc(buffer_size);
-
-	if (buffer == (char *) 0)
-		quit("can't allocate memory for tracing info\n");
-
-	kd = (kd_buf *)(uintptr_t)buffer;
 
-	read_command_map(fd, count_of_names);
-	read_cpu_map(fd);
+	tmep = &tt->temp;
 
-	for (;;) {
-		uint32_t count;
-		uint64_t now = 0;
-		uint64_t prev;
-		uint64_t prevdelta = 0;
-		uint32_t cpunum = 0;
-		uint64_t thread;
-		double	x = 0.0;
-		double	y = 0.0;
-		double  event_elapsed_time = 0;
-		kd_buf *kdp;
-		lookup_t  lkp;
-		boolean_t ending_event;
-		int	i;
-		int	debugid;
-		int	debugid_base;
-		int	dmsgindex;
-		char	dbgmessge[80];
-		char	outbuf[32];
-		char	*command;
+	for (tme = threads.temp; tme; tme = tme->tm_next) {
+		*tmep = pool_get(&tt->maps);
+		**tmep = *tme;
+		tmep = &(*tmep)->tm_next;
+	}
+	*tmep = NULL;
 
-		if (!readRAW_flag) {
-			needed = buffer_size;
+	return (snap);
+}
 
-			mib[0] = CTL_KERN;
-			mib[1] = KERN_KDEBUG;
-			mib[2] = KERN_KDREADTR;
-			mib[3] = 0;
-			mib[4] = 0;
-			mib[5] = 0;
-			if (sysctl(mib, 3, buffer, &needed, NULL, 0) < 0)
-				quit_args("trace facility failure, KERN_KDREADTR: %s\n", strerror(errno));
+/*
+ * Replace this thread's table with the one in snap, which is freed.
+ */
+static void
+decode_snapshot_install(struct decode_snapshot *snap)
+{
+	thread_table_free(&threads);
+	threads = snap->threads;
 
-			if (needed == 0)
-				break;
-			count = (uint32_t)needed;
+	free(snap);
+}
 
-		} else {
-			uint32_t bytes_read;
+static void *
+decode_worker(void *arg)
+{
+	struct decode_chunk *chunk;
+	FILE	*out;
 
-			bytes_read = (uint32_t)read(fd, buffer, buffer_size);
+	for (;;) {
+		pthread_mutex_lock(&decode_lock);
 
-			if (bytes_read == -1) {
-				perror("read failed");
-				exit(2);
-			}
-			count = bytes_read / sizeof(kd_buf);
+		while (decode_next_chunk < decode_nchunks && decode_next_chunk >= decode_chunks_ready)
+			pthread_cond_wait(&decode_cond, &decode_lock);
 
-			if (count == 0)
-				break;
+		if (decode_next_chunk == decode_nchunks) {
+			pthread_mutex_unlock(&decode_lock);
+			return (NULL);
 		}
-		for (kdp = &kd[0], i = 0; i < count; i++, kdp++) {
+		chunk = &decode_chunks[decode_next_chunk++];
 
-			prev = now;
-			debugid = kdp->debugid;
-			debugid_base = debugid & DBG_FUNC_MASK;
-			now = kdp->timestamp & KDBG_TIMESTAMP_MASK;
-			cpunum = kdbg_get_cpu(kdp);
+		pthread_mutex_unlock(&decode_lock);
 
-			/*
-			 * Is this event from an IOP? If so, there will be no
-			 * thread command, label it with the symbolic IOP name
-			 */
-			if (cpumap && (cpunum < cpumap_header->cpu_count) && (cpumap[cpunum].flags & KDBG_CPUMAP_IS_IOP)) {
-				command = cpumap[cpunum].name;
-			} else {
-				find_thread_command(kdp, &command);
-			}
+		decode_snapshot_install(chunk->snapshot);
+		chunk->snapshot = NULL;
 
-			/*
-			 * The internal use TRACE points clutter the output.
-			 * Print them only if in verbose mode.
-			 */
-			if (!verbose_flag)
-			{
-				/* Is this entry of Class DBG_TRACE */
-				if ((debugid >> 24) == DBG_TRACE) {
-					if (((debugid >> 16) & 0xff) != DBG_TRACE_INFO)
-						continue;
-				}
-			}
+		if ((out = open_memstream(&chunk->output, &chunk->output_len)) == NULL)
+			quit("can't allocate memory for tracing info\n");
 
-			if (firsttime)
-				bias = now;
-			now -= bias;
+		decode_records(chunk->kd, chunk->count, &chunk->state, out);
+		fclose(out);
 
-			thread = kdp->arg5;
+		pthread_mutex_lock(&decode_lock);
+		chunk->done = TRUE;
+		pthread_cond_broadcast(&decode_cond);
+		pthread_mutex_unlock(&decode_lock);
+	}
+}
 
-			if (lines == 64 || firsttime)
-			{
-				prevdelta = now - prevdelta;
+/*
+ * Write out the decoded chunks from *written on, in order, waiting for
+ * the ones before wait_until and stopping at the first other one that
+ * isn't done yet.
+ */
+static void
+decode_write_chunks(size_t *written, size_t wait_until)
+{
+	struct decode_chunk *chunk;
+	boolean_t done;
 
-				if (firsttime)
-					firsttime = 0;
-				else {
-					x = (double)prevdelta;
-					x /= divisor;
+	while (*written < decode_nchunks) {
+		chunk = &decode_chunks[*written];
 
-					fprintf(output_file, "\n\nNumber of microsecs since in last page %8.1f\n", x);
-				}
-				prevdelta = now;
+		pthread_mutex_lock(&decode_lock);
 
-				/*
-				 * Output description row to output file (make sure to format correctly for 32-bit and 64-bit)
-				 */
-				fprintf(output_file,
-#ifdef __LP64__
-					"   AbsTime(Us)      Delta            debugid                       arg1             arg2             arg3             arg4              thread         cpu#  command\n\n"
-#else
-					"   AbsTime(Us)      Delta            debugid                       arg1           arg2           arg3           arg4                thread   cpu#  command\n\n"
-#endif
-					);
+		while (!chunk->done && *written < wait_until)
+			pthread_cond_wait(&decode_cond, &decode_lock);
+		done = chunk->done;
 
-				lines = 0;
+		pthread_mutex_unlock(&decode_lock);
 
-				if (io_lines > 15000) {
-					fcntl(output_fd, F_FLUSH_DATA, 0);
+		if (!done)
+			break;
 
-					io_lines = 0;
-				}
-			}
-			lkp = 0;
+		fwrite(chunk->output, 1, chunk->output_len, output_file);
+		free(chunk->output);
+		chunk->output = NULL;
 
-			if (debugid_base == VFS_LOOKUP) {
-				lkp = handle_lookup_event(thread, debugid, kdp);
+		(*written)++;
+	}
+}
 
-				if ( !lkp || !(debugid & DBG_FUNC_END))
-					continue;
-			}
+/*
+ * Decode the rest of the mapped raw file on njobs threads.  Finding where
+ * each chunk starts from takes a pass over the records that keeps the state
+ * up to date without formatting anything, which is the expensive part.
+ */
+static void
+read_trace_parallel(struct decode_state *ds, uint32_t chunk_records)
+{
+	struct decode_chunk *chunk;
+	pthread_t	*workers;
+	size_t		nrecords;
+	size_t		written = 0;
+	size_t		backlog;
+	size_t		c;
+	int		i, rc;
+
+	nrecords = kdc_raw_left(&raw) / sizeof(kd_buf);
+	decode_nchunks = howmany(nrecords, chunk_records);
+	backlog = (size_t)njobs * DECODE_BACKLOG;
+
+	decode_chunks = calloc(decode_nchunks, sizeof(struct decode_chunk));
+	workers = calloc(njobs, sizeof(pthread_t));
+
+	if ((decode_nchunks && decode_chunks == NULL) || workers == NULL)
+		quit("can't allocate memory for tracing info\n");
 
-			x = (double)now;
-			x /= divisor;
+	for (i = 0; i < njobs; i++) {
+		if ((rc = pthread_create(&workers[i], NULL, decode_worker, NULL)) != 0)
+			quit_args("can't create decoding thread: %s\n", strerror(rc));
+	}
 
-			if (last_event_time)
-				y = x - last_event_time;
-			else
-				y = x;
-			last_event_time = x;
-			ending_event = FALSE;
+	for (c = 0; c < decode_nchunks; c++) {
+		chunk = &decode_chunks[c];
 
-			if ( !lkp) {
-				int t_debugid;
-				uint64_t t_thread;
+		chunk->count = (uint32_t)MIN(nrecords - c * chunk_records, chunk_records);
+		chunk->kd = kdc_raw_take(&raw, chunk->count * sizeof(kd_buf));
+		chunk->state = *ds;
+		chunk->snapshot = decode_snapshot_take();
 
-				if ((debugid & DBG_FUNC_START) || debugid == MACH_MAKERUNNABLE) {
+		/* move on to where the next chunk starts */
+		decode_records(chunk->kd, chunk->count, ds, NULL);
 
-					if (debugid_base != BSC_thread_terminate && debugid_base != BSC_exit) {
+		pthread_mutex_lock(&decode_lock);
+		decode_chunks_ready = c + 1;
+		pthread_cond_broadcast(&decode_cond);
+		pthread_mutex_unlock(&decode_lock);
 
-						if (debugid == MACH_MAKERUNNABLE)
-							t_thread = kdp->arg1;
-						else
-							t_thread = thread;
+		decode_write_chunks(&written, c + 1 > backlog ? c + 1 - backlog : 0);
+	}
+	decode_write_chunks(&written, decode_nchunks);
 
-						insert_start_event(t_thread, debugid_base, now);
-					}
+	for (i = 0; i < njobs; i++)
+		pthread_join(workers[i], NULL);
 
-				} else if ((debugid & DBG_FUNC_END) || debugid == MACH_STKHANDOFF || debugid == MACH_SCHEDULED) {
+	free(workers);
+	free(decode_chunks);
+	decode_chunks = NULL;
+}
 
-					if (debugid == MACH_STKHANDOFF || debugid == MACH_SCHEDULED) {
-						t_debugid = MACH_MAKERUNNABLE;
-						t_thread = kdp->arg2;
-					} else {
-						t_debugid = debugid_base;
-						t_thread = thread;
-					}
-					event_elapsed_time = (double)consume_start_event(t_thread, t_debugid, now);
-					event_elapsed_time /= divisor;
-					ending_event = TRUE;
 
-					if (event_elapsed_time == 0 && (debugid == MACH_STKHANDOFF || debugid == MACH_SCHEDULED))
-						ending_event = FALSE;
-				}
-			}
-			if (ending_event) {
-				char *ch;
 
-				sprintf(&outbuf[0], "(%-10.1f)", event_elapsed_time);
-				/*
-				 * fix that right paren
-				 */
-				ch = &outbuf[11];
+/*
+ * Wait for the non-blocking -L socket to take more, counting how often and
+ * for how long the collector held things up.
+ */
+static void
+stream_wait_writable(int fd)
+{
+	struct pollfd	pfd = { .fd = fd, .events = POLLOUT };
+	uint64_t	start = current_millis();
 
-				if (*ch != ')') {
-					ch = strchr (&outbuf[0], ')');
-				}
-				if (ch)
-				{
-					*ch = ' ';
-					--ch;
+	while (poll(&pfd, 1, STREAM_STATS_MS) == -1 && errno == EINTR)
+		;
 
-					while (ch != &outbuf[0])
-					{
-						if (*ch == ' ')
-							--ch;
-						else
-						{
-							*(++ch) = ')';
-							break;
-						}
-					}
-				}
-			}
-			if (match_debugid(debugid_base, dbgmessge, &dmsgindex)) {
-				if (ending_event)
-					fprintf(output_file, "%13.1f %10.1f%s %-28x  ", x, y, outbuf, debugid_base);
-				else
-					fprintf(output_file, "%13.1f %10.1f             %-28x  ", x, y, debugid_base);
-			} else {
-				if (ending_event)
-					fprintf(output_file, "%13.1f %10.1f%s %-28.28s  ", x, y, outbuf, dbgmessge);
-				else
-					fprintf(output_file, "%13.1f %10.1f             %-28.28s  ", x, y, dbgmessge);
-			}
-			if (lkp) {
-				char *strptr;
-				int	len;
-
-				strptr = (char *)lkp->lk_pathname;
-
-				/*
-				 * print the tail end of the pathname
-				 */
-				len = (int)strlen(strptr);
-				if (len > 51)
-					len -= 51;
-				else
-					len = 0;
-#if defined(__LP64__) || defined(__arm64__)
+	pthread_mutex_lock(&stream.lock);
+	stream.send_waits++;
+	stream.send_wait_ms += current_millis() - start;
+	pthread_mutex_unlock(&stream.lock);
+}
 
-				fprintf(output_file, "%-16llx %-51s %-16" PRIx64 "  %-2d %s\n", (uint64_t)lkp->lk_dvp, &strptr[len], thread, cpunum, command);
-#else
-				fprintf(output_file, "%-8x   %-51s   %-8" PRIx64 "   %-2d  %s\n", (unsigned int)lkp->lk_dvp, &strptr[len], thread, cpunum, command);
-#endif
-				delete_lookup_event(thread, lkp);
-			} else if (debugid == TRACE_INFO_STRING) {
-#if defined(__LP64__) || defined(__arm64__)
-				fprintf(output_file, "%-32s%-36s %-16" PRIx64 "  %-2d %s\n", (char *) &kdp->arg1, "", thread, cpunum, command);
-#else
-				fprintf(output_file, "%-16s%-46s   %-8" PRIx64 "   %-2d  %s\n", (char *) &kdp->arg1, "", thread, cpunum, command);
-#endif
-			} else {
-#if defined(__LP64__) || defined(__arm64__)
-				fprintf(output_file, "%-16" PRIx64 " %-16" PRIx64 " %-16" PRIx64 " %-16" PRIx64 "  %-16" PRIx64 "  %-2d %s\n",
-					(uint64_t)kdp->arg1, (uint64_t)kdp->arg2, (uint64_t)kdp->arg3, (uint64_t)kdp->arg4, thread, cpunum, command);
-#else
-				fprintf(output_file, "%-8" PRIx64 "       %-8" PRIx64 "       %-8" PRIx64 "       %-8" PRIx64 "            %-8" PRIx64 "   %-2d  %s\n",
-					(uint64_t)kdp->arg1, (uint64_t)kdp->arg2, (uint64_t)kdp->arg3, (uint64_t)kdp->arg4, thread, cpunum, command);
-#endif
+/*
+ * Write all of buf, returning 0 or the errno of the failed write().
+ */
+static int
+write_all(int fd, const void *buf, size_t len)
+{
+	const char	*p = buf;
+	ssize_t		n;
+
+	while (len) {
+		if ((n = write(fd, p, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				stream_wait_writable(fd);
+				continue;
 			}
-			lines++;
-			io_lines++;
+			return (errno);
 		}
+		p += n;
+		len -= n;
 	}
-	if (reenable == 1)
-		set_enable(1);  /* re-enable kernel logging */
+	return (0);
+}
+
+/*
+ * A stream buffer always fits in one chunk; only the header can take more.
+ * write_all() also waits out a full -L socket.
+ */
+static void
+rawz_init(int fd)
+{
+	int	rc;
+
+	if ((rc = rawz_writer_open(&rawz, fd, STREAM_BUF_EVENTS * sizeof(kd_buf), write_all)) != 0)
+		quit_args("can't write tracefile header: %s\n", strerror(rc));
 }
 
+/*
+ * The kernel writes the header and thread map straight to a file
+ * descriptor, so have it write them to a temporary file and compress that.
+ */
+static int
+rawz_write_header(void)
+{
+	char	tmp_path[MAXPATHLEN];
+	const char *tmpdir;
+	void	*map;
+	off_t	size;
+	int	tmp_fd, rc;
+
+	if ((tmpdir = getenv("TMPDIR")) == NULL)
+		tmpdir = _PATH_TMP;
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s/trace.XXXXXX", tmpdir);
+
+	if ((tmp_fd = mkstemp(tmp_path)) == -1)
+		return (1);
+	unlink(tmp_path);
+
+	if (write_command_map(tmp_fd) || (size = lseek(tmp_fd, 0, SEEK_END)) == -1) {
+		close(tmp_fd);
+		return (1);
+	}
+	rc = 0;
+
+	if (size) {
+		if ((map = mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, tmp_fd, 0)) == MAP_FAILED) {
+			close(tmp_fd);
+			return (1);
+		}
+		/* the header carries no timestamp of its own */
+		if ((rc = rawz_writer_write(&rawz, map, (size_t)size, 0)) != 0)
+			errno = rc;
+
+		munmap(map, (size_t)size);
+	}
+	close(tmp_fd);
 
+	return (rc != 0);
+}
 
 void signal_handler(int sig)
 {
@@ -1283,6 +2496,8 @@ int main (int argc, char* argv[], char *envp[])
 	int i;
 	char *output_filename = NULL;
 	unsigned int parsed_arg;
+	const char **codefiles;
+	int ncodefiles = 0;
 
 	for (i = 1; i < argc; i++) {
 		if (strcmp("-X", argv[i]) == 0) {
@@ -1311,7 +2526,7 @@ int main (int argc, char* argv[], char *envp[])
 	output_file = stdout;
 	output_fd = 1;
 
-	while ((ch = getopt(argc, argv, "hedEk:irb:gc:p:s:tR:L:l:S:F:a:x:Xnfvo:PT:N")) != EOF)
+	while ((ch = getopt(argc, argv, "hedEk:irb:gc:p:s:tR:L:l:S:F:a:x:Xnfvo:PT:Nj:m:zAW:y:")) != EOF)
 	{
 		switch(ch)
 		{
@@ -1430,6 +2645,30 @@ int main (int argc, char* argv[], char *envp[])
 		case 'N':
 			no_default_codes_flag = 1;
 			break;
+		case 'm':
+			stream_nbufs = argtoi('m', "decimal number", optarg, 10);
+			if (stream_nbufs < 2)
+				quit_args("argument '-m %s' must be at least 2\n", optarg);
+			break;
+		case 'z':
+			compress_flag = TRUE;
+			break;
+		case 'A':
+			aggregate_flag = 1;
+			break;
+		case 'W':
+			recorder_secs = argtoi('W', "decimal number", optarg, 10);
+			if (recorder_secs < 1)
+				quit_args("argument '-W %s' must be at least 1\n", optarg);
+			break;
+		case 'y':
+			recorder_threshold_us = argtoul('y', "decimal number", optarg, 10);
+			break;
+		case 'j':
+			njobs = argtoi('j', "decimal number", optarg, 10);
+			if (njobs < 1)
+				quit_args("argument '-j %s' must be at least 1\n", optarg);
+			break;
 		case 'T':
 			filter_flag = 1;
 
@@ -1444,11 +2683,15 @@ int main (int argc, char* argv[], char *envp[])
 	}
 	argc -= optind;
 
+	codefiles = calloc(argc + 1, sizeof(char *));
+	if (codefiles == NULL)
+		quit("can't allocate memory for code files\n");
+
 	if (!no_default_codes_flag)
 	{
 		if (verbose_flag)
 			printf("Adding default code file /usr/share/misc/trace.codes. Use '-N' to skip this.\n");
-		parse_codefile("/usr/share/misc/trace.codes");
+		codefiles[ncodefiles++] = "/usr/share/misc/trace.codes";
 	}
 
 	if (argc)
@@ -1459,7 +2702,7 @@ int main (int argc, char* argv[], char *envp[])
 			{
 				const char *cfile = argv[optind++];
 				if (verbose_flag) printf("Adding code file %s \n", cfile);
-				parse_codefile(cfile);
+				codefiles[ncodefiles++] = cfile;
 			}
 		}
 	}
@@ -1469,6 +2712,9 @@ int main (int argc, char* argv[], char *envp[])
 			quit_args("-E flag needs an executable to launch\n");
 	}
 
+	load_codefiles(codefiles, ncodefiles);
+	free(codefiles);
+
 	if (usage_flag)
 		usage(LONG_HELP);
 
@@ -1477,12 +2723,53 @@ int main (int argc, char* argv[], char *envp[])
 	if (pid_flag && pid_exflag)
 		quit_args("Can't use both -a and -x flag together\n");
 
+	if (recorder_threshold_us && !recorder_secs)
+		quit_args("When using 'y' option, must use the 'W' option too\n");
+
+	if (recorder_secs) {
+		if (!LogRAW_flag)
+			quit_args("When using 'W' option, must use the 'L' option too\n");
+
+		/* the -k debugids stop the recording instead of filtering it */
+		recorder_codes[0] = value1;
+		recorder_codes[1] = value2;
+		recorder_codes[2] = value3;
+		recorder_codes[3] = value4;
+		recorder_ncodes = kval_flag;
+		kval_flag = 0;
+	}
+
 	if (kval_flag && filter_flag)
 		quit_args("Cannot use -k flag with -c, -s, or -p\n");
 
 	if (output_filename && !trace_flag && !readRAW_flag)
 		quit_args("When using 'o' option, must use the 't' or 'R' option too\n");
 
+	if (njobs > 1 && !readRAW_flag)
+		quit_args("When using 'j' option, must use the 'R' option too\n");
+
+	if (aggregate_flag && !readRAW_flag)
+		quit_args("When using 'A' option, must use the 'R' option too\n");
+
+	if (aggregate_flag && njobs > 1)
+		quit_args("Can't use both -A and -j flag together\n");
+
+	if (stream_nbufs && !LogRAW_flag)
+		quit_args("When using 'm' option, must use the 'L' option too\n");
+
+	if (compress_flag && !LogRAW_flag)
+		quit_args("When using 'z' option, must use the 'L' option too\n");
+
+	/* the stream is framed so that the collector can save it as is */
+	if (LogRAW_flag && (strncmp(logfile, "tcp:", 4) == 0 || strncmp(logfile, "unix:", 5) == 0)) {
+		stream_socket = TRUE;
+		compress_flag = TRUE;
+	}
+
+	/* the file is compressed as it is written out of the stream buffers */
+	if (compress_flag && !stream_nbufs && !recorder_secs)
+		stream_nbufs = STREAM_DEFAULT_BUFS;
+
 	filter_done_parsing();
 
 	done_with_args = 1;
@@ -1856,11 +3143,11 @@ usage(int short_help)
 			      "                  executable_path [optional args to executable] \n\n");
 
 		(void)fprintf(stderr,
-			      "  usage: trace -L RawFilename [-S SecsToRun]\n");
+			      "  usage: trace -L RawFilename [-S SecsToRun] [-m NumBuffers] [-z] [-W Secs [-k code ...] [-y Usecs]]\n");
 		(void)fprintf(stderr,
 			      "  usage: trace -l RawFilename\n");
 		(void)fprintf(stderr,
-			      "  usage: trace -R RawFilename [-X] [-F frequency] [-o OutputFilename] [-N] [ExtraCodeFilename1 ExtraCodeFilename2 ...]\n");
+			      "  usage: trace -R RawFilename [-X] [-F frequency] [-o OutputFilename] [-N] [-j jobs | -A] [ExtraCodeFilename1 ExtraCodeFilename2 ...]\n");
 		(void)fprintf(stderr,
 			      "  usage: trace -t [-o OutputFilename] [-N] [ExtraCodeFilename1 ExtraCodeFilename2 ...]\n");
 		(void)fprintf(stderr,
@@ -1938,22 +3225,32 @@ usage(int short_help)
 	(void)fprintf(stderr, "\t -o OutputFilename  Print trace output to OutputFilename. Default is stdout.\n\n");
 
 	(void)fprintf(stderr,
-		      "usage: trace -R RawFilename [-X] [-F frequency] [-o OutputFilename] [-N] [ExtraCodeFilename1 ExtraCodeFilename2 ...] \n");
+		      "usage: trace -R RawFilename [-X] [-F frequency] [-o OutputFilename] [-N] [-j jobs | -A] [ExtraCodeFilename1 ExtraCodeFilename2 ...] \n");
 	(void)fprintf(stderr, "\tRead raw trace file and print it.\n\n");
 	(void)fprintf(stderr, "\t -X                 Force trace to interpret trace data as 32 bit. \n");
 	(void)fprintf(stderr, "\t                          Default is to match the bit width of the current system. \n");
 	(void)fprintf(stderr, "\t -N                 Do not import /usr/share/misc/trace.codes (for raw hex tracing or supplying an alternate set of codefiles)\n");
 	(void)fprintf(stderr, "\t -F frequency       Specify the frequency of the clock used to timestamp entries in RawFilename.\n\t                    Use command \"sysctl hw.tbfrequency\" on the target device, to get target frequency.\n");
+	(void)fprintf(stderr, "\t -j jobs            Decode RawFilename on this many threads.\n");
+	(void)fprintf(stderr, "\t -A                 Print counts and start to end times for each debugid instead of the events.\n");
 	(void)fprintf(stderr, "\t -o OutputFilename  Print trace output to OutputFilename. Default is stdout.\n\n");
 
 	(void)fprintf(stderr,
-		      "usage: trace -L RawFilename [-S SecsToRun]\n");
+		      "usage: trace -L RawFilename [-S SecsToRun] [-m NumBuffers] [-z] [-W Secs [-k code ...] [-y Usecs]]\n");
 	(void)fprintf(stderr, "\tContinuously collect the kernel buffer trace data in the raw format \n");
 	(void)fprintf(stderr, "\tand write it to RawFilename. \n");
 
 	(void)fprintf(stderr, "\t-L implies -r -i if tracing isn't currently enabled.\n");
 	(void)fprintf(stderr, "\tOptions passed to -e(enable) are also accepted by -L. (except -a -x -P)\n\n");
-	(void)fprintf(stderr, "\t -S SecsToRun       Specify the number of seconds to collect trace data.\n\n");
+	(void)fprintf(stderr, "\t -S SecsToRun       Specify the number of seconds to collect trace data.\n");
+	(void)fprintf(stderr, "\t -m NumBuffers      Read trace data into this many buffers and write them\n");
+	(void)fprintf(stderr, "\t                    to RawFilename on a separate thread.\n");
+	(void)fprintf(stderr, "\t -z                 Compress RawFilename with LZ4 as it is written. Implies -m.\n");
+	(void)fprintf(stderr, "\t                    A RawFilename of tcp:host:port or unix:path streams the\n");
+	(void)fprintf(stderr, "\t                    compressed data to a collector instead, dropping events it can't keep up with.\n");
+	(void)fprintf(stderr, "\t -W Secs            Keep only the last Secs seconds of trace data in memory, and write\n");
+	(void)fprintf(stderr, "\t                    them to RawFilename when interrupted, on SIGUSR1, at -S SecsToRun,\n");
+	(void)fprintf(stderr, "\t                    on one of the -k codes, or when a start to end pair takes -y Usecs.\n\n");
 
 	(void)fprintf(stderr,
 		      "usage: trace -l RawFilename\n");
@@ -2322,44 +3619,6 @@ parse_filter_file(char *filename)
 	fclose(file);
 }
 
-/*
- *  Find the debugid code in the list and return its index
- */
-static int
-binary_search(code_type_t *list, int lowbound, int highbound, unsigned int code)
-{
-	int low, high, mid;
-	int tries = 0;
-
-	low = lowbound;
-	high = highbound;
-
-	while (1)
-	{
-		mid = (low + high) / 2;
-
-		tries++;
-
-		if (low > high)
-			return (-1); /* failed */
-		else if ( low + 1 >= high)
-		{
-			/* We have a match */
-			if (list[high].debugid == code)
-				return(high);
-			else if (list[low].debugid == code)
-				return(low);
-			else
-				return(-1);  /* search failed */
-		}
-		else if (code < list[mid].debugid)
-			high = mid;
-		else
-			low = mid;
-	} 
-}
-
-
 static int
 parse_codefile(const char *filename)
 {
@@ -2532,24 +3791,73 @@ parse_codefile(const char *filename)
 		printf("[%6d] 0x%8x %s\n\n", codenum-1, codesc[codenum-1].debugid, codesc[codenum-1].debug_string);
 	}
 
-	/* sort */
+	return(0);
+}
+
+/*
+ * Load the codes from the given code files, from the cache if it was
+ * compiled from the same files and none of them has changed since.
+ */
+static void
+load_codefiles(const char **files, int nfiles)
+{
+	char		*key;
+	size_t		key_size;
+	int		i;
+
+	if (nfiles == 0)
+		return;
+
+	/* a missing file is reported by parse_codefile() */
+	if (kdc_codes_cache_key(files, nfiles, &key, &key_size) < 0)
+		key = NULL;
+
+	/* with -v, parse the files anyway to report on them */
+	if (key && !verbose_flag && kdc_codes_cache_load(&codes, key, key_size) == 0) {
+		if (codes.dupes)
+			codesc_dupes_warning();
+		free(key);
+		return;
+	}
+
+	for (i = 0; i < nfiles; i++)
+		parse_codefile(files[i]);
+
+	codesc_compile();
+
+	if (key) {
+		if (kdc_codes_cache_save(&codes, key, key_size) < 0 && verbose_flag)
+			printf("Can't write the code cache -- this is not fatal\n");
+		free(key);
+	}
+}
+
+/*
+ * Build the code table from the parsed codes, in the order the files
+ * list them, then sort them to report on any duplicates.
+ */
+static void
+codesc_compile(void)
+{
+	size_t		i;
+
+	for (i = 0; i < codesc_idx; i++) {
+		if (codesc[i].debug_string &&
+		    kdc_codes_add(&codes, codesc[i].debugid, codesc[i].debug_string) < 0)
+			quit("can't allocate memory for the code table\n");
+	}
+	if (kdc_codes_compile(&codes) < 0)
+		quit("can't allocate memory for the code table\n");
+
 	qsort((void *)codesc, codesc_idx, sizeof(code_type_t), debugid_compar);
 
-	if (verbose_flag)
+	if (verbose_flag && codesc_idx)
 	{
-		printf("Sorted %zd codes in %s\n", codesc_idx, filename);
+		printf("Sorted %zd codes\n", codesc_idx);
 		printf("lowbound  [%6d]: 0x%8x %s\n", 0, codesc[0].debugid, codesc[0].debug_string);
 		printf("highbound [%6zd]: 0x%8x %s\n\n", codesc_idx - 1, codesc[codesc_idx - 1].debugid, codesc[codesc_idx - 1].debug_string);
 	}
 	codesc_find_dupes();
-
-#if 0
-	/* Dump the codefile */
-	int i;
-	for (i = 0; i < codesc_idx; i++)
-		printf("[%d]  0x%x   %s\n",i+1, codesc[i].debugid, codesc[i].debug_string);
-#endif
-	return(0);
 }
 
 static void
@@ -2574,40 +3882,38 @@ codesc_find_dupes(void)
 	}
 	if (found_dupes)
 	{
-		fprintf(stderr, "WARNING: One or more duplicate entries found in your codefiles, which will lead to unpredictable decoding behavior. Re-run with -v for more info\n");
+		codesc_dupes_warning();
 	}
 }
 
+static void
+codesc_dupes_warning(void)
+{
+	fprintf(stderr, "WARNING: One or more duplicate entries found in your codefiles, which will lead to unpredictable decoding behavior. Re-run with -v for more info\n");
+}
+
 int
 match_debugid(unsigned int xx, char * debugstr, int * yy)
 {
-	int indx;
-
-	if (codenum == 0)
-		return(-1);
+	const struct kdc_code_slot *s;
 
-	if (codesc[codeindx_cache].debugid != xx)
-		indx = binary_search(codesc, 0, (codenum-1), xx);
-	else
-		indx = codeindx_cache;
+	if ((s = kdc_codes_find(&codes, xx)) == NULL)
+		return(-1);  /* match failed */
 
-	if (indx == -1)
-		return(indx);  /* match failed */
-	else {
-		bcopy(&codesc[indx].debug_string[0], debugstr,80);
-		*yy = indx;
-		codeindx_cache = indx;
-		return(0);   /* match success */
-	}
+	strlcpy(debugstr, &codes.names[s->name], 80);
+	*yy = (int)(s - codes.table);
+	return(0);   /* match success */
 }
 
 void
 read_cpu_map(int fd)
 {
 	if (cpumap_header) {
-		free(cpumap_header);
+		if (!cpumap_mapped)
+			free(cpumap_header);
 		cpumap_header = NULL;
 		cpumap = NULL;
+		cpumap_mapped = FALSE;
 	}
 
 	/*
@@ -2621,11 +3927,21 @@ read_cpu_map(int fd)
 		 * cpu maps exist in a RAW_VERSION1+ header only
 		 */
 		if (raw_header.version_no == RAW_VERSION1) {
-			off_t cpumap_position = lseek(fd, 0, SEEK_CUR);
+			off_t cpumap_position = kdc_raw_seek(&raw, 0, SEEK_CUR);
             /* cpumap is part of the last 4KB of padding in the preamble */
 			size_t padding_bytes = SIZE_4KB - (cpumap_position & (SIZE_4KB - 1));
-
-			if (read(fd, cpumap_header, padding_bytes) == padding_bytes) {
+			kd_cpumap_header *mapped_header;
+
+			if (raw.map) {
+				/* use the cpu map in place */
+				if ((mapped_header = kdc_raw_take(&raw, padding_bytes)) &&
+				    mapped_header->version_no == RAW_VERSION1) {
+					free(cpumap_header);
+					cpumap_header = mapped_header;
+					cpumap_mapped = TRUE;
+					cpumap = (kd_cpumap*)&cpumap_header[1];
+				}
+			} else if (kdc_raw_read(&raw, cpumap_header, padding_bytes) == padding_bytes) {
 				if (cpumap_header->version_no == RAW_VERSION1) {
 					cpumap = (kd_cpumap*)&cpumap_header[1];
 				}
@@ -2650,7 +3966,8 @@ read_cpu_map(int fd)
 
 	if (!cpumap) {
 		printf("Can't read the cpu map -- this is not fatal\n");
-		free(cpumap_header);
+		if (!cpumap_mapped)
+			free(cpumap_header);
 		cpumap_header = NULL;
 	} else if (verbose_flag) {
 		/* Dump the initial cpumap */
@@ -2667,7 +3984,6 @@ read_command_map(int fd, uint32_t count)
 {
 	int i;
 	size_t size;
-	int mib[6];
 
 	if (readRAW_flag) {
 		total_threads = count;
@@ -2684,7 +4000,14 @@ read_command_map(int fd, uint32_t count)
 	if (verbose_flag)
 		printf("Size of map table is %d, thus %d entries\n", (int)size, total_threads);
 
-	if (size) {
+	if (readRAW_flag && raw.map) {
+		/* use the thread map in place */
+		if (size && (mapptr = kdc_raw_take(&raw, size)) == NULL) {
+			if (verbose_flag)
+				printf("Can't read the thread map -- this is not fatal\n");
+			return (int)size;
+		}
+	} else if (size) {
 		if ((mapptr = (kd_threadmap *) malloc(size)))
 			bzero (mapptr, size);
 		else
@@ -2695,7 +4018,7 @@ read_command_map(int fd, uint32_t count)
 		}
 	}
 	if (readRAW_flag) {
-		if (read(fd, mapptr, size) != size) {
+		if (!raw.map && kdc_raw_read(&raw, mapptr, size) != size) {
 			if (verbose_flag)
 				printf("Can't read the thread map -- this is not fatal\n");
 			free(mapptr);
@@ -2705,13 +4028,7 @@ read_command_map(int fd, uint32_t count)
 		}
 	} else {
 		/* Now read the threadmap */
-		mib[0] = CTL_KERN;
-		mib[1] = KERN_KDEBUG;
-		mib[2] = KERN_KDTHRMAP;
-		mib[3] = 0;
-		mib[4] = 0;
-		mib[5] = 0;		/* no flags */
-		if (sysctl(mib, 3, mapptr, &size, NULL, 0) < 0)
+		if (kdc_op(KERN_KDTHRMAP, mapptr, &size) < 0)
 		{
 			/* This is not fatal -- just means I cant map command strings */
 			if (verbose_flag)
@@ -2721,6 +4038,10 @@ read_command_map(int fd, uint32_t count)
 			return(0);
 		}
 	}
+	/* size the thread table and the name pool once for the whole map */
+	thread_table_reserve(total_threads);
+	pool_reserve(&threads.maps, total_threads);
+
 	for (i = 0; i < total_threads; i++) {
 		if (mapptr[i].thread)
 			create_map_entry(mapptr[i].thread, &mapptr[i].command[0]);
@@ -2745,87 +4066,52 @@ read_command_map(int fd, uint32_t count)
 void
 create_map_entry(uint64_t thread, char *command)
 {
+	struct thread_state *ts;
 	threadmap_t	tme;
-	int		hashid;
 
-	if ((tme = threadmap_freelist))
-		threadmap_freelist = tme->tm_next;
-	else
-		tme = (threadmap_t)malloc(sizeof(struct threadmap));
+	ts = thread_state_get(thread);
 
+	if ((tme = ts->ts_map) == NULL) {
+		tme = pool_get(&threads.maps);
+		ts->ts_map = tme;
+	}
 	tme->tm_thread = thread;
 	tme->tm_deleteme = FALSE;
 
 	(void)strncpy (tme->tm_command, command, MAXCOMLEN);
 	tme->tm_command[MAXCOMLEN] = '\0';
-
-	hashid = thread & HASH_MASK;
-
-	tme->tm_next = threadmap_hash[hashid];
-	threadmap_hash[hashid] = tme;
 }
 
 void
 delete_thread_entry(uint64_t thread)
 {
-	threadmap_t	tme = 0;
-	threadmap_t	tme_prev;
-	int		hashid;
-
-	hashid = thread & HASH_MASK;
+	struct thread_state *ts;
 
-	if ((tme = threadmap_hash[hashid])) {
-		if (tme->tm_thread == thread)
-			threadmap_hash[hashid] = tme->tm_next;
-		else {
-			tme_prev = tme;
+	if ((ts = thread_state_find(thread)) && ts->ts_map) {
+		pool_put(&threads.maps, ts->ts_map);
+		ts->ts_map = NULL;
 
-			for (tme = tme->tm_next; tme; tme = tme->tm_next) {
-				if (tme->tm_thread == thread) {
-					tme_prev->tm_next = tme->tm_next;
-					break;
-				}
-				tme_prev = tme;
-			}
-		}
-		if (tme) {
-			tme->tm_next = threadmap_freelist;
-			threadmap_freelist = tme;
-		}
+		thread_state_release(ts);
 	}
 }
 
 void
 find_and_insert_tmp_map_entry(uint64_t pthread, char *command)
 {
-	threadmap_t	tme = 0;
-	threadmap_t	tme_prev;
-	int		hashid;
+	threadmap_t	tme;
+	threadmap_t	*tmep;
 
-	if ((tme = threadmap_temp)) {
-		if (tme->tm_pthread == pthread)
-			threadmap_temp = tme->tm_next;
-		else {
-			tme_prev = tme;
+	for (tmep = &threads.temp; (tme = *tmep); tmep = &tme->tm_next) {
+		if (tme->tm_pthread == pthread) {
+			*tmep = tme->tm_next;
 
-			for (tme = tme->tm_next; tme; tme = tme->tm_next) {
-				if (tme->tm_pthread == pthread) {
-					tme_prev->tm_next = tme->tm_next;
-					break;
-				}
-				tme_prev = tme;
-			}
-		}
-		if (tme) {
 			(void)strncpy (tme->tm_command, command, MAXCOMLEN);
 			tme->tm_command[MAXCOMLEN] = '\0';
 
 			delete_thread_entry(tme->tm_thread);
 
-			hashid = tme->tm_thread & HASH_MASK;
-
-			tme->tm_next = threadmap_hash[hashid];
-			threadmap_hash[hashid] = tme;
+			thread_state_get(tme->tm_thread)->ts_map = tme;
+			break;
 		}
 	}
 }
@@ -2835,33 +4121,25 @@ create_tmp_map_entry(uint64_t thread, uint64_t pthread)
 {
 	threadmap_t	tme;
 
-	if ((tme = threadmap_freelist))
-		threadmap_freelist = tme->tm_next;
-	else
-		tme = (threadmap_t)malloc(sizeof(struct threadmap));
+	tme = pool_get(&threads.maps);
 
 	tme->tm_thread = thread;
 	tme->tm_pthread = pthread;
 	tme->tm_deleteme = FALSE;
 	tme->tm_command[0] = '\0';
 
-	tme->tm_next = threadmap_temp;
-	threadmap_temp = tme;
+	tme->tm_next = threads.temp;
+	threads.temp = tme;
 }
 
 
 threadmap_t
 find_thread_entry(uint64_t thread)
 {
-	threadmap_t	tme;
-	int	hashid;
+	struct thread_state *ts;
 
-	hashid = thread & HASH_MASK;
-
-	for (tme = threadmap_hash[hashid]; tme; tme = tme->tm_next) {
-		if (tme->tm_thread == thread)
-			return (tme);
-	}
+	if ((ts = thread_state_find(thread)))
+		return (ts->ts_map);
 	return (0);
 }
 
@@ -2929,10 +4207,10 @@ find_thread_command(kd_buf *kbufp, char **command)
 static void
 getdivisor(void)
 {
-	(void) mach_timebase_info (&mach_timebase);
+	kdc_timebase_init(&timebase);
 
 	if (frequency == 0) {
-		divisor = ( (double)mach_timebase.denom / (double)mach_timebase.numer) * 1000;
+		divisor = timebase.divisor;
 	} else
 		divisor = (double)frequency / 1000000;
 
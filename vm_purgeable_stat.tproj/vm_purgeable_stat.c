@@ -25,6 +25,7 @@
 #include <System/sys/proc.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <ctype.h>
 #include <unistd.h>
 #include <mach/mach.h>
@@ -32,8 +33,11 @@
 #include <mach/task.h>
 #include <libproc.h>
 #include <mach/vm_purgable.h>
+#include <dispatch/dispatch.h>
 
-#define USAGE "Usage: vm_purgeable_stat [-a | -p <pid> | -s <interval>]\n"
+#include "proctab.h"
+
+#define USAGE "Usage: vm_purgeable_stat [-a | -p <pid> | -s <interval> | -t <count> [-s <interval>] | -g <count> [-s <interval>]]\n"
 #define PRIV_ERR_MSG "The option specified needs root priveleges."
 #define PROC_NAME_LEN 256
 #define KB 1024
@@ -41,12 +45,39 @@
 
 static inline int purge_info_size_adjust(uint64_t size);
 static inline char purge_info_unit(uint64_t size);
+static inline int purge_info_signed_adjust(int64_t delta);
+static inline char purge_info_signed_unit(int64_t delta);
 void print_header(int summary_view);
 int get_system_tasks(task_array_t *tasks, mach_msg_type_number_t *count);
 int get_task_from_pid(int pid, task_t *task);
+void release_system_tasks(task_array_t tasks, mach_msg_type_number_t count);
+void print_purge_info(struct vm_purgeable_info *info);
 void print_purge_info_task(task_t task, int pid);
 void print_purge_info_task_array(task_array_t tasks, mach_msg_type_number_t count);
 void print_purge_info_summary(int sleep_duration);
+void print_purge_info_top(int top_count, int sleep_duration);
+void print_purge_info_growers(int top_count, int sleep_duration);
+
+struct purge_info_entry {
+	int				pid;	/* -1 if the task could not be inspected */
+	uint64_t			total;	/* bytes across all queues */
+	struct vm_purgeable_info	info;
+};
+
+/*
+ * -g keeps one entry per task across intervals, sorted by task port name.
+ * processor_set_tasks() hands back the same name for a task we already hold,
+ * so known tasks are matched without another pid_for_task().
+ */
+struct purge_task_state {
+	task_t		task;
+	int		pid;
+	int		has_prev;		/* a previous sample exists */
+	uint64_t	volatile_bytes;
+	uint64_t	nonvolatile_bytes;
+	int64_t		volatile_delta;
+	int64_t		nonvolatile_delta;
+};
 
 static inline int purge_info_size_adjust(uint64_t size)
 {
@@ -55,6 +86,16 @@ static inline int purge_info_size_adjust(uint64_t size)
 	return (int)size;
 }
 
+static inline int purge_info_signed_adjust(int64_t delta)
+{
+	return (delta < 0) ? -purge_info_size_adjust((uint64_t)-delta) : purge_info_size_adjust((uint64_t)delta);
+}
+
+static inline char purge_info_signed_unit(int64_t delta)
+{
+	return purge_info_unit((delta < 0) ? (uint64_t)-delta : (uint64_t)delta);
+}
+
 static inline char purge_info_unit(uint64_t size)
 {
 	char sizes[] = {'B', 'K', 'M', 'G', 'T'};
@@ -98,67 +139,71 @@ int get_task_from_pid(int pid, task_t *task)
 
 int get_system_tasks(task_array_t *tasks, mach_msg_type_number_t *count)
 {
-	processor_set_name_array_t psets;
-	mach_msg_type_number_t psetCount;
-	mach_port_t pset_priv;
-	kern_return_t ret;
-
 	if (geteuid() != 0) {
 		fprintf(stderr, "%s\n", PRIV_ERR_MSG);
 		return -1;
 	}
+	return proctab_tasks(TASK_FLAVOR_INSPECT, tasks, count);
+}
 
-	ret = host_processor_sets(mach_host_self(), &psets, &psetCount);
-	if (ret != KERN_SUCCESS) {
-		fprintf(stderr, "host_processor_sets() failed: %s\n", mach_error_string(ret));
-		return -1;
-	}
-	if (psetCount != 1) {
-		fprintf(stderr, "Assertion Failure: pset count greater than one (%d)\n", psetCount);
-		return -1;
-	}
+void release_system_tasks(task_array_t tasks, mach_msg_type_number_t count)
+{
+	proctab_release_tasks(tasks, count);
+}
 
-	/* convert the processor-set-name port to a privileged port */
-	ret = host_processor_set_priv(mach_host_self(), psets[0], &pset_priv);
-	if (ret != KERN_SUCCESS) {
-		fprintf(stderr, "host_processor_set_priv() failed: %s\n", mach_error_string(ret));
-		return -1;
-	}
-	mach_port_deallocate(mach_task_self(), psets[0]);
-	vm_deallocate(mach_task_self(), (vm_address_t)psets, (vm_size_t)psetCount * sizeof(mach_port_t));
+void print_purge_info(struct vm_purgeable_info *info)
+{
+	int i;
 
-	/* convert the processor-set-priv to a list of tasks for the processor set */
-	ret = processor_set_tasks_with_flavor(pset_priv, TASK_FLAVOR_INSPECT, tasks, count);
-	if (ret != KERN_SUCCESS) {
-		fprintf(stderr, "processor_set_tasks_with_flavor() failed: %s\n", mach_error_string(ret));
-		return -1;
-	}
-	mach_port_deallocate(mach_task_self(), pset_priv);
-	return 0;
+	for (i=0; i<PURGEABLE_PRIO_LEVELS; i++)
+		printf("%4u/%3d%c ", (unsigned)info->fifo_data[i].count, purge_info_size_adjust(info->fifo_data[i].size), purge_info_unit(info->fifo_data[i].size));
+	printf("%4u/%3d%c ", (unsigned)info->obsolete_data.count, purge_info_size_adjust(info->obsolete_data.size), purge_info_unit(info->obsolete_data.size));
+	for (i=0; i<PURGEABLE_PRIO_LEVELS; i++)
+		printf("%4u/%3d%c ", (unsigned)info->lifo_data[i].count, purge_info_size_adjust(info->lifo_data[i].size), purge_info_unit(info->lifo_data[i].size));
+	printf("\n");
+}
+
+static uint64_t purge_info_total(struct vm_purgeable_info *info)
+{
+	uint64_t total = info->obsolete_data.size;
+	int i;
+
+	for (i=0; i<PURGEABLE_PRIO_LEVELS; i++)
+		total += info->fifo_data[i].size + info->lifo_data[i].size;
+	return total;
+}
+
+static int purge_info_entry_compare(const void *a, const void *b)
+{
+	const struct purge_info_entry *ea = a, *eb = b;
+
+	if (ea->total != eb->total)
+		return (ea->total < eb->total) ? 1 : -1;
+	return ea->pid - eb->pid;
+}
+
+static void print_purge_info_name(int pid)
+{
+	char pname[PROC_NAME_LEN];
+
+	if (0 == proc_name(pid, pname, PROC_NAME_LEN))
+		strlcpy(pname, "Unknown", sizeof(pname));
+	pname[20] = 0;
+	printf("%20s ", pname);
 }
 
 void print_purge_info_task(task_t task, int pid)
 {
 	task_purgable_info_t info;
 	kern_return_t kr;
-	int i;
-	char pname[PROC_NAME_LEN];
 
 	kr = task_purgable_info(task, &info);
 	if (kr != KERN_SUCCESS) {
 		fprintf(stderr, "(pid: %d) task_purgable_info() failed: %s\n", pid, mach_error_string(kr));
 		return;
 	}
-	if (0 == proc_name(pid, pname, PROC_NAME_LEN))
-		strncpy(pname, "Unknown", 7);
-	pname[20] = 0;
-	printf("%20s ", pname);
-	for (i=0; i<PURGEABLE_PRIO_LEVELS; i++)
-		printf("%4u/%3d%c ", (unsigned)info.fifo_data[i].count, purge_info_size_adjust(info.fifo_data[i].size), purge_info_unit(info.fifo_data[i].size));
-        printf("%4u/%3d%c ", (unsigned)info.obsolete_data.count, purge_info_size_adjust(info.obsolete_data.size), purge_info_unit(info.obsolete_data.size));
-	for (i=0; i<PURGEABLE_PRIO_LEVELS; i++)
-		printf("%4u/%3d%c ", (unsigned)info.lifo_data[i].count, purge_info_size_adjust(info.lifo_data[i].size), purge_info_unit(info.lifo_data[i].size));
-	printf("\n");
+	print_purge_info_name(pid);
+	print_purge_info(&info);
 	return;
 }
 
@@ -180,72 +225,305 @@ void print_purge_info_summary(int sleep_duration)
 	host_purgable_info_data_t       info;
         mach_msg_type_number_t          count;
         kern_return_t                   result;
-        int                             i;
 
+	/* one host-wide call per interval; no task ports are touched */
 	while(1) {
 		count = HOST_VM_PURGABLE_COUNT;
 		result = host_info(mach_host_self(), HOST_VM_PURGABLE, (host_info_t)&info, &count);
 		if (result != KERN_SUCCESS)
 			break;
-		for (i=0; i<PURGEABLE_PRIO_LEVELS; i++)
-			printf("%4u/%3d%c ", (unsigned)info.fifo_data[i].count, purge_info_size_adjust(info.fifo_data[i].size), purge_info_unit(info.fifo_data[i].size));
-		printf("%4u/%3d%c ", (unsigned)info.obsolete_data.count, purge_info_size_adjust(info.obsolete_data.size), purge_info_unit(info.obsolete_data.size));
-		for (i=0; i<PURGEABLE_PRIO_LEVELS; i++)
-			printf("%4u/%3d%c ", (unsigned)info.lifo_data[i].count, purge_info_size_adjust(info.lifo_data[i].size), purge_info_unit(info.lifo_data[i].size));
-		printf("\n");
+		print_purge_info(&info);
+		fflush(stdout);
 		sleep(sleep_duration);
 	}
         return;
 }
 
+/*
+ * Rank tasks by total purgeable size. task_purgable_info() walks each task's
+ * purgeable queues in the kernel, so tasks are inspected concurrently.
+ */
+void print_purge_info_top(int top_count, int sleep_duration)
+{
+	task_array_t tasks;
+	mach_msg_type_number_t taskCount;
+	struct purge_info_entry *entries;
+	int i, shown;
+
+	while(1) {
+		if (get_system_tasks(&tasks, &taskCount) < 0)
+			return;
+		entries = calloc(taskCount, sizeof(*entries));
+		if (entries == NULL) {
+			perror("calloc");
+			release_system_tasks(tasks, taskCount);
+			return;
+		}
+
+		dispatch_apply(taskCount, DISPATCH_APPLY_AUTO, ^(size_t t) {
+			struct purge_info_entry *entry = &entries[t];
+
+			entry->pid = -1;
+			if (KERN_SUCCESS != pid_for_task(tasks[t], &entry->pid) ||
+			    KERN_SUCCESS != task_purgable_info(tasks[t], &entry->info)) {
+				entry->pid = -1;
+				return;
+			}
+			entry->total = purge_info_total(&entry->info);
+		});
+		release_system_tasks(tasks, taskCount);
+
+		qsort(entries, taskCount, sizeof(*entries), purge_info_entry_compare);
+		print_header(0);
+		for (i = 0, shown = 0; i < taskCount && shown < top_count; i++) {
+			if (entries[i].pid < 0 || entries[i].total == 0)
+				continue;
+			print_purge_info_name(entries[i].pid);
+			print_purge_info(&entries[i].info);
+			shown++;
+		}
+		free(entries);
+
+		if (sleep_duration <= 0)
+			break;
+		printf("\n");
+		fflush(stdout);
+		sleep(sleep_duration);
+	}
+}
+
+static int task_port_compare(const void *a, const void *b)
+{
+	task_t ta = *(const task_t *)a, tb = *(const task_t *)b;
+
+	return (ta > tb) - (ta < tb);
+}
+
+static int purge_task_delta_compare(const void *a, const void *b)
+{
+	const struct purge_task_state *sa = *(struct purge_task_state * const *)a;
+	const struct purge_task_state *sb = *(struct purge_task_state * const *)b;
+
+	if (sa->volatile_delta != sb->volatile_delta)
+		return (sa->volatile_delta < sb->volatile_delta) ? 1 : -1;
+	return sa->pid - sb->pid;
+}
+
+/*
+ * Merge a fresh task list into the port-sorted state array. Extra send
+ * rights for known tasks and rights for exited tasks are released.
+ */
+static int refresh_purge_task_states(struct purge_task_state **statesp, mach_msg_type_number_t *countp)
+{
+	struct purge_task_state *old = *statesp, *states;
+	mach_msg_type_number_t oldCount = *countp, taskCount, i = 0, j = 0, n = 0;
+	task_array_t tasks;
+
+	if (get_system_tasks(&tasks, &taskCount) < 0)
+		return -1;
+	qsort(tasks, taskCount, sizeof(task_t), task_port_compare);
+
+	states = calloc(taskCount ? taskCount : 1, sizeof(*states));
+	if (states == NULL) {
+		perror("calloc");
+		release_system_tasks(tasks, taskCount);
+		return -1;
+	}
+
+	while (i < oldCount || j < taskCount) {
+		if (j == taskCount || (i < oldCount && old[i].task < tasks[j])) {
+			mach_port_deallocate(mach_task_self(), old[i].task);
+			i++;
+		} else if (i == oldCount || tasks[j] < old[i].task) {
+			states[n].task = tasks[j];
+			if (KERN_SUCCESS != pid_for_task(tasks[j], &states[n].pid)) {
+				mach_port_deallocate(mach_task_self(), tasks[j]);
+			} else {
+				n++;
+			}
+			j++;
+		} else {
+			states[n++] = old[i++];
+			mach_port_deallocate(mach_task_self(), tasks[j++]);
+		}
+	}
+	vm_deallocate(mach_task_self(), (vm_address_t)tasks, (vm_size_t)taskCount * sizeof(task_t));
+
+	free(old);
+	*statesp = states;
+	*countp = n;
+	return 0;
+}
+
+/*
+ * Report the tasks whose volatile purgeable memory grew the most since the
+ * previous interval. The totals come from the task's purgeable ledgers via
+ * TASK_VM_INFO, which is much cheaper than walking the queues.
+ */
+void print_purge_info_growers(int top_count, int sleep_duration)
+{
+	struct purge_task_state *states = NULL, **ranked;
+	mach_msg_type_number_t stateCount = 0;
+	int i, shown, first = 1;
+
+	while(1) {
+		if (refresh_purge_task_states(&states, &stateCount) < 0)
+			break;
+
+		dispatch_apply(stateCount, DISPATCH_APPLY_AUTO, ^(size_t t) {
+			struct purge_task_state *state = &states[t];
+			task_vm_info_data_t vm_info;
+			mach_msg_type_number_t count = TASK_VM_INFO_COUNT;
+			uint64_t vol, nonvol;
+
+			if (KERN_SUCCESS != task_info(state->task, TASK_VM_INFO, (task_info_t)&vm_info, &count)) {
+				state->has_prev = 0;
+				state->volatile_delta = state->nonvolatile_delta = 0;
+				return;
+			}
+			if (count >= TASK_VM_INFO_REV3_COUNT) {
+				vol = vm_info.ledger_purgeable_volatile + vm_info.ledger_purgeable_volatile_compressed;
+				nonvol = vm_info.ledger_purgeable_nonvolatile + vm_info.ledger_purgeable_novolatile_compressed;
+			} else {
+				vol = vm_info.purgeable_volatile_virtual;
+				nonvol = 0;
+			}
+			state->volatile_delta = state->has_prev ? (int64_t)(vol - state->volatile_bytes) : 0;
+			state->nonvolatile_delta = state->has_prev ? (int64_t)(nonvol - state->nonvolatile_bytes) : 0;
+			state->volatile_bytes = vol;
+			state->nonvolatile_bytes = nonvol;
+			state->has_prev = 1;
+		});
+
+		if (first) {
+			printf("Recorded purgeable baseline for %u tasks\n", stateCount);
+			first = 0;
+		} else {
+			ranked = calloc(stateCount ? stateCount : 1, sizeof(*ranked));
+			if (ranked == NULL) {
+				perror("calloc");
+				break;
+			}
+			for (i = 0; i < stateCount; i++)
+				ranked[i] = &states[i];
+			qsort(ranked, stateCount, sizeof(*ranked), purge_task_delta_compare);
+
+			printf("%20s %6s %9s %10s %9s %10s\n", "Process-Name", "PID",
+				"VOLATILE", "VOL-DELTA", "NONVOL", "NV-DELTA");
+			for (i = 0, shown = 0; i < stateCount && shown < top_count; i++) {
+				if (ranked[i]->volatile_delta <= 0)
+					break;
+				print_purge_info_name(ranked[i]->pid);
+				printf("%6d %8d%c %+9d%c %8d%c %+9d%c\n", ranked[i]->pid,
+					purge_info_size_adjust(ranked[i]->volatile_bytes), purge_info_unit(ranked[i]->volatile_bytes),
+					purge_info_signed_adjust(ranked[i]->volatile_delta), purge_info_signed_unit(ranked[i]->volatile_delta),
+					purge_info_size_adjust(ranked[i]->nonvolatile_bytes), purge_info_unit(ranked[i]->nonvolatile_bytes),
+					purge_info_signed_adjust(ranked[i]->nonvolatile_delta), purge_info_signed_unit(ranked[i]->nonvolatile_delta));
+				shown++;
+			}
+			if (shown == 0)
+				printf("%20s\n", "(no growth)");
+			printf("\n");
+			free(ranked);
+		}
+		fflush(stdout);
+		sleep(sleep_duration);
+	}
+
+	for (i = 0; i < stateCount; i++)
+		mach_port_deallocate(mach_task_self(), states[i].task);
+	free(states);
+}
+
 int main(int argc, char *argv[])
 {
 
 	char ch;
 	int pid;
-	int sleep_duration;
+	int sleep_duration = -1;
+	int top_count = 0;
 	task_array_t tasks;
 	task_t task;
 	mach_msg_type_number_t taskCount;
-	int noargs = 1;
+	char mode = 0;
 
 	while(1) {
-		ch = getopt(argc, argv, "ahp:s:");
+		ch = getopt(argc, argv, "ag:hp:s:t:");
 		if (ch == -1)
 			break;
-		noargs = 0;
 		switch(ch) {
 			case 'a':
-				if (get_system_tasks(&tasks, &taskCount) < 0)
-					break;
-				print_header(0);
-				print_purge_info_task_array(tasks, taskCount);
+				if (mode == 0)
+					mode = ch;
 				break;
-
 			case 'p':
+				if (mode != 0)
+					break;
 				pid = (int)strtol(optarg, NULL, 10);
 				if (pid < 0)
-					break;
-				if (get_task_from_pid(pid, &task) < 0)
-					break;
-				print_header(0);
-				print_purge_info_task(task, pid);
+					return 0;
+				mode = ch;
 				break;
 			case 's':
 				sleep_duration = (int)strtol(optarg, NULL, 10);
 				if (sleep_duration < 0)
-					break;
-				print_header(1);
-				print_purge_info_summary(sleep_duration);
+					return 0;
+				if (mode == 0)
+					mode = ch;
+				break;
+			case 't':
+				top_count = (int)strtol(optarg, NULL, 10);
+				if (top_count <= 0) {
+					printf("%s", USAGE);
+					return 0;
+				}
+				/* -t takes precedence over the summary, and -s becomes its interval */
+				if (mode == 0 || mode == 's')
+					mode = ch;
+				break;
+			case 'g':
+				top_count = (int)strtol(optarg, NULL, 10);
+				if (top_count <= 0) {
+					printf("%s", USAGE);
+					return 0;
+				}
+				if (mode == 0 || mode == 's')
+					mode = ch;
 				break;
 			case '?':
 			case 'h':
 			default:
 				printf("%s", USAGE);
+				return 0;
 		}
-		break;
 	}
-	if (noargs)
-		printf("%s", USAGE);
+
+	switch (mode) {
+		case 'a':
+			if (get_system_tasks(&tasks, &taskCount) < 0)
+				break;
+			print_header(0);
+			print_purge_info_task_array(tasks, taskCount);
+			break;
+		case 'p':
+			if (get_task_from_pid(pid, &task) < 0)
+				break;
+			print_header(0);
+			print_purge_info_task(task, pid);
+			break;
+		case 's':
+			print_header(1);
+			print_purge_info_summary(sleep_duration);
+			break;
+		case 't':
+			print_purge_info_top(top_count, sleep_duration);
+			break;
+		case 'g':
+			/* growth needs at least two samples */
+			print_purge_info_growers(top_count, sleep_duration > 0 ? sleep_duration : 1);
+			break;
+		default:
+			printf("%s", USAGE);
+	}
 	return 0;
 }
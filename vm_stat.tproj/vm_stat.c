@@ -46,8 +46,19 @@
 #include <err.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <math.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <libproc.h>
 
 #include <mach/mach.h>
 #include <mach/vm_page_size.h>
@@ -55,28 +66,93 @@
 vm_statistics64_data_t	vm_stat, last;
 char	*pgmname;
 mach_port_t myHost;
+uint64_t page_size;	/* of the statistics being printed */
+
+/* -o: machine readable samples instead of the table */
+enum { OUTPUT_TEXT, OUTPUT_JSON, OUTPUT_CSV } output_format = OUTPUT_TEXT;
+
+/*
+ * -t: per-process attribution. The table is kept sorted by pid and merged
+ * with the sorted pid list on every sample, so a task port and name are
+ * only looked up once per process and dropped when it exits.
+ */
+struct proc_entry {
+	pid_t		pid;
+	mach_port_t	task;		/* MACH_PORT_NULL if task_read_for_pid() was refused */
+	char		name[2 * MAXCOMLEN + 1];
+	uint64_t	footprint;	/* phys_footprint, bytes */
+	uint64_t	compressed;	/* bytes in the compressor, UINT64_MAX if unknown */
+	uint64_t	last_compressed;
+	int		sampled;	/* the previous values are from the last sample */
+};
+
+struct proc_entry *procs;
+int nprocs;
+int top_n = 0;
+
+/*
+ * -w: ring file recorder. The file is a ring_header followed by nslots
+ * fixed-size records. Page counts are stored as they are; event counters
+ * are stored as 32-bit deltas from the previous record, and base holds the
+ * absolute counters just before the oldest record still in the ring, so
+ * any record can be rebuilt by summing forward from base.
+ */
+#define RING_MAGIC		0x766d7374	/* "vmst" */
+#define RING_VERSION		1
+#define RING_DEFAULT_SLOTS	86400
+#define RING_GAUGES		11
+#define RING_COUNTERS		11
+
+struct ring_header {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	record_size;
+	uint32_t	nslots;
+	uint64_t	page_size;
+	uint64_t	written;	/* records ever written; the next goes to written % nslots */
+	uint64_t	base[RING_COUNTERS];
+};
+
+struct ring_record {
+	uint64_t	time_ns;	/* wall clock */
+	uint32_t	gauges[RING_GAUGES];
+	uint32_t	deltas[RING_COUNTERS];
+};
+
+uint32_t ring_slots = RING_DEFAULT_SLOTS;
 
 void usage(void);
 void snapshot(void);
 void sspstat(char *str, uint64_t n);
 void banner(void);
 void print_stats(void);
+void print_banner(void);
+void print_line(void);
 void get_stats(vm_statistics64_t stat);
 
 void pstat(uint64_t n, int width);
+void print_record(double t, double elapsed);
+double wall_seconds(void);
+void record_ring(const char *path, double delay, int count);
+void read_ring(const char *path, const char *window);
+double monotonic_seconds(void);
+void sleep_until(double deadline);
+void update_procs(void);
+void print_top(double elapsed);
 
 int
 main(int argc, char *argv[])
 {
 	double delay = 0.0;
 	int count = 0;
+	const char *record_path = NULL, *read_path = NULL, *window = NULL;
 
 	pgmname = argv[0];
 
 	setlinebuf (stdout);
 
 	int c;
-	while ((c = getopt (argc, argv, "c:")) != -1) {
+	while ((c = getopt (argc, argv, "c:n:o:r:t:w:T:")) != -1) {
 		switch (c) {
 			case 'c':
 				count = (int)strtol(optarg, NULL, 10);
@@ -85,6 +161,41 @@ main(int argc, char *argv[])
 					usage();
 				}
 				break;
+			case 'w':
+				record_path = optarg;
+				break;
+			case 'r':
+				read_path = optarg;
+				break;
+			case 'T':
+				window = optarg;
+				break;
+			case 'n': {
+				long slots = strtol(optarg, NULL, 10);
+				if (slots < 2 || slots > UINT32_MAX) {
+					warnx("ring size must be at least 2 samples");
+					usage();
+				}
+				ring_slots = (uint32_t)slots;
+				break;
+			}
+			case 't':
+				top_n = (int)strtol(optarg, NULL, 10);
+				if (top_n < 1) {
+					warnx("process count must be positive");
+					usage();
+				}
+				break;
+			case 'o':
+				if (strcmp(optarg, "json") == 0) {
+					output_format = OUTPUT_JSON;
+				} else if (strcmp(optarg, "csv") == 0) {
+					output_format = OUTPUT_CSV;
+				} else {
+					warnx("unknown output format: %s", optarg);
+					usage();
+				}
+				break;
 			default:
 				usage();
 				break;
@@ -102,13 +213,57 @@ main(int argc, char *argv[])
 	}
 
 	myHost = mach_host_self();
+	page_size = (uint64_t)vm_kernel_page_size;
 
-	if (delay == 0.0) {
+	if (read_path != NULL) {
+		if (record_path != NULL || top_n != 0 || argc != 0)
+			usage();
+		read_ring(read_path, window);
+	} else if (record_path != NULL) {
+		if (delay == 0.0 || top_n != 0) {
+			warnx("recording needs an interval");
+			usage();
+		}
+		record_ring(record_path, delay, count);
+	} else if (top_n != 0) {
+		double start = monotonic_seconds(), then = start, now;
+
+		get_stats(&vm_stat);
+		update_procs();
+		print_top(0.0);
+		last = vm_stat;
+		for (int i = 1; delay != 0.0 && (i < count || count == 0); i++) {
+			sleep_until(start + i * delay);
+			get_stats(&vm_stat);
+			update_procs();
+			now = monotonic_seconds();
+			print_top(now - then);
+			last = vm_stat;
+			then = now;
+		}
+	} else if (output_format != OUTPUT_TEXT) {
+		double start = monotonic_seconds(), then = start, now;
+
+		get_stats(&vm_stat);
+		print_record(wall_seconds(), 0.0);
+		last = vm_stat;
+		/* sleep to absolute deadlines so sub-second intervals don't drift */
+		for (int i = 1; delay != 0.0 && (i < count || count == 0); i++) {
+			sleep_until(start + i * delay);
+			get_stats(&vm_stat);
+			now = monotonic_seconds();
+			print_record(wall_seconds(), now - then);
+			last = vm_stat;
+			then = now;
+		}
+	} else if (delay == 0.0) {
 		snapshot();
 	} else {
+		double start = monotonic_seconds();
+
 		print_stats();
 		for (int i = 1; i < count || count == 0; i++ ){
-			usleep((int)(delay * USEC_PER_SEC));
+			sleep_until(start + i * delay);
 			print_stats();
 		}
 	}
@@ -118,7 +273,9 @@ main(int argc, char *argv[])
 void
 usage(void)
 {
-	fprintf(stderr, "usage: %s [[-c count] interval]\n", pgmname);
+	fprintf(stderr, "usage: %s [-o json|csv] [-t processes] [[-c count] interval]\n", pgmname);
+	fprintf(stderr, "       %s -w file [-n samples] [-c count] interval\n", pgmname);
+	fprintf(stderr, "       %s -r file [-o json|csv] [-T from[,to]]\n", pgmname);
 	exit(EXIT_FAILURE);
 }
 
@@ -162,8 +319,15 @@ void
 banner(void)
 {
 	get_stats(&vm_stat);
+	print_banner();
+	bzero(&last, sizeof(last));
+}
+
+void
+print_banner(void)
+{
 	printf("Mach Virtual Memory Statistics: ");
-	printf("(page size of %llu bytes)\n", (mach_vm_size_t)vm_kernel_page_size);
+	printf("(page size of %llu bytes)\n", page_size);
 	printf("%8s %8s %8s %8s %8s %8s %8s %8s %8s %8s %8s %8s %11s %9s %8s %8s %8s %8s %8s %8s %8s %8s\n",
 	       "free",
 	       "active",
@@ -187,7 +351,6 @@ banner(void)
 	       "pageout",
 	       "swapins",
 	       "swapouts");
-	bzero(&last, sizeof(last));
 }
 
 void
@@ -202,6 +365,14 @@ print_stats(void)
 		count = 0;
 
 	get_stats(&vm_stat);
+	print_line();
+	last = vm_stat;
+}
+
+/* one table row: page counts from vm_stat, events since last */
+void
+print_line(void)
+{
 	pstat((uint64_t) (vm_stat.free_count - vm_stat.speculative_count), 8);
 	pstat((uint64_t) (vm_stat.active_count), 8);
 	pstat((uint64_t) (vm_stat.speculative_count), 8);
@@ -225,7 +396,6 @@ print_stats(void)
 	pstat((uint64_t) (vm_stat.swapins - last.swapins), 8);
 	pstat((uint64_t) (vm_stat.swapouts - last.swapouts), 8);
 	putchar('\n');
-	last = vm_stat;
 }
 
 void
@@ -265,3 +435,581 @@ get_stats(vm_statistics64_t stat)
 		exit(EXIT_FAILURE);
 	}
 }
+
+double
+wall_seconds(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / (double)USEC_PER_SEC;
+}
+
+double
+monotonic_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / (double)NSEC_PER_SEC;
+}
+
+void
+sleep_until(double deadline)
+{
+	double remaining;
+	struct timespec ts;
+
+	while ((remaining = deadline - monotonic_seconds()) > 0.0) {
+		ts.tv_sec = (time_t)remaining;
+		ts.tv_nsec = (long)((remaining - ts.tv_sec) * NSEC_PER_SEC);
+		nanosleep(&ts, NULL);
+	}
+}
+
+/*
+ * One sample of the machine readable output. Page counts and counters are
+ * the system-wide values; when elapsed is non-zero the counters are also
+ * reported as per-second rates since the previous sample (in last).
+ */
+static int record_fields;
+static int csv_header;
+
+static void
+field_name(const char *name)
+{
+	if (output_format == OUTPUT_JSON) {
+		printf("%s\"%s\":", record_fields++ ? "," : "", name);
+	} else if (csv_header) {
+		printf("%s%s", record_fields++ ? "," : "", name);
+	} else {
+		printf("%s", record_fields++ ? "," : "");
+	}
+}
+
+static void
+field_u64(const char *name, uint64_t n)
+{
+	field_name(name);
+	if (!csv_header)
+		printf("%llu", n);
+}
+
+static void
+field_double(const char *name, double d, int valid)
+{
+	field_name(name);
+	if (csv_header)
+		return;
+	if (valid)
+		printf("%.3f", d);
+	else if (output_format == OUTPUT_JSON)
+		printf("null");
+}
+
+static void
+field_rate(const char *name, uint64_t now, uint64_t then, double elapsed)
+{
+	field_double(name, elapsed > 0.0 ? (now - then) / elapsed : 0.0, elapsed > 0.0);
+}
+
+static void
+record_fields_print(double t, double elapsed)
+{
+	field_double("time", t, 1);
+	field_u64("page_size", page_size);
+	field_u64("free", (uint64_t) (vm_stat.free_count - vm_stat.speculative_count));
+	field_u64("active", (uint64_t) (vm_stat.active_count));
+	field_u64("inactive", (uint64_t) (vm_stat.inactive_count));
+	field_u64("speculative", (uint64_t) (vm_stat.speculative_count));
+	field_u64("throttled", (uint64_t) (vm_stat.throttled_count));
+	field_u64("wired", (uint64_t) (vm_stat.wire_count));
+	field_u64("purgeable", (uint64_t) (vm_stat.purgeable_count));
+	field_u64("faults", (uint64_t) (vm_stat.faults));
+	field_u64("cow_faults", (uint64_t) (vm_stat.cow_faults));
+	field_u64("zero_fill", (uint64_t) (vm_stat.zero_fill_count));
+	field_u64("reactivations", (uint64_t) (vm_stat.reactivations));
+	field_u64("purges", (uint64_t) (vm_stat.purges));
+	field_u64("file_backed", (uint64_t) (vm_stat.external_page_count));
+	field_u64("anonymous", (uint64_t) (vm_stat.internal_page_count));
+	field_u64("compressed", (uint64_t) (vm_stat.total_uncompressed_pages_in_compressor));
+	field_u64("compressor", (uint64_t) (vm_stat.compressor_page_count));
+	field_u64("decompressions", (uint64_t) (vm_stat.decompressions));
+	field_u64("compressions", (uint64_t) (vm_stat.compressions));
+	field_u64("pageins", (uint64_t) (vm_stat.pageins));
+	field_u64("pageouts", (uint64_t) (vm_stat.pageouts));
+	field_u64("swapins", (uint64_t) (vm_stat.swapins));
+	field_u64("swapouts", (uint64_t) (vm_stat.swapouts));
+
+	field_double("elapsed", elapsed, elapsed > 0.0);
+	field_rate("faults_per_sec", vm_stat.faults, last.faults, elapsed);
+	field_rate("pageins_per_sec", vm_stat.pageins, last.pageins, elapsed);
+	field_rate("pageouts_per_sec", vm_stat.pageouts, last.pageouts, elapsed);
+	field_rate("compressions_per_sec", vm_stat.compressions, last.compressions, elapsed);
+	field_rate("decompressions_per_sec", vm_stat.decompressions, last.decompressions, elapsed);
+	field_rate("swapins_per_sec", vm_stat.swapins, last.swapins, elapsed);
+	field_rate("swapouts_per_sec", vm_stat.swapouts, last.swapouts, elapsed);
+	/* uncompressed pages held per page of compressor memory */
+	field_double("compressor_ratio",
+	    vm_stat.compressor_page_count ?
+	    (double)vm_stat.total_uncompressed_pages_in_compressor / vm_stat.compressor_page_count : 0.0,
+	    vm_stat.compressor_page_count != 0);
+}
+
+void
+print_record(double t, double elapsed)
+{
+	static int header_done = 0;
+
+	if (output_format == OUTPUT_CSV && !header_done) {
+		csv_header = 1;
+		record_fields = 0;
+		record_fields_print(t, elapsed);
+		putchar('\n');
+		csv_header = 0;
+		header_done = 1;
+	}
+
+	record_fields = 0;
+	if (output_format == OUTPUT_JSON)
+		putchar('{');
+	record_fields_print(t, elapsed);
+	if (output_format == OUTPUT_JSON)
+		putchar('}');
+	putchar('\n');
+}
+
+static int
+pid_compare(const void *a, const void *b)
+{
+	return *(const pid_t *)a - *(const pid_t *)b;
+}
+
+static void
+sample_proc(struct proc_entry *p)
+{
+	task_vm_info_data_t vmi;
+	mach_msg_type_number_t count = TASK_VM_INFO_COUNT;
+	struct rusage_info_v2 ri;
+
+	p->last_compressed = p->compressed;
+	p->compressed = UINT64_MAX;
+	if (p->task != MACH_PORT_NULL &&
+	    task_info(p->task, TASK_VM_INFO, (task_info_t)&vmi, &count) == KERN_SUCCESS &&
+	    count >= TASK_VM_INFO_REV1_COUNT) {
+		p->footprint = vmi.phys_footprint;
+		p->compressed = vmi.compressed;
+	} else if (proc_pid_rusage(p->pid, RUSAGE_INFO_V2, (rusage_info_t *)&ri) == 0) {
+		p->footprint = ri.ri_phys_footprint;
+	} else {
+		p->footprint = 0;
+	}
+}
+
+void
+update_procs(void)
+{
+	static pid_t *pids;
+	static int maxpids;
+	struct proc_entry *merged;
+	int npids, i = 0, j = 0, n = 0;
+
+	for (;;) {
+		npids = proc_listallpids(pids, maxpids * (int)sizeof(pid_t));
+		if (npids < 0) {
+			err(EXIT_FAILURE, "proc_listallpids");
+		}
+		if (npids < maxpids)
+			break;
+		maxpids = maxpids ? maxpids * 2 : 1024;
+		if ((pids = realloc(pids, maxpids * sizeof(pid_t))) == NULL)
+			err(EXIT_FAILURE, "realloc");
+	}
+	qsort(pids, npids, sizeof(pid_t), pid_compare);
+
+	if ((merged = calloc(npids ? npids : 1, sizeof(struct proc_entry))) == NULL)
+		err(EXIT_FAILURE, "calloc");
+	while (j < npids) {
+		if (i < nprocs && procs[i].pid < pids[j]) {
+			/* exited */
+			if (procs[i].task != MACH_PORT_NULL)
+				mach_port_deallocate(mach_task_self(), procs[i].task);
+			i++;
+		} else if (i < nprocs && procs[i].pid == pids[j]) {
+			merged[n++] = procs[i++];
+			j++;
+		} else {
+			struct proc_entry *p = &merged[n++];
+
+			p->pid = pids[j++];
+			if (task_read_for_pid(mach_task_self(), p->pid, &p->task) != KERN_SUCCESS)
+				p->task = MACH_PORT_NULL;
+			if (proc_name(p->pid, p->name, sizeof(p->name)) <= 0)
+				strlcpy(p->name, "-", sizeof(p->name));
+			p->compressed = UINT64_MAX;
+		}
+	}
+	for (; i < nprocs; i++) {
+		if (procs[i].task != MACH_PORT_NULL)
+			mach_port_deallocate(mach_task_self(), procs[i].task);
+	}
+	free(procs);
+	procs = merged;
+	nprocs = n;
+
+	for (i = 0; i < nprocs; i++) {
+		sample_proc(&procs[i]);
+		if (procs[i].sampled < 2)
+			procs[i].sampled++;
+	}
+}
+
+/* rank by compressed bytes where known, then by footprint */
+static int
+top_compare(const void *a, const void *b)
+{
+	const struct proc_entry *pa = *(struct proc_entry * const *)a;
+	const struct proc_entry *pb = *(struct proc_entry * const *)b;
+	uint64_t ca = pa->compressed == UINT64_MAX ? 0 : pa->compressed;
+	uint64_t cb = pb->compressed == UINT64_MAX ? 0 : pb->compressed;
+
+	if (ca != cb)
+		return ca < cb ? 1 : -1;
+	if (pa->footprint != pb->footprint)
+		return pa->footprint < pb->footprint ? 1 : -1;
+	return pa->pid - pb->pid;
+}
+
+static int64_t
+compressed_delta(const struct proc_entry *p)
+{
+	if (p->sampled < 2 || p->compressed == UINT64_MAX || p->last_compressed == UINT64_MAX)
+		return 0;
+	return (int64_t)(p->compressed - p->last_compressed);
+}
+
+void
+print_top(double elapsed)
+{
+	static struct proc_entry **top;
+	static int ntop;
+	struct timeval tv;
+	double t, ratio, rate;
+	int i, n;
+
+	if (ntop < nprocs) {
+		ntop = nprocs;
+		if ((top = realloc(top, ntop * sizeof(*top))) == NULL)
+			err(EXIT_FAILURE, "realloc");
+	}
+	for (i = 0; i < nprocs; i++)
+		top[i] = &procs[i];
+	qsort(top, nprocs, sizeof(*top), top_compare);
+	n = nprocs < top_n ? nprocs : top_n;
+
+	gettimeofday(&tv, NULL);
+	t = tv.tv_sec + tv.tv_usec / (double)USEC_PER_SEC;
+	ratio = vm_stat.compressor_page_count ?
+	    (double)vm_stat.total_uncompressed_pages_in_compressor / vm_stat.compressor_page_count : 0.0;
+	rate = elapsed > 0.0 ? (vm_stat.compressions - last.compressions) / elapsed : 0.0;
+
+	switch (output_format) {
+	case OUTPUT_TEXT:
+		printf("Compressor: %llu pages stored in %llu pages (ratio %.2f), %.0f compressions/s\n",
+		    (uint64_t)vm_stat.total_uncompressed_pages_in_compressor,
+		    (uint64_t)vm_stat.compressor_page_count, ratio, rate);
+		printf("%6s %-32s %12s %12s %12s\n", "pid", "command", "footprint", "compressed", "delta");
+		for (i = 0; i < n; i++) {
+			printf("%6d %-32.32s ", top[i]->pid, top[i]->name);
+			pstat(top[i]->footprint, 12);
+			if (top[i]->compressed == UINT64_MAX)
+				printf("%12s ", "-");
+			else
+				pstat(top[i]->compressed, 12);
+			printf("%+12lld\n", compressed_delta(top[i]));
+		}
+		putchar('\n');
+		break;
+	case OUTPUT_CSV:
+		if (elapsed == 0.0)
+			printf("time,pid,command,footprint,compressed,compressed_delta\n");
+		for (i = 0; i < n; i++) {
+			printf("%.3f,%d,\"%s\",%llu,", t, top[i]->pid, top[i]->name, top[i]->footprint);
+			if (top[i]->compressed != UINT64_MAX)
+				printf("%llu", top[i]->compressed);
+			printf(",%lld\n", compressed_delta(top[i]));
+		}
+		break;
+	case OUTPUT_JSON:
+		printf("{\"time\":%.3f,\"compressor_ratio\":%.3f,\"compressions_per_sec\":%.3f,\"processes\":[",
+		    t, ratio, rate);
+		for (i = 0; i < n; i++) {
+			printf("%s{\"pid\":%d,\"command\":\"", i ? "," : "", top[i]->pid);
+			for (const char *c = top[i]->name; *c; c++) {
+				if (*c == '"' || *c == '\\')
+					putchar('\\');
+				if ((unsigned char)*c >= 0x20)
+					putchar(*c);
+			}
+			printf("\",\"footprint\":%llu,\"compressed\":", top[i]->footprint);
+			if (top[i]->compressed == UINT64_MAX)
+				printf("null");
+			else
+				printf("%llu", top[i]->compressed);
+			printf(",\"compressed_delta\":%lld}", compressed_delta(top[i]));
+		}
+		printf("]}\n");
+		break;
+	}
+}
+
+static void
+ring_counters(const vm_statistics64_data_t *stat, uint64_t counters[RING_COUNTERS])
+{
+	counters[0] = stat->faults;
+	counters[1] = stat->cow_faults;
+	counters[2] = stat->zero_fill_count;
+	counters[3] = stat->reactivations;
+	counters[4] = stat->purges;
+	counters[5] = stat->decompressions;
+	counters[6] = stat->compressions;
+	counters[7] = stat->pageins;
+	counters[8] = stat->pageouts;
+	counters[9] = stat->swapins;
+	counters[10] = stat->swapouts;
+}
+
+static void
+ring_pack(const vm_statistics64_data_t *stat, const uint64_t prev[RING_COUNTERS], struct ring_record *rec)
+{
+	uint64_t counters[RING_COUNTERS], delta;
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	rec->time_ns = (uint64_t)tv.tv_sec * NSEC_PER_SEC + (uint64_t)tv.tv_usec * 1000;
+	rec->gauges[0] = stat->free_count;
+	rec->gauges[1] = stat->active_count;
+	rec->gauges[2] = stat->inactive_count;
+	rec->gauges[3] = stat->speculative_count;
+	rec->gauges[4] = stat->throttled_count;
+	rec->gauges[5] = stat->wire_count;
+	rec->gauges[6] = stat->purgeable_count;
+	rec->gauges[7] = stat->external_page_count;
+	rec->gauges[8] = stat->internal_page_count;
+	rec->gauges[9] = (uint32_t)MIN(stat->total_uncompressed_pages_in_compressor, UINT32_MAX);
+	rec->gauges[10] = stat->compressor_page_count;
+
+	ring_counters(stat, counters);
+	for (int i = 0; i < RING_COUNTERS; i++) {
+		/* a 32-bit delta per sample interval; saturate rather than wrap */
+		delta = counters[i] - prev[i];
+		rec->deltas[i] = (uint32_t)MIN(delta, UINT32_MAX);
+	}
+}
+
+static void
+ring_unpack(const struct ring_record *rec, const uint64_t counters[RING_COUNTERS], vm_statistics64_data_t *stat)
+{
+	bzero(stat, sizeof(*stat));
+	stat->free_count = rec->gauges[0];
+	stat->active_count = rec->gauges[1];
+	stat->inactive_count = rec->gauges[2];
+	stat->speculative_count = rec->gauges[3];
+	stat->throttled_count = rec->gauges[4];
+	stat->wire_count = rec->gauges[5];
+	stat->purgeable_count = rec->gauges[6];
+	stat->external_page_count = rec->gauges[7];
+	stat->internal_page_count = rec->gauges[8];
+	stat->total_uncompressed_pages_in_compressor = rec->gauges[9];
+	stat->compressor_page_count = rec->gauges[10];
+
+	stat->faults = counters[0];
+	stat->cow_faults = counters[1];
+	stat->zero_fill_count = counters[2];
+	stat->reactivations = counters[3];
+	stat->purges = counters[4];
+	stat->decompressions = counters[5];
+	stat->compressions = counters[6];
+	stat->pageins = counters[7];
+	stat->pageouts = counters[8];
+	stat->swapins = counters[9];
+	stat->swapouts = counters[10];
+}
+
+static struct ring_header *
+ring_map(const char *path, int writable, size_t *lenp)
+{
+	struct ring_header *hdr;
+	struct stat st;
+	size_t len;
+	int fd;
+
+	fd = open(path, writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+	if (fd < 0)
+		err(EXIT_FAILURE, "%s", path);
+	if (fstat(fd, &st) < 0)
+		err(EXIT_FAILURE, "%s", path);
+
+	if (writable) {
+		len = sizeof(struct ring_header) + (size_t)ring_slots * sizeof(struct ring_record);
+		if ((size_t)st.st_size != len && ftruncate(fd, (off_t)len) < 0)
+			err(EXIT_FAILURE, "%s", path);
+	} else {
+		len = (size_t)st.st_size;
+		if (len < sizeof(struct ring_header))
+			errx(EXIT_FAILURE, "%s: not a vm_stat recording", path);
+	}
+
+	hdr = mmap(NULL, len, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED)
+		err(EXIT_FAILURE, "%s", path);
+	close(fd);
+
+	if (!writable && (hdr->magic != RING_MAGIC || hdr->version != RING_VERSION ||
+	    hdr->record_size != sizeof(struct ring_record) ||
+	    len < sizeof(struct ring_header) + (size_t)hdr->nslots * sizeof(struct ring_record)))
+		errx(EXIT_FAILURE, "%s: not a vm_stat recording", path);
+
+	*lenp = len;
+	return hdr;
+}
+
+/* absolute counters as of the newest record */
+static void
+ring_newest_counters(const struct ring_header *hdr, uint64_t counters[RING_COUNTERS])
+{
+	const struct ring_record *recs = (const struct ring_record *)(hdr + 1);
+	uint64_t n = MIN(hdr->written, hdr->nslots);
+
+	memcpy(counters, hdr->base, sizeof(hdr->base));
+	for (uint64_t i = hdr->written - n; i < hdr->written; i++) {
+		for (int c = 0; c < RING_COUNTERS; c++)
+			counters[c] += recs[i % hdr->nslots].deltas[c];
+	}
+}
+
+void
+record_ring(const char *path, double delay, int count)
+{
+	struct ring_header *hdr;
+	struct ring_record *recs, *rec;
+	uint64_t prev[RING_COUNTERS], now[RING_COUNTERS];
+	double start = monotonic_seconds();
+	size_t len;
+	int reset;
+
+	hdr = ring_map(path, 1, &len);
+	recs = (struct ring_record *)(hdr + 1);
+
+	get_stats(&vm_stat);
+	ring_counters(&vm_stat, now);
+
+	/* keep appending to a compatible ring, unless the counters went backwards (reboot) */
+	reset = hdr->magic != RING_MAGIC || hdr->version != RING_VERSION ||
+	    hdr->record_size != sizeof(struct ring_record) || hdr->nslots != ring_slots ||
+	    hdr->page_size != page_size;
+	if (!reset) {
+		ring_newest_counters(hdr, prev);
+		for (int c = 0; c < RING_COUNTERS; c++) {
+			if (now[c] < prev[c])
+				reset = 1;
+		}
+	}
+	if (reset) {
+		bzero(hdr, sizeof(*hdr));
+		hdr->magic = RING_MAGIC;
+		hdr->version = RING_VERSION;
+		hdr->record_size = sizeof(struct ring_record);
+		hdr->nslots = ring_slots;
+		hdr->page_size = page_size;
+		memcpy(hdr->base, now, sizeof(now));
+		memcpy(prev, now, sizeof(now));
+	}
+
+	for (int i = 0; i < count || count == 0; i++) {
+		if (i != 0) {
+			sleep_until(start + i * delay);
+			get_stats(&vm_stat);
+			ring_counters(&vm_stat, now);
+		}
+
+		rec = &recs[hdr->written % hdr->nslots];
+		if (hdr->written >= hdr->nslots) {
+			/* the oldest record is about to go; fold it into base */
+			for (int c = 0; c < RING_COUNTERS; c++)
+				hdr->base[c] += rec->deltas[c];
+		}
+		ring_pack(&vm_stat, prev, rec);
+		hdr->written++;
+		memcpy(prev, now, sizeof(now));
+	}
+
+	munmap(hdr, len);
+}
+
+/* parse one end of -T: seconds since the epoch, or negative for before the newest record */
+static double
+ring_window_time(const char *str, double newest)
+{
+	char *end;
+	double t = strtod(str, &end);
+
+	if (end == str || (*end != '\0' && *end != ','))
+		errx(EXIT_FAILURE, "bad time: %s", str);
+	return t < 0.0 ? newest + t : t;
+}
+
+void
+read_ring(const char *path, const char *window)
+{
+	struct ring_header *hdr;
+	const struct ring_record *recs, *rec;
+	uint64_t counters[RING_COUNTERS];
+	uint64_t n, first;
+	double newest, from = 0.0, to = INFINITY, t, prev_t = 0.0;
+	const char *comma;
+	size_t len;
+	int lines = 0;
+
+	hdr = ring_map(path, 0, &len);
+	recs = (const struct ring_record *)(hdr + 1);
+	n = MIN(hdr->written, hdr->nslots);
+	first = hdr->written - n;
+	if (n == 0)
+		return;
+	page_size = hdr->page_size;
+
+	newest = recs[(hdr->written - 1) % hdr->nslots].time_ns / (double)NSEC_PER_SEC;
+	if (window != NULL) {
+		from = ring_window_time(window, newest);
+		if ((comma = strchr(window, ',')) != NULL)
+			to = ring_window_time(comma + 1, newest);
+	}
+
+	memcpy(counters, hdr->base, sizeof(counters));
+	bzero(&last, sizeof(last));
+	for (uint64_t i = first; i < hdr->written; i++) {
+		rec = &recs[i % hdr->nslots];
+		for (int c = 0; c < RING_COUNTERS; c++)
+			counters[c] += rec->deltas[c];
+		ring_unpack(rec, counters, &vm_stat);
+		t = rec->time_ns / (double)NSEC_PER_SEC;
+
+		if (t >= from && t <= to) {
+			if (output_format != OUTPUT_TEXT) {
+				print_record(t, lines++ ? t - prev_t : 0.0);
+			} else {
+				/* like a live run: a banner every 20 rows, then totals */
+				if (lines++ % 21 == 0) {
+					print_banner();
+					bzero(&last, sizeof(last));
+				}
+				print_line();
+			}
+			prev_t = t;
+		}
+		last = vm_stat;
+	}
+
+	munmap(hdr, len);
+}
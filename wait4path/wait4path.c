@@ -22,43 +22,131 @@
  */
 
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <sys/event.h>
+#include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
+/* Filesystem events that can't make a path show up, so are not worth a stat */
+#define VQ_NOPATH	(VQ_NOTRESP | VQ_LOWDISK | VQ_QUOTA | VQ_VERYLOWDISK)
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-t timeout] <object on mount point> ...\n",
+			prog);
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * Stat each of the paths still missing, dropping the ones that now exist.
+ * Returns how many are left.
+ */
+static int
+check_paths(char **paths, int npaths)
+{
+	struct stat sb;
+	int i;
+
+	for (i = 0; i < npaths; ) {
+		if (stat(paths[i], &sb) == 0) {
+			paths[i] = paths[--npaths];
+		} else {
+			i++;
+		}
+	}
+	return npaths;
+}
+
 int
 main(int argc, char *argv[])
 {
 	int kq = kqueue();
-	struct kevent kev;
-	struct stat sb;
+	struct kevent kev[8];
+	struct timespec deadline, now, left, *timeout = NULL;
+	char **paths, *end;
+	long seconds = -1;
+	int ch, i, n, npaths;
 
-	if (argc != 2) {
-		fprintf(stderr, "usage: %s <object on mount point>\n", argv[0]);
-		exit(EXIT_FAILURE);
+	while ((ch = getopt(argc, argv, "t:")) != -1) {
+		switch (ch) {
+		case 't':
+			errno = 0;
+			seconds = strtol(optarg, &end, 10);
+			if (errno != 0 || *optarg == '\0' || *end != '\0' ||
+			    seconds < 0 || seconds > INT_MAX) {
+				fprintf(stderr, "invalid timeout: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	paths = argv + optind;
+	npaths = argc - optind;
+	if (npaths == 0) {
+		usage(argv[0]);
 	}
 
-	EV_SET(&kev, 0, EVFILT_FS, EV_ADD, 0, 0, 0);
+	EV_SET(&kev[0], 0, EVFILT_FS, EV_ADD, 0, 0, 0);
 
-	if (kevent(kq, &kev, 1, NULL, 0, NULL) == -1) {
+	if (kevent(kq, &kev[0], 1, NULL, 0, NULL) == -1) {
 		fprintf(stderr, "adding EVFILT_FS to kqueue failed: %s\n",
 				strerror(errno));
 		exit(EXIT_FAILURE);
 	}
 
-	if (stat(argv[1], &sb) == 0) {
+	if ((npaths = check_paths(paths, npaths)) == 0) {
 		exit(EXIT_SUCCESS);
 	}
 
+	if (seconds >= 0) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += seconds;
+		timeout = &left;
+	}
+
 	for (;;) {
-		kevent(kq, NULL, 0, &kev, 1, NULL);
-		if (stat(argv[1], &sb) == 0) {
-			break;
+		if (timeout != NULL) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			left.tv_sec = deadline.tv_sec - now.tv_sec;
+			left.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+			if (left.tv_nsec < 0) {
+				left.tv_sec--;
+				left.tv_nsec += 1000000000;
+			}
+			if (left.tv_sec < 0) {
+				break;
+			}
+		}
+		n = kevent(kq, NULL, 0, kev, sizeof(kev) / sizeof(kev[0]),
+				timeout);
+		if (n == -1 && errno != EINTR) {
+			fprintf(stderr, "kevent failed: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		/* Only recheck when one of the events might have added a path */
+		for (i = 0; i < n; i++) {
+			if (kev[i].fflags == 0 || (kev[i].fflags & ~VQ_NOPATH) != 0) {
+				break;
+			}
+		}
+		if (n == 0 || i < n) {
+			if ((npaths = check_paths(paths, npaths)) == 0) {
+				exit(EXIT_SUCCESS);
+			}
 		}
 	}
 
-	exit(EXIT_SUCCESS);
+	for (i = 0; i < npaths; i++) {
+		fprintf(stderr, "timed out waiting for %s\n", paths[i]);
+	}
+	exit(EXIT_FAILURE);
 }
@@ -13,10 +13,13 @@ __unused static const char rcsid[] =
 */
 
 #include <err.h>
+#include <errno.h>
+#include <fts.h>
 #include <stdio.h>	/* for stdout, stderr */
 #include <stdlib.h>	/* for exit, malloc, atoi */
 #include <string.h>	/* for strcpy */
 #include <sys/types.h>	/* for time_t */
+#include <sys/wait.h>	/* for waitpid */
 #include <time.h>	/* for struct tm */
 #include <unistd.h>
 #include <limits.h>
@@ -125,29 +128,52 @@ __unused static const char rcsid[] =
 #endif /* !defined __STDC__ */
 #endif /* !defined P */
 
+#ifndef TZDIR
+#define TZDIR	"/usr/share/zoneinfo"
+#endif /* !defined TZDIR */
+
+#ifndef TZIF_HEADER_SIZE
+#define TZIF_HEADER_SIZE	44
+#endif /* !defined TZIF_HEADER_SIZE */
+
+#ifndef MAX_JOBS
+#define MAX_JOBS	256
+#endif /* !defined MAX_JOBS */
+
 extern char **	environ;
 extern char *	tzname[2];
 
 static char *	abbr P((struct tm * tmp));
+static int	changed P((time_t lot, time_t hit));
+static void	compare P((char * name, char ** lines, long count));
 static long	delta P((struct tm * newp, struct tm * oldp));
+static long	detzcode P((const unsigned char * codep));
+static void	dumpzone P((char * name));
+static void	dumpzones P((char ** names, int count));
+static void	emit P((char * name, FILE * fp));
+static int	fileorder P((const FTSENT ** a, const FTSENT ** b));
+static int	findzones P((char * dir, char *** namesp));
+static char *	linetext P((char * line));
+static void	loadref P((const char * path));
+static void	missing P((void));
+static int	refcmp P((const void * leftp, const void * rightp));
 static time_t	hunt P((char * name, time_t lot, time_t	hit));
 static size_t	longest;
+static int	readtrans P((const char * name));
 static void	show P((char * zone, time_t t, int v));
 static void     usage(void);
-
-int
-main(int argc, char *argv[])
-{
-	int			i;
-	int			c;
-	int			vflag;
-	char *			cutoff;
-	int			cutyear;
-	long			cuttime;
-	char **			fakeenv;
-	time_t			now;
-	time_t			t;
-	time_t			newt;
+static void	walk P((char * name, time_t t));
+
+static int	vflag;
+static int	Tflag;
+static int	jobs = 1;
+static char *	cutoff;
+static long	cuttime;
+static char **	fakeenv;
+static time_t	now;
+static char *	zonedir;	/* -d: dump every TZif file under here */
+static char *	reference;	/* -r: report only differences from this */
+static long	discrepancies;
 #ifndef __APPLE__
 // <rdar://problem/6013740>
 // The approach of walking through every day from the minimum
@@ -156,10 +182,43 @@ main(int argc, char *argv[])
 // and causes gmtime(3) and localtime(3) to return EOVERFLOW
 // which this code does not anticipate).  Limiting the time_t
 // range to [INT_MIN:INT_MAX] even on LP64.
-	time_t			hibit;
+static time_t	hibit;
 #endif
-	struct tm		tm;
-	struct tm		newtm;
+
+/*
+** Transition times read from a zone's TZif file for -T.  steptail is set
+** when the file ends with a POSIX TZ string that has DST rules, since
+** localtime may find transitions past the last one in the file.
+*/
+static time_t *	trans;
+static long	ntrans;
+static int	steptail;
+
+/*
+** The output of an earlier run, read for -r and grouped by zone.  Lines
+** are kept without the zone name and its padding, so that runs over
+** different sets of zones still compare equal.
+*/
+struct refzone {
+	char *		rz_name;
+	char **		rz_lines;
+	long		rz_nlines;
+	int		rz_seen;
+};
+
+static struct refzone *	refzones;
+static long		nrefzones;
+
+int
+main(int argc, char *argv[])
+{
+	int			i;
+	int			c;
+	int			cutyear;
+	int			nzones;
+	char **			zones;
+	char *			ep;
+	long			l;
 
 	INITIALIZE(cuttime);
 #if HAVE_GETTEXT - 0
@@ -175,14 +234,51 @@ main(int argc, char *argv[])
 		}
 	vflag = 0;
 	cutoff = NULL;
-	while ((c = getopt(argc, argv, "c:v")) == 'c' || c == 'v')
-		if (c == 'v')
-			vflag = 1;
-		else	cutoff = optarg;
-	if ((c != -1) ||
-		(optind == argc - 1 && strcmp(argv[optind], "=") == 0)) {
+	while ((c = getopt(argc, argv, "Tc:d:j:r:v")) != -1)
+		switch (c) {
+			case 'T':
+				Tflag = 1;
+				break;
+			case 'c':
+				cutoff = optarg;
+				break;
+			case 'd':
+				zonedir = optarg;
+				break;
+			case 'j':
+				l = strtol(optarg, &ep, 10);
+				if (*ep != '\0' || l < 1 || l > MAX_JOBS)
+					errx(EXIT_FAILURE,
+					     _("invalid job count"));
+				jobs = (int) l;
+				break;
+			case 'r':
+				reference = optarg;
+				break;
+			case 'v':
+				vflag = 1;
+				break;
+			default:
+				usage();
+		}
+	if (optind == argc - 1 && strcmp(argv[optind], "=") == 0)
+		usage();
+	if (zonedir != NULL) {
+		if (optind != argc)
 			usage();
+		/*
+		** localtime takes relative TZ names from TZDIR.
+		*/
+		if ((ep = realpath(zonedir, NULL)) == NULL)
+			err(EXIT_FAILURE, "%s", zonedir);
+		zonedir = ep;
+		nzones = findzones(zonedir, &zones);
+	} else {
+		nzones = argc - optind;
+		zones = &argv[optind];
 	}
+	if (reference != NULL)
+		loadref(reference);
 	if (cutoff != NULL) {
 		int	y;
 
@@ -194,9 +290,9 @@ main(int argc, char *argv[])
 	}
 	(void) time(&now);
 	longest = 0;
-	for (i = optind; i < argc; ++i)
-		if (strlen(argv[i]) > longest)
-			longest = strlen(argv[i]);
+	for (i = 0; i < nzones; ++i)
+		if (strlen(zones[i]) > longest)
+			longest = strlen(zones[i]);
 #ifndef __APPLE__
 	for (hibit = 1; (hibit << 1) != 0; hibit <<= 1)
 		continue;
@@ -211,7 +307,8 @@ main(int argc, char *argv[])
 			sizeof *fakeenv));
 		if (fakeenv == NULL ||
 			(fakeenv[0] = (char *) malloc((size_t) (longest +
-				4))) == NULL)
+				4 + (zonedir == NULL ? 0 :
+				strlen(zonedir) + 1)))) == NULL)
 					errx(EXIT_FAILURE,
 					     _("malloc() failed"));
 		to = 0;
@@ -222,84 +319,558 @@ main(int argc, char *argv[])
 		fakeenv[to] = NULL;
 		environ = fakeenv;
 	}
-	for (i = optind; i < argc; ++i) {
-		static char	buf[MAX_STRING_LENGTH];
+	dumpzones(zones, nzones);
+	if (reference != NULL && zonedir != NULL)
+		missing();
+	if (fflush(stdout) || ferror(stdout))
+		errx(EXIT_FAILURE, _("error writing standard output"));
+	exit((discrepancies == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+
+	/* gcc -Wall pacifier */
+	for ( ; ; )
+		continue;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+_("usage: zdump [--version] [-Tv] [-c cutoff] [-j jobs] [-r reference]\n\
+             {-d directory | zonename ...}\n"));
+	exit(EXIT_FAILURE);
+}
+
+/*
+** Dump each zone, on up to jobs processes.  localtime keeps its state in
+** globals, so the workers are forked; each writes one zone's output to a
+** temporary file, which is copied out (or compared, for -r) in argument
+** order once that worker has finished, so the output doesn't depend on
+** the number of jobs.
+*/
+static void
+dumpzones(char **names, int count)
+{
+	pid_t		pids[MAX_JOBS];
+	FILE *		outs[MAX_JOBS];
+	int		status;
+	int		next;
+	int		done;
+	int		slot;
+
+	if (reference == NULL && (jobs <= 1 || count <= 1)) {
+		for (next = 0; next < count; ++next)
+			dumpzone(names[next]);
+		return;
+	}
+	for (next = done = 0; done < count; ++done) {
+		for ( ; next < count && next < done + jobs; ++next) {
+			slot = next % jobs;
+			if ((outs[slot] = tmpfile()) == NULL)
+				err(EXIT_FAILURE, _("can't create temporary file"));
+			(void) fflush(stdout);
+			(void) fflush(stderr);
+			pids[slot] = fork();
+			if (pids[slot] == -1)
+				err(EXIT_FAILURE, _("can't fork"));
+			if (pids[slot] == 0) {
+				if (dup2(fileno(outs[slot]), STDOUT_FILENO) == -1)
+					err(EXIT_FAILURE, _("can't redirect output"));
+				dumpzone(names[next]);
+				if (fflush(stdout) || ferror(stdout))
+					errx(EXIT_FAILURE,
+					     _("error writing standard output"));
+				_exit(EXIT_SUCCESS);
+			}
+		}
+		slot = done % jobs;
+		while (waitpid(pids[slot], &status, 0) == -1)
+			if (errno != EINTR)
+				err(EXIT_FAILURE, _("can't wait for worker"));
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			exit(EXIT_FAILURE);
+		rewind(outs[slot]);
+		emit(names[done], outs[slot]);
+		(void) fclose(outs[slot]);
+	}
+}
+
+/*
+** Pass on one zone's output from a worker, or with -r, just the lines
+** that differ from the reference.
+*/
+static void
+emit(char *name, FILE *fp)
+{
+	char		buf[BUFSIZ];
+	size_t		n;
+	char **		lines;
+	long		count;
+	long		size;
+	char *		line;
+	size_t		cap;
+
+	if (reference == NULL) {
+		while ((n = fread(buf, 1, sizeof buf, fp)) != 0)
+			if (fwrite(buf, 1, n, stdout) != n)
+				break;
+		return;
+	}
+	lines = NULL;
+	count = size = 0;
+	line = NULL;
+	cap = 0;
+	while (getline(&line, &cap, fp) > 0) {
+		if (count == size) {
+			size = (size == 0) ? 64 : 2 * size;
+			lines = (char **) realloc(lines,
+				(size_t) size * sizeof *lines);
+			if (lines == NULL)
+				errx(EXIT_FAILURE, _("malloc() failed"));
+		}
+		if ((lines[count++] = strdup(linetext(line))) == NULL)
+			errx(EXIT_FAILURE, _("malloc() failed"));
+	}
+	free(line);
+	compare(name, lines, count);
+	while (count > 0)
+		free(lines[--count]);
+	free(lines);
+}
+
+/*
+** Print the lines of one zone that aren't in the reference as "+ ",
+** and those of the reference that weren't produced as "- ".
+*/
+static void
+compare(char *name, char **lines, long count)
+{
+	struct refzone		key;
+	struct refzone *	rz;
+	long			i;
+	long			j;
+
+	key.rz_name = name;
+	rz = (struct refzone *) bsearch(&key, refzones, (size_t) nrefzones,
+		sizeof *refzones, refcmp);
+	if (rz != NULL) {
+		rz->rz_seen = TRUE;
+		if (rz->rz_nlines == count) {
+			for (i = 0; i < count; ++i)
+				if (strcmp(rz->rz_lines[i], lines[i]) != 0)
+					break;
+			if (i == count)
+				return;
+		}
+		for (i = 0; i < rz->rz_nlines; ++i) {
+			for (j = 0; j < count; ++j)
+				if (strcmp(rz->rz_lines[i], lines[j]) == 0)
+					break;
+			if (j == count)
+				(void) printf("- %-*s  %s", (int) longest,
+					name, rz->rz_lines[i]);
+		}
+	}
+	for (i = 0; i < count; ++i) {
+		for (j = 0; rz != NULL && j < rz->rz_nlines; ++j)
+			if (strcmp(rz->rz_lines[j], lines[i]) == 0)
+				break;
+		if (rz == NULL || j == rz->rz_nlines)
+			(void) printf("+ %-*s  %s", (int) longest, name,
+				lines[i]);
+	}
+	++discrepancies;
+}
+
+/*
+** Report the zones in the reference that the directory no longer has.
+*/
+static void
+missing(void)
+{
+	long	i;
+	long	j;
+
+	for (i = 0; i < nrefzones; ++i) {
+		if (refzones[i].rz_seen)
+			continue;
+		for (j = 0; j < refzones[i].rz_nlines; ++j)
+			(void) printf("- %-*s  %s", (int) longest,
+				refzones[i].rz_name, refzones[i].rz_lines[j]);
+		++discrepancies;
+	}
+}
+
+/*
+** Skip the zone name and padding that start each line of output.
+*/
+static char *
+linetext(char *line)
+{
+	line += strcspn(line, " \t\n");
+	return line + strspn(line, " \t");
+}
+
+static int
+refcmp(const void *leftp, const void *rightp)
+{
+	return strcmp(((const struct refzone *) leftp)->rz_name,
+		((const struct refzone *) rightp)->rz_name);
+}
+
+/*
+** Read an earlier run's output and group its lines by zone.
+*/
+static void
+loadref(const char *path)
+{
+	FILE *			fp;
+	char *			line;
+	size_t			cap;
+	size_t			len;
+	long			size;
+	long			lsize;
+	struct refzone *	rz;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		err(EXIT_FAILURE, "%s", path);
+	line = NULL;
+	cap = 0;
+	size = lsize = 0;
+	rz = NULL;
+	while (getline(&line, &cap, fp) > 0) {
+		len = strcspn(line, " \t\n");
+		if (len == 0)
+			continue;
+		if (rz == NULL || strlen(rz->rz_name) != len ||
+			strncmp(rz->rz_name, line, len) != 0) {
+				if (nrefzones == size) {
+					size = (size == 0) ? 512 : 2 * size;
+					refzones = (struct refzone *)
+						realloc(refzones, (size_t) size *
+						sizeof *refzones);
+					if (refzones == NULL)
+						errx(EXIT_FAILURE,
+						     _("malloc() failed"));
+				}
+				rz = &refzones[nrefzones++];
+				if ((rz->rz_name = strndup(line, len)) == NULL)
+					errx(EXIT_FAILURE,
+					     _("malloc() failed"));
+				rz->rz_lines = NULL;
+				rz->rz_nlines = 0;
+				rz->rz_seen = FALSE;
+				lsize = 0;
+		}
+		if (rz->rz_nlines == lsize) {
+			lsize = (lsize == 0) ? 64 : 2 * lsize;
+			rz->rz_lines = (char **) realloc(rz->rz_lines,
+				(size_t) lsize * sizeof *rz->rz_lines);
+			if (rz->rz_lines == NULL)
+				errx(EXIT_FAILURE, _("malloc() failed"));
+		}
+		if ((rz->rz_lines[rz->rz_nlines++] =
+			strdup(linetext(line))) == NULL)
+				errx(EXIT_FAILURE, _("malloc() failed"));
+	}
+	if (ferror(fp))
+		err(EXIT_FAILURE, "%s", path);
+	free(line);
+	(void) fclose(fp);
+	qsort(refzones, (size_t) nrefzones, sizeof *refzones, refcmp);
+}
 
-		(void) strcpy(&fakeenv[0][3], argv[i]);
-		if (!vflag) {
-			show(argv[i], now, FALSE);
+static int
+fileorder(const FTSENT **a, const FTSENT **b)
+{
+	return strcmp((*a)->fts_name, (*b)->fts_name);
+}
+
+/*
+** Collect the names, relative to dir, of the TZif files under dir.
+** Symbolic links are skipped, since they only repeat other zones.
+*/
+static int
+findzones(char *dir, char ***namesp)
+{
+	char *		paths[2];
+	FTS *		fts;
+	FTSENT *	fe;
+	FILE *		fp;
+	char		magic[4];
+	size_t		dirlen;
+	char **		names;
+	int		count;
+	int		size;
+
+	dirlen = strlen(dir);
+	while (dirlen > 1 && dir[dirlen - 1] == '/')
+		dir[--dirlen] = '\0';
+	paths[0] = dir;
+	paths[1] = NULL;
+	if ((fts = fts_open(paths, FTS_PHYSICAL | FTS_NOCHDIR,
+		fileorder)) == NULL)
+			err(EXIT_FAILURE, "%s", dir);
+	names = NULL;
+	count = size = 0;
+	while ((fe = fts_read(fts)) != NULL) {
+		if (fe->fts_info == FTS_ERR || fe->fts_info == FTS_DNR) {
+			warnx("%s: %s", fe->fts_path,
+				strerror(fe->fts_errno));
 			continue;
 		}
-		/*
-		** Get lowest value of t.
-		*/
+		if (fe->fts_info != FTS_F || fe->fts_level == 0)
+			continue;
+		if ((fp = fopen(fe->fts_accpath, "r")) == NULL)
+			continue;
+		if (fread(magic, 1, sizeof magic, fp) != sizeof magic ||
+			memcmp(magic, "TZif", sizeof magic) != 0) {
+				(void) fclose(fp);
+				continue;
+		}
+		(void) fclose(fp);
+		if (count == size) {
+			size = (size == 0) ? 512 : 2 * size;
+			names = (char **) realloc(names,
+				(size_t) size * sizeof *names);
+			if (names == NULL)
+				errx(EXIT_FAILURE, _("malloc() failed"));
+		}
+		if ((names[count++] = strdup(fe->fts_path + dirlen +
+			(dir[dirlen - 1] != '/'))) == NULL)
+				errx(EXIT_FAILURE, _("malloc() failed"));
+	}
+	(void) fts_close(fts);
+	*namesp = names;
+	return count;
+}
+
+static void
+dumpzone(char *name)
+{
+	time_t		t;
+	time_t		newt;
+	long		i;
+
+	if (zonedir != NULL)
+		(void) sprintf(&fakeenv[0][3], "%s/%s", zonedir, name);
+	else	(void) strcpy(&fakeenv[0][3], name);
+	if (!vflag) {
+		show(name, now, FALSE);
+		return;
+	}
+	/*
+	** Get lowest value of t.
+	*/
 #ifdef __APPLE__
-		t = INT_MIN;
+	t = INT_MIN;
 #else
-		t = hibit;
-		if (t > 0)		/* time_t is unsigned */
-			t = 0;
+	t = hibit;
+	if (t > 0)		/* time_t is unsigned */
+		t = 0;
 #endif
-		show(argv[i], t, TRUE);
-		t += SECSPERHOUR * HOURSPERDAY;
-		show(argv[i], t, TRUE);
-		tm = *localtime(&t);
-		(void) strncpy(buf, abbr(&tm), (sizeof buf) - 1);
-		for ( ; ; ) {
-			if (cutoff != NULL && t >= cuttime)
-				break;
-			newt = t + SECSPERHOUR * 12;
+	show(name, t, TRUE);
+	t += SECSPERHOUR * HOURSPERDAY;
+	show(name, t, TRUE);
+	if (!Tflag || readtrans(&fakeenv[0][3]) != 0)
+		walk(name, t);
+	else {
+		/*
+		** Check each transition in the file rather than hunting
+		** for them; ones that change nothing localtime reports
+		** are skipped just as the walk would skip them.
+		*/
+		for (i = 0; i < ntrans; ++i) {
+			newt = trans[i];
+			if (newt <= t)
+				continue;
 			if (cutoff != NULL && newt >= cuttime)
 				break;
 #ifdef __APPLE__
 			if (newt > INT_MAX)
 				break;
-#else
-			if (newt <= t)
-				break;
 #endif
-			newtm = *localtime(&newt);
-			if (delta(&newtm, &tm) != (newt - t) ||
-				newtm.tm_isdst != tm.tm_isdst ||
-				strcmp(abbr(&newtm), buf) != 0) {
-					newt = hunt(argv[i], t, newt);
-					newtm = *localtime(&newt);
-					(void) strncpy(buf, abbr(&newtm),
-						(sizeof buf) - 1);
+			if (changed(newt - 1, newt)) {
+				show(name, newt - 1, TRUE);
+				show(name, newt, TRUE);
 			}
 			t = newt;
-			tm = newtm;
 		}
-		/*
-		** Get highest value of t.
-		*/
+		if (steptail)
+			walk(name, t);
+	}
+	/*
+	** Get highest value of t.
+	*/
 #ifdef __APPLE__
-		t = INT_MAX;
+	t = INT_MAX;
 #else
-		t = ~((time_t) 0);
-		if (t < 0)		/* time_t is signed */
-			t &= ~hibit;
+	t = ~((time_t) 0);
+	if (t < 0)		/* time_t is signed */
+		t &= ~hibit;
 #endif
-		t -= SECSPERHOUR * HOURSPERDAY;
-		show(argv[i], t, TRUE);
-		t += SECSPERHOUR * HOURSPERDAY;
-		show(argv[i], t, TRUE);
+	t -= SECSPERHOUR * HOURSPERDAY;
+	show(name, t, TRUE);
+	t += SECSPERHOUR * HOURSPERDAY;
+	show(name, t, TRUE);
+}
+
+/*
+** Step forward from t half a day at a time, hunting down each
+** discontinuity found, until the cutoff or the end of time.
+*/
+static void
+walk(char *name, time_t t)
+{
+	time_t		newt;
+	struct tm	tm;
+	struct tm	newtm;
+	static char	buf[MAX_STRING_LENGTH];
+
+	tm = *localtime(&t);
+	(void) strncpy(buf, abbr(&tm), (sizeof buf) - 1);
+	for ( ; ; ) {
+		if (cutoff != NULL && t >= cuttime)
+			break;
+		newt = t + SECSPERHOUR * 12;
+		if (cutoff != NULL && newt >= cuttime)
+			break;
+#ifdef __APPLE__
+		if (newt > INT_MAX)
+			break;
+#else
+		if (newt <= t)
+			break;
+#endif
+		newtm = *localtime(&newt);
+		if (delta(&newtm, &tm) != (newt - t) ||
+			newtm.tm_isdst != tm.tm_isdst ||
+			strcmp(abbr(&newtm), buf) != 0) {
+				newt = hunt(name, t, newt);
+				newtm = *localtime(&newt);
+				(void) strncpy(buf, abbr(&newtm),
+					(sizeof buf) - 1);
+		}
+		t = newt;
+		tm = newtm;
 	}
-	if (fflush(stdout) || ferror(stdout))
-		errx(EXIT_FAILURE, _("error writing standard output"));
-	exit(EXIT_SUCCESS);
+}
 
-	/* gcc -Wall pacifier */
-	for ( ; ; )
-		continue;
+static long
+detzcode(const unsigned char *codep)
+{
+	long	result;
+	int	i;
+
+	result = (codep[0] & 0x80) ? ~0L : 0L;
+	for (i = 0; i < 4; ++i)
+		result = (result << 8) | (codep[i] & 0xff);
+	return result;
 }
 
-static void
-usage(void)
+/*
+** Load the transition times of a zone from its TZif file.  Returns -1
+** when the zone isn't a readable TZif file, or has leap seconds, which
+** only show up by hunting; the caller then walks the zone instead.
+*/
+static int
+readtrans(const char *name)
 {
-	fprintf(stderr,
-_("usage: zdump [--version] [-v] [-c cutoff] zonename ...\n"));
-	exit(EXIT_FAILURE);
+	char			path[PATH_MAX];
+	FILE *			fp;
+	unsigned char *		buf;
+	unsigned char *		p;
+	unsigned char *		end;
+	unsigned char *		nl;
+	long			size;
+	long			cnt[6];
+	long			len;
+	long			i;
+	int			n;
+
+	if (*name == ':')
+		++name;
+	if (*name == '/')
+		n = snprintf(path, sizeof path, "%s", name);
+	else	n = snprintf(path, sizeof path, "%s/%s", TZDIR, name);
+	if (n < 0 || (size_t) n >= sizeof path)
+		return -1;
+	if ((fp = fopen(path, "r")) == NULL)
+		return -1;
+	buf = NULL;
+	if (fseek(fp, 0L, SEEK_END) != 0 || (size = ftell(fp)) <
+		TZIF_HEADER_SIZE || fseek(fp, 0L, SEEK_SET) != 0 ||
+		(buf = (unsigned char *) malloc((size_t) size)) == NULL ||
+		fread(buf, 1, (size_t) size, fp) != (size_t) size ||
+		memcmp(buf, "TZif", 4) != 0)
+			goto bad;
+	end = buf + size;
+	/*
+	** ttisgmtcnt, ttisstdcnt, leapcnt, timecnt, typecnt, charcnt
+	*/
+	for (i = 0; i < 6; ++i)
+		if ((cnt[i] = detzcode(buf + 20 + 4 * i)) < 0)
+			goto bad;
+	if (cnt[2] != 0)
+		goto bad;
+	len = cnt[3] * 5 + cnt[4] * 6 + cnt[5] + cnt[2] * 8 + cnt[1] + cnt[0];
+	if (len > size - TZIF_HEADER_SIZE)
+		goto bad;
+	free(trans);
+	trans = (time_t *) malloc((size_t) (cnt[3] + 1) * sizeof *trans);
+	if (trans == NULL)
+		errx(EXIT_FAILURE, _("malloc() failed"));
+	ntrans = cnt[3];
+	for (i = 0; i < ntrans; ++i)
+		trans[i] = (time_t) detzcode(buf + TZIF_HEADER_SIZE + 4 * i);
+	/*
+	** Version 2 files follow the 32-bit data with 64-bit data and a
+	** POSIX TZ string; if that can't be found, walk past the last
+	** transition to be safe.
+	*/
+	steptail = FALSE;
+	if (buf[4] >= '2') {
+		steptail = TRUE;
+		p = buf + TZIF_HEADER_SIZE + len;
+		if (end - p >= TZIF_HEADER_SIZE && memcmp(p, "TZif", 4) == 0) {
+			for (i = 0; i < 6; ++i)
+				if ((cnt[i] = detzcode(p + 20 + 4 * i)) < 0)
+					goto bad;
+			len = cnt[3] * 9 + cnt[4] * 6 + cnt[5] + cnt[2] * 12 +
+				cnt[1] + cnt[0];
+			if (len < end - p - TZIF_HEADER_SIZE) {
+				p += TZIF_HEADER_SIZE + len;
+				if (*p == '\n' && (nl = memchr(p + 1, '\n',
+					end - p - 1)) != NULL)
+						steptail = memchr(p + 1, ',',
+							nl - p - 1) != NULL;
+			}
+		}
+	}
+	free(buf);
+	(void) fclose(fp);
+	return 0;
+bad:
+	free(buf);
+	(void) fclose(fp);
+	return -1;
+}
+
+/*
+** Whether localtime reports a discontinuity between lot and hit.
+*/
+static int
+changed(time_t lot, time_t hit)
+{
+	struct tm	lotm;
+	struct tm	tm;
+	static char	loab[MAX_STRING_LENGTH];
+
+	lotm = *localtime(&lot);
+	(void) strncpy(loab, abbr(&lotm), (sizeof loab) - 1);
+	tm = *localtime(&hit);
+	return delta(&tm, &lotm) != (hit - lot) ||
+		tm.tm_isdst != lotm.tm_isdst ||
+		strcmp(abbr(&tm), loab) != 0;
 }
 
 static time_t
@@ -45,13 +45,14 @@ mkdir -p "${DATFILES}"
 mkdir -p "${ZONEINFO}"
 tar zxf "${TARBALL}" -C "${DATFILES}"
 ZONE_FILES="$("${SRCROOT}"/zic.tproj/generate_zone_file_list.sh "${DATFILES}")"
+ZIC_JOBS="$(sysctl -n hw.activecpu 2>/dev/null || echo 1)"
 for tz in ${ZONE_FILES}; do
     if [ ${tz} = "northamerica" ]; then
         ARG="-p America/New_York"
     else
         ARG=""
     fi
-    "${ZICHOST}" ${ARG} -L /dev/null -d "${ZONEINFO}" \
+    "${ZICHOST}" ${ARG} -j "${ZIC_JOBS}" -L /dev/null -d "${ZONEINFO}" \
         -y "${DATFILES}/yearistype.sh" "${DATFILES}/${tz}" || exit 1
 done
 
@@ -16,6 +16,7 @@ static const char rcsid[] =
 #include <locale.h>
 #include <sys/stat.h>			/* for umask manifest constants */
 #include <sys/types.h>
+#include <fcntl.h>
 #include <unistd.h>
 
 #define	ZIC_VERSION	'2'
@@ -137,9 +138,11 @@ static int	mkdirs(char * filename);
 static void	newabbr(const char * abbr);
 static long	oadd(long t1, long t2);
 static void	outzone(const struct zone * zp, int ntzones);
+static void	outzones(void);
 static void	puttzcode(long code, FILE * fp);
 static void	puttzcode64(zic_t code, FILE * fp);
 static int	rcomp(const void * leftp, const void * rightp);
+static unsigned	namehash(const char * name);
 static zic_t	rpytime(const struct rule * rp, int wantedy);
 static void	rulesub(struct rule * rp,
 			const char * loyearp, const char * hiyearp,
@@ -156,6 +159,8 @@ static void	setuser(uid_t *flag, const char *name);
 static zic_t	tadd(zic_t t1, long t2);
 static void	usage(FILE *stream, int status);
 static void	writezone(const char * name, const char * string);
+static int	zonesame(const char * name, const char * buf, size_t size,
+			struct stat * stp);
 static int	yearistype(int year, const char * type);
 
 static int		charcnt;
@@ -263,6 +268,8 @@ static int		typecnt;
 static struct rule *	rules;
 static int		nrules;	/* number of rules */
 
+#define RULEHASHSIZE	1024	/* buckets for rule set names in associate() */
+
 static struct zone *	zones;
 static int		nzones;	/* number of zones */
 
@@ -284,6 +291,22 @@ struct lookup {
 static struct lookup const *	byword(const char * string,
 					const struct lookup * lp);
 
+/*
+** Input files repeat the same handful of keywords on every line, so
+** byword() remembers each (table, word) pair it has resolved.
+*/
+
+#define WORDHASHSIZE	256
+
+struct wordcache {
+	const struct lookup *	w_table;
+	const char *		w_word;
+	const struct lookup *	w_found;
+	struct wordcache *	w_next;
+};
+
+static struct wordcache *	wordcache[WORDHASHSIZE];
+
 static struct lookup const	line_codes[] = {
 	{ "Rule",	LC_RULE },
 	{ "Zone",	LC_ZONE },
@@ -450,8 +473,9 @@ static void
 usage(FILE *stream, int status)
   {
 	(void) fprintf(stream, _("usage is zic \
-[ --version ] [--help] [ -v ] [ -l localtime ] [ -p posixrules ] \\\n\
-\t[ -d directory ] [ -L leapseconds ] [ -y yearistype ] [ filename ... ]\n\
+[ --version ] [--help] [ -v ] [ -j jobs ] [ -l localtime ] \\\n\
+\t[ -p posixrules ] [ -d directory ] [ -L leapseconds ] [ -y yearistype ] \\\n\
+\t[ filename ... ]\n\
 \n\
 Report bugs to tz@elsie.nci.nih.gov.\n"));
 	exit(status);
@@ -463,6 +487,7 @@ static const char *	directory;
 static const char *	leapsec;
 static const char *	yitcommand;
 static int		Dflag;
+static int		jobs = 1;
 static uid_t		uflag = (uid_t)-1;
 static gid_t		gflag = (gid_t)-1;
 static mode_t		mflag = (S_IRUSR | S_IRGRP | S_IROTH
@@ -498,7 +523,7 @@ char *	argv[];
  		} else if (strcmp(argv[i], "--help") == 0) {
  			usage(stdout, EXIT_SUCCESS);
 		}
-	while ((c = getopt(argc, argv, "Dd:g:l:m:p:L:u:vsy:")) != -1)
+	while ((c = getopt(argc, argv, "Dd:g:j:l:m:p:L:u:vsy:")) != -1)
 		switch (c) {
 			default:
 				usage(stderr, EXIT_FAILURE);
@@ -515,6 +540,17 @@ _("more than one -d option specified"));
 			case 'g':
 				setgroup(&gflag, optarg);
 				break;
+			case 'j':
+			{
+				char *ep;
+				long l = strtol(optarg, &ep, 10);
+
+				if (*ep != '\0' || l < 1 || l > 256)
+					errx(EXIT_FAILURE,
+_("invalid job count"));
+				jobs = (int) l;
+				break;
+			}
 			case 'l':
 				if (lcltime == NULL)
 					lcltime = optarg;
@@ -582,14 +618,7 @@ _("more than one -L option specified"));
 	if (errors)
 		exit(EXIT_FAILURE);
 	associate();
-	for (i = 0; i < nzones; i = j) {
-		/*
-		** Find the next non-continuation zone entry.
-		*/
-		for (j = i + 1; j < nzones && zones[j].z_name == NULL; ++j)
-			continue;
-		outzone(&zones[i], j - i);
-	}
+	outzones();
 	/*
 	** Make links.
 	*/
@@ -613,6 +642,70 @@ _("more than one -L option specified"));
 	return (errors == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
+/*
+** Write out every zone, on up to jobs processes.  outzone works in the
+** global transition tables, so the workers are forked rather than
+** threaded; each one takes every jobs'th zone, and each zone goes to
+** its own file, so the output doesn't depend on the number of jobs.
+** Links are made after all the workers are done.
+*/
+static void
+outzones(void)
+{
+	register int	i;
+	register int	j;
+	register int	k;
+	register int	w;
+	register int	nworkers;
+	pid_t *		pids;
+	int		status;
+
+	for (i = 0, k = 0; i < nzones; ++i)
+		if (zones[i].z_name != NULL)
+			++k;
+	nworkers = (jobs < k) ? jobs : k;
+
+	if (nworkers <= 1) {
+		for (i = 0; i < nzones; i = j) {
+			/*
+			** Find the next non-continuation zone entry.
+			*/
+			for (j = i + 1; j < nzones && zones[j].z_name == NULL;
+				++j)
+					continue;
+			outzone(&zones[i], j - i);
+		}
+		return;
+	}
+
+	pids = (pid_t *) emalloc(nworkers * sizeof *pids);
+	(void) fflush(stdout);
+	(void) fflush(stderr);
+	for (w = 0; w < nworkers; ++w) {
+		pids[w] = fork();
+		if (pids[w] == -1)
+			err(EXIT_FAILURE, _("can't fork"));
+		if (pids[w] != 0)
+			continue;
+		for (i = 0, k = 0; i < nzones; i = j, ++k) {
+			for (j = i + 1; j < nzones && zones[j].z_name == NULL;
+				++j)
+					continue;
+			if (k % nworkers == w)
+				outzone(&zones[i], j - i);
+		}
+		exit((errors == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+	for (w = 0; w < nworkers; ++w) {
+		while (waitpid(pids[w], &status, 0) == -1)
+			if (errno != EINTR)
+				err(EXIT_FAILURE, _("can't wait for worker"));
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			errors = TRUE;
+	}
+	ifree((char *) pids);
+}
+
 static void
 dolink(fromfield, tofield)
 const char * const	fromfield;
@@ -636,6 +729,21 @@ const char * const	tofield;
 		toname = ecatalloc(toname, tofield);
 	}
 	/*
+	** Leave the link alone if it is already there.
+	*/
+	{
+		struct stat	fromst, tost;
+
+		if (stat(fromname, &fromst) == 0 &&
+			lstat(toname, &tost) == 0 &&
+			fromst.st_dev == tost.st_dev &&
+			fromst.st_ino == tost.st_ino) {
+				ifree(fromname);
+				ifree(toname);
+				return;
+		}
+	}
+	/*
 	** We get to be careful here since
 	** there's a fair chance of root running us.
 	*/
@@ -729,6 +837,12 @@ associate(void)
 	register struct rule *	rp;
 	register int		base, out;
 	register int		i, j;
+	register int		nsets;
+	register unsigned	h;
+	int *			setbase;
+	int *			setcount;
+	int *			setnext;
+	int *			sethash;
 
 	if (nrules != 0) {
 		(void) qsort((void *) rules, (size_t) nrules,
@@ -764,19 +878,44 @@ associate(void)
 		zp->z_rules = NULL;
 		zp->z_nrules = 0;
 	}
+	/*
+	** Index each run of same-named rules by name so that every zone
+	** finds its rules with one hash probe.
+	*/
+	setbase = (int *) emalloc((nrules + 1) * sizeof *setbase);
+	setcount = (int *) emalloc((nrules + 1) * sizeof *setcount);
+	setnext = (int *) emalloc((nrules + 1) * sizeof *setnext);
+	sethash = (int *) emalloc(RULEHASHSIZE * sizeof *sethash);
+	for (h = 0; h < RULEHASHSIZE; ++h)
+		sethash[h] = -1;
+	nsets = 0;
 	for (base = 0; base < nrules; base = out) {
 		rp = &rules[base];
 		for (out = base + 1; out < nrules; ++out)
 			if (strcmp(rp->r_name, rules[out].r_name) != 0)
 				break;
-		for (i = 0; i < nzones; ++i) {
-			zp = &zones[i];
+		h = namehash(rp->r_name) % RULEHASHSIZE;
+		setbase[nsets] = base;
+		setcount[nsets] = out - base;
+		setnext[nsets] = sethash[h];
+		sethash[h] = nsets++;
+	}
+	for (i = 0; i < nzones; ++i) {
+		zp = &zones[i];
+		h = namehash(zp->z_rule) % RULEHASHSIZE;
+		for (j = sethash[h]; j >= 0; j = setnext[j]) {
+			rp = &rules[setbase[j]];
 			if (strcmp(zp->z_rule, rp->r_name) != 0)
 				continue;
 			zp->z_rules = rp;
-			zp->z_nrules = out - base;
+			zp->z_nrules = setcount[j];
+			break;
 		}
 	}
+	ifree((char *) setbase);
+	ifree((char *) setcount);
+	ifree((char *) setnext);
+	ifree((char *) sethash);
 	for (i = 0; i < nzones; ++i) {
 		zp = &zones[i];
 		if (zp->z_nrules == 0) {
@@ -1456,6 +1595,10 @@ const char * const	string;
 	static struct tzhead		tzh;
 	zic_t				ats[TZ_MAX_TIMES];
 	unsigned char			types[TZ_MAX_TIMES];
+	char *				buf;
+	size_t				size;
+	struct stat			st;
+	int				same;
 
 	/*
 	** Sort.
@@ -1534,17 +1677,11 @@ const char * const	string;
 	(void) sprintf(fullname, "%s/%s", directory, name);
 
 	/*
-	 * Remove old file, if any, to snap links.
-	 */
-	if (!itsdir(fullname) && remove(fullname) != 0 && errno != ENOENT)
-		err(EXIT_FAILURE, _("can't remove %s"), fullname);
-
-	if ((fp = fopen(fullname, "wb")) == NULL) {
-		if (mkdirs(fullname) != 0)
-			exit(EXIT_FAILURE);
-		if ((fp = fopen(fullname, "wb")) == NULL)
-			err(EXIT_FAILURE, _("can't create %s"), fullname);
-	}
+	** Build the file in memory first, so that an unchanged file
+	** can be left alone.
+	*/
+	if ((fp = open_memstream(&buf, &size)) == NULL)
+		err(EXIT_FAILURE, _("can't create %s"), fullname);
 	for (pass = 1; pass <= 2; ++pass) {
 		register int	thistimei, thistimecnt;
 		register int	thisleapi, thisleapcnt;
@@ -1738,15 +1875,70 @@ const char * const	string;
 	(void) fprintf(fp, "\n%s\n", string);
 	if (ferror(fp) || fclose(fp))
 		errx(EXIT_FAILURE, _("error writing %s"), fullname);
-	if (chmod(fullname, mflag) < 0)
+
+	same = zonesame(fullname, buf, size, &st);
+	if (!same) {
+		/*
+		 * Remove old file, if any, to snap links.
+		 */
+		if (!itsdir(fullname) && remove(fullname) != 0 &&
+		    errno != ENOENT)
+			err(EXIT_FAILURE, _("can't remove %s"), fullname);
+
+		if ((fp = fopen(fullname, "wb")) == NULL) {
+			if (mkdirs(fullname) != 0)
+				exit(EXIT_FAILURE);
+			if ((fp = fopen(fullname, "wb")) == NULL)
+				err(EXIT_FAILURE, _("can't create %s"),
+				    fullname);
+		}
+		if (fwrite(buf, 1, size, fp) != size || fclose(fp))
+			errx(EXIT_FAILURE, _("error writing %s"), fullname);
+	}
+	free(buf);
+	if ((!same || (st.st_mode & ALLPERMS) != mflag) &&
+	    chmod(fullname, mflag) < 0)
 		err(EXIT_FAILURE, _("cannot change mode of %s to %03o"),
 		    fullname, (unsigned)mflag);
 	if ((uflag != (uid_t)-1 || gflag != (gid_t)-1)
+	    && (!same || (uflag != (uid_t)-1 && st.st_uid != uflag) ||
+	    (gflag != (gid_t)-1 && st.st_gid != gflag))
 	    && chown(fullname, uflag, gflag) < 0)
 		err(EXIT_FAILURE, _("cannot change ownership of %s"), 
 		    fullname);
 }
 
+/*
+** Is the file already there with exactly these contents?  If so, *stp
+** is filled in for the caller's mode and owner checks.
+*/
+static int
+zonesame(name, buf, size, stp)
+const char * const	name;
+const char * const	buf;
+const size_t		size;
+struct stat * const	stp;
+{
+	register char *	old;
+	register int	fd;
+	register int	same;
+	ssize_t		n;
+
+	if ((fd = open(name, O_RDONLY)) == -1)
+		return FALSE;
+	if (fstat(fd, stp) != 0 || !S_ISREG(stp->st_mode) ||
+		stp->st_size != (off_t) size) {
+			(void) close(fd);
+			return FALSE;
+	}
+	old = emalloc(size + 1);
+	n = read(fd, old, size + 1);
+	same = n == (ssize_t) size && memcmp(old, buf, size) == 0;
+	ifree(old);
+	(void) close(fd);
+	return same;
+}
+
 static void
 doabbr(abbr, format, letters, isdst, doquotes)
 char * const		abbr;
@@ -2421,15 +2613,23 @@ register const struct lookup * const	table;
 {
 	register const struct lookup *	foundlp;
 	register const struct lookup *	lp;
+	register struct wordcache *	wp;
+	register unsigned		h;
 
 	if (word == NULL || table == NULL)
 		return NULL;
+	h = namehash(word) % WORDHASHSIZE;
+	for (wp = wordcache[h]; wp != NULL; wp = wp->w_next)
+		if (wp->w_table == table && strcmp(wp->w_word, word) == 0)
+			return wp->w_found;
 	/*
 	** Look for exact match.
 	*/
 	for (lp = table; lp->l_word != NULL; ++lp)
-		if (ciequal(word, lp->l_word))
-			return lp;
+		if (ciequal(word, lp->l_word)) {
+			foundlp = lp;
+			goto found;
+		}
 	/*
 	** Look for inexact match.
 	*/
@@ -2438,11 +2638,35 @@ register const struct lookup * const	table;
 		if (itsabbr(word, lp->l_word)) {
 			if (foundlp == NULL)
 				foundlp = lp;
-			else	return NULL;	/* multiple inexact matches */
+			else {
+				foundlp = NULL;	/* multiple inexact matches */
+				break;
+			}
 		}
+found:
+	wp = (struct wordcache *) emalloc(sizeof *wp);
+	wp->w_table = table;
+	wp->w_word = ecpyalloc(word);
+	wp->w_found = foundlp;
+	wp->w_next = wordcache[h];
+	wordcache[h] = wp;
 	return foundlp;
 }
 
+static unsigned
+namehash(name)
+register const char *	name;
+{
+	register unsigned	h;
+
+	h = 2166136261U;
+	while (*name != '\0') {
+		h ^= (unsigned char) *name++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
 static char **
 getfields(cp)
 register char *	cp;
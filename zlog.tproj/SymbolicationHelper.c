@@ -5,6 +5,9 @@
 //  Created by Rasha Eqbal on 2/26/18.
 //
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "SymbolicationHelper.h"
 
 /*
@@ -19,6 +22,7 @@
 #define kUuidKey CFSTR("UUID")
 
 static void AddSymbolOwnerSummary(CSSymbolOwnerRef owner, CFMutableDictionaryRef binaryImages);
+static char *CopySymbolicatedAddress(CSSymbolicatorRef symbolicator, mach_vm_address_t addr, CFMutableDictionaryRef binaryImages);
 static void ShowBinaryImage(const void *key, const void *value, void *context);
 
 /*
@@ -29,31 +33,216 @@ static void ShowBinaryImage(const void *key, const void *value, void *context);
  */
 void PrintSymbolicatedAddress(CSSymbolicatorRef symbolicator, mach_vm_address_t addr, CFMutableDictionaryRef binaryImages)
 {
-	printf("0x%llx", addr);
+	char *line = CopySymbolicatedAddress(symbolicator, addr, binaryImages);
+
+	if (line) {
+		printf("%s\n", line);
+		free(line);
+	} else {
+		printf("0x%llx\n", addr);
+	}
+}
+
+/*
+ * Returns the line printed for 'addr', without the trailing newline, in a malloc'ed string.
+ * Adds owner info to 'binaryImages' for offline symbolication.
+ */
+static char *CopySymbolicatedAddress(CSSymbolicatorRef symbolicator, mach_vm_address_t addr, CFMutableDictionaryRef binaryImages)
+{
+	char *line = NULL;
+	size_t len = 0;
+	FILE *out = open_memstream(&line, &len);
+
+	if (!out) {
+		return NULL;
+	}
+	fprintf(out, "0x%llx", addr);
+	if (CSIsNull(symbolicator)) {
+		/* printed for symbolication elsewhere */
+		fclose(out);
+		return line;
+	}
 
 	CSSymbolOwnerRef ownerInfo = CSSymbolicatorGetSymbolOwnerWithAddressAtTime(symbolicator, addr, kCSNow);
 	if (!CSIsNull(ownerInfo)) {
 		const char *moduleName = CSSymbolOwnerGetName(ownerInfo);
 		if (moduleName) {
-			printf(" <%s>", moduleName);
+			fprintf(out, " <%s>", moduleName);
 		}
 	}
 
 	CSSymbolRef symbolInfo = CSSymbolicatorGetSymbolWithAddressAtTime(symbolicator, addr, kCSNow);
 	if (!CSIsNull(symbolInfo)) {
-		printf(" %s", CSSymbolGetName(symbolInfo));
+		fprintf(out, " %s", CSSymbolGetName(symbolInfo));
 	}
 
 	CSSourceInfoRef sourceInfo = CSSymbolicatorGetSourceInfoWithAddressAtTime(symbolicator, addr, kCSNow);
 	if (!CSIsNull(sourceInfo)) {
 		const char *fileName = CSSourceInfoGetPath(sourceInfo);
 		if (fileName) {
-			printf(" at %s:%d", fileName, CSSourceInfoGetLineNumber(sourceInfo));
+			fprintf(out, " at %s:%d", fileName, CSSourceInfoGetLineNumber(sourceInfo));
 		}
 	}
-	printf("\n");
+	fclose(out);
 
 	AddSymbolOwnerSummary(ownerInfo, binaryImages);
+	return line;
+}
+
+/*
+ * The cache is an open-addressed hash table from address to printed line and frame name, grown
+ * when half full.  Each is only computed the first time it is asked for.
+ */
+struct SymbolCacheEntry {
+	mach_vm_address_t addr;
+	char *line;
+	char *name;
+	bool used;
+};
+
+struct SymbolCache {
+	CSSymbolicatorRef symbolicator;
+	CFMutableDictionaryRef binaryImages;
+	struct SymbolCacheEntry *entries;
+	size_t count;
+	size_t capacity;
+};
+
+#define SYMBOL_CACHE_MIN_CAPACITY	1024
+
+static size_t SymbolCacheSlot(const struct SymbolCacheEntry *entries, size_t capacity, mach_vm_address_t addr)
+{
+	size_t slot = (size_t)((addr * 0x9E3779B97F4A7C15ULL) >> 32) & (capacity - 1);
+
+	while (entries[slot].used && entries[slot].addr != addr) {
+		slot = (slot + 1) & (capacity - 1);
+	}
+	return slot;
+}
+
+static int SymbolCacheGrow(SymbolCacheRef cache)
+{
+	size_t capacity = cache->capacity ? cache->capacity * 2 : SYMBOL_CACHE_MIN_CAPACITY;
+	struct SymbolCacheEntry *entries = calloc(capacity, sizeof(*entries));
+
+	if (!entries) {
+		return -1;
+	}
+	for (size_t i = 0; i < cache->capacity; i++) {
+		if (cache->entries[i].used) {
+			entries[SymbolCacheSlot(entries, capacity, cache->entries[i].addr)] = cache->entries[i];
+		}
+	}
+	free(cache->entries);
+	cache->entries = entries;
+	cache->capacity = capacity;
+	return 0;
+}
+
+SymbolCacheRef SymbolCacheCreate(CSSymbolicatorRef symbolicator, CFMutableDictionaryRef binaryImages)
+{
+	SymbolCacheRef cache = calloc(1, sizeof(*cache));
+
+	if (!cache) {
+		return NULL;
+	}
+	cache->symbolicator = symbolicator;
+	cache->binaryImages = binaryImages;
+	if (SymbolCacheGrow(cache) != 0) {
+		free(cache);
+		return NULL;
+	}
+	return cache;
+}
+
+void SymbolCacheRelease(SymbolCacheRef cache)
+{
+	for (size_t i = 0; i < cache->capacity; i++) {
+		free(cache->entries[i].line);
+		free(cache->entries[i].name);
+	}
+	free(cache->entries);
+	free(cache);
+}
+
+/*
+ * Returns the entry for 'addr', adding it if needed, or NULL if the cache could not grow.
+ */
+static struct SymbolCacheEntry *SymbolCacheLookup(SymbolCacheRef cache, mach_vm_address_t addr)
+{
+	size_t slot = SymbolCacheSlot(cache->entries, cache->capacity, addr);
+
+	if (!cache->entries[slot].used) {
+		if (2 * (cache->count + 1) > cache->capacity) {
+			if (SymbolCacheGrow(cache) != 0) {
+				return NULL;
+			}
+			slot = SymbolCacheSlot(cache->entries, cache->capacity, addr);
+		}
+		cache->entries[slot].addr = addr;
+		cache->entries[slot].used = true;
+		cache->count++;
+	}
+	return &cache->entries[slot];
+}
+
+void PrintSymbolicatedAddressCached(SymbolCacheRef cache, mach_vm_address_t addr)
+{
+	struct SymbolCacheEntry *entry = SymbolCacheLookup(cache, addr);
+
+	if (entry && !entry->line) {
+		entry->line = CopySymbolicatedAddress(cache->symbolicator, addr, cache->binaryImages);
+	}
+	if (entry && entry->line) {
+		printf("%s\n", entry->line);
+	} else {
+		printf("0x%llx\n", addr);
+	}
+}
+
+const char *SymbolCacheGetFrameName(SymbolCacheRef cache, mach_vm_address_t addr, bool symbolicate)
+{
+	struct SymbolCacheEntry *entry = SymbolCacheLookup(cache, addr);
+	const char *symbolName = NULL;
+	char *name = NULL;
+
+	if (!entry) {
+		return NULL;
+	}
+	if (entry->name) {
+		return entry->name;
+	}
+
+	if (CSIsNull(cache->symbolicator)) {
+		asprintf(&name, "0x%llx", addr);
+		entry->name = name;
+		return name;
+	}
+
+	CSSymbolOwnerRef ownerInfo = CSSymbolicatorGetSymbolOwnerWithAddressAtTime(cache->symbolicator, addr, kCSNow);
+	if (symbolicate) {
+		CSSymbolRef symbolInfo = CSSymbolicatorGetSymbolWithAddressAtTime(cache->symbolicator, addr, kCSNow);
+		if (!CSIsNull(symbolInfo)) {
+			symbolName = CSSymbolGetName(symbolInfo);
+		}
+	}
+	if (symbolName) {
+		name = strdup(symbolName);
+		if (name) {
+			/* ';' separates the frames of a collapsed stack */
+			for (char *p = name; *p; p++) {
+				if (*p == ';') {
+					*p = ':';
+				}
+			}
+		}
+	} else {
+		asprintf(&name, "0x%llx", addr);
+	}
+	AddSymbolOwnerSummary(ownerInfo, cache->binaryImages);
+
+	entry->name = name;
+	return name;
 }
 
 /*
@@ -146,12 +335,17 @@ cleanup:
  * for offline symbolication.
  */
 void PrintBinaryImagesInfo(CFMutableDictionaryRef binaryImages)
+{
+	FPrintBinaryImagesInfo(stdout, binaryImages);
+}
+
+void FPrintBinaryImagesInfo(FILE *out, CFMutableDictionaryRef binaryImages)
 {
 	if (CFDictionaryGetCount(binaryImages) > 0) {
-		printf("\nBinary Images:\n");
-		CFDictionaryApplyFunction(binaryImages, ShowBinaryImage, NULL);
+		fprintf(out, "\nBinary Images:\n");
+		CFDictionaryApplyFunction(binaryImages, ShowBinaryImage, out);
 	} else {
-		printf("No binary images\n");
+		fprintf(out, "No binary images\n");
 	}
 }
 
@@ -177,5 +371,5 @@ static void ShowBinaryImage(const void *key, const void *value, void *context)
 	CFNumberGetValue(addressNumber, kCFNumberSInt64Type, &address);
 	CFNumberGetValue(sizeNumber, kCFNumberSInt64Type, &size);
 
-	printf("%p - %p %s <%s> %s\n", (void*)address, (void*)address + size, nameString, uuidString, pathString);
+	fprintf((FILE *)context, "%p - %p %s <%s> %s\n", (void*)address, (void*)address + size, nameString, uuidString, pathString);
 }
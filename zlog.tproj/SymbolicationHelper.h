@@ -8,6 +8,8 @@
 #ifndef SymbolicationHelper_h
 #define SymbolicationHelper_h
 
+#include <stdbool.h>
+#include <stdio.h>
 #include <CoreFoundation/CoreFoundation.h>
 #include <CoreSymbolication/CoreSymbolication.h>
 
@@ -21,6 +23,30 @@
  */
 void PrintSymbolicatedAddress(CSSymbolicatorRef sym, mach_vm_address_t addr, CFMutableDictionaryRef binaryImages);
 
+/*
+ * A cache of symbolicated addresses, for tools that symbolicate the same addresses many times.
+ */
+typedef struct SymbolCache *SymbolCacheRef;
+
+/*
+ * 'sym' may be kCSNull, for addresses from another system, which are then printed in hex.
+ */
+SymbolCacheRef SymbolCacheCreate(CSSymbolicatorRef sym, CFMutableDictionaryRef binaryImages);
+void SymbolCacheRelease(SymbolCacheRef cache);
+
+/*
+ * Same as PrintSymbolicatedAddress(), but each address is only symbolicated the first time it is
+ * printed; binary image info is collected in the dictionary the cache was created with.
+ */
+void PrintSymbolicatedAddressCached(SymbolCacheRef cache, mach_vm_address_t addr);
+
+/*
+ * Returns the name of the symbol containing 'addr' for use as a stack frame, or if 'symbolicate' is
+ * false or there is no symbol, the address in hex.  Binary image info is collected either way, so that
+ * the addresses can be symbolicated offline.  The string is owned by the cache.
+ */
+const char *SymbolCacheGetFrameName(SymbolCacheRef cache, mach_vm_address_t addr, bool symbolicate);
+
 /*
  * Call this function to dump binary image info required for offline symbolication.
  *
@@ -31,5 +57,6 @@ void PrintSymbolicatedAddress(CSSymbolicatorRef sym, mach_vm_address_t addr, CFM
  * which just needs to be passed in here to print the relevant information.
  */
 void PrintBinaryImagesInfo(CFMutableDictionaryRef binaryImages);
+void FPrintBinaryImagesInfo(FILE *out, CFMutableDictionaryRef binaryImages);
 
 #endif /* SymbolicationHelper_h */
@@ -5,10 +5,12 @@
 //  Created by Rasha Eqbal on 1/4/18.
 //
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/kas_info.h>
 #include <sys/sysctl.h>
 #include <mach/mach.h>
 #include <mach/mach_error.h>
@@ -27,20 +29,71 @@ mach_zone_get_zlog_zones(host_priv_t             host,
                          mach_zone_name_array_t  *namesp,
                          mach_msg_type_number_t  *namesCntp);
 
+/* Records with the same operation and backtrace, counted once */
+typedef struct {
+	zone_btrecord_t rec;   /* must be first, for compare_zone_btrecords() */
+	unsigned int    nrecs;
+} zone_btgroup_t;
+
 static int compare_zone_btrecords(const void *left, const void *right);
+static int compare_zone_btrecord_frames(const void *left, const void *right);
+static unsigned int group_zone_btrecords(zone_btrecord_t *recs, unsigned int recs_count, zone_btgroup_t **groupsp);
+/* Where frame addresses are symbolicated, see create_symbols() */
+typedef struct {
+	CSSymbolicatorRef      kernelSym;
+	CFMutableDictionaryRef binaryImages;
+	SymbolCacheRef         cache;
+	const char            *unslid_uuid;
+} zlog_symbols_t;
+
+/*
+ * A capture (-w) is this header followed by the raw records, and is read back with -r.
+ */
+#define ZLOG_CAPTURE_MAGIC		"ZLGC"
+#define ZLOG_CAPTURE_VERSION	1
+#define ZLOG_CAPTURE_SLIDE		0x1	/* kernel_slide is known */
+
+typedef struct {
+	char     magic[4];
+	uint32_t version;
+	uint32_t flags;
+	uint32_t record_size;
+	uint64_t records;
+	uint64_t kernel_slide;
+	char     kernel_uuid[40];
+	char     osversion[32];
+	char     zone_name[sizeof(((mach_zone_name_t *)0)->mzn_name)];
+} zlog_capture_t;
+
 static void usage(FILE *stream, char **argv);
 static void print_zone_info(const char *name);
-static void get_zone_btrecords(const char *name, int topN);
+static void copy_zone_btrecords(const char *name, zone_btrecord_t **recsp, unsigned int *recs_countp);
+static void release_zone_btrecords(zone_btrecord_t *recs, unsigned int recs_count);
+static void create_symbols(zlog_symbols_t *syms, bool kernel);
+static void release_symbols(zlog_symbols_t *syms);
+static void print_binary_images(FILE *out, zlog_symbols_t *syms);
+static void print_zone_btrecords(const char *name, zone_btrecord_t *recs, unsigned int recs_count, int topN,
+								 zlog_symbols_t *syms);
+static void print_collapsed_stacks(zone_btrecord_t *recs, unsigned int recs_count, bool symbolicate,
+								   zlog_symbols_t *syms);
+static void capture_zone_btrecords(const char *name, const char *path);
+static zone_btrecord_t *load_zone_btrecords(const char *path, zlog_capture_t *cap);
+static void get_osversion(char *buffer, size_t buffer_len);
 static void list_zones_with_zlog_enabled(void);
 
 static void usage(FILE *stream, char **argv)
 {
-	fprintf (stream, "usage: %s [-t] [-z name [-n num | -l]] [-h]\n", argv[0]);
+	fprintf (stream, "usage: %s [-t] [-z name [-n num | -l | -c [-u] | -w file]] [-r file [-n num | -l | -c [-u]]] [-h]\n", argv[0]);
 	fprintf (stream, "    -t            : list all the zones that have logging enabled\n");
 	fprintf (stream, "    -z <name>     : show all allocation backtraces for zone <name>\n");
 	fprintf (stream, "    -n <num>      : show top <num> backtraces with the most active references in zone <name>\n");
 	fprintf (stream, "    -l            : show the backtrace most likely contributing to a leak in zone <name>\n");
 	fprintf (stream, "                    (prints the backtrace with the most active references)\n");
+	fprintf (stream, "    -c            : print the backtraces in zone <name> as collapsed stacks for flame graphs\n");
+	fprintf (stream, "                    (binary images for offline symbolication are printed to stderr)\n");
+	fprintf (stream, "    -u            : with -c, print frame addresses instead of symbol names\n");
+	fprintf (stream, "    -w <file>     : write the backtraces in zone <name> to <file> without symbolicating them\n");
+	fprintf (stream, "    -r <file>     : show the backtraces written by -w, possibly on another machine\n");
 	fprintf (stream, "    -h            : print this help text\n");
 	exit(stream != stdout);
 }
@@ -53,6 +106,49 @@ static int compare_zone_btrecords(const void *left, const void *right)
 	return (btr->ref_count - btl->ref_count);
 }
 
+static int compare_zone_btrecord_frames(const void *left, const void *right)
+{
+	const zone_btrecord_t *btl = (const zone_btrecord_t *)left;
+	const zone_btrecord_t *btr = (const zone_btrecord_t *)right;
+
+	if (btl->operation_type != btr->operation_type) {
+		return (btl->operation_type < btr->operation_type) ? -1 : 1;
+	}
+	return memcmp(btl->bt, btr->bt, sizeof(btl->bt));
+}
+
+/*
+ * Collapses the records with identical backtraces and operation types into one group each,
+ * adding up their active references, and sorts the groups with compare_zone_btrecords().
+ */
+static unsigned int group_zone_btrecords(zone_btrecord_t *recs, unsigned int recs_count, zone_btgroup_t **groupsp)
+{
+	zone_btgroup_t *groups;
+	unsigned int i, ngroups = 0;
+
+	groups = calloc(recs_count, sizeof(*groups));
+	if (groups == NULL) {
+		fprintf(stderr, "error: failed to allocate %u backtrace groups\n", recs_count);
+		exit(1);
+	}
+
+	qsort(recs, recs_count, sizeof *recs, compare_zone_btrecord_frames);
+	for (i = 0; i < recs_count; i++) {
+		if (ngroups && compare_zone_btrecord_frames(&groups[ngroups - 1].rec, &recs[i]) == 0) {
+			groups[ngroups - 1].rec.ref_count += recs[i].ref_count;
+			groups[ngroups - 1].nrecs++;
+		} else {
+			groups[ngroups].rec = recs[i];
+			groups[ngroups].nrecs = 1;
+			ngroups++;
+		}
+	}
+	qsort(groups, ngroups, sizeof *groups, compare_zone_btrecords);
+
+	*groupsp = groups;
+	return ngroups;
+}
+
 static void print_zone_info(const char *name)
 {
 	mach_zone_name_t zname;
@@ -72,83 +168,328 @@ static void print_zone_info(const char *name)
 	printf("\n");
 }
 
-static void get_zone_btrecords(const char *name, int topN)
+static void copy_zone_btrecords(const char *name, zone_btrecord_t **recsp, unsigned int *recs_countp)
 {
 	kern_return_t kr;
-	int i, j, index;
 	mach_zone_name_t zname;
-	unsigned int recs_count = 0;
-	zone_btrecord_t *recs, *recs_addr = NULL;
-	CSSymbolicatorRef kernelSym;
-	CFMutableDictionaryRef binaryImages;
-
-	/* Create kernel symbolicator */
-	kernelSym = CSSymbolicatorCreateWithMachKernel();
-	if (CSIsNull(kernelSym)) {
-		fprintf(stderr, "error: CSSymbolicatorCreateWithMachKernel() returned NULL\n");
-		exit(1);
-	}
-	/* Create dictionary to collect binary image info for offline symbolication */
-    binaryImages = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
 
 	/* Query the kernel for backtrace records */
-	strcpy(zname.mzn_name, name);
-	kr = mach_zone_get_btlog_records(mach_host_self(), zname, &recs_addr, &recs_count);
+	strlcpy(zname.mzn_name, name, sizeof(zname.mzn_name));
+	*recsp = NULL;
+	*recs_countp = 0;
+	kr = mach_zone_get_btlog_records(mach_host_self(), zname, recsp, recs_countp);
 	if (kr != KERN_SUCCESS) {
 		fprintf(stderr, "error: call to mach_zone_get_btlog_records() failed: %s\n", mach_error_string(kr));
 		exit(1);
 	}
+}
 
-	if (recs_count == 0) {
-		goto finish;
+static void release_zone_btrecords(zone_btrecord_t *recs, unsigned int recs_count)
+{
+	kern_return_t kr;
+
+	if ((recs != NULL) && (recs_count != 0)) {
+		kr = vm_deallocate(mach_task_self(), (vm_address_t) recs, (vm_size_t) (recs_count * sizeof *recs));
+		if (kr != KERN_SUCCESS) {
+			fprintf(stderr, "call to vm_deallocate() failed: %s\n", mach_error_string(kr));
+			exit(1);
+		}
 	}
+}
 
-	recs = recs_addr;
-	if (topN == 1) {
-		/* Print the backtrace with the highest no. of refs */
-		index = 0;
-		for (i = 0; i < recs_count; i++) {
-			if (recs[i].ref_count > recs[index].ref_count) {
-				index = i;
-			}
+/*
+ * Frame addresses are symbolicated against the running kernel, unless 'kernel' is false because the
+ * records were captured on another boot, in which case they are printed as they are.
+ */
+static void create_symbols(zlog_symbols_t *syms, bool kernel)
+{
+	syms->kernelSym = kCSNull;
+	syms->unslid_uuid = NULL;
+	if (kernel) {
+		/* Create kernel symbolicator */
+		syms->kernelSym = CSSymbolicatorCreateWithMachKernel();
+		if (CSIsNull(syms->kernelSym)) {
+			fprintf(stderr, "error: CSSymbolicatorCreateWithMachKernel() returned NULL\n");
+			exit(1);
 		}
-		recs = recs_addr + index;
-	} else if (topN == 0) {
-		/* Print all backtraces */
-		topN = recs_count;
+	}
+	/* Create dictionary to collect binary image info for offline symbolication */
+	syms->binaryImages = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	/* Each distinct frame address is only symbolicated once */
+	syms->cache = SymbolCacheCreate(syms->kernelSym, syms->binaryImages);
+	if (syms->cache == NULL) {
+		fprintf(stderr, "error: failed to create the symbol cache\n");
+		exit(1);
+	}
+}
+
+static void release_symbols(zlog_symbols_t *syms)
+{
+	SymbolCacheRelease(syms->cache);
+	CFRelease(syms->binaryImages);
+	if (!CSIsNull(syms->kernelSym)) {
+		CSRelease(syms->kernelSym);
+	}
+}
+
+/* Print relevant info for offline symbolication */
+static void print_binary_images(FILE *out, zlog_symbols_t *syms)
+{
+	if (!CSIsNull(syms->kernelSym)) {
+		FPrintBinaryImagesInfo(out, syms->binaryImages);
+	} else if (syms->unslid_uuid) {
+		fprintf(out, "\nAddresses are unslid, for kernel UUID %s\n", syms->unslid_uuid);
 	} else {
-		/* Sort the records by no. of refs, and print the top <topN> */
-		qsort(recs, recs_count, sizeof *recs, compare_zone_btrecords);
+		fprintf(out, "\nAddresses are as captured, kernel slide unknown\n");
+	}
+}
+
+static void print_zone_btrecords(const char *name, zone_btrecord_t *recs, unsigned int recs_count, int topN,
+								 zlog_symbols_t *syms)
+{
+	int i, j;
+	unsigned int groups_count;
+	zone_btgroup_t *groups = NULL;
+
+	if (recs_count == 0) {
+		return;
 	}
 
-	printf("printing top %d (out of %d) allocation backtrace(s) for zone %s\n", topN, recs_count, zname.mzn_name);
+	/*
+	 * Print each unique backtrace once, sorted by no. of refs: all of them, the top <topN>,
+	 * or with -l the one with the highest no. of refs.
+	 */
+	groups_count = group_zone_btrecords(recs, recs_count, &groups);
+	if (topN == 0 || topN > groups_count) {
+		topN = groups_count;
+	}
+
+	printf("printing top %d (out of %d) allocation backtrace(s) for zone %s\n", topN, groups_count, name);
+	printf("(%u records)\n", recs_count);
 
 	for (i = 0; i < topN; i++) {
-		printf("\nactive refs: %d   operation type: %s\n", recs[i].ref_count,
-			   (recs[i].operation_type == ZOP_ALLOC)? "ALLOC": (recs[i].operation_type == ZOP_FREE)? "FREE": "UNKNOWN");
+		zone_btrecord_t *rec = &groups[i].rec;
+
+		printf("\nactive refs: %d   operation type: %s   records: %u\n", rec->ref_count,
+			   (rec->operation_type == ZOP_ALLOC)? "ALLOC": (rec->operation_type == ZOP_FREE)? "FREE": "UNKNOWN",
+			   groups[i].nrecs);
 
 		for (j = 0; j < MAX_ZTRACE_DEPTH; j++) {
-			mach_vm_address_t addr = (mach_vm_address_t)recs[i].bt[j];
+			mach_vm_address_t addr = (mach_vm_address_t)rec->bt[j];
 			if (!addr) {
 				break;
 			}
-			PrintSymbolicatedAddress(kernelSym, addr, binaryImages);
+			PrintSymbolicatedAddressCached(syms->cache, addr);
 		}
 	}
+	free(groups);
 
-	/* Print relevant info for offline symbolication */
-	PrintBinaryImagesInfo(binaryImages);
-	CFRelease(binaryImages);
+	print_binary_images(stdout, syms);
+}
 
-finish:
-	if ((recs_addr != NULL) && (recs_count != 0)) {
-		kr = vm_deallocate(mach_task_self(), (vm_address_t) recs_addr, (vm_size_t) (recs_count * sizeof *recs));
-		if (kr != KERN_SUCCESS) {
-			fprintf(stderr, "call to vm_deallocate() failed: %s\n", mach_error_string(kr));
+/*
+ * Collapsed stacks: the records are merged into a prefix tree of frames, outermost frame first, under
+ * a root per operation type.  Each node is weighted by the active references of the backtraces ending
+ * there, and each weighted node is printed as "OP;frame;...;frame weight".
+ */
+typedef struct {
+	mach_vm_address_t pc;
+	unsigned int      child;    /* first child, 0 if none */
+	unsigned int      sibling;  /* next sibling, 0 if none */
+	long long         weight;
+} btnode_t;
+
+typedef struct {
+	btnode_t     *nodes;
+	unsigned int  count;
+	unsigned int  capacity;
+} bttree_t;
+
+static unsigned int bttree_child(bttree_t *tree, unsigned int parent, mach_vm_address_t pc)
+{
+	unsigned int n;
+
+	for (n = tree->nodes[parent].child; n != 0; n = tree->nodes[n].sibling) {
+		if (tree->nodes[n].pc == pc) {
+			return n;
+		}
+	}
+	if (tree->count == tree->capacity) {
+		tree->capacity *= 2;
+		tree->nodes = reallocf(tree->nodes, tree->capacity * sizeof(*tree->nodes));
+		if (tree->nodes == NULL) {
+			fprintf(stderr, "error: failed to allocate backtrace tree\n");
 			exit(1);
 		}
 	}
-	CSRelease(kernelSym);
+	n = tree->count++;
+	tree->nodes[n] = (btnode_t){ .pc = pc, .sibling = tree->nodes[parent].child };
+	tree->nodes[parent].child = n;
+	return n;
+}
+
+static const char *operation_name(mach_vm_address_t op)
+{
+	return (op == ZOP_ALLOC)? "ALLOC": (op == ZOP_FREE)? "FREE": "UNKNOWN";
+}
+
+static void print_collapsed_node(const bttree_t *tree, unsigned int n, const char **stack, unsigned int depth,
+								 SymbolCacheRef symbolCache, bool symbolicate)
+{
+	const btnode_t *node = &tree->nodes[n];
+	unsigned int i, c;
+
+	if (depth == 0) {
+		stack[depth] = operation_name(node->pc);
+	} else {
+		stack[depth] = SymbolCacheGetFrameName(symbolCache, node->pc, symbolicate);
+		if (stack[depth] == NULL) {
+			stack[depth] = "???";
+		}
+	}
+	depth++;
+
+	if (node->weight > 0) {
+		for (i = 0; i < depth; i++) {
+			printf("%s%s", i ? ";" : "", stack[i]);
+		}
+		printf(" %lld\n", node->weight);
+	}
+	for (c = node->child; c != 0; c = tree->nodes[c].sibling) {
+		print_collapsed_node(tree, c, stack, depth, symbolCache, symbolicate);
+	}
+}
+
+static void print_collapsed_stacks(zone_btrecord_t *recs, unsigned int recs_count, bool symbolicate,
+								   zlog_symbols_t *syms)
+{
+	unsigned int i, n;
+	int j;
+	bttree_t tree;
+	const char *stack[MAX_ZTRACE_DEPTH + 1];
+
+	tree.capacity = 1024;
+	tree.count = 1;
+	tree.nodes = calloc(tree.capacity, sizeof(*tree.nodes));
+	if (tree.nodes == NULL) {
+		fprintf(stderr, "error: failed to allocate backtrace tree\n");
+		exit(1);
+	}
+
+	for (i = 0; i < recs_count; i++) {
+		if (recs[i].ref_count == 0) {
+			continue;
+		}
+		n = bttree_child(&tree, 0, recs[i].operation_type);
+		for (j = MAX_ZTRACE_DEPTH - 1; j >= 0; j--) {
+			if (recs[i].bt[j]) {
+				n = bttree_child(&tree, n, (mach_vm_address_t)recs[i].bt[j]);
+			}
+		}
+		tree.nodes[n].weight += recs[i].ref_count;
+	}
+
+	for (n = tree.nodes[0].child; n != 0; n = tree.nodes[n].sibling) {
+		print_collapsed_node(&tree, n, stack, 0, syms->cache, symbolicate);
+	}
+	fflush(stdout);
+
+	/* Kept out of the collapsed stacks, which flame graph tools read from stdout */
+	print_binary_images(stderr, syms);
+
+	free(tree.nodes);
+}
+
+/*
+ * The kernel UUID and slide let a capture be symbolicated on another boot or machine.
+ */
+static void get_kernel_identity(zlog_capture_t *cap)
+{
+	size_t len = sizeof(cap->kernel_uuid);
+	uint64_t slide = 0;
+	size_t slide_size = sizeof(slide);
+
+	if (sysctlbyname("kern.uuid", cap->kernel_uuid, &len, NULL, 0) != 0) {
+		strlcpy(cap->kernel_uuid, "Unknown", sizeof(cap->kernel_uuid));
+	}
+	if (kas_info(KAS_INFO_KERNEL_TEXT_SLIDE_SELECTOR, &slide, &slide_size) == 0) {
+		cap->kernel_slide = slide;
+		cap->flags |= ZLOG_CAPTURE_SLIDE;
+	}
+	get_osversion(cap->osversion, sizeof(cap->osversion));
+}
+
+/*
+ * Only the kernel is asked for the records; nothing is symbolicated.
+ */
+static void capture_zone_btrecords(const char *name, const char *path)
+{
+	zlog_capture_t cap;
+	zone_btrecord_t *recs;
+	unsigned int recs_count;
+	FILE *f;
+
+	memset(&cap, 0, sizeof(cap));
+	memcpy(cap.magic, ZLOG_CAPTURE_MAGIC, sizeof(cap.magic));
+	cap.version = ZLOG_CAPTURE_VERSION;
+	cap.record_size = sizeof(zone_btrecord_t);
+	strlcpy(cap.zone_name, name, sizeof(cap.zone_name));
+	get_kernel_identity(&cap);
+
+	copy_zone_btrecords(name, &recs, &recs_count);
+	cap.records = recs_count;
+
+	f = fopen(path, "w");
+	if (f == NULL) {
+		fprintf(stderr, "error: cannot create %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	if (fwrite(&cap, sizeof(cap), 1, f) != 1 ||
+		(recs_count != 0 && fwrite(recs, sizeof(*recs), recs_count, f) != recs_count) ||
+		fclose(f) != 0) {
+		fprintf(stderr, "error: cannot write %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	printf("wrote %u backtrace record(s) for zone %s to %s\n", recs_count, name, path);
+
+	release_zone_btrecords(recs, recs_count);
+}
+
+static zone_btrecord_t *load_zone_btrecords(const char *path, zlog_capture_t *cap)
+{
+	zone_btrecord_t *recs;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		fprintf(stderr, "error: cannot open %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	if (fread(cap, sizeof(*cap), 1, f) != 1 ||
+		memcmp(cap->magic, ZLOG_CAPTURE_MAGIC, sizeof(cap->magic)) != 0) {
+		fprintf(stderr, "error: %s is not a zlog capture\n", path);
+		exit(1);
+	}
+	if (cap->version != ZLOG_CAPTURE_VERSION || cap->record_size != sizeof(zone_btrecord_t)) {
+		fprintf(stderr, "error: %s: unsupported capture version %u (record size %u)\n",
+				path, cap->version, cap->record_size);
+		exit(1);
+	}
+	cap->zone_name[sizeof(cap->zone_name) - 1] = '\0';
+	cap->kernel_uuid[sizeof(cap->kernel_uuid) - 1] = '\0';
+	cap->osversion[sizeof(cap->osversion) - 1] = '\0';
+
+	recs = calloc(cap->records ? cap->records : 1, sizeof(*recs));
+	if (recs == NULL) {
+		fprintf(stderr, "error: failed to allocate %llu backtrace records\n", cap->records);
+		exit(1);
+	}
+	if (fread(recs, sizeof(*recs), cap->records, f) != cap->records) {
+		fprintf(stderr, "error: %s is truncated\n", path);
+		exit(1);
+	}
+	fclose(f);
+	return recs;
 }
 
 static void list_zones_with_zlog_enabled(void)
@@ -200,25 +541,19 @@ get_osversion(char *buffer, size_t buffer_len)
 int main(int argc, char *argv[])
 {
 	int c, topN = 0;
-	const char *zone_name = NULL;
-
-	/* Identifier string for SpeedTracer parsing */
-	printf("%s\n\n", VERSION_STRING);
+	const char *zone_name = NULL, *capture_path = NULL, *load_path = NULL;
+	bool list_zones = false, collapsed = false, symbolicate = true, same_kernel;
+	FILE *header;
 	char version_buffer[32] = {0};
-	get_osversion(version_buffer, sizeof(version_buffer));
-	printf("Collected on build: %s\n\n", version_buffer);
-
-	if (argc == 1) {
-		/* default when no arguments are specified */
-		list_zones_with_zlog_enabled();
-		printf("Run 'zlog -h' for usage info.\n");
-		return 0;
-	}
+	zone_btrecord_t *recs;
+	unsigned int recs_count, i, j;
+	zlog_capture_t cap, now;
+	zlog_symbols_t syms;
 
-	while ((c = getopt(argc, argv, "tz:n:lh")) != -1) {
+	while ((c = getopt(argc, argv, "tz:n:lcuw:r:h")) != -1) {
 		switch(c) {
 			case 't':
-				list_zones_with_zlog_enabled();
+				list_zones = true;
 				break;
 			case 'z':
 				zone_name = optarg;
@@ -229,6 +564,18 @@ int main(int argc, char *argv[])
 			case 'l':
 				topN = 1;
 				break;
+			case 'c':
+				collapsed = true;
+				break;
+			case 'u':
+				symbolicate = false;
+				break;
+			case 'w':
+				capture_path = optarg;
+				break;
+			case 'r':
+				load_path = optarg;
+				break;
 			case 'h':
 				usage(stdout, argv);
 				break;
@@ -242,10 +589,82 @@ int main(int argc, char *argv[])
 	if (optind < argc) {
 		usage(stderr, argv);
 	}
+	/* -c prints all of the backtraces of one zone, and -u needs -c */
+	if (collapsed && (!(zone_name || load_path) || topN != 0 || list_zones)) {
+		usage(stderr, argv);
+	}
+	if (!symbolicate && !collapsed) {
+		usage(stderr, argv);
+	}
+	/* -w captures one zone as it is, and -r reads a capture instead of a zone */
+	if (capture_path && (!zone_name || topN != 0 || collapsed || load_path)) {
+		usage(stderr, argv);
+	}
+	if (load_path && zone_name) {
+		usage(stderr, argv);
+	}
+
+	/* Identifier string for SpeedTracer parsing; kept out of collapsed stacks */
+	header = collapsed ? stderr : stdout;
+	fprintf(header, "%s\n\n", VERSION_STRING);
+	get_osversion(version_buffer, sizeof(version_buffer));
+	fprintf(header, "Collected on build: %s\n\n", version_buffer);
 
-	if (zone_name) {
-		print_zone_info(zone_name);
-		get_zone_btrecords(zone_name, topN);
+	if (argc == 1) {
+		/* default when no arguments are specified */
+		list_zones_with_zlog_enabled();
+		printf("Run 'zlog -h' for usage info.\n");
+		return 0;
+	}
+	if (list_zones) {
+		list_zones_with_zlog_enabled();
+	}
+
+	if (capture_path) {
+		capture_zone_btrecords(zone_name, capture_path);
+	} else if (load_path) {
+		/*
+		 * Symbolicate with the running kernel if the capture was made on this boot, and otherwise
+		 * print the addresses unslid.
+		 */
+		recs = load_zone_btrecords(load_path, &cap);
+		recs_count = (unsigned int)cap.records;
+		memset(&now, 0, sizeof(now));
+		get_kernel_identity(&now);
+		same_kernel = (cap.flags & now.flags & ZLOG_CAPTURE_SLIDE) &&
+			cap.kernel_slide == now.kernel_slide &&
+			strcmp(cap.kernel_uuid, now.kernel_uuid) == 0;
+		if (!same_kernel && (cap.flags & ZLOG_CAPTURE_SLIDE)) {
+			for (i = 0; i < recs_count; i++) {
+				for (j = 0; j < MAX_ZTRACE_DEPTH && recs[i].bt[j]; j++) {
+					recs[i].bt[j] -= cap.kernel_slide;
+				}
+			}
+		}
+		create_symbols(&syms, same_kernel);
+		if (!same_kernel && (cap.flags & ZLOG_CAPTURE_SLIDE)) {
+			syms.unslid_uuid = cap.kernel_uuid;
+		}
+		fprintf(header, "Captured on build: %s\n\n", cap.osversion);
+		if (collapsed) {
+			print_collapsed_stacks(recs, recs_count, symbolicate, &syms);
+		} else {
+			printf("zone name            : %s\n\n", cap.zone_name);
+			print_zone_btrecords(cap.zone_name, recs, recs_count, topN, &syms);
+		}
+		release_symbols(&syms);
+		free(recs);
+	} else if (zone_name) {
+		copy_zone_btrecords(zone_name, &recs, &recs_count);
+		create_symbols(&syms, true);
+		if (collapsed) {
+			print_collapsed_stacks(recs, recs_count, symbolicate, &syms);
+		} else {
+			print_zone_info(zone_name);
+			print_zone_btrecords(zone_name, recs, recs_count, topN, &syms);
+		}
+		release_symbols(&syms);
+		release_zone_btrecords(recs, recs_count);
 	} else {
 		/* -n or -l was specified without -z */
 		if (topN != 0) {
@@ -69,6 +69,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <mach/mach.h>
 #include <mach_debug/mach_debug.h>
 #include <mach/mach_error.h>
@@ -123,6 +130,34 @@ mach_zone_info_t *kalloc_zone_info = NULL;
 char *kalloc_zone_delta = NULL;
 uint64_t kalloc_info_idx = 0;
 
+/*
+ * Every zone seen gets a slot, found by name, that persists across -d
+ * samples: the maxima that deltas are measured against, and everything
+ * that depends only on the name (whether it matches the command line,
+ * its kalloc type and coalesced size class), are kept there.  Zones are
+ * usually reported in the same order each time, so the slot that the
+ * same index had in the last sample is checked before the hash.
+ */
+struct zone_slot {
+    mach_zone_name_t zs_name;
+    uint64_t         zs_max_cur_size;
+    uint64_t         zs_max_sum_size;
+    kalloc_zone_type zs_type;
+    boolean_t        zs_new;        /* not in an earlier sample */
+    boolean_t        zs_match;      /* name matches the command line */
+    int              zs_kidx;       /* index in kalloc_zone_info, or -1 */
+    int              zs_next;       /* hash chain */
+};
+
+#define ZONE_SLOT_BUCKETS 1024
+
+static struct zone_slot *zone_slots = NULL;
+static unsigned int zone_slots_cnt = 0;
+static unsigned int zone_slots_max = 0;
+static int zone_slot_hash[ZONE_SLOT_BUCKETS];
+static int *zone_slot_of = NULL;        /* slot of each zone in the last sample */
+static unsigned int zone_slot_of_cnt = 0;
+
 static void usage(FILE *stream);
 static void printzone(mach_zone_name_t *, mach_zone_info_t *);
 static void colprintzone(mach_zone_name_t *, mach_zone_info_t *);
@@ -130,8 +165,11 @@ static void colprintzoneheader(void);
 static void PrintZones(mach_zone_name_t *names, mach_zone_info_t *info,
                        unsigned int count, char *deltas,
                        uint64_t *zoneElements);
+static void PrintZonesJSON(mach_zone_name_t *names, mach_zone_info_t *info,
+                           unsigned int count, char *deltas);
+static void json_string(const char *s, size_t maxlen);
 static boolean_t substr(const char *a, size_t alen, const char *b, size_t blen);
-static int  find_deltas(mach_zone_name_t *, mach_zone_info_t *, mach_zone_info_t *,
+static int  find_deltas(mach_zone_name_t *, mach_zone_info_t *,
                         char *, int, int);
 static bool sort_zones(mach_zone_name_t **name, mach_zone_info_t **info,
                        char **deltas, unsigned int *infoCnt);
@@ -141,8 +179,14 @@ static void free_zone_info_resources(mach_zone_name_t *name,
 static uint64_t get_kalloc_info_idx(uint64_t sizeclass);
 static char *get_kalloc_sizep(char *name);
 static kalloc_zone_type get_zone_type(mach_zone_name_t name);
-static void coalesce_kalloc(mach_zone_name_t name, mach_zone_info_t info,
+struct zone_slot;
+static struct zone_slot *find_zone_slot(unsigned int idx, mach_zone_name_t *name,
+                                        mach_zone_info_t *info);
+static void coalesce_kalloc(struct zone_slot *zs, mach_zone_info_t info,
                             char *deltas);
+static int  record_zones(const char *path, unsigned int interval);
+static int  report_growth(const char *path, long long from, long long to,
+                          unsigned int count);
 
 static int  SortName(void * thunk, const void * left, const void * right);
 static int  SortSize(void * thunk, const void * left, const void * right);
@@ -150,6 +194,8 @@ static void PrintLarge(mach_memory_info_t *wiredInfo, unsigned int wiredInfoCnt,
     mach_zone_info_t *zoneInfo, mach_zone_name_t *zoneNames,
     unsigned int zoneCnt, uint64_t zoneElements,
     int (*func)(void *, const void *, const void *), boolean_t column);
+static void PrintLargeJSON(mach_memory_info_t *wiredInfo, unsigned int wiredInfoCnt,
+    mach_zone_name_t *zoneNames, unsigned int zoneCnt);
 
 static char *program;
 
@@ -160,7 +206,9 @@ static boolean_t ShowLarge = TRUE;
 static boolean_t SortZones = FALSE;
 static boolean_t ColFormat = TRUE;
 static boolean_t PrintHeader = TRUE;
+static boolean_t JsonFormat = FALSE;
 static kalloc_zone_type CoalesceKalloc = KALLOC_ZONE_DEFAULT;
+static unsigned int LargeCount = 0;
 
 static unsigned long long totalsize = 0;
 static unsigned long long totalused = 0;
@@ -231,7 +279,9 @@ sigintr(__unused int signum)
 static void
 usage(FILE *stream)
 {
-	fprintf(stream, "usage: %s [-w] [-s] [-c] [-h] [-H] [-t] [-d] [-l] [-L] [-k] [-kt] [-kd] [name]\n\n", program);
+	fprintf(stream, "usage: %s [-w] [-s] [-c] [-h] [-H] [-t] [-d] [-l] [-L] [-k] [-kt] [-kd] [-j] [-n count] [name]\n", program);
+	fprintf(stream, "       %s -r file [-i seconds] [name]\n", program);
+	fprintf(stream, "       %s -g file [-b start] [-e end] [-n count] [-H] [name]\n\n", program);
 	fprintf(stream, "\t-w\tshow wasted memory for each zone\n");
 	fprintf(stream, "\t-s\tsort zones by wasted memory\n");
 	fprintf(stream, "\t-c\t(default) display output formatted in columns\n");
@@ -241,9 +291,16 @@ usage(FILE *stream)
 	fprintf(stream, "\t-d\tdisplay deltas over time\n");
 	fprintf(stream, "\t-l\t(default) display wired memory info after zone info\n");
 	fprintf(stream, "\t-L\tdo not show wired memory info, only show zone info\n");
+	fprintf(stream, "\t-j\tdisplay zones and wired memory as one JSON object per sample\n");
     fprintf(stream, "\t-k\tcoalesce all kalloc zones for specific size\n");
     fprintf(stream, "\t-kt\tcoalesce kalloc type/kext zones with default\n");
     fprintf(stream, "\t-kd\tcoalesce kalloc data zones with default\n");
+	fprintf(stream, "\t-r\trecord zone sizes to file every -i seconds (default 60)\n");
+	fprintf(stream, "\t-g\treport the zones that grew most in a recording\n");
+	fprintf(stream, "\t-b, -e\tstart and end of the report, in seconds from the start\n");
+	fprintf(stream, "\t\tof the recording, or if negative, before its end\n");
+	fprintf(stream, "\t-n\treport the top count zones (default 20, 0 for all), or\n");
+	fprintf(stream, "\t\tshow the first count wired memory sites of each kind\n");
 	fprintf(stream, "\nAny option (including default options) can be overridden by specifying the option in upper-case.\n\n");
 	exit(stream != stdout);
 }
@@ -257,8 +314,8 @@ main(int argc, char **argv)
 	unsigned int infoCnt = 0;
 	mach_memory_info_t *wiredInfo = NULL;
 	unsigned int wiredInfoCnt = 0;
-	mach_zone_info_t *max_info = NULL;
 	char            *deltas = NULL;
+	unsigned int    deltasCnt = 0;
 	uint64_t        zoneElements;
     unsigned all_infoCnt = 0;
     bool replaced_resources = false;
@@ -268,6 +325,12 @@ main(int argc, char **argv)
 	int             first_time = 1;
 	int     must_print = 1;
 	int             interval = 1;
+	const char      *recordLog = NULL;
+	const char      *growthLog = NULL;
+	unsigned int    recordInterval = 60;
+	long long       growthFrom = 0;
+	long long       growthTo = 0;
+	int             topCount = -1;
 
 	signal(SIGINT, sigintr);
 
@@ -305,12 +368,31 @@ main(int argc, char **argv)
 			usage(stdout);
 		} else if (streql(argv[i], "-H")) {
 			PrintHeader = FALSE;
+		} else if (streql(argv[i], "-j")) {
+			JsonFormat = TRUE;
+		} else if (streql(argv[i], "-J")) {
+			JsonFormat = FALSE;
         } else if (streql(argv[i], "-k")) {
             CoalesceKalloc |= (KALLOC_ZONE_TYPE | KALLOC_ZONE_KEXT | KALLOC_ZONE_DATA);
         } else if (streql(argv[i], "-kt")) {
             CoalesceKalloc |= (KALLOC_ZONE_TYPE | KALLOC_ZONE_KEXT);
         } else if (streql(argv[i], "-kd")) {
             CoalesceKalloc |= KALLOC_ZONE_DATA;
+		} else if (streql(argv[i], "-r") && i + 1 < argc) {
+			recordLog = argv[++i];
+		} else if (streql(argv[i], "-i") && i + 1 < argc) {
+			recordInterval = (unsigned int)strtoul(argv[++i], NULL, 0);
+			if (recordInterval == 0) {
+				usage(stderr);
+			}
+		} else if (streql(argv[i], "-g") && i + 1 < argc) {
+			growthLog = argv[++i];
+		} else if (streql(argv[i], "-b") && i + 1 < argc) {
+			growthFrom = strtoll(argv[++i], NULL, 0);
+		} else if (streql(argv[i], "-e") && i + 1 < argc) {
+			growthTo = strtoll(argv[++i], NULL, 0);
+		} else if (streql(argv[i], "-n") && i + 1 < argc) {
+			topCount = (int)strtoul(argv[++i], NULL, 0);
 		} else if (streql(argv[i], "--")) {
 			i++;
 			break;
@@ -336,11 +418,29 @@ main(int argc, char **argv)
 		usage(stderr);
 	}
 
+	if (recordLog || growthLog) {
+		if (recordLog && growthLog) {
+			usage(stderr);
+		}
+		/* zones are recorded and reported individually */
+		CoalesceKalloc = KALLOC_ZONE_DEFAULT;
+		exit(recordLog ? record_zones(recordLog, recordInterval) :
+		    report_growth(growthLog, growthFrom, growthTo,
+		    topCount < 0 ? 20 : (unsigned int)topCount));
+	}
+	if (topCount > 0) {
+		LargeCount = (unsigned int)topCount;
+	}
+
 	if (ShowDeltas) {
 		SortZones = FALSE;
 		ColFormat = TRUE;
 		PrintHeader = TRUE;
 	}
+	if (JsonFormat) {
+		/* zones are reported individually, with their kalloc group */
+		CoalesceKalloc = KALLOC_ZONE_DEFAULT;
+	}
 
 	if (ShowWasted) {
 		columns[COL_FRAG_SIZE].visible = true;
@@ -369,25 +469,34 @@ main(int argc, char **argv)
         all_infoCnt = infoCnt;
         if (CoalesceKalloc != KALLOC_ZONE_DEFAULT) {
             all_infoCnt += KALLOC_SIZECLASSES;
-            kalloc_zone_name = (mach_zone_name_t *) calloc(KALLOC_SIZECLASSES, sizeof *name);
-            kalloc_zone_info = (mach_zone_info_t *) calloc(KALLOC_SIZECLASSES, sizeof *info);
-            if (!kalloc_zone_name || !kalloc_zone_info) {
-                fprintf(stderr, "%s: calloc failed to allocate memory\n", program);
-                exit(1);
+            if (first_time) {
+                /* size classes keep their index from sample to sample */
+                kalloc_zone_name = (mach_zone_name_t *) calloc(KALLOC_SIZECLASSES, sizeof *name);
+                kalloc_zone_info = (mach_zone_info_t *) calloc(KALLOC_SIZECLASSES, sizeof *info);
+                if (!kalloc_zone_name || !kalloc_zone_info) {
+                    fprintf(stderr, "%s: calloc failed to allocate memory\n", program);
+                    exit(1);
+                }
             }
         }
 
-		if (first_time) {
-            deltas = (char *)malloc(all_infoCnt);
-            max_info = (mach_zone_info_t *)malloc((infoCnt * sizeof *info));
-            kalloc_zone_delta = deltas + infoCnt;
-            if (!deltas || !max_info) {
+        /*
+         * The number of zones can grow between samples.
+         */
+		if (all_infoCnt > deltasCnt) {
+            deltas = (char *)realloc(deltas, all_infoCnt);
+            if (!deltas) {
                 fprintf(stderr, "%s: malloc failed to allocate memory\n", program);
                 exit(1);
             }
+            deltasCnt = all_infoCnt;
 		}
+        kalloc_zone_delta = deltas + infoCnt;
+        if (CoalesceKalloc != KALLOC_ZONE_DEFAULT) {
+            bzero(kalloc_zone_delta, KALLOC_SIZECLASSES);
+        }
 
-		must_print = find_deltas(name, info, max_info, deltas, infoCnt, first_time);
+		must_print = find_deltas(name, info, deltas, infoCnt, first_time);
 
         if (SortZones) {
             /*
@@ -397,7 +506,23 @@ main(int argc, char **argv)
             replaced_resources = sort_zones(&name, &info, &deltas, &infoCnt);
         }
 		zoneElements = 0;
-		if (must_print) {
+		if (JsonFormat) {
+			if (must_print || (ShowLarge && first_time)) {
+				totalsize = totalused = totalsum = 0;
+				totalfragmented = totalcollectable = 0;
+				printf("{\"time\":%ld,", (long)time(NULL));
+				PrintZonesJSON(name, info, infoCnt, deltas);
+				if (ShowLarge && first_time) {
+					PrintLargeJSON(wiredInfo, wiredInfoCnt, name, nameCnt);
+				}
+				printf(",\"totals\":{\"size\":%llu,\"used\":%llu,"
+				    "\"wasted\":%llu,\"fragmented\":%llu,"
+				    "\"collectable\":%llu,\"allocs\":%llu}}\n",
+				    totalsize, totalused, totalsize - totalused,
+				    totalfragmented, totalcollectable, totalsum);
+				fflush(stdout);
+			}
+		} else if (must_print) {
 			if (ColFormat) {
 				if (!first_time) {
 					printf("\n");
@@ -411,7 +536,7 @@ main(int argc, char **argv)
             }
 		}
 
-		if (ShowLarge && first_time) {
+		if (ShowLarge && first_time && !JsonFormat) {
 			PrintLarge(wiredInfo, wiredInfoCnt, &info[0], &name[0],
 			    nameCnt, zoneElements,
 			    SortZones ? &SortSize : &SortName, ColFormat);
@@ -423,10 +548,6 @@ main(int argc, char **argv)
          * Clean up resources and reset deltas
          */
         free_zone_info_resources(name, info, infoCnt, !replaced_resources);
-        if (CoalesceKalloc != KALLOC_ZONE_DEFAULT) {
-            bzero(kalloc_zone_delta, KALLOC_SIZECLASSES);
-            kalloc_info_idx = 0;
-        }
 
 		if ((wiredInfo != NULL) && (wiredInfoCnt != 0)) {
 			kr = vm_deallocate(mach_task_self(), (vm_address_t) wiredInfo,
@@ -438,7 +559,7 @@ main(int argc, char **argv)
 			}
 		}
 
-		if ((ShowWasted || ShowTotal) && PrintHeader && !ShowDeltas) {
+		if ((ShowWasted || ShowTotal) && PrintHeader && !ShowDeltas && !JsonFormat) {
 			printf("\nZONE TOTALS\n");
 			printf("---------------------------------------------\n");
 			printf("TOTAL SIZE        = %llu\n", totalsize);
@@ -628,6 +749,94 @@ PrintZones(mach_zone_name_t *names, mach_zone_info_t *info,
     }
 }
 
+/*
+ * -j: print a string as JSON, reading at most maxlen bytes of it.
+ */
+static void
+json_string(const char *s, size_t maxlen)
+{
+	size_t i;
+
+	putchar('"');
+	for (i = 0; i < maxlen && s[i]; i++) {
+		unsigned char c = (unsigned char)s[i];
+
+		if (c == '"' || c == '\\') {
+			printf("\\%c", c);
+		} else if (c < 0x20) {
+			printf("\\u%04x", c);
+		} else {
+			putchar(c);
+		}
+	}
+	putchar('"');
+}
+
+static void
+PrintZonesJSON(mach_zone_name_t *names, mach_zone_info_t *info,
+               unsigned int count, char *deltas)
+{
+	unsigned long long used, size, fragmented, collectable, elems;
+	kalloc_zone_type type;
+	char namebuf[sizeof names->mzn_name + 1];
+	const char *sizep, *group;
+	size_t grouplen;
+	bool first = true;
+
+	printf("\"zones\":[");
+	for (unsigned int i = 0; i < count; i++) {
+		const mach_zone_info_t *zi = &info[i];
+
+		if (!deltas[i]) {
+			continue;
+		}
+		used = zi->mzi_elem_size * zi->mzi_count;
+		size = zi->mzi_cur_size;
+		collectable = GET_MZI_COLLECTABLE_BYTES(zi->mzi_collectable);
+		fragmented = size - used - collectable;
+		elems = zi->mzi_elem_size ? zi->mzi_cur_size / zi->mzi_elem_size : 0;
+		totalused += used;
+		totalsize += size;
+		totalsum += zi->mzi_sum_size;
+		totalcollectable += collectable;
+		totalfragmented += fragmented;
+
+		printf("%s{\"name\":", first ? "" : ",");
+		json_string(names[i].mzn_name, sizeof names[i].mzn_name);
+		printf(",\"elem_size\":%llu,\"cur_size\":%llu,\"max_size\":%llu,"
+		    "\"cur_elems\":%llu,\"inuse\":%llu,\"alloc_size\":%llu,"
+		    "\"total_allocs\":%llu,\"total_frees\":%llu,"
+		    "\"wasted\":%llu,\"fragmented\":%llu,\"collectable\":%llu,"
+		    "\"exhaustible\":%s,\"collectable_zone\":%s,\"kalloc\":",
+		    zi->mzi_elem_size, size, zi->mzi_max_size,
+		    elems, zi->mzi_count, zi->mzi_alloc_size,
+		    zi->mzi_sum_size, zi->mzi_sum_size - used,
+		    size - used, fragmented, collectable,
+		    zi->mzi_exhaustible ? "true" : "false",
+		    GET_MZI_COLLECTABLE_FLAG(zi->mzi_collectable) ? "true" : "false");
+
+		type = get_zone_type(names[i]);
+		if (type == KALLOC_ZONE_NONE) {
+			printf("null}");
+		} else {
+			snprintf(namebuf, sizeof namebuf, "%.*s",
+			    (int)sizeof names[i].mzn_name, names[i].mzn_name);
+			sizep = get_kalloc_sizep(namebuf);
+			group = kalloc_zone_names[ffs((int)type)];
+			grouplen = strlen(group);
+			if (grouplen && group[grouplen - 1] == '.') {
+				grouplen--;
+			}
+			printf("{\"group\":");
+			json_string(group, grouplen);
+			printf(",\"size_class\":%llu}}",
+			    sizep ? strtoull(sizep, NULL, 10) : zi->mzi_elem_size);
+		}
+		first = false;
+	}
+	printf("]");
+}
+
 static void
 colprintzoneheader(void)
 {
@@ -688,11 +897,27 @@ free_zone_info_resources(mach_zone_name_t *name, mach_zone_info_t *info,
             exit(1);
         }
     }
-    
-    if (CoalesceKalloc != KALLOC_ZONE_DEFAULT) {
-        free(kalloc_zone_name);
-        free(kalloc_zone_info);
+}
+
+static unsigned long long
+zone_waste(const mach_zone_info_t *info)
+{
+    return info->mzi_cur_size - (info->mzi_elem_size * info->mzi_count);
+}
+
+static int
+SortWaste(void *thunk, const void *left, const void *right)
+{
+    const mach_zone_info_t *info = thunk;
+    const unsigned long long wastel = zone_waste(&info[*(const unsigned int *)left]);
+    const unsigned long long waster = zone_waste(&info[*(const unsigned int *)right]);
+
+    if (wastel > waster) {
+        return -1;
+    } else if (wastel < waster) {
+        return 1;
     }
+    return 0;
 }
 
 /*
@@ -702,7 +927,7 @@ static bool
 sort_zones(mach_zone_name_t **name, mach_zone_info_t **info, char **deltas,
     unsigned int *infoCnt)
 {
-    unsigned int i, j;
+    unsigned int i;
     mach_zone_name_t *all_name = *name;
     mach_zone_info_t *all_info = *info;
     char *all_deltas = *deltas;
@@ -734,37 +959,41 @@ sort_zones(mach_zone_name_t **name, mach_zone_info_t **info, char **deltas,
         free_zone_info_resources(*name, *info, tinfoCnt, true);
         replaced_resources = true;
     }
-    for (i = 0; i < all_infoCnt - 1; i++) {
-        for (j = i + 1; j < all_infoCnt; j++) {
-            unsigned long long wastei, wastej;
-
-            wastei = (all_info[i].mzi_cur_size -
-                (all_info[i].mzi_elem_size *
-                all_info[i].mzi_count));
-            wastej = (all_info[j].mzi_cur_size -
-                (all_info[j].mzi_elem_size *
-                all_info[j].mzi_count));
-
-            if (wastej > wastei) {
-                mach_zone_info_t tinfo;
-                mach_zone_name_t tname;
-                char tdelta;
-
-                tinfo = all_info[i];
-                all_info[i] = all_info[j];
-                all_info[j] = tinfo;
-
-                tname = all_name[i];
-                all_name[i] = all_name[j];
-                all_name[j] = tname;
-                
-                tdelta = all_deltas[i];
-                all_deltas[i] = all_deltas[j];
-                all_deltas[j] = tdelta;
-                
-            }
-        }
+    /*
+     * Sort an index rather than swapping the three parallel arrays
+     * pairwise, then lay them out once in that order.
+     */
+    unsigned int *order = malloc(sizeof(*order) * all_infoCnt);
+    mach_zone_name_t *sorted_name = malloc(sizeof(mach_zone_name_t) * all_infoCnt);
+    mach_zone_info_t *sorted_info = malloc(sizeof(mach_zone_info_t) * all_infoCnt);
+    char *sorted_deltas = malloc(all_infoCnt);
+    if (!order || !sorted_name || !sorted_info || !sorted_deltas) {
+        fprintf(stderr, "%s: malloc failed to allocate memory\n", program);
+        exit(1);
+    }
+    for (i = 0; i < all_infoCnt; i++) {
+        order[i] = i;
+    }
+    qsort_r(order, all_infoCnt, sizeof(*order), all_info, SortWaste);
+    for (i = 0; i < all_infoCnt; i++) {
+        sorted_name[i] = all_name[order[i]];
+        sorted_info[i] = all_info[order[i]];
+        sorted_deltas[i] = all_deltas[order[i]];
     }
+    memcpy(all_deltas, sorted_deltas, all_infoCnt);
+    free(sorted_deltas);
+    free(order);
+
+    if (replaced_resources) {
+        free(all_name);
+        free(all_info);
+    } else {
+        free_zone_info_resources(all_name, all_info, all_infoCnt, true);
+        replaced_resources = true;
+    }
+    all_name = sorted_name;
+    all_info = sorted_info;
+
     *name = all_name;
     *info = all_info;
     *deltas = all_deltas;
@@ -820,37 +1049,123 @@ get_zone_type(mach_zone_name_t name)
     return type;
 }
 
+static unsigned int
+zone_name_hash(const char *name)
+{
+    unsigned int hash = 2166136261u;  /* FNV-1a */
+    for (size_t i = 0; i < ZONE_NAME_MAX_LEN && name[i]; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return hash % ZONE_SLOT_BUCKETS;
+}
+
 /*
- * Aggregate zone info's of requested kalloc zones.
+ * Return the slot for the zone at index idx of this sample, making one
+ * the first time a zone is seen.
+ */
+static struct zone_slot *
+find_zone_slot(unsigned int idx, mach_zone_name_t *name, mach_zone_info_t *info)
+{
+    if (idx < zone_slot_of_cnt) {
+        struct zone_slot *zs = &zone_slots[zone_slot_of[idx]];
+        if (strneql(zs->zs_name.mzn_name, name->mzn_name, ZONE_NAME_MAX_LEN)) {
+            return zs;
+        }
+    } else {
+        zone_slot_of = reallocf(zone_slot_of, (idx + 1) * sizeof *zone_slot_of);
+        if (!zone_slot_of) {
+            fprintf(stderr, "%s: malloc failed to allocate memory\n", program);
+            exit(1);
+        }
+        zone_slot_of_cnt = idx + 1;
+    }
+
+    if (!zone_slots) {
+        memset(zone_slot_hash, -1, sizeof zone_slot_hash);
+    }
+    const unsigned int bucket = zone_name_hash(name->mzn_name);
+    int slot;
+    for (slot = zone_slot_hash[bucket]; slot != -1; slot = zone_slots[slot].zs_next) {
+        if (strneql(zone_slots[slot].zs_name.mzn_name, name->mzn_name, ZONE_NAME_MAX_LEN)) {
+            break;
+        }
+    }
+
+    if (slot == -1) {
+        if (zone_slots_cnt == zone_slots_max) {
+            zone_slots_max = zone_slots_max ? 2 * zone_slots_max : 1024;
+            zone_slots = reallocf(zone_slots, zone_slots_max * sizeof *zone_slots);
+            if (!zone_slots) {
+                fprintf(stderr, "%s: malloc failed to allocate memory\n", program);
+                exit(1);
+            }
+        }
+        slot = (int)zone_slots_cnt++;
+        struct zone_slot *zs = &zone_slots[slot];
+        zs->zs_name = *name;
+        zs->zs_max_cur_size = 0;
+        zs->zs_max_sum_size = 0;
+        zs->zs_type = get_zone_type(*name);
+        zs->zs_new = TRUE;
+        zs->zs_match = substr(zname, znamelen, name->mzn_name,
+            strnlen(name->mzn_name, sizeof name->mzn_name));
+        zs->zs_kidx = -1;
+        if (CoalesceKalloc != KALLOC_ZONE_DEFAULT && info != NULL &&
+            (zs->zs_type & CoalesceKalloc)) {
+            const uint64_t kidx = get_kalloc_info_idx(info->mzi_elem_size);
+            if (kidx == kalloc_info_idx - 1 && kalloc_zone_info[kidx].mzi_elem_size == 0) {
+                /*
+                 * First time assignments for specific size
+                 */
+                mach_zone_name_t *kzn = kalloc_zone_name + kidx;
+                mach_zone_info_t *kzi = kalloc_zone_info + kidx;
+                snprintf(kzn->mzn_name, ZONE_NAME_MAX_LEN, "kalloc.%s",
+                         get_kalloc_sizep(name->mzn_name));
+                kzi->mzi_alloc_size = info->mzi_alloc_size;
+                kzi->mzi_elem_size = info->mzi_elem_size;
+                kzi->mzi_exhaustible = info->mzi_exhaustible;
+            }
+            zs->zs_kidx = (int)kidx;
+        }
+        zs->zs_next = zone_slot_hash[bucket];
+        zone_slot_hash[bucket] = slot;
+    }
+    zone_slot_of[idx] = slot;
+    return &zone_slots[slot];
+}
+
+/*
+ * Start a new sample of the coalesced kalloc zones: the names and sizes
+ * of the size classes stay, the totals are recounted.
  */
 static void
-coalesce_kalloc(mach_zone_name_t name, mach_zone_info_t info, char *deltas)
+reset_kalloc_info(void)
 {
-    kalloc_zone_type kalloc_type = get_zone_type(name);
-    if (kalloc_type == KALLOC_ZONE_NONE) {
-        return;
+    for (uint64_t i = 0; i < kalloc_info_idx; i++) {
+        mach_zone_info_t *kzi = kalloc_zone_info + i;
+        kzi->mzi_count = 0;
+        kzi->mzi_cur_size = 0;
+        kzi->mzi_max_size = 0;
+        kzi->mzi_sum_size = 0;
+        kzi->mzi_collectable = 0;
     }
-    
-    if (kalloc_type & CoalesceKalloc) {
-        uint64_t idx = get_kalloc_info_idx(info.mzi_elem_size);
+}
+
+/*
+ * Aggregate zone info's of requested kalloc zones.
+ */
+static void
+coalesce_kalloc(struct zone_slot *zs, mach_zone_info_t info, char *deltas)
+{
+    if (zs->zs_kidx != -1) {
+        const int idx = zs->zs_kidx;
         mach_zone_info_t *kzi = kalloc_zone_info + idx;
-        mach_zone_name_t *kzn = kalloc_zone_name + idx;
         if (*deltas) {
             kalloc_zone_delta[idx] = 1;
             *deltas = 0;
         }
         kzi->mzi_count += info.mzi_count;
         kzi->mzi_cur_size += info.mzi_cur_size;
-        if (idx == kalloc_info_idx - 1) {
-            /*
-             * First time assignments for specific size
-             */
-            snprintf(kzn->mzn_name, ZONE_NAME_MAX_LEN, "kalloc.%s",
-                     get_kalloc_sizep(name.mzn_name));
-            kzi->mzi_alloc_size = info.mzi_alloc_size;
-            kzi->mzi_elem_size = info.mzi_elem_size;
-            kzi->mzi_exhaustible = info.mzi_exhaustible;
-        }
         if (GET_MZI_COLLECTABLE_FLAG(info.mzi_collectable)) {
             SET_MZI_COLLECTABLE_BYTES(kzi->mzi_collectable,
                 GET_MZI_COLLECTABLE_BYTES(kzi->mzi_collectable) +
@@ -862,34 +1177,40 @@ coalesce_kalloc(mach_zone_name_t name, mach_zone_info_t info, char *deltas)
 }
 
 int
-find_deltas(mach_zone_name_t *name, mach_zone_info_t *info, mach_zone_info_t *max_info,
+find_deltas(mach_zone_name_t *name, mach_zone_info_t *info,
     char *deltas, int cnt, int first_time)
 {
 	int i;
 	int  found_one = 0;
 
+	if (CoalesceKalloc != KALLOC_ZONE_DEFAULT) {
+		reset_kalloc_info();
+	}
 	for (i = 0; i < cnt; i++) {
+		struct zone_slot *zs = find_zone_slot(i, &name[i], info);
+
 		deltas[i] = 0;
-		if (substr(zname, znamelen, name[i].mzn_name,
-		    strnlen(name[i].mzn_name, sizeof name[i].mzn_name))) {
-			if (first_time || info->mzi_cur_size > max_info->mzi_cur_size ||
-			    (ShowTotal && ((info->mzi_sum_size >> 1) > max_info->mzi_sum_size))) {
-				max_info->mzi_cur_size = info->mzi_cur_size;
-				max_info->mzi_sum_size = info->mzi_sum_size;
+		if (zs->zs_match) {
+			/* a zone that is new since the last sample is always shown */
+			if (first_time || zs->zs_new ||
+			    info->mzi_cur_size > zs->zs_max_cur_size ||
+			    (ShowTotal && ((info->mzi_sum_size >> 1) > zs->zs_max_sum_size))) {
+				zs->zs_max_cur_size = info->mzi_cur_size;
+				zs->zs_max_sum_size = info->mzi_sum_size;
 				deltas[i] = 1;
 				found_one = 1;
 			}
 		}
+		zs->zs_new = FALSE;
         /*
          * Caolesce kalloc zones outside the above if to ensure that we
          * consider all other kalloc zones for the size when one of them hits
          * conditions other than first_time.
          */
         if (CoalesceKalloc != KALLOC_ZONE_DEFAULT) {
-            coalesce_kalloc(name[i], *info, &deltas[i]);
+            coalesce_kalloc(zs, *info, &deltas[i]);
         }
 		info++;
-		max_info++;
 	}
 	return found_one;
 }
@@ -897,6 +1218,465 @@ find_deltas(mach_zone_name_t *name, mach_zone_info_t *info, mach_zone_info_t *ma
 /*********************************************************************
 *********************************************************************/
 
+/*
+ * Recording zone sizes (-r) and reporting growth from a recording (-g).
+ *
+ * The log starts with a header and is then a sequence of records, each
+ * a type byte followed by unsigned LEB128 varints:
+ *
+ *	'B' time		a recording starts, at this wall clock time
+ *	'N' id len name		a zone name, given the id used for it below
+ *	'S' dt n {id dsize dcount}*n
+ *				a sample dt seconds after the previous one,
+ *				with the zones whose size or element count
+ *				changed (zigzag-encoded differences)
+ *
+ * Ids and the values they are differenced against start again at every
+ * 'B' record, so a recording can be appended to an existing log.
+ */
+#define ZLOG_MAGIC      "ZPRL"
+#define ZLOG_VERSION    1
+
+struct zlog_header {
+	char     zh_magic[4];
+	uint32_t zh_version;
+};
+
+static size_t
+put_varint(uint8_t *p, uint64_t v)
+{
+	size_t n = 0;
+	while (v >= 0x80) {
+		p[n++] = (uint8_t)(v | 0x80);
+		v >>= 7;
+	}
+	p[n++] = (uint8_t)v;
+	return n;
+}
+
+static bool
+get_varint(const uint8_t **pp, const uint8_t *end, uint64_t *v)
+{
+	const uint8_t *p = *pp;
+	uint64_t result = 0;
+	for (unsigned shift = 0; p < end && shift < 64; shift += 7) {
+		const uint8_t b = *p++;
+		result |= (uint64_t)(b & 0x7f) << shift;
+		if ((b & 0x80) == 0) {
+			*pp = p;
+			*v = result;
+			return true;
+		}
+	}
+	return false;
+}
+
+static uint64_t
+zigzag(int64_t v)
+{
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t
+unzigzag(uint64_t v)
+{
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+/* what was last recorded for each zone slot */
+struct zone_recorded {
+	boolean_t zr_named;
+	uint64_t  zr_size;
+	uint64_t  zr_count;
+};
+
+static int
+record_zones(const char *path, unsigned int interval)
+{
+	int fd = open(path, O_RDWR | O_APPEND | O_CREAT, 0644);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		fprintf(stderr, "%s: %s: %s\n", program, path, strerror(errno));
+		return EX_CANTCREAT;
+	}
+
+	struct zlog_header zh;
+	if (st.st_size == 0) {
+		memcpy(zh.zh_magic, ZLOG_MAGIC, sizeof zh.zh_magic);
+		zh.zh_version = ZLOG_VERSION;
+		if (write(fd, &zh, sizeof zh) != sizeof zh) {
+			fprintf(stderr, "%s: %s: %s\n", program, path, strerror(errno));
+			return EX_IOERR;
+		}
+	} else if (pread(fd, &zh, sizeof zh, 0) != sizeof zh ||
+	    memcmp(zh.zh_magic, ZLOG_MAGIC, sizeof zh.zh_magic) != 0 ||
+	    zh.zh_version != ZLOG_VERSION) {
+		fprintf(stderr, "%s: %s: not a zprint recording\n", program, path);
+		return EX_DATAERR;
+	}
+
+	struct zone_recorded *recorded = NULL;
+	unsigned int recordedCnt = 0;
+	uint8_t *names = NULL, *samples = NULL;
+	size_t bufsize = 0;
+	time_t last = time(NULL);
+	uint8_t start[1 + 10];
+
+	start[0] = 'B';
+	if (write(fd, start, 1 + put_varint(start + 1, (uint64_t)last)) == -1) {
+		fprintf(stderr, "%s: %s: %s\n", program, path, strerror(errno));
+		return EX_IOERR;
+	}
+
+	while (!last_time) {
+		mach_zone_name_t *name = NULL;
+		unsigned int nameCnt = 0;
+		mach_zone_info_t *info = NULL;
+		unsigned int infoCnt = 0;
+
+		kern_return_t kr = mach_zone_info(mach_host_self(),
+		    &name, &nameCnt, &info, &infoCnt);
+		if (kr != KERN_SUCCESS) {
+			fprintf(stderr, "%s: mach_zone_info: %s (try running as root)\n",
+			    program, mach_error_string(kr));
+			return 1;
+		}
+		if (nameCnt != infoCnt) {
+			fprintf(stderr, "%s: mach_zone_name/ mach_zone_info: counts not equal?\n",
+			    program);
+			return 1;
+		}
+
+		const size_t need = infoCnt * (3 * 10 + 1 + 10 + 10 + ZONE_NAME_MAX_LEN);
+		if (need > bufsize) {
+			names = reallocf(names, need);
+			samples = reallocf(samples, need);
+			bufsize = need;
+		}
+		if (!names || !samples) {
+			fprintf(stderr, "%s: malloc failed to allocate memory\n", program);
+			exit(1);
+		}
+
+		size_t nameslen = 0, sampleslen = 0;
+		uint64_t nchanged = 0;
+		for (unsigned int i = 0; i < infoCnt; i++) {
+			struct zone_slot *zs = find_zone_slot(i, &name[i], &info[i]);
+			const unsigned int id = (unsigned int)(zs - zone_slots);
+			if (!zs->zs_match) {
+				continue;
+			}
+			if (id >= recordedCnt) {
+				const unsigned int cnt = zone_slots_max;
+				recorded = reallocf(recorded, cnt * sizeof *recorded);
+				if (!recorded) {
+					fprintf(stderr, "%s: malloc failed to allocate memory\n", program);
+					exit(1);
+				}
+				bzero(recorded + recordedCnt, (cnt - recordedCnt) * sizeof *recorded);
+				recordedCnt = cnt;
+			}
+			struct zone_recorded *zr = &recorded[id];
+			if (!zr->zr_named) {
+				const size_t len = strnlen(name[i].mzn_name, sizeof name[i].mzn_name);
+				names[nameslen++] = 'N';
+				nameslen += put_varint(names + nameslen, id);
+				nameslen += put_varint(names + nameslen, len);
+				memcpy(names + nameslen, name[i].mzn_name, len);
+				nameslen += len;
+				zr->zr_named = TRUE;
+			}
+			const int64_t dsize = (int64_t)(info[i].mzi_cur_size - zr->zr_size);
+			const int64_t dcount = (int64_t)(info[i].mzi_count - zr->zr_count);
+			if (dsize == 0 && dcount == 0) {
+				continue;
+			}
+			sampleslen += put_varint(samples + sampleslen, id);
+			sampleslen += put_varint(samples + sampleslen, zigzag(dsize));
+			sampleslen += put_varint(samples + sampleslen, zigzag(dcount));
+			zr->zr_size = info[i].mzi_cur_size;
+			zr->zr_count = info[i].mzi_count;
+			nchanged++;
+		}
+		free_zone_info_resources(name, info, infoCnt, true);
+
+		const time_t now = time(NULL);
+		uint8_t hdr[1 + 10 + 10];
+		size_t hdrlen = 0;
+		hdr[hdrlen++] = 'S';
+		hdrlen += put_varint(hdr + hdrlen, now > last ? (uint64_t)(now - last) : 0);
+		hdrlen += put_varint(hdr + hdrlen, nchanged);
+		last = now;
+
+		const struct iovec iov[3] = {
+			{ .iov_base = names, .iov_len = nameslen },
+			{ .iov_base = hdr, .iov_len = hdrlen },
+			{ .iov_base = samples, .iov_len = sampleslen },
+		};
+		if (writev(fd, iov, 3) == -1) {
+			fprintf(stderr, "%s: %s: %s\n", program, path, strerror(errno));
+			return EX_IOERR;
+		}
+
+		sleep(interval);
+	}
+
+	free(names);
+	free(samples);
+	free(recorded);
+	close(fd);
+	return 0;
+}
+
+/* the growth of each zone slot over the window */
+struct zone_growth {
+	boolean_t zg_present;
+	boolean_t zg_started;
+	int64_t   zg_size, zg_count;
+	int64_t   zg_start_size, zg_start_count;
+	int64_t   zg_end_size, zg_end_count;
+	time_t    zg_start_t, zg_end_t;
+};
+
+static struct zone_growth *zone_growth = NULL;
+static unsigned int zone_growthCnt = 0;
+
+/*
+ * Walk the records of a log.  Without a window only the times of the
+ * first and last samples are found; with one, the size of every zone
+ * at the start and end of the window is.
+ */
+static bool
+scan_zone_log(const uint8_t *p, const uint8_t *end, bool window,
+    time_t wstart, time_t wend, time_t *first, time_t *last, unsigned int *nsamples)
+{
+	int *slot_of_id = NULL;
+	uint64_t nids = 0;
+	time_t t = 0;
+	bool ok = true;
+
+	*nsamples = 0;
+	while (p < end && ok) {
+		const uint8_t type = *p++;
+		uint64_t v, id, len, n;
+
+		switch (type) {
+		case 'B':
+			if (!(ok = get_varint(&p, end, &v))) {
+				break;
+			}
+			t = (time_t)v;
+			if (window) {
+				for (unsigned int i = 0; i < zone_growthCnt; i++) {
+					zone_growth[i].zg_present = FALSE;
+					zone_growth[i].zg_size = 0;
+					zone_growth[i].zg_count = 0;
+				}
+			}
+			if (nids) {
+				memset(slot_of_id, -1, nids * sizeof *slot_of_id);
+			}
+			break;
+		case 'N':
+			if (!(ok = get_varint(&p, end, &id) && get_varint(&p, end, &len) &&
+			    len < ZONE_NAME_MAX_LEN && len <= (uint64_t)(end - p) && id < UINT_MAX)) {
+				break;
+			}
+			if (id >= nids) {
+				const uint64_t cnt = id + 1 > 2 * nids ? id + 1 : 2 * nids;
+				slot_of_id = reallocf(slot_of_id, cnt * sizeof *slot_of_id);
+				if (!slot_of_id) {
+					fprintf(stderr, "%s: malloc failed to allocate memory\n", program);
+					exit(1);
+				}
+				memset(slot_of_id + nids, -1, (cnt - nids) * sizeof *slot_of_id);
+				nids = cnt;
+			}
+			mach_zone_name_t zn;
+			bzero(&zn, sizeof zn);
+			memcpy(zn.mzn_name, p, len);
+			p += len;
+			const struct zone_slot *zs = find_zone_slot((unsigned int)id, &zn, NULL);
+			slot_of_id[id] = (int)(zs - zone_slots);
+			if (zone_slots_cnt > zone_growthCnt) {
+				zone_growth = reallocf(zone_growth, zone_slots_max * sizeof *zone_growth);
+				if (!zone_growth) {
+					fprintf(stderr, "%s: malloc failed to allocate memory\n", program);
+					exit(1);
+				}
+				bzero(zone_growth + zone_growthCnt,
+				    (zone_slots_max - zone_growthCnt) * sizeof *zone_growth);
+				zone_growthCnt = zone_slots_max;
+			}
+			break;
+		case 'S':
+			if (!(ok = get_varint(&p, end, &v) && get_varint(&p, end, &n))) {
+				break;
+			}
+			t += (time_t)v;
+			for (uint64_t i = 0; i < n && ok; i++) {
+				uint64_t dsize, dcount;
+				if (!(ok = get_varint(&p, end, &id) && get_varint(&p, end, &dsize) &&
+				    get_varint(&p, end, &dcount) && id < nids && slot_of_id[id] != -1)) {
+					break;
+				}
+				if (window) {
+					struct zone_growth *zg = &zone_growth[slot_of_id[id]];
+					zg->zg_size += unzigzag(dsize);
+					zg->zg_count += unzigzag(dcount);
+					zg->zg_present = TRUE;
+				}
+			}
+			if (!ok) {
+				break;
+			}
+			if (*nsamples == 0) {
+				*first = t;
+			}
+			*last = t;
+			if (window && t >= wstart && t <= wend) {
+				for (unsigned int i = 0; i < zone_slots_cnt; i++) {
+					struct zone_growth *zg = &zone_growth[i];
+					if (!zg->zg_present || !zone_slots[i].zs_match) {
+						continue;
+					}
+					if (!zg->zg_started) {
+						zg->zg_started = TRUE;
+						zg->zg_start_size = zg->zg_size;
+						zg->zg_start_count = zg->zg_count;
+						zg->zg_start_t = t;
+					}
+					zg->zg_end_size = zg->zg_size;
+					zg->zg_end_count = zg->zg_count;
+					zg->zg_end_t = t;
+				}
+				(*nsamples)++;
+			} else if (!window) {
+				(*nsamples)++;
+			}
+			break;
+		default:
+			ok = false;
+			break;
+		}
+	}
+	free(slot_of_id);
+	return ok;
+}
+
+static int
+SortGrowth(void *thunk, const void *left, const void *right)
+{
+	const struct zone_growth *zg = thunk;
+	const struct zone_growth *l = &zg[*(const unsigned int *)left];
+	const struct zone_growth *r = &zg[*(const unsigned int *)right];
+	const int64_t lg = l->zg_end_size - l->zg_start_size;
+	const int64_t rg = r->zg_end_size - r->zg_start_size;
+
+	if (lg > rg) {
+		return -1;
+	} else if (lg < rg) {
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * A window bound is seconds from the start of the recording, or if
+ * negative, seconds before its last sample.
+ */
+static time_t
+window_time(long long bound, time_t first, time_t last)
+{
+	return bound < 0 ? last + bound : first + bound;
+}
+
+static int
+report_growth(const char *path, long long from, long long to, unsigned int count)
+{
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		fprintf(stderr, "%s: %s: %s\n", program, path, strerror(errno));
+		return EX_NOINPUT;
+	}
+	if (st.st_size < (off_t)sizeof(struct zlog_header)) {
+		fprintf(stderr, "%s: %s: not a zprint recording\n", program, path);
+		return EX_DATAERR;
+	}
+	const uint8_t *base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		fprintf(stderr, "%s: %s: %s\n", program, path, strerror(errno));
+		return EX_IOERR;
+	}
+	const struct zlog_header *zh = (const void *)base;
+	if (memcmp(zh->zh_magic, ZLOG_MAGIC, sizeof zh->zh_magic) != 0 ||
+	    zh->zh_version != ZLOG_VERSION) {
+		fprintf(stderr, "%s: %s: not a zprint recording\n", program, path);
+		return EX_DATAERR;
+	}
+	const uint8_t *p = base + sizeof *zh, *end = base + st.st_size;
+
+	time_t first = 0, last = 0;
+	unsigned int nsamples;
+	if (!scan_zone_log(p, end, false, 0, 0, &first, &last, &nsamples)) {
+		/* e.g. a recording cut short in the middle of a record */
+		fprintf(stderr, "%s: %s: ignoring damaged data after the last good sample\n",
+		    program, path);
+	}
+	if (nsamples == 0) {
+		fprintf(stderr, "%s: %s: no samples recorded\n", program, path);
+		return EX_DATAERR;
+	}
+	const time_t wstart = window_time(from, first, last);
+	const time_t wend = to == 0 ? last : window_time(to, first, last);
+	scan_zone_log(p, end, true, wstart, wend, &first, &last, &nsamples);
+	munmap((void *)base, (size_t)st.st_size);
+
+	unsigned int *order = malloc(zone_slots_cnt * sizeof *order);
+	unsigned int nzones = 0;
+	if (!order) {
+		fprintf(stderr, "%s: malloc failed to allocate memory\n", program);
+		exit(1);
+	}
+	for (unsigned int i = 0; i < zone_slots_cnt; i++) {
+		if (zone_growth[i].zg_started) {
+			order[nzones++] = i;
+		}
+	}
+	qsort_r(order, nzones, sizeof *order, zone_growth, SortGrowth);
+
+	char tstart[32], tend[32];
+	struct tm tm;
+	strftime(tstart, sizeof tstart, "%F %T", localtime_r(&wstart, &tm));
+	strftime(tend, sizeof tend, "%F %T", localtime_r(&wend, &tm));
+	if (PrintHeader) {
+		printf("%u samples from %s to %s\n\n", nsamples, tstart, tend);
+		printf("%-*s %12s %12s %12s %12s %12s\n", ZONE_NAME_MAX_LEN / 2, "zone name",
+		    "start size", "end size", "growth", "growth/hour", "elts growth");
+		for (int i = 0; i < ZONE_NAME_MAX_LEN / 2 + 5 * 13 + 13; i++) {
+			printf("-");
+		}
+		printf("\n");
+	}
+	for (unsigned int n = 0; n < nzones && (count == 0 || n < count); n++) {
+		const struct zone_growth *zg = &zone_growth[order[n]];
+		const int64_t growth = zg->zg_end_size - zg->zg_start_size;
+		const time_t elapsed = zg->zg_end_t - zg->zg_start_t;
+		printf("%-*.*s %11lldK %11lldK %11lldK %11lldK %12lld\n",
+		    ZONE_NAME_MAX_LEN / 2, ZONE_NAME_MAX_LEN / 2, zone_slots[order[n]].zs_name.mzn_name,
+		    zg->zg_start_size / 1024, zg->zg_end_size / 1024, growth / 1024,
+		    elapsed > 0 ? growth * 3600 / elapsed / 1024 : 0,
+		    zg->zg_end_count - zg->zg_start_count);
+	}
+	free(order);
+	return 0;
+}
+
+/*********************************************************************
+*********************************************************************/
+
 static char *
 kern_vm_tag_name(uint64_t tag)
 {
@@ -989,16 +1769,60 @@ MakeLoadTagKeys(const void * key, const void * value, void * context)
 }
 
 static CSSymbolicatorRef         gSym;
+static bool                      gSymCreated;
 static CFMutableDictionaryRef    gTagDict;
 static mach_memory_info_t *  gSites;
+static unsigned int          gSitesCnt;
+static char **               gSiteNames[2];  /* [1]: qualified with the zone name */
+static CFStringRef *         gSiteNameStrs;
+
+/*
+ * The symbolicator and the load tag table are only built the first time a
+ * site in the kernel or in a kext is named, and only the bundle identifier
+ * and load tag are copied out of the loaded kext info.
+ */
+static CSSymbolicatorRef
+KernelSymbolicator(void)
+{
+	if (!gSymCreated) {
+		gSym = CSSymbolicatorCreateWithMachKernel();
+		gSymCreated = true;
+	}
+	return gSym;
+}
+
+static CFDictionaryRef
+LoadTagDict(void)
+{
+	CFDictionaryRef allKexts;
+	CFArrayRef      infoKeys;
+	const void    * keys[] = { kCFBundleIdentifierKey, CFSTR(kOSBundleLoadTagKey) };
+
+	if (gTagDict) {
+		return gTagDict;
+	}
+	gTagDict = CFDictionaryCreateMutable(
+		kCFAllocatorDefault, (CFIndex) 0,
+		(CFDictionaryKeyCallBacks *) 0,
+		&kCFTypeDictionaryValueCallBacks);
+
+	infoKeys = CFArrayCreate(kCFAllocatorDefault, keys,
+	    sizeof(keys) / sizeof(keys[0]), &kCFTypeArrayCallBacks);
+	allKexts = OSKextCopyLoadedKextInfo(NULL, infoKeys);
+	CFRelease(infoKeys);
+	if (allKexts) {
+		CFDictionaryApplyFunction(allKexts, &MakeLoadTagKeys, gTagDict);
+		CFRelease(allKexts);
+	}
+	return gTagDict;
+}
 
 static char *
-GetSiteName(int siteIdx, mach_zone_name_t * zoneNames, unsigned int zoneNamesCnt)
+GetSiteBaseName(int siteIdx, uintptr_t * kmodidp)
 {
 	const char      * name;
 	uintptr_t         kmodid;
 	char            * result;
-	char            * append;
 	mach_vm_address_t addr;
 	CFDictionaryRef   kextInfo;
 	CFStringRef       bundleID;
@@ -1006,6 +1830,7 @@ GetSiteName(int siteIdx, mach_zone_name_t * zoneNames, unsigned int zoneNamesCnt
 
 	const mach_memory_info_t * site;
 	const char                   * fileName;
+	CSSymbolicatorRef              sym;
 	CSSymbolRef                    symbol;
 	const char                   * symbolName;
 	CSSourceInfoRef                sourceInfo;
@@ -1032,7 +1857,7 @@ GetSiteName(int siteIdx, mach_zone_name_t * zoneNames, unsigned int zoneNamesCnt
 		case VM_KERN_SITE_KMOD:
 
 			kmodid = (uintptr_t) addr;
-			kextInfo = CFDictionaryGetValue(gTagDict, (const void *)kmodid);
+			kextInfo = CFDictionaryGetValue(LoadTagDict(), (const void *)kmodid);
 			if (kextInfo) {
 				bundleID = (CFStringRef)CFDictionaryGetValue(kextInfo, kCFBundleIdentifierKey);
 				name = CFStringGetCStringPtr(bundleID, kCFStringEncodingUTF8);
@@ -1049,15 +1874,18 @@ GetSiteName(int siteIdx, mach_zone_name_t * zoneNames, unsigned int zoneNamesCnt
 		case VM_KERN_SITE_KERNEL:
 			symbolName = NULL;
 			if (addr) {
-				symbol = CSSymbolicatorGetSymbolWithAddressAtTime(gSym, addr, kCSNow);
+				sym = KernelSymbolicator();
+				symbol = CSSymbolicatorGetSymbolWithAddressAtTime(sym, addr, kCSNow);
 				symbolName = CSSymbolGetName(symbol);
 			}
 			if (symbolName) {
-				asprintf(&result, "%s", symbolName);
-				sourceInfo = CSSymbolicatorGetSourceInfoWithAddressAtTime(gSym, addr, kCSNow);
+				sourceInfo = CSSymbolicatorGetSourceInfoWithAddressAtTime(sym, addr, kCSNow);
 				fileName = CSSourceInfoGetPath(sourceInfo);
 				if (fileName) {
-					printf(" (%s:%d)", fileName, CSSourceInfoGetLineNumber(sourceInfo));
+					asprintf(&result, "%s (%s:%d)", symbolName, fileName,
+					    CSSourceInfoGetLineNumber(sourceInfo));
+				} else {
+					asprintf(&result, "%s", symbolName);
 				}
 			} else {
 				asprintf(&result, "site 0x%qx", addr);
@@ -1069,6 +1897,21 @@ GetSiteName(int siteIdx, mach_zone_name_t * zoneNames, unsigned int zoneNamesCnt
 		}
 	}
 
+	*kmodidp = kmodid;
+	return result;
+}
+
+static char *
+GetSiteName(int siteIdx, mach_zone_name_t * zoneNames, unsigned int zoneNamesCnt)
+{
+	const mach_memory_info_t * site;
+	uintptr_t         kmodid;
+	char            * result;
+	char            * append;
+
+	site = &gSites[siteIdx];
+	result = GetSiteBaseName(siteIdx, &kmodid);
+
 	if (result
 	    && (VM_KERN_SITE_ZONE & site->flags)
 	    && zoneNames
@@ -1096,6 +1939,53 @@ GetSiteName(int siteIdx, mach_zone_name_t * zoneNames, unsigned int zoneNamesCnt
 	return result;
 }
 
+/*
+ * Site names are only built for the rows that are sorted by name, filtered
+ * or printed, and then kept until PrintLarge() returns.
+ */
+static const char *
+SiteName(int siteIdx, mach_zone_name_t * zoneNames, unsigned int zoneNamesCnt)
+{
+	char ** names = gSiteNames[zoneNames != NULL];
+
+	if (!names[siteIdx]) {
+		names[siteIdx] = GetSiteName(siteIdx, zoneNames, zoneNamesCnt);
+		if (!names[siteIdx]) {
+			names[siteIdx] = strdup("");
+		}
+	}
+	return names[siteIdx];
+}
+
+static CFStringRef
+SiteNameString(int siteIdx, mach_zone_name_t * zoneNames, unsigned int zoneNamesCnt)
+{
+	if (!gSiteNameStrs[siteIdx]) {
+		gSiteNameStrs[siteIdx] = CFStringCreateWithCString(kCFAllocatorDefault,
+		    SiteName(siteIdx, zoneNames, zoneNamesCnt), kCFStringEncodingUTF8);
+	}
+	return gSiteNameStrs[siteIdx];
+}
+
+static void
+FreeSiteNames(void)
+{
+	unsigned int idx;
+
+	for (idx = 0; idx < gSitesCnt; idx++) {
+		free(gSiteNames[0][idx]);
+		free(gSiteNames[1][idx]);
+		if (gSiteNameStrs[idx]) {
+			CFRelease(gSiteNameStrs[idx]);
+		}
+	}
+	free(gSiteNames[0]);
+	free(gSiteNames[1]);
+	free(gSiteNameStrs);
+	gSiteNames[0] = gSiteNames[1] = NULL;
+	gSiteNameStrs = NULL;
+}
+
 struct CompareThunk {
 	mach_zone_name_t *zoneNames;
 	unsigned int      zoneNamesCnt;
@@ -1107,28 +1997,15 @@ SortName(void * thunk, const void * left, const void * right)
 	const struct CompareThunk * t = (typeof(t))thunk;
 	const int * idxL;
 	const int * idxR;
-	char * l;
-	char * r;
 	CFStringRef lcf;
 	CFStringRef rcf;
-	int result;
 
 	idxL = (typeof(idxL))left;
 	idxR = (typeof(idxR))right;
-	l = GetSiteName(*idxL, t->zoneNames, t->zoneNamesCnt);
-	r = GetSiteName(*idxR, t->zoneNames, t->zoneNamesCnt);
-
-	lcf = CFStringCreateWithCString(kCFAllocatorDefault, l, kCFStringEncodingUTF8);
-	rcf = CFStringCreateWithCString(kCFAllocatorDefault, r, kCFStringEncodingUTF8);
-
-	result = (int) CFStringCompareWithOptionsAndLocale(lcf, rcf, CFRangeMake(0, CFStringGetLength(lcf)), kCFCompareNumerically, NULL);
+	lcf = SiteNameString(*idxL, t->zoneNames, t->zoneNamesCnt);
+	rcf = SiteNameString(*idxR, t->zoneNames, t->zoneNamesCnt);
 
-	CFRelease(lcf);
-	CFRelease(rcf);
-	free(l);
-	free(r);
-
-	return result;
+	return (int) CFStringCompareWithOptionsAndLocale(lcf, rcf, CFRangeMake(0, CFStringGetLength(lcf)), kCFCompareNumerically, NULL);
 }
 
 static int
@@ -1164,27 +2041,23 @@ PrintLarge(mach_memory_info_t *wiredInfo, unsigned int wiredInfoCnt,
 	uint64_t size;
 	uint64_t elemsTagged;
 
-	CFDictionaryRef allKexts;
-	unsigned int idx, site, first;
+	unsigned int idx, site, first, shown;
 	int sorted[wiredInfoCnt];
 	char totalstr[40];
-	char * name;
-	bool   headerPrinted;
+	const char * name;
+	bool   headerPrinted, limited;
 
 	zonetotal = totalsize;
 
 	gSites = wiredInfo;
-
-	gSym = CSSymbolicatorCreateWithMachKernel();
-
-	allKexts = OSKextCopyLoadedKextInfo(NULL, NULL);
-	gTagDict = CFDictionaryCreateMutable(
-		kCFAllocatorDefault, (CFIndex) 0,
-		(CFDictionaryKeyCallBacks *) 0,
-		&kCFTypeDictionaryValueCallBacks);
-
-	CFDictionaryApplyFunction(allKexts, &MakeLoadTagKeys, gTagDict);
-	CFRelease(allKexts);
+	gSitesCnt = wiredInfoCnt;
+	gSiteNames[0] = calloc(wiredInfoCnt, sizeof(char *));
+	gSiteNames[1] = calloc(wiredInfoCnt, sizeof(char *));
+	gSiteNameStrs = calloc(wiredInfoCnt, sizeof(CFStringRef));
+	if (!gSiteNames[0] || !gSiteNames[1] || !gSiteNameStrs) {
+		fprintf(stderr, "%s: out of memory\n", program);
+		exit(1);
+	}
 
 	top_wired = 0;
 
@@ -1202,7 +2075,7 @@ PrintLarge(mach_memory_info_t *wiredInfo, unsigned int wiredInfoCnt,
 	    func);
 
 	elemsTagged = 0;
-	for (headerPrinted = false, idx = 0; idx < wiredInfoCnt; idx++) {
+	for (shown = 0, headerPrinted = false, idx = 0; idx < wiredInfoCnt; idx++) {
 		site = sorted[idx];
 		if ((VM_KERN_SITE_COUNTER & gSites[site].flags)
 		    && (VM_KERN_COUNT_WIRED == gSites[site].site)) {
@@ -1224,10 +2097,21 @@ PrintLarge(mach_memory_info_t *wiredInfo, unsigned int wiredInfoCnt,
 			continue;
 		}
 
-		name = GetSiteName(site, zoneNames, zoneCnt);
-		if (!substr(zname, znamelen, name, strlen(name))) {
+		/* past the -n limit, names are only needed to filter the total */
+		limited = LargeCount && shown >= LargeCount;
+		if (!limited || znamelen) {
+			name = SiteName(site, zoneNames, zoneCnt);
+			if (!substr(zname, znamelen, name, strlen(name))) {
+				continue;
+			}
+		}
+		if (!(VM_KERN_SITE_ZONE & gSites[site].flags)) {
+			totalsize += gSites[site].size;
+		}
+		if (limited) {
 			continue;
 		}
+		shown++;
 		if (!headerPrinted) {
 			printf("-------------------------------------------------------------------------------------------------------------\n");
 			printf("                                                               kmod          vm        peak               cur\n");
@@ -1236,7 +2120,6 @@ PrintLarge(mach_memory_info_t *wiredInfo, unsigned int wiredInfoCnt,
 			headerPrinted = true;
 		}
 		printf("%-67s", name);
-		free(name);
 		printf("%12d", gSites[site].tag);
 
 		if (gSites[site].peak) {
@@ -1253,10 +2136,6 @@ PrintLarge(mach_memory_info_t *wiredInfo, unsigned int wiredInfoCnt,
 
 		PRINTK(" %9llu", gSites[site].size);
 
-		if (!(VM_KERN_SITE_ZONE & gSites[site].flags)) {
-			totalsize += gSites[site].size;
-		}
-
 		printf("\n");
 	}
 
@@ -1276,7 +2155,7 @@ PrintLarge(mach_memory_info_t *wiredInfo, unsigned int wiredInfoCnt,
 		snprintf(totalstr, sizeof(totalstr), "%6.2fM of %6.2fM", totalsize / 1024.0 / 1024.0, top_wired / 1024.0 / 1024.0);
 		printf("total%104s\n", totalstr);
 	}
-	for (headerPrinted = false, idx = 0; idx < wiredInfoCnt; idx++) {
+	for (shown = 0, headerPrinted = false, idx = 0; idx < wiredInfoCnt; idx++) {
 		site = sorted[idx];
 		size = gSites[site].mapped;
 		if (!size) {
@@ -1290,10 +2169,14 @@ PrintLarge(mach_memory_info_t *wiredInfo, unsigned int wiredInfoCnt,
 			continue;
 		}
 
-		name = GetSiteName(site, NULL, 0);
+		if (LargeCount && shown >= LargeCount) {
+			break;
+		}
+		name = SiteName(site, NULL, 0);
 		if (!substr(zname, znamelen, name, strlen(name))) {
 			continue;
 		}
+		shown++;
 		if (!headerPrinted) {
 			printf("-------------------------------------------------------------------------------------------------------------\n");
 			printf("                                                                        largest        peak               cur\n");
@@ -1302,7 +2185,6 @@ PrintLarge(mach_memory_info_t *wiredInfo, unsigned int wiredInfoCnt,
 			headerPrinted = true;
 		}
 		printf("%-55s", name);
-		free(name);
 
 		if (gSites[site].free) {
 			PRINTK(" %10llu", gSites[site].free);
@@ -1323,17 +2205,21 @@ PrintLarge(mach_memory_info_t *wiredInfo, unsigned int wiredInfoCnt,
 
 		printf("\n");
 	}
-	for (headerPrinted = false, idx = 0; idx < wiredInfoCnt; idx++) {
+	for (shown = 0, headerPrinted = false, idx = 0; idx < wiredInfoCnt; idx++) {
 		site = sorted[idx];
 		size = gSites[site].size;
 		if (!size || !(VM_KERN_SITE_ZONE_VIEW & gSites[site].flags)) {
 			continue;
 		}
 
-		name = GetSiteName(site, NULL, 0);
+		if (LargeCount && shown >= LargeCount) {
+			break;
+		}
+		name = SiteName(site, NULL, 0);
 		if (!substr(zname, znamelen, name, strlen(name))) {
 			continue;
 		}
+		shown++;
 		if (!headerPrinted) {
 			printf("-------------------------------------------------------------------------------------------------------------\n");
 			printf("                                                                                                          cur\n");
@@ -1342,7 +2228,6 @@ PrintLarge(mach_memory_info_t *wiredInfo, unsigned int wiredInfoCnt,
 			headerPrinted = true;
 		}
 		printf("%-55s", name);
-		free(name);
 
 		printf(" %11s", "");
 		printf(" %11s", "");
@@ -1351,5 +2236,59 @@ PrintLarge(mach_memory_info_t *wiredInfo, unsigned int wiredInfoCnt,
 
 		printf("\n");
 	}
+	FreeSiteNames();
 	totalsize = zonetotal;
 }
+
+static void
+PrintLargeJSON(mach_memory_info_t *wiredInfo, unsigned int wiredInfoCnt,
+    mach_zone_name_t *zoneNames, unsigned int zoneCnt)
+{
+	const mach_memory_info_t * si;
+	uintptr_t    kmodid;
+	char       * name;
+	unsigned int site;
+	bool         first = true;
+
+	gSites = wiredInfo;
+	gSitesCnt = wiredInfoCnt;
+
+	printf(",\"wired\":[");
+	for (site = 0; site < wiredInfoCnt; site++) {
+		si = &gSites[site];
+		if (VM_KERN_SITE_HIDE & si->flags) {
+			continue;
+		}
+		if (!si->size && !si->mapped && !si->peak) {
+			continue;
+		}
+		name = GetSiteBaseName(site, &kmodid);
+		if (!name) {
+			continue;
+		}
+		if (!substr(zname, znamelen, name, strlen(name))) {
+			free(name);
+			continue;
+		}
+		printf("%s{\"name\":", first ? "" : ",");
+		json_string(name, strlen(name));
+		free(name);
+		printf(",\"tag\":%d", si->tag);
+		if (kmodid) {
+			printf(",\"kmod\":%lu", (unsigned long)kmodid);
+		}
+		if ((VM_KERN_SITE_ZONE & si->flags) && si->zone < zoneCnt) {
+			printf(",\"zone\":");
+			json_string(zoneNames[si->zone].mzn_name,
+			    sizeof zoneNames[si->zone].mzn_name);
+		}
+		printf(",\"wired\":%s,\"size\":%llu,\"peak\":%llu,"
+		    "\"collectable\":%llu,\"mapped\":%llu,\"free\":%llu,"
+		    "\"largest\":%llu}",
+		    (VM_KERN_SITE_WIRED & si->flags) ? "true" : "false",
+		    si->size, si->peak, si->collectable_bytes,
+		    si->mapped, si->free, si->largest);
+		first = false;
+	}
+	printf("]");
+}